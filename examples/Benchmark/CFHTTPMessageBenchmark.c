@@ -0,0 +1,345 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements a microbenchmark of CFHTTPMessage response
+ *     header parsing (CFHTTPMessageAppendBytes) over a corpus of
+ *     real-world response headers, fed either whole or in small
+ *     chunks, as a socket read loop would, and with no, a few, or all
+ *     of the header fields looked up afterward.
+ *
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <AssertMacros.h>
+
+#include <CFNetwork/CFNetwork.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#define __CFHTTPMessageBenchmarkLog(format, ...)   do { fprintf(stderr, format, ##__VA_ARGS__); fflush(stderr); } while (0)
+
+#define kCFHTTPMessageBenchmarkDefaultIterations   20000
+#define kCFHTTPMessageBenchmarkDefaultChunkSize    64
+
+// Corpus
+//
+// Response headers as captured from a handful of popular origin
+// servers and CDNs, each followed by the start of its body.
+
+static const char * const sCorpus[] = {
+    // nginx, static asset
+
+    "HTTP/1.1 200 OK\r\n"
+    "Server: nginx/1.18.0 (Ubuntu)\r\n"
+    "Date: Fri, 16 Oct 2026 08:12:44 GMT\r\n"
+    "Content-Type: text/css\r\n"
+    "Content-Length: 18263\r\n"
+    "Last-Modified: Tue, 06 Oct 2026 17:40:02 GMT\r\n"
+    "Connection: keep-alive\r\n"
+    "ETag: \"5f7cac72-4757\"\r\n"
+    "Expires: Sat, 16 Oct 2027 08:12:44 GMT\r\n"
+    "Cache-Control: max-age=31536000\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "\r\n"
+    "body{margin:0}",
+
+    // Apache, dynamic page
+
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Fri, 16 Oct 2026 08:12:45 GMT\r\n"
+    "Server: Apache/2.4.41 (Ubuntu)\r\n"
+    "X-Powered-By: PHP/7.4.3\r\n"
+    "Expires: Thu, 19 Nov 1981 08:52:00 GMT\r\n"
+    "Cache-Control: no-store, no-cache, must-revalidate\r\n"
+    "Pragma: no-cache\r\n"
+    "Set-Cookie: PHPSESSID=0f6b1c1f6c0a4bb0b6f0e0a3c1d2e3f4; path=/; HttpOnly\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "Content-Encoding: gzip\r\n"
+    "Content-Length: 5120\r\n"
+    "Keep-Alive: timeout=5, max=100\r\n"
+    "Connection: Keep-Alive\r\n"
+    "Content-Type: text/html; charset=UTF-8\r\n"
+    "\r\n"
+    "\x1f\x8b\x08",
+
+    // Google front end, chunked
+
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Fri, 16 Oct 2026 08:12:45 GMT\r\n"
+    "Expires: -1\r\n"
+    "Cache-Control: private, max-age=0\r\n"
+    "Content-Type: text/html; charset=ISO-8859-1\r\n"
+    "Content-Security-Policy-Report-Only: object-src 'none';base-uri 'self';script-src 'nonce-3y1cIw4gyKyKt7CfwGnYqA' 'strict-dynamic' 'report-sample' 'unsafe-eval' 'unsafe-inline' https: http:;report-uri https://csp.withgoogle.com/csp/gws/other-hp\r\n"
+    "P3P: CP=\"This is not a P3P policy! See g.co/p3phelp for more info.\"\r\n"
+    "Server: gws\r\n"
+    "X-XSS-Protection: 0\r\n"
+    "X-Frame-Options: SAMEORIGIN\r\n"
+    "Set-Cookie: 1P_JAR=2026-10-16-08; expires=Sun, 15-Nov-2026 08:12:45 GMT; path=/; domain=.google.com; Secure\r\n"
+    "Set-Cookie: AEC=AakniGN2CbTOHhnGzYuHXh3qqVPqH8gzPMqH6H8ePqlCHZ0qJqk0XQ3uTg; expires=Wed, 14-Apr-2027 08:12:45 GMT; path=/; domain=.google.com; Secure; HttpOnly; SameSite=lax\r\n"
+    "Alt-Svc: h3=\":443\"; ma=2592000,h3-29=\":443\"; ma=2592000\r\n"
+    "Accept-Ranges: none\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "\r\n"
+    "5a1f\r\n",
+
+    // Cloudflare, API response
+
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Fri, 16 Oct 2026 08:12:46 GMT\r\n"
+    "Content-Type: application/json; charset=utf-8\r\n"
+    "Content-Length: 482\r\n"
+    "Connection: keep-alive\r\n"
+    "CF-Ray: 8d3c5e1a9f0b2c4d-SJC\r\n"
+    "CF-Cache-Status: DYNAMIC\r\n"
+    "Access-Control-Allow-Origin: *\r\n"
+    "Strict-Transport-Security: max-age=31536000; includeSubDomains; preload\r\n"
+    "Vary: Accept-Encoding, Origin\r\n"
+    "X-Content-Type-Options: nosniff\r\n"
+    "X-Request-Id: 7c2f0e5e-3f3a-4c5b-9d41-2f6b7e8a9c10\r\n"
+    "Report-To: {\"endpoints\":[{\"url\":\"https:\\/\\/a.nel.cloudflare.com\\/report\\/v4?s=abc\"}],\"group\":\"cf-nel\",\"max_age\":604800}\r\n"
+    "NEL: {\"success_fraction\":0,\"report_to\":\"cf-nel\",\"max_age\":604800}\r\n"
+    "Server: cloudflare\r\n"
+    "\r\n"
+    "{\"ok\":true}",
+
+    // Amazon S3 behind CloudFront
+
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: image/png\r\n"
+    "Content-Length: 48213\r\n"
+    "Connection: keep-alive\r\n"
+    "Date: Fri, 16 Oct 2026 08:12:46 GMT\r\n"
+    "Last-Modified: Mon, 12 Oct 2026 21:03:17 GMT\r\n"
+    "ETag: \"a8b8e5d6c0f2a3b4c5d6e7f8a9b0c1d2\"\r\n"
+    "x-amz-server-side-encryption: AES256\r\n"
+    "x-amz-version-id: 3HL4kqtJlcpXroDTDmJ.rmSpXd3dIbrHY\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "Server: AmazonS3\r\n"
+    "X-Cache: Hit from cloudfront\r\n"
+    "Via: 1.1 1f3c5e7a9b0d2f4a6c8e0b2d4f6a8c0e.cloudfront.net (CloudFront)\r\n"
+    "X-Amz-Cf-Pop: SFO53-C1\r\n"
+    "X-Amz-Cf-Id: Qy2sBv8mY3kZ1XcJpW4nR6tL0aE9uH7dF5gK3oM1iN8bV2cX6zA4==\r\n"
+    "Age: 2841\r\n"
+    "\r\n"
+    "\x89PNG",
+
+    // GitHub, redirect
+
+    "HTTP/1.1 301 Moved Permanently\r\n"
+    "Content-Length: 0\r\n"
+    "Location: https://github.com/\r\n"
+    "\r\n",
+
+    // Conditional GET, not modified
+
+    "HTTP/1.1 304 Not Modified\r\n"
+    "Date: Fri, 16 Oct 2026 08:12:47 GMT\r\n"
+    "Connection: keep-alive\r\n"
+    "ETag: W/\"2a-1eN1qXq3Y0q8q8s7r1X6w2s9ZbM\"\r\n"
+    "Cache-Control: public, max-age=0\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "\r\n",
+
+    // Microsoft IIS, with a folded header line
+
+    "HTTP/1.1 200 OK\r\n"
+    "Cache-Control: private\r\n"
+    "Content-Type: text/html; charset=utf-8\r\n"
+    "Server: Microsoft-IIS/10.0\r\n"
+    "X-AspNet-Version: 4.0.30319\r\n"
+    "X-Powered-By: ASP.NET\r\n"
+    "Set-Cookie: ASP.NET_SessionId=xq3lz5f1yq0k2mb2o4c5a1vn; path=/; HttpOnly;\r\n"
+    "\tSameSite=Lax\r\n"
+    "Date: Fri, 16 Oct 2026 08:12:47 GMT\r\n"
+    "Content-Length: 10918\r\n"
+    "\r\n"
+    "<!DOCTYPE html>"
+};
+
+#define kCFHTTPMessageBenchmarkCorpusCount  (sizeof(sCorpus) / sizeof(sCorpus[0]))
+
+enum {
+    kLookupNone = 0,
+    kLookupSome = 1,
+    kLookupAll  = 2
+};
+
+// Benchmark
+
+static int
+ParseOne(const UInt8 *aBytes, size_t aLength, size_t aChunkSize, int aLookup)
+{
+    CFHTTPMessageRef message;
+    size_t           offset = 0;
+    Boolean          result = TRUE;
+    int              status = -1;
+
+    message = CFHTTPMessageCreateEmpty(kCFAllocatorDefault, FALSE);
+    __Require(message != NULL, done);
+
+    while (result && (offset < aLength) && !CFHTTPMessageIsHeaderComplete(message)) {
+        size_t length = aLength - offset;
+
+        if ((aChunkSize > 0) && (length > aChunkSize)) {
+            length = aChunkSize;
+        }
+
+        result = CFHTTPMessageAppendBytes(message, aBytes + offset, (CFIndex)length);
+        offset += length;
+    }
+
+    __Require(result && CFHTTPMessageIsHeaderComplete(message), done);
+
+    if (aLookup == kLookupSome) {
+        // The fields a client typically asks for once a response is in.
+
+        const CFStringRef lookups[] = {
+            CFSTR("Content-Length"),
+            CFSTR("Content-Type"),
+            CFSTR("Connection")
+        };
+        size_t i;
+
+        for (i = 0; i < (sizeof(lookups) / sizeof(lookups[0])); i++) {
+            CFStringRef value = CFHTTPMessageCopyHeaderFieldValue(message, lookups[i]);
+
+            if (value != NULL) {
+                CFRelease(value);
+            }
+        }
+
+    } else if (aLookup == kLookupAll) {
+        CFDictionaryRef headers = CFHTTPMessageCopyAllHeaderFields(message);
+
+        __Require(headers != NULL, done);
+
+        CFRelease(headers);
+    }
+
+    status = 0;
+
+ done:
+    if (message != NULL) {
+        CFRelease(message);
+    }
+
+    return (status);
+}
+
+static int
+RunBenchmark(const char *aDescription, unsigned int aIterations, size_t aChunkSize, int aLookup)
+{
+    unsigned long    total    = 0;
+    unsigned long    messages = 0;
+    unsigned int     i;
+    size_t           j;
+    CFAbsoluteTime   start;
+    CFTimeInterval   elapsed;
+    int              status   = 0;
+
+    start = CFAbsoluteTimeGetCurrent();
+
+    for (i = 0; i < aIterations; i++) {
+        for (j = 0; j < kCFHTTPMessageBenchmarkCorpusCount; j++) {
+            size_t length = strlen(sCorpus[j]);
+
+            status = ParseOne((const UInt8 *)sCorpus[j], length, aChunkSize, aLookup);
+            __Require(status == 0, done);
+
+            total += length;
+            messages++;
+        }
+    }
+
+    elapsed = CFAbsoluteTimeGetCurrent() - start;
+
+    __CFHTTPMessageBenchmarkLog("%-8s chunk %-6zu %lu messages, %lu bytes: %.3f s, %.0f messages/sec, %.1f MB/s\n",
+                                aDescription,
+                                aChunkSize,
+                                messages,
+                                total,
+                                elapsed,
+                                (elapsed > 0) ? (messages / elapsed) : 0.0,
+                                (elapsed > 0) ? ((total / elapsed) / (1024.0 * 1024.0)) : 0.0);
+
+ done:
+    return (status);
+}
+
+static void
+Usage(const char *aProgram)
+{
+    __CFHTTPMessageBenchmarkLog("Usage: %s [ -n <iterations> ] [ -c <chunk size> ]\n", aProgram);
+}
+
+int
+main(int argc, char * const argv[])
+{
+    unsigned int iterations = kCFHTTPMessageBenchmarkDefaultIterations;
+    size_t       chunkSize  = kCFHTTPMessageBenchmarkDefaultChunkSize;
+    int          c;
+    int          status     = -1;
+
+    while ((c = getopt(argc, argv, "c:n:")) != -1) {
+        switch (c) {
+
+        case 'c':
+            chunkSize = (size_t)strtoul(optarg, NULL, 0);
+            break;
+
+        case 'n':
+            iterations = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+
+        default:
+            Usage(argv[0]);
+            goto done;
+
+        }
+    }
+
+    __Require_Action((iterations > 0) && (chunkSize > 0), done, Usage(argv[0]));
+
+    // A chunk size of zero hands each message over in one piece.
+
+    status = RunBenchmark("parse", iterations, 0, kLookupNone);
+    __Require(status == 0, done);
+
+    status = RunBenchmark("parse", iterations, chunkSize, kLookupNone);
+    __Require(status == 0, done);
+
+    status = RunBenchmark("lookup", iterations, 0, kLookupSome);
+    __Require(status == 0, done);
+
+    status = RunBenchmark("all", iterations, 0, kLookupAll);
+    __Require(status == 0, done);
+
+ done:
+    return ((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
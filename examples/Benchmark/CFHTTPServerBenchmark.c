@@ -0,0 +1,439 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements a load-generating benchmark of the embedded
+ *     HTTP server (_CFHTTPServer), reporting requests per second and
+ *     median and 99th percentile latency for keep-alive GET requests
+ *     from concurrent clients as the number of server worker threads
+ *     grows.
+ *
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <AssertMacros.h>
+
+#include <CFNetwork/CFNetwork.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#define __CFHTTPServerBenchmarkLog(format, ...)   do { fprintf(stderr, format, ##__VA_ARGS__); fflush(stderr); } while (0)
+
+#define kCFHTTPServerBenchmarkDefaultClients      32
+#define kCFHTTPServerBenchmarkDefaultRequests     1000
+#define kCFHTTPServerBenchmarkDefaultWorkers      8
+#define kCFHTTPServerBenchmarkBufferSize          4096
+
+// SPI from CFHTTPServerPriv.h, which is not installed.
+
+typedef struct __CFHTTPServer* _CFHTTPServerRef;
+
+typedef struct {
+    CFIndex                             version;
+    void *                              info;
+    CFAllocatorRetainCallBack           retain;
+    CFAllocatorReleaseCallBack          release;
+    CFAllocatorCopyDescriptionCallBack  copyDescription;
+} _CFHTTPServerContext;
+
+typedef struct {
+    CFIndex  version;
+    Boolean  (*acceptNewConnectionCallBack)(_CFHTTPServerRef server, CFDataRef peer, void *info);
+    Boolean  (*acceptNewRequestCallBack)(_CFHTTPServerRef server, CFHTTPMessageRef headers, CFDataRef peer, void *info);
+    void     (*didReceiveRequestCallBack)(_CFHTTPServerRef server, CFHTTPMessageRef request, void *info);
+    void     (*didSendResponseCallBack)(_CFHTTPServerRef server, CFHTTPMessageRef request, CFHTTPMessageRef response, void *info);
+    void     (*errorCallBack)(_CFHTTPServerRef server, const CFStreamError *error, CFHTTPMessageRef request, CFHTTPMessageRef response, void *info);
+} _CFHTTPServerCallBacks;
+
+extern _CFHTTPServerRef _CFHTTPServerCreate(CFAllocatorRef alloc, const _CFHTTPServerCallBacks *callbacks, _CFHTTPServerContext *context);
+extern Boolean _CFHTTPServerSetWorkerCount(_CFHTTPServerRef server, CFIndex count);
+extern Boolean _CFHTTPServerStart(_CFHTTPServerRef server, CFStringRef name, CFStringRef serviceType, UInt32 port);
+extern void _CFHTTPServerInvalidate(_CFHTTPServerRef server);
+extern UInt32 _CFHTTPServerGetPort(_CFHTTPServerRef server);
+extern void _CFHTTPServerAddResponse(_CFHTTPServerRef server, CFHTTPMessageRef request, CFHTTPMessageRef response);
+
+// Type Declarations
+
+typedef struct {
+    pthread_mutex_t  mLock;
+    unsigned int     mFinished;
+    unsigned int     mFailed;
+} _CFHTTPServerBenchmarkContext;
+
+typedef struct {
+    _CFHTTPServerBenchmarkContext *mContext;
+    pthread_t                      mThread;
+    UInt16                         mPort;
+    unsigned int                   mRequests;
+    unsigned int                   mCompleted;
+    double                        *mLatencies;
+} _CFHTTPServerBenchmarkClient;
+
+static const char sRequest[] = "GET /health HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+// Server
+
+static void
+DidReceiveRequest(_CFHTTPServerRef aServer, CFHTTPMessageRef aRequest, void *aInfo)
+{
+    static const UInt8 kBody[] = "OK\n";
+    CFHTTPMessageRef   response;
+    CFDataRef          body;
+
+    response = CFHTTPMessageCreateResponse(kCFAllocatorDefault, 200, NULL, kCFHTTPVersion1_1);
+    __Require(response != NULL, done);
+
+    body = CFDataCreate(kCFAllocatorDefault, kBody, sizeof(kBody) - 1);
+    __Require_Action(body != NULL, done, CFRelease(response));
+
+    CFHTTPMessageSetBody(response, body);
+    CFRelease(body);
+
+    _CFHTTPServerAddResponse(aServer, aRequest, response);
+    CFRelease(response);
+
+ done:
+    return;
+}
+
+// Client
+
+static double
+Now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec + (now.tv_nsec / 1e9));
+}
+
+/**
+ *  Read one complete response, headers and Content-Length body, off
+ *  the connection.
+ *
+ */
+static int
+ReadResponse(int aSocket, char *aBuffer, size_t aSize)
+{
+    size_t  length   = 0;
+    size_t  expected = 0;
+    char   *headers  = NULL;
+    int     status   = -1;
+
+    while ((headers == NULL) || (length < expected)) {
+        ssize_t bytes = read(aSocket, aBuffer + length, aSize - length - 1);
+
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            goto done;
+        }
+
+        __Require(bytes > 0, done);
+
+        length += (size_t)bytes;
+        aBuffer[length] = '\0';
+
+        if (headers == NULL) {
+            headers = strstr(aBuffer, "\r\n\r\n");
+
+            if (headers != NULL) {
+                const char *field = strstr(aBuffer, "\r\n");
+
+                // Find the Content-Length field among the headers.
+
+                while ((field != NULL) && (field < headers) && (strncasecmp(field + 2, "Content-Length:", 15) != 0)) {
+                    field = strstr(field + 2, "\r\n");
+                }
+
+                __Require((field != NULL) && (field < headers), done);
+
+                expected = (size_t)(headers - aBuffer) + 4 + strtoul(field + 17, NULL, 10);
+                __Require(expected < aSize, done);
+            }
+        }
+    }
+
+    // Requests aren't pipelined, so there is never more than one response.
+
+    status = (length == expected) ? 0 : -1;
+
+ done:
+    return (status);
+}
+
+static void *
+ClientMain(void *aContext)
+{
+    _CFHTTPServerBenchmarkClient *client = aContext;
+    struct sockaddr_in            address;
+    char                          buffer[kCFHTTPServerBenchmarkBufferSize];
+    int                           one    = 1;
+    int                           sock;
+    int                           status;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    __Require(sock >= 0, done);
+
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family      = AF_INET;
+    address.sin_port        = htons(client->mPort);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    status = connect(sock, (struct sockaddr *)&address, sizeof(address));
+    __Require(status == 0, close_socket);
+
+    // Issue the requests one at a time on the one keep-alive
+    // connection, timing each from request to complete response.
+
+    while (client->mCompleted < client->mRequests) {
+        double start = Now();
+
+        status = (write(sock, sRequest, sizeof(sRequest) - 1) == (ssize_t)(sizeof(sRequest) - 1)) ? 0 : -1;
+        __Require(status == 0, close_socket);
+
+        status = ReadResponse(sock, buffer, sizeof(buffer));
+        __Require(status == 0, close_socket);
+
+        client->mLatencies[client->mCompleted++] = Now() - start;
+    }
+
+ close_socket:
+    close(sock);
+
+ done:
+    pthread_mutex_lock(&client->mContext->mLock);
+
+    client->mContext->mFinished++;
+
+    if (client->mCompleted < client->mRequests) {
+        client->mContext->mFailed++;
+    }
+
+    pthread_mutex_unlock(&client->mContext->mLock);
+
+    return (NULL);
+}
+
+// Benchmark
+
+static int
+CompareLatencies(const void *aFirst, const void *aSecond)
+{
+    const double first  = *(const double *)aFirst;
+    const double second = *(const double *)aSecond;
+
+    return ((first > second) - (first < second));
+}
+
+static int
+RunBenchmark(CFIndex aWorkers, unsigned int aClients, unsigned int aRequests)
+{
+    _CFHTTPServerCallBacks         callbacks = { 0, NULL, NULL, DidReceiveRequest, NULL, NULL };
+    _CFHTTPServerContext           context   = { 0, NULL, NULL, NULL, NULL };
+    _CFHTTPServerBenchmarkContext  shared;
+    _CFHTTPServerBenchmarkClient  *clients   = NULL;
+    _CFHTTPServerRef               server    = NULL;
+    double                        *latencies = NULL;
+    unsigned int                   started   = 0;
+    unsigned int                   finished  = 0;
+    unsigned int                   completed = 0;
+    unsigned int                   i;
+    double                         start;
+    double                         elapsed   = 0;
+    Boolean                        result;
+    int                            status    = -1;
+
+    memset(&shared, 0, sizeof(shared));
+    pthread_mutex_init(&shared.mLock, NULL);
+
+    clients = calloc(aClients, sizeof(clients[0]));
+    __Require(clients != NULL, done);
+
+    latencies = malloc((size_t)aClients * aRequests * sizeof(latencies[0]));
+    __Require(latencies != NULL, done);
+
+    server = _CFHTTPServerCreate(kCFAllocatorDefault, &callbacks, &context);
+    __Require(server != NULL, done);
+
+    result = _CFHTTPServerSetWorkerCount(server, aWorkers);
+    __Require(result, done);
+
+    result = _CFHTTPServerStart(server, NULL, NULL, 0);
+    __Require(result, done);
+
+    start = Now();
+
+    for (started = 0; started < aClients; started++) {
+        _CFHTTPServerBenchmarkClient *client = &clients[started];
+
+        client->mContext   = &shared;
+        client->mPort      = (UInt16)_CFHTTPServerGetPort(server);
+        client->mRequests  = aRequests;
+        client->mLatencies = &latencies[(size_t)started * aRequests];
+
+        if (pthread_create(&client->mThread, NULL, ClientMain, client) != 0) {
+            break;
+        }
+    }
+
+    // Service the server's listening sockets, and with no workers all
+    // of its connections, until every client has finished.
+
+    while (finished < started) {
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.01, FALSE);
+
+        pthread_mutex_lock(&shared.mLock);
+        finished = shared.mFinished;
+        pthread_mutex_unlock(&shared.mLock);
+    }
+
+    elapsed = Now() - start;
+
+    for (i = 0; i < started; i++) {
+        pthread_join(clients[i].mThread, NULL);
+    }
+
+    __Require(started == aClients, done);
+    __Require(shared.mFailed == 0, done);
+
+    // Gather every client's latencies to find the percentiles.
+
+    for (i = 0; i < aClients; i++) {
+        memmove(&latencies[completed], clients[i].mLatencies, clients[i].mCompleted * sizeof(latencies[0]));
+        completed += clients[i].mCompleted;
+    }
+
+    qsort(latencies, completed, sizeof(latencies[0]), CompareLatencies);
+
+    __CFHTTPServerBenchmarkLog("workers %-3ld %u requests on %u connections: %.3f s, %.0f req/s, p50 %.3f ms, p99 %.3f ms\n",
+                               aWorkers,
+                               completed,
+                               aClients,
+                               elapsed,
+                               (elapsed > 0) ? (completed / elapsed) : 0.0,
+                               latencies[completed / 2] * 1e3,
+                               latencies[(size_t)((completed - 1) * 0.99)] * 1e3);
+
+    status = 0;
+
+ done:
+    if (server != NULL) {
+        _CFHTTPServerInvalidate(server);
+        CFRelease(server);
+    }
+
+    if (latencies != NULL) {
+        free(latencies);
+    }
+
+    if (clients != NULL) {
+        free(clients);
+    }
+
+    pthread_mutex_destroy(&shared.mLock);
+
+    return (status);
+}
+
+static void
+Usage(const char *aProgram)
+{
+    __CFHTTPServerBenchmarkLog("Usage: %s [ -c <clients> ] [ -n <requests per client> ] [ -w <maximum workers> ]\n", aProgram);
+}
+
+int
+main(int argc, char * const argv[])
+{
+    unsigned int clients    = kCFHTTPServerBenchmarkDefaultClients;
+    unsigned int requests   = kCFHTTPServerBenchmarkDefaultRequests;
+    CFIndex      maxWorkers = kCFHTTPServerBenchmarkDefaultWorkers;
+    CFIndex      workers;
+    int          c;
+    int          status     = -1;
+
+    while ((c = getopt(argc, argv, "c:n:w:")) != -1) {
+        switch (c) {
+
+        case 'c':
+            clients = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+
+        case 'n':
+            requests = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+
+        case 'w':
+            maxWorkers = (CFIndex)strtol(optarg, NULL, 0);
+            break;
+
+        default:
+            Usage(argv[0]);
+            goto done;
+
+        }
+    }
+
+    __Require_Action((clients > 0) && (requests > 0) && (maxWorkers >= 0), done, Usage(argv[0]));
+
+    // A client that gave up early must not take the server down with
+    // SIGPIPE.
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // Zero workers is the default mode, where the server's own run
+    // loop services every connection; then double the worker threads
+    // up to the maximum.
+
+    status = RunBenchmark(0, clients, requests);
+    __Require(status == 0, done);
+
+    for (workers = 1; workers <= maxWorkers; workers *= 2) {
+        status = RunBenchmark(workers, clients, requests);
+        __Require(status == 0, done);
+    }
+
+ done:
+    return ((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
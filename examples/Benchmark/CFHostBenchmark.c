@@ -0,0 +1,507 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements a benchmark of concurrent, asynchronous
+ *     (that is, run loop-based) CFHost name-to-address
+ *     (kCFHostAddresses) lookups against a local stub DNS server,
+ *     comparing lookups per second when each lookup creates its own
+ *     resolver channel, when all lookups share one, and when all
+ *     lookups are issued together as a batch over the shared one.
+ *
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <AssertMacros.h>
+
+#include <CFNetwork/CFNetwork.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#define __CFHostBenchmarkLog(format, ...)     do { fprintf(stderr, format, ##__VA_ARGS__); fflush(stderr); } while (0)
+
+#define kCFHostBenchmarkDefaultLookups        2000
+#define kCFHostBenchmarkDefaultConcurrency    256
+#define kCFHostBenchmarkRecordTimeToLive      60
+
+// SPI from CFHostPriv.h, which is not installed.
+
+extern const CFStringRef _kCFHostPropertyCacheCapacity;
+extern const CFStringRef _kCFHostPropertyResolverSharedChannel;
+extern const CFStringRef _kCFHostPropertyResolverServers;
+
+extern Boolean CFHostSetProperty(CFHostRef theHost, CFStringRef propertyName, CFTypeRef propertyValue);
+
+typedef struct __CFHostBatchResolution* CFHostBatchResolutionRef;
+
+typedef void (*CFHostBatchResolutionCallBack)(CFHostBatchResolutionRef theBatch, CFStringRef name, CFArrayRef addresses, const CFStreamError *error, void *info);
+typedef void (*CFHostBatchResolutionCompletionCallBack)(CFHostBatchResolutionRef theBatch, void *info);
+
+extern CFHostBatchResolutionRef CFHostCreateBatchResolution(CFAllocatorRef allocator, CFArrayRef names);
+extern Boolean CFHostBatchResolutionSetClient(CFHostBatchResolutionRef theBatch, CFHostBatchResolutionCallBack clientCB, CFHostBatchResolutionCompletionCallBack completionCB, CFHostClientContext *clientContext);
+extern void CFHostBatchResolutionScheduleWithRunLoop(CFHostBatchResolutionRef theBatch, CFRunLoopRef runLoop, CFStringRef runLoopMode);
+extern void CFHostBatchResolutionUnscheduleFromRunLoop(CFHostBatchResolutionRef theBatch, CFRunLoopRef runLoop, CFStringRef runLoopMode);
+extern Boolean CFHostBatchResolutionStart(CFHostBatchResolutionRef theBatch, CFStreamError *error);
+
+// Type Declarations
+
+typedef struct {
+    unsigned int  mRound;
+    unsigned int  mLookups;
+    unsigned int  mStarted;
+    unsigned int  mCompleted;
+    unsigned int  mFailed;
+} _CFHostBenchmarkContext;
+
+typedef struct {
+    unsigned int  mCompleted;
+    unsigned int  mFailed;
+} _CFHostBatchBenchmarkContext;
+
+// Stub DNS Server
+
+/**
+ *  Answer every A query with 127.0.0.1 and every other query with an
+ *  empty (that is, no data) response.  Any additional records in the
+ *  query, such as an EDNS OPT record, are dropped from the response.
+ *
+ */
+static void
+StubServerMain(int aSocket)
+{
+    unsigned char buffer[512];
+
+    while (TRUE) {
+        struct sockaddr_storage peer;
+        socklen_t               peerlen = sizeof (peer);
+        ssize_t                 length;
+        size_t                  offset;
+        unsigned int            qtype;
+
+        length = recvfrom(aSocket, buffer, sizeof (buffer), 0, (struct sockaddr *)&peer, &peerlen);
+
+        if (length < 12) {
+            continue;
+        }
+
+        // Skip the question name, then its type and class.
+
+        offset = 12;
+
+        while ((offset < (size_t)length) && (buffer[offset] != 0)) {
+            offset += buffer[offset] + 1;
+        }
+
+        offset += 1 + 4;
+
+        if (offset > (size_t)length) {
+            continue;
+        }
+
+        qtype = (buffer[offset - 4] << 8) | buffer[offset - 3];
+
+        buffer[2] = 0x81;                   // QR, RD
+        buffer[3] = 0x80;                   // RA, NOERROR
+        buffer[4] = 0; buffer[5] = 1;       // QDCOUNT
+        buffer[6] = 0; buffer[7] = 0;       // ANCOUNT
+        buffer[8] = 0; buffer[9] = 0;       // NSCOUNT
+        buffer[10] = 0; buffer[11] = 0;     // ARCOUNT
+
+        if ((qtype == 1) && ((offset + 16) <= sizeof (buffer))) {
+            static const unsigned char answer[16] = {
+                0xc0, 0x0c,                 // NAME, pointer to question
+                0x00, 0x01,                 // TYPE A
+                0x00, 0x01,                 // CLASS IN
+                0x00, 0x00, 0x00, kCFHostBenchmarkRecordTimeToLive,
+                0x00, 0x04,                 // RDLENGTH
+                127, 0, 0, 1
+            };
+
+            memcpy(&buffer[offset], answer, sizeof (answer));
+            offset += sizeof (answer);
+
+            buffer[7] = 1;
+        }
+
+        sendto(aSocket, buffer, offset, 0, (struct sockaddr *)&peer, peerlen);
+    }
+}
+
+static pid_t
+StubServerStart(unsigned short *aPort)
+{
+    struct sockaddr_in address;
+    socklen_t          addrlen = sizeof (address);
+    int                fd;
+    int                status;
+    pid_t              pid = -1;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    __Require(fd >= 0, done);
+
+    memset(&address, 0, sizeof (address));
+
+    address.sin_family      = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port        = 0;
+
+    status = bind(fd, (struct sockaddr *)&address, sizeof (address));
+    __Require(status == 0, done);
+
+    status = getsockname(fd, (struct sockaddr *)&address, &addrlen);
+    __Require(status == 0, done);
+
+    *aPort = ntohs(address.sin_port);
+
+    pid = fork();
+
+    if (pid == 0) {
+        StubServerMain(fd);
+        _exit(EXIT_SUCCESS);
+    }
+
+ done:
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return (pid);
+}
+
+static void
+StubServerStop(pid_t aPid)
+{
+    if (aPid > 0) {
+        kill(aPid, SIGTERM);
+        waitpid(aPid, NULL, 0);
+    }
+}
+
+// Benchmark
+
+static Boolean StartLookup(_CFHostBenchmarkContext *aContext);
+
+static void
+HostCallBack(CFHostRef aHost, CFHostInfoType aInfo, const CFStreamError *aError, void *aContext)
+{
+    _CFHostBenchmarkContext *lContext = ((_CFHostBenchmarkContext *)(aContext));
+
+    if (aError->error != 0) {
+        lContext->mFailed++;
+    }
+
+    lContext->mCompleted++;
+
+    CFHostSetClient(aHost, NULL, NULL);
+    CFHostUnscheduleFromRunLoop(aHost, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+    CFRelease(aHost);
+
+    if (lContext->mStarted < lContext->mLookups) {
+        if (!StartLookup(lContext)) {
+            lContext->mFailed++;
+            lContext->mCompleted++;
+        }
+    }
+
+    if (lContext->mCompleted == lContext->mLookups) {
+        CFRunLoopStop(CFRunLoopGetCurrent());
+    }
+}
+
+static Boolean
+StartLookup(_CFHostBenchmarkContext *aContext)
+{
+    CFHostClientContext context = { 0, aContext, NULL, NULL, NULL };
+    CFStringRef         name;
+    CFHostRef           host = NULL;
+    CFStreamError       error;
+    Boolean             result = FALSE;
+
+    // Every name is unique so that no lookup is satisfied from the
+    // address cache or coalesced with another in the resolver.
+
+    name = CFStringCreateWithFormat(kCFAllocatorDefault,
+                                    NULL,
+                                    CFSTR("h%u.r%u.bench.test"),
+                                    aContext->mStarted,
+                                    aContext->mRound);
+    __Require(name != NULL, done);
+
+    aContext->mStarted++;
+
+    host = CFHostCreateWithName(kCFAllocatorDefault, name);
+    __Require(host != NULL, done);
+
+    result = CFHostSetClient(host, HostCallBack, &context);
+    __Require(result, done);
+
+    CFHostScheduleWithRunLoop(host, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+
+    result = CFHostStartInfoResolution(host, kCFHostAddresses, &error);
+    __Require_Action(result, done, CFHostUnscheduleFromRunLoop(host, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode));
+
+    // The reference is released by HostCallBack on completion.
+
+    host = NULL;
+
+ done:
+    if (host != NULL) {
+        CFHostSetClient(host, NULL, NULL);
+        CFRelease(host);
+    }
+
+    if (name != NULL) {
+        CFRelease(name);
+    }
+
+    return (result);
+}
+
+static int
+RunBenchmark(const char *aDescription, Boolean aShared, unsigned int aRound, unsigned int aLookups, unsigned int aConcurrency)
+{
+    _CFHostBenchmarkContext context = { aRound, aLookups, 0, 0, 0 };
+    CFAbsoluteTime          start;
+    CFTimeInterval          elapsed;
+    Boolean                 set;
+    unsigned int            i;
+    int                     status = -1;
+
+    set = CFHostSetProperty(NULL, _kCFHostPropertyResolverSharedChannel, aShared ? kCFBooleanTrue : kCFBooleanFalse);
+    __Require(set, done);
+
+    start = CFAbsoluteTimeGetCurrent();
+
+    for (i = 0; (i < aConcurrency) && (context.mStarted < aLookups); i++) {
+        if (!StartLookup(&context)) {
+            context.mFailed++;
+            context.mCompleted++;
+        }
+    }
+
+    if (context.mCompleted < aLookups) {
+        CFRunLoopRun();
+    }
+
+    elapsed = CFAbsoluteTimeGetCurrent() - start;
+
+    __CFHostBenchmarkLog("%-12s %u lookups, %u concurrent, %u failed: %.3f s, %.0f lookups/sec\n",
+                         aDescription,
+                         context.mCompleted,
+                         aConcurrency,
+                         context.mFailed,
+                         elapsed,
+                         (elapsed > 0) ? (context.mCompleted / elapsed) : 0.0);
+
+    status = (context.mFailed == 0) ? 0 : -1;
+
+ done:
+    return (status);
+}
+
+static void
+BatchCallBack(CFHostBatchResolutionRef aBatch, CFStringRef aName, CFArrayRef aAddresses, const CFStreamError *aError, void *aContext)
+{
+    _CFHostBatchBenchmarkContext *lContext = ((_CFHostBatchBenchmarkContext *)(aContext));
+
+    if ((aError->error != 0) || (aAddresses == NULL)) {
+        lContext->mFailed++;
+    }
+
+    lContext->mCompleted++;
+}
+
+static void
+BatchCompletionCallBack(CFHostBatchResolutionRef aBatch, void *aContext)
+{
+    CFRunLoopStop(CFRunLoopGetCurrent());
+}
+
+static int
+RunBatchBenchmark(const char *aDescription, unsigned int aRound, unsigned int aLookups)
+{
+    _CFHostBatchBenchmarkContext context  = { 0, 0 };
+    CFHostClientContext          client   = { 0, &context, NULL, NULL, NULL };
+    CFMutableArrayRef            names    = NULL;
+    CFHostBatchResolutionRef     batch    = NULL;
+    CFAbsoluteTime               start;
+    CFTimeInterval               elapsed;
+    CFStreamError                error;
+    Boolean                      result;
+    unsigned int                 i;
+    int                          status   = -1;
+
+    result = CFHostSetProperty(NULL, _kCFHostPropertyResolverSharedChannel, kCFBooleanTrue);
+    __Require(result, done);
+
+    names = CFArrayCreateMutable(kCFAllocatorDefault, aLookups, &kCFTypeArrayCallBacks);
+    __Require(names != NULL, done);
+
+    for (i = 0; i < aLookups; i++) {
+        CFStringRef name = CFStringCreateWithFormat(kCFAllocatorDefault,
+                                                    NULL,
+                                                    CFSTR("h%u.r%u.bench.test"),
+                                                    i,
+                                                    aRound);
+        __Require(name != NULL, done);
+
+        CFArrayAppendValue(names, name);
+        CFRelease(name);
+    }
+
+    start = CFAbsoluteTimeGetCurrent();
+
+    batch = CFHostCreateBatchResolution(kCFAllocatorDefault, names);
+    __Require(batch != NULL, done);
+
+    result = CFHostBatchResolutionSetClient(batch, BatchCallBack, BatchCompletionCallBack, &client);
+    __Require(result, done);
+
+    CFHostBatchResolutionScheduleWithRunLoop(batch, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+
+    result = CFHostBatchResolutionStart(batch, &error);
+    __Require(result, done);
+
+    CFRunLoopRun();
+
+    elapsed = CFAbsoluteTimeGetCurrent() - start;
+
+    CFHostBatchResolutionUnscheduleFromRunLoop(batch, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+
+    __CFHostBenchmarkLog("%-12s %u lookups, %u concurrent, %u failed: %.3f s, %.0f lookups/sec\n",
+                         aDescription,
+                         context.mCompleted,
+                         aLookups,
+                         context.mFailed,
+                         elapsed,
+                         (elapsed > 0) ? (context.mCompleted / elapsed) : 0.0);
+
+    status = ((context.mFailed == 0) && (context.mCompleted == aLookups)) ? 0 : -1;
+
+ done:
+    if (batch != NULL) {
+        CFRelease(batch);
+    }
+
+    if (names != NULL) {
+        CFRelease(names);
+    }
+
+    return (status);
+}
+
+static void
+Usage(const char *aProgram)
+{
+    __CFHostBenchmarkLog("Usage: %s [ -n <lookups> ] [ -c <concurrency> ]\n", aProgram);
+}
+
+int
+main(int argc, char * const argv[])
+{
+    unsigned int   lookups     = kCFHostBenchmarkDefaultLookups;
+    unsigned int   concurrency = kCFHostBenchmarkDefaultConcurrency;
+    unsigned short port        = 0;
+    pid_t          server      = -1;
+    CFStringRef    servers     = NULL;
+    CFIndex        capacity    = 0;
+    CFNumberRef    number      = NULL;
+    Boolean        set;
+    int            c;
+    int            status      = -1;
+
+    while ((c = getopt(argc, argv, "c:n:")) != -1) {
+        switch (c) {
+
+        case 'c':
+            concurrency = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+
+        case 'n':
+            lookups = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+
+        default:
+            Usage(argv[0]);
+            goto done;
+
+        }
+    }
+
+    __Require_Action((lookups > 0) && (concurrency > 0), done, Usage(argv[0]));
+
+    server = StubServerStart(&port);
+    __Require(server > 0, done);
+
+    servers = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("127.0.0.1:%hu"), port);
+    __Require(servers != NULL, done);
+
+    set = CFHostSetProperty(NULL, _kCFHostPropertyResolverServers, servers);
+    __Require(set, done);
+
+    // Disable the address cache so that every lookup reaches the
+    // resolver.
+
+    number = CFNumberCreate(kCFAllocatorDefault, kCFNumberCFIndexType, &capacity);
+    __Require(number != NULL, done);
+
+    set = CFHostSetProperty(NULL, _kCFHostPropertyCacheCapacity, number);
+    __Require(set, done);
+
+    status = RunBenchmark("per-request", FALSE, 0, lookups, concurrency);
+    __Require(status == 0, done);
+
+    status = RunBenchmark("shared", TRUE, 1, lookups, concurrency);
+    __Require(status == 0, done);
+
+    status = RunBatchBenchmark("batch", 2, lookups);
+    __Require(status == 0, done);
+
+ done:
+    if (number != NULL) {
+        CFRelease(number);
+    }
+
+    if (servers != NULL) {
+        CFHostSetProperty(NULL, _kCFHostPropertyResolverServers, NULL);
+        CFRelease(servers);
+    }
+
+    StubServerStop(server);
+
+    return ((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,2244 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements the OpenCFNetwork benchmark suite: micro-
+ *     benchmarks of HTTP header parsing, chunked transfer decoding
+ *     and FTP listing parsing over fixed in-memory inputs, and macro-
+ *     benchmarks of socket stream throughput, connection cache reuse,
+ *     end-to-end HTTP GETs against an in-process _CFHTTPServer, and
+ *     full versus resumed SSL handshakes against a local openssl
+ *     s_server, and of stream callback latency under a busy main run
+ *     loop, with the stream scheduled there directly and on a
+ *     background network run loop.
+ *
+ *     Nothing leaves the host: every connection is to 127.0.0.1 and
+ *     names are resolved by a stub DNS server on the loopback
+ *     interface.  Each benchmark is run a number of times and the
+ *     fastest run is kept; the results are written as one JSON
+ *     document, to standard output unless a file is named, while
+ *     progress goes to standard error.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <AssertMacros.h>
+
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFFTPStreamPriv.h>
+#include <CFNetwork/CFHostPriv.h>
+#include <CFNetwork/CFHTTPMessagePriv.h>
+#include <CFNetwork/CFHTTPServerPriv.h>
+#include <CFNetwork/CFHTTPStreamPriv.h>
+#include <CFNetwork/CFSocketStreamPriv.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#define __CFNetworkBenchmarkLog(format, ...)     do { fprintf(stderr, format, ##__VA_ARGS__); fflush(stderr); } while (0)
+
+#define kCFNetworkBenchmarkDefaultScale          1
+#define kCFNetworkBenchmarkDefaultRepetitions    3
+#define kCFNetworkBenchmarkMaxResults            4
+
+#define kCFNetworkBenchmarkMessages              20000
+#define kCFNetworkBenchmarkChunkedResponses      200
+#define kCFNetworkBenchmarkChunkedBodySize       (256 * 1024)
+#define kCFNetworkBenchmarkChunkSize             1024
+#define kCFNetworkBenchmarkSocketBytes           (64 * 1024 * 1024)
+#define kCFNetworkBenchmarkSocketBlockSize       (16 * 1024)
+#define kCFNetworkBenchmarkConnectionRequests    500
+#define kCFNetworkBenchmarkListingPasses         200
+#define kCFNetworkBenchmarkLargeListingEntries   100000
+#define kCFNetworkBenchmarkGetRequests           2000
+#define kCFNetworkBenchmarkGetBodySize           (16 * 1024)
+#define kCFNetworkBenchmarkReadSize              (16 * 1024)
+#define kCFNetworkBenchmarkHandshakes            200
+#define kCFNetworkBenchmarkCallbackMessages      2000
+#define kCFNetworkBenchmarkCallbackInterval      0.0005
+#define kCFNetworkBenchmarkBusyInterval          0.001
+#define kCFNetworkBenchmarkBusySlice             0.002
+#define kCFNetworkBenchmarkRecordTimeToLive      60
+#define kCFNetworkBenchmarkServerStartTimeout    5.0
+
+#define kCFNetworkBenchmarkHostName              "bench.opencfnetwork.test"
+
+// SPI from CFNetworkSchedule.h, which is internal to the library.
+
+extern CFReadStreamRef _CFReadStreamCreateWithIORunLoop(CFAllocatorRef alloc, CFReadStreamRef stream);
+
+// Type Declarations
+
+/**
+ *  One measurement.  Latencies are in seconds and connection cache,
+ *  resumed session and allocation counts are over the run; any of
+ *  them that a benchmark does not measure is negative and left out of
+ *  the report.
+ *
+ */
+typedef struct {
+    const char *     mName;
+    const char *     mKind;
+    unsigned long    mOperations;
+    UInt64           mBytes;
+    double           mSeconds;
+    double           mLatencyP50;
+    double           mLatencyP99;
+    long             mCacheHits;
+    long             mCacheMisses;
+    long             mResumed;
+    long             mAllocations;
+} _CFNetworkBenchmarkResult;
+
+typedef struct {
+    unsigned int                mScale;
+    const char *                mCertificate;
+    unsigned int                mCount;
+    _CFNetworkBenchmarkResult   mResults[kCFNetworkBenchmarkMaxResults];
+} _CFNetworkBenchmarkRun;
+
+typedef int (*_CFNetworkBenchmarkFunction)(_CFNetworkBenchmarkRun *aRun);
+
+typedef struct {
+    const char *                  mName;
+    _CFNetworkBenchmarkFunction   mFunction;
+} _CFNetworkBenchmark;
+
+typedef struct {
+    pthread_mutex_t   mLock;
+    pthread_cond_t    mCondition;
+    pthread_t         mThread;
+    CFDataRef         mBody;
+    UInt16            mPort;
+    Boolean           mStarted;
+    Boolean           mStopping;
+    Boolean           mFailed;
+} _CFNetworkBenchmarkServer;
+
+typedef struct {
+    int               mSocket;
+    size_t            mBytes;
+    size_t            mWritten;
+} _CFNetworkBenchmarkWriter;
+
+typedef struct {
+    int               mSocket;
+    unsigned long     mMessages;
+    unsigned long     mSent;
+} _CFNetworkBenchmarkTicker;
+
+typedef struct {
+    double *          mLatencies;
+    unsigned long     mMessages;
+    unsigned long     mReceived;
+    UInt64            mBytes;
+    UInt8             mPartial[sizeof (double)];
+    size_t            mPartialLength;
+    Boolean           mDone;
+    Boolean           mFailed;
+} _CFNetworkBenchmarkReceiver;
+
+static const char sResponseHeader[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Mon, 04 Jan 2021 18:30:00 GMT\r\n"
+    "Server: OpenCFNetwork-Benchmark/1.0\r\n"
+    "Content-Type: text/html; charset=utf-8\r\n"
+    "Content-Length: 5120\r\n"
+    "Cache-Control: private, max-age=0, must-revalidate\r\n"
+    "ETag: \"5ff35ee8-1400\"\r\n"
+    "Last-Modified: Mon, 04 Jan 2021 18:00:00 GMT\r\n"
+    "Vary: Accept-Encoding, User-Agent\r\n"
+    "Set-Cookie: session=0123456789abcdef; Path=/; HttpOnly\r\n"
+    "X-Frame-Options: SAMEORIGIN\r\n"
+    "X-Content-Type-Options: nosniff\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static const char * const sListingLines[] = {
+    "-rw-r--r--   1 ftp      ftp        104857 Jan 10 12:34 README.txt\r\n",
+    "drwxr-xr-x   4 ftp      ftp          4096 Mar  2  2020 pub\r\n",
+    "lrwxrwxrwx   1 root     root            7 Feb 28 09:01 latest -> 2.1.0\r\n",
+    "-rw-r--r--   1 1001     1001   2147483648 Dec 31  2019 archive.tar.gz\r\n",
+    "-rwxr-x---   1 build    staff       73218 Jul  4 23:59 configure\r\n",
+    "drwx------   2 build    staff         512 Nov 11  2018 .private\r\n",
+    "-rw-rw-r--   1 ftp      ftp             0 Aug 15 00:00 empty file name.dat\r\n",
+    "-r--r--r--   1 ftp      ftp         31337 Sep  9 17:45 CHANGES.md\r\n"
+};
+
+// Utilities
+
+static double
+Now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec + (now.tv_nsec / 1e9));
+}
+
+static int
+CompareLatencies(const void *aFirst, const void *aSecond)
+{
+    const double first  = *(const double *)aFirst;
+    const double second = *(const double *)aSecond;
+
+    return ((first > second) - (first < second));
+}
+
+static _CFNetworkBenchmarkResult *
+AddResult(_CFNetworkBenchmarkRun *aRun, const char *aName, const char *aKind)
+{
+    _CFNetworkBenchmarkResult *result = NULL;
+
+    __Require(aRun->mCount < kCFNetworkBenchmarkMaxResults, done);
+
+    result = &aRun->mResults[aRun->mCount++];
+
+    memset(result, 0, sizeof (*result));
+
+    result->mName        = aName;
+    result->mKind        = aKind;
+    result->mLatencyP50  = -1;
+    result->mLatencyP99  = -1;
+    result->mCacheHits   = -1;
+    result->mCacheMisses = -1;
+    result->mResumed     = -1;
+    result->mAllocations = -1;
+
+ done:
+    return (result);
+}
+
+static void
+GetConnectionCacheCounts(long *aHits, long *aMisses)
+{
+    CFDictionaryRef statistics;
+    CFIndex         hits   = 0;
+    CFIndex         misses = 0;
+
+    statistics = _CFHTTPStreamCopyConnectionCacheStatistics(kCFAllocatorDefault);
+
+    if (statistics != NULL) {
+        CFNumberRef number;
+
+        number = CFDictionaryGetValue(statistics, _kCFHTTPStreamConnectionCacheHits);
+
+        if (number != NULL) {
+            CFNumberGetValue(number, kCFNumberCFIndexType, &hits);
+        }
+
+        number = CFDictionaryGetValue(statistics, _kCFHTTPStreamConnectionCacheMisses);
+
+        if (number != NULL) {
+            CFNumberGetValue(number, kCFNumberCFIndexType, &misses);
+        }
+
+        CFRelease(statistics);
+    }
+
+    *aHits   = (long)hits;
+    *aMisses = (long)misses;
+}
+
+/**
+ *  Read a stream to its end, counting the bytes read.
+ *
+ */
+static int
+ReadToEnd(CFReadStreamRef aStream, UInt8 *aBuffer, CFIndex aSize, UInt64 *aBytes)
+{
+    int status = 0;
+
+    while (TRUE) {
+        CFIndex length = CFReadStreamRead(aStream, aBuffer, aSize);
+
+        if (length == 0) {
+            break;
+        }
+
+        if (length < 0) {
+            status = -1;
+            break;
+        }
+
+        *aBytes += (UInt64)length;
+    }
+
+    return (status);
+}
+
+// Stub DNS Server
+
+/**
+ *  Answer every A query with 127.0.0.1 and every other query with an
+ *  empty (that is, no data) response.
+ *
+ */
+static void
+StubServerMain(int aSocket)
+{
+    unsigned char buffer[512];
+
+    while (TRUE) {
+        struct sockaddr_storage peer;
+        socklen_t               peerlen = sizeof (peer);
+        ssize_t                 length;
+        size_t                  offset;
+        unsigned int            qtype;
+
+        length = recvfrom(aSocket, buffer, sizeof (buffer), 0, (struct sockaddr *)&peer, &peerlen);
+
+        if (length < 12) {
+            continue;
+        }
+
+        // Skip the question name, then its type and class.
+
+        offset = 12;
+
+        while ((offset < (size_t)length) && (buffer[offset] != 0)) {
+            offset += buffer[offset] + 1;
+        }
+
+        offset += 1 + 4;
+
+        if (offset > (size_t)length) {
+            continue;
+        }
+
+        qtype = (buffer[offset - 4] << 8) | buffer[offset - 3];
+
+        buffer[2] = 0x81;                   // QR, RD
+        buffer[3] = 0x80;                   // RA, NOERROR
+        buffer[4] = 0; buffer[5] = 1;       // QDCOUNT
+        buffer[6] = 0; buffer[7] = 0;       // ANCOUNT
+        buffer[8] = 0; buffer[9] = 0;       // NSCOUNT
+        buffer[10] = 0; buffer[11] = 0;     // ARCOUNT
+
+        if ((qtype == 1) && ((offset + 16) <= sizeof (buffer))) {
+            static const unsigned char answer[16] = {
+                0xc0, 0x0c,                 // NAME, pointer to question
+                0x00, 0x01,                 // TYPE A
+                0x00, 0x01,                 // CLASS IN
+                0x00, 0x00, 0x00, kCFNetworkBenchmarkRecordTimeToLive,
+                0x00, 0x04,                 // RDLENGTH
+                127, 0, 0, 1
+            };
+
+            memcpy(&buffer[offset], answer, sizeof (answer));
+            offset += sizeof (answer);
+
+            buffer[7] = 1;
+        }
+
+        sendto(aSocket, buffer, offset, 0, (struct sockaddr *)&peer, peerlen);
+    }
+}
+
+static pid_t
+StubServerStart(unsigned short *aPort)
+{
+    struct sockaddr_in address;
+    socklen_t          addrlen = sizeof (address);
+    int                fd;
+    int                status;
+    pid_t              pid = -1;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    __Require(fd >= 0, done);
+
+    memset(&address, 0, sizeof (address));
+
+    address.sin_family      = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port        = 0;
+
+    status = bind(fd, (struct sockaddr *)&address, sizeof (address));
+    __Require(status == 0, done);
+
+    status = getsockname(fd, (struct sockaddr *)&address, &addrlen);
+    __Require(status == 0, done);
+
+    *aPort = ntohs(address.sin_port);
+
+    pid = fork();
+
+    if (pid == 0) {
+        StubServerMain(fd);
+        _exit(EXIT_SUCCESS);
+    }
+
+ done:
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return (pid);
+}
+
+static void
+StubServerStop(pid_t aPid)
+{
+    if (aPid > 0) {
+        kill(aPid, SIGTERM);
+        waitpid(aPid, NULL, 0);
+    }
+}
+
+// HTTP Server
+
+static void
+DidReceiveRequest(_CFHTTPServerRef aServer, CFHTTPMessageRef aRequest, void *aInfo)
+{
+    _CFNetworkBenchmarkServer *server = aInfo;
+    CFHTTPMessageRef           response;
+
+    response = CFHTTPMessageCreateResponse(kCFAllocatorDefault, 200, NULL, kCFHTTPVersion1_1);
+    __Require(response != NULL, done);
+
+    CFHTTPMessageSetBody(response, server->mBody);
+
+    _CFHTTPServerAddResponse(aServer, aRequest, response);
+    CFRelease(response);
+
+ done:
+    return;
+}
+
+/**
+ *  Run the server on its own thread and run loop so that the client
+ *  streams on the main thread can block in CFReadStreamRead.
+ *
+ */
+static void *
+ServerMain(void *aContext)
+{
+    _CFNetworkBenchmarkServer  *server    = aContext;
+    _CFHTTPServerCallBacks      callbacks = { 0, NULL, NULL, DidReceiveRequest, NULL, NULL };
+    _CFHTTPServerContext        context   = { 0, server, NULL, NULL, NULL };
+    _CFHTTPServerRef            http;
+    Boolean                     stopping  = FALSE;
+    Boolean                     result    = FALSE;
+
+    http = _CFHTTPServerCreate(kCFAllocatorDefault, &callbacks, &context);
+
+    if (http != NULL) {
+        result = _CFHTTPServerStart(http, NULL, NULL, 0);
+    }
+
+    pthread_mutex_lock(&server->mLock);
+
+    server->mStarted = TRUE;
+    server->mFailed  = !result;
+
+    if (result) {
+        server->mPort = (UInt16)_CFHTTPServerGetPort(http);
+    }
+
+    pthread_cond_signal(&server->mCondition);
+    pthread_mutex_unlock(&server->mLock);
+
+    while (result && !stopping) {
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.05, FALSE);
+
+        pthread_mutex_lock(&server->mLock);
+        stopping = server->mStopping;
+        pthread_mutex_unlock(&server->mLock);
+    }
+
+    if (http != NULL) {
+        _CFHTTPServerInvalidate(http);
+        CFRelease(http);
+    }
+
+    return (NULL);
+}
+
+static int
+ServerStart(_CFNetworkBenchmarkServer *aServer, size_t aBodySize)
+{
+    UInt8 *body   = NULL;
+    int    status = -1;
+
+    memset(aServer, 0, sizeof (*aServer));
+
+    pthread_mutex_init(&aServer->mLock, NULL);
+    pthread_cond_init(&aServer->mCondition, NULL);
+
+    body = malloc(aBodySize);
+    __Require(body != NULL, done);
+
+    memset(body, 'x', aBodySize);
+
+    aServer->mBody = CFDataCreate(kCFAllocatorDefault, body, (CFIndex)aBodySize);
+    __Require(aServer->mBody != NULL, done);
+
+    status = pthread_create(&aServer->mThread, NULL, ServerMain, aServer);
+    __Require(status == 0, done);
+
+    pthread_mutex_lock(&aServer->mLock);
+
+    while (!aServer->mStarted) {
+        pthread_cond_wait(&aServer->mCondition, &aServer->mLock);
+    }
+
+    status = aServer->mFailed ? -1 : 0;
+
+    pthread_mutex_unlock(&aServer->mLock);
+
+ done:
+    if (body != NULL) {
+        free(body);
+    }
+
+    return (status);
+}
+
+static void
+ServerStop(_CFNetworkBenchmarkServer *aServer)
+{
+    if (aServer->mStarted) {
+        pthread_mutex_lock(&aServer->mLock);
+        aServer->mStopping = TRUE;
+        pthread_mutex_unlock(&aServer->mLock);
+
+        pthread_join(aServer->mThread, NULL);
+    }
+
+    if (aServer->mBody != NULL) {
+        CFRelease(aServer->mBody);
+    }
+
+    pthread_cond_destroy(&aServer->mCondition);
+    pthread_mutex_destroy(&aServer->mLock);
+}
+
+// SSL Server
+
+/**
+ *  Find a free port on the loopback interface for a server which must
+ *  be told its port up front.
+ *
+ */
+static int
+GetFreePort(UInt16 *aPort)
+{
+    struct sockaddr_in address;
+    socklen_t          addrlen = sizeof (address);
+    int                fd;
+    int                status  = -1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    __Require(fd >= 0, done);
+
+    memset(&address, 0, sizeof (address));
+
+    address.sin_family      = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port        = 0;
+
+    status = bind(fd, (struct sockaddr *)&address, sizeof (address));
+    __Require(status == 0, done);
+
+    status = getsockname(fd, (struct sockaddr *)&address, &addrlen);
+    __Require(status == 0, done);
+
+    *aPort = ntohs(address.sin_port);
+
+ done:
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return (status);
+}
+
+/**
+ *  Run openssl s_server on the loopback interface, answering each
+ *  connection with a short status page, and wait for it to accept
+ *  connections.
+ *
+ */
+static pid_t
+SSLServerStart(const char *aCertificate, UInt16 aPort)
+{
+    struct sockaddr_in address;
+    char               endpoint[32];
+    double             deadline;
+    pid_t              pid;
+
+    snprintf(endpoint, sizeof (endpoint), "127.0.0.1:%u", aPort);
+
+    pid = fork();
+
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+
+        if (null >= 0) {
+            dup2(null, STDIN_FILENO);
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+
+        execlp("openssl", "openssl", "s_server", "-quiet", "-www", "-accept", endpoint, "-cert", aCertificate, (char *)NULL);
+        _exit(EXIT_FAILURE);
+    }
+
+    __Require(pid > 0, done);
+
+    memset(&address, 0, sizeof (address));
+
+    address.sin_family      = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port        = htons(aPort);
+
+    deadline = Now() + kCFNetworkBenchmarkServerStartTimeout;
+
+    while (TRUE) {
+        int fd        = socket(AF_INET, SOCK_STREAM, 0);
+        int connected = (fd >= 0) && (connect(fd, (struct sockaddr *)&address, sizeof (address)) == 0);
+
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        if (connected) {
+            break;
+        }
+
+        if ((waitpid(pid, NULL, WNOHANG) == pid) || (Now() > deadline)) {
+            kill(pid, SIGTERM);
+            waitpid(pid, NULL, 0);
+            pid = -1;
+            break;
+        }
+
+        usleep(10000);
+    }
+
+ done:
+    return (pid);
+}
+
+static void
+SSLServerStop(pid_t aPid)
+{
+    if (aPid > 0) {
+        kill(aPid, SIGTERM);
+        waitpid(aPid, NULL, 0);
+    }
+}
+
+/**
+ *  Connect, complete the SSL handshake by way of a request and read the
+ *  server's page to the end.  Returns 1 rather than failing if this
+ *  build of the library has no SSL support.
+ *
+ */
+static int
+SSLFetch(CFStringRef aHost, UInt16 aPort, CFDictionaryRef aSettings, UInt8 *aBuffer, CFIndex aSize, UInt64 *aBytes, Boolean *aResumed)
+{
+    static const char request[] = "GET / HTTP/1.0\r\n\r\n";
+    CFReadStreamRef   readStream  = NULL;
+    CFWriteStreamRef  writeStream = NULL;
+    CFBooleanRef      resumed     = NULL;
+    int               status      = -1;
+
+    CFStreamCreatePairWithSocketToHost(kCFAllocatorDefault, aHost, aPort, &readStream, &writeStream);
+    __Require((readStream != NULL) && (writeStream != NULL), done);
+
+    __Require_Action(CFReadStreamSetProperty(readStream, kCFStreamPropertySSLSettings, aSettings), done, status = 1);
+
+    __Require(CFReadStreamOpen(readStream), done);
+    __Require(CFWriteStreamOpen(writeStream), done);
+
+    // The write waits on the handshake.
+
+    __Require(CFWriteStreamWrite(writeStream, (const UInt8 *)request, sizeof (request) - 1) == (CFIndex)(sizeof (request) - 1), done);
+
+    status = ReadToEnd(readStream, aBuffer, aSize, aBytes);
+    __Require(status == 0, done);
+
+#if defined(__MACH__)
+    resumed = CFReadStreamCopyProperty(readStream, _kCFStreamPropertySSLSessionResumed);
+#endif
+
+    *aResumed = (resumed != NULL) && CFBooleanGetValue(resumed);
+
+ done:
+    if (resumed != NULL) {
+        CFRelease(resumed);
+    }
+
+    if (writeStream != NULL) {
+        CFWriteStreamClose(writeStream);
+        CFRelease(writeStream);
+    }
+
+    if (readStream != NULL) {
+        CFReadStreamClose(readStream);
+        CFRelease(readStream);
+    }
+
+    return (status);
+}
+
+// HTTP Client
+
+/**
+ *  Issue one GET and read its response to the end, failing on anything
+ *  other than a 200 response.
+ *
+ */
+static int
+Fetch(CFURLRef aURL, Boolean aPersistent, UInt8 *aBuffer, CFIndex aSize, UInt64 *aBytes)
+{
+    CFHTTPMessageRef request  = NULL;
+    CFHTTPMessageRef response = NULL;
+    CFReadStreamRef  stream   = NULL;
+    Boolean          result;
+    int              status   = -1;
+
+    request = CFHTTPMessageCreateRequest(kCFAllocatorDefault, CFSTR("GET"), aURL, kCFHTTPVersion1_1);
+    __Require(request != NULL, done);
+
+    stream = CFReadStreamCreateForHTTPRequest(kCFAllocatorDefault, request);
+    __Require(stream != NULL, done);
+
+    result = CFReadStreamSetProperty(stream, kCFStreamPropertyHTTPAttemptPersistentConnection, aPersistent ? kCFBooleanTrue : kCFBooleanFalse);
+    __Require(result, done);
+
+    result = CFReadStreamOpen(stream);
+    __Require(result, done);
+
+    status = ReadToEnd(stream, aBuffer, aSize, aBytes);
+    __Require(status == 0, done);
+
+    response = (CFHTTPMessageRef)CFReadStreamCopyProperty(stream, kCFStreamPropertyHTTPResponseHeader);
+    __Require_Action(response != NULL, done, status = -1);
+
+    status = (CFHTTPMessageGetResponseStatusCode(response) == 200) ? 0 : -1;
+
+ done:
+    if (response != NULL) {
+        CFRelease(response);
+    }
+
+    if (stream != NULL) {
+        CFReadStreamClose(stream);
+        CFRelease(stream);
+    }
+
+    if (request != NULL) {
+        CFRelease(request);
+    }
+
+    return (status);
+}
+
+// Microbenchmarks
+
+/**
+ *  Parse a typical response header block with CFHTTPMessageAppendBytes.
+ *
+ */
+static int
+BenchmarkHTTPMessageParse(_CFNetworkBenchmarkRun *aRun)
+{
+    _CFNetworkBenchmarkResult *result;
+    const unsigned long        messages = (unsigned long)kCFNetworkBenchmarkMessages * aRun->mScale;
+    unsigned long              i;
+    double                     start;
+    int                        status   = -1;
+
+    result = AddResult(aRun, "http-message-parse", "micro");
+    __Require(result != NULL, done);
+
+    start = Now();
+
+    for (i = 0; i < messages; i++) {
+        CFHTTPMessageRef message;
+        CFStringRef      value;
+        Boolean          complete;
+
+        message = CFHTTPMessageCreateEmpty(kCFAllocatorDefault, FALSE);
+        __Require(message != NULL, done);
+
+        complete = CFHTTPMessageAppendBytes(message, (const UInt8 *)sResponseHeader, sizeof (sResponseHeader) - 1) &&
+                   CFHTTPMessageIsHeaderComplete(message);
+
+        value = complete ? CFHTTPMessageCopyHeaderFieldValue(message, CFSTR("Content-Length")) : NULL;
+
+        CFRelease(message);
+
+        __Require(value != NULL, done);
+
+        CFRelease(value);
+    }
+
+    result->mSeconds    = Now() - start;
+    result->mOperations = messages;
+    result->mBytes      = (UInt64)messages * (sizeof (sResponseHeader) - 1);
+
+    status = 0;
+
+ done:
+    return (status);
+}
+
+/**
+ *  Decode a chunked response body through the HTTP read filter over a
+ *  memory stream, so that only the filter's own work is measured.
+ *
+ */
+static int
+BenchmarkHTTPFilterChunked(_CFNetworkBenchmarkRun *aRun)
+{
+    static const char          header[]  = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+    static const char          trailer[] = "0\r\n\r\n";
+    _CFNetworkBenchmarkResult *result;
+    const unsigned long        responses = (unsigned long)kCFNetworkBenchmarkChunkedResponses * aRun->mScale;
+    const size_t               chunks    = kCFNetworkBenchmarkChunkedBodySize / kCFNetworkBenchmarkChunkSize;
+    UInt8                     *encoded   = NULL;
+    UInt8                     *buffer    = NULL;
+    size_t                     length    = 0;
+    size_t                     i;
+    unsigned long              n;
+    double                     start;
+    int                        status    = -1;
+
+    result = AddResult(aRun, "http-filter-chunked", "micro");
+    __Require(result != NULL, done);
+
+    encoded = malloc(sizeof (header) + (chunks * (kCFNetworkBenchmarkChunkSize + 16)) + sizeof (trailer));
+    __Require(encoded != NULL, done);
+
+    buffer = malloc(kCFNetworkBenchmarkReadSize);
+    __Require(buffer != NULL, done);
+
+    memcpy(encoded, header, sizeof (header) - 1);
+    length = sizeof (header) - 1;
+
+    for (i = 0; i < chunks; i++) {
+        length += (size_t)sprintf((char *)&encoded[length], "%x\r\n", kCFNetworkBenchmarkChunkSize);
+
+        memset(&encoded[length], 'a' + (int)(i % 26), kCFNetworkBenchmarkChunkSize);
+        length += kCFNetworkBenchmarkChunkSize;
+
+        encoded[length++] = '\r';
+        encoded[length++] = '\n';
+    }
+
+    memcpy(&encoded[length], trailer, sizeof (trailer) - 1);
+    length += sizeof (trailer) - 1;
+
+    start = Now();
+
+    for (n = 0; n < responses; n++) {
+        CFReadStreamRef memory;
+        CFReadStreamRef stream;
+        UInt64          bytes    = 0;
+        int             decoded  = -1;
+
+        memory = CFReadStreamCreateWithBytesNoCopy(kCFAllocatorDefault, encoded, (CFIndex)length, kCFAllocatorNull);
+        __Require(memory != NULL, done);
+
+        stream = CFReadStreamCreateHTTPStream(kCFAllocatorDefault, memory, TRUE);
+        CFRelease(memory);
+        __Require(stream != NULL, done);
+
+        if (CFReadStreamOpen(stream)) {
+            decoded = ReadToEnd(stream, buffer, kCFNetworkBenchmarkReadSize, &bytes);
+        }
+
+        CFReadStreamClose(stream);
+        CFRelease(stream);
+
+        __Require((decoded == 0) && (bytes == kCFNetworkBenchmarkChunkedBodySize), done);
+
+        result->mBytes += bytes;
+    }
+
+    result->mSeconds    = Now() - start;
+    result->mOperations = responses;
+
+    status = 0;
+
+ done:
+    if (buffer != NULL) {
+        free(buffer);
+    }
+
+    if (encoded != NULL) {
+        free(encoded);
+    }
+
+    return (status);
+}
+
+/**
+ *  A malloc allocator that counts the requests made of it, to stand
+ *  behind the messages of the arena benchmark.
+ *
+ */
+static void *
+CountingAllocate(CFIndex aSize, CFOptionFlags aHint, void *aInfo)
+{
+    (void)aHint;
+
+    __sync_fetch_and_add((long *)aInfo, 1);
+
+    return (malloc((size_t)aSize));
+}
+
+static void *
+CountingReallocate(void *aPointer, CFIndex aSize, CFOptionFlags aHint, void *aInfo)
+{
+    (void)aHint;
+
+    __sync_fetch_and_add((long *)aInfo, 1);
+
+    return (realloc(aPointer, (size_t)aSize));
+}
+
+static void
+CountingDeallocate(void *aPointer, void *aInfo)
+{
+    (void)aInfo;
+
+    free(aPointer);
+}
+
+/**
+ *  Parse a response, read a few of its headers and give it a body,
+ *  as an HTTP stream would, with messages made directly on a
+ *  counting malloc allocator and then on a fresh arena backed by it
+ *  for each message, and report the requests each way made of it.
+ *
+ */
+static int
+BenchmarkHTTPMessageArena(_CFNetworkBenchmarkRun *aRun)
+{
+    static const char * const  headers[] = { "Content-Length", "Content-Type", "Date", "Server" };
+    _CFNetworkBenchmarkResult *results[2];
+    const unsigned long        messages  = (unsigned long)kCFNetworkBenchmarkMessages * aRun->mScale;
+    CFAllocatorRef             counting  = NULL;
+    long                       count     = 0;
+    CFAllocatorContext         context   = { 0, &count, NULL, NULL, NULL, CountingAllocate, CountingReallocate, CountingDeallocate, NULL };
+    CFDataRef                  body      = NULL;
+    UInt8                      bytes[kCFNetworkBenchmarkChunkSize];
+    unsigned int               pass;
+    unsigned long              i;
+    size_t                     j;
+    double                     start;
+    int                        status    = -1;
+
+    results[0] = AddResult(aRun, "http-message-malloc", "micro");
+    results[1] = AddResult(aRun, "http-message-arena", "micro");
+    __Require((results[0] != NULL) && (results[1] != NULL), done);
+
+    counting = CFAllocatorCreate(kCFAllocatorSystemDefault, &context);
+    __Require(counting != NULL, done);
+
+    memset(bytes, 'a', sizeof (bytes));
+
+    body = CFDataCreate(kCFAllocatorDefault, bytes, sizeof (bytes));
+    __Require(body != NULL, done);
+
+    for (pass = 0; pass < 2; pass++) {
+        _CFNetworkBenchmarkResult *result = results[pass];
+
+        count = 0;
+        start = Now();
+
+        for (i = 0; i < messages; i++) {
+            CFAllocatorRef   alloc = counting;
+            CFHTTPMessageRef message;
+            Boolean          complete;
+
+            if (pass == 1) {
+                alloc = _CFHTTPArenaCreate(counting, 0);
+                __Require(alloc != NULL, done);
+            }
+
+            message = CFHTTPMessageCreateEmpty(alloc, FALSE);
+
+            if (pass == 1) {
+                CFRelease(alloc);
+            }
+
+            __Require(message != NULL, done);
+
+            complete = CFHTTPMessageAppendBytes(message, (const UInt8 *)sResponseHeader, sizeof (sResponseHeader) - 1) &&
+                       CFHTTPMessageIsHeaderComplete(message);
+
+            for (j = 0; complete && (j < (sizeof (headers) / sizeof (headers[0]))); j++) {
+                CFStringRef name  = CFStringCreateWithCStringNoCopy(kCFAllocatorDefault, headers[j], kCFStringEncodingASCII, kCFAllocatorNull);
+                CFStringRef value = CFHTTPMessageCopyHeaderFieldValue(message, name);
+
+                CFRelease(name);
+
+                complete = (value != NULL);
+
+                if (value != NULL) {
+                    CFRelease(value);
+                }
+            }
+
+            if (complete) {
+                CFHTTPMessageSetBody(message, body);
+            }
+
+            CFRelease(message);
+
+            __Require(complete, done);
+        }
+
+        result->mSeconds     = Now() - start;
+        result->mOperations  = messages;
+        result->mBytes       = (UInt64)messages * ((sizeof (sResponseHeader) - 1) + sizeof (bytes));
+        result->mAllocations = count;
+    }
+
+    status = 0;
+
+ done:
+    if (body != NULL) {
+        CFRelease(body);
+    }
+
+    if (counting != NULL) {
+        CFRelease(counting);
+    }
+
+    return (status);
+}
+
+/**
+ *  Parse Unix-style FTP listing lines with
+ *  CFFTPCreateParsedResourceListing.
+ *
+ */
+static int
+BenchmarkFTPListingParse(_CFNetworkBenchmarkRun *aRun)
+{
+    _CFNetworkBenchmarkResult *result;
+    const unsigned long        passes  = (unsigned long)kCFNetworkBenchmarkListingPasses * aRun->mScale;
+    const size_t               samples = sizeof (sListingLines) / sizeof (sListingLines[0]);
+    UInt8                     *listing = NULL;
+    size_t                     length  = 0;
+    size_t                     i;
+    unsigned long              n;
+    double                     start;
+    int                        status  = -1;
+
+    result = AddResult(aRun, "ftp-listing-parse", "micro");
+    __Require(result != NULL, done);
+
+    // One listing of a hundred entries, cycling through the samples.
+
+    for (i = 0; i < 100; i++) {
+        length += strlen(sListingLines[i % samples]);
+    }
+
+    listing = malloc(length);
+    __Require(listing != NULL, done);
+
+    length = 0;
+
+    for (i = 0; i < 100; i++) {
+        const size_t line = strlen(sListingLines[i % samples]);
+
+        memcpy(&listing[length], sListingLines[i % samples], line);
+        length += line;
+    }
+
+    start = Now();
+
+    for (n = 0; n < passes; n++) {
+        size_t offset = 0;
+
+        while (offset < length) {
+            CFDictionaryRef parsed   = NULL;
+            CFIndex         consumed;
+
+            consumed = CFFTPCreateParsedResourceListing(kCFAllocatorDefault, &listing[offset], (CFIndex)(length - offset), &parsed);
+
+            if (parsed != NULL) {
+                CFRelease(parsed);
+                result->mOperations++;
+            }
+
+            __Require(consumed > 0, done);
+
+            offset += (size_t)consumed;
+        }
+
+        result->mBytes += length;
+    }
+
+    result->mSeconds = Now() - start;
+
+    status = (result->mOperations == (passes * 100)) ? 0 : -1;
+
+ done:
+    if (listing != NULL) {
+        free(listing);
+    }
+
+    return (status);
+}
+
+/**
+ *  Make a listing of a large directory, in the style of a mirror,
+ *  in one of the formats _CFFTPListing understands.  The listing is
+ *  made the same way every time: a few owners and groups, every
+ *  tenth entry a directory and every fiftieth a link, and dates
+ *  both in the last year and older.
+ *
+ */
+static UInt8 *
+CreateLargeListing(UInt32 aFormat, unsigned long aEntries, size_t *aLength)
+{
+    static const char * const kMonths[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    static const char * const kUsers[]  = { "ftp", "build", "root", "mirror" };
+    const size_t              kLine     = 160;
+    UInt8                    *listing;
+    size_t                    length    = 0;
+    UInt32                    seed      = 1;
+    unsigned long             i;
+
+    listing = malloc((aEntries + 1) * kLine);
+    __Require(listing != NULL, done);
+
+    if (aFormat == _kCFFTPListingFormatUnix) {
+        length += (size_t)snprintf((char *)listing, kLine, "total %lu\r\n", aEntries);
+    }
+
+    for (i = 0; i < aEntries; i++) {
+        char * const        line   = (char *)&listing[length];
+        const Boolean       isDir  = ((i % 10) == 0);
+        const Boolean       isLink = !isDir && ((i % 50) == 1);
+        const char * const  user   = kUsers[(i / 7) % 4];
+        const char * const  group  = kUsers[(i / 11) % 4];
+        const unsigned int  month  = (unsigned int)(i % 12);
+        const unsigned int  day    = (unsigned int)(1 + (i % 28));
+        unsigned long long  size;
+
+        seed = (seed * 1103515245) + 12345;
+        size = isDir ? 4096 : ((seed >> 8) % 100000000);
+
+        switch (aFormat) {
+
+        case _kCFFTPListingFormatUnix:
+            length += (size_t)snprintf(line, kLine, "%s %3u %-8s %-8s %12llu %s %2u %5s %s-%06lu%s\r\n",
+                                       isDir ? "drwxr-xr-x" : (isLink ? "lrwxrwxrwx" : "-rw-r--r--"),
+                                       isDir ? 2 : 1, user, group, size, kMonths[month], day,
+                                       ((i % 3) == 0) ? "2019" : "12:34",
+                                       isDir ? "dir" : "file", i,
+                                       isDir ? "" : (isLink ? ".lnk -> target" : ".dat"));
+            break;
+
+        case _kCFFTPListingFormatDOS: {
+            char field[24];
+
+            if (isDir) {
+                snprintf(field, sizeof (field), "%-14s", "<DIR>");
+            } else {
+                snprintf(field, sizeof (field), "%14llu", size);
+            }
+
+            length += (size_t)snprintf(line, kLine, "%02u-%02u-%02u  %02u:%02u%s %s %s-%06lu%s\r\n",
+                                       month + 1, day, (unsigned int)(i % 30), (unsigned int)(1 + (i % 12)), (unsigned int)(i % 60),
+                                       ((i % 2) == 0) ? "AM" : "PM", field,
+                                       isDir ? "dir" : "file", i, isDir ? "" : ".dat");
+            break;
+        }
+
+        case _kCFFTPListingFormatMLSD:
+            length += (size_t)snprintf(line, kLine, "type=%s;%s=%llu;modify=20%02u%02u%02u123456;UNIX.mode=0%s;UNIX.owner=%s;UNIX.group=%s; %s-%06lu\r\n",
+                                       isDir ? "dir" : (isLink ? "OS.unix=slink:target" : "file"),
+                                       isDir ? "sizd" : "size", size,
+                                       (unsigned int)(i % 30), month + 1, day,
+                                       isDir ? "755" : "644", user, group,
+                                       isDir ? "dir" : "file", i);
+            break;
+
+        }
+    }
+
+    *aLength = length;
+
+ done:
+    return (listing);
+}
+
+/**
+ *  Parse large listings in one pass with _CFFTPListing, in each of
+ *  the formats it understands, against the line at a time
+ *  CFFTPCreateParsedResourceListing on the Unix listing.
+ *
+ */
+static int
+BenchmarkFTPListingBulk(_CFNetworkBenchmarkRun *aRun)
+{
+    static const struct {
+        const char * mName;
+        UInt32       mFormat;
+    } kFormats[] = {
+        { "ftp-listing-bulk-unix", _kCFFTPListingFormatUnix },
+        { "ftp-listing-bulk-dos",  _kCFFTPListingFormatDOS  },
+        { "ftp-listing-bulk-mlsd", _kCFFTPListingFormatMLSD }
+    };
+    const unsigned long        entries = (unsigned long)kCFNetworkBenchmarkLargeListingEntries * aRun->mScale;
+    _CFNetworkBenchmarkResult *result;
+    UInt8                     *listing = NULL;
+    size_t                     length  = 0;
+    size_t                     offset  = 0;
+    size_t                     i;
+    double                     start;
+    int                        status  = -1;
+
+    for (i = 0; i < (sizeof (kFormats) / sizeof (kFormats[0])); i++) {
+        _CFFTPListingRef listingRef;
+
+        result = AddResult(aRun, kFormats[i].mName, "micro");
+        __Require(result != NULL, done);
+
+        listing = CreateLargeListing(kFormats[i].mFormat, entries, &length);
+        __Require(listing != NULL, done);
+
+        // Let the format be detected, as a client not knowing the server would.
+
+        start = Now();
+
+        listingRef = _CFFTPListingCreateWithBytes(kCFAllocatorDefault, listing, (CFIndex)length, _kCFFTPListingFormatUnknown);
+        __Require(listingRef != NULL, done);
+
+        result->mSeconds    = Now() - start;
+        result->mOperations = (unsigned long)_CFFTPListingGetCount(listingRef);
+        result->mBytes      = length;
+
+        __Require_Action((_CFFTPListingGetFormat(listingRef) == kFormats[i].mFormat) && (result->mOperations == entries),
+                         done,
+                         CFRelease(listingRef));
+
+        CFRelease(listingRef);
+
+        if (kFormats[i].mFormat != _kCFFTPListingFormatUnix) {
+            free(listing);
+            listing = NULL;
+        }
+    }
+
+    // The Unix listing again, a line and a dictionary at a time.
+
+    result = AddResult(aRun, "ftp-listing-lines-unix", "micro");
+    __Require(result != NULL, done);
+
+    listing = CreateLargeListing(_kCFFTPListingFormatUnix, entries, &length);
+    __Require(listing != NULL, done);
+
+    start = Now();
+
+    while (offset < length) {
+        CFDictionaryRef parsed   = NULL;
+        CFIndex         consumed;
+
+        consumed = CFFTPCreateParsedResourceListing(kCFAllocatorDefault, &listing[offset], (CFIndex)(length - offset), &parsed);
+
+        if (parsed != NULL) {
+            CFRelease(parsed);
+            result->mOperations++;
+        }
+
+        __Require(consumed > 0, done);
+
+        offset += (size_t)consumed;
+    }
+
+    result->mSeconds = Now() - start;
+    result->mBytes   = length;
+
+    status = (result->mOperations == entries) ? 0 : -1;
+
+ done:
+    if (listing != NULL) {
+        free(listing);
+    }
+
+    return (status);
+}
+
+// Macrobenchmarks
+
+static void *
+WriterMain(void *aContext)
+{
+    _CFNetworkBenchmarkWriter *writer = aContext;
+    CFWriteStreamRef           stream = NULL;
+    UInt8                     *block  = NULL;
+
+    block = malloc(kCFNetworkBenchmarkSocketBlockSize);
+    __Require(block != NULL, done);
+
+    memset(block, 'x', kCFNetworkBenchmarkSocketBlockSize);
+
+    CFStreamCreatePairWithSocket(kCFAllocatorDefault, writer->mSocket, NULL, &stream);
+    __Require(stream != NULL, done);
+
+    // Closing the stream closes the socket, which ends the reader's
+    // stream.
+
+    CFWriteStreamSetProperty(stream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
+    writer->mSocket = -1;
+
+    __Require(CFWriteStreamOpen(stream), done);
+
+    while (writer->mWritten < writer->mBytes) {
+        CFIndex length = CFWriteStreamWrite(stream, block, kCFNetworkBenchmarkSocketBlockSize);
+
+        if (length <= 0) {
+            break;
+        }
+
+        writer->mWritten += (size_t)length;
+    }
+
+ done:
+    if (stream != NULL) {
+        CFWriteStreamClose(stream);
+        CFRelease(stream);
+    }
+
+    if (writer->mSocket >= 0) {
+        close(writer->mSocket);
+    }
+
+    if (block != NULL) {
+        free(block);
+    }
+
+    return (NULL);
+}
+
+/**
+ *  Stream bytes from a CFWriteStream on one thread to a CFReadStream on
+ *  this one over a TCP connection on the loopback interface.
+ *
+ */
+static int
+BenchmarkSocketStreamLoopback(_CFNetworkBenchmarkRun *aRun)
+{
+    _CFNetworkBenchmarkResult *result;
+    _CFNetworkBenchmarkWriter  writer;
+    struct sockaddr_in         address;
+    socklen_t                  addrlen  = sizeof (address);
+    pthread_t                  thread;
+    Boolean                    started  = FALSE;
+    CFReadStreamRef            stream   = NULL;
+    UInt8                     *buffer   = NULL;
+    UInt64                     bytes    = 0;
+    int                        listener = -1;
+    int                        sockets[2] = { -1, -1 };
+    double                     start;
+    int                        status   = -1;
+
+    memset(&writer, 0, sizeof (writer));
+
+    result = AddResult(aRun, "socket-stream-loopback", "macro");
+    __Require(result != NULL, done);
+
+    buffer = malloc(kCFNetworkBenchmarkSocketBlockSize);
+    __Require(buffer != NULL, done);
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    __Require(listener >= 0, done);
+
+    memset(&address, 0, sizeof (address));
+
+    address.sin_family      = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port        = 0;
+
+    status = bind(listener, (struct sockaddr *)&address, sizeof (address));
+    __Require(status == 0, done);
+
+    status = getsockname(listener, (struct sockaddr *)&address, &addrlen);
+    __Require(status == 0, done);
+
+    status = listen(listener, 1);
+    __Require(status == 0, done);
+
+    status = -1;
+
+    sockets[0] = socket(AF_INET, SOCK_STREAM, 0);
+    __Require(sockets[0] >= 0, done);
+
+    __Require(connect(sockets[0], (struct sockaddr *)&address, sizeof (address)) == 0, done);
+
+    sockets[1] = accept(listener, NULL, NULL);
+    __Require(sockets[1] >= 0, done);
+
+    CFStreamCreatePairWithSocket(kCFAllocatorDefault, sockets[1], &stream, NULL);
+    __Require(stream != NULL, done);
+
+    __Require(CFReadStreamSetProperty(stream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue), done);
+
+    sockets[1] = -1;
+
+    __Require(CFReadStreamOpen(stream), done);
+
+    writer.mSocket = sockets[0];
+    writer.mBytes  = (size_t)kCFNetworkBenchmarkSocketBytes * aRun->mScale;
+
+    sockets[0] = -1;
+
+    start = Now();
+
+    if (pthread_create(&thread, NULL, WriterMain, &writer) != 0) {
+        close(writer.mSocket);
+        goto done;
+    }
+
+    started = TRUE;
+
+    status = ReadToEnd(stream, buffer, kCFNetworkBenchmarkSocketBlockSize, &bytes);
+
+    result->mSeconds = Now() - start;
+
+    pthread_join(thread, NULL);
+    started = FALSE;
+
+    __Require_Action((status == 0) && (bytes == writer.mWritten) && (bytes == writer.mBytes), done, status = -1);
+
+    // Count each block both written and read as one operation.
+
+    result->mBytes      = bytes;
+    result->mOperations = (unsigned long)(bytes / kCFNetworkBenchmarkSocketBlockSize);
+
+ done:
+    if (stream != NULL) {
+        CFReadStreamClose(stream);
+        CFRelease(stream);
+    }
+
+    if (started) {
+        pthread_join(thread, NULL);
+    }
+
+    if (sockets[0] >= 0) {
+        close(sockets[0]);
+    }
+
+    if (sockets[1] >= 0) {
+        close(sockets[1]);
+    }
+
+    if (listener >= 0) {
+        close(listener);
+    }
+
+    if (buffer != NULL) {
+        free(buffer);
+    }
+
+    return (status);
+}
+
+/**
+ *  Issue the same small GETs one at a time, first each on a connection
+ *  of its own and then with persistent connections, so that the cost a
+ *  connection cache hit saves shows up as the difference of the two.
+ *
+ */
+static int
+BenchmarkConnectionCache(_CFNetworkBenchmarkRun *aRun)
+{
+    static const char * const  names[2] = { "connection-cache-fresh", "connection-cache-reused" };
+    _CFNetworkBenchmarkServer  server;
+    const unsigned long        requests = (unsigned long)kCFNetworkBenchmarkConnectionRequests * aRun->mScale;
+    CFURLRef                   url      = NULL;
+    CFStringRef                string   = NULL;
+    UInt8                     *buffer   = NULL;
+    unsigned int               mode;
+    int                        status   = -1;
+
+    status = ServerStart(&server, 2);
+    __Require(status == 0, done);
+
+    status = -1;
+
+    buffer = malloc(kCFNetworkBenchmarkReadSize);
+    __Require(buffer != NULL, done);
+
+    string = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("http://127.0.0.1:%u/"), server.mPort);
+    __Require(string != NULL, done);
+
+    url = CFURLCreateWithString(kCFAllocatorDefault, string, NULL);
+    __Require(url != NULL, done);
+
+    for (mode = 0; mode < 2; mode++) {
+        _CFNetworkBenchmarkResult *result;
+        long                       hits;
+        long                       misses;
+        unsigned long              i;
+        double                     start;
+
+        result = AddResult(aRun, names[mode], "macro");
+        __Require(result != NULL, done);
+
+        GetConnectionCacheCounts(&hits, &misses);
+
+        start = Now();
+
+        for (i = 0; i < requests; i++) {
+            status = Fetch(url, (mode != 0), buffer, kCFNetworkBenchmarkReadSize, &result->mBytes);
+            __Require(status == 0, done);
+        }
+
+        result->mSeconds    = Now() - start;
+        result->mOperations = requests;
+
+        GetConnectionCacheCounts(&result->mCacheHits, &result->mCacheMisses);
+
+        result->mCacheHits   -= hits;
+        result->mCacheMisses -= misses;
+    }
+
+ done:
+    if (url != NULL) {
+        CFRelease(url);
+    }
+
+    if (string != NULL) {
+        CFRelease(string);
+    }
+
+    if (buffer != NULL) {
+        free(buffer);
+    }
+
+    ServerStop(&server);
+
+    return (status);
+}
+
+/**
+ *  GET a document by name, resolved by the stub DNS server, over
+ *  persistent connections, timing each request to the end of its
+ *  response.
+ *
+ */
+static int
+BenchmarkHTTPGet(_CFNetworkBenchmarkRun *aRun)
+{
+    _CFNetworkBenchmarkResult *result;
+    _CFNetworkBenchmarkServer  server;
+    const unsigned long        requests  = (unsigned long)kCFNetworkBenchmarkGetRequests * aRun->mScale;
+    unsigned short             dnsPort   = 0;
+    pid_t                      dns       = -1;
+    CFStringRef                string    = NULL;
+    CFURLRef                   url       = NULL;
+    UInt8                     *buffer    = NULL;
+    double                    *latencies = NULL;
+    unsigned long              i;
+    double                     start;
+    int                        status    = -1;
+
+    status = ServerStart(&server, kCFNetworkBenchmarkGetBodySize);
+    __Require(status == 0, done);
+
+    status = -1;
+
+    result = AddResult(aRun, "http-get", "macro");
+    __Require(result != NULL, done);
+
+    dns = StubServerStart(&dnsPort);
+    __Require(dns > 0, done);
+
+    string = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("127.0.0.1:%u"), dnsPort);
+    __Require(string != NULL, done);
+
+    __Require(CFHostSetProperty(NULL, _kCFHostPropertyResolverServers, string), done);
+
+    CFRelease(string);
+    string = NULL;
+
+    buffer = malloc(kCFNetworkBenchmarkReadSize);
+    __Require(buffer != NULL, done);
+
+    latencies = malloc(requests * sizeof (latencies[0]));
+    __Require(latencies != NULL, done);
+
+    string = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("http://%s:%u/index.html"), kCFNetworkBenchmarkHostName, server.mPort);
+    __Require(string != NULL, done);
+
+    url = CFURLCreateWithString(kCFAllocatorDefault, string, NULL);
+    __Require(url != NULL, done);
+
+    start = Now();
+
+    for (i = 0; i < requests; i++) {
+        const double begin = Now();
+
+        status = Fetch(url, TRUE, buffer, kCFNetworkBenchmarkReadSize, &result->mBytes);
+        __Require(status == 0, done);
+
+        latencies[i] = Now() - begin;
+    }
+
+    result->mSeconds    = Now() - start;
+    result->mOperations = requests;
+
+    qsort(latencies, requests, sizeof (latencies[0]), CompareLatencies);
+
+    result->mLatencyP50 = latencies[requests / 2];
+    result->mLatencyP99 = latencies[(size_t)((requests - 1) * 0.99)];
+
+    status = (result->mBytes == ((UInt64)requests * kCFNetworkBenchmarkGetBodySize)) ? 0 : -1;
+
+ done:
+    if (url != NULL) {
+        CFRelease(url);
+    }
+
+    if (string != NULL) {
+        CFRelease(string);
+    }
+
+    if (latencies != NULL) {
+        free(latencies);
+    }
+
+    if (buffer != NULL) {
+        free(buffer);
+    }
+
+    ServerStop(&server);
+    StubServerStop(dns);
+
+    return (status);
+}
+
+/**
+ *  Make SSL connections one at a time, first forgetting the session
+ *  before each so that every handshake is a full one, then keeping it
+ *  so that every handshake after the first resumes it.  Skipped when
+ *  no certificate is given or the library has no SSL support.
+ *
+ */
+static int
+BenchmarkSSLHandshake(_CFNetworkBenchmarkRun *aRun)
+{
+    static const char * const  names[2]  = { "ssl-handshake-full", "ssl-handshake-resumed" };
+    const unsigned long        handshakes = (unsigned long)kCFNetworkBenchmarkHandshakes * aRun->mScale;
+    CFMutableDictionaryRef     settings  = NULL;
+    UInt8                     *buffer    = NULL;
+    UInt16                     port      = 0;
+    pid_t                      server    = -1;
+    Boolean                    resumed;
+    UInt64                     bytes     = 0;
+    unsigned int               mode;
+    int                        status    = 0;
+
+    if ((aRun->mCertificate == NULL) || (access(aRun->mCertificate, R_OK) != 0)) {
+        __CFNetworkBenchmarkLog("%-24s skipped, no certificate\n", "ssl-handshake");
+        goto done;
+    }
+
+    status = GetFreePort(&port);
+    __Require(status == 0, done);
+
+    status = 0;
+
+    server = SSLServerStart(aRun->mCertificate, port);
+    __Require_Action(server > 0, done, __CFNetworkBenchmarkLog("%-24s skipped, no openssl s_server\n", "ssl-handshake"));
+
+    status = -1;
+
+    buffer = malloc(kCFNetworkBenchmarkReadSize);
+    __Require(buffer != NULL, done);
+
+    // The certificate is self-signed, so only the name is checked.
+
+    settings = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    __Require(settings != NULL, done);
+
+    CFDictionarySetValue(settings, kCFStreamSSLLevel, kCFStreamSocketSecurityLevelNegotiatedSSL);
+    CFDictionarySetValue(settings, kCFStreamSSLPeerName, CFSTR(kCFNetworkBenchmarkHostName));
+    CFDictionarySetValue(settings, kCFStreamSSLValidatesCertificateChain, kCFBooleanFalse);
+
+    // Warm up, which also learns whether there is SSL support at all.
+
+    status = SSLFetch(CFSTR("127.0.0.1"), port, settings, buffer, kCFNetworkBenchmarkReadSize, &bytes, &resumed);
+
+    if (status == 1) {
+        __CFNetworkBenchmarkLog("%-24s skipped, no SSL support\n", "ssl-handshake");
+        status = 0;
+        goto done;
+    }
+
+    __Require(status == 0, done);
+
+    for (mode = 0; mode < 2; mode++) {
+        _CFNetworkBenchmarkResult *result;
+        unsigned long              i;
+        double                     start;
+
+        result = AddResult(aRun, names[mode], "macro");
+        __Require_Action(result != NULL, done, status = -1);
+
+        result->mResumed = 0;
+
+        start = Now();
+
+        for (i = 0; i < handshakes; i++) {
+#if defined(__MACH__)
+            if (mode == 0) {
+                _CFSocketStreamFlushSSLSessionCache();
+            }
+#endif
+
+            status = SSLFetch(CFSTR("127.0.0.1"), port, settings, buffer, kCFNetworkBenchmarkReadSize, &result->mBytes, &resumed);
+            __Require(status == 0, done);
+
+            result->mResumed += resumed ? 1 : 0;
+        }
+
+        result->mSeconds    = Now() - start;
+        result->mOperations = handshakes;
+    }
+
+ done:
+    if (settings != NULL) {
+        CFRelease(settings);
+    }
+
+    if (buffer != NULL) {
+        free(buffer);
+    }
+
+    SSLServerStop(server);
+
+    return (status);
+}
+
+/**
+ *  Connect a pair of TCP sockets over the loopback interface.
+ *
+ */
+static int
+ConnectLoopback(int aSockets[2])
+{
+    struct sockaddr_in address;
+    socklen_t          addrlen  = sizeof (address);
+    int                listener = -1;
+    int                status   = -1;
+
+    aSockets[0] = aSockets[1] = -1;
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    __Require(listener >= 0, done);
+
+    memset(&address, 0, sizeof (address));
+
+    address.sin_family      = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port        = 0;
+
+    __Require(bind(listener, (struct sockaddr *)&address, sizeof (address)) == 0, done);
+    __Require(getsockname(listener, (struct sockaddr *)&address, &addrlen) == 0, done);
+    __Require(listen(listener, 1) == 0, done);
+
+    aSockets[0] = socket(AF_INET, SOCK_STREAM, 0);
+    __Require(aSockets[0] >= 0, done);
+
+    __Require(connect(aSockets[0], (struct sockaddr *)&address, sizeof (address)) == 0, done);
+
+    aSockets[1] = accept(listener, NULL, NULL);
+    __Require(aSockets[1] >= 0, done);
+
+    status = 0;
+
+ done:
+    if (status != 0) {
+        if (aSockets[0] >= 0) {
+            close(aSockets[0]);
+        }
+
+        if (aSockets[1] >= 0) {
+            close(aSockets[1]);
+        }
+
+        aSockets[0] = aSockets[1] = -1;
+    }
+
+    if (listener >= 0) {
+        close(listener);
+    }
+
+    return (status);
+}
+
+/**
+ *  Send the time, as a message of its own, at a steady interval, then
+ *  close the connection.
+ *
+ */
+static void *
+TickerMain(void *aContext)
+{
+    _CFNetworkBenchmarkTicker *ticker   = aContext;
+    const long                 interval = (long)(kCFNetworkBenchmarkCallbackInterval * 1e9);
+
+    while (ticker->mSent < ticker->mMessages) {
+        const struct timespec delay = { 0, interval };
+        const double          now   = Now();
+
+        if (write(ticker->mSocket, &now, sizeof (now)) != sizeof (now)) {
+            break;
+        }
+
+        ticker->mSent++;
+
+        nanosleep(&delay, NULL);
+    }
+
+    close(ticker->mSocket);
+
+    return (NULL);
+}
+
+/**
+ *  Keep the main run loop busy, as an application doing its own work
+ *  on it would.
+ *
+ */
+static void
+BusyTimerCallBack(CFRunLoopTimerRef aTimer, void *aInfo)
+{
+    const double until = Now() + kCFNetworkBenchmarkBusySlice;
+
+    (void)aTimer;
+    (void)aInfo;
+
+    while (Now() < until) {
+        continue;
+    }
+}
+
+/**
+ *  Take whatever messages have arrived, timing each from when it was
+ *  sent to this callback.
+ *
+ */
+static void
+ReceiverCallBack(CFReadStreamRef aStream, CFStreamEventType aType, void *aInfo)
+{
+    _CFNetworkBenchmarkReceiver *receiver = aInfo;
+
+    if (aType == kCFStreamEventHasBytesAvailable) {
+        const double now = Now();
+        UInt8        buffer[kCFNetworkBenchmarkReadSize];
+        CFIndex      length;
+        CFIndex      i;
+
+        length = CFReadStreamRead(aStream, buffer, sizeof (buffer));
+
+        if (length < 0) {
+            receiver->mFailed = TRUE;
+            receiver->mDone   = TRUE;
+            return;
+        }
+
+        receiver->mBytes += (UInt64)length;
+
+        for (i = 0; i < length; i++) {
+            receiver->mPartial[receiver->mPartialLength++] = buffer[i];
+
+            if (receiver->mPartialLength == sizeof (double)) {
+                double sent;
+
+                memcpy(&sent, receiver->mPartial, sizeof (sent));
+                receiver->mPartialLength = 0;
+
+                if (receiver->mReceived < receiver->mMessages) {
+                    receiver->mLatencies[receiver->mReceived++] = now - sent;
+                }
+            }
+        }
+    } else if (aType == kCFStreamEventEndEncountered) {
+        receiver->mDone = TRUE;
+    } else if (aType == kCFStreamEventErrorOccurred) {
+        receiver->mFailed = TRUE;
+        receiver->mDone   = TRUE;
+    }
+}
+
+/**
+ *  Time stream callbacks on a main run loop kept busy by a timer, from
+ *  when each message is sent to when the callback has it, first with
+ *  the socket stream scheduled on the main run loop itself and then
+ *  with it read on a background network run loop and its events
+ *  handed over to the main one.
+ *
+ */
+static int
+BenchmarkCallbackLatency(_CFNetworkBenchmarkRun *aRun)
+{
+    static const char * const  names[2] = { "callback-latency-direct", "callback-latency-io-run-loop" };
+    const unsigned long        messages = (unsigned long)kCFNetworkBenchmarkCallbackMessages * aRun->mScale;
+    CFRunLoopTimerRef          timer    = NULL;
+    double                    *latencies = NULL;
+    unsigned int               mode;
+    int                        status   = -1;
+
+    latencies = malloc(messages * sizeof (latencies[0]));
+    __Require(latencies != NULL, done);
+
+    timer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent(), kCFNetworkBenchmarkBusyInterval, 0, 0, BusyTimerCallBack, NULL);
+    __Require(timer != NULL, done);
+
+    for (mode = 0; mode < 2; mode++) {
+        _CFNetworkBenchmarkResult   *result;
+        _CFNetworkBenchmarkTicker    ticker;
+        _CFNetworkBenchmarkReceiver  receiver;
+        CFStreamClientContext        context  = { 0, &receiver, NULL, NULL, NULL };
+        CFReadStreamRef              socket   = NULL;
+        CFReadStreamRef              stream   = NULL;
+        pthread_t                    thread;
+        Boolean                      started  = FALSE;
+        int                          sockets[2];
+        double                       start;
+
+        status = -1;
+
+        memset(&ticker, 0, sizeof (ticker));
+        memset(&receiver, 0, sizeof (receiver));
+
+        receiver.mLatencies = latencies;
+        receiver.mMessages  = messages;
+
+        result = AddResult(aRun, names[mode], "macro");
+        __Require(result != NULL, next);
+
+        __Require(ConnectLoopback(sockets) == 0, next);
+
+        CFStreamCreatePairWithSocket(kCFAllocatorDefault, sockets[1], &socket, NULL);
+        __Require_Action(socket != NULL, next, close(sockets[0]); close(sockets[1]));
+
+        CFReadStreamSetProperty(socket, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
+
+        stream = (mode == 0) ? (CFReadStreamRef)CFRetain(socket) : _CFReadStreamCreateWithIORunLoop(kCFAllocatorDefault, socket);
+        __Require_Action(stream != NULL, next, close(sockets[0]));
+
+        __Require_Action(CFReadStreamSetClient(stream, kCFStreamEventHasBytesAvailable | kCFStreamEventEndEncountered | kCFStreamEventErrorOccurred, ReceiverCallBack, &context), next, close(sockets[0]));
+
+        CFReadStreamScheduleWithRunLoop(stream, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+
+        __Require_Action(CFReadStreamOpen(stream), next, close(sockets[0]));
+
+        ticker.mSocket   = sockets[0];
+        ticker.mMessages = messages;
+
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(), timer, kCFRunLoopDefaultMode);
+
+        start = Now();
+
+        if (pthread_create(&thread, NULL, TickerMain, &ticker) != 0) {
+            close(ticker.mSocket);
+            goto next;
+        }
+
+        started = TRUE;
+
+        while (!receiver.mDone) {
+            CFRunLoopRunInMode(kCFRunLoopDefaultMode, 1.0, TRUE);
+        }
+
+        result->mSeconds = Now() - start;
+
+        pthread_join(thread, NULL);
+        started = FALSE;
+
+        __Require(!receiver.mFailed && (receiver.mReceived == messages) && (ticker.mSent == messages), next);
+
+        qsort(latencies, messages, sizeof (latencies[0]), CompareLatencies);
+
+        result->mOperations = messages;
+        result->mBytes      = receiver.mBytes;
+        result->mLatencyP50 = latencies[messages / 2];
+        result->mLatencyP99 = latencies[(size_t)((messages - 1) * 0.99)];
+
+        status = 0;
+
+    next:
+        CFRunLoopRemoveTimer(CFRunLoopGetCurrent(), timer, kCFRunLoopDefaultMode);
+
+        if (stream != NULL) {
+            CFReadStreamSetClient(stream, kCFStreamEventNone, NULL, NULL);
+            CFReadStreamUnscheduleFromRunLoop(stream, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+            CFReadStreamClose(stream);
+            CFRelease(stream);
+        }
+
+        if (socket != NULL) {
+            CFRelease(socket);
+        }
+
+        if (started) {
+            pthread_join(thread, NULL);
+        }
+
+        __Require(status == 0, done);
+    }
+
+ done:
+    if (timer != NULL) {
+        CFRunLoopTimerInvalidate(timer);
+        CFRelease(timer);
+    }
+
+    if (latencies != NULL) {
+        free(latencies);
+    }
+
+    return (status);
+}
+
+static const _CFNetworkBenchmark sBenchmarks[] = {
+    { "http-message-parse",     BenchmarkHTTPMessageParse     },
+    { "http-filter-chunked",    BenchmarkHTTPFilterChunked    },
+    { "http-message-arena",     BenchmarkHTTPMessageArena     },
+    { "ftp-listing-parse",      BenchmarkFTPListingParse      },
+    { "ftp-listing-bulk",       BenchmarkFTPListingBulk       },
+    { "socket-stream-loopback", BenchmarkSocketStreamLoopback },
+    { "connection-cache",       BenchmarkConnectionCache      },
+    { "http-get",               BenchmarkHTTPGet              },
+    { "ssl-handshake",          BenchmarkSSLHandshake         },
+    { "callback-latency",       BenchmarkCallbackLatency      }
+};
+
+// Report
+
+static void
+WriteResult(FILE *aFile, const _CFNetworkBenchmarkResult *aResult, Boolean aFirst)
+{
+    const double seconds = aResult->mSeconds;
+
+    fprintf(aFile, "%s\n    {\n", aFirst ? "" : ",");
+    fprintf(aFile, "      \"name\": \"%s\",\n", aResult->mName);
+    fprintf(aFile, "      \"kind\": \"%s\",\n", aResult->mKind);
+    fprintf(aFile, "      \"operations\": %lu,\n", aResult->mOperations);
+    fprintf(aFile, "      \"bytes\": %llu,\n", (unsigned long long)aResult->mBytes);
+    fprintf(aFile, "      \"seconds\": %.9f,\n", seconds);
+    fprintf(aFile, "      \"operations_per_second\": %.3f,\n", (seconds > 0) ? (aResult->mOperations / seconds) : 0.0);
+    fprintf(aFile, "      \"bytes_per_second\": %.3f", (seconds > 0) ? (aResult->mBytes / seconds) : 0.0);
+
+    if (aResult->mLatencyP50 >= 0) {
+        fprintf(aFile, ",\n      \"latency_p50_ms\": %.6f", aResult->mLatencyP50 * 1e3);
+        fprintf(aFile, ",\n      \"latency_p99_ms\": %.6f", aResult->mLatencyP99 * 1e3);
+    }
+
+    if (aResult->mCacheHits >= 0) {
+        fprintf(aFile, ",\n      \"connection_cache_hits\": %ld", aResult->mCacheHits);
+        fprintf(aFile, ",\n      \"connection_cache_misses\": %ld", aResult->mCacheMisses);
+    }
+
+    if (aResult->mResumed >= 0) {
+        fprintf(aFile, ",\n      \"ssl_sessions_resumed\": %ld", aResult->mResumed);
+    }
+
+    if (aResult->mAllocations >= 0) {
+        fprintf(aFile, ",\n      \"allocations\": %ld", aResult->mAllocations);
+    }
+
+    fprintf(aFile, "\n    }");
+}
+
+// Driver
+
+/**
+ *  Run one benchmark the requested number of times, keeping for each
+ *  of its measurements the fastest run.
+ *
+ */
+static int
+RunBenchmark(const _CFNetworkBenchmark *aBenchmark, unsigned int aScale, const char *aCertificate, unsigned int aRepetitions, _CFNetworkBenchmarkRun *aBest)
+{
+    unsigned int repetition;
+    int          status = -1;
+
+    memset(aBest, 0, sizeof (*aBest));
+
+    for (repetition = 0; repetition < aRepetitions; repetition++) {
+        _CFNetworkBenchmarkRun run;
+        unsigned int           i;
+
+        memset(&run, 0, sizeof (run));
+        run.mScale       = aScale;
+        run.mCertificate = aCertificate;
+
+        status = aBenchmark->mFunction(&run);
+        __Require(status == 0, done);
+
+        for (i = 0; i < run.mCount; i++) {
+            if ((i >= aBest->mCount) || (run.mResults[i].mSeconds < aBest->mResults[i].mSeconds)) {
+                aBest->mResults[i] = run.mResults[i];
+            }
+        }
+
+        aBest->mCount = run.mCount;
+    }
+
+    for (repetition = 0; repetition < aBest->mCount; repetition++) {
+        const _CFNetworkBenchmarkResult *result = &aBest->mResults[repetition];
+
+        __CFNetworkBenchmarkLog("%-24s %lu ops in %.3f s\n", result->mName, result->mOperations, result->mSeconds);
+    }
+
+ done:
+    if (status != 0) {
+        __CFNetworkBenchmarkLog("%-24s failed\n", aBenchmark->mName);
+    }
+
+    return (status);
+}
+
+static void
+Usage(const char *aProgram)
+{
+    __CFNetworkBenchmarkLog("Usage: %s [ -b <benchmark> ] [ -c <certificate and key> ] [ -o <output file> ] [ -r <repetitions> ] [ -s <scale> ]\n", aProgram);
+}
+
+int
+main(int argc, char * const argv[])
+{
+    const size_t  count       = sizeof (sBenchmarks) / sizeof (sBenchmarks[0]);
+    const char   *filter      = NULL;
+    const char   *certificate = NULL;
+    const char   *path        = NULL;
+    unsigned int  repetitions = kCFNetworkBenchmarkDefaultRepetitions;
+    unsigned int  scale       = kCFNetworkBenchmarkDefaultScale;
+    Boolean       first       = TRUE;
+    FILE         *file        = stdout;
+    size_t        i;
+    int           c;
+    int           status      = -1;
+
+    while ((c = getopt(argc, argv, "b:c:o:r:s:")) != -1) {
+        switch (c) {
+
+        case 'b':
+            filter = optarg;
+            break;
+
+        case 'c':
+            certificate = optarg;
+            break;
+
+        case 'o':
+            path = optarg;
+            break;
+
+        case 'r':
+            repetitions = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+
+        case 's':
+            scale = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+
+        default:
+            Usage(argv[0]);
+            goto done;
+
+        }
+    }
+
+    __Require_Action((repetitions > 0) && (scale > 0), done, Usage(argv[0]));
+
+    if (path != NULL) {
+        file = fopen(path, "w");
+        __Require_Action(file != NULL, done, __CFNetworkBenchmarkLog("%s: %s\n", path, strerror(errno)));
+    }
+
+    // A peer that gave up early must not take this process down with
+    // SIGPIPE.
+
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"suite\": \"CFNetworkBenchmark\",\n");
+    fprintf(file, "  \"version\": 1,\n");
+    fprintf(file, "  \"timestamp\": %ld,\n", (long)time(NULL));
+    fprintf(file, "  \"scale\": %u,\n", scale);
+    fprintf(file, "  \"repetitions\": %u,\n", repetitions);
+    fprintf(file, "  \"benchmarks\": [");
+
+    status = 0;
+
+    for (i = 0; i < count; i++) {
+        _CFNetworkBenchmarkRun best;
+        unsigned int           j;
+
+        if ((filter != NULL) && (strcmp(filter, sBenchmarks[i].mName) != 0)) {
+            continue;
+        }
+
+        status = RunBenchmark(&sBenchmarks[i], scale, certificate, repetitions, &best);
+        __Require(status == 0, finish);
+
+        for (j = 0; j < best.mCount; j++) {
+            WriteResult(file, &best.mResults[j], first);
+            first = FALSE;
+        }
+    }
+
+ finish:
+    fprintf(file, "\n  ]\n}\n");
+
+    if (file != stdout) {
+        fclose(file);
+    }
+
+ done:
+    return ((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,286 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements a microbenchmark of CFSocketStream
+ *     (CFReadStreamRead) reads of small messages over a local socket
+ *     pair, comparing reads per second when each read goes straight
+ *     to the socket and when reads are served from the stream's
+ *     receive buffer.
+ *
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <AssertMacros.h>
+
+#include <CFNetwork/CFNetwork.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#define __CFSocketStreamBenchmarkLog(format, ...)   do { fprintf(stderr, format, ##__VA_ARGS__); fflush(stderr); } while (0)
+
+#define kCFSocketStreamBenchmarkDefaultMessages     200000
+#define kCFSocketStreamBenchmarkDefaultSize         64
+#define kCFSocketStreamBenchmarkDefaultBufferSize   32768
+
+// SPI from CFSocketStream.c, which is not exported.
+
+#define _kCFStreamPropertyRecvBufferSize            CFSTR("_kCFStreamPropertyRecvBufferSize")
+
+// Writer
+
+/**
+ *  Write the requested number of fixed-size messages to the socket,
+ *  then shut it down so that the reader sees end-of-stream.
+ *
+ */
+static void
+WriterMain(int aSocket, unsigned int aMessages, size_t aSize)
+{
+    unsigned char *message;
+    unsigned int   i;
+
+    message = malloc(aSize);
+    __Require(message != NULL, done);
+
+    memset(message, 'x', aSize);
+
+    for (i = 0; i < aMessages; i++) {
+        size_t offset = 0;
+
+        while (offset < aSize) {
+            ssize_t written = write(aSocket, message + offset, aSize - offset);
+
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                goto done;
+            }
+
+            offset += (size_t)written;
+        }
+    }
+
+ done:
+    if (message != NULL) {
+        free(message);
+    }
+
+    shutdown(aSocket, SHUT_WR);
+}
+
+static pid_t
+WriterStart(int aSocket, unsigned int aMessages, size_t aSize)
+{
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        WriterMain(aSocket, aMessages, aSize);
+        _exit(EXIT_SUCCESS);
+    }
+
+    return (pid);
+}
+
+static void
+WriterStop(pid_t aPid)
+{
+    if (aPid > 0) {
+        kill(aPid, SIGTERM);
+        waitpid(aPid, NULL, 0);
+    }
+}
+
+// Benchmark
+
+static int
+RunBenchmark(const char *aDescription, CFIndex aBufferSize, unsigned int aMessages, size_t aSize)
+{
+    int              sockets[2] = { -1, -1 };
+    pid_t            writer     = -1;
+    CFReadStreamRef  stream     = NULL;
+    CFNumberRef      number     = NULL;
+    UInt8           *buffer     = NULL;
+    unsigned long    total      = 0;
+    unsigned long    expected   = (unsigned long)aMessages * aSize;
+    unsigned int     reads      = 0;
+    CFAbsoluteTime   start;
+    CFTimeInterval   elapsed;
+    Boolean          result;
+    int              status     = -1;
+
+    buffer = malloc(aSize);
+    __Require(buffer != NULL, done);
+
+    status = socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+    __Require(status == 0, done);
+
+    status = -1;
+
+    CFStreamCreatePairWithSocket(kCFAllocatorDefault, sockets[0], &stream, NULL);
+    __Require(stream != NULL, done);
+
+    result = CFReadStreamSetProperty(stream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
+    __Require(result, done);
+
+    sockets[0] = -1;
+
+    if (aBufferSize > 0) {
+        number = CFNumberCreate(kCFAllocatorDefault, kCFNumberCFIndexType, &aBufferSize);
+        __Require(number != NULL, done);
+
+        result = CFReadStreamSetProperty(stream, _kCFStreamPropertyRecvBufferSize, number);
+        __Require(result, done);
+    }
+
+    result = CFReadStreamOpen(stream);
+    __Require(result, done);
+
+    writer = WriterStart(sockets[1], aMessages, aSize);
+    __Require(writer > 0, done);
+
+    close(sockets[1]);
+    sockets[1] = -1;
+
+    start = CFAbsoluteTimeGetCurrent();
+
+    // Read one message's worth at a time, as a message-oriented
+    // client would, until the writer closes its end.
+
+    while (TRUE) {
+        CFIndex length = CFReadStreamRead(stream, buffer, aSize);
+
+        if (length <= 0) {
+            break;
+        }
+
+        total += (unsigned long)length;
+        reads++;
+    }
+
+    elapsed = CFAbsoluteTimeGetCurrent() - start;
+
+    __CFSocketStreamBenchmarkLog("%-12s %lu bytes in %u reads of %zu: %.3f s, %.0f reads/sec, %.1f MB/s\n",
+                                 aDescription,
+                                 total,
+                                 reads,
+                                 aSize,
+                                 elapsed,
+                                 (elapsed > 0) ? (reads / elapsed) : 0.0,
+                                 (elapsed > 0) ? ((total / elapsed) / (1024.0 * 1024.0)) : 0.0);
+
+    status = (total == expected) ? 0 : -1;
+
+ done:
+    WriterStop(writer);
+
+    if (stream != NULL) {
+        CFReadStreamClose(stream);
+        CFRelease(stream);
+    }
+
+    if (number != NULL) {
+        CFRelease(number);
+    }
+
+    if (sockets[0] >= 0) {
+        close(sockets[0]);
+    }
+
+    if (sockets[1] >= 0) {
+        close(sockets[1]);
+    }
+
+    if (buffer != NULL) {
+        free(buffer);
+    }
+
+    return (status);
+}
+
+static void
+Usage(const char *aProgram)
+{
+    __CFSocketStreamBenchmarkLog("Usage: %s [ -n <messages> ] [ -s <message size> ] [ -b <buffer size> ]\n", aProgram);
+}
+
+int
+main(int argc, char * const argv[])
+{
+    unsigned int messages   = kCFSocketStreamBenchmarkDefaultMessages;
+    size_t       size       = kCFSocketStreamBenchmarkDefaultSize;
+    CFIndex      bufferSize = kCFSocketStreamBenchmarkDefaultBufferSize;
+    int          c;
+    int          status     = -1;
+
+    while ((c = getopt(argc, argv, "b:n:s:")) != -1) {
+        switch (c) {
+
+        case 'b':
+            bufferSize = (CFIndex)strtol(optarg, NULL, 0);
+            break;
+
+        case 'n':
+            messages = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+
+        case 's':
+            size = (size_t)strtoul(optarg, NULL, 0);
+            break;
+
+        default:
+            Usage(argv[0]);
+            goto done;
+
+        }
+    }
+
+    __Require_Action((messages > 0) && (size > 0) && (bufferSize > 0), done, Usage(argv[0]));
+
+    // The writer exits on its own; don't let a reader that gave up
+    // early take this process down with SIGPIPE.
+
+    signal(SIGPIPE, SIG_IGN);
+
+    status = RunBenchmark("unbuffered", 0, messages, size);
+    __Require(status == 0, done);
+
+    status = RunBenchmark("buffered", bufferSize, messages, size);
+    __Require(status == 0, done);
+
+ done:
+    return ((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,252 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements a test of the CFNetwork bulk FTP listing
+ *     parser: that Unix "ls -l", DOS and MLSD listings are detected
+ *     and parsed into the expected names, types, sizes, links, owners
+ *     and dates, and that malformed lines in each, such as impossible
+ *     months and days, truncated lines and broken MLSD facts, are
+ *     dropped rather than made into entries.
+ *
+ */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <AssertMacros.h>
+
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFFTPStreamPriv.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#define __CFFTPListingTestLog(format, ...)   do { fprintf(stderr, format, ##__VA_ARGS__); fflush(stderr); } while (0)
+
+#define kNoSize                         ((UInt64)-1)
+
+typedef struct {
+    const char *mName;
+    UInt8       mType;
+    UInt64      mSize;      // kNoSize if none is listed
+    const char *mLink;      // NULL unless a link
+    const char *mOwner;     // NULL if none is listed
+} Expected;
+
+static const char kUnixListing[] =
+    "total 12\r\n"
+    "drwxr-xr-x   2 ftp      ftp          4096 Jan 10 12:34 pub\r\n"
+    "-rw-r--r--   1 ftp      ftp        104857 Jan 10  2020 README.txt\r\n"
+    "lrwxrwxrwx   1 ftp      ftp            10 Jan 10  2020 latest -> README.txt\r\n"
+    "-rw-r--r--   1 ftp      ftp           100 Foo 10  2020 bad-month\r\n"
+    "-rw-r--r--   1 ftp      ftp           100 Jan 32  2020 bad-day\r\n"
+    "-rw-r--r--   1 ftp      ftp           100 Jan  0  2020 zero-day\r\n"
+    "-rw-r--r--   1 ftp      ftp\r\n";
+
+static const Expected kUnixEntries[] = {
+    { "pub",        DT_DIR, 4096,   NULL,         "ftp" },
+    { "README.txt", DT_REG, 104857, NULL,         "ftp" },
+    { "latest",     DT_LNK, 10,     "README.txt", "ftp" }
+};
+
+static const char kDOSListing[] =
+    "01-10-20  12:34PM       <DIR>          pub\r\n"
+    "01-10-2020  09:05AM           104,857 README.txt\r\n"
+    "13-10-20  12:34PM                 100 bad-month\r\n"
+    "00-10-20  12:34PM                 100 zero-month\r\n"
+    "01-32-20  12:34PM                 100 bad-day\r\n"
+    "01-00-20  12:34PM                 100 zero-day\r\n"
+    "01-10-20  25:34                   100 bad-hour\r\n"
+    "01-10-20  12:60PM                 100 bad-minute\r\n"
+    "01-10-20  12:34PM       <DIR>\r\n"
+    "01-10-20  12:34PM\r\n";
+
+static const Expected kDOSEntries[] = {
+    { "pub",        DT_DIR, kNoSize, NULL, NULL },
+    { "README.txt", DT_REG, 104857,  NULL, NULL }
+};
+
+static const char kMLSDListing[] =
+    "type=cdir;modify=20200110123400; .\r\n"
+    "type=pdir;modify=20200110123400; ..\r\n"
+    "type=dir;modify=20200110123400;UNIX.mode=0755; pub\r\n"
+    "type=file;size=104857;modify=20200110090500;UNIX.mode=0644;UNIX.owner=ftp; README.txt\r\n"
+    "type=OS.unix=slink:README.txt;modify=20200110090500; latest\r\n"
+    "type=file;size=100 no-semicolon\r\n"
+    "type=file;size=100;no-space\r\n"
+    "type=file;sizeonly; no-equals\r\n"
+    "type=file;size=100;\r\n";
+
+static const Expected kMLSDEntries[] = {
+    { "pub",        DT_DIR,     kNoSize, NULL,         NULL  },
+    { "README.txt", DT_REG,     104857,  NULL,         "ftp" },
+    { "latest",     DT_LNK,     kNoSize, "README.txt", NULL  }
+};
+
+static Boolean
+BytesEqual(const UInt8 *aBytes, UInt32 aLength, const char *aString)
+{
+    return ((aLength == strlen(aString)) && (memcmp(aBytes, aString, aLength) == 0));
+}
+
+/**
+ *  Return the time of a date in the given time zone, or in UTC if
+ *  it is NULL.
+ *
+ */
+static CFAbsoluteTime
+DateTime(SInt32 aYear, SInt8 aMonth, SInt8 aDay, SInt8 aHour, SInt8 aMinute, CFTimeZoneRef aTimeZone)
+{
+    CFGregorianDate date;
+
+    date.year   = aYear;
+    date.month  = aMonth;
+    date.day    = aDay;
+    date.hour   = aHour;
+    date.minute = aMinute;
+    date.second = 0;
+
+    return (CFGregorianDateGetAbsoluteTime(date, aTimeZone));
+}
+
+/**
+ *  Parse the listing, detecting its format, and check that it came
+ *  out as expected, with the modification date of "README.txt".
+ *
+ */
+static int
+Expect(const char *aDescription, const char *aListing, UInt32 aFormat, const Expected *anExpected, CFIndex aCount, CFAbsoluteTime aModDate)
+{
+    _CFFTPListingRef          listing;
+    const _CFFTPListingEntry *entries;
+    const UInt8              *bytes;
+    CFIndex                   i;
+    int                       status   = -1;
+
+    listing = _CFFTPListingCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)aListing, strlen(aListing), _kCFFTPListingFormatUnknown);
+    __Require(listing != NULL, done);
+
+    __Require(_CFFTPListingGetFormat(listing) == aFormat, done);
+    __Require(_CFFTPListingGetCount(listing) == aCount, done);
+
+    entries = _CFFTPListingGetEntries(listing);
+    bytes   = _CFFTPListingGetBytes(listing);
+
+    for (i = 0; i < aCount; i++) {
+        const _CFFTPListingEntry *entry    = &entries[i];
+        const Expected           *expected = &anExpected[i];
+
+        __Require(BytesEqual(bytes + entry->name, entry->nameLength, expected->mName), done);
+
+        __Require(entry->type == expected->mType, done);
+
+        if (expected->mSize == kNoSize) {
+            __Require(!(entry->flags & _kCFFTPListingEntryHasSize), done);
+        } else {
+            __Require(entry->flags & _kCFFTPListingEntryHasSize, done);
+            __Require(entry->size == expected->mSize, done);
+        }
+
+        if (expected->mLink == NULL) {
+            __Require(entry->linkLength == 0, done);
+        } else {
+            __Require(BytesEqual(bytes + entry->link, entry->linkLength, expected->mLink), done);
+        }
+
+        if (expected->mOwner == NULL) {
+            __Require(entry->owner == -1, done);
+        } else {
+            CFStringRef owner = _CFFTPListingGetUserName(listing, entry->owner);
+            CFStringRef name  = CFStringCreateWithCString(kCFAllocatorDefault, expected->mOwner, kCFStringEncodingUTF8);
+            Boolean     equal = (owner != NULL) && (name != NULL) && CFEqual(owner, name);
+
+            if (name != NULL) {
+                CFRelease(name);
+            }
+
+            __Require(equal, done);
+        }
+
+        __Require(entry->flags & _kCFFTPListingEntryHasModDate, done);
+
+        if (strcmp(expected->mName, "README.txt") == 0) {
+            __Require(entry->modDate == aModDate, done);
+        }
+    }
+
+    status = 0;
+
+ done:
+    if (listing != NULL) {
+        CFRelease(listing);
+    }
+
+    __CFFTPListingTestLog("%-40s %s\n", aDescription, (status == 0) ? "passed" : "FAILED");
+
+    return (status);
+}
+
+int
+main(void)
+{
+    CFTimeZoneRef timeZone;
+    int           status   = -1;
+
+    timeZone = CFTimeZoneCopyDefault();
+    __Require(timeZone != NULL, done);
+
+    status = Expect("Unix, malformed lines dropped",
+                    kUnixListing,
+                    _kCFFTPListingFormatUnix,
+                    kUnixEntries,
+                    sizeof (kUnixEntries) / sizeof (kUnixEntries[0]),
+                    DateTime(2020, 1, 10, 0, 0, timeZone));
+    __Require(status == 0, done);
+
+    status = Expect("DOS, malformed lines dropped",
+                    kDOSListing,
+                    _kCFFTPListingFormatDOS,
+                    kDOSEntries,
+                    sizeof (kDOSEntries) / sizeof (kDOSEntries[0]),
+                    DateTime(2020, 1, 10, 9, 5, timeZone));
+    __Require(status == 0, done);
+
+    // MLSD dates are always in UTC.
+
+    status = Expect("MLSD, malformed lines dropped",
+                    kMLSDListing,
+                    _kCFFTPListingFormatMLSD,
+                    kMLSDEntries,
+                    sizeof (kMLSDEntries) / sizeof (kMLSDEntries[0]),
+                    DateTime(2020, 1, 10, 9, 5, NULL));
+    __Require(status == 0, done);
+
+ done:
+    if (timeZone != NULL) {
+        CFRelease(timeZone);
+    }
+
+    return ((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,628 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements a test of the CFNetwork segmented FTP
+ *     download against a loopback server which reports each REST and
+ *     RETR it sees: that a file fetched over several segments reads
+ *     back in order, that a segment whose data connection is dropped
+ *     partway is retried from where it stopped, and that a server
+ *     which refuses REST has the whole file read over one stream.
+ *
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <AssertMacros.h>
+
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFFTPStreamPriv.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "TestSupport.h"
+
+#define __CFFTPSegmentedStreamTestLog(format, ...)   do { fprintf(stderr, format, ##__VA_ARGS__); fflush(stderr); } while (0)
+
+// The file divides into exactly kSegmentCount segments of the
+// stream's 256 KiB minimum.
+
+#define kFileSize           (1024 * 1024)
+#define kSegmentCount       4
+#define kSegmentLength      (kFileSize / kSegmentCount)
+
+// In kModeDrop, the first transfer of the last segment stops after
+// kDropLength bytes.
+
+#define kDropOffset         (kFileSize - kSegmentLength)
+#define kDropLength         (100 * 1024)
+
+#define kTimeout            30.0
+
+enum {
+    kModeNormal,
+    kModeDrop,
+    kModeRefuseRest
+};
+
+/**
+ *  What every connection to one server shares: its mode and, in
+ *  memory shared by all of its children, whether kModeDrop has
+ *  dropped its transfer yet.
+ *
+ */
+typedef struct {
+    int           mMode;
+    volatile int *mDropped;
+} ServerState;
+
+static UInt8
+PatternByte(long long anOffset)
+{
+    return ((UInt8)(anOffset ^ (anOffset >> 8) ^ (anOffset >> 16)));
+}
+
+// Server
+
+static Boolean
+WriteString(int aSocket, const char *aString)
+{
+    return (WriteAll(aSocket, aString, strlen(aString)));
+}
+
+/**
+ *  Read one CRLF-terminated command, without the CRLF.
+ *
+ */
+static Boolean
+ReadLine(int aSocket, char *aLine, size_t aSize)
+{
+    size_t length = 0;
+
+    while (length < aSize - 1) {
+        char    c;
+        ssize_t received = read(aSocket, &c, 1);
+
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (received <= 0) {
+            return (FALSE);
+        }
+
+        if (c == '\n') {
+            if (length > 0 && aLine[length - 1] == '\r') {
+                length--;
+            }
+
+            aLine[length] = '\0';
+
+            return (TRUE);
+        }
+
+        aLine[length++] = c;
+    }
+
+    return (FALSE);
+}
+
+/**
+ *  Open a listener for a passive data connection and return it,
+ *  with its port.
+ *
+ */
+static int
+PassiveListen(unsigned short *aPort)
+{
+    struct sockaddr_in address;
+    socklen_t          addrlen  = sizeof (address);
+    int                listener;
+    int                status;
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    __Require(listener >= 0, done);
+
+    memset(&address, 0, sizeof (address));
+
+    address.sin_family      = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port        = 0;
+
+    status = bind(listener, (struct sockaddr *)&address, sizeof (address));
+    __Require(status == 0, fail);
+
+    status = getsockname(listener, (struct sockaddr *)&address, &addrlen);
+    __Require(status == 0, fail);
+
+    status = listen(listener, 1);
+    __Require(status == 0, fail);
+
+    *aPort = ntohs(address.sin_port);
+
+ done:
+    return (listener);
+
+ fail:
+    close(listener);
+
+    return (-1);
+}
+
+/**
+ *  Send the file from the offset over the data connection, stopping
+ *  after at most the given length.  Write errors are expected: a
+ *  segment closes its data connection once it has its range.
+ *
+ */
+static void
+SendFile(int aSocket, long long anOffset, long long aLength)
+{
+    UInt8     buffer[16 * 1024];
+    long long end = anOffset + aLength;
+
+    if (end > kFileSize) {
+        end = kFileSize;
+    }
+
+    while (anOffset < end) {
+        size_t length = sizeof (buffer);
+        size_t i;
+
+        if ((long long)length > end - anOffset) {
+            length = (size_t)(end - anOffset);
+        }
+
+        for (i = 0; i < length; i++) {
+            buffer[i] = PatternByte(anOffset + i);
+        }
+
+        if (!WriteAll(aSocket, buffer, length)) {
+            return;
+        }
+
+        anOffset += length;
+    }
+}
+
+/**
+ *  Answer one control connection until it closes.  Each REST is
+ *  reported on the pipe as "REST <offset>", or "REST <offset>
+ *  refused" in kModeRefuseRest, and each RETR as "RETR <offset>".
+ *
+ *  In kModeDrop, the first RETR at kDropOffset sends only kDropLength
+ *  bytes before closing the data connection and answering 426.
+ *
+ */
+static void
+ServeConnection(int aSocket, int aReport, const void *aContext)
+{
+    const ServerState *state    = (const ServerState *)aContext;
+    char               line[256];
+    char               reply[128];
+    long long          offset   = 0;
+    int                listener = -1;
+    int                count;
+
+    WriteString(aSocket, "220 Service ready\r\n");
+
+    while (ReadLine(aSocket, line, sizeof (line))) {
+
+        if (strncmp(line, "USER ", 5) == 0) {
+            WriteString(aSocket, "331 Password required\r\n");
+
+        } else if (strncmp(line, "PASS ", 5) == 0) {
+            WriteString(aSocket, "230 Logged in\r\n");
+
+        } else if (strcmp(line, "SYST") == 0) {
+            WriteString(aSocket, "215 UNIX Type: L8\r\n");
+
+        } else if (strcmp(line, "PWD") == 0) {
+            WriteString(aSocket, "257 \"/\" is the current directory\r\n");
+
+        } else if (strncmp(line, "TYPE ", 5) == 0) {
+            WriteString(aSocket, "200 Type set to I\r\n");
+
+        } else if (strncmp(line, "CWD ", 4) == 0) {
+            WriteString(aSocket, "250 Directory changed\r\n");
+
+        } else if (strncmp(line, "SIZE ", 5) == 0) {
+            count = snprintf(reply, sizeof (reply), "213 %d\r\n", kFileSize);
+            WriteAll(aSocket, reply, count);
+
+        } else if (strcmp(line, "PASV") == 0) {
+            unsigned short port = 0;
+
+            if (listener >= 0) {
+                close(listener);
+            }
+
+            listener = PassiveListen(&port);
+
+            if (listener < 0) {
+                WriteString(aSocket, "425 Cannot open data connection\r\n");
+                continue;
+            }
+
+            count = snprintf(reply, sizeof (reply), "227 Entering Passive Mode (127,0,0,1,%u,%u)\r\n", port >> 8, port & 0xff);
+            WriteAll(aSocket, reply, count);
+
+        } else if (strncmp(line, "REST ", 5) == 0) {
+            long long rest = strtoll(line + 5, NULL, 10);
+
+            if (state->mMode == kModeRefuseRest) {
+                count = snprintf(reply, sizeof (reply), "REST %lld refused\n", rest);
+                WriteAll(aReport, reply, count);
+
+                WriteString(aSocket, "502 Command not implemented\r\n");
+
+            } else {
+                offset = rest;
+
+                count = snprintf(reply, sizeof (reply), "REST %lld\n", rest);
+                WriteAll(aReport, reply, count);
+
+                count = snprintf(reply, sizeof (reply), "350 Restarting at %lld\r\n", rest);
+                WriteAll(aSocket, reply, count);
+            }
+
+        } else if (strncmp(line, "RETR ", 5) == 0) {
+            long long length = kFileSize;
+            Boolean   drop   = FALSE;
+            int       data;
+
+            count = snprintf(reply, sizeof (reply), "RETR %lld\n", offset);
+            WriteAll(aReport, reply, count);
+
+            if (listener < 0) {
+                WriteString(aSocket, "425 Use PASV first\r\n");
+                continue;
+            }
+
+            WriteString(aSocket, "150 Opening BINARY mode data connection\r\n");
+
+            data = accept(listener, NULL, NULL);
+
+            close(listener);
+            listener = -1;
+
+            if (data < 0) {
+                WriteString(aSocket, "425 Cannot open data connection\r\n");
+                continue;
+            }
+
+            if ((state->mMode == kModeDrop) && (offset == kDropOffset) && !*state->mDropped) {
+                *state->mDropped = 1;
+                drop      = TRUE;
+                length    = kDropLength;
+            }
+
+            SendFile(data, offset, length);
+            close(data);
+
+            offset = 0;
+
+            WriteString(aSocket, drop ? "426 Connection closed; transfer aborted\r\n" : "226 Transfer complete\r\n");
+
+        } else if (strcmp(line, "QUIT") == 0) {
+            WriteString(aSocket, "221 Goodbye\r\n");
+            break;
+
+        } else {
+            WriteString(aSocket, "502 Command not implemented\r\n");
+
+        }
+    }
+
+    if (listener >= 0) {
+        close(listener);
+    }
+}
+
+/**
+ *  Count the reported RETRs whose offset is within [aLow, aHigh].
+ *
+ */
+static int
+CountRetrievals(const char *aReports, long long aLow, long long aHigh)
+{
+    const char *line  = aReports;
+    int         count = 0;
+
+    while (*line != '\0') {
+        long long offset;
+
+        if ((sscanf(line, "RETR %lld", &offset) == 1) && (offset >= aLow) && (offset <= aHigh)) {
+            count++;
+        }
+
+        line = strchr(line, '\n');
+
+        if (line == NULL) {
+            break;
+        }
+
+        line++;
+    }
+
+    return (count);
+}
+
+// Client
+
+typedef struct {
+    UInt8   *mBytes;
+    size_t   mLength;
+    Boolean  mDone;
+    Boolean  mFailed;
+} Download;
+
+static void
+DownloadCallBack(CFReadStreamRef aStream, CFStreamEventType aType, void *aContext)
+{
+    Download *download = (Download *)aContext;
+    CFIndex   read;
+
+    switch (aType) {
+
+    case kCFStreamEventHasBytesAvailable:
+        // One more byte than the file has room for, so that a
+        // download which runs long is caught.
+
+        read = CFReadStreamRead(aStream, download->mBytes + download->mLength, kFileSize + 1 - download->mLength);
+
+        if (read < 0) {
+            download->mFailed = TRUE;
+        } else {
+            download->mLength += (size_t)read;
+        }
+        break;
+
+    case kCFStreamEventEndEncountered:
+        download->mDone = TRUE;
+        break;
+
+    case kCFStreamEventErrorOccurred:
+        download->mFailed = TRUE;
+        break;
+
+    default:
+        break;
+
+    }
+}
+
+/**
+ *  Fetch the file from a server in the given mode over kSegmentCount
+ *  segments, check that it read back whole and in order, and return
+ *  the REST and RETR commands the server saw.
+ *
+ */
+static int
+Fetch(int aMode, char *aReports, size_t aReportsSize)
+{
+    char                  url[128];
+    CFStreamClientContext context  = { 0, NULL, NULL, NULL, NULL };
+    Download              download = { NULL, 0, FALSE, FALSE };
+    ServerState           state    = { aMode, MAP_FAILED };
+    CFURLRef              theURL   = NULL;
+    CFReadStreamRef       stream   = NULL;
+    CFAbsoluteTime        deadline;
+    unsigned short        port     = 0;
+    int                   report   = -1;
+    pid_t                 server   = -1;
+    Boolean               result;
+    size_t                i;
+    int                   status   = -1;
+
+    download.mBytes = malloc(kFileSize + 1);
+    __Require(download.mBytes != NULL, done);
+
+    state.mDropped = mmap(NULL, sizeof (*state.mDropped), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    __Require(state.mDropped != MAP_FAILED, done);
+
+    *state.mDropped = 0;
+
+    // The segments' control connections are all open at once, so each
+    // is served from a child of its own.  Every report precedes the
+    // reply or data it concerns, so all of them are in the pipe by the
+    // time the download has finished.
+
+    server = ServerStart(ServeConnection, &state, kServerServeConcurrently | kServerReportNonBlocking, &port, &report);
+    __Require(server > 0, done);
+
+    snprintf(url, sizeof (url), "ftp://127.0.0.1:%u/file.bin", port);
+
+    theURL = CFURLCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)url, strlen(url), kCFStringEncodingASCII, NULL);
+    __Require(theURL != NULL, done);
+
+    stream = _CFReadStreamCreateWithFTPURLSegments(kCFAllocatorDefault, theURL, kSegmentCount);
+    __Require(stream != NULL, done);
+
+    context.info = &download;
+
+    result = CFReadStreamSetClient(stream,
+                                   kCFStreamEventHasBytesAvailable | kCFStreamEventEndEncountered | kCFStreamEventErrorOccurred,
+                                   DownloadCallBack,
+                                   &context);
+    __Require(result, done);
+
+    CFReadStreamScheduleWithRunLoop(stream, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+
+    result = CFReadStreamOpen(stream);
+    __Require(result, done);
+
+    deadline = CFAbsoluteTimeGetCurrent() + kTimeout;
+
+    while (!download.mDone && !download.mFailed && (CFAbsoluteTimeGetCurrent() < deadline)) {
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.1, FALSE);
+    }
+
+    __Require(download.mDone, done);
+    __Require(download.mLength == kFileSize, done);
+
+    for (i = 0; i < kFileSize; i++) {
+        __Require(download.mBytes[i] == PatternByte(i), done);
+    }
+
+    ReadReports(report, aReports, aReportsSize);
+
+    status = 0;
+
+ done:
+    if (stream != NULL) {
+        CFReadStreamSetClient(stream, kCFStreamEventNone, NULL, NULL);
+        CFReadStreamUnscheduleFromRunLoop(stream, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+        CFReadStreamClose(stream);
+        CFRelease(stream);
+    }
+
+    if (theURL != NULL) {
+        CFRelease(theURL);
+    }
+
+    ServerStop(server);
+
+    if (report >= 0) {
+        close(report);
+    }
+
+    if (state.mDropped != MAP_FAILED) {
+        munmap((void *)state.mDropped, sizeof (*state.mDropped));
+    }
+
+    if (download.mBytes != NULL) {
+        free(download.mBytes);
+    }
+
+    return (status);
+}
+
+static int
+TestReassembly(void)
+{
+    char reports[1024];
+    int  i;
+    int  status;
+
+    status = Fetch(kModeNormal, reports, sizeof (reports));
+    __Require(status == 0, done);
+
+    status = -1;
+
+    // One transfer per segment, each restarted at its boundary.
+
+    for (i = 0; i < kSegmentCount; i++) {
+        __Require(CountRetrievals(reports, (long long)i * kSegmentLength, (long long)i * kSegmentLength) == 1, done);
+    }
+
+    __Require(CountRetrievals(reports, 0, kFileSize) == kSegmentCount, done);
+
+    status = 0;
+
+ done:
+    __CFFTPSegmentedStreamTestLog("%-40s %s\n", "segments, reassembled in order", (status == 0) ? "passed" : "FAILED");
+
+    return (status);
+}
+
+static int
+TestRetry(void)
+{
+    char reports[1024];
+    int  status;
+
+    status = Fetch(kModeDrop, reports, sizeof (reports));
+    __Require(status == 0, done);
+
+    status = -1;
+
+    // The dropped transfer, then at least one more picking up at or
+    // after the point where it stopped.
+
+    __Require(CountRetrievals(reports, kDropOffset, kDropOffset) >= 1, done);
+    __Require(CountRetrievals(reports, kDropOffset, kDropOffset + kDropLength) >= 2, done);
+
+    status = 0;
+
+ done:
+    __CFFTPSegmentedStreamTestLog("%-40s %s\n", "segment dropped, retried", (status == 0) ? "passed" : "FAILED");
+
+    return (status);
+}
+
+static int
+TestRestRefused(void)
+{
+    char reports[1024];
+    int  status;
+
+    status = Fetch(kModeRefuseRest, reports, sizeof (reports));
+    __Require(status == 0, done);
+
+    status = -1;
+
+    // Every transfer started at zero, at least one segment was
+    // refused, and the file still arrived whole.
+
+    __Require(strstr(reports, " refused\n") != NULL, done);
+    __Require(CountRetrievals(reports, 0, 0) >= 1, done);
+    __Require(CountRetrievals(reports, 1, kFileSize) == 0, done);
+
+    status = 0;
+
+ done:
+    __CFFTPSegmentedStreamTestLog("%-40s %s\n", "REST refused, single stream", (status == 0) ? "passed" : "FAILED");
+
+    return (status);
+}
+
+int
+main(void)
+{
+    int status;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    status = TestReassembly();
+    __Require(status == 0, done);
+
+    status = TestRetry();
+    __Require(status == 0, done);
+
+    status = TestRestRefused();
+    __Require(status == 0, done);
+
+ done:
+    return ((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
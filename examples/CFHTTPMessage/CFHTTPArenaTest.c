@@ -0,0 +1,465 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements a test of the HTTP message arena
+ *     allocator: that small blocks are carved, aligned and apart,
+ *     from a few chunks of the backing allocator; that the most
+ *     recent block is given back on deallocation and grows in place;
+ *     that large blocks go to the backing allocator on their own and
+ *     are freed with their deallocation; and that once a message made
+ *     with an arena and the arena itself are released, everything
+ *     taken from the backing allocator has been given back.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <AssertMacros.h>
+
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFHTTPMessagePriv.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#define __CFHTTPArenaTestLog(format, ...)   do { fprintf(stderr, format, ##__VA_ARGS__); fflush(stderr); } while (0)
+
+// The arena's defaults
+
+#define kCFHTTPArenaTestChunkSize           4096
+#define kCFHTTPArenaTestMinimumChunkSize    256
+#define kCFHTTPArenaTestLargeSize           (kCFHTTPArenaTestChunkSize / 4)
+#define kCFHTTPArenaTestAlignment           16
+
+typedef struct {
+    const char *  mDescription;
+    int        (* mFunction)(CFAllocatorRef aBacking);
+} _CFHTTPArenaTestCase;
+
+// Backing allocator
+
+/**
+ *  The blocks the backing allocator has handed out and not yet had
+ *  back.
+ *
+ */
+static CFIndex sBackingLive = 0;
+
+static void *
+BackingAllocate(CFIndex aSize, CFOptionFlags aHint, void *anInfo)
+{
+    void *result = malloc((size_t)aSize);
+
+    if (result != NULL) {
+        sBackingLive++;
+    }
+
+    return (result);
+}
+
+static void *
+BackingReallocate(void *aPointer, CFIndex aSize, CFOptionFlags aHint, void *anInfo)
+{
+    return (realloc(aPointer, (size_t)aSize));
+}
+
+static void
+BackingDeallocate(void *aPointer, void *anInfo)
+{
+    sBackingLive--;
+
+    free(aPointer);
+}
+
+static CFAllocatorRef
+BackingCreate(void)
+{
+    CFAllocatorContext context = {
+        0,                      // version
+        NULL,                   // info
+        NULL,                   // retain
+        NULL,                   // release
+        NULL,                   // copyDescription
+        BackingAllocate,        // allocate
+        BackingReallocate,      // reallocate
+        BackingDeallocate,      // deallocate
+        NULL                    // preferredSize
+    };
+
+    return (CFAllocatorCreate(kCFAllocatorSystemDefault, &context));
+}
+
+// Tests
+
+static Boolean
+IsAligned(const void *aPointer)
+{
+    return (((uintptr_t)aPointer % kCFHTTPArenaTestAlignment) == 0);
+}
+
+static int
+TestSmallBlocks(CFAllocatorRef aBacking)
+{
+    _CFHTTPArenaStatistics stats;
+    CFAllocatorRef         arena  = NULL;
+    UInt8                 *blocks[100];
+    size_t                 i;
+    size_t                 j;
+    int                    status = -1;
+
+    arena = _CFHTTPArenaCreate(aBacking, 0);
+    __Require(arena != NULL, done);
+
+    for (i = 0; i < sizeof (blocks) / sizeof (blocks[0]); i++) {
+        blocks[i] = CFAllocatorAllocate(arena, 24, 0);
+        __Require(blocks[i] != NULL, done);
+        __Require(IsAligned(blocks[i]), done);
+
+        memset(blocks[i], (int)i, 24);
+    }
+
+    for (i = 0; i < sizeof (blocks) / sizeof (blocks[0]); i++) {
+        for (j = 0; j < 24; j++) {
+            __Require(blocks[i][j] == (UInt8)i, done);
+        }
+    }
+
+    __Require(_CFHTTPArenaGetStatistics(arena, &stats), done);
+
+    __Require(stats.allocations == sizeof (blocks) / sizeof (blocks[0]), done);
+    __Require(stats.chunks >= 1, done);
+    __Require(stats.chunks <= 2, done);
+    __Require(stats.backingAllocations == stats.chunks, done);
+    __Require(stats.bytesReserved == stats.chunks * kCFHTTPArenaTestChunkSize, done);
+
+    // Only arenas have statistics.
+
+    __Require(!_CFHTTPArenaGetStatistics(aBacking, &stats), done);
+
+    status = 0;
+
+ done:
+    if (arena != NULL) {
+        CFRelease(arena);
+    }
+
+    return (status);
+}
+
+static int
+TestLastBlock(CFAllocatorRef aBacking)
+{
+    CFAllocatorRef  arena  = NULL;
+    UInt8          *first;
+    UInt8          *second;
+    UInt8          *block;
+    CFIndex         i;
+    int             status = -1;
+
+    arena = _CFHTTPArenaCreate(aBacking, 0);
+    __Require(arena != NULL, done);
+
+    // The most recent block is taken back, so the next takes its place.
+
+    first = CFAllocatorAllocate(arena, 40, 0);
+    __Require(first != NULL, done);
+
+    CFAllocatorDeallocate(arena, first);
+
+    block = CFAllocatorAllocate(arena, 40, 0);
+    __Require(block == first, done);
+
+    // One behind it is not.
+
+    second = CFAllocatorAllocate(arena, 40, 0);
+    __Require(second != NULL, done);
+
+    CFAllocatorDeallocate(arena, first);
+
+    block = CFAllocatorAllocate(arena, 40, 0);
+    __Require(block != first, done);
+    __Require(block != second, done);
+
+    // The most recent block grows in place, keeping its contents.
+
+    for (i = 0; i < 40; i++) {
+        block[i] = (UInt8)i;
+    }
+
+    first = CFAllocatorReallocate(arena, block, 512, 0);
+    __Require(first == block, done);
+
+    for (i = 0; i < 40; i++) {
+        __Require(first[i] == (UInt8)i, done);
+    }
+
+    // Once another is carved after it, it has to move to grow.
+
+    second = CFAllocatorAllocate(arena, 16, 0);
+    __Require(second != NULL, done);
+
+    block = CFAllocatorReallocate(arena, first, 900, 0);
+    __Require(block != NULL, done);
+    __Require(block != first, done);
+    __Require(IsAligned(block), done);
+
+    for (i = 0; i < 40; i++) {
+        __Require(block[i] == (UInt8)i, done);
+    }
+
+    status = 0;
+
+ done:
+    if (arena != NULL) {
+        CFRelease(arena);
+    }
+
+    return (status);
+}
+
+static int
+TestLargeBlocks(CFAllocatorRef aBacking)
+{
+    _CFHTTPArenaStatistics before;
+    _CFHTTPArenaStatistics after;
+    CFAllocatorRef         arena  = NULL;
+    CFIndex                live;
+    UInt8                 *block;
+    UInt8                 *small;
+    int                    status = -1;
+
+    arena = _CFHTTPArenaCreate(aBacking, 0);
+    __Require(arena != NULL, done);
+
+    small = CFAllocatorAllocate(arena, 16, 0);
+    __Require(small != NULL, done);
+
+    __Require(_CFHTTPArenaGetStatistics(arena, &before), done);
+
+    live = sBackingLive;
+
+    block = CFAllocatorAllocate(arena, kCFHTTPArenaTestLargeSize * 2, 0);
+    __Require(block != NULL, done);
+    __Require(IsAligned(block), done);
+
+    memset(block, 0xA5, kCFHTTPArenaTestLargeSize * 2);
+
+    __Require(_CFHTTPArenaGetStatistics(arena, &after), done);
+
+    __Require(sBackingLive == live + 1, done);
+    __Require(after.chunks == before.chunks, done);
+    __Require(after.backingAllocations == before.backingAllocations + 1, done);
+    __Require(after.bytesReserved == before.bytesReserved + kCFHTTPArenaTestLargeSize * 2, done);
+
+    // A large block grows through the backing allocator, and stays large.
+
+    block = CFAllocatorReallocate(arena, block, kCFHTTPArenaTestLargeSize * 4, 0);
+    __Require(block != NULL, done);
+    __Require(block[kCFHTTPArenaTestLargeSize * 2 - 1] == 0xA5, done);
+
+    __Require(_CFHTTPArenaGetStatistics(arena, &after), done);
+
+    __Require(sBackingLive == live + 1, done);
+    __Require(after.bytesReserved == before.bytesReserved + kCFHTTPArenaTestLargeSize * 4, done);
+
+    // Unlike the small blocks, it is given back as soon as it is deallocated.
+
+    CFAllocatorDeallocate(arena, block);
+
+    __Require(_CFHTTPArenaGetStatistics(arena, &after), done);
+
+    __Require(sBackingLive == live, done);
+    __Require(after.bytesReserved == before.bytesReserved, done);
+
+    status = 0;
+
+ done:
+    if (arena != NULL) {
+        CFRelease(arena);
+    }
+
+    return (status);
+}
+
+static int
+TestChunkSize(CFAllocatorRef aBacking)
+{
+    _CFHTTPArenaStatistics stats;
+    CFAllocatorRef         arena  = NULL;
+    void                  *block;
+    int                    status = -1;
+
+    arena = _CFHTTPArenaCreate(aBacking, 100);
+    __Require(arena != NULL, done);
+
+    block = CFAllocatorAllocate(arena, 8, 0);
+    __Require(block != NULL, done);
+
+    __Require(_CFHTTPArenaGetStatistics(arena, &stats), done);
+
+    __Require(stats.chunks == 1, done);
+    __Require(stats.bytesReserved == kCFHTTPArenaTestMinimumChunkSize, done);
+
+    status = 0;
+
+ done:
+    if (arena != NULL) {
+        CFRelease(arena);
+    }
+
+    return (status);
+}
+
+static int
+TestMessageRelease(CFAllocatorRef aBacking)
+{
+    _CFHTTPArenaStatistics stats;
+    CFAllocatorRef         arena    = NULL;
+    CFURLRef               theURL   = NULL;
+    CFHTTPMessageRef       request  = NULL;
+    CFDataRef              body     = NULL;
+    UInt8                  bytes[kCFHTTPArenaTestChunkSize * 3];
+    CFIndex                live     = sBackingLive;
+    int                    i;
+    int                    status   = -1;
+
+    arena = _CFHTTPArenaCreate(aBacking, 0);
+    __Require(arena != NULL, done);
+
+    theURL = CFURLCreateWithString(arena, CFSTR("http://www.example.com/index.html"), NULL);
+    __Require(theURL != NULL, done);
+
+    request = CFHTTPMessageCreateRequest(arena, CFSTR("GET"), theURL, kCFHTTPVersion1_1);
+    __Require(request != NULL, done);
+
+    for (i = 0; i < 32; i++) {
+        CFStringRef name  = CFStringCreateWithFormat(arena, NULL, CFSTR("X-Header-%d"), i);
+        CFStringRef value = CFStringCreateWithFormat(arena, NULL, CFSTR("value %d"), i);
+
+        __Require(name != NULL, done);
+        __Require(value != NULL, done);
+
+        CFHTTPMessageSetHeaderFieldValue(request, name, value);
+
+        CFRelease(name);
+        CFRelease(value);
+    }
+
+    memset(bytes, 'x', sizeof (bytes));
+
+    body = CFDataCreate(arena, bytes, sizeof (bytes));
+    __Require(body != NULL, done);
+
+    CFHTTPMessageSetBody(request, body);
+
+    __Require(_CFHTTPArenaGetStatistics(arena, &stats), done);
+
+    __Require(stats.allocations > stats.backingAllocations, done);
+
+    // The message and what it holds keep the arena alive.
+
+    CFRelease(arena);
+    arena = NULL;
+
+    CFRelease(theURL);
+    theURL = NULL;
+
+    CFRelease(body);
+    body = NULL;
+
+    __Require(sBackingLive > live, done);
+
+    // Releasing the last of them releases the arena, and every block
+    // and chunk it took goes back at once.
+
+    CFRelease(request);
+    request = NULL;
+
+    __Require(sBackingLive == live, done);
+
+    status = 0;
+
+ done:
+    if (body != NULL) {
+        CFRelease(body);
+    }
+
+    if (request != NULL) {
+        CFRelease(request);
+    }
+
+    if (theURL != NULL) {
+        CFRelease(theURL);
+    }
+
+    if (arena != NULL) {
+        CFRelease(arena);
+    }
+
+    return (status);
+}
+
+static const _CFHTTPArenaTestCase sTestCases[] = {
+    { "small blocks",           TestSmallBlocks     },
+    { "last block",             TestLastBlock       },
+    { "large blocks",           TestLargeBlocks     },
+    { "minimum chunk size",     TestChunkSize       },
+    { "message release",        TestMessageRelease  }
+};
+
+int
+main(void)
+{
+    CFAllocatorRef backing;
+    CFIndex        live;
+    size_t         i;
+    int            status = 0;
+
+    backing = BackingCreate();
+
+    if (backing == NULL) {
+        return (EXIT_FAILURE);
+    }
+
+    for (i = 0; i < sizeof (sTestCases) / sizeof (sTestCases[0]); i++) {
+        live = sBackingLive;
+
+        // Whatever a case leaves, releasing its arena gives it all back.
+
+        if ((sTestCases[i].mFunction(backing) != 0) || (sBackingLive != live)) {
+            __CFHTTPArenaTestLog("%-32s %s\n", sTestCases[i].mDescription, "FAILED");
+            status = -1;
+
+        } else {
+            __CFHTTPArenaTestLog("%-32s %s\n", sTestCases[i].mDescription, "passed");
+
+        }
+    }
+
+    CFRelease(backing);
+
+    return ((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,596 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements a test of CFHTTPMessage response header
+ *     parsing by feeding canned responses to CFHTTPMessageAppendBytes
+ *     whole and in chunks of every size from one byte up to past two
+ *     vector blocks, so that lines, colons and line ends land on
+ *     each side of every block boundary, and checking the header
+ *     fields and body both before and after the header strings have
+ *     been created. Copies and bodies taken while the header fields
+ *     are still only parsed, and copies taken part way through the
+ *     header, are checked the same way.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <AssertMacros.h>
+
+#include <CFNetwork/CFNetwork.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#define __CFHTTPMessageParserTestLog(format, ...)   do { fprintf(stderr, format, ##__VA_ARGS__); fflush(stderr); } while (0)
+
+// Twice the widest (AVX2) block the parser scans at a time, plus one.
+
+#define kCFHTTPMessageParserTestMaxChunkSize        65
+
+#define kCFHTTPMessageParserTestMaxHeaders          8
+
+typedef struct {
+    const char *  mName;
+    const char *  mValue;   // NULL if the field must be absent
+} _CFHTTPMessageParserTestField;
+
+typedef struct {
+    const char *                   mDescription;
+    const char *                   mHead;
+    const char *                   mBody;
+    CFIndex                        mStatus;
+    CFIndex                        mFieldCount;
+    _CFHTTPMessageParserTestField  mFields[kCFHTTPMessageParserTestMaxHeaders];
+} _CFHTTPMessageParserTestCase;
+
+static const _CFHTTPMessageParserTestCase sTestCases[] = {
+    {
+        "simple",
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/html\r\n"
+        "Content-Length: 12\r\n"
+        "X-A-Rather-Long-Header-Name-Spanning-Blocks: a value which itself runs on past the end of more than one block\r\n"
+        "X-Colon-Value: a:b:c\r\n"
+        "X-Empty:\r\n"
+        "X-Tabs:\t \tvalue\r\n"
+        "\r\n",
+        "hello, world",
+        200,
+        6,
+        {
+            { "Content-Type",                                "text/html" },
+            { "Content-Length",                              "12" },
+            { "X-A-Rather-Long-Header-Name-Spanning-Blocks", "a value which itself runs on past the end of more than one block" },
+            { "X-Colon-Value",                               "a:b:c" },
+            { "X-Empty",                                     "" },
+            { "X-Tabs",                                      "value" },
+            { "X-Missing",                                   NULL }
+        }
+    },
+    {
+        "short lines",
+        "HTTP/1.1 204 No Content\r\n"
+        "A: 1\r\n"
+        "Bb: 22\r\n"
+        "Ccc: 333\r\n"
+        "Dddd: 4444\r\n"
+        "E:5\r\n"
+        "\r\n",
+        "",
+        204,
+        5,
+        {
+            { "A",    "1" },
+            { "Bb",   "22" },
+            { "Ccc",  "333" },
+            { "Dddd", "4444" },
+            { "E",    "5" }
+        }
+    },
+    {
+        "LF line ends",
+        "HTTP/1.1 200 OK\n"
+        "Server: test\n"
+        "Content-Length: 4\n"
+        "\n",
+        "body",
+        200,
+        2,
+        {
+            { "Server",         "test" },
+            { "Content-Length", "4" }
+        }
+    },
+    {
+        "obs-fold continuation lines",
+        "HTTP/1.1 200 OK\r\n"
+        "X-Folded: first\r\n"
+        " second\r\n"
+        "\tthird\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n",
+        "",
+        200,
+        2,
+        {
+            { "X-Folded",       "first second\tthird" },
+            { "Content-Length", "0" }
+        }
+    },
+    {
+        "repeated fields",
+        "HTTP/1.1 200 OK\r\n"
+        "Set-Cookie: a=1\r\n"
+        "Vary: Accept\r\n"
+        "set-cookie: b=2\r\n"
+        "Vary: Accept-Encoding\r\n"
+        " , Cookie\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n",
+        "",
+        200,
+        3,
+        {
+            { "Set-Cookie",     "a=1, b=2" },
+            { "Vary",           "Accept, Accept-Encoding , Cookie" },
+            { "Content-Length", "0" }
+        }
+    },
+    {
+        "bare CR inside a line",
+        "HTTP/1.1 200 OK\r\n"
+        "X-Bare: a\rb\r\n"
+        "Content-Length: 3\r\n"
+        "\r\n",
+        "abc",
+        200,
+        2,
+        {
+            { "X-Bare",         "a\rb" },
+            { "Content-Length", "3" }
+        }
+    },
+    {
+        "bare CR line ends",
+        "HTTP/1.0 200 OK\r"
+        "X-Old: yes\r"
+        "Content-Length: 4\r"
+        "\r",
+        "body",
+        200,
+        2,
+        {
+            { "X-Old",          "yes" },
+            { "Content-Length", "4" }
+        }
+    }
+};
+
+static CFStringRef
+CreateString(const char *aString)
+{
+    return (CFStringCreateWithCString(kCFAllocatorDefault, aString, kCFStringEncodingISOLatin1));
+}
+
+static CFStringRef
+CreateLowercaseString(const char *aString)
+{
+    CFMutableStringRef result = NULL;
+    CFStringRef        string;
+
+    string = CreateString(aString);
+    __Require(string != NULL, done);
+
+    result = CFStringCreateMutableCopy(kCFAllocatorDefault, 0, string);
+    CFRelease(string);
+    __Require(result != NULL, done);
+
+    CFStringLowercase(result, NULL);
+
+ done:
+    return (result);
+}
+
+/**
+ *  Check one field by looking it up as given and in lower case.
+ *
+ */
+static Boolean
+CheckField(CFHTTPMessageRef aMessage, const _CFHTTPMessageParserTestField *aField)
+{
+    CFStringRef names[2] = { NULL, NULL };
+    CFStringRef expected = NULL;
+    CFStringRef value    = NULL;
+    size_t      i;
+    Boolean     result   = FALSE;
+
+    names[0] = CreateString(aField->mName);
+    names[1] = CreateLowercaseString(aField->mName);
+    __Require((names[0] != NULL) && (names[1] != NULL), done);
+
+    if (aField->mValue != NULL) {
+        expected = CreateString(aField->mValue);
+        __Require(expected != NULL, done);
+    }
+
+    for (i = 0; i < (sizeof (names) / sizeof (names[0])); i++) {
+        value = CFHTTPMessageCopyHeaderFieldValue(aMessage, names[i]);
+
+        if (expected == NULL) {
+            __Require(value == NULL, done);
+        } else {
+            __Require((value != NULL) && CFEqual(value, expected), done);
+            CFRelease(value);
+            value = NULL;
+        }
+    }
+
+    result = TRUE;
+
+ done:
+    for (i = 0; i < (sizeof (names) / sizeof (names[0])); i++) {
+        if (names[i] != NULL) {
+            CFRelease(names[i]);
+        }
+    }
+
+    if (expected != NULL) {
+        CFRelease(expected);
+    }
+
+    if (value != NULL) {
+        CFRelease(value);
+    }
+
+    return (result);
+}
+
+/**
+ *  Check every field against the dictionary of all of them.
+ *
+ */
+static Boolean
+CheckAllFields(CFHTTPMessageRef aMessage, const _CFHTTPMessageParserTestCase *aTestCase)
+{
+    CFDictionaryRef fields;
+    CFStringRef     name     = NULL;
+    CFStringRef     expected = NULL;
+    size_t          i;
+    Boolean         result   = FALSE;
+
+    fields = CFHTTPMessageCopyAllHeaderFields(aMessage);
+    __Require(fields != NULL, done);
+
+    __Require(CFDictionaryGetCount(fields) == aTestCase->mFieldCount, done);
+
+    for (i = 0; (i < kCFHTTPMessageParserTestMaxHeaders) && (aTestCase->mFields[i].mName != NULL); i++) {
+        const _CFHTTPMessageParserTestField *field = &aTestCase->mFields[i];
+        CFStringRef                          value;
+
+        name = CreateString(field->mName);
+        __Require(name != NULL, done);
+
+        value = (CFStringRef)CFDictionaryGetValue(fields, name);
+
+        if (field->mValue == NULL) {
+            __Require(value == NULL, done);
+        } else {
+            expected = CreateString(field->mValue);
+            __Require(expected != NULL, done);
+
+            __Require((value != NULL) && CFEqual(value, expected), done);
+
+            CFRelease(expected);
+            expected = NULL;
+        }
+
+        CFRelease(name);
+        name = NULL;
+    }
+
+    result = TRUE;
+
+ done:
+    if (fields != NULL) {
+        CFRelease(fields);
+    }
+
+    if (name != NULL) {
+        CFRelease(name);
+    }
+
+    if (expected != NULL) {
+        CFRelease(expected);
+    }
+
+    return (result);
+}
+
+/**
+ *  Check that the message is complete and carries the test case's
+ *  status, body and fields: looked up one at a time straight from
+ *  the parsed lines, then all at once, which creates the strings
+ *  for all of them, and then one at a time again.
+ *
+ */
+static Boolean
+CheckMessage(CFHTTPMessageRef aMessage, const _CFHTTPMessageParserTestCase *aTestCase)
+{
+    const CFIndex bodyLength = (CFIndex)strlen(aTestCase->mBody);
+    CFDataRef     body;
+    size_t        i;
+    Boolean       result     = FALSE;
+
+    __Require(CFHTTPMessageIsHeaderComplete(aMessage), done);
+    __Require(CFHTTPMessageGetResponseStatusCode(aMessage) == aTestCase->mStatus, done);
+
+    body = CFHTTPMessageCopyBody(aMessage);
+
+    if (body == NULL) {
+        __Require(bodyLength == 0, done);
+    } else {
+        Boolean same = (CFDataGetLength(body) == bodyLength) && (memcmp(CFDataGetBytePtr(body), aTestCase->mBody, bodyLength) == 0);
+
+        CFRelease(body);
+        __Require(same, done);
+    }
+
+    for (i = 0; (i < kCFHTTPMessageParserTestMaxHeaders) && (aTestCase->mFields[i].mName != NULL); i++) {
+        __Require(CheckField(aMessage, &aTestCase->mFields[i]), done);
+    }
+
+    __Require(CheckAllFields(aMessage, aTestCase), done);
+
+    for (i = 0; (i < kCFHTTPMessageParserTestMaxHeaders) && (aTestCase->mFields[i].mName != NULL); i++) {
+        __Require(CheckField(aMessage, &aTestCase->mFields[i]), done);
+    }
+
+    result = TRUE;
+
+ done:
+    return (result);
+}
+
+static Boolean
+AppendBytes(CFHTTPMessageRef aMessage, const UInt8 *aBytes, CFIndex aLength, CFIndex aChunkSize)
+{
+    CFIndex offset;
+
+    for (offset = 0; offset < aLength; offset += aChunkSize) {
+        CFIndex length = aLength - offset;
+
+        if (length > aChunkSize) {
+            length = aChunkSize;
+        }
+
+        if (!CFHTTPMessageAppendBytes(aMessage, aBytes + offset, length)) {
+            return (FALSE);
+        }
+    }
+
+    return (TRUE);
+}
+
+static CFDataRef
+CopyResponse(const _CFHTTPMessageParserTestCase *aTestCase)
+{
+    CFMutableDataRef response;
+
+    response = CFDataCreateMutable(kCFAllocatorDefault, 0);
+    __Require(response != NULL, done);
+
+    CFDataAppendBytes(response, (const UInt8 *)aTestCase->mHead, strlen(aTestCase->mHead));
+    CFDataAppendBytes(response, (const UInt8 *)aTestCase->mBody, strlen(aTestCase->mBody));
+
+ done:
+    return (response);
+}
+
+/**
+ *  Feed the response in chunks of the given size (the whole of it
+ *  at once for zero) and check the message.
+ *
+ */
+static Boolean
+RunChunked(const _CFHTTPMessageParserTestCase *aTestCase, CFDataRef aResponse, CFIndex aChunkSize)
+{
+    const CFIndex    length  = CFDataGetLength(aResponse);
+    CFHTTPMessageRef message;
+    Boolean          result  = FALSE;
+
+    message = CFHTTPMessageCreateEmpty(kCFAllocatorDefault, FALSE);
+    __Require(message != NULL, done);
+
+    __Require(AppendBytes(message, CFDataGetBytePtr(aResponse), length, (aChunkSize > 0) ? aChunkSize : length), done);
+
+    __Require(CheckMessage(message, aTestCase), done);
+
+    result = TRUE;
+
+ done:
+    if (!result) {
+        __CFHTTPMessageParserTestLog("%-32s failed in chunks of %ld\n", aTestCase->mDescription, (long)aChunkSize);
+    }
+
+    if (message != NULL) {
+        CFRelease(message);
+    }
+
+    return (result);
+}
+
+/**
+ *  Take a copy and the body of a message whose header has been
+ *  parsed but none of whose fields has been looked up yet, then
+ *  check both the copy and the original.
+ *
+ */
+static Boolean
+RunCopyAfterHeader(const _CFHTTPMessageParserTestCase *aTestCase, CFDataRef aResponse)
+{
+    const CFIndex    bodyLength = (CFIndex)strlen(aTestCase->mBody);
+    CFHTTPMessageRef message;
+    CFHTTPMessageRef copy       = NULL;
+    CFDataRef        body       = NULL;
+    Boolean          result     = FALSE;
+
+    message = CFHTTPMessageCreateEmpty(kCFAllocatorDefault, FALSE);
+    __Require(message != NULL, done);
+
+    __Require(CFHTTPMessageAppendBytes(message, CFDataGetBytePtr(aResponse), CFDataGetLength(aResponse)), done);
+
+    body = CFHTTPMessageCopyBody(message);
+    __Require((body != NULL) || (bodyLength == 0), done);
+
+    if (body != NULL) {
+        __Require(CFDataGetLength(body) == bodyLength, done);
+        __Require(memcmp(CFDataGetBytePtr(body), aTestCase->mBody, bodyLength) == 0, done);
+    }
+
+    copy = CFHTTPMessageCreateCopy(kCFAllocatorDefault, message);
+    __Require(copy != NULL, done);
+
+    __Require(CheckMessage(copy, aTestCase), done);
+    __Require(CheckMessage(message, aTestCase), done);
+
+    result = TRUE;
+
+ done:
+    if (!result) {
+        __CFHTTPMessageParserTestLog("%-32s failed copying after the header\n", aTestCase->mDescription);
+    }
+
+    if (body != NULL) {
+        CFRelease(body);
+    }
+
+    if (copy != NULL) {
+        CFRelease(copy);
+    }
+
+    if (message != NULL) {
+        CFRelease(message);
+    }
+
+    return (result);
+}
+
+/**
+ *  Take a copy of a message part way through its header, then feed
+ *  the rest of the response to both and check them.
+ *
+ */
+static Boolean
+RunCopyWithinHeader(const _CFHTTPMessageParserTestCase *aTestCase, CFDataRef aResponse, CFIndex aSplit)
+{
+    const UInt8 *    bytes   = CFDataGetBytePtr(aResponse);
+    const CFIndex    length  = CFDataGetLength(aResponse);
+    CFHTTPMessageRef message;
+    CFHTTPMessageRef copy    = NULL;
+    Boolean          result  = FALSE;
+
+    message = CFHTTPMessageCreateEmpty(kCFAllocatorDefault, FALSE);
+    __Require(message != NULL, done);
+
+    __Require(CFHTTPMessageAppendBytes(message, bytes, aSplit), done);
+    __Require(!CFHTTPMessageIsHeaderComplete(message), done);
+
+    copy = CFHTTPMessageCreateCopy(kCFAllocatorDefault, message);
+    __Require(copy != NULL, done);
+
+    __Require(CFHTTPMessageAppendBytes(message, bytes + aSplit, length - aSplit), done);
+    __Require(CFHTTPMessageAppendBytes(copy, bytes + aSplit, length - aSplit), done);
+
+    __Require(CheckMessage(copy, aTestCase), done);
+    __Require(CheckMessage(message, aTestCase), done);
+
+    result = TRUE;
+
+ done:
+    if (!result) {
+        __CFHTTPMessageParserTestLog("%-32s failed copying after %ld bytes\n", aTestCase->mDescription, (long)aSplit);
+    }
+
+    if (copy != NULL) {
+        CFRelease(copy);
+    }
+
+    if (message != NULL) {
+        CFRelease(message);
+    }
+
+    return (result);
+}
+
+static int
+RunTestCase(const _CFHTTPMessageParserTestCase *aTestCase)
+{
+    const CFIndex headLength = (CFIndex)strlen(aTestCase->mHead);
+    CFDataRef     response;
+    CFIndex       i;
+    int           status     = -1;
+
+    response = CopyResponse(aTestCase);
+    __Require(response != NULL, done);
+
+    for (i = 0; i <= kCFHTTPMessageParserTestMaxChunkSize; i++) {
+        __Require(RunChunked(aTestCase, response, i), done);
+    }
+
+    __Require(RunCopyAfterHeader(aTestCase, response), done);
+
+    // Every split short of the whole header leaves it incomplete.
+
+    for (i = 1; i < headLength; i++) {
+        __Require(RunCopyWithinHeader(aTestCase, response, i), done);
+    }
+
+    status = 0;
+
+ done:
+    __CFHTTPMessageParserTestLog("%-32s %s\n", aTestCase->mDescription, (status == 0) ? "passed" : "FAILED");
+
+    if (response != NULL) {
+        CFRelease(response);
+    }
+
+    return (status);
+}
+
+int
+main(void)
+{
+    size_t i;
+    int    status = 0;
+
+    for (i = 0; i < sizeof (sTestCases) / sizeof (sTestCases[0]); i++) {
+        if (RunTestCase(&sTestCases[i]) != 0) {
+            status = -1;
+        }
+    }
+
+    return ((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
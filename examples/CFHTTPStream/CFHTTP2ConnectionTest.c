@@ -0,0 +1,960 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements a test of the CFNetwork HTTP/2 connection:
+ *     its HPACK decoder and encoder against the examples of RFC 7541
+ *     Appendix C, with and without Huffman coding, table size updates
+ *     and eviction; and its frame handling against a loopback server
+ *     which sends cleartext HTTP/2 frames by hand and reports how the
+ *     client answered them: oversized frames, bad padding lengths,
+ *     header blocks interrupted before their CONTINUATION, changes to
+ *     SETTINGS_INITIAL_WINDOW_SIZE, overflowing windows and
+ *     WINDOW_UPDATE frames for idle streams.
+ *
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <AssertMacros.h>
+
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFHTTPConnectionPriv.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "CFHTTPInternal.h"
+#include "TestSupport.h"
+
+#define __CFHTTP2ConnectionTestLog(format, ...)   do { fprintf(stderr, format, ##__VA_ARGS__); fflush(stderr); } while (0)
+
+// RFC 7540 section 6 frame types, flags and section 7 error codes
+
+#define kFrameData                  0x0
+#define kFrameHeaders               0x1
+#define kFrameRSTStream             0x3
+#define kFrameSettings              0x4
+#define kFramePing                  0x6
+#define kFrameGoAway                0x7
+#define kFrameWindowUpdate          0x8
+#define kFrameContinuation          0x9
+
+#define kFlagEndStream              0x1
+#define kFlagEndHeaders             0x4
+#define kFlagPadded                 0x8
+
+#define kErrorProtocol              0x1
+#define kErrorFlowControl           0x3
+#define kErrorFrameSize             0x6
+
+#define kSettingInitialWindowSize   0x4
+
+#define kFrameHeaderSize            9
+#define kFrameMaxSize               16384
+
+#define kDefaultWindow              65535
+
+// Larger than the default window, so that sending it waits for updates
+
+#define kRequestBodySize            70000
+
+// How long the server waits for a frame before deciding none is coming
+
+#define kIdleTimeout                500
+#define kFrameTimeout               5000
+
+// HPACK
+
+/**
+ *  One header block: its bytes as hex, the fields it holds as names
+ *  and values, NULL-terminated, and the dynamic table's size once it
+ *  has been coded.  Where the encoder's choices differ from those of
+ *  the example, the bytes it should produce instead are given too.
+ *
+ */
+typedef struct {
+    const char *  mBlock;
+    const char *  mFields[16];
+    CFIndex       mTableSize;
+    const char *  mEncoded;
+} HPACKBlock;
+
+/**
+ *  A run of header blocks coded on one connection, and whether the
+ *  encoder, its table first limited to the given size, should
+ *  reproduce them.
+ *
+ */
+typedef struct {
+    const char *  mDescription;
+    HPACKBlock    mBlocks[3];
+    CFIndex       mCount;
+    Boolean       mEncode;
+    CFIndex       mEncoderTableSize;
+} HPACKExample;
+
+#define kRFC7541Date1   "Mon, 21 Oct 2013 20:13:21 GMT"
+#define kRFC7541Date2   "Mon, 21 Oct 2013 20:13:22 GMT"
+#define kRFC7541Cookie  "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"
+
+// The response examples use a 256 byte table, which the decoder is told
+// of with a dynamic table size update (3fe101) ahead of the first block.
+
+static const HPACKExample sHPACKExamples[] = {
+    {
+        "C.2.1 literal, indexed",
+        {
+            { "400a637573746f6d2d6b65790d637573746f6d2d686561646572",
+              { "custom-key", "custom-header", NULL }, 55, NULL }
+        },
+        1, FALSE, 0
+    },
+    {
+        "C.2.2 literal, not indexed",
+        {
+            { "040c2f73616d706c652f70617468",
+              { ":path", "/sample/path", NULL }, 0, NULL }
+        },
+        1, FALSE, 0
+    },
+    {
+        "C.2.3 literal, never indexed",
+        {
+            { "100870617373776f726406736563726574",
+              { "password", "secret", NULL }, 0, NULL }
+        },
+        1, FALSE, 0
+    },
+    {
+        "C.2.4 indexed",
+        {
+            { "82",
+              { ":method", "GET", NULL }, 0, NULL }
+        },
+        1, FALSE, 0
+    },
+    {
+        "C.3 requests",
+        {
+            { "828684410f7777772e6578616d706c652e636f6d",
+              { ":method", "GET", ":scheme", "http", ":path", "/", ":authority", "www.example.com", NULL }, 57, NULL },
+            { "828684be58086e6f2d6361636865",
+              { ":method", "GET", ":scheme", "http", ":path", "/", ":authority", "www.example.com",
+                "cache-control", "no-cache", NULL }, 110, NULL },
+            { "828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565",
+              { ":method", "GET", ":scheme", "https", ":path", "/index.html", ":authority", "www.example.com",
+                "custom-key", "custom-value", NULL }, 164, NULL }
+        },
+        3, FALSE, 0
+    },
+    {
+        "C.4 requests, Huffman",
+        {
+            { "828684418cf1e3c2e5f23a6ba0ab90f4ff",
+              { ":method", "GET", ":scheme", "http", ":path", "/", ":authority", "www.example.com", NULL }, 57, NULL },
+            { "828684be5886a8eb10649cbf",
+              { ":method", "GET", ":scheme", "http", ":path", "/", ":authority", "www.example.com",
+                "cache-control", "no-cache", NULL }, 110, NULL },
+            { "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf",
+              { ":method", "GET", ":scheme", "https", ":path", "/index.html", ":authority", "www.example.com",
+                "custom-key", "custom-value", NULL }, 164, NULL }
+        },
+        3, TRUE, 4096
+    },
+    {
+        "C.5 responses, eviction",
+        {
+            { "3fe101"
+              "4803333032580770726976617465611d4d6f6e2c203231204f637420323031332032303a31333a323120474d54"
+              "6e1768747470733a2f2f7777772e6578616d706c652e636f6d",
+              { ":status", "302", "cache-control", "private", "date", kRFC7541Date1,
+                "location", "https://www.example.com", NULL }, 222, NULL },
+            { "4803333037c1c0bf",
+              { ":status", "307", "cache-control", "private", "date", kRFC7541Date1,
+                "location", "https://www.example.com", NULL }, 222, NULL },
+            { "88c1611d4d6f6e2c203231204f637420323031332032303a31333a323220474d54c05a04677a69707738666f6f3d"
+              "4153444a4b48514b425a584f5157454f50495541585157454f49553b206d61782d6167653d333630303b2076657273"
+              "696f6e3d31",
+              { ":status", "200", "cache-control", "private", "date", kRFC7541Date2,
+                "location", "https://www.example.com", "content-encoding", "gzip",
+                "set-cookie", kRFC7541Cookie, NULL }, 215, NULL }
+        },
+        3, FALSE, 0
+    },
+    {
+        // Huffman coding "307" saves nothing, so the encoder sends it as
+        // it is, giving the block of C.5.2 rather than that of C.6.2.
+
+        "C.6 responses, Huffman, eviction",
+        {
+            { "3fe101"
+              "488264025885aec3771a4b6196d07abe941054d444a8200595040b8166e082a62d1bff6e919d29ad171863c78f0b97"
+              "c8e9ae82ae43d3",
+              { ":status", "302", "cache-control", "private", "date", kRFC7541Date1,
+                "location", "https://www.example.com", NULL }, 222, NULL },
+            { "4883640effc1c0bf",
+              { ":status", "307", "cache-control", "private", "date", kRFC7541Date1,
+                "location", "https://www.example.com", NULL }, 222, "4803333037c1c0bf" },
+            { "88c16196d07abe941054d444a8200595040b8166e084a62d1bffc05a839bd9ab77ad94e7821dd7f2e6c7b335dfdf"
+              "cd5b3960d5af27087f3672c1ab270fb5291f9587316065c003ed4ee5b1063d5007",
+              { ":status", "200", "cache-control", "private", "date", kRFC7541Date2,
+                "location", "https://www.example.com", "content-encoding", "gzip",
+                "set-cookie", kRFC7541Cookie, NULL }, 215, NULL }
+        },
+        3, TRUE, 256
+    }
+};
+
+/**
+ *  Blocks the decoder must refuse, each on a fresh connection.
+ *
+ */
+static const struct {
+    const char *  mDescription;
+    const char *  mBlock;
+} sHPACKBadBlocks[] = {
+    { "decode, index past the table",     "be"       },
+    { "decode, table size over limit",    "3fe21f"   },
+    { "decode, table size after a field", "823fe101" },
+    { "decode, truncated literal",        "400a6375" }
+};
+
+static CFDataRef
+CreateDataFromHex(const char *aHex)
+{
+    CFMutableDataRef data   = CFDataCreateMutable(kCFAllocatorDefault, 0);
+    size_t           length = strlen(aHex);
+    size_t           i;
+
+    if (data == NULL) {
+        return (NULL);
+    }
+
+    for (i = 0; i + 1 < length; i += 2) {
+        unsigned int value;
+        UInt8        byte;
+
+        sscanf(aHex + i, "%2x", &value);
+
+        byte = (UInt8)value;
+        CFDataAppendBytes(data, &byte, 1);
+    }
+
+    return (data);
+}
+
+static CFArrayRef
+CreateFields(const char * const *aFields)
+{
+    CFMutableArrayRef fields = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+
+    if (fields == NULL) {
+        return (NULL);
+    }
+
+    for (; *aFields != NULL; aFields++) {
+        CFStringRef string = CFStringCreateWithCString(kCFAllocatorDefault, *aFields, kCFStringEncodingISOLatin1);
+
+        if (string != NULL) {
+            CFArrayAppendValue(fields, string);
+            CFRelease(string);
+        }
+    }
+
+    return (fields);
+}
+
+/**
+ *  Decode the example's blocks in order on one connection, checking
+ *  the fields of each and the size of the table after it; then, if
+ *  the example asks, encode its fields in order on another and check
+ *  the bytes and table sizes the encoder produces.
+ *
+ */
+static int
+TestHPACKExample(const HPACKExample *aExample)
+{
+    CFTypeRef  decoder  = NULL;
+    CFTypeRef  encoder  = NULL;
+    CFDataRef  block    = NULL;
+    CFDataRef  encoded  = NULL;
+    CFArrayRef expected = NULL;
+    CFArrayRef fields   = NULL;
+    CFIndex    i;
+    int        status   = -1;
+
+    decoder = _CFHTTP2ConnectionCreate(kCFAllocatorDefault, CFSTR("localhost"), 80, kHTTP2Cleartext, NULL);
+    __Require(decoder != NULL, done);
+
+    encoder = _CFHTTP2ConnectionCreate(kCFAllocatorDefault, CFSTR("localhost"), 80, kHTTP2Cleartext, NULL);
+    __Require(encoder != NULL, done);
+
+    if (aExample->mEncode) {
+        _CFHTTP2ConnectionSetHPACKEncoderTableSize(encoder, aExample->mEncoderTableSize);
+    }
+
+    for (i = 0; i < aExample->mCount; i++) {
+        const HPACKBlock *theBlock = &aExample->mBlocks[i];
+
+        block = CreateDataFromHex(theBlock->mBlock);
+        __Require(block != NULL, done);
+
+        expected = CreateFields(theBlock->mFields);
+        __Require(expected != NULL, done);
+
+        fields = _CFHTTP2ConnectionCopyHPACKDecodedFields(decoder, block);
+        __Require(fields != NULL, done);
+        __Require(CFEqual(fields, expected), done);
+        __Require(_CFHTTP2ConnectionGetHPACKTableSize(decoder, FALSE) == theBlock->mTableSize, done);
+
+        if (aExample->mEncode) {
+            if (theBlock->mEncoded != NULL) {
+                CFRelease(block);
+
+                block = CreateDataFromHex(theBlock->mEncoded);
+                __Require(block != NULL, done);
+            }
+
+            encoded = _CFHTTP2ConnectionCreateHPACKBlock(encoder, expected);
+            __Require(encoded != NULL, done);
+            __Require(CFEqual(encoded, block), done);
+            __Require(_CFHTTP2ConnectionGetHPACKTableSize(encoder, TRUE) == theBlock->mTableSize, done);
+
+            CFRelease(encoded);
+            encoded = NULL;
+        }
+
+        CFRelease(fields);
+        fields = NULL;
+
+        CFRelease(expected);
+        expected = NULL;
+
+        CFRelease(block);
+        block = NULL;
+    }
+
+    status = 0;
+
+ done:
+    __CFHTTP2ConnectionTestLog("%-40s %s\n", aExample->mDescription, (status == 0) ? "passed" : "FAILED");
+
+    if (fields != NULL) {
+        CFRelease(fields);
+    }
+
+    if (expected != NULL) {
+        CFRelease(expected);
+    }
+
+    if (encoded != NULL) {
+        CFRelease(encoded);
+    }
+
+    if (block != NULL) {
+        CFRelease(block);
+    }
+
+    if (encoder != NULL) {
+        CFRelease(encoder);
+    }
+
+    if (decoder != NULL) {
+        CFRelease(decoder);
+    }
+
+    return (status);
+}
+
+static int
+TestHPACKBadBlock(const char *aDescription, const char *aBlock)
+{
+    CFTypeRef  decoder = NULL;
+    CFDataRef  block   = NULL;
+    CFArrayRef fields  = NULL;
+    int        status  = -1;
+
+    decoder = _CFHTTP2ConnectionCreate(kCFAllocatorDefault, CFSTR("localhost"), 80, kHTTP2Cleartext, NULL);
+    __Require(decoder != NULL, done);
+
+    block = CreateDataFromHex(aBlock);
+    __Require(block != NULL, done);
+
+    fields = _CFHTTP2ConnectionCopyHPACKDecodedFields(decoder, block);
+    __Require(fields == NULL, done);
+
+    status = 0;
+
+ done:
+    __CFHTTP2ConnectionTestLog("%-40s %s\n", aDescription, (status == 0) ? "passed" : "FAILED");
+
+    if (fields != NULL) {
+        CFRelease(fields);
+    }
+
+    if (block != NULL) {
+        CFRelease(block);
+    }
+
+    if (decoder != NULL) {
+        CFRelease(decoder);
+    }
+
+    return (status);
+}
+
+// Server
+
+typedef struct {
+    UInt8  mType;
+    UInt8  mFlags;
+    UInt32 mStream;
+    UInt32 mLength;
+    UInt8  mPayload[kFrameMaxSize];
+} Frame;
+
+/**
+ *  Read exactly the given number of bytes, waiting no longer than the
+ *  timeout, in milliseconds, for each to arrive.  Returns 1 once they
+ *  have, 0 if none came in time and -1 on end of stream or error.
+ *
+ */
+static int
+ReadAll(int aSocket, void *aBytes, size_t aLength, int aTimeout)
+{
+    UInt8  *bytes  = (UInt8 *)aBytes;
+    size_t  offset = 0;
+
+    while (offset < aLength) {
+        struct pollfd pfd = { aSocket, POLLIN, 0 };
+        ssize_t       received;
+        int           ready;
+
+        ready = poll(&pfd, 1, aTimeout);
+
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ready == 0 && offset == 0) {
+            return (0);
+        }
+
+        if (ready <= 0) {
+            return (-1);
+        }
+
+        received = read(aSocket, bytes + offset, aLength - offset);
+
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (received <= 0) {
+            return (-1);
+        }
+
+        offset += (size_t)received;
+    }
+
+    return (1);
+}
+
+static int
+ReadFrame(int aSocket, Frame *aFrame, int aTimeout)
+{
+    UInt8 header[kFrameHeaderSize];
+    int   status;
+
+    status = ReadAll(aSocket, header, sizeof (header), aTimeout);
+
+    if (status <= 0) {
+        return (status);
+    }
+
+    aFrame->mLength = (header[0] << 16) | (header[1] << 8) | header[2];
+    aFrame->mType   = header[3];
+    aFrame->mFlags  = header[4];
+    aFrame->mStream = ((header[5] & 0x7F) << 24) | (header[6] << 16) | (header[7] << 8) | header[8];
+
+    if (aFrame->mLength > sizeof (aFrame->mPayload)) {
+        return (-1);
+    }
+
+    if (aFrame->mLength == 0) {
+        return (1);
+    }
+
+    return ((ReadAll(aSocket, aFrame->mPayload, aFrame->mLength, kFrameTimeout) > 0) ? 1 : -1);
+}
+
+static Boolean
+WriteFrame(int aSocket, UInt8 aType, UInt8 aFlags, UInt32 aStream, const void *aPayload, UInt32 aLength)
+{
+    UInt8 header[kFrameHeaderSize] = {
+        (aLength >> 16) & 0xFF, (aLength >> 8) & 0xFF, aLength & 0xFF,
+        aType, aFlags,
+        (aStream >> 24) & 0x7F, (aStream >> 16) & 0xFF, (aStream >> 8) & 0xFF, aStream & 0xFF
+    };
+
+    return (WriteAll(aSocket, header, sizeof (header)) && ((aLength == 0) || WriteAll(aSocket, aPayload, aLength)));
+}
+
+static Boolean
+WriteInitialWindowSize(int aSocket, UInt32 aValue)
+{
+    const UInt8 payload[6] = {
+        0, kSettingInitialWindowSize,
+        (aValue >> 24) & 0xFF, (aValue >> 16) & 0xFF, (aValue >> 8) & 0xFF, aValue & 0xFF
+    };
+
+    return (WriteFrame(aSocket, kFrameSettings, 0, 0, payload, sizeof (payload)));
+}
+
+static Boolean
+WriteWindowUpdate(int aSocket, UInt32 aStream, UInt32 aIncrement)
+{
+    const UInt8 payload[4] = {
+        (aIncrement >> 24) & 0x7F, (aIncrement >> 16) & 0xFF, (aIncrement >> 8) & 0xFF, aIncrement & 0xFF
+    };
+
+    return (WriteFrame(aSocket, kFrameWindowUpdate, 0, aStream, payload, sizeof (payload)));
+}
+
+/**
+ *  Count the request body bytes which arrive until the client stops
+ *  sending, or ends the stream.  Fails if the client gives up on the
+ *  stream or the connection instead.
+ *
+ */
+static Boolean
+ReceiveData(int aSocket, size_t *aReceived, Boolean *aEnded)
+{
+    Frame frame;
+    int   status;
+
+    while ((status = ReadFrame(aSocket, &frame, kIdleTimeout)) > 0) {
+        if ((frame.mType == kFrameGoAway) || (frame.mType == kFrameRSTStream)) {
+            return (FALSE);
+        }
+
+        if ((frame.mType == kFrameData) && (frame.mStream == 1)) {
+            *aReceived += frame.mLength;
+
+            if (frame.mFlags & kFlagEndStream) {
+                *aEnded = TRUE;
+                break;
+            }
+        }
+    }
+
+    return (status >= 0);
+}
+
+// The scenarios, each run once the request's headers have arrived on
+// stream 1.  The response "HEADERS" blocks are just ":status: 200"
+// (0x88), the literal "x-test: split" and a block with neither.
+
+static const UInt8 sStatus200[]  = { 0x88 };
+static const UInt8 sTestField[]  = { 0x00, 0x06, 'x', '-', 't', 'e', 's', 't', 0x05, 's', 'p', 'l', 'i', 't' };
+static const UInt8 sPing[8]      = { 0 };
+
+static Boolean
+ServeOversizedFrame(int aSocket)
+{
+    UInt8 payload[kFrameMaxSize + 1];
+
+    memset(payload, 0, sizeof (payload));
+
+    // The client may stop reading, and close, after the frame's header.
+
+    WriteFrame(aSocket, kFrameData, 0, 1, payload, sizeof (payload));
+
+    return (TRUE);
+}
+
+static Boolean
+ServeDataPaddingTooLong(int aSocket)
+{
+    const UInt8 payload[] = { 4, 'a', 'b', 'c' };
+
+    return (WriteFrame(aSocket, kFrameHeaders, kFlagEndHeaders, 1, sStatus200, sizeof (sStatus200)) &&
+            WriteFrame(aSocket, kFrameData, kFlagPadded, 1, payload, sizeof (payload)));
+}
+
+static Boolean
+ServeHeadersPaddingTooLong(int aSocket)
+{
+    const UInt8 payload[] = { 5, 0x88 };
+
+    return (WriteFrame(aSocket, kFrameHeaders, kFlagPadded | kFlagEndHeaders, 1, payload, sizeof (payload)));
+}
+
+static Boolean
+ServeInterruptedHeaders(int aSocket)
+{
+    return (WriteFrame(aSocket, kFrameHeaders, 0, 1, sStatus200, sizeof (sStatus200)) &&
+            WriteFrame(aSocket, kFramePing, 0, 0, sPing, sizeof (sPing)));
+}
+
+static Boolean
+ServeContinuation(int aSocket)
+{
+    return (WriteFrame(aSocket, kFrameHeaders, 0, 1, sStatus200, sizeof (sStatus200)) &&
+            WriteFrame(aSocket, kFrameContinuation, 0, 1, NULL, 0) &&
+            WriteFrame(aSocket, kFrameContinuation, kFlagEndHeaders, 1, sTestField, sizeof (sTestField)) &&
+            WriteFrame(aSocket, kFrameData, kFlagEndStream, 1, "hello", 5));
+}
+
+static Boolean
+ServeInitialWindowTooLarge(int aSocket)
+{
+    return (WriteInitialWindowSize(aSocket, 0x80000000));
+}
+
+static Boolean
+ServeInitialWindowOverflow(int aSocket)
+{
+    // The stream's window is 1000 over the initial one when that is
+    // raised to the most allowed.
+
+    return (WriteWindowUpdate(aSocket, 1, 1000) && WriteInitialWindowSize(aSocket, 0x7FFFFFFF));
+}
+
+/**
+ *  Hold the request body to the stream's window, as the initial
+ *  window size setting moves it up and down, and then answer.
+ *
+ */
+static Boolean
+ServeInitialWindowChanges(int aSocket)
+{
+    size_t  received = 0;
+    Boolean ended    = FALSE;
+
+    // Both windows start at the default, and then only the stream's is short.
+
+    __Require(ReceiveData(aSocket, &received, &ended) && (received == kDefaultWindow) && !ended, done);
+    __Require(WriteWindowUpdate(aSocket, 0, 2 * kRequestBodySize), done);
+    __Require(ReceiveData(aSocket, &received, &ended) && (received == kDefaultWindow) && !ended, done);
+
+    // Raising the setting opens the stream's window by the difference...
+
+    __Require(WriteInitialWindowSize(aSocket, kDefaultWindow + 500), done);
+    __Require(ReceiveData(aSocket, &received, &ended) && (received == kDefaultWindow + 500) && !ended, done);
+
+    // ...and lowering it again closes it below zero, so that an update of
+    // the same amount leaves nothing to send.
+
+    __Require(WriteInitialWindowSize(aSocket, kDefaultWindow), done);
+    __Require(WriteWindowUpdate(aSocket, 1, 500), done);
+    __Require(ReceiveData(aSocket, &received, &ended) && (received == kDefaultWindow + 500) && !ended, done);
+
+    __Require(WriteWindowUpdate(aSocket, 1, kRequestBodySize - (kDefaultWindow + 500)), done);
+    __Require(ReceiveData(aSocket, &received, &ended) && (received == kRequestBodySize) && ended, done);
+
+    return (WriteFrame(aSocket, kFrameHeaders, kFlagEndHeaders | kFlagEndStream, 1, sStatus200, sizeof (sStatus200)));
+
+ done:
+    return (FALSE);
+}
+
+static Boolean
+ServeConnectionWindowOverflow(int aSocket)
+{
+    return (WriteWindowUpdate(aSocket, 0, 0x7FFFFFFF));
+}
+
+static Boolean
+ServeStreamWindowOverflow(int aSocket)
+{
+    return (WriteWindowUpdate(aSocket, 1, 0x7FFFFFFF));
+}
+
+static Boolean
+ServeWindowUpdateIdleStream(int aSocket)
+{
+    return (WriteWindowUpdate(aSocket, 3, 1));
+}
+
+static Boolean
+ServeWindowUpdateServerStream(int aSocket)
+{
+    return (WriteWindowUpdate(aSocket, 2, 1));
+}
+
+typedef struct {
+    const char *  mDescription;
+    Boolean     (*mServe)(int aSocket);
+    Boolean       mRequestBody;
+    UInt8         mAnswerType;      // 0 if the response should be read whole
+    UInt32        mAnswerCode;
+    const char *  mResponseBody;
+} FrameTest;
+
+static const FrameTest sFrameTests[] = {
+    { "frame, oversized",                       ServeOversizedFrame,            FALSE, kFrameGoAway,    kErrorFrameSize,   NULL    },
+    { "DATA, padding too long",                 ServeDataPaddingTooLong,        FALSE, kFrameGoAway,    kErrorProtocol,    NULL    },
+    { "HEADERS, padding too long",              ServeHeadersPaddingTooLong,     FALSE, kFrameGoAway,    kErrorProtocol,    NULL    },
+    { "CONTINUATION, interleaved",              ServeInterruptedHeaders,        FALSE, kFrameGoAway,    kErrorProtocol,    NULL    },
+    { "CONTINUATION",                           ServeContinuation,              FALSE, 0,               0,                 "hello" },
+    { "initial window size, too large",         ServeInitialWindowTooLarge,     FALSE, kFrameGoAway,    kErrorFlowControl, NULL    },
+    { "initial window size, overflow",          ServeInitialWindowOverflow,     FALSE, kFrameGoAway,    kErrorFlowControl, NULL    },
+    { "initial window size, changes",           ServeInitialWindowChanges,      TRUE,  0,               0,                 ""      },
+    { "WINDOW_UPDATE, connection overflow",     ServeConnectionWindowOverflow,  FALSE, kFrameGoAway,    kErrorFlowControl, NULL    },
+    { "WINDOW_UPDATE, stream overflow",         ServeStreamWindowOverflow,      FALSE, kFrameRSTStream, kErrorFlowControl, NULL    },
+    { "WINDOW_UPDATE, idle stream",             ServeWindowUpdateIdleStream,    FALSE, kFrameGoAway,    kErrorProtocol,    NULL    },
+    { "WINDOW_UPDATE, server stream",           ServeWindowUpdateServerStream,  FALSE, kFrameGoAway,    kErrorProtocol,    NULL    }
+};
+
+/**
+ *  Serve one connection: take the client's preface and request
+ *  headers, run the test's scenario and, if the client is expected
+ *  to give up, wait for its GOAWAY or RST_STREAM.  The report is
+ *  whether the scenario ran as planned, followed by the type and
+ *  error code of the frame the client gave up with, if any.
+ *
+ */
+static void
+ServeConnection(int aSocket, int aReport, const void *aContext)
+{
+    static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    const FrameTest  *test      = (const FrameTest *)aContext;
+    char              received[sizeof (preface) - 1];
+    Frame             frame;
+    UInt32            report[3] = { 0, 0, 0 };
+
+    __Require(ReadAll(aSocket, received, sizeof (received), kFrameTimeout) > 0, done);
+    __Require(memcmp(received, preface, sizeof (received)) == 0, done);
+
+    __Require(WriteFrame(aSocket, kFrameSettings, 0, 0, NULL, 0), done);
+
+    do {
+        __Require(ReadFrame(aSocket, &frame, kFrameTimeout) > 0, done);
+    } while ((frame.mType != kFrameHeaders) || (frame.mStream != 1));
+
+    report[0] = test->mServe(aSocket);
+
+    while (report[0] && test->mAnswerType) {
+        __Require(ReadFrame(aSocket, &frame, kFrameTimeout) > 0, done);
+
+        if ((frame.mType == kFrameGoAway) && (frame.mLength >= 8)) {
+            report[1] = frame.mType;
+            report[2] = (frame.mPayload[4] << 24) | (frame.mPayload[5] << 16) | (frame.mPayload[6] << 8) | frame.mPayload[7];
+            break;
+        }
+
+        if ((frame.mType == kFrameRSTStream) && (frame.mLength == 4)) {
+            report[1] = frame.mType;
+            report[2] = (frame.mPayload[0] << 24) | (frame.mPayload[1] << 16) | (frame.mPayload[2] << 8) | frame.mPayload[3];
+            break;
+        }
+    }
+
+ done:
+    WriteAll(aReport, report, sizeof (report));
+}
+
+// Client
+
+/**
+ *  Send one request over a cleartext HTTP/2 connection to a server
+ *  running the test's scenario, and check both how the request ended
+ *  and what the server saw of the client's answer.
+ *
+ */
+static int
+TestFrames(const FrameTest *aTest)
+{
+    char             url[128];
+    char             body[256];
+    unsigned short   port       = 0;
+    int              report     = -1;
+    pid_t            server     = -1;
+    UInt32           reported[3];
+    CFURLRef         theURL     = NULL;
+    CFHTTPMessageRef request    = NULL;
+    CFHTTPMessageRef response   = NULL;
+    CFDataRef        data       = NULL;
+    CFStringRef      field      = NULL;
+    CFTypeRef        connection = NULL;
+    CFReadStreamRef  stream     = NULL;
+    CFStreamError    error      = { 0, 0 };
+    size_t           length     = 0;
+    int              status     = -1;
+
+    server = ServerStart(ServeConnection, aTest, kServerServeOnce, &port, &report);
+    __Require(server > 0, done);
+
+    snprintf(url, sizeof (url), "http://127.0.0.1:%u/", port);
+
+    theURL = CFURLCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)url, strlen(url), kCFStringEncodingASCII, NULL);
+    __Require(theURL != NULL, done);
+
+    request = CFHTTPMessageCreateRequest(kCFAllocatorDefault, aTest->mRequestBody ? CFSTR("POST") : CFSTR("GET"), theURL, kCFHTTPVersion1_1);
+    __Require(request != NULL, done);
+
+    if (aTest->mRequestBody) {
+        UInt8 *bytes = calloc(1, kRequestBodySize);
+
+        __Require(bytes != NULL, done);
+
+        data = CFDataCreate(kCFAllocatorDefault, bytes, kRequestBodySize);
+        free(bytes);
+        __Require(data != NULL, done);
+
+        CFHTTPMessageSetBody(request, data);
+    }
+
+    connection = _CFHTTP2ConnectionCreate(kCFAllocatorDefault, CFSTR("127.0.0.1"), port, kHTTP2Cleartext, NULL);
+    __Require(connection != NULL, done);
+
+    stream = _CFHTTP2ConnectionEnqueue(connection, request, NULL);
+    __Require(stream != NULL, done);
+
+    if (!CFReadStreamOpen(stream)) {
+        error = CFReadStreamGetError(stream);
+    }
+
+    while (error.error == 0) {
+        CFIndex read = CFReadStreamRead(stream, (UInt8 *)body + length, sizeof (body) - 1 - length);
+
+        if (read < 0) {
+            error = CFReadStreamGetError(stream);
+            break;
+        }
+
+        if (read == 0) {
+            break;
+        }
+
+        length += (size_t)read;
+    }
+
+    body[length] = '\0';
+
+    if (aTest->mAnswerType) {
+        __Require(error.domain == kCFStreamErrorDomainHTTP, done);
+        __Require(error.error == kCFStreamErrorHTTP2StreamReset, done);
+
+    } else {
+        __Require(error.error == 0, done);
+        __Require(strcmp(body, aTest->mResponseBody) == 0, done);
+
+        response = (CFHTTPMessageRef)CFReadStreamCopyProperty(stream, kCFStreamPropertyHTTPResponseHeader);
+        __Require(response != NULL, done);
+        __Require(CFHTTPMessageGetResponseStatusCode(response) == 200, done);
+
+        if (aTest->mServe == ServeContinuation) {
+            field = CFHTTPMessageCopyHeaderFieldValue(response, CFSTR("X-Test"));
+            __Require(field != NULL, done);
+            __Require(CFEqual(field, CFSTR("split")), done);
+        }
+    }
+
+    __Require(read(report, reported, sizeof (reported)) == sizeof (reported), done);
+    __Require(reported[0] != 0, done);
+
+    if (aTest->mAnswerType) {
+        __Require(reported[1] == aTest->mAnswerType, done);
+        __Require(reported[2] == aTest->mAnswerCode, done);
+    }
+
+    status = 0;
+
+ done:
+    __CFHTTP2ConnectionTestLog("%-40s %s\n", aTest->mDescription, (status == 0) ? "passed" : "FAILED");
+
+    if (field != NULL) {
+        CFRelease(field);
+    }
+
+    if (response != NULL) {
+        CFRelease(response);
+    }
+
+    if (stream != NULL) {
+        CFReadStreamClose(stream);
+        CFRelease(stream);
+    }
+
+    if (connection != NULL) {
+        _CFHTTP2ConnectionInvalidate(connection, NULL);
+        CFRelease(connection);
+    }
+
+    if (data != NULL) {
+        CFRelease(data);
+    }
+
+    if (request != NULL) {
+        CFRelease(request);
+    }
+
+    if (theURL != NULL) {
+        CFRelease(theURL);
+    }
+
+    if (report >= 0) {
+        close(report);
+    }
+
+    ServerStop(server);
+
+    return (status);
+}
+
+int
+main(void)
+{
+    size_t i;
+    int    status = 0;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    for (i = 0; i < sizeof (sHPACKExamples) / sizeof (sHPACKExamples[0]); i++) {
+        if (TestHPACKExample(&sHPACKExamples[i]) != 0) {
+            status = -1;
+        }
+    }
+
+    for (i = 0; i < sizeof (sHPACKBadBlocks) / sizeof (sHPACKBadBlocks[0]); i++) {
+        if (TestHPACKBadBlock(sHPACKBadBlocks[i].mDescription, sHPACKBadBlocks[i].mBlock) != 0) {
+            status = -1;
+        }
+    }
+
+    for (i = 0; i < sizeof (sFrameTests) / sizeof (sFrameTests[0]); i++) {
+        if (TestFrames(&sFrameTests[i]) != 0) {
+            status = -1;
+        }
+    }
+
+    return ((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,346 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements a test of the HTTP authentication cache:
+ *     that once a server has accepted Basic credentials, later
+ *     requests in the same protection space carry them before being
+ *     challenged, that requests outside it do not, and that nothing is
+ *     sent ahead of a challenge once the cache has been flushed.
+ *
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <AssertMacros.h>
+
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFHTTPMessagePriv.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "TestSupport.h"
+
+#define __CFHTTPAuthenticationCacheTestLog(format, ...)   do { fprintf(stderr, format, ##__VA_ARGS__); fflush(stderr); } while (0)
+
+#define kCFHTTPAuthenticationCacheTestUser          "user"
+#define kCFHTTPAuthenticationCacheTestPassword      "password"
+
+// "user:password", base64-encoded
+#define kCFHTTPAuthenticationCacheTestCredentials   "dXNlcjpwYXNzd29yZA=="
+
+// Server
+
+/**
+ *  Answer one request on the connection, then close it.  Paths under
+ *  "/private/" are answered with a Basic challenge unless the request
+ *  carries the test's credentials; others are always answered.  Each
+ *  request is reported on the pipe as its path, followed by
+ *  " authorized" if it carried the test's credentials, or
+ *  " rejected" if it carried others.
+ *
+ */
+static void
+ServeConnection(int aSocket, int aReport, const void *aContext)
+{
+    char        request[2048];
+    char        path[256];
+    char        response[512];
+    const char *authorization;
+    Boolean     authorized;
+    size_t      length = 0;
+    int         count;
+
+    while (length < sizeof (request) - 1) {
+        ssize_t received = read(aSocket, request + length, sizeof (request) - 1 - length);
+
+        if (received <= 0) {
+            return;
+        }
+
+        length += (size_t)received;
+        request[length] = '\0';
+
+        if (strstr(request, "\r\n\r\n") != NULL) {
+            break;
+        }
+    }
+
+    if (sscanf(request, "GET %255s ", path) != 1) {
+        return;
+    }
+
+    authorization = strstr(request, "\r\nAuthorization: ");
+    authorized    = (strstr(request, "\r\nAuthorization: Basic " kCFHTTPAuthenticationCacheTestCredentials "\r\n") != NULL);
+
+    count = snprintf(response, sizeof (response), "%s%s\n", path, authorized ? " authorized" : (authorization != NULL) ? " rejected" : "");
+    WriteAll(aReport, response, count);
+
+    if ((strncmp(path, "/private/", 9) == 0) && !authorized) {
+        count = snprintf(response, sizeof (response),
+                         "HTTP/1.1 401 Unauthorized\r\n"
+                         "WWW-Authenticate: Basic realm=\"test\"\r\n"
+                         "Content-Length: 0\r\n"
+                         "Connection: close\r\n"
+                         "\r\n");
+
+    } else {
+        count = snprintf(response, sizeof (response),
+                         "HTTP/1.1 200 OK\r\n"
+                         "Content-Type: text/plain\r\n"
+                         "Content-Length: %zu\r\n"
+                         "Connection: close\r\n"
+                         "\r\n"
+                         "%s",
+                         strlen(path),
+                         path);
+
+    }
+
+    WriteAll(aSocket, response, count);
+}
+
+// Client
+
+/**
+ *  Fetch the path from the server, with the test's credentials
+ *  applied through the authentication if there is one, returning the
+ *  response's status code and, if asked for, the response.
+ *
+ */
+static int
+Fetch(unsigned short aPort, const char *aPath, CFHTTPAuthenticationRef anAuthentication, UInt32 *aStatusCode, CFHTTPMessageRef *aResponse)
+{
+    char             url[128];
+    UInt8            buffer[256];
+    CFURLRef         theURL   = NULL;
+    CFHTTPMessageRef request  = NULL;
+    CFHTTPMessageRef response = NULL;
+    CFReadStreamRef  stream   = NULL;
+    Boolean          result;
+    int              status   = -1;
+
+    snprintf(url, sizeof (url), "http://127.0.0.1:%u%s", aPort, aPath);
+
+    theURL = CFURLCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)url, strlen(url), kCFStringEncodingASCII, NULL);
+    __Require(theURL != NULL, done);
+
+    request = CFHTTPMessageCreateRequest(kCFAllocatorDefault, CFSTR("GET"), theURL, kCFHTTPVersion1_1);
+    __Require(request != NULL, done);
+
+    if (anAuthentication != NULL) {
+        result = CFHTTPMessageApplyCredentials(request,
+                                               anAuthentication,
+                                               CFSTR(kCFHTTPAuthenticationCacheTestUser),
+                                               CFSTR(kCFHTTPAuthenticationCacheTestPassword),
+                                               NULL);
+        __Require(result, done);
+    }
+
+    stream = CFReadStreamCreateForHTTPRequest(kCFAllocatorDefault, request);
+    __Require(stream != NULL, done);
+
+    result = CFReadStreamOpen(stream);
+    __Require(result, done);
+
+    while (TRUE) {
+        CFIndex read = CFReadStreamRead(stream, buffer, sizeof (buffer));
+
+        __Require(read >= 0, done);
+
+        if (read == 0) {
+            break;
+        }
+    }
+
+    response = (CFHTTPMessageRef)CFReadStreamCopyProperty(stream, kCFStreamPropertyHTTPResponseHeader);
+    __Require(response != NULL, done);
+
+    *aStatusCode = CFHTTPMessageGetResponseStatusCode(response);
+
+    if (aResponse != NULL) {
+        *aResponse = response;
+        response   = NULL;
+    }
+
+    status = 0;
+
+ done:
+    if (response != NULL) {
+        CFRelease(response);
+    }
+
+    if (stream != NULL) {
+        CFReadStreamClose(stream);
+        CFRelease(stream);
+    }
+
+    if (request != NULL) {
+        CFRelease(request);
+    }
+
+    if (theURL != NULL) {
+        CFRelease(theURL);
+    }
+
+    return (status);
+}
+
+/**
+ *  Fetch the path without credentials of its own and check the status
+ *  code and what the server saw.
+ *
+ */
+static int
+Expect(unsigned short aPort, int aReport, const char *aDescription, const char *aPath, UInt32 aStatusCode, const char *aReports)
+{
+    char   reports[256];
+    UInt32 statusCode = 0;
+    int    status;
+
+    status = Fetch(aPort, aPath, NULL, &statusCode, NULL);
+    __Require(status == 0, done);
+
+    status = -1;
+
+    ReadReports(aReport, reports, sizeof (reports));
+
+    __Require(statusCode == aStatusCode, done);
+    __Require(strcmp(reports, aReports) == 0, done);
+
+    status = 0;
+
+ done:
+    __CFHTTPAuthenticationCacheTestLog("%-40s %s\n", aDescription, (status == 0) ? "passed" : "FAILED");
+
+    return (status);
+}
+
+/**
+ *  Answer a challenge the way a client would: fetch the path, create
+ *  the authentication from the 401, and fetch it again with the
+ *  test's credentials applied.
+ *
+ */
+static int
+Authenticate(unsigned short aPort, int aReport, const char *aPath)
+{
+    char                    reports[256];
+    char                    expected[256];
+    CFHTTPMessageRef        response       = NULL;
+    CFHTTPAuthenticationRef authentication = NULL;
+    UInt32                  statusCode     = 0;
+    int                     status;
+
+    status = Fetch(aPort, aPath, NULL, &statusCode, &response);
+    __Require(status == 0, done);
+
+    status = -1;
+
+    __Require(statusCode == 401, done);
+
+    authentication = CFHTTPAuthenticationCreateFromResponse(kCFAllocatorDefault, response);
+    __Require(authentication != NULL, done);
+    __Require(CFHTTPAuthenticationIsValid(authentication, NULL), done);
+
+    status = Fetch(aPort, aPath, authentication, &statusCode, NULL);
+    __Require(status == 0, done);
+
+    status = -1;
+
+    __Require(statusCode == 200, done);
+
+    ReadReports(aReport, reports, sizeof (reports));
+
+    snprintf(expected, sizeof (expected), "%s\n%s authorized\n", aPath, aPath);
+    __Require(strcmp(reports, expected) == 0, done);
+
+    status = 0;
+
+ done:
+    __CFHTTPAuthenticationCacheTestLog("%-40s %s\n", "challenged, then authenticated", (status == 0) ? "passed" : "FAILED");
+
+    if (authentication != NULL) {
+        CFRelease(authentication);
+    }
+
+    if (response != NULL) {
+        CFRelease(response);
+    }
+
+    return (status);
+}
+
+int
+main(void)
+{
+    unsigned short port   = 0;
+    int            report = -1;
+    pid_t          server = -1;
+    int            status = -1;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // Reports are only read once the response they precede has been
+    // read, so none should be waiting when the pipe is polled.
+
+    server = ServerStart(ServeConnection, NULL, kServerReportNonBlocking, &port, &report);
+    __Require(server > 0, done);
+
+    _CFHTTPAuthenticationFlushCache();
+
+    status = Expect(port, report, "not cached", "/private/a", 401, "/private/a\n");
+    __Require(status == 0, done);
+
+    status = Authenticate(port, report, "/private/a");
+    __Require(status == 0, done);
+
+    status = Expect(port, report, "cached, same request", "/private/a", 200, "/private/a authorized\n");
+    __Require(status == 0, done);
+
+    status = Expect(port, report, "cached, same directory", "/private/b", 200, "/private/b authorized\n");
+    __Require(status == 0, done);
+
+    status = Expect(port, report, "cached, other directory", "/public/c", 200, "/public/c\n");
+    __Require(status == 0, done);
+
+    _CFHTTPAuthenticationFlushCache();
+
+    status = Expect(port, report, "flushed", "/private/b", 401, "/private/b\n");
+    __Require(status == 0, done);
+
+ done:
+    ServerStop(server);
+
+    if (report >= 0) {
+        close(report);
+    }
+
+    _CFHTTPAuthenticationFlushCache();
+
+    return ((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,604 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements a test of the HTTP stream connection pool:
+ *     that a persistent connection is reused by the next request to
+ *     its host, that no more than the per-host limit are opened and
+ *     the requests beyond it wait in line, that an idle connection is
+ *     closed by the reaper once its timeout has passed, and that an
+ *     idle connection to one host is evicted to make room for another
+ *     under the total limit.
+ *
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <AssertMacros.h>
+
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFHTTPStreamPriv.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "TestSupport.h"
+
+#define __CFHTTPConnectionPoolTestLog(format, ...)   do { fprintf(stderr, format, ##__VA_ARGS__); fflush(stderr); } while (0)
+
+#define kFetchTimeout               10.0
+
+// The library's defaults, restored once done
+
+#define kDefaultMaxPerHost          6
+#define kDefaultMaxTotal            32
+#define kDefaultIdleTimeout         15.0
+
+typedef struct {
+    CFIndex mHits;
+    CFIndex mMisses;
+    CFIndex mWaits;
+    CFIndex mEvictions;
+} Statistics;
+
+// Server
+
+/**
+ *  Answer requests on the connection until the client closes it,
+ *  keeping it open in between.  The server reports "connect" when
+ *  the connection is accepted, each request's path, and "closed" once
+ *  the client has closed its end.  The body of each response is its
+ *  path; "/slow" is answered after a delay, so that requests made
+ *  together overlap.
+ *
+ */
+static void
+ServeConnection(int aSocket, int aReport, const void *aContext)
+{
+    char   buffer[4096];
+    size_t length = 0;
+
+    buffer[0] = '\0';
+
+    WriteAll(aReport, "connect\n", 8);
+
+    while (TRUE) {
+        char    path[256];
+        char    response[512];
+        char   *end;
+        int     count;
+
+        while ((end = strstr(buffer, "\r\n\r\n")) == NULL) {
+            ssize_t received;
+
+            if (length == sizeof (buffer) - 1) {
+                return;
+            }
+
+            received = read(aSocket, buffer + length, sizeof (buffer) - 1 - length);
+
+            if (received <= 0) {
+                if (received == 0) {
+                    WriteAll(aReport, "closed\n", 7);
+                }
+
+                return;
+            }
+
+            length += (size_t)received;
+            buffer[length] = '\0';
+        }
+
+        if (sscanf(buffer, "GET %255s ", path) != 1) {
+            return;
+        }
+
+        count = snprintf(response, sizeof (response), "%s\n", path);
+        WriteAll(aReport, response, count);
+
+        if (strcmp(path, "/slow") == 0) {
+            usleep(300000);
+        }
+
+        count = snprintf(response, sizeof (response),
+                         "HTTP/1.1 200 OK\r\n"
+                         "Content-Type: text/plain\r\n"
+                         "Content-Length: %zu\r\n"
+                         "\r\n"
+                         "%s",
+                         strlen(path),
+                         path);
+
+        if (!WriteAll(aSocket, response, count)) {
+            return;
+        }
+
+        end    += 4;
+        length -= (size_t)(end - buffer);
+
+        memmove(buffer, end, length + 1);
+    }
+}
+
+// Client
+
+typedef struct {
+    CFReadStreamRef mStream;
+    char            mBody[64];
+    size_t          mLength;
+    Boolean         mDone;
+    Boolean         mFailed;
+} Fetch;
+
+static void
+FetchCallBack(CFReadStreamRef aStream, CFStreamEventType anEvent, void *anInfo)
+{
+    Fetch *fetch = (Fetch *)anInfo;
+
+    switch (anEvent) {
+
+    case kCFStreamEventHasBytesAvailable: {
+        UInt8   buffer[256];
+        CFIndex length = CFReadStreamRead(aStream, buffer, sizeof (buffer));
+
+        if (length < 0) {
+            fetch->mFailed = TRUE;
+
+        } else if (fetch->mLength + (size_t)length < sizeof (fetch->mBody)) {
+            memcpy(fetch->mBody + fetch->mLength, buffer, (size_t)length);
+            fetch->mLength += (size_t)length;
+
+        } else {
+            fetch->mFailed = TRUE;
+
+        }
+        break;
+    }
+
+    case kCFStreamEventEndEncountered:
+        fetch->mDone = TRUE;
+        break;
+
+    case kCFStreamEventErrorOccurred:
+        fetch->mFailed = TRUE;
+        break;
+
+    default:
+        break;
+
+    }
+}
+
+/**
+ *  Run the current run loop for the interval, even when nothing is
+ *  scheduled on it.
+ *
+ */
+static void
+RunFor(CFTimeInterval anInterval)
+{
+    CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + anInterval;
+    CFAbsoluteTime now;
+
+    while ((now = CFAbsoluteTimeGetCurrent()) < deadline) {
+        if (CFRunLoopRunInMode(kCFRunLoopDefaultMode, deadline - now, TRUE) == kCFRunLoopRunFinished) {
+            usleep(10000);
+        }
+    }
+}
+
+/**
+ *  Fetch the paths from the server all at once over persistent
+ *  connections, returning once every response has been read and its
+ *  stream closed.
+ *
+ */
+static int
+FetchAll(unsigned short aPort, const char * const *aPaths, size_t aCount)
+{
+    CFStreamClientContext context  = { 0, NULL, NULL, NULL, NULL };
+    const CFOptionFlags   events   = (kCFStreamEventHasBytesAvailable | kCFStreamEventEndEncountered | kCFStreamEventErrorOccurred);
+    Fetch                 fetches[4];
+    CFAbsoluteTime        deadline;
+    size_t                i;
+    Boolean               result;
+    int                   status   = -1;
+
+    __Require(aCount <= sizeof (fetches) / sizeof (fetches[0]), done);
+
+    memset(fetches, 0, sizeof (fetches));
+
+    for (i = 0; i < aCount; i++) {
+        char             url[128];
+        CFURLRef         theURL;
+        CFHTTPMessageRef request;
+
+        snprintf(url, sizeof (url), "http://127.0.0.1:%u%s", aPort, aPaths[i]);
+
+        theURL = CFURLCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)url, strlen(url), kCFStringEncodingASCII, NULL);
+        __Require(theURL != NULL, done);
+
+        request = CFHTTPMessageCreateRequest(kCFAllocatorDefault, CFSTR("GET"), theURL, kCFHTTPVersion1_1);
+        CFRelease(theURL);
+        __Require(request != NULL, done);
+
+        fetches[i].mStream = CFReadStreamCreateForHTTPRequest(kCFAllocatorDefault, request);
+        CFRelease(request);
+        __Require(fetches[i].mStream != NULL, done);
+
+        result = CFReadStreamSetProperty(fetches[i].mStream, kCFStreamPropertyHTTPAttemptPersistentConnection, kCFBooleanTrue);
+        __Require(result, done);
+
+        context.info = &fetches[i];
+
+        result = CFReadStreamSetClient(fetches[i].mStream, events, FetchCallBack, &context);
+        __Require(result, done);
+
+        CFReadStreamScheduleWithRunLoop(fetches[i].mStream, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+
+        result = CFReadStreamOpen(fetches[i].mStream);
+        __Require(result, done);
+    }
+
+    deadline = CFAbsoluteTimeGetCurrent() + kFetchTimeout;
+
+    while (CFAbsoluteTimeGetCurrent() < deadline) {
+        Boolean finished = TRUE;
+
+        for (i = 0; i < aCount; i++) {
+            __Require(!fetches[i].mFailed, done);
+
+            if (!fetches[i].mDone) {
+                finished = FALSE;
+            }
+        }
+
+        if (finished) {
+            break;
+        }
+
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.1, TRUE);
+    }
+
+    for (i = 0; i < aCount; i++) {
+        __Require(fetches[i].mDone, done);
+        __Require(fetches[i].mLength == strlen(aPaths[i]), done);
+        __Require(memcmp(fetches[i].mBody, aPaths[i], fetches[i].mLength) == 0, done);
+    }
+
+    status = 0;
+
+ done:
+    for (i = 0; i < aCount; i++) {
+        if (fetches[i].mStream != NULL) {
+            CFReadStreamSetClient(fetches[i].mStream, kCFStreamEventNone, NULL, NULL);
+            CFReadStreamUnscheduleFromRunLoop(fetches[i].mStream, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+            CFReadStreamClose(fetches[i].mStream);
+            CFRelease(fetches[i].mStream);
+        }
+    }
+
+    return (status);
+}
+
+static CFIndex
+GetStatistic(CFDictionaryRef aStatistics, CFStringRef aKey)
+{
+    CFNumberRef number = (CFNumberRef)CFDictionaryGetValue(aStatistics, aKey);
+    CFIndex     value  = 0;
+
+    if (number != NULL) {
+        CFNumberGetValue(number, kCFNumberCFIndexType, &value);
+    }
+
+    return (value);
+}
+
+static void
+GetStatistics(Statistics *aStatistics)
+{
+    CFDictionaryRef statistics = _CFHTTPStreamCopyConnectionCacheStatistics(kCFAllocatorDefault);
+
+    memset(aStatistics, 0, sizeof (*aStatistics));
+
+    if (statistics != NULL) {
+        aStatistics->mHits      = GetStatistic(statistics, _kCFHTTPStreamConnectionCacheHits);
+        aStatistics->mMisses    = GetStatistic(statistics, _kCFHTTPStreamConnectionCacheMisses);
+        aStatistics->mWaits     = GetStatistic(statistics, _kCFHTTPStreamConnectionCacheWaits);
+        aStatistics->mEvictions = GetStatistic(statistics, _kCFHTTPStreamConnectionCacheEvictions);
+
+        CFRelease(statistics);
+    }
+}
+
+/**
+ *  Return how many lines the server has reported which match the
+ *  line, without its newline.
+ *
+ */
+static int
+CountReports(const char *aReports, const char *aLine)
+{
+    size_t      length = strlen(aLine);
+    const char *line   = aReports;
+    int         count  = 0;
+
+    while (*line != '\0') {
+        const char *next = strchr(line, '\n');
+
+        if (next == NULL) {
+            next = line + strlen(line);
+        }
+
+        if (((size_t)(next - line) == length) && (strncmp(line, aLine, length) == 0)) {
+            count++;
+        }
+
+        line = (*next == '\0') ? next : next + 1;
+    }
+
+    return (count);
+}
+
+// Tests
+
+static int
+TestReuse(void)
+{
+    static const char * const kFirst[]  = { "/first" };
+    static const char * const kSecond[] = { "/second" };
+    Statistics     before;
+    Statistics     after;
+    char           reports[512];
+    unsigned short port   = 0;
+    int            report = -1;
+    pid_t          server = -1;
+    int            status = -1;
+
+    _CFHTTPStreamSetConnectionCacheLimits(kDefaultMaxPerHost, kDefaultMaxTotal, kDefaultIdleTimeout);
+
+    server = ServerStart(ServeConnection, NULL, kServerServeConcurrently | kServerReportNonBlocking, &port, &report);
+    __Require(server > 0, done);
+
+    GetStatistics(&before);
+
+    __Require(FetchAll(port, kFirst, 1) == 0, done);
+    __Require(FetchAll(port, kSecond, 1) == 0, done);
+
+    GetStatistics(&after);
+
+    ReadReports(report, reports, sizeof (reports));
+
+    __Require(CountReports(reports, "connect") == 1, done);
+    __Require(CountReports(reports, "/first") == 1, done);
+    __Require(CountReports(reports, "/second") == 1, done);
+    __Require(after.mMisses - before.mMisses == 1, done);
+    __Require(after.mHits - before.mHits == 1, done);
+
+    status = 0;
+
+ done:
+    __CFHTTPConnectionPoolTestLog("%-40s %s\n", "reuse", (status == 0) ? "passed" : "FAILED");
+
+    ServerStop(server);
+
+    if (report >= 0) {
+        close(report);
+    }
+
+    return (status);
+}
+
+static int
+TestPerHostLimit(void)
+{
+    static const char * const kPaths[] = { "/slow", "/slow", "/slow", "/slow" };
+    Statistics     before;
+    Statistics     after;
+    char           reports[512];
+    unsigned short port   = 0;
+    int            report = -1;
+    pid_t          server = -1;
+    int            status = -1;
+
+    _CFHTTPStreamSetConnectionCacheLimits(2, kDefaultMaxTotal, kDefaultIdleTimeout);
+
+    server = ServerStart(ServeConnection, NULL, kServerServeConcurrently | kServerReportNonBlocking, &port, &report);
+    __Require(server > 0, done);
+
+    GetStatistics(&before);
+
+    __Require(FetchAll(port, kPaths, 4) == 0, done);
+
+    GetStatistics(&after);
+
+    ReadReports(report, reports, sizeof (reports));
+
+    __Require(CountReports(reports, "connect") == 2, done);
+    __Require(CountReports(reports, "/slow") == 4, done);
+    __Require(after.mMisses - before.mMisses == 2, done);
+    __Require(after.mWaits - before.mWaits >= 2, done);
+
+    status = 0;
+
+ done:
+    __CFHTTPConnectionPoolTestLog("%-40s %s\n", "per-host limit", (status == 0) ? "passed" : "FAILED");
+
+    ServerStop(server);
+
+    if (report >= 0) {
+        close(report);
+    }
+
+    return (status);
+}
+
+static int
+TestIdleReaping(void)
+{
+    static const char * const kFirst[]  = { "/first" };
+    static const char * const kSecond[] = { "/second" };
+    Statistics     before;
+    Statistics     after;
+    char           reports[512];
+    unsigned short port   = 0;
+    int            report = -1;
+    pid_t          server = -1;
+    int            status = -1;
+
+    _CFHTTPStreamSetConnectionCacheLimits(kDefaultMaxPerHost, kDefaultMaxTotal, 0.5);
+
+    server = ServerStart(ServeConnection, NULL, kServerServeConcurrently | kServerReportNonBlocking, &port, &report);
+    __Require(server > 0, done);
+
+    GetStatistics(&before);
+
+    __Require(FetchAll(port, kFirst, 1) == 0, done);
+
+    // Nothing else touches the pool meanwhile, so only the reaper can
+    // close the connection.
+
+    RunFor(1.5);
+
+    ReadReports(report, reports, sizeof (reports));
+
+    __Require(CountReports(reports, "connect") == 1, done);
+    __Require(CountReports(reports, "closed") == 1, done);
+
+    __Require(FetchAll(port, kSecond, 1) == 0, done);
+
+    GetStatistics(&after);
+
+    ReadReports(report, reports, sizeof (reports));
+
+    __Require(CountReports(reports, "connect") == 1, done);
+    __Require(CountReports(reports, "/second") == 1, done);
+    __Require(after.mMisses - before.mMisses == 2, done);
+    __Require(after.mEvictions - before.mEvictions >= 1, done);
+
+    status = 0;
+
+ done:
+    __CFHTTPConnectionPoolTestLog("%-40s %s\n", "idle reaping", (status == 0) ? "passed" : "FAILED");
+
+    ServerStop(server);
+
+    if (report >= 0) {
+        close(report);
+    }
+
+    return (status);
+}
+
+static int
+TestTotalLimit(void)
+{
+    static const char * const kFirst[]  = { "/first" };
+    static const char * const kSecond[] = { "/second" };
+    Statistics     before;
+    Statistics     after;
+    char           reports[512];
+    unsigned short ports[2]   = { 0, 0 };
+    int            report[2]  = { -1, -1 };
+    pid_t          server[2]  = { -1, -1 };
+    int            status     = -1;
+
+    _CFHTTPStreamSetConnectionCacheLimits(kDefaultMaxPerHost, 1, kDefaultIdleTimeout);
+
+    server[0] = ServerStart(ServeConnection, NULL, kServerServeConcurrently | kServerReportNonBlocking, &ports[0], &report[0]);
+    __Require(server[0] > 0, done);
+
+    server[1] = ServerStart(ServeConnection, NULL, kServerServeConcurrently | kServerReportNonBlocking, &ports[1], &report[1]);
+    __Require(server[1] > 0, done);
+
+    GetStatistics(&before);
+
+    __Require(FetchAll(ports[0], kFirst, 1) == 0, done);
+    __Require(FetchAll(ports[1], kSecond, 1) == 0, done);
+
+    GetStatistics(&after);
+
+    // Give the first server a moment to see its connection close.
+
+    RunFor(0.2);
+
+    ReadReports(report[0], reports, sizeof (reports));
+
+    __Require(CountReports(reports, "connect") == 1, done);
+    __Require(CountReports(reports, "closed") == 1, done);
+
+    ReadReports(report[1], reports, sizeof (reports));
+
+    __Require(CountReports(reports, "connect") == 1, done);
+    __Require(CountReports(reports, "closed") == 0, done);
+    __Require(after.mEvictions - before.mEvictions >= 1, done);
+
+    status = 0;
+
+ done:
+    __CFHTTPConnectionPoolTestLog("%-40s %s\n", "total limit", (status == 0) ? "passed" : "FAILED");
+
+    ServerStop(server[0]);
+    ServerStop(server[1]);
+
+    if (report[0] >= 0) {
+        close(report[0]);
+    }
+
+    if (report[1] >= 0) {
+        close(report[1]);
+    }
+
+    return (status);
+}
+
+int
+main(void)
+{
+    int status = 0;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (TestReuse() != 0) {
+        status = -1;
+    }
+
+    if (TestPerHostLimit() != 0) {
+        status = -1;
+    }
+
+    if (TestIdleReaping() != 0) {
+        status = -1;
+    }
+
+    if (TestTotalLimit() != 0) {
+        status = -1;
+    }
+
+    _CFHTTPStreamSetConnectionCacheLimits(kDefaultMaxPerHost, kDefaultMaxTotal, kDefaultIdleTimeout);
+
+    return ((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
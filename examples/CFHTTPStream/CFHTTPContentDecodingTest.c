@@ -0,0 +1,471 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements a test of Content-Encoding decoding in the
+ *     CFNetwork HTTP read stream filter by feeding canned gzip and
+ *     deflate responses, framed by Content-Length, chunked encoding
+ *     and end-of-stream, through a local socket pair and checking
+ *     the bytes read and the encoded and decoded byte counts.
+ *
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include <AssertMacros.h>
+
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFHTTPStreamPriv.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "TestSupport.h"
+
+#define __CFHTTPContentDecodingTestLog(format, ...)   do { fprintf(stderr, format, ##__VA_ARGS__); fflush(stderr); } while (0)
+
+// Small enough that inflate fills the buffer many times per response.
+
+#define kCFHTTPContentDecodingTestReadSize            61
+
+// Small enough that each response spans many chunks.
+
+#define kCFHTTPContentDecodingTestChunkSize           17
+
+#define kCFHTTPContentDecodingTestRecordCount         48
+
+typedef enum {
+    kFramingContentLength,
+    kFramingChunked,
+    kFramingEndOfStream
+} _CFHTTPContentDecodingTestFraming;
+
+typedef struct {
+    const char *                       mDescription;
+    const char *                       mContentEncoding;
+    const UInt8 *                      mBody;
+    size_t                             mBodyLength;
+    _CFHTTPContentDecodingTestFraming  mFraming;
+    Boolean                            mDecode;
+    Boolean                            mExpectError;
+} _CFHTTPContentDecodingTestCase;
+
+// The canned bodies below are the payload built by CopyPayload,
+// compressed by zlib at level 9: with a gzip wrapper (and a zero
+// modification time), with a zlib wrapper, and with no wrapper.
+
+static const UInt8 sGzipBody[] = {
+    0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x95, 0xd6,
+    0xcb, 0x4a, 0x03, 0x41, 0x14, 0x45, 0xd1, 0x7f, 0xb9, 0xe3, 0x16, 0x72,
+    0x1f, 0x79, 0xf5, 0xaf, 0x84, 0x0c, 0x4a, 0x6d, 0xb5, 0x21, 0x11, 0x31,
+    0x1d, 0x27, 0xe2, 0xbf, 0x1b, 0x10, 0x84, 0x3a, 0xa3, 0xec, 0x61, 0x43,
+    0x6f, 0xce, 0x64, 0x51, 0x55, 0x87, 0x6f, 0x9b, 0x9f, 0x6d, 0x5c, 0x0d,
+    0xf6, 0xde, 0xce, 0x93, 0x8d, 0x36, 0x2f, 0xd3, 0xf9, 0x61, 0x65, 0x83,
+    0x2d, 0xed, 0xf5, 0x62, 0xe3, 0xc1, 0xda, 0xe9, 0xe3, 0xad, 0xdd, 0xbe,
+    0x1f, 0xa7, 0xa5, 0xd9, 0x71, 0xb0, 0xf6, 0xb4, 0xcc, 0x5f, 0xb7, 0x3f,
+    0x5f, 0xda, 0xe9, 0x32, 0xfd, 0x0c, 0x7f, 0xbd, 0xf7, 0xbd, 0xdf, 0xd1,
+    0x2f, 0x9f, 0xd7, 0xff, 0x3c, 0xfa, 0x3c, 0xe8, 0x7c, 0xf6, 0x7d, 0xc2,
+    0xf9, 0xea, 0xf3, 0xa2, 0xf3, 0xeb, 0xbe, 0x5f, 0xc3, 0xf9, 0x4d, 0x9f,
+    0x6f, 0xe8, 0xfc, 0xb6, 0xef, 0xb7, 0x70, 0x7e, 0xd7, 0xe7, 0x3b, 0x3a,
+    0xbf, 0xef, 0xfb, 0x3d, 0x9c, 0x77, 0xb1, 0xe7, 0x1c, 0x9f, 0xea, 0xa3,
+    0xfc, 0x5c, 0xfc, 0x39, 0x06, 0xe8, 0x22, 0xd0, 0x29, 0x41, 0x17, 0x83,
+    0x8e, 0x11, 0xba, 0x28, 0x74, 0xca, 0xd0, 0xc5, 0xa1, 0x63, 0x88, 0x2e,
+    0x12, 0x9d, 0x52, 0x74, 0xb1, 0xe8, 0x18, 0xa3, 0x8b, 0x46, 0xa7, 0x1c,
+    0x43, 0x38, 0x06, 0xe6, 0x18, 0xc2, 0x31, 0xf0, 0x69, 0xa8, 0xc7, 0x21,
+    0xe6, 0x18, 0xc2, 0x31, 0x28, 0xc7, 0x10, 0x8e, 0x81, 0x39, 0x86, 0x70,
+    0x0c, 0xca, 0x31, 0x84, 0x63, 0x60, 0x8e, 0x21, 0x1c, 0x83, 0x72, 0x0c,
+    0xe1, 0x18, 0x98, 0x63, 0x08, 0xc7, 0xa0, 0x1c, 0x53, 0x38, 0x26, 0xe6,
+    0x98, 0xc2, 0x31, 0x29, 0xc7, 0x14, 0x8e, 0xc9, 0xaf, 0x67, 0xbd, 0x9f,
+    0x29, 0xc7, 0x14, 0x8e, 0x89, 0x39, 0xa6, 0x70, 0x4c, 0xca, 0x31, 0x85,
+    0x63, 0x62, 0x8e, 0x29, 0x1c, 0x93, 0x72, 0x4c, 0xe1, 0x98, 0x98, 0x63,
+    0x0a, 0xc7, 0xa4, 0x1c, 0x4b, 0x38, 0x16, 0xe6, 0x58, 0xc2, 0xb1, 0x28,
+    0xc7, 0x12, 0x8e, 0x85, 0x39, 0x96, 0x70, 0x2c, 0xfc, 0x5e, 0xd4, 0x07,
+    0x23, 0xe6, 0x58, 0xc2, 0xb1, 0x28, 0xc7, 0x12, 0x8e, 0x85, 0x39, 0x96,
+    0x70, 0xac, 0xbb, 0x39, 0x1e, 0x7f, 0x01, 0x4b, 0x52, 0xda, 0x51, 0x35,
+    0x0c, 0x00, 0x00,
+};
+
+static const UInt8 sZlibBody[] = {
+    0x78, 0xda, 0x95, 0xd6, 0xcb, 0x4a, 0x03, 0x41, 0x14, 0x45, 0xd1, 0x7f,
+    0xb9, 0xe3, 0x16, 0x72, 0x1f, 0x79, 0xf5, 0xaf, 0x84, 0x0c, 0x4a, 0x6d,
+    0xb5, 0x21, 0x11, 0x31, 0x1d, 0x27, 0xe2, 0xbf, 0x1b, 0x10, 0x84, 0x3a,
+    0xa3, 0xec, 0x61, 0x43, 0x6f, 0xce, 0x64, 0x51, 0x55, 0x87, 0x6f, 0x9b,
+    0x9f, 0x6d, 0x5c, 0x0d, 0xf6, 0xde, 0xce, 0x93, 0x8d, 0x36, 0x2f, 0xd3,
+    0xf9, 0x61, 0x65, 0x83, 0x2d, 0xed, 0xf5, 0x62, 0xe3, 0xc1, 0xda, 0xe9,
+    0xe3, 0xad, 0xdd, 0xbe, 0x1f, 0xa7, 0xa5, 0xd9, 0x71, 0xb0, 0xf6, 0xb4,
+    0xcc, 0x5f, 0xb7, 0x3f, 0x5f, 0xda, 0xe9, 0x32, 0xfd, 0x0c, 0x7f, 0xbd,
+    0xf7, 0xbd, 0xdf, 0xd1, 0x2f, 0x9f, 0xd7, 0xff, 0x3c, 0xfa, 0x3c, 0xe8,
+    0x7c, 0xf6, 0x7d, 0xc2, 0xf9, 0xea, 0xf3, 0xa2, 0xf3, 0xeb, 0xbe, 0x5f,
+    0xc3, 0xf9, 0x4d, 0x9f, 0x6f, 0xe8, 0xfc, 0xb6, 0xef, 0xb7, 0x70, 0x7e,
+    0xd7, 0xe7, 0x3b, 0x3a, 0xbf, 0xef, 0xfb, 0x3d, 0x9c, 0x77, 0xb1, 0xe7,
+    0x1c, 0x9f, 0xea, 0xa3, 0xfc, 0x5c, 0xfc, 0x39, 0x06, 0xe8, 0x22, 0xd0,
+    0x29, 0x41, 0x17, 0x83, 0x8e, 0x11, 0xba, 0x28, 0x74, 0xca, 0xd0, 0xc5,
+    0xa1, 0x63, 0x88, 0x2e, 0x12, 0x9d, 0x52, 0x74, 0xb1, 0xe8, 0x18, 0xa3,
+    0x8b, 0x46, 0xa7, 0x1c, 0x43, 0x38, 0x06, 0xe6, 0x18, 0xc2, 0x31, 0xf0,
+    0x69, 0xa8, 0xc7, 0x21, 0xe6, 0x18, 0xc2, 0x31, 0x28, 0xc7, 0x10, 0x8e,
+    0x81, 0x39, 0x86, 0x70, 0x0c, 0xca, 0x31, 0x84, 0x63, 0x60, 0x8e, 0x21,
+    0x1c, 0x83, 0x72, 0x0c, 0xe1, 0x18, 0x98, 0x63, 0x08, 0xc7, 0xa0, 0x1c,
+    0x53, 0x38, 0x26, 0xe6, 0x98, 0xc2, 0x31, 0x29, 0xc7, 0x14, 0x8e, 0xc9,
+    0xaf, 0x67, 0xbd, 0x9f, 0x29, 0xc7, 0x14, 0x8e, 0x89, 0x39, 0xa6, 0x70,
+    0x4c, 0xca, 0x31, 0x85, 0x63, 0x62, 0x8e, 0x29, 0x1c, 0x93, 0x72, 0x4c,
+    0xe1, 0x98, 0x98, 0x63, 0x0a, 0xc7, 0xa4, 0x1c, 0x4b, 0x38, 0x16, 0xe6,
+    0x58, 0xc2, 0xb1, 0x28, 0xc7, 0x12, 0x8e, 0x85, 0x39, 0x96, 0x70, 0x2c,
+    0xfc, 0x5e, 0xd4, 0x07, 0x23, 0xe6, 0x58, 0xc2, 0xb1, 0x28, 0xc7, 0x12,
+    0x8e, 0x85, 0x39, 0x96, 0x70, 0xac, 0xbb, 0x39, 0x1e, 0x7f, 0x01, 0x75,
+    0xf4, 0xc1, 0xaa,
+};
+
+static const UInt8 sRawDeflateBody[] = {
+    0x95, 0xd6, 0xcb, 0x4a, 0x03, 0x41, 0x14, 0x45, 0xd1, 0x7f, 0xb9, 0xe3,
+    0x16, 0x72, 0x1f, 0x79, 0xf5, 0xaf, 0x84, 0x0c, 0x4a, 0x6d, 0xb5, 0x21,
+    0x11, 0x31, 0x1d, 0x27, 0xe2, 0xbf, 0x1b, 0x10, 0x84, 0x3a, 0xa3, 0xec,
+    0x61, 0x43, 0x6f, 0xce, 0x64, 0x51, 0x55, 0x87, 0x6f, 0x9b, 0x9f, 0x6d,
+    0x5c, 0x0d, 0xf6, 0xde, 0xce, 0x93, 0x8d, 0x36, 0x2f, 0xd3, 0xf9, 0x61,
+    0x65, 0x83, 0x2d, 0xed, 0xf5, 0x62, 0xe3, 0xc1, 0xda, 0xe9, 0xe3, 0xad,
+    0xdd, 0xbe, 0x1f, 0xa7, 0xa5, 0xd9, 0x71, 0xb0, 0xf6, 0xb4, 0xcc, 0x5f,
+    0xb7, 0x3f, 0x5f, 0xda, 0xe9, 0x32, 0xfd, 0x0c, 0x7f, 0xbd, 0xf7, 0xbd,
+    0xdf, 0xd1, 0x2f, 0x9f, 0xd7, 0xff, 0x3c, 0xfa, 0x3c, 0xe8, 0x7c, 0xf6,
+    0x7d, 0xc2, 0xf9, 0xea, 0xf3, 0xa2, 0xf3, 0xeb, 0xbe, 0x5f, 0xc3, 0xf9,
+    0x4d, 0x9f, 0x6f, 0xe8, 0xfc, 0xb6, 0xef, 0xb7, 0x70, 0x7e, 0xd7, 0xe7,
+    0x3b, 0x3a, 0xbf, 0xef, 0xfb, 0x3d, 0x9c, 0x77, 0xb1, 0xe7, 0x1c, 0x9f,
+    0xea, 0xa3, 0xfc, 0x5c, 0xfc, 0x39, 0x06, 0xe8, 0x22, 0xd0, 0x29, 0x41,
+    0x17, 0x83, 0x8e, 0x11, 0xba, 0x28, 0x74, 0xca, 0xd0, 0xc5, 0xa1, 0x63,
+    0x88, 0x2e, 0x12, 0x9d, 0x52, 0x74, 0xb1, 0xe8, 0x18, 0xa3, 0x8b, 0x46,
+    0xa7, 0x1c, 0x43, 0x38, 0x06, 0xe6, 0x18, 0xc2, 0x31, 0xf0, 0x69, 0xa8,
+    0xc7, 0x21, 0xe6, 0x18, 0xc2, 0x31, 0x28, 0xc7, 0x10, 0x8e, 0x81, 0x39,
+    0x86, 0x70, 0x0c, 0xca, 0x31, 0x84, 0x63, 0x60, 0x8e, 0x21, 0x1c, 0x83,
+    0x72, 0x0c, 0xe1, 0x18, 0x98, 0x63, 0x08, 0xc7, 0xa0, 0x1c, 0x53, 0x38,
+    0x26, 0xe6, 0x98, 0xc2, 0x31, 0x29, 0xc7, 0x14, 0x8e, 0xc9, 0xaf, 0x67,
+    0xbd, 0x9f, 0x29, 0xc7, 0x14, 0x8e, 0x89, 0x39, 0xa6, 0x70, 0x4c, 0xca,
+    0x31, 0x85, 0x63, 0x62, 0x8e, 0x29, 0x1c, 0x93, 0x72, 0x4c, 0xe1, 0x98,
+    0x98, 0x63, 0x0a, 0xc7, 0xa4, 0x1c, 0x4b, 0x38, 0x16, 0xe6, 0x58, 0xc2,
+    0xb1, 0x28, 0xc7, 0x12, 0x8e, 0x85, 0x39, 0x96, 0x70, 0x2c, 0xfc, 0x5e,
+    0xd4, 0x07, 0x23, 0xe6, 0x58, 0xc2, 0xb1, 0x28, 0xc7, 0x12, 0x8e, 0x85,
+    0x39, 0x96, 0x70, 0xac, 0xbb, 0x39, 0x1e, 0x7f, 0x01,
+};
+
+// A gzip header followed by a deflate block of a reserved (invalid)
+// type.
+
+static const UInt8 sCorruptGzipBody[] = {
+    0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0xff, 0xff, 0xff,
+};
+
+static const _CFHTTPContentDecodingTestCase sTestCases[] = {
+    { "gzip, Content-Length",          "gzip",    sGzipBody,        sizeof (sGzipBody),        kFramingContentLength, TRUE,  FALSE },
+    { "gzip, chunked",                 "gzip",    sGzipBody,        sizeof (sGzipBody),        kFramingChunked,       TRUE,  FALSE },
+    { "gzip, end of stream",           "gzip",    sGzipBody,        sizeof (sGzipBody),        kFramingEndOfStream,   TRUE,  FALSE },
+    { "x-gzip, chunked",               "X-Gzip",  sGzipBody,        sizeof (sGzipBody),        kFramingChunked,       TRUE,  FALSE },
+    { "deflate (zlib), chunked",       "deflate", sZlibBody,        sizeof (sZlibBody),        kFramingChunked,       TRUE,  FALSE },
+    { "deflate (raw), Content-Length", "deflate", sRawDeflateBody,  sizeof (sRawDeflateBody),  kFramingContentLength, TRUE,  FALSE },
+    { "gzip, not decoded",             "gzip",    sGzipBody,        sizeof (sGzipBody),        kFramingContentLength, FALSE, FALSE },
+    { "gzip, truncated",               "gzip",    sGzipBody,        sizeof (sGzipBody) / 2,    kFramingContentLength, TRUE,  TRUE },
+    { "gzip, corrupt",                 "gzip",    sCorruptGzipBody, sizeof (sCorruptGzipBody), kFramingContentLength, TRUE,  TRUE }
+};
+
+/**
+ *  Return the uncompressed payload the canned bodies carry: a JSON
+ *  array of small, repetitive records, like those our APIs return.
+ *
+ */
+static CFDataRef
+CopyPayload(void)
+{
+    CFMutableDataRef payload;
+    char             record[128];
+    unsigned int     i;
+
+    payload = CFDataCreateMutable(kCFAllocatorDefault, 0);
+    __Require(payload != NULL, done);
+
+    CFDataAppendBytes(payload, (const UInt8 *)"[", 1);
+
+    for (i = 0; i < kCFHTTPContentDecodingTestRecordCount; i++) {
+        int length = snprintf(record, sizeof (record),
+                              "%s{\"id\":%u,\"name\":\"item-%u\",\"tags\":[\"alpha\",\"beta\"],\"active\":%s}",
+                              (i > 0) ? "," : "",
+                              i,
+                              i,
+                              (i % 2) ? "true" : "false");
+
+        CFDataAppendBytes(payload, (const UInt8 *)record, length);
+    }
+
+    CFDataAppendBytes(payload, (const UInt8 *)"]", 1);
+
+ done:
+    return (payload);
+}
+
+// Server
+
+/**
+ *  Write the canned response for the test case, framed as it asks,
+ *  then shut the socket down so that the reader sees end-of-stream.
+ *
+ */
+static void
+ServeConnection(int aSocket, int aReport, const void *aContext)
+{
+    const _CFHTTPContentDecodingTestCase *testCase = (const _CFHTTPContentDecodingTestCase *)aContext;
+    char                                  header[256];
+    int                                   length;
+    size_t                                offset;
+    Boolean                               result;
+
+    length = snprintf(header, sizeof (header),
+                      "HTTP/1.1 200 OK\r\n"
+                      "Content-Type: application/json\r\n"
+                      "Content-Encoding: %s\r\n",
+                      testCase->mContentEncoding);
+
+    switch (testCase->mFraming) {
+
+    case kFramingContentLength:
+        length += snprintf(header + length, sizeof (header) - length, "Content-Length: %zu\r\n\r\n", testCase->mBodyLength);
+        break;
+
+    case kFramingChunked:
+        length += snprintf(header + length, sizeof (header) - length, "Transfer-Encoding: chunked\r\n\r\n");
+        break;
+
+    case kFramingEndOfStream:
+        length += snprintf(header + length, sizeof (header) - length, "Connection: close\r\n\r\n");
+        break;
+
+    }
+
+    result = WriteAll(aSocket, header, length);
+    __Require(result, done);
+
+    if (testCase->mFraming == kFramingChunked) {
+        for (offset = 0; offset < testCase->mBodyLength; offset += kCFHTTPContentDecodingTestChunkSize) {
+            size_t chunk = testCase->mBodyLength - offset;
+
+            if (chunk > kCFHTTPContentDecodingTestChunkSize) {
+                chunk = kCFHTTPContentDecodingTestChunkSize;
+            }
+
+            length = snprintf(header, sizeof (header), "%zx\r\n", chunk);
+
+            result = WriteAll(aSocket, header, length) &&
+                     WriteAll(aSocket, testCase->mBody + offset, chunk) &&
+                     WriteAll(aSocket, "\r\n", 2);
+            __Require(result, done);
+        }
+
+        result = WriteAll(aSocket, "0\r\n\r\n", 5);
+        __Require(result, done);
+
+    } else {
+        result = WriteAll(aSocket, testCase->mBody, testCase->mBodyLength);
+        __Require(result, done);
+
+    }
+
+ done:
+    shutdown(aSocket, SHUT_WR);
+}
+
+// Client
+
+static long long
+CopyCount(CFReadStreamRef aStream, CFStringRef aProperty)
+{
+    CFNumberRef number;
+    long long   count = -1;
+
+    number = (CFNumberRef)CFReadStreamCopyProperty(aStream, aProperty);
+
+    if (number != NULL) {
+        CFNumberGetValue(number, kCFNumberLongLongType, &count);
+        CFRelease(number);
+    }
+
+    return (count);
+}
+
+/**
+ *  Read the test case's response through an HTTP read stream and
+ *  check that it decodes to the payload (or, when not decoding,
+ *  passes the body through untouched) or fails if it should.
+ *
+ *  Returns 0 on success, 1 if decoding is unavailable and the case
+ *  was skipped, and -1 on failure.
+ *
+ */
+static int
+RunTestCase(const _CFHTTPContentDecodingTestCase *aTestCase, CFDataRef aPayload)
+{
+    int               sockets[2]   = { -1, -1 };
+    pid_t             server       = -1;
+    CFReadStreamRef   socketStream = NULL;
+    CFReadStreamRef   stream       = NULL;
+    CFMutableDataRef  received     = NULL;
+    const UInt8 *     expected;
+    CFIndex           expectedLength;
+    UInt8             buffer[kCFHTTPContentDecodingTestReadSize];
+    Boolean           failed       = FALSE;
+    Boolean           result;
+    int               status       = -1;
+
+    if (aTestCase->mDecode) {
+        expected       = CFDataGetBytePtr(aPayload);
+        expectedLength = CFDataGetLength(aPayload);
+    } else {
+        expected       = aTestCase->mBody;
+        expectedLength = (CFIndex)aTestCase->mBodyLength;
+    }
+
+    received = CFDataCreateMutable(kCFAllocatorDefault, 0);
+    __Require(received != NULL, done);
+
+    status = socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+    __Require(status == 0, done);
+
+    status = -1;
+
+    CFStreamCreatePairWithSocket(kCFAllocatorDefault, sockets[0], &socketStream, NULL);
+    __Require(socketStream != NULL, done);
+
+    result = CFReadStreamSetProperty(socketStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
+    __Require(result, done);
+
+    sockets[0] = -1;
+
+    stream = CFReadStreamCreateHTTPStream(kCFAllocatorDefault, socketStream, TRUE);
+    __Require(stream != NULL, done);
+
+    if (aTestCase->mDecode) {
+        result = CFReadStreamSetProperty(stream, _kCFStreamPropertyHTTPDecodeContentEncoding, kCFBooleanTrue);
+        __Require_Action(result, done, status = 1);
+    }
+
+    result = CFReadStreamOpen(stream);
+    __Require(result, done);
+
+    server = ServerStartWithSocket(sockets[1], ServeConnection, aTestCase);
+    __Require(server > 0, done);
+
+    close(sockets[1]);
+    sockets[1] = -1;
+
+    while (TRUE) {
+        CFIndex length = CFReadStreamRead(stream, buffer, sizeof (buffer));
+
+        if (length < 0) {
+            failed = TRUE;
+            break;
+        } else if (length == 0) {
+            break;
+        }
+
+        CFDataAppendBytes(received, buffer, length);
+    }
+
+    if (aTestCase->mExpectError) {
+        __Require(failed, done);
+
+    } else {
+        __Require(!failed, done);
+        __Require(CFDataGetLength(received) == expectedLength, done);
+        __Require(memcmp(CFDataGetBytePtr(received), expected, expectedLength) == 0, done);
+        __Require(CopyCount(stream, _kCFStreamPropertyHTTPEncodedBodyBytes) == (long long)aTestCase->mBodyLength, done);
+        __Require(CopyCount(stream, _kCFStreamPropertyHTTPDecodedBodyBytes) == (long long)expectedLength, done);
+
+    }
+
+    status = 0;
+
+ done:
+    __CFHTTPContentDecodingTestLog("%-32s %s\n",
+                                   aTestCase->mDescription,
+                                   (status == 0) ? "passed" : ((status > 0) ? "skipped" : "FAILED"));
+
+    ServerStop(server);
+
+    if (stream != NULL) {
+        CFReadStreamClose(stream);
+        CFRelease(stream);
+    }
+
+    if (socketStream != NULL) {
+        CFRelease(socketStream);
+    }
+
+    if (received != NULL) {
+        CFRelease(received);
+    }
+
+    if (sockets[0] >= 0) {
+        close(sockets[0]);
+    }
+
+    if (sockets[1] >= 0) {
+        close(sockets[1]);
+    }
+
+    return (status);
+}
+
+int
+main(void)
+{
+    CFDataRef payload = NULL;
+    size_t    i;
+    int       status  = -1;
+
+    // The server exits on its own; don't let a reader that gave up
+    // early take this process down with SIGPIPE.
+
+    signal(SIGPIPE, SIG_IGN);
+
+    payload = CopyPayload();
+    __Require(payload != NULL, done);
+
+    for (i = 0; i < sizeof (sTestCases) / sizeof (sTestCases[0]); i++) {
+        status = RunTestCase(&sTestCases[i], payload);
+
+        // Decoding is unavailable when CFNetwork is built without
+        // zlib; there is nothing more to test.
+
+        if (status > 0) {
+            status = 0;
+            break;
+        }
+
+        __Require(status == 0, done);
+    }
+
+ done:
+    if (payload != NULL) {
+        CFRelease(payload);
+    }
+
+    return ((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,460 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements a test of HTTP stream pipelining: that
+ *     requests are pipelined on a persistent connection no deeper
+ *     than the configured depth, and that when the server closes the
+ *     connection having answered only the first of them, the rest are
+ *     sent again on a new connection and every response still arrives.
+ *
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include <AssertMacros.h>
+
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFHTTPStreamPriv.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "TestSupport.h"
+
+#define __CFHTTPPipeliningTestLog(format, ...)   do { fprintf(stderr, format, ##__VA_ARGS__); fflush(stderr); } while (0)
+
+#define kFetchTimeout               10.0
+
+// The library's defaults, restored once done
+
+#define kDefaultMaxPerHost          6
+#define kDefaultMaxTotal            32
+#define kDefaultIdleTimeout         15.0
+#define kDefaultMaxPipelineDepth    4
+
+/**
+ *  One run: the pipeline depth to configure, and whether requests
+ *  should be found queued behind the one being answered.
+ *
+ */
+typedef struct {
+    const char *mDescription;
+    CFIndex     mMaxPipelineDepth;
+    Boolean     mPipelined;
+} PipeliningTest;
+
+static const PipeliningTest sPipeliningTests[] = {
+    { "not pipelined, replayed",    1,  FALSE },
+    { "pipelined, replayed",        4,  TRUE  }
+};
+
+// Server
+
+/**
+ *  Return the end of the first complete request in the buffer, or
+ *  NULL if there is none.
+ *
+ */
+static char *
+FindRequestEnd(char *aBuffer)
+{
+    char *end = strstr(aBuffer, "\r\n\r\n");
+
+    return ((end != NULL) ? end + 4 : NULL);
+}
+
+/**
+ *  Answer requests on the connection until the client closes it.
+ *  Connections are served one at a time.  The first connection
+ *  answers two requests only, the second after a pause in which any
+ *  requests pipelined behind it arrive, then closes its end and
+ *  drains the rest unanswered.  Later connections answer everything.
+ *
+ *  The server reports "connect" for each connection, each request it
+ *  answers by its path, "pipelined" and the number of requests found
+ *  waiting behind the one it answered last on the first connection,
+ *  and "dropped" and the path of each one it left unanswered.  The
+ *  body of each response is its path.
+ *
+ */
+static void
+ServeConnection(int aSocket, int aReport, const void *aContext)
+{
+    static int sConnections = 0;
+    Boolean    dropping     = (sConnections++ == 0);
+    int        answered     = 0;
+    char       buffer[4096];
+    size_t     length       = 0;
+
+    buffer[0] = '\0';
+
+    WriteAll(aReport, "connect\n", 8);
+
+    while (TRUE) {
+        char    path[256];
+        char    response[512];
+        char   *end;
+        int     count;
+
+        while ((end = FindRequestEnd(buffer)) == NULL) {
+            ssize_t received;
+
+            if (length == sizeof (buffer) - 1) {
+                return;
+            }
+
+            received = read(aSocket, buffer + length, sizeof (buffer) - 1 - length);
+
+            if (received <= 0) {
+                return;
+            }
+
+            length += (size_t)received;
+            buffer[length] = '\0';
+        }
+
+        if (sscanf(buffer, "GET %255s ", path) != 1) {
+            return;
+        }
+
+        if (dropping && (answered == 2)) {
+            count = snprintf(response, sizeof (response), "dropped %s\n", path);
+            WriteAll(aReport, response, count);
+
+        } else {
+            if (dropping && (answered == 1)) {
+                char       *next    = end;
+                int         waiting = 0;
+                ssize_t     received;
+
+                usleep(100000);
+
+                received = recv(aSocket, buffer + length, sizeof (buffer) - 1 - length, MSG_DONTWAIT);
+
+                if (received > 0) {
+                    length += (size_t)received;
+                    buffer[length] = '\0';
+                }
+
+                while ((next = FindRequestEnd(next)) != NULL) {
+                    waiting++;
+                }
+
+                count = snprintf(response, sizeof (response), "pipelined %d\n", waiting);
+                WriteAll(aReport, response, count);
+            }
+
+            count = snprintf(response, sizeof (response), "%s\n", path);
+            WriteAll(aReport, response, count);
+
+            count = snprintf(response, sizeof (response),
+                             "HTTP/1.1 200 OK\r\n"
+                             "Content-Type: text/plain\r\n"
+                             "Content-Length: %zu\r\n"
+                             "\r\n"
+                             "%s",
+                             strlen(path),
+                             path);
+
+            if (!WriteAll(aSocket, response, count)) {
+                return;
+            }
+
+            if (dropping && (++answered == 2)) {
+                shutdown(aSocket, SHUT_WR);
+            }
+        }
+
+        length -= (size_t)(end - buffer);
+
+        memmove(buffer, end, length + 1);
+    }
+}
+
+// Client
+
+typedef struct {
+    CFReadStreamRef mStream;
+    char            mBody[64];
+    size_t          mLength;
+    Boolean         mDone;
+    Boolean         mFailed;
+} Fetch;
+
+static void
+FetchCallBack(CFReadStreamRef aStream, CFStreamEventType anEvent, void *anInfo)
+{
+    Fetch *fetch = (Fetch *)anInfo;
+
+    switch (anEvent) {
+
+    case kCFStreamEventHasBytesAvailable: {
+        UInt8   buffer[256];
+        CFIndex length = CFReadStreamRead(aStream, buffer, sizeof (buffer));
+
+        if (length < 0) {
+            fetch->mFailed = TRUE;
+
+        } else if (fetch->mLength + (size_t)length < sizeof (fetch->mBody)) {
+            memcpy(fetch->mBody + fetch->mLength, buffer, (size_t)length);
+            fetch->mLength += (size_t)length;
+
+        } else {
+            fetch->mFailed = TRUE;
+
+        }
+        break;
+    }
+
+    case kCFStreamEventEndEncountered:
+        fetch->mDone = TRUE;
+        break;
+
+    case kCFStreamEventErrorOccurred:
+        fetch->mFailed = TRUE;
+        break;
+
+    default:
+        break;
+
+    }
+}
+
+/**
+ *  Fetch the paths from the server all at once over persistent
+ *  connections, returning once every response has been read and its
+ *  stream closed.
+ *
+ */
+static int
+FetchAll(unsigned short aPort, const char * const *aPaths, size_t aCount)
+{
+    CFStreamClientContext context  = { 0, NULL, NULL, NULL, NULL };
+    const CFOptionFlags   events   = (kCFStreamEventHasBytesAvailable | kCFStreamEventEndEncountered | kCFStreamEventErrorOccurred);
+    Fetch                 fetches[4];
+    CFAbsoluteTime        deadline;
+    size_t                i;
+    Boolean               result;
+    int                   status   = -1;
+
+    __Require(aCount <= sizeof (fetches) / sizeof (fetches[0]), done);
+
+    memset(fetches, 0, sizeof (fetches));
+
+    for (i = 0; i < aCount; i++) {
+        char             url[128];
+        CFURLRef         theURL;
+        CFHTTPMessageRef request;
+
+        snprintf(url, sizeof (url), "http://127.0.0.1:%u%s", aPort, aPaths[i]);
+
+        theURL = CFURLCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)url, strlen(url), kCFStringEncodingASCII, NULL);
+        __Require(theURL != NULL, done);
+
+        request = CFHTTPMessageCreateRequest(kCFAllocatorDefault, CFSTR("GET"), theURL, kCFHTTPVersion1_1);
+        CFRelease(theURL);
+        __Require(request != NULL, done);
+
+        fetches[i].mStream = CFReadStreamCreateForHTTPRequest(kCFAllocatorDefault, request);
+        CFRelease(request);
+        __Require(fetches[i].mStream != NULL, done);
+
+        result = CFReadStreamSetProperty(fetches[i].mStream, kCFStreamPropertyHTTPAttemptPersistentConnection, kCFBooleanTrue);
+        __Require(result, done);
+
+        context.info = &fetches[i];
+
+        result = CFReadStreamSetClient(fetches[i].mStream, events, FetchCallBack, &context);
+        __Require(result, done);
+
+        CFReadStreamScheduleWithRunLoop(fetches[i].mStream, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+
+        result = CFReadStreamOpen(fetches[i].mStream);
+        __Require(result, done);
+    }
+
+    deadline = CFAbsoluteTimeGetCurrent() + kFetchTimeout;
+
+    while (CFAbsoluteTimeGetCurrent() < deadline) {
+        Boolean finished = TRUE;
+
+        for (i = 0; i < aCount; i++) {
+            __Require(!fetches[i].mFailed, done);
+
+            if (!fetches[i].mDone) {
+                finished = FALSE;
+            }
+        }
+
+        if (finished) {
+            break;
+        }
+
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.1, TRUE);
+    }
+
+    for (i = 0; i < aCount; i++) {
+        __Require(fetches[i].mDone, done);
+        __Require(fetches[i].mLength == strlen(aPaths[i]), done);
+        __Require(memcmp(fetches[i].mBody, aPaths[i], fetches[i].mLength) == 0, done);
+    }
+
+    status = 0;
+
+ done:
+    for (i = 0; i < aCount; i++) {
+        if (fetches[i].mStream != NULL) {
+            CFReadStreamSetClient(fetches[i].mStream, kCFStreamEventNone, NULL, NULL);
+            CFReadStreamUnscheduleFromRunLoop(fetches[i].mStream, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+            CFReadStreamClose(fetches[i].mStream);
+            CFRelease(fetches[i].mStream);
+        }
+    }
+
+    return (status);
+}
+
+/**
+ *  Return how many lines the server has reported which match the
+ *  line, without its newline.
+ *
+ */
+static int
+CountReports(const char *aReports, const char *aLine)
+{
+    size_t      length = strlen(aLine);
+    const char *line   = aReports;
+    int         count  = 0;
+
+    while (*line != '\0') {
+        const char *next = strchr(line, '\n');
+
+        if (next == NULL) {
+            next = line + strlen(line);
+        }
+
+        if (((size_t)(next - line) == length) && (strncmp(line, aLine, length) == 0)) {
+            count++;
+        }
+
+        line = (*next == '\0') ? next : next + 1;
+    }
+
+    return (count);
+}
+
+// Tests
+
+static int
+TestPipelining(const PipeliningTest *aTest)
+{
+    static const char * const kWarm[]  = { "/warm" };
+    static const char * const kPaths[] = { "/a", "/b", "/c", "/d" };
+    char           reports[1024];
+    char           line[64];
+    unsigned short port      = 0;
+    int            report    = -1;
+    pid_t          server    = -1;
+    int            pipelined = -1;
+    const char    *found;
+    size_t         i;
+    int            status    = -1;
+
+    // One connection to the host, so that the requests all queue on it
+
+    _CFHTTPStreamSetConnectionCacheLimits(1, kDefaultMaxTotal, kDefaultIdleTimeout);
+    _CFHTTPStreamSetMaxPipelineDepth(aTest->mMaxPipelineDepth);
+    _CFHTTPStreamSetPipeliningBlacklisted(CFSTR("127.0.0.1"), FALSE);
+
+    server = ServerStart(ServeConnection, NULL, kServerReportNonBlocking, &port, &report);
+    __Require(server > 0, done);
+
+    // Pipelining starts once a response shows the connection persists.
+
+    __Require(FetchAll(port, kWarm, 1) == 0, done);
+    __Require(FetchAll(port, kPaths, 4) == 0, done);
+
+    ReadReports(report, reports, sizeof (reports));
+
+    __Require(CountReports(reports, "connect") == 2, done);
+    __Require(CountReports(reports, "/warm") == 1, done);
+
+    for (i = 0; i < sizeof (kPaths) / sizeof (kPaths[0]); i++) {
+        __Require(CountReports(reports, kPaths[i]) == 1, done);
+    }
+
+    found = strstr(reports, "pipelined ");
+    __Require(found != NULL, done);
+    __Require(sscanf(found, "pipelined %d", &pipelined) == 1, done);
+
+    if (aTest->mPipelined) {
+        __Require(pipelined >= 1, done);
+        __Require(pipelined < aTest->mMaxPipelineDepth, done);
+
+        snprintf(line, sizeof (line), "dropped %s", kPaths[1]);
+        __Require(CountReports(reports, line) == 1, done);
+
+    } else {
+        __Require(pipelined == 0, done);
+
+    }
+
+    status = 0;
+
+ done:
+    __CFHTTPPipeliningTestLog("%-40s %s\n", aTest->mDescription, (status == 0) ? "passed" : "FAILED");
+
+    ServerStop(server);
+
+    if (report >= 0) {
+        close(report);
+    }
+
+    return (status);
+}
+
+int
+main(void)
+{
+    size_t i;
+    int    status = 0;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    for (i = 0; i < sizeof (sPipeliningTests) / sizeof (sPipeliningTests[0]); i++) {
+        if (TestPipelining(&sPipeliningTests[i]) != 0) {
+            status = -1;
+        }
+    }
+
+    _CFHTTPStreamSetConnectionCacheLimits(kDefaultMaxPerHost, kDefaultMaxTotal, kDefaultIdleTimeout);
+    _CFHTTPStreamSetMaxPipelineDepth(kDefaultMaxPipelineDepth);
+
+    return ((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,366 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements a test of the CFNetwork HTTP stream
+ *     response cache against a loopback server which reports each
+ *     request it sees: that fresh responses are read without the
+ *     server, that stale ones are revalidated with If-None-Match and
+ *     read from the cache on a 304, that "no-store" responses are not
+ *     kept, that unknown directives are not mistaken for known ones
+ *     sharing their prefix, and that responses kept on disk are found
+ *     again once the cache directory is reopened.
+ *
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <AssertMacros.h>
+
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFHTTPStreamPriv.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "TestSupport.h"
+
+#define __CFHTTPResponseCacheTestLog(format, ...)   do { fprintf(stderr, format, ##__VA_ARGS__); fflush(stderr); } while (0)
+
+#define kCFHTTPResponseCacheTestETag                "\"v1\""
+
+// Server
+
+/**
+ *  Answer one request on the connection, then close it.  Each request
+ *  is reported on the pipe as its path, followed by " conditional" if
+ *  it carried the test's ETag in If-None-Match.
+ *
+ *  Paths:
+ *    /fresh      200, fresh for an hour.
+ *    /etag       200 with an ETag and "no-cache", or 304 if the
+ *                request's If-None-Match matches it.
+ *    /no-store   200 with "no-store".
+ *    /extension  200 with an unknown "no-cache-ext" directive ahead of
+ *                "max-age", which must not be taken for "no-cache".
+ *
+ */
+static void
+ServeConnection(int aSocket, int aReport, const void *aContext)
+{
+    char        request[2048];
+    char        path[256];
+    char        response[512];
+    const char *body;
+    const char *headers;
+    Boolean     conditional;
+    size_t      length = 0;
+    int         count;
+
+    while (length < sizeof (request) - 1) {
+        ssize_t received = read(aSocket, request + length, sizeof (request) - 1 - length);
+
+        if (received <= 0) {
+            return;
+        }
+
+        length += (size_t)received;
+        request[length] = '\0';
+
+        if (strstr(request, "\r\n\r\n") != NULL) {
+            break;
+        }
+    }
+
+    if (sscanf(request, "GET %255s ", path) != 1) {
+        return;
+    }
+
+    conditional = (strstr(request, "If-None-Match: " kCFHTTPResponseCacheTestETag "\r\n") != NULL);
+
+    count = snprintf(response, sizeof (response), "%s%s\n", path, conditional ? " conditional" : "");
+    WriteAll(aReport, response, count);
+
+    if (strcmp(path, "/etag") == 0) {
+        body    = "etag-body";
+        headers = "Cache-Control: no-cache\r\nETag: " kCFHTTPResponseCacheTestETag "\r\n";
+
+        if (conditional) {
+            count = snprintf(response, sizeof (response),
+                             "HTTP/1.1 304 Not Modified\r\n"
+                             "%s"
+                             "Connection: close\r\n"
+                             "\r\n",
+                             headers);
+
+            WriteAll(aSocket, response, count);
+            return;
+        }
+
+    } else if (strcmp(path, "/no-store") == 0) {
+        body    = "no-store-body";
+        headers = "Cache-Control: no-store\r\n";
+
+    } else if (strcmp(path, "/extension") == 0) {
+        body    = "extension-body";
+        headers = "Cache-Control: no-cache-ext, max-age=3600\r\n";
+
+    } else {
+        body    = "fresh-body";
+        headers = "Cache-Control: max-age=3600\r\n";
+
+    }
+
+    count = snprintf(response, sizeof (response),
+                     "HTTP/1.1 200 OK\r\n"
+                     "%s"
+                     "Content-Type: text/plain\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Connection: close\r\n"
+                     "\r\n"
+                     "%s",
+                     headers,
+                     strlen(body),
+                     body);
+
+    WriteAll(aSocket, response, count);
+}
+
+// Client
+
+/**
+ *  Fetch the path from the server through the response cache,
+ *  returning the body, whether it came from the cache and the
+ *  requests the server saw for it.
+ *
+ */
+static int
+Fetch(unsigned short aPort, const char *aPath, int aReport, char *aBody, size_t aBodySize, Boolean *aFromCache, char *aReports, size_t aReportsSize)
+{
+    char             url[128];
+    CFURLRef         theURL   = NULL;
+    CFHTTPMessageRef request  = NULL;
+    CFHTTPMessageRef response = NULL;
+    CFReadStreamRef  stream   = NULL;
+    CFBooleanRef     cached   = NULL;
+    size_t           length   = 0;
+    Boolean          result;
+    int              status   = -1;
+
+    snprintf(url, sizeof (url), "http://127.0.0.1:%u%s", aPort, aPath);
+
+    theURL = CFURLCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)url, strlen(url), kCFStringEncodingASCII, NULL);
+    __Require(theURL != NULL, done);
+
+    request = CFHTTPMessageCreateRequest(kCFAllocatorDefault, CFSTR("GET"), theURL, kCFHTTPVersion1_1);
+    __Require(request != NULL, done);
+
+    stream = CFReadStreamCreateForHTTPRequest(kCFAllocatorDefault, request);
+    __Require(stream != NULL, done);
+
+    result = CFReadStreamSetProperty(stream, _kCFStreamPropertyHTTPUseResponseCache, kCFBooleanTrue);
+    __Require(result, done);
+
+    result = CFReadStreamOpen(stream);
+    __Require(result, done);
+
+    while (TRUE) {
+        CFIndex read = CFReadStreamRead(stream, (UInt8 *)aBody + length, aBodySize - 1 - length);
+
+        __Require(read >= 0, done);
+
+        if (read == 0) {
+            break;
+        }
+
+        length += (size_t)read;
+    }
+
+    aBody[length] = '\0';
+
+    response = (CFHTTPMessageRef)CFReadStreamCopyProperty(stream, kCFStreamPropertyHTTPResponseHeader);
+    __Require(response != NULL, done);
+    __Require(CFHTTPMessageGetResponseStatusCode(response) == 200, done);
+
+    cached = (CFBooleanRef)CFReadStreamCopyProperty(stream, _kCFStreamPropertyHTTPResponseFromCache);
+    __Require(cached != NULL, done);
+
+    *aFromCache = CFBooleanGetValue(cached);
+
+    ReadReports(aReport, aReports, aReportsSize);
+
+    status = 0;
+
+ done:
+    if (cached != NULL) {
+        CFRelease(cached);
+    }
+
+    if (response != NULL) {
+        CFRelease(response);
+    }
+
+    if (stream != NULL) {
+        CFReadStreamClose(stream);
+        CFRelease(stream);
+    }
+
+    if (request != NULL) {
+        CFRelease(request);
+    }
+
+    if (theURL != NULL) {
+        CFRelease(theURL);
+    }
+
+    return (status);
+}
+
+/**
+ *  Fetch the path and check what came back and what the server saw.
+ *
+ */
+static int
+Expect(unsigned short aPort, int aReport, const char *aDescription, const char *aPath, const char *aBody, Boolean aFromCache, const char *aReports)
+{
+    char    body[256];
+    char    reports[256];
+    Boolean fromCache = FALSE;
+    int     status;
+
+    status = Fetch(aPort, aPath, aReport, body, sizeof (body), &fromCache, reports, sizeof (reports));
+    __Require(status == 0, done);
+
+    status = -1;
+
+    __Require(strcmp(body, aBody) == 0, done);
+    __Require(fromCache == aFromCache, done);
+    __Require(strcmp(reports, aReports) == 0, done);
+
+    status = 0;
+
+ done:
+    __CFHTTPResponseCacheTestLog("%-40s %s\n", aDescription, (status == 0) ? "passed" : "FAILED");
+
+    return (status);
+}
+
+int
+main(void)
+{
+    char           directory[] = "/tmp/CFHTTPResponseCacheTest.XXXXXX";
+    CFURLRef       directoryURL = NULL;
+    unsigned short port         = 0;
+    int            report       = -1;
+    pid_t          server       = -1;
+    int            status       = -1;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    __Require(mkdtemp(directory) != NULL, done);
+
+    directoryURL = CFURLCreateFromFileSystemRepresentation(kCFAllocatorDefault, (const UInt8 *)directory, strlen(directory), TRUE);
+    __Require(directoryURL != NULL, done);
+
+    // Reports are only read once the response they precede has been
+    // read, so none should be waiting when the pipe is polled.
+
+    server = ServerStart(ServeConnection, NULL, kServerReportNonBlocking, &port, &report);
+    __Require(server > 0, done);
+
+    // Memory only
+
+    _CFHTTPStreamSetResponseCacheLimits(1024 * 1024, 0, NULL);
+
+    status = Expect(port, report, "fresh, first", "/fresh", "fresh-body", FALSE, "/fresh\n");
+    __Require(status == 0, done);
+
+    status = Expect(port, report, "fresh, second", "/fresh", "fresh-body", TRUE, "");
+    __Require(status == 0, done);
+
+    status = Expect(port, report, "no-cache, first", "/etag", "etag-body", FALSE, "/etag\n");
+    __Require(status == 0, done);
+
+    status = Expect(port, report, "no-cache, revalidated", "/etag", "etag-body", TRUE, "/etag conditional\n");
+    __Require(status == 0, done);
+
+    status = Expect(port, report, "no-store, first", "/no-store", "no-store-body", FALSE, "/no-store\n");
+    __Require(status == 0, done);
+
+    status = Expect(port, report, "no-store, second", "/no-store", "no-store-body", FALSE, "/no-store\n");
+    __Require(status == 0, done);
+
+    status = Expect(port, report, "extension, first", "/extension", "extension-body", FALSE, "/extension\n");
+    __Require(status == 0, done);
+
+    status = Expect(port, report, "extension, second", "/extension", "extension-body", TRUE, "");
+    __Require(status == 0, done);
+
+    // Disk only, then the same directory again, as if after a restart
+
+    _CFHTTPStreamRemoveAllCachedResponses();
+    _CFHTTPStreamSetResponseCacheLimits(0, 1024 * 1024, directoryURL);
+
+    status = Expect(port, report, "disk, first", "/fresh", "fresh-body", FALSE, "/fresh\n");
+    __Require(status == 0, done);
+
+    status = Expect(port, report, "disk, second", "/fresh", "fresh-body", TRUE, "");
+    __Require(status == 0, done);
+
+    _CFHTTPStreamSetResponseCacheLimits(0, 0, NULL);
+    _CFHTTPStreamSetResponseCacheLimits(0, 1024 * 1024, directoryURL);
+
+    status = Expect(port, report, "disk, reopened", "/fresh", "fresh-body", TRUE, "");
+    __Require(status == 0, done);
+
+    status = Expect(port, report, "disk, revalidated", "/etag", "etag-body", FALSE, "/etag\n");
+    __Require(status == 0, done);
+
+    status = Expect(port, report, "disk, revalidated again", "/etag", "etag-body", TRUE, "/etag conditional\n");
+    __Require(status == 0, done);
+
+ done:
+    ServerStop(server);
+
+    if (report >= 0) {
+        close(report);
+    }
+
+    if (directoryURL != NULL) {
+        char path[sizeof (directory) + 16];
+
+        _CFHTTPStreamRemoveAllCachedResponses();
+        _CFHTTPStreamSetResponseCacheLimits(0, 0, NULL);
+
+        snprintf(path, sizeof (path), "%s/index", directory);
+        unlink(path);
+        rmdir(directory);
+
+        CFRelease(directoryURL);
+    }
+
+    return ((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,374 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements a test of the CFNetwork ICMP echo prober
+ *     against loopback targets: that every probe to 127.0.0.1 is
+ *     answered, that replies are matched to the right target and the
+ *     right prober when two probers share targets and sequence
+ *     numbers, and that replies which come after the timeout are
+ *     counted as lost.
+ *
+ *     The prober uses unprivileged datagram ICMP sockets; where the
+ *     system does not allow them (on Linux, when the user is not in
+ *     net.ipv4.ping_group_range), the test is skipped.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <AssertMacros.h>
+
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFNetDiagnosticsPriv.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#define __CFNetDiagnosticProberTestLog(format, ...)   do { fprintf(stderr, format, ##__VA_ARGS__); fflush(stderr); } while (0)
+
+#define kProbeCount         3
+#define kProbeInterval      0.05
+#define kProbeTimeout       2.0
+#define kLateTimeout        0.000001
+#define kTimeout            10.0
+
+#define kMaximumResults     4
+
+typedef struct {
+    char                            mTarget[64];
+    struct in_addr                  mAddress;
+    _CFNetDiagnosticProbeStatistics mStatistics;
+    CFStreamError                   mError;
+} Result;
+
+typedef struct {
+    Result   mResults[kMaximumResults];
+    CFIndex  mCount;
+} Results;
+
+static void
+ProberCallBack(_CFNetDiagnosticProberRef aProber, CFStringRef aTarget, CFDataRef anAddress, const _CFNetDiagnosticProbeStatistics *aStatistics, const CFStreamError *anError, void *anInfo)
+{
+    Results *results = (Results *)anInfo;
+    Result  *result;
+
+    if (results->mCount == kMaximumResults) {
+        return;
+    }
+
+    result = &results->mResults[results->mCount++];
+
+    memset(result, 0, sizeof (*result));
+
+    CFStringGetCString(aTarget, result->mTarget, sizeof (result->mTarget), kCFStringEncodingASCII);
+
+    if ((anAddress != NULL) && (CFDataGetLength(anAddress) >= (CFIndex)sizeof (struct sockaddr_in))) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)CFDataGetBytePtr(anAddress);
+
+        if (sin->sin_family == AF_INET) {
+            result->mAddress = sin->sin_addr;
+        }
+    }
+
+    result->mStatistics = *aStatistics;
+    result->mError      = *anError;
+}
+
+static void
+ProberStop(_CFNetDiagnosticProberRef aProber)
+{
+    if (aProber != NULL) {
+        _CFNetDiagnosticProberUnscheduleFromRunLoop(aProber, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+        _CFNetDiagnosticProberInvalidate(aProber);
+        CFRelease(aProber);
+    }
+}
+
+/**
+ *  Make a prober calling back into the results, scheduled on the
+ *  current run loop, with the given targets.
+ *
+ */
+static _CFNetDiagnosticProberRef
+ProberStart(CFTimeInterval aTimeout, Results *aResults, const char *aFirst, const char *aSecond)
+{
+    _CFNetDiagnosticProberClientContext context = { 0, NULL, NULL, NULL, NULL };
+    _CFNetDiagnosticProberRef           prober;
+    const char                         *targets[2] = { aFirst, aSecond };
+    size_t                              i;
+
+    context.info = aResults;
+
+    prober = _CFNetDiagnosticProberCreate(kCFAllocatorDefault, kProbeCount, kProbeInterval, aTimeout, ProberCallBack, &context);
+    __Require(prober != NULL, done);
+
+    _CFNetDiagnosticProberScheduleWithRunLoop(prober, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+
+    for (i = 0; i < sizeof (targets) / sizeof (targets[0]); i++) {
+        CFStringRef target;
+        Boolean     added;
+
+        if (targets[i] == NULL) {
+            continue;
+        }
+
+        target = CFStringCreateWithCString(kCFAllocatorDefault, targets[i], kCFStringEncodingASCII);
+        added  = (target != NULL) && _CFNetDiagnosticProberAddTarget(prober, target);
+
+        if (target != NULL) {
+            CFRelease(target);
+        }
+
+        if (!added) {
+            ProberStop(prober);
+            prober = NULL;
+            break;
+        }
+    }
+
+ done:
+    return (prober);
+}
+
+/**
+ *  Run the current run loop until each set of results has as many
+ *  as expected, or the time runs out.
+ *
+ */
+static Boolean
+RunUntil(Results *aFirst, CFIndex aFirstCount, Results *aSecond, CFIndex aSecondCount)
+{
+    CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + kTimeout;
+
+    while ((aFirst->mCount < aFirstCount) || ((aSecond != NULL) && (aSecond->mCount < aSecondCount))) {
+        if (CFAbsoluteTimeGetCurrent() >= deadline) {
+            return (FALSE);
+        }
+
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.1, FALSE);
+    }
+
+    return (TRUE);
+}
+
+static const Result *
+FindResult(const Results *aResults, const char *aTarget)
+{
+    CFIndex i;
+
+    for (i = 0; i < aResults->mCount; i++) {
+        if (strcmp(aResults->mResults[i].mTarget, aTarget) == 0) {
+            return (&aResults->mResults[i]);
+        }
+    }
+
+    return (NULL);
+}
+
+/**
+ *  Check that the target finished without error, at the address it
+ *  was named by, with every probe sent and aReceived of them
+ *  answered.
+ *
+ */
+static Boolean
+CheckResult(const Results *aResults, const char *aTarget, CFIndex aReceived)
+{
+    const Result                          *result = FindResult(aResults, aTarget);
+    const _CFNetDiagnosticProbeStatistics *stats;
+    struct in_addr                         address;
+
+    if ((result == NULL) || (result->mError.error != 0)) {
+        return (FALSE);
+    }
+
+    if ((inet_pton(AF_INET, aTarget, &address) != 1) || (address.s_addr != result->mAddress.s_addr)) {
+        return (FALSE);
+    }
+
+    stats = &result->mStatistics;
+
+    if ((stats->sent != kProbeCount) || (stats->received != aReceived)) {
+        return (FALSE);
+    }
+
+    if (aReceived == 0) {
+        return ((stats->minimum == 0.0) && (stats->average == 0.0) && (stats->maximum == 0.0));
+    }
+
+    return ((stats->minimum >= 0.0) &&
+            (stats->minimum <= stats->average) &&
+            (stats->average <= stats->maximum) &&
+            (stats->maximum < kProbeTimeout));
+}
+
+/**
+ *  Probe 127.0.0.1, returning 1 if the system does not allow the
+ *  prober's sockets.
+ *
+ */
+static int
+TestLoopback(void)
+{
+    Results                   results;
+    _CFNetDiagnosticProberRef prober;
+    const Result             *result;
+    int                       status   = -1;
+
+    memset(&results, 0, sizeof (results));
+
+    prober = ProberStart(kProbeTimeout, &results, "127.0.0.1", NULL);
+    __Require(prober != NULL, done);
+
+    __Require(RunUntil(&results, 1, NULL, 0), done);
+
+    result = FindResult(&results, "127.0.0.1");
+    __Require(result != NULL, done);
+
+    if ((result->mError.domain == kCFStreamErrorDomainPOSIX) &&
+        ((result->mError.error == EACCES) || (result->mError.error == EPERM) || (result->mError.error == EPROTONOSUPPORT)))
+    {
+        status = 1;
+        goto done;
+    }
+
+    __Require(CheckResult(&results, "127.0.0.1", kProbeCount), done);
+
+    status = 0;
+
+ done:
+    ProberStop(prober);
+
+    __CFNetDiagnosticProberTestLog("%-40s %s\n", "loopback, answered", (status == 0) ? "passed" : (status == 1) ? "skipped" : "FAILED");
+
+    return (status);
+}
+
+/**
+ *  Run two probers at once: one with two loopback targets sharing
+ *  its socket, the other with one of the same targets.  Both start
+ *  their sequence numbers at zero, so only the identifier, source
+ *  address and cookie tell their replies apart.
+ *
+ */
+static int
+TestMatching(void)
+{
+    Results                   first;
+    Results                   second;
+    _CFNetDiagnosticProberRef firstProber  = NULL;
+    _CFNetDiagnosticProberRef secondProber = NULL;
+    int                       status       = -1;
+
+    memset(&first, 0, sizeof (first));
+    memset(&second, 0, sizeof (second));
+
+    firstProber = ProberStart(kProbeTimeout, &first, "127.0.0.1", "127.0.0.2");
+    __Require(firstProber != NULL, done);
+
+    secondProber = ProberStart(kProbeTimeout, &second, "127.0.0.1", NULL);
+    __Require(secondProber != NULL, done);
+
+    __Require(RunUntil(&first, 2, &second, 1), done);
+
+    __Require(first.mCount == 2, done);
+    __Require(second.mCount == 1, done);
+
+    __Require(CheckResult(&first, "127.0.0.1", kProbeCount), done);
+    __Require(CheckResult(&first, "127.0.0.2", kProbeCount), done);
+    __Require(CheckResult(&second, "127.0.0.1", kProbeCount), done);
+
+    status = 0;
+
+ done:
+    ProberStop(secondProber);
+    ProberStop(firstProber);
+
+    __CFNetDiagnosticProberTestLog("%-40s %s\n", "replies matched to target and prober", (status == 0) ? "passed" : "FAILED");
+
+    return (status);
+}
+
+/**
+ *  Probe 127.0.0.1 with a timeout no reply can meet; every probe is
+ *  sent and every one lost.
+ *
+ */
+static int
+TestTimeout(void)
+{
+    Results                   results;
+    _CFNetDiagnosticProberRef prober;
+    int                       status   = -1;
+
+    memset(&results, 0, sizeof (results));
+
+    prober = ProberStart(kLateTimeout, &results, "127.0.0.1", NULL);
+    __Require(prober != NULL, done);
+
+    __Require(RunUntil(&results, 1, NULL, 0), done);
+
+    __Require(CheckResult(&results, "127.0.0.1", 0), done);
+
+    status = 0;
+
+ done:
+    ProberStop(prober);
+
+    __CFNetDiagnosticProberTestLog("%-40s %s\n", "late replies, timed out", (status == 0) ? "passed" : "FAILED");
+
+    return (status);
+}
+
+int
+main(void)
+{
+    int status;
+
+    status = TestLoopback();
+
+    // Without ICMP sockets there is nothing more to test.
+
+    if (status == 1) {
+        status = 0;
+        goto done;
+    }
+
+    __Require(status == 0, done);
+
+    status = TestMatching();
+    __Require(status == 0, done);
+
+    status = TestTimeout();
+    __Require(status == 0, done);
+
+ done:
+    return ((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
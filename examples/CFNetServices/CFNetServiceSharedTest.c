@@ -0,0 +1,591 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements a test of CFNetwork service browsers and
+ *     monitors sharing the one DNS-SD connection of the process: that
+ *     two browsers of different types, one called per service and one
+ *     in batches, and two monitors of different services, are each
+ *     called only with their own replies, that a burst of TXT record
+ *     changes leaves a monitor with the latest, and that a service
+ *     going away is reported once, to its own browser alone.
+ *
+ *     The test registers its own services in "local.", so it needs a
+ *     running DNS-SD daemon; where there is none, or DNS-SD is not
+ *     ported (as on Linux), registration fails and the test is
+ *     skipped.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <AssertMacros.h>
+
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFNetServicesPriv.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#define __CFNetServiceSharedTestLog(format, ...)   do { fprintf(stderr, format, ##__VA_ARGS__); fflush(stderr); } while (0)
+
+#define kDomain             CFSTR("local.")
+#define kFirstType          CFSTR("_cfnsharea._tcp")
+#define kSecondType         CFSTR("_cfnshareb._tcp")
+#define kPort               9
+#define kTimeout            10.0
+#define kSettle             1.0
+
+typedef struct {
+    CFStringRef             mType;
+    CFStringRef             mName;
+    CFIndex                 mCalls;     // per-service callbacks
+    CFIndex                 mBatches;   // batch callbacks
+    CFIndex                 mFound;     // times our service was found
+    CFIndex                 mRemoved;   // times our service went away
+    CFIndex                 mForeign;   // services of another type
+    CFStreamError           mError;
+} BrowserResults;
+
+typedef struct {
+    CFNetServiceRef         mService;
+    CFIndex                 mCalls;
+    CFIndex                 mForeign;   // callbacks for another service
+    CFDataRef               mLatest;
+    CFStreamError           mError;
+} MonitorResults;
+
+typedef struct {
+    CFNetServiceRef         mService;
+    CFNetServiceBrowserRef  mBrowser;
+    CFNetServiceMonitorRef  mMonitor;
+    BrowserResults          mBrowserResults;
+    MonitorResults          mMonitorResults;
+} Client;
+
+static Boolean
+TXTEqual(CFDataRef aData, const char *aValue)
+{
+    CFIndex length = strlen(aValue);
+
+    return ((aData != NULL) &&
+            (CFDataGetLength(aData) == length + 1) &&
+            (CFDataGetBytePtr(aData)[0] == length) &&
+            (memcmp(CFDataGetBytePtr(aData) + 1, aValue, length) == 0));
+}
+
+/**
+ *  Return a TXT record holding the one string.
+ *
+ */
+static CFDataRef
+TXTCreate(const char *aValue)
+{
+    UInt8  bytes[256];
+    size_t length = strlen(aValue);
+
+    bytes[0] = (UInt8)length;
+    memcpy(&bytes[1], aValue, length);
+
+    return (CFDataCreate(kCFAllocatorDefault, bytes, length + 1));
+}
+
+/**
+ *  Count a service found or gone away, if it is ours, or as foreign
+ *  if it is not of the browser's type.
+ *
+ */
+static void
+BrowserCount(BrowserResults *aResults, CFNetServiceRef aService, Boolean aRemoved)
+{
+    if (!CFStringHasPrefix(CFNetServiceGetType(aService), aResults->mType)) {
+        aResults->mForeign++;
+
+    } else if (CFEqual(CFNetServiceGetName(aService), aResults->mName)) {
+        if (aRemoved) {
+            aResults->mRemoved++;
+        } else {
+            aResults->mFound++;
+        }
+    }
+}
+
+static void
+BrowserCallBack(CFNetServiceBrowserRef aBrowser, CFOptionFlags aFlags, CFTypeRef aDomainOrService, CFStreamError *anError, void *anInfo)
+{
+    BrowserResults *results = (BrowserResults *)anInfo;
+
+    results->mCalls++;
+
+    if ((anError != NULL) && (anError->error != 0)) {
+        results->mError = *anError;
+
+    } else if (!(aFlags & kCFNetServiceFlagIsDomain)) {
+        BrowserCount(results, (CFNetServiceRef)aDomainOrService, (aFlags & kCFNetServiceFlagRemove) != 0);
+    }
+}
+
+static void
+BrowserBatchCallBack(CFNetServiceBrowserRef aBrowser, CFArrayRef anAdded, CFArrayRef aRemoved, void *anInfo)
+{
+    BrowserResults *results = (BrowserResults *)anInfo;
+    CFIndex         i;
+
+    results->mBatches++;
+
+    for (i = 0; i < CFArrayGetCount(anAdded); i++) {
+        BrowserCount(results, (CFNetServiceRef)CFArrayGetValueAtIndex(anAdded, i), FALSE);
+    }
+
+    for (i = 0; i < CFArrayGetCount(aRemoved); i++) {
+        BrowserCount(results, (CFNetServiceRef)CFArrayGetValueAtIndex(aRemoved, i), TRUE);
+    }
+}
+
+static void
+MonitorCallBack(CFNetServiceMonitorRef aMonitor, CFNetServiceRef aService, CFNetServiceMonitorType aType, CFDataRef anRData, CFStreamError *anError, void *anInfo)
+{
+    MonitorResults *results = (MonitorResults *)anInfo;
+
+    results->mCalls++;
+
+    if (aService != results->mService) {
+        results->mForeign++;
+
+    } else if ((anError != NULL) && (anError->error != 0)) {
+        results->mError = *anError;
+
+    } else if (anRData != NULL) {
+        if (results->mLatest != NULL) {
+            CFRelease(results->mLatest);
+        }
+
+        results->mLatest = CFDataCreateCopy(kCFAllocatorDefault, anRData);
+    }
+}
+
+static void
+ServiceCallBack(CFNetServiceRef aService, CFStreamError *anError, void *anInfo)
+{
+    // Registration failures are seen as our services never being found.
+}
+
+static void
+ServiceStop(CFNetServiceRef aService)
+{
+    if (aService != NULL) {
+        CFNetServiceUnscheduleFromRunLoop(aService, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+        CFNetServiceSetClient(aService, NULL, NULL);
+        CFNetServiceCancel(aService);
+        CFRelease(aService);
+    }
+}
+
+/**
+ *  Register a service of the given type, with the TXT record
+ *  "v=0", returning NULL and the error if it cannot be.
+ *
+ */
+static CFNetServiceRef
+ServiceStart(CFStringRef aType, CFStringRef aName, CFStreamError *anError)
+{
+    CFNetServiceClientContext context = { 0, NULL, NULL, NULL, NULL };
+    CFNetServiceRef           service;
+    CFDataRef                 txt;
+    Boolean                   registered;
+
+    memset(anError, 0, sizeof (*anError));
+
+    service = CFNetServiceCreate(kCFAllocatorDefault, kDomain, aType, aName, kPort);
+    __Require(service != NULL, done);
+
+    txt = TXTCreate("v=0");
+    __Require_Action(txt != NULL, done, ServiceStop(service); service = NULL);
+
+    CFNetServiceSetTXTData(service, txt);
+    CFRelease(txt);
+
+    CFNetServiceSetClient(service, ServiceCallBack, &context);
+    CFNetServiceScheduleWithRunLoop(service, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+
+    registered = CFNetServiceRegisterWithOptions(service, kCFNetServiceFlagNoAutoRename, anError);
+    __Require_Action(registered, done, ServiceStop(service); service = NULL);
+
+ done:
+    return (service);
+}
+
+static void
+ClientStop(Client *aClient)
+{
+    if (aClient->mMonitor != NULL) {
+        CFNetServiceMonitorStop(aClient->mMonitor, NULL);
+        CFNetServiceMonitorUnscheduleFromRunLoop(aClient->mMonitor, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+        CFNetServiceMonitorInvalidate(aClient->mMonitor);
+        CFRelease(aClient->mMonitor);
+        aClient->mMonitor = NULL;
+    }
+
+    if (aClient->mBrowser != NULL) {
+        CFNetServiceBrowserStopSearch(aClient->mBrowser, NULL);
+        CFNetServiceBrowserUnscheduleFromRunLoop(aClient->mBrowser, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+        CFNetServiceBrowserInvalidate(aClient->mBrowser);
+        CFRelease(aClient->mBrowser);
+        aClient->mBrowser = NULL;
+    }
+
+    if (aClient->mService != NULL) {
+        CFRelease(aClient->mService);
+        aClient->mService = NULL;
+    }
+
+    if (aClient->mMonitorResults.mLatest != NULL) {
+        CFRelease(aClient->mMonitorResults.mLatest);
+        aClient->mMonitorResults.mLatest = NULL;
+    }
+}
+
+/**
+ *  Start a shared browser for the type and a shared monitor of the
+ *  TXT record of the named service of that type, both scheduled on
+ *  the current run loop.  The browser is called in batches if asked.
+ *
+ */
+static Boolean
+ClientStart(Client *aClient, CFStringRef aType, CFStringRef aName, Boolean aBatched)
+{
+    CFNetServiceClientContext browserContext = { 0, NULL, NULL, NULL, NULL };
+    CFNetServiceClientContext monitorContext = { 0, NULL, NULL, NULL, NULL };
+    Boolean                   started        = FALSE;
+
+    memset(aClient, 0, sizeof (*aClient));
+
+    aClient->mBrowserResults.mType = aType;
+    aClient->mBrowserResults.mName = aName;
+
+    browserContext.info = &aClient->mBrowserResults;
+    monitorContext.info = &aClient->mMonitorResults;
+
+    aClient->mBrowser = CFNetServiceBrowserCreate(kCFAllocatorDefault, BrowserCallBack, &browserContext);
+    __Require(aClient->mBrowser != NULL, done);
+
+    _CFNetServiceBrowserSetUsesSharedConnection(aClient->mBrowser, TRUE);
+
+    if (aBatched) {
+        _CFNetServiceBrowserSetBatchCallBack(aClient->mBrowser, BrowserBatchCallBack);
+    }
+
+    CFNetServiceBrowserScheduleWithRunLoop(aClient->mBrowser, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+
+    __Require(CFNetServiceBrowserSearchForServices(aClient->mBrowser, kDomain, aType, NULL), done);
+
+    aClient->mService = CFNetServiceCreate(kCFAllocatorDefault, kDomain, aType, aName, 0);
+    __Require(aClient->mService != NULL, done);
+
+    aClient->mMonitorResults.mService = aClient->mService;
+
+    aClient->mMonitor = CFNetServiceMonitorCreate(kCFAllocatorDefault, aClient->mService, MonitorCallBack, &monitorContext);
+    __Require(aClient->mMonitor != NULL, done);
+
+    _CFNetServiceMonitorSetUsesSharedConnection(aClient->mMonitor, TRUE);
+
+    CFNetServiceMonitorScheduleWithRunLoop(aClient->mMonitor, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+
+    __Require(CFNetServiceMonitorStart(aClient->mMonitor, kCFNetServiceMonitorTXT, NULL), done);
+
+    started = TRUE;
+
+ done:
+    if (!started) {
+        ClientStop(aClient);
+    }
+
+    return (started);
+}
+
+static Boolean
+ClientFailed(const Client *aClient)
+{
+    return ((aClient->mBrowserResults.mError.error != 0) || (aClient->mMonitorResults.mError.error != 0));
+}
+
+/**
+ *  Run the current run loop until each client's browser has found
+ *  its service, and each monitor has the given TXT record, or the
+ *  time runs out.
+ *
+ */
+static Boolean
+RunUntilFound(Client *aFirst, Client *aSecond, const char *aFirstTXT, const char *aSecondTXT)
+{
+    CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + kTimeout;
+
+    while ((aFirst->mBrowserResults.mFound == 0) ||
+           (aSecond->mBrowserResults.mFound == 0) ||
+           !TXTEqual(aFirst->mMonitorResults.mLatest, aFirstTXT) ||
+           !TXTEqual(aSecond->mMonitorResults.mLatest, aSecondTXT))
+    {
+        if (ClientFailed(aFirst) || ClientFailed(aSecond) || (CFAbsoluteTimeGetCurrent() >= deadline)) {
+            return (FALSE);
+        }
+
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.1, FALSE);
+    }
+
+    return (TRUE);
+}
+
+static Boolean
+RunUntilRemoved(Client *aClient)
+{
+    CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + kTimeout;
+
+    while (aClient->mBrowserResults.mRemoved == 0) {
+        if (ClientFailed(aClient) || (CFAbsoluteTimeGetCurrent() >= deadline)) {
+            return (FALSE);
+        }
+
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.1, FALSE);
+    }
+
+    return (TRUE);
+}
+
+/**
+ *  Run the current run loop a while longer, so that any stray
+ *  replies are delivered.
+ *
+ */
+static void
+Settle(void)
+{
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, kSettle, FALSE);
+}
+
+/**
+ *  Return the number of services the browser knows, and whether the
+ *  named service is among them.
+ *
+ */
+static CFIndex
+CopyServicesCount(CFNetServiceBrowserRef aBrowser, CFStringRef aName, Boolean *aFound)
+{
+    CFArrayRef services = _CFNetServiceBrowserCopyServices(aBrowser);
+    CFIndex    count    = 0;
+    CFIndex    i;
+
+    *aFound = FALSE;
+
+    if (services != NULL) {
+        count = CFArrayGetCount(services);
+
+        for (i = 0; i < count; i++) {
+            CFNetServiceRef service = (CFNetServiceRef)CFArrayGetValueAtIndex(services, i);
+
+            if (CFEqual(CFNetServiceGetName(service), aName)) {
+                *aFound = TRUE;
+            }
+        }
+
+        CFRelease(services);
+    }
+
+    return (count);
+}
+
+/**
+ *  Check that each client found only its own service, the batched
+ *  browser only in batches and the other only per service, and
+ *  that each monitor has only its own service's TXT record.
+ *
+ */
+static int
+TestSeparation(Client *aFirst, Client *aSecond)
+{
+    int status = -1;
+
+    __Require(RunUntilFound(aFirst, aSecond, "v=0", "v=0"), done);
+
+    Settle();
+
+    __Require(aFirst->mBrowserResults.mForeign == 0, done);
+    __Require(aFirst->mBrowserResults.mFound == 1, done);
+    __Require(aFirst->mBrowserResults.mBatches > 0, done);
+    __Require(aFirst->mBrowserResults.mCalls == 0, done);
+
+    __Require(aSecond->mBrowserResults.mForeign == 0, done);
+    __Require(aSecond->mBrowserResults.mFound == 1, done);
+    __Require(aSecond->mBrowserResults.mBatches == 0, done);
+    __Require(aSecond->mBrowserResults.mCalls > 0, done);
+
+    __Require(aFirst->mMonitorResults.mForeign == 0, done);
+    __Require(aSecond->mMonitorResults.mForeign == 0, done);
+
+    status = 0;
+
+ done:
+    __CFNetServiceSharedTestLog("%-40s %s\n", "shared clients, kept separate", (status == 0) ? "passed" : "FAILED");
+
+    return (status);
+}
+
+/**
+ *  Change the first service's TXT record three times back to back;
+ *  its monitor must end with the last, in no more calls than there
+ *  were changes, and the other monitor must not be called.
+ *
+ */
+static int
+TestCoalescing(CFNetServiceRef aService, Client *aFirst, Client *aSecond)
+{
+    static const char * const values[] = { "v=1", "v=2", "v=3" };
+    CFIndex                   firstCalls  = aFirst->mMonitorResults.mCalls;
+    CFIndex                   secondCalls = aSecond->mMonitorResults.mCalls;
+    size_t                    i;
+    int                       status      = -1;
+
+    for (i = 0; i < sizeof (values) / sizeof (values[0]); i++) {
+        CFDataRef txt = TXTCreate(values[i]);
+
+        __Require(txt != NULL, done);
+
+        CFNetServiceSetTXTData(aService, txt);
+        CFRelease(txt);
+    }
+
+    __Require(RunUntilFound(aFirst, aSecond, "v=3", "v=0"), done);
+
+    Settle();
+
+    __Require(TXTEqual(aFirst->mMonitorResults.mLatest, "v=3"), done);
+    __Require(aFirst->mMonitorResults.mCalls - firstCalls <= (CFIndex)(sizeof (values) / sizeof (values[0])), done);
+    __Require(aFirst->mMonitorResults.mForeign == 0, done);
+
+    __Require(aSecond->mMonitorResults.mCalls == secondCalls, done);
+
+    status = 0;
+
+ done:
+    __CFNetServiceSharedTestLog("%-40s %s\n", "TXT changes, latest delivered", (status == 0) ? "passed" : "FAILED");
+
+    return (status);
+}
+
+/**
+ *  Take the first service away; only its browser is told, once, and
+ *  no longer lists it, while the other still lists its own.
+ *
+ */
+static int
+TestRemoval(CFNetServiceRef *aService, Client *aFirst, Client *aSecond)
+{
+    Boolean found;
+    int     status = -1;
+
+    ServiceStop(*aService);
+    *aService = NULL;
+
+    __Require(RunUntilRemoved(aFirst), done);
+
+    Settle();
+
+    __Require(aFirst->mBrowserResults.mRemoved == 1, done);
+    __Require(aFirst->mBrowserResults.mFound == 1, done);
+    __Require(aFirst->mBrowserResults.mForeign == 0, done);
+
+    CopyServicesCount(aFirst->mBrowser, aFirst->mBrowserResults.mName, &found);
+    __Require(!found, done);
+
+    __Require(aSecond->mBrowserResults.mRemoved == 0, done);
+    __Require(aSecond->mBrowserResults.mForeign == 0, done);
+
+    __Require(CopyServicesCount(aSecond->mBrowser, aSecond->mBrowserResults.mName, &found) == 1, done);
+    __Require(found, done);
+
+    status = 0;
+
+ done:
+    __CFNetServiceSharedTestLog("%-40s %s\n", "service removed, its browser told", (status == 0) ? "passed" : "FAILED");
+
+    return (status);
+}
+
+int
+main(void)
+{
+    CFStringRef     name;
+    CFNetServiceRef firstService  = NULL;
+    CFNetServiceRef secondService = NULL;
+    Client          first;
+    Client          second;
+    CFStreamError   error;
+    int             status        = -1;
+
+    memset(&first, 0, sizeof (first));
+    memset(&second, 0, sizeof (second));
+
+    name = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("CFNetServiceSharedTest %d"), (int)getpid());
+    __Require(name != NULL, done);
+
+    // Without DNS-SD there is nothing to test.
+
+    firstService = ServiceStart(kFirstType, name, &error);
+
+    if ((firstService == NULL) && (error.domain == kCFStreamErrorDomainNetServices)) {
+        __CFNetServiceSharedTestLog("%-40s %s\n", "shared clients, kept separate", "skipped");
+        status = 0;
+        goto done;
+    }
+
+    __Require(firstService != NULL, done);
+
+    secondService = ServiceStart(kSecondType, name, &error);
+    __Require(secondService != NULL, done);
+
+    __Require(ClientStart(&first, kFirstType, name, TRUE), done);
+    __Require(ClientStart(&second, kSecondType, name, FALSE), done);
+
+    status = TestSeparation(&first, &second);
+    __Require(status == 0, done);
+
+    status = TestCoalescing(firstService, &first, &second);
+    __Require(status == 0, done);
+
+    status = TestRemoval(&firstService, &first, &second);
+    __Require(status == 0, done);
+
+ done:
+    ClientStop(&second);
+    ClientStop(&first);
+
+    ServiceStop(secondService);
+    ServiceStop(firstService);
+
+    if (name != NULL) {
+        CFRelease(name);
+    }
+
+    return ((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,363 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements a test of the CFNetwork perform queue: that
+ *     work enqueued at once from several threads is all performed, and
+ *     released, on the run loop the queue is scheduled on, in the
+ *     order each thread enqueued it; that work enqueued before the
+ *     queue is scheduled runs once it is; that draining runs it on the
+ *     calling thread; and that destroying the queue releases what is
+ *     pending without performing it.
+ *
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <AssertMacros.h>
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "CFNetworkSchedule.h"
+
+#define __CFNetworkPerformQueueTestLog(format, ...)   do { fprintf(stderr, format, ##__VA_ARGS__); fflush(stderr); } while (0)
+
+#define kProducers          4
+#define kItemsPerProducer   20000
+#define kTimeout            30.0
+
+typedef struct {
+    const char *  mDescription;
+    int        (* mFunction)(void);
+} _CFNetworkPerformQueueTestCase;
+
+typedef struct {
+    _CFNetworkPerformQueueRef mQueue;
+    uintptr_t                 mProducer;
+    pthread_t                 mThread;
+    Boolean                   mFailed;
+} Producer;
+
+/**
+ *  What has been performed and released.  Items are numbered
+ *  kItemsPerProducer apart per producer, so that each producer's can
+ *  be checked to arrive in order.
+ *
+ */
+static pthread_t sConsumer;
+static CFIndex   sPerformed;
+static CFIndex   sReleased;
+static CFIndex   sNext[kProducers];
+static Boolean   sFailed;
+
+static void
+Reset(void)
+{
+    size_t i;
+
+    sConsumer  = pthread_self();
+    sPerformed = 0;
+    sReleased  = 0;
+    sFailed    = FALSE;
+
+    for (i = 0; i < kProducers; i++) {
+        sNext[i] = 0;
+    }
+}
+
+static void
+Perform(void *anInfo)
+{
+    uintptr_t item     = (uintptr_t)anInfo;
+    uintptr_t producer = item / kItemsPerProducer;
+    uintptr_t sequence = item % kItemsPerProducer;
+
+    if (!pthread_equal(pthread_self(), sConsumer) || (producer >= kProducers) || ((CFIndex)sequence != sNext[producer])) {
+        sFailed = TRUE;
+
+    } else {
+        sNext[producer]++;
+
+    }
+
+    sPerformed++;
+}
+
+static void
+Release(void *anInfo)
+{
+    if (!pthread_equal(pthread_self(), sConsumer)) {
+        sFailed = TRUE;
+    }
+
+    sReleased++;
+}
+
+/**
+ *  Run the current run loop until everything expected has been
+ *  performed and released, or until the timeout.
+ *
+ */
+static void
+RunUntil(CFIndex aCount)
+{
+    CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + kTimeout;
+
+    while (((sPerformed < aCount) || (sReleased < aCount)) && (CFAbsoluteTimeGetCurrent() < deadline)) {
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.1, TRUE);
+    }
+}
+
+// Producers
+
+static void *
+Produce(void *aContext)
+{
+    Producer *producer = (Producer *)aContext;
+    uintptr_t i;
+
+    for (i = 0; i < kItemsPerProducer; i++) {
+        uintptr_t item = (producer->mProducer * kItemsPerProducer) + i;
+
+        if (!_CFNetworkPerformQueueEnqueue(producer->mQueue, Perform, (void *)item, Release)) {
+            producer->mFailed = TRUE;
+            break;
+        }
+
+        // Now and then let the consumer catch up, so that the queue
+        // empties and the next enqueue has to wake it again.
+
+        if ((i % 1000) == 0) {
+            sched_yield();
+        }
+    }
+
+    return (NULL);
+}
+
+// Tests
+
+static int
+TestHandoff(void)
+{
+    _CFNetworkPerformQueueRef queue    = NULL;
+    Producer                  producers[kProducers];
+    Boolean                   failed   = FALSE;
+    size_t                    started;
+    size_t                    i;
+    int                       status   = -1;
+
+    Reset();
+
+    queue = _CFNetworkPerformQueueCreate(kCFAllocatorDefault);
+    __Require(queue != NULL, done);
+
+    _CFNetworkPerformQueueScheduleWithRunLoop(queue, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+
+    for (started = 0; started < kProducers; started++) {
+        producers[started].mQueue    = queue;
+        producers[started].mProducer = started;
+        producers[started].mFailed   = FALSE;
+
+        if (pthread_create(&producers[started].mThread, NULL, Produce, &producers[started]) != 0) {
+            break;
+        }
+    }
+
+    if (started == kProducers) {
+        RunUntil(kProducers * kItemsPerProducer);
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(producers[i].mThread, NULL);
+
+        if (producers[i].mFailed) {
+            failed = TRUE;
+        }
+    }
+
+    __Require(started == kProducers, done);
+    __Require(!failed, done);
+
+    __Require(sPerformed == kProducers * kItemsPerProducer, done);
+    __Require(sReleased == kProducers * kItemsPerProducer, done);
+    __Require(!sFailed, done);
+
+    for (i = 0; i < kProducers; i++) {
+        __Require(sNext[i] == kItemsPerProducer, done);
+    }
+
+    status = 0;
+
+ done:
+    if (queue != NULL) {
+        _CFNetworkPerformQueueUnscheduleFromRunLoop(queue, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+        _CFNetworkPerformQueueDestroy(queue);
+    }
+
+    return (status);
+}
+
+static int
+TestEnqueuedBeforeScheduling(void)
+{
+    _CFNetworkPerformQueueRef queue  = NULL;
+    uintptr_t                 i;
+    int                       status = -1;
+
+    Reset();
+
+    queue = _CFNetworkPerformQueueCreate(kCFAllocatorDefault);
+    __Require(queue != NULL, done);
+
+    for (i = 0; i < 3; i++) {
+        __Require(_CFNetworkPerformQueueEnqueue(queue, Perform, (void *)i, Release), done);
+    }
+
+    // Nothing is scheduled, so nothing runs.
+
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.1, TRUE);
+
+    __Require(sPerformed == 0, done);
+
+    _CFNetworkPerformQueueScheduleWithRunLoop(queue, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+
+    RunUntil(3);
+
+    __Require(sPerformed == 3, done);
+    __Require(sReleased == 3, done);
+    __Require(sNext[0] == 3, done);
+    __Require(!sFailed, done);
+
+    status = 0;
+
+ done:
+    if (queue != NULL) {
+        _CFNetworkPerformQueueUnscheduleFromRunLoop(queue, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+        _CFNetworkPerformQueueDestroy(queue);
+    }
+
+    return (status);
+}
+
+static int
+TestDrain(void)
+{
+    _CFNetworkPerformQueueRef queue  = NULL;
+    uintptr_t                 i;
+    int                       status = -1;
+
+    Reset();
+
+    queue = _CFNetworkPerformQueueCreate(kCFAllocatorDefault);
+    __Require(queue != NULL, done);
+
+    for (i = 0; i < 3; i++) {
+        __Require(_CFNetworkPerformQueueEnqueue(queue, Perform, (void *)i, Release), done);
+    }
+
+    _CFNetworkPerformQueueDrain(queue);
+
+    __Require(sPerformed == 3, done);
+    __Require(sReleased == 3, done);
+    __Require(sNext[0] == 3, done);
+    __Require(!sFailed, done);
+
+    // Draining again finds nothing.
+
+    _CFNetworkPerformQueueDrain(queue);
+
+    __Require(sPerformed == 3, done);
+
+    status = 0;
+
+ done:
+    if (queue != NULL) {
+        _CFNetworkPerformQueueDestroy(queue);
+    }
+
+    return (status);
+}
+
+static int
+TestDestroyPending(void)
+{
+    _CFNetworkPerformQueueRef queue  = NULL;
+    uintptr_t                 i;
+    int                       status = -1;
+
+    Reset();
+
+    queue = _CFNetworkPerformQueueCreate(kCFAllocatorDefault);
+    __Require(queue != NULL, done);
+
+    for (i = 0; i < 5; i++) {
+        __Require(_CFNetworkPerformQueueEnqueue(queue, Perform, (void *)i, Release), done);
+    }
+
+    _CFNetworkPerformQueueDestroy(queue);
+    queue = NULL;
+
+    __Require(sPerformed == 0, done);
+    __Require(sReleased == 5, done);
+
+    status = 0;
+
+ done:
+    if (queue != NULL) {
+        _CFNetworkPerformQueueDestroy(queue);
+    }
+
+    return (status);
+}
+
+static const _CFNetworkPerformQueueTestCase sTestCases[] = {
+    { "handoff from several threads",   TestHandoff                  },
+    { "enqueued before scheduling",     TestEnqueuedBeforeScheduling },
+    { "drain",                          TestDrain                    },
+    { "destroy with work pending",      TestDestroyPending           }
+};
+
+int
+main(void)
+{
+    size_t i;
+    int    status = 0;
+
+    for (i = 0; i < sizeof (sTestCases) / sizeof (sTestCases[0]); i++) {
+        int result = sTestCases[i].mFunction();
+
+        __CFNetworkPerformQueueTestLog("%-40s %s\n", sTestCases[i].mDescription, (result == 0) ? "passed" : "FAILED");
+
+        if (result != 0) {
+            status = -1;
+        }
+    }
+
+    return ((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
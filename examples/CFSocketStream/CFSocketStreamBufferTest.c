@@ -0,0 +1,258 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements a test of the CFSocketStream receive
+ *     buffer: that bytes read through it come back whole and in
+ *     order, whatever the buffer's configured size and however the
+ *     writes and reads are cut, as the ring wraps, grows and shrinks
+ *     again; and that end-of-stream is seen once it has drained.
+ *
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include <AssertMacros.h>
+
+#include <CFNetwork/CFNetwork.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "TestSupport.h"
+
+#define __CFSocketStreamBufferTestLog(format, ...)   do { fprintf(stderr, format, ##__VA_ARGS__); fflush(stderr); } while (0)
+
+#define kTotalSize          (1024 * 1024)
+
+// SPI from CFSocketStream.c, which is not exported.
+
+#define _kCFStreamPropertyRecvBufferSize            CFSTR("_kCFStreamPropertyRecvBufferSize")
+
+/**
+ *  One run: the receive buffer size to configure, or 0 to leave the
+ *  stream unbuffered, and the largest read to make.  Writes and
+ *  reads both cycle through sizes which don't divide the buffer, so
+ *  that the unread bytes keep straddling the end of the ring.
+ *
+ */
+typedef struct {
+    const char *mDescription;
+    CFIndex     mBufferSize;
+    size_t      mReadSize;
+} BufferTest;
+
+static const BufferTest sBufferTests[] = {
+    { "unbuffered",                     0,      8192   },
+    { "buffered, default size",         32768,  8192   },
+    { "buffered, minimum size",         4096,   8192   },
+    { "buffered, below minimum size",   100,    8192   },
+    { "buffered, single bytes",         4096,   1      },
+    { "buffered, reads past capacity",  4096,   65536  }
+};
+
+static const size_t sWriteSizes[] = { 1, 13, 700, 4096, 9001, 65536 };
+static const size_t sReadSizes[]  = { 7, 1, 3000, 65536, 100, 5000 };
+
+static UInt8
+PatternByte(size_t anOffset)
+{
+    return ((UInt8)(anOffset ^ (anOffset >> 8) ^ (anOffset >> 16)));
+}
+
+// Writer
+
+/**
+ *  Write kTotalSize bytes of the pattern in writes of varying size,
+ *  pausing now and then so that the reader sometimes drains the
+ *  buffer and sometimes falls behind, then shut the socket down.
+ *
+ */
+static void
+ServeConnection(int aSocket, int aReport, const void *aContext)
+{
+    UInt8  *bytes;
+    size_t  offset = 0;
+    size_t  i      = 0;
+
+    bytes = malloc(kTotalSize);
+    __Require(bytes != NULL, done);
+
+    for (offset = 0; offset < kTotalSize; offset++) {
+        bytes[offset] = PatternByte(offset);
+    }
+
+    offset = 0;
+
+    while (offset < kTotalSize) {
+        size_t length = sWriteSizes[i++ % (sizeof (sWriteSizes) / sizeof (sWriteSizes[0]))];
+
+        if (length > kTotalSize - offset) {
+            length = kTotalSize - offset;
+        }
+
+        __Require(WriteAll(aSocket, bytes + offset, length), done);
+
+        offset += length;
+
+        if ((i % 16) == 0) {
+            usleep(1000);
+        }
+    }
+
+ done:
+    if (bytes != NULL) {
+        free(bytes);
+    }
+
+    shutdown(aSocket, SHUT_WR);
+}
+
+// Reader
+
+static int
+TestBuffer(const BufferTest *aTest)
+{
+    int              sockets[2] = { -1, -1 };
+    pid_t            writer     = -1;
+    CFReadStreamRef  stream     = NULL;
+    CFNumberRef      number     = NULL;
+    UInt8           *buffer     = NULL;
+    size_t           total      = 0;
+    size_t           i          = 0;
+    Boolean          result;
+    int              status     = -1;
+
+    buffer = malloc(aTest->mReadSize);
+    __Require(buffer != NULL, done);
+
+    status = socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+    __Require(status == 0, done);
+
+    status = -1;
+
+    CFStreamCreatePairWithSocket(kCFAllocatorDefault, sockets[0], &stream, NULL);
+    __Require(stream != NULL, done);
+
+    result = CFReadStreamSetProperty(stream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
+    __Require(result, done);
+
+    sockets[0] = -1;
+
+    if (aTest->mBufferSize > 0) {
+        number = CFNumberCreate(kCFAllocatorDefault, kCFNumberCFIndexType, &aTest->mBufferSize);
+        __Require(number != NULL, done);
+
+        result = CFReadStreamSetProperty(stream, _kCFStreamPropertyRecvBufferSize, number);
+        __Require(result, done);
+    }
+
+    result = CFReadStreamOpen(stream);
+    __Require(result, done);
+
+    writer = ServerStartWithSocket(sockets[1], ServeConnection, NULL);
+    __Require(writer > 0, done);
+
+    close(sockets[1]);
+    sockets[1] = -1;
+
+    while (TRUE) {
+        size_t  wanted = sReadSizes[i++ % (sizeof (sReadSizes) / sizeof (sReadSizes[0]))];
+        CFIndex length;
+        CFIndex j;
+
+        if (wanted > aTest->mReadSize) {
+            wanted = aTest->mReadSize;
+        }
+
+        length = CFReadStreamRead(stream, buffer, wanted);
+        __Require(length >= 0, done);
+
+        if (length == 0) {
+            break;
+        }
+
+        __Require((size_t)length <= wanted, done);
+
+        for (j = 0; j < length; j++) {
+            __Require(buffer[j] == PatternByte(total + j), done);
+        }
+
+        total += (size_t)length;
+    }
+
+    __Require(total == kTotalSize, done);
+    __Require(CFReadStreamGetStatus(stream) == kCFStreamStatusAtEnd, done);
+
+    status = 0;
+
+ done:
+    __CFSocketStreamBufferTestLog("%-40s %s\n", aTest->mDescription, (status == 0) ? "passed" : "FAILED");
+
+    ServerStop(writer);
+
+    if (stream != NULL) {
+        CFReadStreamClose(stream);
+        CFRelease(stream);
+    }
+
+    if (number != NULL) {
+        CFRelease(number);
+    }
+
+    if (sockets[0] >= 0) {
+        close(sockets[0]);
+    }
+
+    if (sockets[1] >= 0) {
+        close(sockets[1]);
+    }
+
+    if (buffer != NULL) {
+        free(buffer);
+    }
+
+    return (status);
+}
+
+int
+main(void)
+{
+    size_t i;
+    int    status = 0;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    for (i = 0; i < sizeof (sBufferTests) / sizeof (sBufferTests[0]); i++) {
+        if (TestBuffer(&sBufferTests[i]) != 0) {
+            status = -1;
+        }
+    }
+
+    return ((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,225 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file implements the loopback servers and pipe helpers
+ *     shared by the CFNetwork example tests.
+ *
+ */
+
+#include "TestSupport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <AssertMacros.h>
+
+Boolean
+WriteAll(int aSocket, const void *aBytes, size_t aLength)
+{
+    const UInt8 *bytes  = (const UInt8 *)aBytes;
+    size_t       offset = 0;
+
+    while (offset < aLength) {
+        ssize_t written = write(aSocket, bytes + offset, aLength - offset);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return (FALSE);
+        }
+
+        offset += (size_t)written;
+    }
+
+    return (TRUE);
+}
+
+static void
+ServerMain(int aListener, int aReport, ServerServeFunction aServe, const void *aContext, unsigned int aOptions)
+{
+    if (aOptions & kServerServeConcurrently) {
+        signal(SIGCHLD, SIG_IGN);
+    }
+
+    while (TRUE) {
+        int connection = accept(aListener, NULL, NULL);
+
+        if (connection < 0) {
+            continue;
+        }
+
+        if (aOptions & kServerServeConcurrently) {
+            if (fork() == 0) {
+                close(aListener);
+
+                aServe(connection, aReport, aContext);
+
+                _exit(EXIT_SUCCESS);
+            }
+
+        } else {
+            aServe(connection, aReport, aContext);
+
+        }
+
+        close(connection);
+
+        if (aOptions & kServerServeOnce) {
+            break;
+        }
+    }
+}
+
+pid_t
+ServerStart(ServerServeFunction aServe, const void *aContext, unsigned int aOptions, unsigned short *aPort, int *aReport)
+{
+    struct sockaddr_in address;
+    socklen_t          addrlen   = sizeof (address);
+    int                report[2] = { -1, -1 };
+    int                listener;
+    int                status;
+    pid_t              pid       = -1;
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    __Require(listener >= 0, done);
+
+    memset(&address, 0, sizeof (address));
+
+    address.sin_family      = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port        = 0;
+
+    status = bind(listener, (struct sockaddr *)&address, sizeof (address));
+    __Require(status == 0, done);
+
+    status = getsockname(listener, (struct sockaddr *)&address, &addrlen);
+    __Require(status == 0, done);
+
+    status = listen(listener, 8);
+    __Require(status == 0, done);
+
+    status = pipe(report);
+    __Require(status == 0, done);
+
+    *aPort = ntohs(address.sin_port);
+
+    pid = fork();
+
+    if (pid == 0) {
+        close(report[0]);
+
+        setpgid(0, 0);
+
+        ServerMain(listener, report[1], aServe, aContext, aOptions);
+
+        _exit(EXIT_SUCCESS);
+    }
+
+    // Make sure the group exists before ServerStop might signal it.
+
+    if (pid > 0) {
+        setpgid(pid, pid);
+    }
+
+    if (aOptions & kServerReportNonBlocking) {
+        fcntl(report[0], F_SETFL, O_NONBLOCK);
+    }
+
+    *aReport  = report[0];
+    report[0] = -1;
+
+ done:
+    if (listener >= 0) {
+        close(listener);
+    }
+
+    if (report[0] >= 0) {
+        close(report[0]);
+    }
+
+    if (report[1] >= 0) {
+        close(report[1]);
+    }
+
+    return (pid);
+}
+
+pid_t
+ServerStartWithSocket(int aSocket, ServerServeFunction aServe, const void *aContext)
+{
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        setpgid(0, 0);
+
+        aServe(aSocket, -1, aContext);
+
+        _exit(EXIT_SUCCESS);
+    }
+
+    if (pid > 0) {
+        setpgid(pid, pid);
+    }
+
+    return (pid);
+}
+
+void
+ServerStop(pid_t aPid)
+{
+    if (aPid > 0) {
+        kill(-aPid, SIGTERM);
+        waitpid(aPid, NULL, 0);
+    }
+}
+
+void
+ReadReports(int aReport, char *aBuffer, size_t aSize)
+{
+    size_t length = 0;
+
+    while (length < aSize - 1) {
+        ssize_t received = read(aReport, aBuffer + length, aSize - 1 - length);
+
+        if (received <= 0) {
+            break;
+        }
+
+        length += (size_t)received;
+    }
+
+    aBuffer[length] = '\0';
+}
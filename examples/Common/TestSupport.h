@@ -0,0 +1,95 @@
+/*
+ *   Copyright (c) 2021 OpenCFNetwork Authors. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/**
+ *   @file
+ *     This file defines the loopback servers and pipe helpers shared
+ *     by the CFNetwork example tests.
+ *
+ *     A server runs in a forked process group of its own and hands
+ *     each connection to the test's serve function, along with the
+ *     write end of a pipe on which it may report what it saw.
+ *
+ */
+
+#ifndef __TESTSUPPORT__
+#define __TESTSUPPORT__
+
+#include <stddef.h>
+
+#include <sys/types.h>
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*ServerServeFunction)(int aSocket, int aReport, const void *aContext);
+
+enum {
+    kServerServeOnce          = 0x1,    // Serve one connection, then exit
+    kServerServeConcurrently  = 0x2,    // Serve each connection from a child of its own
+    kServerReportNonBlocking  = 0x4     // Reading the report pipe does not wait
+};
+
+/**
+ *  Write all of the bytes, retrying short and interrupted writes.
+ *
+ */
+extern Boolean WriteAll(int aSocket, const void *aBytes, size_t aLength);
+
+/**
+ *  Start a server listening on an ephemeral loopback port, returning
+ *  its process and setting the port and the read end of its report
+ *  pipe, or returning -1 if it could not be started.
+ *
+ */
+extern pid_t ServerStart(ServerServeFunction aServe, const void *aContext, unsigned int aOptions, unsigned short *aPort, int *aReport);
+
+/**
+ *  Start a server for one connection already made.  The caller should
+ *  close its own copy of the socket.  No report pipe is given to the
+ *  serve function.
+ *
+ */
+extern pid_t ServerStartWithSocket(int aSocket, ServerServeFunction aServe, const void *aContext);
+
+/**
+ *  Stop the server and every child it has forked.
+ *
+ */
+extern void ServerStop(pid_t aPid);
+
+/**
+ *  Return what the server has reported since last asked, as a
+ *  NUL-terminated string, from a non-blocking report pipe.
+ *
+ */
+extern void ReadReports(int aReport, char *aBuffer, size_t aSize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TESTSUPPORT__ */
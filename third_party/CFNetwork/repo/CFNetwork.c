@@ -34,6 +34,7 @@
 #include <stdlib.h>  // for getenv
 #if defined(__MACH__)
 #include <mach-o/dyld.h>
+#include <mach/mach_time.h>
 #include <SystemConfiguration/SystemConfiguration.h>
 #endif
 
@@ -49,6 +50,7 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <time.h>
 #endif
 
 
@@ -162,6 +164,38 @@ _CFNetworkCFStringCreateWithCFDataAddress(CFAllocatorRef alloc, CFDataRef addr)
 }
 
 
+/* extern */ CFTimeInterval
+_CFNetworkGetMonotonicTime(void) {
+
+#if defined(__MACH__)
+	static mach_timebase_info_data_t timebase = {0, 0};
+
+	if (!timebase.denom)
+		mach_timebase_info(&timebase);
+
+	return ((CFTimeInterval)mach_absolute_time() * timebase.numer) / (timebase.denom * 1.0e9);
+#elif defined(__WIN32__)
+	static LARGE_INTEGER frequency = {{0, 0}};
+	LARGE_INTEGER counter;
+
+	if (!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+
+	QueryPerformanceCounter(&counter);
+
+	return (CFTimeInterval)counter.QuadPart / (CFTimeInterval)frequency.QuadPart;
+#else
+	struct timespec now;
+
+	/* Fall back to wall clock time if there is no monotonic clock. */
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		return CFAbsoluteTimeGetCurrent();
+
+	return (CFTimeInterval)now.tv_sec + ((CFTimeInterval)now.tv_nsec / 1.0e9);
+#endif
+}
+
+
 #if 0
 /*
 	-=-=- RFC-1123 -=-=-
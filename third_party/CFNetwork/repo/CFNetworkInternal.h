@@ -169,6 +169,17 @@ extern void* __CFNetworkLoadFramework(const char* const framework_path);
 extern CFStringRef _CFNetworkCFStringCreateWithCFDataAddress(CFAllocatorRef alloc, CFDataRef addr);
 
 
+/*!
+    @function _CFNetworkGetMonotonicTime
+    @discussion Returns the current value of a monotonic clock for use in
+		measuring intervals.  Unlike CFAbsoluteTimeGetCurrent, the value is
+		not affected by changes to the system clock.
+    @result Returns the number of seconds since an arbitrary, fixed point
+		in the past.  Only differences between values are meaningful.
+*/
+extern CFTimeInterval _CFNetworkGetMonotonicTime(void);
+
+
 /*!
     @function _CFStringGetOrCreateCString
     @discussion Given a CFString, this function attempts to get the bytes of
@@ -203,6 +214,94 @@ extern UInt8* _CFStringGetOrCreateCString(CFAllocatorRef allocator, CFStringRef
 extern SInt32 _DNSServiceErrorToCFNetServiceError(DNSServiceErrorType dnsError);
 
 
+/*!
+    @typedef _CFNetServiceSharedOperationRef
+    @discussion An operation, such as a browse or a record query, made on the
+		process-wide shared DNS-SD connection.
+*/
+typedef struct __CFNetServiceSharedOperation* _CFNetServiceSharedOperationRef;
+
+
+/*!
+    @typedef _CFNetServiceSharedErrorCallBack
+    @discussion Called, on the connection thread, for each operation when the
+		shared connection fails.  The operation's reference is no longer valid.
+*/
+typedef void (*_CFNetServiceSharedErrorCallBack)(DNSServiceRef operation, DNSServiceErrorType error, void* info);
+
+
+/*!
+    @function _CFNetServiceSharedConnectionLock
+    @discussion Locks the process-wide DNS-SD connection, connecting to the daemon
+		and starting the thread which services the connection if need be.  While
+		it is locked, operations may be made on the connection by copying the
+		returned reference and passing kDNSServiceFlagsShareConnection.  Their
+		replies are called on the connection thread.
+    @param error Set to the DNS-SD error if the connection could not be made.
+    @result The connection's primary reference, or NULL if there is no connection
+		in which case it is not locked.
+*/
+extern DNSServiceRef _CFNetServiceSharedConnectionLock(DNSServiceErrorType* error);
+
+
+/*!
+    @function _CFNetServiceSharedConnectionUnlock
+    @discussion Balances a successful _CFNetServiceSharedConnectionLock.
+*/
+extern void _CFNetServiceSharedConnectionUnlock(void);
+
+
+/*!
+    @function _CFNetServiceSharedConnectionAddOperation
+    @discussion Registers an operation just made on the shared connection, which
+		must be locked.  The connection is kept while there are operations.
+    @param operation The operation's DNS-SD reference.
+    @param trigger The trigger, made by _CFNetServiceSharedConnectionCreateTrigger,
+		to be signaled for the operation's replies.  It is retained until the
+		operation is removed.
+    @param callback Called if the connection fails.
+    @param info Passed to the callback.
+    @result The operation, or NULL if it could not be registered.
+*/
+extern _CFNetServiceSharedOperationRef _CFNetServiceSharedConnectionAddOperation(DNSServiceRef operation, CFRunLoopSourceRef trigger,
+																				 _CFNetServiceSharedErrorCallBack callback, void* info);
+
+
+/*!
+    @function _CFNetServiceSharedConnectionRemoveOperation
+    @discussion Ends an operation on the shared connection.  This never waits for
+		the connection, so may be called with other locks held; the operation is
+		deallocated by the connection thread, and replies to it may be called
+		until then.
+    @param operation The operation to remove.
+*/
+extern void _CFNetServiceSharedConnectionRemoveOperation(_CFNetServiceSharedOperationRef operation);
+
+
+/*!
+    @function _CFNetServiceSharedConnectionCreateTrigger
+    @discussion Creates the run loop source with which the connection thread
+		wakes a client for replies, at the end of each burst of them.
+    @param alloc Allocator for the source.
+    @param owner Object whose perform function is called.  It is retained by
+		the source.
+    @param perform Called, on the client's run loops, when replies are waiting.
+    @result The trigger.
+*/
+extern CFRunLoopSourceRef _CFNetServiceSharedConnectionCreateTrigger(CFAllocatorRef alloc, CFTypeRef owner, void (*perform)(void*));
+
+
+/*!
+    @function _CFNetServiceSharedConnectionPost
+    @discussion Called from replies on the shared connection.  Marks the trigger
+		for signaling once kDNSServiceFlagsMoreComing is clear, so that a client
+		is woken once per burst of replies.
+    @param trigger The trigger to signal, or NULL to only note the flags.
+    @param flags The flags given to the reply.
+*/
+extern void _CFNetServiceSharedConnectionPost(CFRunLoopSourceRef trigger, DNSServiceFlags flags);
+
+
 
 #if defined(__cplusplus)
 }
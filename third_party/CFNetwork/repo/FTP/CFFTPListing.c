@@ -0,0 +1,1276 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+/*
+ *  CFFTPListing.c
+ *  CFNetwork
+ *
+ */
+
+
+#pragma mark Description
+/*
+    A _CFFTPListing parses a whole directory listing in one pass, where
+    CFFTPCreateParsedResourceListing parses a line per call and makes a dictionary
+    of CF objects for each.  Listings of hundreds of thousands of entries are common
+    enough on mirrors that the per-entry objects, and the time zone and clock lookups
+    made for every date, dominate.
+
+    Each entry is a fixed-size _CFFTPListingEntry in one array.  Names and link
+    targets are copied into a single byte buffer, to which entries hold offsets.
+    Owner and group names are interned: each distinct name is stored once, found
+    through a small open-addressed hash table, and only made into a CFString when a
+    client asks for it.  Dates are converted against a time zone and clock read once
+    per listing, and the last conversion is remembered, since neighbouring entries
+    usually share a date.  Dictionaries in the form CFFTPCreateParsedResourceListing
+    returns are made only on request.
+
+    Three formats are understood: Unix "ls -l" output, DOS and IIS style output, and
+    the machine-readable MLSD format of RFC 3659.  Unless told, the listing detects
+    the format from the first line which looks like any of them.  Lines in no known
+    format are taken, as CFFTPCreateParsedResourceListing takes them, as bare names.
+
+    Bytes may be appended as they arrive from the data connection; a partial line at
+    the end is held until the rest of it comes.  A listing is not thread safe.
+*/
+
+#pragma mark -
+#pragma mark Includes
+#if HAVE_CONFIG_H
+#include "opencfnetwork-config.h"
+#endif
+
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFFTPStreamPriv.h>
+#include "CFNetworkInternal.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__MACH__)
+#include <sys/dirent.h>
+#include <strings.h>
+#elif !defined(__WIN32__)
+#include <dirent.h>
+#include <strings.h>
+#endif
+
+
+#pragma mark -
+#pragma mark Constants
+
+#if defined(__WIN32__)
+#define DT_UNKNOWN       0
+#define DT_FIFO          1
+#define DT_CHR           2
+#define DT_DIR           4
+#define DT_BLK           6
+#define DT_REG           8
+#define DT_LNK          10
+#define DT_SOCK         12
+#endif
+
+// Fields split out of a Unix listing line; any more are part of the name
+#define kListingMaxFields               16
+
+// Initial sizes of the growing arrays
+#define kListingInitialEntries          64
+#define kListingInitialBytes            1024
+#define kListingInitialUserTable        64
+
+#ifdef __CONSTANT_CFSTRINGS__
+#define _kCFFTPListingDescribeFormat    CFSTR("<_CFFTPListing 0x%x>{format=%d, count=%d}")
+#define _kCFFTPListingEmptyLink         CFSTR("")
+#else
+CONST_STRING_DECL_LOCAL(_kCFFTPListingDescribeFormat, "<_CFFTPListing 0x%x>{format=%d, count=%d}")
+CONST_STRING_DECL_LOCAL(_kCFFTPListingEmptyLink, "")
+#endif	/* __CONSTANT_CFSTRINGS__ */
+
+
+#pragma mark -
+#pragma mark Type Declarations
+
+typedef struct {
+    UInt32                  offset;
+    UInt32                  length;
+    UInt32                  hash;
+    CFStringRef             string;         // Made when first asked for
+} _CFFTPListingUser;
+
+typedef struct {
+    CFRuntimeBase           _base;
+
+    _CFFTPListingFormat     _format;
+    Boolean                 _detect;        // _format is a guess until a line matches
+
+    _CFFTPListingEntry*     _entries;
+    CFIndex                 _count;
+    CFIndex                 _capacity;
+
+    UInt8*                  _bytes;         // Names, links and users
+    CFIndex                 _length;
+    CFIndex                 _size;
+
+    _CFFTPListingUser*      _users;
+    CFIndex                 _userCount;
+    CFIndex                 _userCapacity;
+    SInt32*                 _userTable;     // Open addressed; user index + 1, or 0
+    CFIndex                 _userTableSize;
+
+    UInt8*                  _partial;       // Start of a line still to come
+    CFIndex                 _partialLength;
+    CFIndex                 _partialSize;
+
+    CFTimeZoneRef           _timeZone;
+    CFAbsoluteTime          _now;
+    SInt32                  _year;          // Year of tomorrow, for dates given without one
+
+    CFGregorianDate         _lastDate;      // Last local date converted, and its time
+    CFAbsoluteTime          _lastTime;
+} _CFFTPListing;
+
+
+#pragma mark -
+#pragma mark Static Function Declarations
+
+static void _ListingRegisterClass(void);
+static void _ListingDestroy(_CFFTPListing* listing);
+static CFStringRef _ListingDescribe(_CFFTPListing* listing);
+
+static Boolean _ListingReadModeBits(const UInt8* str, int* mode);
+static Boolean _ListingReadNumber(const UInt8* str, const UInt8* end, UInt64* value);
+static const UInt8* _ListingReadDigits(const UInt8* str, const UInt8* end, CFIndex count, SInt32* value);
+static const UInt8* _ListingReadUnixDate(_CFFTPListing* listing, const UInt8* str, const UInt8* eol, CFAbsoluteTime* time);
+
+static Boolean _ListingGrow(_CFFTPListing* listing, void** buffer, CFIndex* capacity, CFIndex needed, CFIndex itemSize, CFIndex initial);
+static Boolean _ListingAddBytes(_CFFTPListing* listing, const UInt8* bytes, CFIndex length, UInt32* offset);
+static SInt32 _ListingIntern(_CFFTPListing* listing, const UInt8* bytes, CFIndex length);
+static CFAbsoluteTime _ListingLocalTime(_CFFTPListing* listing, SInt32 year, SInt8 month, SInt8 day, SInt8 hour, SInt8 minute);
+
+static _CFFTPListingFormat _ListingDetect(const UInt8* line, const UInt8* eol);
+static Boolean _ListingParseLine(_CFFTPListing* listing, const UInt8* line, const UInt8* eol);
+static Boolean _ListingParseUnix(_CFFTPListing* listing, const UInt8* line, const UInt8* eol, _CFFTPListingEntry* entry);
+static Boolean _ListingParseDOS(_CFFTPListing* listing, const UInt8* line, const UInt8* eol, _CFFTPListingEntry* entry);
+static Boolean _ListingParseMLSD(_CFFTPListing* listing, const UInt8* line, const UInt8* eol, _CFFTPListingEntry* entry);
+static Boolean _ListingSetName(_CFFTPListing* listing, const UInt8* name, const UInt8* eol, _CFFTPListingEntry* entry);
+
+
+#pragma mark -
+#pragma mark Globals
+
+static _CFOnceLock _kCFFTPListingRegisterClass = _CFOnceInitializer;
+static CFTypeID _kCFFTPListingTypeID = _kCFRuntimeNotATypeID;
+
+
+#pragma mark -
+#pragma mark Field Parsing
+
+/* static */ Boolean
+_ListingReadModeBits(const UInt8* str, int* mode) {
+
+    int i;
+
+    *mode = 0;
+
+    for (i = 0; i < 9; i += 3) {
+
+        int shift = 6 - i;
+
+        if (str[i] == 'r') *mode |= (4 << shift);
+        else if (str[i] != '-') return FALSE;
+
+        if (str[i + 1] == 'w') *mode |= (2 << shift);
+        else if (str[i + 1] != '-') return FALSE;
+
+        switch (str[i + 2]) {
+            case 'x': *mode |= (1 << shift); break;
+            case 's': *mode |= (1 << shift);        /* Fall through */
+            case 'S': *mode |= (i ? 02000 : 04000); break;
+            case 't': *mode |= (1 << shift);        /* Fall through */
+            case 'T': if (i == 6) *mode |= 01000; break;
+            case '-': break;
+            default: return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+/* static */ Boolean
+_ListingReadNumber(const UInt8* str, const UInt8* end, UInt64* value) {
+
+    UInt64 result = 0;
+
+    if ((str >= end) || !isdigit(*str))
+        return FALSE;
+
+    for (; (str < end) && isdigit(*str); str++)
+        result = (result * 10) + (*str - '0');
+
+    if (str != end)
+        return FALSE;
+
+    *value = result;
+    return TRUE;
+}
+
+
+/* static */ const UInt8*
+_ListingReadDigits(const UInt8* str, const UInt8* end, CFIndex count, SInt32* value) {
+
+    SInt32 result = 0;
+    CFIndex i;
+
+    for (i = 0; i < count; i++) {
+        if ((str >= end) || !isdigit(*str))
+            return NULL;
+        result = (result * 10) + (*str++ - '0');
+    }
+
+    *value = result;
+    return str;
+}
+
+
+/* static */ const UInt8*
+_ListingReadUnixDate(_CFFTPListing* listing, const UInt8* str, const UInt8* eol, CFAbsoluteTime* time) {
+
+    static const char kMonths[] = "janfebmaraprmayjunjulaugsepoctnovdec";
+
+    SInt32 month, day = 0, hour = 0, minute = 0, year;
+    Boolean hasTime = FALSE;
+    CFIndex digits = 0;
+
+    if ((eol - str) < 8)
+        return NULL;
+
+    for (month = 0; month < 12; month++) {
+        if ((tolower(str[0]) == kMonths[month * 3]) &&
+            (tolower(str[1]) == kMonths[month * 3 + 1]) &&
+            (tolower(str[2]) == kMonths[month * 3 + 2]))
+        {
+            break;
+        }
+    }
+
+    if ((month == 12) || !isspace(str[3]))
+        return NULL;
+
+    for (str += 3; (str < eol) && isspace(*str); str++)
+        /* Do nothing. */ ;
+
+    while ((str < eol) && isdigit(*str) && (digits < 2)) {
+        day = (day * 10) + (*str++ - '0');
+        digits++;
+    }
+
+    if (!digits || (day < 1) || (day > 31) || (str >= eol) || !isspace(*str))
+        return NULL;
+
+    for (; (str < eol) && isspace(*str); str++)
+        /* Do nothing. */ ;
+
+    for (digits = 0; (str < eol) && isdigit(*str); digits++)
+        hour = (hour * 10) + (*str++ - '0');
+
+    if (!digits)
+        return NULL;
+
+    if ((str < eol) && (*str == ':')) {
+        hasTime = TRUE;
+        for (str++; (str < eol) && isdigit(*str); str++)
+            minute = (minute * 10) + (*str - '0');
+    }
+
+    if ((str < eol) && !isspace(*str))
+        return NULL;
+
+    if (!hasTime) {
+        year = (hour < 100) ? (1900 + hour) : hour;
+        *time = _ListingLocalTime(listing, year, month + 1, day, 0, 0);
+    }
+
+    // Without a year, the date is within the last year, allowing a day for clocks being off.
+    else {
+        *time = _ListingLocalTime(listing, listing->_year, month + 1, day, hour, minute);
+        if (*time > (listing->_now + 86400.0))
+            *time = _ListingLocalTime(listing, listing->_year - 1, month + 1, day, hour, minute);
+    }
+
+    return str;
+}
+
+
+#pragma mark -
+#pragma mark Storage
+
+/* static */ Boolean
+_ListingGrow(_CFFTPListing* listing, void** buffer, CFIndex* capacity, CFIndex needed, CFIndex itemSize, CFIndex initial) {
+
+    CFAllocatorRef alloc = CFGetAllocator((CFTypeRef)listing);
+    CFIndex newCapacity = *capacity ? *capacity : initial;
+    void* newBuffer;
+
+    if (needed <= *capacity)
+        return TRUE;
+
+    while (newCapacity < needed)
+        newCapacity *= 2;
+
+    if (*buffer)
+        newBuffer = CFAllocatorReallocate(alloc, *buffer, newCapacity * itemSize, 0);
+    else
+        newBuffer = CFAllocatorAllocate(alloc, newCapacity * itemSize, 0);
+
+    if (!newBuffer)
+        return FALSE;
+
+    *buffer = newBuffer;
+    *capacity = newCapacity;
+
+    return TRUE;
+}
+
+
+/* static */ Boolean
+_ListingAddBytes(_CFFTPListing* listing, const UInt8* bytes, CFIndex length, UInt32* offset) {
+
+    if (!_ListingGrow(listing, (void**)&listing->_bytes, &listing->_size, listing->_length + length, 1, kListingInitialBytes))
+        return FALSE;
+
+    memmove(listing->_bytes + listing->_length, bytes, length);
+    *offset = (UInt32)listing->_length;
+    listing->_length += length;
+
+    return TRUE;
+}
+
+
+/* static */ SInt32
+_ListingIntern(_CFFTPListing* listing, const UInt8* bytes, CFIndex length) {
+
+    UInt32 hash = 2166136261U;
+    CFIndex i, mask;
+    _CFFTPListingUser* user;
+
+    for (i = 0; i < length; i++)
+        hash = (hash ^ bytes[i]) * 16777619U;
+
+    // Keep the table at most half full.
+    if ((listing->_userCount * 2) >= listing->_userTableSize) {
+
+        CFAllocatorRef alloc = CFGetAllocator((CFTypeRef)listing);
+        CFIndex size = listing->_userTableSize ? (listing->_userTableSize * 2) : kListingInitialUserTable;
+        SInt32* table = CFAllocatorAllocate(alloc, size * sizeof(table[0]), 0);
+
+        if (!table)
+            return -1;
+
+        memset(table, 0, size * sizeof(table[0]));
+
+        for (i = 0; i < listing->_userCount; i++) {
+            CFIndex slot = listing->_users[i].hash & (size - 1);
+            while (table[slot])
+                slot = (slot + 1) & (size - 1);
+            table[slot] = (SInt32)(i + 1);
+        }
+
+        if (listing->_userTable)
+            CFAllocatorDeallocate(alloc, listing->_userTable);
+
+        listing->_userTable = table;
+        listing->_userTableSize = size;
+    }
+
+    mask = listing->_userTableSize - 1;
+
+    for (i = hash & mask; listing->_userTable[i]; i = (i + 1) & mask) {
+        user = &listing->_users[listing->_userTable[i] - 1];
+        if ((user->hash == hash) && (user->length == length) && !memcmp(listing->_bytes + user->offset, bytes, length))
+            return listing->_userTable[i] - 1;
+    }
+
+    if (!_ListingGrow(listing, (void**)&listing->_users, &listing->_userCapacity, listing->_userCount + 1, sizeof(listing->_users[0]), kListingInitialUserTable / 2))
+        return -1;
+
+    user = &listing->_users[listing->_userCount];
+    if (!_ListingAddBytes(listing, bytes, length, &user->offset))
+        return -1;
+
+    user->length = (UInt32)length;
+    user->hash = hash;
+    user->string = NULL;
+
+    listing->_userTable[i] = (SInt32)(++listing->_userCount);
+
+    return (SInt32)(listing->_userCount - 1);
+}
+
+
+/* static */ CFAbsoluteTime
+_ListingLocalTime(_CFFTPListing* listing, SInt32 year, SInt8 month, SInt8 day, SInt8 hour, SInt8 minute) {
+
+    CFGregorianDate date;
+
+    date.year = year;
+    date.month = month;
+    date.day = day;
+    date.hour = hour;
+    date.minute = minute;
+    date.second = 0;
+
+    if ((date.year != listing->_lastDate.year) || (date.month != listing->_lastDate.month) ||
+        (date.day != listing->_lastDate.day) || (date.hour != listing->_lastDate.hour) ||
+        (date.minute != listing->_lastDate.minute))
+    {
+        listing->_lastDate = date;
+        listing->_lastTime = CFGregorianDateGetAbsoluteTime(date, listing->_timeZone);
+    }
+
+    return listing->_lastTime;
+}
+
+
+#pragma mark -
+#pragma mark Line Parsing
+
+/* static */ _CFFTPListingFormat
+_ListingDetect(const UInt8* line, const UInt8* eol) {
+
+    const UInt8* iter = line;
+    int mode;
+
+    // MLSD lines start with "fact=value;"
+    if (isalpha(*iter)) {
+        while ((iter < eol) && (isalnum(*iter) || (*iter == '.') || (*iter == '-')))
+            iter++;
+        if ((iter < eol) && (*iter == '=') && memchr(iter, ';', eol - iter))
+            return _kCFFTPListingFormatMLSD;
+    }
+
+    // DOS lines start with "MM-DD-YY"
+    if (((eol - line) >= 8) &&
+        isdigit(line[0]) && isdigit(line[1]) && ((line[2] == '-') || (line[2] == '/')) &&
+        isdigit(line[3]) && isdigit(line[4]) && (line[5] == line[2]) &&
+        isdigit(line[6]) && isdigit(line[7]))
+    {
+        return _kCFFTPListingFormatDOS;
+    }
+
+    if (((eol - line) >= 10) && strchr("-dlbcps", line[0]) && _ListingReadModeBits(line + 1, &mode))
+        return _kCFFTPListingFormatUnix;
+
+    if (((eol - line) >= 6) && !memcmp(line, "total ", 6))
+        return _kCFFTPListingFormatUnix;
+
+    return _kCFFTPListingFormatUnknown;
+}
+
+
+/* static */ Boolean
+_ListingParseLine(_CFFTPListing* listing, const UInt8* line, const UInt8* eol) {
+
+    _CFFTPListingEntry entry;
+    Boolean parsed;
+
+    if ((eol > line) && (eol[-1] == '\r'))
+        eol--;
+
+    if (eol == line)
+        return FALSE;
+
+    if (listing->_detect) {
+        _CFFTPListingFormat format = _ListingDetect(line, eol);
+        if (format != _kCFFTPListingFormatUnknown) {
+            listing->_format = format;
+            listing->_detect = FALSE;
+        }
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    entry.owner = -1;
+    entry.group = -1;
+
+    switch (listing->_format) {
+        case _kCFFTPListingFormatDOS:
+            parsed = _ListingParseDOS(listing, line, eol, &entry);
+            break;
+
+        case _kCFFTPListingFormatMLSD:
+            parsed = _ListingParseMLSD(listing, line, eol, &entry);
+            break;
+
+        default:
+            parsed = _ListingParseUnix(listing, line, eol, &entry);
+            break;
+    }
+
+    if (!parsed)
+        return FALSE;
+
+    if (!_ListingGrow(listing, (void**)&listing->_entries, &listing->_capacity, listing->_count + 1, sizeof(entry), kListingInitialEntries))
+        return FALSE;
+
+    listing->_entries[listing->_count++] = entry;
+
+    return TRUE;
+}
+
+
+/* static */ Boolean
+_ListingSetName(_CFFTPListing* listing, const UInt8* name, const UInt8* eol, _CFFTPListingEntry* entry) {
+
+    const UInt8* link = NULL;
+    const UInt8* end = eol;
+
+    if (name >= eol)
+        return FALSE;
+
+    // Links are listed as "name -> target".
+    if (entry->type == DT_LNK) {
+        const UInt8* iter;
+        for (iter = name; (iter + 4) <= eol; iter++) {
+            if ((iter[0] == ' ') && (iter[1] == '-') && (iter[2] == '>') && (iter[3] == ' ')) {
+                end = iter;
+                link = iter + 4;
+                break;
+            }
+        }
+    }
+
+    // Some servers wrap names in HTML; keep only what is between the tags.
+    if ((*name == '<') && (end[-1] == '>')) {
+        const UInt8* open = memchr(name, '>', end - name);
+        const UInt8* close = end - 1;
+        while ((close > name) && (*close != '<'))
+            close--;
+        if (open && (close > (open + 1))) {
+            name = open + 1;
+            end = close;
+        }
+    }
+
+    if (!_ListingAddBytes(listing, name, end - name, &entry->name))
+        return FALSE;
+    entry->nameLength = (UInt32)(end - name);
+
+    if (link && (link < eol)) {
+        if (!_ListingAddBytes(listing, link, eol - link, &entry->link))
+            return FALSE;
+        entry->linkLength = (UInt32)(eol - link);
+    }
+
+    return TRUE;
+}
+
+
+/* static */ Boolean
+_ListingParseUnix(_CFFTPListing* listing, const UInt8* line, const UInt8* eol, _CFFTPListingEntry* entry) {
+
+    const UInt8* starts[kListingMaxFields];
+    const UInt8* ends[kListingMaxFields];
+    const UInt8* iter = line;
+    const UInt8* name = NULL;
+    Boolean hadModeBits = FALSE;
+    int count = 0, mode = 0, i;
+
+    if (((eol - line) >= 6) && !memcmp(line, "total ", 6))
+        return FALSE;
+
+    while ((count < kListingMaxFields) && (iter < eol)) {
+
+        while ((iter < eol) && isspace(*iter))
+            iter++;
+
+        if (iter >= eol)
+            break;
+
+        starts[count] = iter;
+        while ((iter < eol) && !isspace(*iter))
+            iter++;
+        ends[count++] = iter;
+    }
+
+    if (!count)
+        return FALSE;
+
+    switch (*starts[0]) {
+        case 'b': entry->type = DT_BLK; break;
+        case 'c': entry->type = DT_CHR; break;
+        case 'd': entry->type = DT_DIR; break;
+        case 'l': entry->type = DT_LNK; break;
+        case 's': entry->type = DT_SOCK; break;
+        case 'p': entry->type = DT_FIFO; break;
+        case '-': entry->type = DT_REG; break;
+        default: entry->type = DT_UNKNOWN; break;
+    }
+
+    if ((ends[0] - starts[0]) >= 10)
+        hadModeBits = _ListingReadModeBits(starts[0] + 1, &mode);
+
+    if (hadModeBits) {
+        entry->mode = (UInt16)mode;
+        entry->flags |= _kCFFTPListingEntryHasMode;
+    }
+
+    // The date is the anchor: the size comes before it and the name after.
+    for (i = 3; i < count; i++) {
+
+        const UInt8* end = _ListingReadUnixDate(listing, starts[i], eol, &entry->modDate);
+        const UInt8* owner = NULL;
+        const UInt8* ownerEnd = NULL;
+        const UInt8* group = NULL;
+        const UInt8* groupEnd = NULL;
+        int first = hadModeBits ? 1 : 0;
+        int j = i - 1;
+
+        if (!end)
+            continue;
+
+        entry->flags |= _kCFFTPListingEntryHasModDate;
+
+        while ((end < eol) && isspace(*end))
+            end++;
+        name = end;
+
+        if ((j >= first) && _ListingReadNumber(starts[j], ends[j], &entry->size)) {
+
+            entry->flags |= _kCFFTPListingEntryHasSize;
+
+            // What is left between the mode and the size is "[links] owner [group]".
+            switch (j - first) {
+
+                case 0:
+                    break;
+
+                case 1:
+                    owner = group = starts[first];
+                    ownerEnd = groupEnd = ends[first];
+                    break;
+
+                case 2: {
+                    UInt64 links;
+                    if (hadModeBits && _ListingReadNumber(starts[first], ends[first], &links)) {
+                        owner = group = starts[first + 1];
+                        ownerEnd = groupEnd = ends[first + 1];
+                    }
+                    else {
+                        owner = starts[first];
+                        ownerEnd = ends[first];
+                        group = starts[first + 1];
+                        groupEnd = ends[first + 1];
+                    }
+                    break;
+                }
+
+                default:
+                    owner = starts[j - 2];
+                    ownerEnd = ends[j - 2];
+                    group = starts[j - 1];
+                    groupEnd = ends[j - 1];
+                    break;
+            }
+
+            // A single field may be "owner|group", or with any of these separators.
+            if (owner && (owner == group)) {
+                static const char kSeparators[] = {'|', ':', '/', '\\'};
+                CFIndex k;
+                for (k = 0; k < (CFIndex)sizeof(kSeparators); k++) {
+                    const UInt8* sep = memchr(owner, kSeparators[k], ownerEnd - owner);
+                    if (sep) {
+                        ownerEnd = sep;
+                        group = sep + 1;
+                        break;
+                    }
+                }
+            }
+
+            if (owner)
+                entry->owner = _ListingIntern(listing, owner, ownerEnd - owner);
+            if (group)
+                entry->group = _ListingIntern(listing, group, groupEnd - group);
+        }
+
+        break;
+    }
+
+    if (name)
+        return _ListingSetName(listing, name, eol, entry);
+
+    // No mode bits and no date, so take the whole line as a name, as the line parser does.
+    if (hadModeBits || ((*starts[0] == '<') && (eol[-1] == '>')))
+        return FALSE;
+
+    entry->type = DT_UNKNOWN;
+    entry->flags = 0;
+
+    return _ListingSetName(listing, starts[0], eol, entry);
+}
+
+
+/* static */ Boolean
+_ListingParseDOS(_CFFTPListing* listing, const UInt8* line, const UInt8* eol, _CFFTPListingEntry* entry) {
+
+    // 01-10-20  12:34PM       <DIR>          pub
+    // 01-10-2020  12:34PM           104857 README.txt
+
+    const UInt8* iter = line;
+    SInt32 month, day, year, hour, minute;
+
+    if (!(iter = _ListingReadDigits(iter, eol, 2, &month)) || (iter >= eol) || ((*iter != '-') && (*iter != '/')))
+        return FALSE;
+    if (!(iter = _ListingReadDigits(iter + 1, eol, 2, &day)) || (iter >= eol) || ((*iter != '-') && (*iter != '/')))
+        return FALSE;
+    if (!(iter = _ListingReadDigits(iter + 1, eol, 2, &year)))
+        return FALSE;
+
+    if ((iter < eol) && isdigit(*iter)) {
+        SInt32 low;
+        if (!(iter = _ListingReadDigits(iter, eol, 2, &low)))
+            return FALSE;
+        year = (year * 100) + low;
+    }
+    else
+        year += (year < 70) ? 2000 : 1900;
+
+    // As with a Unix date, a line whose date cannot be one is not an entry.
+    if ((month < 1) || (month > 12) || (day < 1) || (day > 31))
+        return FALSE;
+
+    while ((iter < eol) && isspace(*iter))
+        iter++;
+
+    if (!(iter = _ListingReadDigits(iter, eol, (((iter + 1) < eol) && (iter[1] == ':')) ? 1 : 2, &hour)) ||
+        (iter >= eol) || (*iter != ':') ||
+        !(iter = _ListingReadDigits(iter + 1, eol, 2, &minute)))
+    {
+        return FALSE;
+    }
+
+    if (((iter + 1) < eol) && ((iter[1] == 'M') || (iter[1] == 'm'))) {
+        if ((*iter == 'P') || (*iter == 'p')) {
+            if (hour < 12) hour += 12;
+        }
+        else if ((*iter == 'A') || (*iter == 'a')) {
+            if (hour == 12) hour = 0;
+        }
+        iter += 2;
+    }
+
+    if ((hour > 23) || (minute > 59))
+        return FALSE;
+
+    entry->modDate = _ListingLocalTime(listing, year, month, day, hour, minute);
+    entry->flags |= _kCFFTPListingEntryHasModDate;
+
+    while ((iter < eol) && isspace(*iter))
+        iter++;
+
+    if (((eol - iter) >= 5) && !memcmp(iter, "<DIR>", 5)) {
+        entry->type = DT_DIR;
+        iter += 5;
+    }
+    else {
+        const UInt8* start = iter;
+        UInt64 size = 0;
+
+        // Some servers group the digits of the size.
+        for (; (iter < eol) && (isdigit(*iter) || (*iter == ',')); iter++) {
+            if (*iter != ',')
+                size = (size * 10) + (*iter - '0');
+        }
+
+        if (iter == start)
+            return FALSE;
+
+        entry->type = DT_REG;
+        entry->size = size;
+        entry->flags |= _kCFFTPListingEntryHasSize;
+    }
+
+    if ((iter >= eol) || !isspace(*iter))
+        return FALSE;
+
+    while ((iter < eol) && isspace(*iter))
+        iter++;
+
+    return _ListingSetName(listing, iter, eol, entry);
+}
+
+
+/* static */ Boolean
+_ListingParseMLSD(_CFFTPListing* listing, const UInt8* line, const UInt8* eol, _CFFTPListingEntry* entry) {
+
+    // type=file;size=104857;modify=20200110123400;UNIX.mode=0644; README.txt
+
+    const UInt8* iter = line;
+    const UInt8* owner = NULL;
+    const UInt8* ownerEnd = NULL;
+    const UInt8* group = NULL;
+    const UInt8* groupEnd = NULL;
+    const UInt8* link = NULL;
+    const UInt8* linkEnd = NULL;
+
+    entry->type = DT_UNKNOWN;
+
+    while ((iter < eol) && (*iter != ' ')) {
+
+        const UInt8* fact = iter;
+        const UInt8* equals;
+        const UInt8* value;
+        const UInt8* end;
+        CFIndex length;
+
+        end = memchr(iter, ';', eol - iter);
+        if (!end)
+            return FALSE;
+
+        equals = memchr(fact, '=', end - fact);
+        if (!equals)
+            return FALSE;
+
+        value = equals + 1;
+        length = equals - fact;
+        iter = end + 1;
+
+        if ((length == 4) && !strncasecmp((const char*)fact, "type", 4)) {
+
+            CFIndex valueLength = end - value;
+
+            if ((valueLength == 4) && !strncasecmp((const char*)value, "file", 4))
+                entry->type = DT_REG;
+            else if ((valueLength == 3) && !strncasecmp((const char*)value, "dir", 3))
+                entry->type = DT_DIR;
+
+            // The listed directory and its parent are not entries.
+            else if (((valueLength == 4) && !strncasecmp((const char*)value, "cdir", 4)) ||
+                     ((valueLength == 4) && !strncasecmp((const char*)value, "pdir", 4)))
+            {
+                return FALSE;
+            }
+
+            // OS.unix=slink:target, or OS.unix=symlink:target
+            else if ((valueLength > 8) && !strncasecmp((const char*)value, "OS.unix=", 8)) {
+                const UInt8* kind = value + 8;
+                const UInt8* colon = memchr(kind, ':', end - kind);
+                CFIndex kindLength = (colon ? colon : end) - kind;
+                if (((kindLength == 5) && !strncasecmp((const char*)kind, "slink", 5)) ||
+                    ((kindLength == 7) && !strncasecmp((const char*)kind, "symlink", 7)))
+                {
+                    entry->type = DT_LNK;
+                    if (colon && ((colon + 1) < end)) {
+                        link = colon + 1;
+                        linkEnd = end;
+                    }
+                }
+            }
+        }
+
+        else if (((length == 4) && !strncasecmp((const char*)fact, "size", 4)) ||
+                 ((length == 4) && !strncasecmp((const char*)fact, "sizd", 4)))
+        {
+            if (_ListingReadNumber(value, end, &entry->size))
+                entry->flags |= _kCFFTPListingEntryHasSize;
+        }
+
+        // YYYYMMDDHHMMSS[.sss], always in UTC
+        else if ((length == 6) && !strncasecmp((const char*)fact, "modify", 6)) {
+            SInt32 year, month, day, hour, minute, second;
+            const UInt8* digits = value;
+            if ((digits = _ListingReadDigits(digits, end, 4, &year)) &&
+                (digits = _ListingReadDigits(digits, end, 2, &month)) &&
+                (digits = _ListingReadDigits(digits, end, 2, &day)) &&
+                (digits = _ListingReadDigits(digits, end, 2, &hour)) &&
+                (digits = _ListingReadDigits(digits, end, 2, &minute)) &&
+                (digits = _ListingReadDigits(digits, end, 2, &second)))
+            {
+                CFGregorianDate date;
+                date.year = year;
+                date.month = month;
+                date.day = day;
+                date.hour = hour;
+                date.minute = minute;
+                date.second = second;
+                entry->modDate = CFGregorianDateGetAbsoluteTime(date, NULL);
+                entry->flags |= _kCFFTPListingEntryHasModDate;
+            }
+        }
+
+        else if ((length == 9) && !strncasecmp((const char*)fact, "UNIX.mode", 9)) {
+            int mode = 0;
+            for (; (value < end) && (*value >= '0') && (*value <= '7'); value++)
+                mode = (mode << 3) | (*value - '0');
+            if (value == end) {
+                entry->mode = (UInt16)(mode & 07777);
+                entry->flags |= _kCFFTPListingEntryHasMode;
+            }
+        }
+
+        // Prefer names to numeric ids, whichever order they come in.
+        else if ((length == 10) && !strncasecmp((const char*)fact, "UNIX.owner", 10)) {
+            owner = value;
+            ownerEnd = end;
+        }
+        else if ((length == 8) && !strncasecmp((const char*)fact, "UNIX.uid", 8)) {
+            if (!owner) {
+                owner = value;
+                ownerEnd = end;
+            }
+        }
+        else if ((length == 10) && !strncasecmp((const char*)fact, "UNIX.group", 10)) {
+            group = value;
+            groupEnd = end;
+        }
+        else if ((length == 8) && !strncasecmp((const char*)fact, "UNIX.gid", 8)) {
+            if (!group) {
+                group = value;
+                groupEnd = end;
+            }
+        }
+    }
+
+    // A single space separates the facts from the name.
+    if ((iter >= eol) || (*iter != ' '))
+        return FALSE;
+
+    if (owner && (ownerEnd > owner))
+        entry->owner = _ListingIntern(listing, owner, ownerEnd - owner);
+    if (group && (groupEnd > group))
+        entry->group = _ListingIntern(listing, group, groupEnd - group);
+
+    if (!_ListingSetName(listing, iter + 1, eol, entry))
+        return FALSE;
+
+    if (link) {
+        if (!_ListingAddBytes(listing, link, linkEnd - link, &entry->link))
+            return FALSE;
+        entry->linkLength = (UInt32)(linkEnd - link);
+    }
+
+    return TRUE;
+}
+
+
+#pragma mark -
+#pragma mark CFRuntime
+
+/* static */ void
+_ListingRegisterClass(void) {
+
+    static const CFRuntimeClass _kCFFTPListingClass = {
+        0,                                              // version
+        "_CFFTPListing",                                // class name
+        NULL,                                           // init
+        NULL,                                           // copy
+        (void(*)(CFTypeRef))_ListingDestroy,            // dealloc
+        NULL,                                           // equal
+        NULL,                                           // hash
+        NULL,                                           // copyFormattingDesc
+        (CFStringRef(*)(CFTypeRef cf))_ListingDescribe  // copyDebugDesc
+    };
+
+    _kCFFTPListingTypeID = _CFRuntimeRegisterClass(&_kCFFTPListingClass);
+}
+
+
+/* static */ void
+_ListingDestroy(_CFFTPListing* listing) {
+
+    CFAllocatorRef alloc = CFGetAllocator((CFTypeRef)listing);
+    CFIndex i;
+
+    for (i = 0; i < listing->_userCount; i++) {
+        if (listing->_users[i].string)
+            CFRelease(listing->_users[i].string);
+    }
+
+    if (listing->_entries)
+        CFAllocatorDeallocate(alloc, listing->_entries);
+    if (listing->_bytes)
+        CFAllocatorDeallocate(alloc, listing->_bytes);
+    if (listing->_users)
+        CFAllocatorDeallocate(alloc, listing->_users);
+    if (listing->_userTable)
+        CFAllocatorDeallocate(alloc, listing->_userTable);
+    if (listing->_partial)
+        CFAllocatorDeallocate(alloc, listing->_partial);
+
+    if (listing->_timeZone)
+        CFRelease(listing->_timeZone);
+}
+
+
+/* static */ CFStringRef
+_ListingDescribe(_CFFTPListing* listing) {
+
+    return CFStringCreateWithFormat(CFGetAllocator((CFTypeRef)listing),
+                                    NULL,
+                                    _kCFFTPListingDescribeFormat,
+                                    listing,
+                                    (int)listing->_format,
+                                    (int)listing->_count);
+}
+
+
+#pragma mark -
+#pragma mark Extern Function Definitions (SPI)
+
+/* extern */ CFTypeID
+_CFFTPListingGetTypeID(void) {
+
+    _CFDoOnce(&_kCFFTPListingRegisterClass, _ListingRegisterClass);
+
+    return _kCFFTPListingTypeID;
+}
+
+
+/* extern */ _CFFTPListingRef
+_CFFTPListingCreate(CFAllocatorRef alloc, _CFFTPListingFormat format) {
+
+    _CFFTPListing* result = (_CFFTPListing*)_CFRuntimeCreateInstance(alloc,
+                                                                     _CFFTPListingGetTypeID(),
+                                                                     sizeof(result[0]) - sizeof(CFRuntimeBase),
+                                                                     NULL);
+
+    if (!result)
+        return NULL;
+
+    {
+        // Save a copy of the base so it's easier to zero the struct
+        CFRuntimeBase copy = result->_base;
+
+        memset(result, 0, sizeof(result[0]));
+        memmove(&(result->_base), &copy, sizeof(result->_base));
+    }
+
+    result->_format = format;
+    result->_detect = (format == _kCFFTPListingFormatUnknown);
+
+    result->_timeZone = CFTimeZoneCopyDefault();
+    result->_now = CFAbsoluteTimeGetCurrent();
+    result->_year = CFAbsoluteTimeGetGregorianDate(result->_now + 86400.0, result->_timeZone).year;
+
+    return (_CFFTPListingRef)result;
+}
+
+
+/* extern */ _CFFTPListingRef
+_CFFTPListingCreateWithBytes(CFAllocatorRef alloc, const UInt8* bytes, CFIndex length, _CFFTPListingFormat format) {
+
+    _CFFTPListingRef result = _CFFTPListingCreate(alloc, format);
+
+    if (result)
+        _CFFTPListingAppendBytes(result, bytes, length, TRUE);
+
+    return result;
+}
+
+
+/* extern */ CFIndex
+_CFFTPListingAppendBytes(_CFFTPListingRef listingRef, const UInt8* bytes, CFIndex length, Boolean atEnd) {
+
+    _CFFTPListing* listing = (_CFFTPListing*)listingRef;
+    const UInt8* end = bytes + length;
+    CFIndex count = listing->_count;
+
+    // Finish off the line held from last time.
+    if (listing->_partialLength) {
+
+        const UInt8* eol = length ? memchr(bytes, '\n', length) : NULL;
+        const UInt8* rest = eol ? eol : end;
+
+        if (!_ListingGrow(listing, (void**)&listing->_partial, &listing->_partialSize,
+                          listing->_partialLength + (rest - bytes), 1, kListingInitialBytes))
+        {
+            return 0;
+        }
+
+        memmove(listing->_partial + listing->_partialLength, bytes, rest - bytes);
+        listing->_partialLength += (rest - bytes);
+
+        if (!eol && !atEnd)
+            return 0;
+
+        _ListingParseLine(listing, listing->_partial, listing->_partial + listing->_partialLength);
+        listing->_partialLength = 0;
+
+        bytes = eol ? (eol + 1) : end;
+    }
+
+    while (bytes < end) {
+
+        const UInt8* eol = memchr(bytes, '\n', end - bytes);
+
+        if (!eol) {
+            if (atEnd) {
+                _ListingParseLine(listing, bytes, end);
+            }
+            else if (_ListingGrow(listing, (void**)&listing->_partial, &listing->_partialSize, end - bytes, 1, kListingInitialBytes)) {
+                memmove(listing->_partial, bytes, end - bytes);
+                listing->_partialLength = end - bytes;
+            }
+            break;
+        }
+
+        _ListingParseLine(listing, bytes, eol);
+        bytes = eol + 1;
+    }
+
+    return listing->_count - count;
+}
+
+
+/* extern */ _CFFTPListingFormat
+_CFFTPListingGetFormat(_CFFTPListingRef listing) {
+    return ((_CFFTPListing*)listing)->_detect ? _kCFFTPListingFormatUnknown : ((_CFFTPListing*)listing)->_format;
+}
+
+
+/* extern */ CFIndex
+_CFFTPListingGetCount(_CFFTPListingRef listing) {
+    return ((_CFFTPListing*)listing)->_count;
+}
+
+
+/* extern */ const _CFFTPListingEntry*
+_CFFTPListingGetEntries(_CFFTPListingRef listing) {
+    return ((_CFFTPListing*)listing)->_entries;
+}
+
+
+/* extern */ const UInt8*
+_CFFTPListingGetBytes(_CFFTPListingRef listing) {
+    return ((_CFFTPListing*)listing)->_bytes;
+}
+
+
+/* extern */ CFStringRef
+_CFFTPListingGetUserName(_CFFTPListingRef listingRef, SInt32 index) {
+
+    _CFFTPListing* listing = (_CFFTPListing*)listingRef;
+    _CFFTPListingUser* user;
+
+    if ((index < 0) || (index >= listing->_userCount))
+        return NULL;
+
+    user = &listing->_users[index];
+    if (!user->string) {
+        user->string = CFStringCreateWithBytes(CFGetAllocator((CFTypeRef)listing),
+                                               listing->_bytes + user->offset,
+                                               user->length,
+                                               kCFStringEncodingMacRoman,
+                                               FALSE);
+    }
+
+    return user->string;
+}
+
+
+/* extern */ CFDictionaryRef
+_CFFTPListingCopyResourceInfo(_CFFTPListingRef listingRef, CFIndex index) {
+
+    _CFFTPListing* listing = (_CFFTPListing*)listingRef;
+    CFAllocatorRef alloc = CFGetAllocator((CFTypeRef)listing);
+    const void *keys[8], *values[8];
+    CFDictionaryRef result = NULL;
+    const _CFFTPListingEntry* entry;
+    CFStringEncoding encoding;
+    int type, mode;
+    CFIndex i = 0;
+
+    if ((index < 0) || (index >= listing->_count))
+        return NULL;
+
+    entry = &listing->_entries[index];
+
+    // A line in no known format was taken as a bare name, and gets only that.
+    if (!entry->flags && (entry->type == DT_UNKNOWN) && (entry->owner == -1)) {
+        keys[0] = kCFFTPResourceName;
+        values[0] = CFStringCreateWithBytes(alloc, listing->_bytes + entry->name, entry->nameLength, kCFStringEncodingMacRoman, FALSE);
+        if (!values[0])
+            return NULL;
+        result = CFDictionaryCreate(alloc, keys, values, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        CFRelease(values[0]);
+        return result;
+    }
+
+    // MLSD names are UTF-8 (RFC 3659 section 2.2); LIST output is taken as the line parser takes it.
+    encoding = (listing->_format == _kCFFTPListingFormatMLSD) ? kCFStringEncodingUTF8 : kCFStringEncodingMacRoman;
+
+    if (entry->flags & _kCFFTPListingEntryHasMode) {
+        mode = entry->mode;
+        keys[i] = kCFFTPResourceMode;
+        values[i] = CFNumberCreate(alloc, kCFNumberSInt32Type, &mode);
+        if (values[i]) i++;
+    }
+
+    keys[i] = kCFFTPResourceName;
+    values[i] = CFStringCreateWithBytes(alloc, listing->_bytes + entry->name, entry->nameLength, encoding, FALSE);
+    if (!values[i] && (encoding != kCFStringEncodingMacRoman))
+        values[i] = CFStringCreateWithBytes(alloc, listing->_bytes + entry->name, entry->nameLength, kCFStringEncodingMacRoman, FALSE);
+    if (values[i]) i++;
+
+    keys[i] = kCFFTPResourceLink;
+    if (entry->linkLength)
+        values[i] = CFStringCreateWithBytes(alloc, listing->_bytes + entry->link, entry->linkLength, encoding, FALSE);
+    else
+        values[i] = CFRetain(_kCFFTPListingEmptyLink);
+    if (values[i]) i++;
+
+    if (entry->flags & _kCFFTPListingEntryHasSize) {
+
+        CFStringRef user = _CFFTPListingGetUserName(listingRef, entry->owner);
+        if (user) {
+            keys[i] = kCFFTPResourceOwner;
+            values[i++] = CFRetain(user);
+        }
+
+        user = _CFFTPListingGetUserName(listingRef, entry->group);
+        if (user) {
+            keys[i] = kCFFTPResourceGroup;
+            values[i++] = CFRetain(user);
+        }
+
+        keys[i] = kCFFTPResourceSize;
+        values[i] = CFNumberCreate(alloc, kCFNumberLongLongType, &entry->size);
+        if (values[i]) i++;
+    }
+
+    type = entry->type;
+    keys[i] = kCFFTPResourceType;
+    values[i] = CFNumberCreate(alloc, kCFNumberIntType, &type);
+    if (values[i]) i++;
+
+    if (entry->flags & _kCFFTPListingEntryHasModDate) {
+        keys[i] = kCFFTPResourceModDate;
+        values[i] = CFDateCreate(alloc, entry->modDate);
+        if (values[i]) i++;
+    }
+
+    result = CFDictionaryCreate(alloc, keys, values, i, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+
+    while (i--)
+        CFRelease(values[i]);
+
+    return result;
+}
@@ -0,0 +1,838 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+/*
+ *  CFFTPSegmentedStream.c
+ *  CFNetwork
+ *
+ */
+
+
+#pragma mark Description
+/*
+    A segmented download retrieves one file over several FTP streams at once, each
+    with its own control and data connections and each starting at its own offset
+    with REST, so that a link with a large bandwidth-delay product can be filled
+    where a single TCP connection would not.
+
+    The first segment starts at zero and asks for the size of the file.  Once it is
+    known, whatever of the file the first segment has not yet received is divided
+    among up to the requested number of segments, none shorter than
+    kFTPSegmentMinimumLength, and the others are opened.  A segment stops its stream
+    once it has its range; since that leaves the connection mid-transfer, segments
+    never use the persistent connection cache.  If the size is never learned, the
+    first segment simply reads to the end of the file.
+
+    Data is written with pwrite at its offset, either to the file the client named
+    in _kCFStreamPropertyFTPSegmentDestination or to an unlinked temporary file, from
+    which client reads are answered in order.  The client is told there are bytes
+    available only once the segment holding its read offset has some past it.
+
+    A segment which fails, or ends before its range is complete, is restarted from
+    where it stopped, up to kFTPSegmentMaximumRetries times, before the error is
+    passed to the client.
+
+    A server which refuses REST (500 through 504) can only send the file from the
+    start, so the first time a segment opening at an offset is refused, the others
+    are stopped and the first segment is left to read the whole file.  If it is not
+    still on its original transfer, it is reopened at zero; from then on, retries
+    also start over from zero.
+
+    Everything happens in the callbacks of the client's stream and of the segments'
+    streams, all on the client's run loops, so nothing is locked.
+*/
+
+#pragma mark -
+#pragma mark Includes
+#if HAVE_CONFIG_H
+#include "opencfnetwork-config.h"
+#endif
+
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFFTPStreamPriv.h>
+#include "CFNetworkInternal.h"
+#include "CFNetworkSchedule.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__MACH__) || defined(__linux__)
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#endif
+
+
+#pragma mark -
+#pragma mark Constants
+
+// Never split a file into segments shorter than this
+#define kFTPSegmentMinimumLength        (256 * 1024)
+
+// Number of times a segment is restarted before its error goes to the client
+#define kFTPSegmentMaximumRetries       3
+
+// Most read from a segment's stream per event
+#define kFTPSegmentBufferSize           (32 * 1024)
+
+/* extern */ CONST_STRING_DECL(_kCFStreamPropertyFTPSegmentDestination, "_kCFStreamPropertyFTPSegmentDestination")
+
+
+#pragma mark -
+#pragma mark Type Declarations
+
+typedef struct _CFFTPSegmentedDownload _CFFTPSegmentedDownload;
+
+typedef struct {
+    _CFFTPSegmentedDownload*    download;
+    CFReadStreamRef             stream;
+    long long                   start;
+    long long                   end;            // -1 until the file's size is known
+    long long                   received;
+    CFIndex                     retries;
+    Boolean                     done;
+} _FTPSegment;
+
+struct _CFFTPSegmentedDownload {
+    CFAllocatorRef              alloc;
+    CFReadStreamRef             stream;         // The client's stream; not retained
+    CFURLRef                    url;
+    CFMutableDictionaryRef      properties;     // Set on each segment's stream
+    CFURLRef                    destination;
+    int                         fd;
+    long long                   size;           // -1 until known
+    long long                   offset;         // Next byte the client reads
+    CFIndex                     maximum;
+    CFIndex                     count;          // Segments in use
+    _FTPSegment*                segments;
+    CFMutableArrayRef           schedules;
+    Boolean                     split;          // The file has been divided, or never will be
+    Boolean                     single;         // REST was refused, so one stream reads it all
+};
+
+
+#pragma mark -
+#pragma mark Static Function Declarations
+
+static Boolean _SegmentOpen(_FTPSegment* segment, CFStreamError* error);
+static void _SegmentStop(_FTPSegment* segment);
+static void _SegmentCallBack(CFReadStreamRef stream, CFStreamEventType type, _FTPSegment* segment);
+static Boolean _SegmentWrite(_FTPSegment* segment, CFStreamError* error);
+static void _SegmentFailed(_FTPSegment* segment, const CFStreamError* error);
+
+static void _DownloadSplit(_CFFTPSegmentedDownload* download);
+static void _DownloadFallBack(_CFFTPSegmentedDownload* download);
+static _FTPSegment* _DownloadSegmentAt(_CFFTPSegmentedDownload* download, long long offset);
+static long long _DownloadAvailable(_CFFTPSegmentedDownload* download);
+static Boolean _DownloadIsComplete(_CFFTPSegmentedDownload* download);
+static void _DownloadFail(_CFFTPSegmentedDownload* download, const CFStreamError* error);
+static void _DownloadStop(_CFFTPSegmentedDownload* download);
+static int _DownloadCreateFile(_CFFTPSegmentedDownload* download);
+
+static void _SegmentedStreamFinalize(CFReadStreamRef stream, _CFFTPSegmentedDownload* download);
+static Boolean _SegmentedStreamOpen(CFReadStreamRef stream, CFStreamError* error, Boolean* openComplete, _CFFTPSegmentedDownload* download);
+static CFIndex _SegmentedStreamRead(CFReadStreamRef stream, UInt8* buffer, CFIndex bufferLength, CFStreamError* error, Boolean* atEOF, _CFFTPSegmentedDownload* download);
+static Boolean _SegmentedStreamCanRead(CFReadStreamRef stream, _CFFTPSegmentedDownload* download);
+static void _SegmentedStreamClose(CFReadStreamRef stream, _CFFTPSegmentedDownload* download);
+static CFTypeRef _SegmentedStreamCopyProperty(CFReadStreamRef stream, CFStringRef propertyName, _CFFTPSegmentedDownload* download);
+static Boolean _SegmentedStreamSetProperty(CFReadStreamRef stream, CFStringRef propertyName, CFTypeRef propertyValue, _CFFTPSegmentedDownload* download);
+static void _SegmentedStreamSchedule(CFReadStreamRef stream, CFRunLoopRef runLoop, CFStringRef runLoopMode, _CFFTPSegmentedDownload* download);
+static void _SegmentedStreamUnschedule(CFReadStreamRef stream, CFRunLoopRef runLoop, CFStringRef runLoopMode, _CFFTPSegmentedDownload* download);
+
+
+#pragma mark -
+#pragma mark Segments
+
+static void
+_SetSegmentProperty(const void* key, const void* value, void* context) {
+    CFReadStreamSetProperty((CFReadStreamRef)context, (CFStringRef)key, (CFTypeRef)value);
+}
+
+
+/* static */ Boolean
+_SegmentOpen(_FTPSegment* segment, CFStreamError* error) {
+
+    _CFFTPSegmentedDownload* download = segment->download;
+    CFStreamClientContext context = {0, segment, NULL, NULL, NULL};
+    long long offset = segment->start + segment->received;
+    CFReadStreamRef stream = CFReadStreamCreateWithFTPURL(download->alloc, download->url);
+
+    if (!stream) {
+        error->domain = kCFStreamErrorDomainPOSIX;
+        error->error = ENOMEM;
+        return FALSE;
+    }
+
+    CFDictionaryApplyFunction(download->properties, _SetSegmentProperty, (void*)stream);
+
+    // A segment may be stopped mid-transfer, which leaves its connection of no use to anyone else.
+    CFReadStreamSetProperty(stream, kCFStreamPropertyFTPAttemptPersistentConnection, kCFBooleanFalse);
+
+    if (offset) {
+        CFNumberRef number = CFNumberCreate(download->alloc, kCFNumberLongLongType, &offset);
+        if (number) {
+            CFReadStreamSetProperty(stream, kCFStreamPropertyFTPFileTransferOffset, number);
+            CFRelease(number);
+        }
+    }
+
+    // Only the first segment asks for the size, and only until the file is divided.
+    if (!download->split && (segment == download->segments))
+        CFReadStreamSetProperty(stream, kCFStreamPropertyFTPFetchResourceInfo, kCFBooleanTrue);
+
+    CFReadStreamSetClient(stream,
+                          kCFStreamEventHasBytesAvailable | kCFStreamEventErrorOccurred | kCFStreamEventEndEncountered,
+                          (CFReadStreamClientCallBack)_SegmentCallBack,
+                          &context);
+    _CFTypeScheduleOnMultipleRunLoops(stream, download->schedules);
+
+    segment->stream = stream;
+
+    if (!CFReadStreamOpen(stream)) {
+        *error = CFReadStreamGetError(stream);
+        _SegmentStop(segment);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/* static */ void
+_SegmentStop(_FTPSegment* segment) {
+
+    CFReadStreamRef stream = segment->stream;
+
+    if (stream) {
+        segment->stream = NULL;
+        CFReadStreamSetClient(stream, kCFStreamEventNone, NULL, NULL);
+        _CFTypeUnscheduleFromMultipleRunLoops(stream, segment->download->schedules);
+        CFReadStreamClose(stream);
+        CFRelease(stream);
+    }
+}
+
+
+/* static */ Boolean
+_SegmentWrite(_FTPSegment* segment, CFStreamError* error) {
+
+    _CFFTPSegmentedDownload* download = segment->download;
+    UInt8 buffer[kFTPSegmentBufferSize];
+    CFIndex length = sizeof(buffer);
+    CFIndex i = 0;
+
+    if ((segment->end != -1) && ((segment->end - segment->start - segment->received) < length))
+        length = (CFIndex)(segment->end - segment->start - segment->received);
+
+    length = CFReadStreamRead(segment->stream, buffer, length);
+    if (length < 0) {
+        *error = CFReadStreamGetError(segment->stream);
+        return FALSE;
+    }
+
+    while (i < length) {
+        ssize_t written = pwrite(download->fd, buffer + i, length - i, segment->start + segment->received + i);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            error->domain = kCFStreamErrorDomainPOSIX;
+            error->error = errno;
+            return FALSE;
+        }
+        i += written;
+    }
+
+    segment->received += length;
+
+    return TRUE;
+}
+
+
+/* static */ void
+_SegmentCallBack(CFReadStreamRef stream, CFStreamEventType type, _FTPSegment* segment) {
+
+    _CFFTPSegmentedDownload* download = segment->download;
+    CFStreamError error = {0, 0};
+    Boolean wasAvailable = (_DownloadAvailable(download) > 0);
+
+    if (!download->split && (segment == download->segments)) {
+        _DownloadSplit(download);
+
+        // Opening the other segments may have failed the whole download.
+        if (!download->segments)
+            return;
+    }
+
+    switch (type) {
+
+        case kCFStreamEventHasBytesAvailable:
+            if ((segment->end != -1) && ((segment->start + segment->received) >= segment->end)) {
+                segment->done = TRUE;
+                _SegmentStop(segment);
+                break;
+            }
+
+            if (!_SegmentWrite(segment, &error)) {
+                _SegmentFailed(segment, &error);
+                return;
+            }
+
+            // The server has no size to give, so the first segment will read to the end.
+            if (!download->split)
+                download->split = TRUE;
+
+            if ((segment->end == -1) || ((segment->start + segment->received) < segment->end))
+                break;
+
+            segment->done = TRUE;
+            _SegmentStop(segment);
+            break;
+
+        case kCFStreamEventEndEncountered:
+            if (segment->end == -1) {
+                download->size = segment->received;
+                download->split = TRUE;
+                segment->end = segment->received;
+            }
+
+            if ((segment->start + segment->received) < segment->end) {
+                error.domain = kCFStreamErrorDomainPOSIX;
+                error.error = ECONNRESET;
+                _SegmentFailed(segment, &error);
+                return;
+            }
+
+            segment->done = TRUE;
+            _SegmentStop(segment);
+            break;
+
+        case kCFStreamEventErrorOccurred:
+            error = CFReadStreamGetError(stream);
+            _SegmentFailed(segment, &error);
+            return;
+
+        default:
+            break;
+    }
+
+    if (_DownloadIsComplete(download)) {
+        if (download->destination || (download->offset == download->size))
+            CFReadStreamSignalEvent(download->stream, kCFStreamEventEndEncountered, NULL);
+        else
+            CFReadStreamSignalEvent(download->stream, kCFStreamEventHasBytesAvailable, NULL);
+    }
+
+    else if (!download->destination && !wasAvailable && (_DownloadAvailable(download) > 0))
+        CFReadStreamSignalEvent(download->stream, kCFStreamEventHasBytesAvailable, NULL);
+}
+
+
+/* static */ void
+_SegmentFailed(_FTPSegment* segment, const CFStreamError* error) {
+
+    _CFFTPSegmentedDownload* download = segment->download;
+    CFStreamError reopenError = *error;
+
+    _SegmentStop(segment);
+
+    if (!download->single &&
+        ((segment->start + segment->received) > 0) &&
+        (error->domain == kCFStreamErrorDomainFTP) &&
+        (error->error >= 500) && (error->error <= 504))
+    {
+        _DownloadFallBack(download);
+        return;
+    }
+
+    // Pick up from where the segment stopped, giving it a fresh pair of connections.
+    while (segment->retries < kFTPSegmentMaximumRetries) {
+        segment->retries++;
+        if (download->single)
+            segment->received = 0;
+        if (_SegmentOpen(segment, &reopenError))
+            return;
+    }
+
+    _DownloadFail(download, &reopenError);
+}
+
+
+#pragma mark -
+#pragma mark Download
+
+/* static */ void
+_DownloadSplit(_CFFTPSegmentedDownload* download) {
+
+    _FTPSegment* first = download->segments;
+    CFNumberRef number;
+    long long size, remaining, length;
+    CFIndex i, count;
+
+    if (!first->stream)
+        return;
+
+    number = CFReadStreamCopyProperty(first->stream, kCFStreamPropertyFTPResourceSize);
+    if (!number)
+        return;
+
+    CFNumberGetValue(number, kCFNumberLongLongType, &size);
+    CFRelease(number);
+
+    download->size = size;
+    download->split = TRUE;
+
+    // Divide whatever the first segment does not have yet.
+    remaining = size - first->received;
+    count = (CFIndex)(remaining / kFTPSegmentMinimumLength);
+    if (count > download->maximum)
+        count = download->maximum;
+    if (count < 1)
+        count = 1;
+
+    length = remaining / count;
+    first->end = (count == 1) ? size : (first->received + length);
+
+    for (i = 1; i < count; i++) {
+
+        _FTPSegment* segment = &download->segments[i];
+        CFStreamError error = {0, 0};
+
+        segment->start = download->segments[i - 1].end;
+        segment->end = (i == (count - 1)) ? size : (segment->start + length);
+
+        download->count = i + 1;
+
+        if (!_SegmentOpen(segment, &error)) {
+            _SegmentFailed(segment, &error);
+            if (!download->segments || download->single)
+                return;
+        }
+    }
+}
+
+
+/* static */ void
+_DownloadFallBack(_CFFTPSegmentedDownload* download) {
+
+    _FTPSegment* first = download->segments;
+    CFStreamError error = {0, 0};
+    CFIndex i;
+
+    for (i = 1; i < download->count; i++)
+        _SegmentStop(&download->segments[i]);
+
+    download->count = 1;
+    download->split = TRUE;
+    download->single = TRUE;
+
+    first->end = download->size;
+    first->done = FALSE;
+
+    // Never having used REST, a first segment still on its transfer just carries on.
+    if (first->stream)
+        return;
+
+    first->received = 0;
+
+    if (!_SegmentOpen(first, &error))
+        _DownloadFail(download, &error);
+}
+
+
+/* static */ _FTPSegment*
+_DownloadSegmentAt(_CFFTPSegmentedDownload* download, long long offset) {
+
+    CFIndex i;
+
+    for (i = 0; i < download->count; i++) {
+        _FTPSegment* segment = &download->segments[i];
+        if ((offset >= segment->start) && ((segment->end == -1) || (offset < segment->end)))
+            return segment;
+    }
+
+    return NULL;
+}
+
+
+/* static */ long long
+_DownloadAvailable(_CFFTPSegmentedDownload* download) {
+
+    _FTPSegment* segment = _DownloadSegmentAt(download, download->offset);
+
+    // A segment started over from zero may be behind bytes the client already has.
+    if (!segment || ((segment->start + segment->received) < download->offset))
+        return 0;
+
+    return segment->start + segment->received - download->offset;
+}
+
+
+/* static */ Boolean
+_DownloadIsComplete(_CFFTPSegmentedDownload* download) {
+
+    CFIndex i;
+
+    if (!download->split || !download->segments)
+        return FALSE;
+
+    for (i = 0; i < download->count; i++) {
+        if (!download->segments[i].done)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/* static */ void
+_DownloadFail(_CFFTPSegmentedDownload* download, const CFStreamError* error) {
+
+    _DownloadStop(download);
+    CFReadStreamSignalEvent(download->stream, kCFStreamEventErrorOccurred, (CFStreamError*)error);
+}
+
+
+/* static */ void
+_DownloadStop(_CFFTPSegmentedDownload* download) {
+
+    CFIndex i;
+
+    if (download->segments) {
+        for (i = 0; i < download->count; i++)
+            _SegmentStop(&download->segments[i]);
+        CFAllocatorDeallocate(download->alloc, download->segments);
+        download->segments = NULL;
+    }
+
+    download->count = 0;
+
+    if (download->fd != -1) {
+        close(download->fd);
+        download->fd = -1;
+    }
+}
+
+
+/* static */ int
+_DownloadCreateFile(_CFFTPSegmentedDownload* download) {
+
+    char path[PATH_MAX];
+    const char* dir;
+    int fd;
+
+    if (download->destination) {
+        if (!CFURLGetFileSystemRepresentation(download->destination, TRUE, (UInt8*)path, sizeof(path))) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        return open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    }
+
+    // Reassembly happens in a file nobody else can find, which goes away with the descriptor.
+    dir = getenv("TMPDIR");
+    if (!dir || !*dir)
+        dir = P_tmpdir;
+
+    if (snprintf(path, sizeof(path), "%s/CFFTPSegments.XXXXXX", dir) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    fd = mkstemp(path);
+    if (fd != -1)
+        unlink(path);
+
+    return fd;
+}
+
+
+#pragma mark -
+#pragma mark Stream Callbacks
+
+/* static */ void
+_SegmentedStreamFinalize(CFReadStreamRef stream, _CFFTPSegmentedDownload* download) {
+
+    CFAllocatorRef alloc = download->alloc;
+
+    _DownloadStop(download);
+
+    CFRelease(download->url);
+    CFRelease(download->properties);
+    CFRelease(download->schedules);
+    if (download->destination)
+        CFRelease(download->destination);
+
+    CFAllocatorDeallocate(alloc, download);
+
+    if (alloc)
+        CFRelease(alloc);
+}
+
+
+/* static */ Boolean
+_SegmentedStreamOpen(CFReadStreamRef stream, CFStreamError* error, Boolean* openComplete, _CFFTPSegmentedDownload* download) {
+
+    download->fd = _DownloadCreateFile(download);
+    if (download->fd == -1) {
+        error->domain = kCFStreamErrorDomainPOSIX;
+        error->error = errno;
+        return FALSE;
+    }
+
+    download->segments = CFAllocatorAllocate(download->alloc, download->maximum * sizeof(download->segments[0]), 0);
+    if (!download->segments) {
+        _DownloadStop(download);
+        error->domain = kCFStreamErrorDomainPOSIX;
+        error->error = ENOMEM;
+        return FALSE;
+    }
+
+    memset(download->segments, 0, download->maximum * sizeof(download->segments[0]));
+    download->segments[0].download = download;
+    download->segments[0].end = -1;
+    download->count = 1;
+
+    {
+        CFIndex i;
+        for (i = 1; i < download->maximum; i++)
+            download->segments[i].download = download;
+    }
+
+    if (!_SegmentOpen(download->segments, error)) {
+        _DownloadStop(download);
+        return FALSE;
+    }
+
+    *openComplete = TRUE;
+    return TRUE;
+}
+
+
+/* static */ CFIndex
+_SegmentedStreamRead(CFReadStreamRef stream, UInt8* buffer, CFIndex bufferLength, CFStreamError* error, Boolean* atEOF, _CFFTPSegmentedDownload* download) {
+
+    long long available;
+    ssize_t result;
+
+    *atEOF = FALSE;
+
+    // Everything went to the destination file; there is nothing to read.
+    if (download->destination) {
+        *atEOF = _DownloadIsComplete(download);
+        return 0;
+    }
+
+    if (_DownloadIsComplete(download) && (download->offset == download->size)) {
+        *atEOF = TRUE;
+        return 0;
+    }
+
+    available = _DownloadAvailable(download);
+    if (available < bufferLength)
+        bufferLength = (CFIndex)available;
+
+    if (!bufferLength)
+        return 0;
+
+    do {
+        result = pread(download->fd, buffer, bufferLength, download->offset);
+    } while ((result < 0) && (errno == EINTR));
+
+    if (result < 0) {
+        error->domain = kCFStreamErrorDomainPOSIX;
+        error->error = errno;
+        return -1;
+    }
+
+    download->offset += result;
+
+    // The next segment may have long since finished, in which case nobody else will say so.
+    if (_DownloadIsComplete(download) && (download->offset == download->size))
+        CFReadStreamSignalEvent(stream, kCFStreamEventEndEncountered, NULL);
+    else if (_DownloadAvailable(download) > 0)
+        CFReadStreamSignalEvent(stream, kCFStreamEventHasBytesAvailable, NULL);
+
+    return result;
+}
+
+
+/* static */ Boolean
+_SegmentedStreamCanRead(CFReadStreamRef stream, _CFFTPSegmentedDownload* download) {
+
+    if (download->destination)
+        return _DownloadIsComplete(download);
+
+    return (_DownloadAvailable(download) > 0);
+}
+
+
+/* static */ void
+_SegmentedStreamClose(CFReadStreamRef stream, _CFFTPSegmentedDownload* download) {
+    _DownloadStop(download);
+}
+
+
+/* static */ CFTypeRef
+_SegmentedStreamCopyProperty(CFReadStreamRef stream, CFStringRef propertyName, _CFFTPSegmentedDownload* download) {
+
+    CFTypeRef value = NULL;
+
+    if (CFEqual(propertyName, kCFStreamPropertyFTPResourceSize)) {
+        if (download->size != -1)
+            value = CFNumberCreate(download->alloc, kCFNumberLongLongType, &download->size);
+    }
+
+    else if (CFEqual(propertyName, _kCFStreamPropertyFTPSegmentDestination)) {
+        if (download->destination)
+            value = CFRetain(download->destination);
+    }
+
+    else {
+        value = CFDictionaryGetValue(download->properties, propertyName);
+        if (value)
+            CFRetain(value);
+    }
+
+    return value;
+}
+
+
+/* static */ Boolean
+_SegmentedStreamSetProperty(CFReadStreamRef stream, CFStringRef propertyName, CFTypeRef propertyValue, _CFFTPSegmentedDownload* download) {
+
+    // Segments pick up their ranges themselves.
+    if (CFEqual(propertyName, kCFStreamPropertyFTPFileTransferOffset) ||
+        CFEqual(propertyName, kCFStreamPropertyFTPResourceSize))
+    {
+        return FALSE;
+    }
+
+    if (CFEqual(propertyName, _kCFStreamPropertyFTPSegmentDestination)) {
+
+        if (propertyValue && (CFGetTypeID(propertyValue) != CFURLGetTypeID()))
+            return FALSE;
+
+        if (download->destination)
+            CFRelease(download->destination);
+        download->destination = propertyValue ? CFRetain(propertyValue) : NULL;
+
+        return TRUE;
+    }
+
+    if (propertyValue)
+        CFDictionarySetValue(download->properties, propertyName, propertyValue);
+    else
+        CFDictionaryRemoveValue(download->properties, propertyName);
+
+    return TRUE;
+}
+
+
+/* static */ void
+_SegmentedStreamSchedule(CFReadStreamRef stream, CFRunLoopRef runLoop, CFStringRef runLoopMode, _CFFTPSegmentedDownload* download) {
+
+    CFIndex i;
+
+    if (!_SchedulesAddRunLoopAndMode(download->schedules, runLoop, runLoopMode))
+        return;
+
+    for (i = 0; download->segments && (i < download->count); i++) {
+        if (download->segments[i].stream)
+            CFReadStreamScheduleWithRunLoop(download->segments[i].stream, runLoop, runLoopMode);
+    }
+}
+
+
+/* static */ void
+_SegmentedStreamUnschedule(CFReadStreamRef stream, CFRunLoopRef runLoop, CFStringRef runLoopMode, _CFFTPSegmentedDownload* download) {
+
+    CFIndex i;
+
+    if (!_SchedulesRemoveRunLoopAndMode(download->schedules, runLoop, runLoopMode))
+        return;
+
+    for (i = 0; download->segments && (i < download->count); i++) {
+        if (download->segments[i].stream)
+            CFReadStreamUnscheduleFromRunLoop(download->segments[i].stream, runLoop, runLoopMode);
+    }
+}
+
+
+#pragma mark -
+#pragma mark Extern Function Definitions (SPI)
+
+/* extern */ CFReadStreamRef
+_CFReadStreamCreateWithFTPURLSegments(CFAllocatorRef alloc, CFURLRef ftpURL, CFIndex segmentCount) {
+
+    CFReadStreamCallBacks callBacks;
+    CFReadStreamRef stream = NULL;
+    _CFFTPSegmentedDownload* download;
+
+    if (!ftpURL || (segmentCount < 1))
+        return NULL;
+
+    download = CFAllocatorAllocate(alloc, sizeof(download[0]), 0);
+    if (!download)
+        return NULL;
+
+    memset(download, 0, sizeof(download[0]));
+
+    download->alloc = alloc ? CFRetain(alloc) : NULL;
+    download->url = CFRetain(ftpURL);
+    download->properties = CFDictionaryCreateMutable(alloc, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    download->schedules = CFArrayCreateMutable(alloc, 0, &kCFTypeArrayCallBacks);
+    download->fd = -1;
+    download->size = -1;
+    download->maximum = segmentCount;
+
+    if (download->properties && download->schedules) {
+        memset(&callBacks, 0, sizeof(callBacks));
+
+        callBacks.version = 1;
+        callBacks.finalize = (void (*)(CFReadStreamRef, void*))_SegmentedStreamFinalize;
+        callBacks.open = (Boolean (*)(CFReadStreamRef, CFStreamError*, Boolean*, void*))_SegmentedStreamOpen;
+        callBacks.read = (CFIndex (*)(CFReadStreamRef, UInt8*, CFIndex, CFStreamError*, Boolean*, void*))_SegmentedStreamRead;
+        callBacks.canRead = (Boolean (*)(CFReadStreamRef, void*))_SegmentedStreamCanRead;
+        callBacks.close = (void (*)(CFReadStreamRef, void*))_SegmentedStreamClose;
+        callBacks.copyProperty = (CFTypeRef (*)(CFReadStreamRef, CFStringRef, void*))_SegmentedStreamCopyProperty;
+        callBacks.setProperty = (Boolean (*)(CFReadStreamRef, CFStringRef, CFTypeRef, void*))_SegmentedStreamSetProperty;
+        callBacks.schedule = (void (*)(CFReadStreamRef, CFRunLoopRef, CFStringRef, void*))_SegmentedStreamSchedule;
+        callBacks.unschedule = (void (*)(CFReadStreamRef, CFRunLoopRef, CFStringRef, void*))_SegmentedStreamUnschedule;
+
+        stream = CFReadStreamCreate(alloc, &callBacks, download);
+    }
+
+    if (!stream) {
+        if (download->properties) CFRelease(download->properties);
+        if (download->schedules) CFRelease(download->schedules);
+        CFRelease(download->url);
+        CFAllocatorDeallocate(alloc, download);
+        if (alloc) CFRelease(alloc);
+        return NULL;
+    }
+
+    download->stream = stream;
+
+    return stream;
+}
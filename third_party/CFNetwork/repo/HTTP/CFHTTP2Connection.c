@@ -0,0 +1,3506 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+/*
+ *  CFHTTP2Connection.c
+ *  CFNetwork
+ *
+ */
+
+
+#pragma mark Description
+/*
+    An HTTP/2 connection (RFC 7540) carries many requests at once over one TCP or
+    SSL connection, where a CFNetConnection carries them one after another.  It is
+    a CFHTTPConnectionRef of its own type: CFHTTPConnectionCreate makes one for
+    kHTTP2 and kHTTP2Cleartext, and the other CFHTTPConnection functions hand it
+    over to the functions at the end of this file.  Each request gets a read stream,
+    as it would from any other connection, whose kCFStreamPropertyHTTPResponseHeader
+    is made from the response's header block and whose bytes are the body.
+
+    The connection owns its socket streams directly.  There are no HTTP filters
+    under it, since framing takes the place of their parsing: frames to send are
+    built in one output buffer, which is flushed whenever the socket takes more,
+    and frames received are handled as soon as each one is whole.  Header blocks
+    are compressed with HPACK (RFC 7541); both ends keep a table of recent fields,
+    and string literals are Huffman coded whenever that makes them shorter.
+
+    Flow control is kept at both levels.  Body bytes go out only while the server's
+    windows for the connection and for the stream allow.  Body bytes received are
+    held by their stream until its client reads them, and the stream's window is
+    opened again only as the client does, so a slow reader holds back its own
+    response and no other.  The connection's window is opened as bytes arrive.
+
+    Requests beyond the server's limit on concurrent streams, or beyond the depth
+    set with CFHTTPConnectionSetMaxPipelineDepth, wait in order for earlier ones to
+    finish.  A kHTTP2 connection offers "h2" by ALPN and, when the server picks
+    something else, fails its requests with kCFStreamErrorHTTP2NotNegotiated before
+    any of them is sent.  Server push is turned off.
+
+    Streams from CFReadStreamCreateForHTTPRequest that ask for HTTP/2 share one
+    connection per host and port, found with _CFHTTP2ConnectionCopyShared.  A host
+    which turned out not to speak HTTP/2 is remembered, so that later requests for
+    it go straight to HTTP/1.1.
+*/
+
+#pragma mark -
+#pragma mark Includes
+#if HAVE_CONFIG_H
+#include "opencfnetwork-config.h"
+#endif
+
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFHTTPConnectionPriv.h>
+#include <CFNetwork/CFSocketStreamPriv.h>
+#include "CFNetworkInternal.h"
+#include "CFNetworkSchedule.h"
+#include "CFHTTPInternal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+extern void _CFSocketStreamCreatePair(CFAllocatorRef alloc, CFStringRef host, UInt32 port, CFSocketNativeHandle s,
+                                      const CFSocketSignature* sig, CFReadStreamRef* readStream, CFWriteStreamRef* writeStream);
+
+
+#pragma mark -
+#pragma mark Constants
+
+const SInt32 kCFStreamErrorHTTP2NotNegotiated = -5;
+const SInt32 kCFStreamErrorHTTP2StreamReset = -6;
+
+// Frame types (RFC 7540, section 6)
+#define kHTTP2FrameData					0x0
+#define kHTTP2FrameHeaders				0x1
+#define kHTTP2FramePriority				0x2
+#define kHTTP2FrameRSTStream			0x3
+#define kHTTP2FrameSettings				0x4
+#define kHTTP2FramePushPromise			0x5
+#define kHTTP2FramePing					0x6
+#define kHTTP2FrameGoAway				0x7
+#define kHTTP2FrameWindowUpdate			0x8
+#define kHTTP2FrameContinuation			0x9
+
+// Frame flags
+#define kHTTP2FlagEndStream				0x01
+#define kHTTP2FlagAck					0x01
+#define kHTTP2FlagEndHeaders			0x04
+#define kHTTP2FlagPadded				0x08
+#define kHTTP2FlagPriority				0x20
+
+// Settings (section 6.5.2)
+#define kHTTP2SettingHeaderTableSize	0x1
+#define kHTTP2SettingEnablePush			0x2
+#define kHTTP2SettingMaxConcurrent		0x3
+#define kHTTP2SettingInitialWindow		0x4
+#define kHTTP2SettingMaxFrameSize		0x5
+
+// Error codes (section 7)
+#define kHTTP2NoError					0x0
+#define kHTTP2ProtocolError				0x1
+#define kHTTP2InternalError				0x2
+#define kHTTP2FlowControlError			0x3
+#define kHTTP2FrameSizeError			0x6
+#define kHTTP2RefusedStream				0x7
+#define kHTTP2Cancel					0x8
+#define kHTTP2CompressionError			0x9
+#define kHTTP2EnhanceYourCalm			0xB
+
+#define kHTTP2FrameHeaderSize			9
+#define kHTTP2MaxWindow					0x7FFFFFFF
+#define kHTTP2MaxStreamID				0x7FFFFFFF
+
+// Protocol defaults, until the server's SETTINGS say otherwise
+#define kHTTP2DefaultFrameSize			16384
+#define kHTTP2DefaultWindow				65535
+#define kHTTP2DefaultTableSize			4096
+#define kHTTP2DefaultMaxConcurrent		100
+
+// What this end grants the server.  A stream may have this much body unread...
+#define kHTTP2StreamWindow				(1024 * 1024)
+
+// ...and the connection as a whole this much in flight.
+#define kHTTP2ConnectionWindow			(16 * 1024 * 1024)
+
+// Bytes asked of the socket at a time
+#define kHTTP2ReadSize					16384
+
+// The longest header block taken from the server
+#define kHTTP2MaxHeaderBlock			(256 * 1024)
+
+// Body frames are only built while less than this is waiting to go out
+#define kHTTP2MaxOutputBacklog			(4 * kHTTP2DefaultFrameSize)
+
+// An idle shared connection older than this is replaced rather than reused
+#define kHTTP2SharedIdleTimeout			15.0
+
+#define kHPACKStaticTableCount			61
+#define kHPACKEntryOverhead				32
+
+// Connection flags
+enum {
+    kFlagBitOpened = 0,					// Socket streams created and opened
+    kFlagBitChecked,					// The protocol has been checked and output may flow
+    kFlagBitNoNewStreams,				// Lost, GOAWAY received, failed or out of stream ids
+    kFlagBitInvalid,					// Failed; every stream has been given the error
+    kFlagBitTableSizeUpdate,			// The next header block starts with a table size update
+    kFlagBitBlockEndsStream				// The header block being continued carried END_STREAM
+};
+
+// Stream flags
+enum {
+    kStreamBitOpening = 0,				// Inside the open callback
+    kStreamBitQueued,					// Opened, and so in the connection's list until done
+    kStreamBitStarted,					// HEADERS sent; the stream has an id
+    kStreamBitRequestSent,				// END_STREAM sent
+    kStreamBitHeadersDone,				// The final response header block arrived
+    kStreamBitEnd,						// END_STREAM received
+    kStreamBitDone,						// Closed; no longer in the connection's list
+    kStreamBitClientClosed				// The client closed or released its read stream
+};
+
+#ifdef __CONSTANT_CFSTRINGS__
+#define _kCFStreamSocketCreatedCallBack			CFSTR("_kCFStreamSocketCreatedCallBack")
+#define _kCFHTTP2PrivateRunLoopMode				CFSTR("_kCFHTTP2ConnectionPrivateRunLoopMode")
+#define _kCFHTTP2Protocol						CFSTR("h2")
+#define _kCFHTTP2FallbackProtocol				CFSTR("http/1.1")
+#define _kCFHTTP2Version						CFSTR("HTTP/2.0")
+#define _kCFHTTP2HostKeyFormat					CFSTR("%@:%d")
+#define _kCFHTTP2BracketedHostFormat			CFSTR("[%@]")
+#define _kCFHTTP2BracketedHostPortFormat		CFSTR("[%@]:%d")
+#define _kCFHTTP2JoinedValueFormat				CFSTR("%@, %@")
+#define _kCFHTTP2Colon							CFSTR(":")
+#define _kCFHTTP2HostHeader						CFSTR("Host")
+#define _kCFHTTP2ContentLengthHeader			CFSTR("Content-Length")
+#define _kCFHTTP2ConnectionDescribeFormat		CFSTR("<HTTP/2 connection 0x%x>{host = %@, port = %d, streams = %d}")
+#define _kCFHTTP2StreamDescribeFormat			CFSTR("<HTTP/2 stream 0x%x>{id = %d, request = %@}")
+#else
+CONST_STRING_DECL_LOCAL(_kCFStreamSocketCreatedCallBack, "_kCFStreamSocketCreatedCallBack")
+CONST_STRING_DECL_LOCAL(_kCFHTTP2PrivateRunLoopMode, "_kCFHTTP2ConnectionPrivateRunLoopMode")
+CONST_STRING_DECL_LOCAL(_kCFHTTP2Protocol, "h2")
+CONST_STRING_DECL_LOCAL(_kCFHTTP2FallbackProtocol, "http/1.1")
+CONST_STRING_DECL_LOCAL(_kCFHTTP2Version, "HTTP/2.0")
+CONST_STRING_DECL_LOCAL(_kCFHTTP2HostKeyFormat, "%@:%d")
+CONST_STRING_DECL_LOCAL(_kCFHTTP2BracketedHostFormat, "[%@]")
+CONST_STRING_DECL_LOCAL(_kCFHTTP2BracketedHostPortFormat, "[%@]:%d")
+CONST_STRING_DECL_LOCAL(_kCFHTTP2JoinedValueFormat, "%@, %@")
+CONST_STRING_DECL_LOCAL(_kCFHTTP2Colon, ":")
+CONST_STRING_DECL_LOCAL(_kCFHTTP2HostHeader, "Host")
+CONST_STRING_DECL_LOCAL(_kCFHTTP2ContentLengthHeader, "Content-Length")
+CONST_STRING_DECL_LOCAL(_kCFHTTP2ConnectionDescribeFormat, "<HTTP/2 connection 0x%x>{host = %@, port = %d, streams = %d}")
+CONST_STRING_DECL_LOCAL(_kCFHTTP2StreamDescribeFormat, "<HTTP/2 stream 0x%x>{id = %d, request = %@}")
+#endif	/* __CONSTANT_CFSTRINGS__ */
+
+static const UInt8 _kHTTP2Preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+
+#pragma mark -
+#pragma mark Type Declarations
+
+typedef struct {
+    const char*		name;
+    CFIndex			nameLength;
+    const char*		value;
+    CFIndex			valueLength;
+} _CFHTTP2StaticEntry;
+
+typedef struct {
+    UInt32			code;
+    UInt8			length;
+} _CFHTTP2HuffmanCode;
+
+typedef struct {
+    SInt16			child[2];			// 0 where there is none; the root is never a child
+    SInt16			symbol;				// -1 for inner nodes
+} _CFHTTP2HuffmanNode;
+
+// A growable byte buffer.  Once an allocation fails it takes nothing more, and the
+// connection fails when it next looks.
+typedef struct {
+    UInt8*			bytes;
+    CFIndex			length;
+    CFIndex			offset;				// Bytes before this are consumed
+    CFIndex			capacity;
+    Boolean			failed;
+} _CFHTTP2Buffer;
+
+// An HPACK dynamic table entry; the name and then the value follow it.
+typedef struct {
+    UInt32			nameLength;
+    UInt32			valueLength;
+} _CFHPACKEntry;
+
+// A ring of entries, newest first
+typedef struct {
+    _CFHPACKEntry**	entries;
+    CFIndex			first;
+    CFIndex			count;
+    CFIndex			slots;
+    CFIndex			size;				// Per RFC 7541 section 4.1
+    CFIndex			maxSize;
+} _CFHPACKTable;
+
+typedef struct __CFHTTP2Connection _CFHTTP2Connection;
+
+typedef struct __CFHTTP2Stream {
+    struct __CFHTTP2Stream*	_next;
+    UInt32					_flags;
+    UInt32					_id;
+    _CFHTTP2Connection*		_conn;			// Retained
+    CFReadStreamRef			_client;		// Not retained; it owns this
+    CFMutableArrayRef		_schedules;
+    CFStreamError			_error;
+
+    CFHTTPMessageRef		_request;
+    CFDataRef				_body;			// The request's body, when there is no body stream
+    CFReadStreamRef			_bodyStream;
+    long long				_bytesWritten;	// Of the body
+
+    CFHTTPMessageRef		_response;
+    _CFHTTP2Buffer			_data;			// Body bytes received and not yet read
+    SInt64					_sendWindow;
+    SInt64					_recvWindow;
+    SInt64					_recvConsumed;	// Read by the client but not yet granted back
+} _CFHTTP2Stream;
+
+struct __CFHTTP2Connection {
+    CFRuntimeBase			_base;
+    _CFMutex				_lock;
+    UInt32					_flags;
+    CFStreamError			_error;
+
+    CFStringRef				_host;
+    SInt32					_port;
+    UInt32					_type;
+    CFDictionaryRef			_properties;	// For the socket streams
+    CFStringRef				_sharedKey;		// Key in the shared table, while in it
+
+    CFReadStreamRef			_rStream;
+    CFWriteStreamRef		_wStream;
+    CFMutableArrayRef		_schedules;		// Every run loop and mode of its streams
+
+    _CFHTTP2Stream*			_head;			// Streams not yet done, oldest first
+    _CFHTTP2Stream*			_tail;
+    CFIndex					_active;		// Of those, the ones which have ids
+    CFIndex					_maxActive;		// Set by the client; 0 for no limit
+    UInt32					_nextStreamID;
+    UInt32					_continuationID;// Stream whose header block is being continued
+
+    // The server's settings
+    UInt32					_peerMaxConcurrent;
+    UInt32					_peerInitialWindow;
+    UInt32					_peerMaxFrame;
+
+    SInt64					_sendWindow;
+    SInt64					_recvWindow;
+    SInt64					_recvConsumed;
+
+    _CFHTTP2Buffer			_out;
+    _CFHTTP2Buffer			_in;
+    _CFHTTP2Buffer			_block;			// A header block being received
+    _CFHTTP2Buffer			_scratch;		// Decoded header fields
+
+    _CFHPACKTable			_encoder;
+    _CFHPACKTable			_decoder;
+
+    CFAbsoluteTime			_lastAccess;
+};
+
+// Collects a response's header fields as they are decoded
+typedef struct {
+    CFAllocatorRef			alloc;
+    CFHTTPMessageRef		message;
+    CFIndex					status;
+    Boolean					malformed;
+} _CFHTTP2HeaderContext;
+
+typedef void (*_CFHPACKFieldCallBack)(const UInt8* name, CFIndex nameLength, const UInt8* value, CFIndex valueLength, void* info);
+
+
+#pragma mark -
+#pragma mark Static Function Declarations
+
+static void _HTTP2ConnectionRegisterClass(void);
+static void _HTTP2ConnectionDealloc(CFTypeRef cf);
+static CFStringRef _HTTP2ConnectionDescribe(CFTypeRef cf);
+
+static void _HuffmanBuildTree(void);
+static Boolean _HuffmanDecode(const UInt8* bytes, CFIndex length, _CFHTTP2Buffer* out, CFAllocatorRef alloc);
+static CFIndex _HuffmanEncodedLength(const UInt8* bytes, CFIndex length);
+static void _HuffmanEncode(const UInt8* bytes, CFIndex length, _CFHTTP2Buffer* out, CFAllocatorRef alloc);
+
+static Boolean _BufferReserve(_CFHTTP2Buffer* buffer, CFIndex more, CFAllocatorRef alloc);
+static void _BufferAppend(_CFHTTP2Buffer* buffer, const UInt8* bytes, CFIndex length, CFAllocatorRef alloc);
+static void _BufferConsume(_CFHTTP2Buffer* buffer, CFIndex length);
+static void _BufferFree(_CFHTTP2Buffer* buffer, CFAllocatorRef alloc);
+
+static void _TableEvict(_CFHPACKTable* table, CFIndex maxSize, CFAllocatorRef alloc);
+static Boolean _TableAdd(_CFHPACKTable* table, const UInt8* name, CFIndex nameLength, const UInt8* value, CFIndex valueLength, CFAllocatorRef alloc);
+static _CFHPACKEntry* _TableGet(_CFHPACKTable* table, CFIndex index);
+static void _TableFree(_CFHPACKTable* table, CFAllocatorRef alloc);
+
+static Boolean _HPACKDecodeInteger(const UInt8** p, const UInt8* end, UInt8 prefixBits, UInt32* value);
+static Boolean _HPACKDecodeString(const UInt8** p, const UInt8* end, _CFHTTP2Buffer* out, CFAllocatorRef alloc);
+static Boolean _HPACKDecodeBlock(_CFHTTP2Connection* conn, const UInt8* bytes, CFIndex length, _CFHPACKFieldCallBack callBack, void* info);
+static void _HPACKEncodeInteger(_CFHTTP2Buffer* out, UInt8 first, UInt8 prefixBits, UInt32 value, CFAllocatorRef alloc);
+static void _HPACKEncodeString(_CFHTTP2Buffer* out, const UInt8* bytes, CFIndex length, CFAllocatorRef alloc);
+static void _HPACKEncodeField(_CFHTTP2Connection* conn, _CFHTTP2Buffer* out, const UInt8* name, CFIndex nameLength, const UInt8* value, CFIndex valueLength, Boolean sensitive);
+static void _HPACKEncodeStringField(_CFHTTP2Connection* conn, _CFHTTP2Buffer* out, const char* name, CFStringRef value);
+static void _HPACKSetEncoderTableSize(_CFHTTP2Connection* conn, UInt32 value);
+static void _HPACKCollectField(const UInt8* name, CFIndex nameLength, const UInt8* value, CFIndex valueLength, void* info);
+
+static void _WriteFrameHeader(_CFHTTP2Buffer* out, UInt32 length, UInt8 type, UInt8 flags, UInt32 streamID, CFAllocatorRef alloc);
+static void _WriteRSTStream(_CFHTTP2Connection* conn, UInt32 streamID, UInt32 code);
+static void _WriteWindowUpdate(_CFHTTP2Connection* conn, UInt32 streamID, UInt32 increment);
+static void _WriteSettings(_CFHTTP2Connection* conn);
+
+static void _ResponseHeaderField(const UInt8* name, CFIndex nameLength, const UInt8* value, CFIndex valueLength, void* info);
+
+static Boolean _ConnectionOpen(_CFHTTP2Connection* conn);
+static Boolean _ConnectionCheckProtocol(_CFHTTP2Connection* conn);
+static void _ConnectionFlush(_CFHTTP2Connection* conn);
+static void _ConnectionPump(_CFHTTP2Connection* conn);
+static void _ConnectionRead(_CFHTTP2Connection* conn);
+static void _ConnectionHandleFrames(_CFHTTP2Connection* conn);
+static void _ConnectionFail(_CFHTTP2Connection* conn, UInt32 code, const CFStreamError* error);
+static void _ConnectionStopNewStreams(_CFHTTP2Connection* conn);
+static void _ConnectionUnshare(_CFHTTP2Connection* conn);
+static void _ConnectionReschedule(_CFHTTP2Connection* conn);
+static void _ConnectionClose(_CFHTTP2Connection* conn);
+static _CFHTTP2Stream* _ConnectionFindStream(_CFHTTP2Connection* conn, UInt32 streamID);
+static Boolean _ConnectionIsIdleStream(_CFHTTP2Connection* conn, UInt32 streamID);
+
+static void _HandleData(_CFHTTP2Connection* conn, UInt8 flags, UInt32 streamID, const UInt8* payload, UInt32 length);
+static void _HandleHeaders(_CFHTTP2Connection* conn, UInt8 type, UInt8 flags, UInt32 streamID, const UInt8* payload, UInt32 length);
+static void _HandleHeaderBlock(_CFHTTP2Connection* conn, UInt32 streamID, Boolean endStream);
+static void _HandleRSTStream(_CFHTTP2Connection* conn, UInt32 streamID, const UInt8* payload, UInt32 length);
+static void _HandleSettings(_CFHTTP2Connection* conn, UInt8 flags, UInt32 streamID, const UInt8* payload, UInt32 length);
+static void _HandlePing(_CFHTTP2Connection* conn, UInt8 flags, UInt32 streamID, const UInt8* payload, UInt32 length);
+static void _HandleGoAway(_CFHTTP2Connection* conn, UInt32 streamID, const UInt8* payload, UInt32 length);
+static void _HandleWindowUpdate(_CFHTTP2Connection* conn, UInt32 streamID, const UInt8* payload, UInt32 length);
+
+static void _StreamStart(_CFHTTP2Stream* stream);
+static Boolean _StreamSendData(_CFHTTP2Stream* stream);
+static void _StreamEnded(_CFHTTP2Stream* stream);
+static void _StreamDone(_CFHTTP2Stream* stream);
+static void _StreamFail(_CFHTTP2Stream* stream, const CFStreamError* error);
+static void _StreamReset(_CFHTTP2Stream* stream, UInt32 code, const CFStreamError* error);
+static void _StreamCancel(_CFHTTP2Stream* stream);
+static void _StreamGrantWindow(_CFHTTP2Stream* stream);
+static Boolean _StreamHasEvent(_CFHTTP2Stream* stream);
+
+static void _SocketReadCallBack(CFReadStreamRef stream, CFStreamEventType type, void* info);
+static void _SocketWriteCallBack(CFWriteStreamRef stream, CFStreamEventType type, void* info);
+static void _BodyStreamCallBack(CFReadStreamRef stream, CFStreamEventType type, void* info);
+static void _StreamSocketCreatedCallBack(int fd, void* ctxt);
+
+static void* _HTTP2StreamCreate(CFReadStreamRef stream, void* info);
+static void _HTTP2StreamFinalize(CFReadStreamRef stream, void* info);
+static CFStringRef _HTTP2StreamCopyDescription(CFReadStreamRef stream, void* info);
+static Boolean _HTTP2StreamOpen(CFReadStreamRef stream, CFStreamError* error, Boolean* openComplete, void* info);
+static Boolean _HTTP2StreamOpenCompleted(CFReadStreamRef stream, CFStreamError* error, void* info);
+static CFIndex _HTTP2StreamRead(CFReadStreamRef stream, UInt8* buffer, CFIndex bufferLength, CFStreamError* error, Boolean* atEOF, void* info);
+static Boolean _HTTP2StreamCanRead(CFReadStreamRef stream, void* info);
+static void _HTTP2StreamClose(CFReadStreamRef stream, void* info);
+static CFTypeRef _HTTP2StreamCopyProperty(CFReadStreamRef stream, CFStringRef propertyName, void* info);
+static Boolean _HTTP2StreamSetProperty(CFReadStreamRef stream, CFStringRef propertyName, CFTypeRef propertyValue, void* info);
+static void _HTTP2StreamSchedule(CFReadStreamRef stream, CFRunLoopRef runLoop, CFStringRef runLoopMode, void* info);
+static void _HTTP2StreamUnschedule(CFReadStreamRef stream, CFRunLoopRef runLoop, CFStringRef runLoopMode, void* info);
+
+
+#pragma mark -
+#pragma mark Globals
+
+// RFC 7541, Appendix A
+static const _CFHTTP2StaticEntry _kHPACKStaticTable[kHPACKStaticTableCount] = {
+    {":authority", 10, "", 0},
+    {":method", 7, "GET", 3},
+    {":method", 7, "POST", 4},
+    {":path", 5, "/", 1},
+    {":path", 5, "/index.html", 11},
+    {":scheme", 7, "http", 4},
+    {":scheme", 7, "https", 5},
+    {":status", 7, "200", 3},
+    {":status", 7, "204", 3},
+    {":status", 7, "206", 3},
+    {":status", 7, "304", 3},
+    {":status", 7, "400", 3},
+    {":status", 7, "404", 3},
+    {":status", 7, "500", 3},
+    {"accept-charset", 14, "", 0},
+    {"accept-encoding", 15, "gzip, deflate", 13},
+    {"accept-language", 15, "", 0},
+    {"accept-ranges", 13, "", 0},
+    {"accept", 6, "", 0},
+    {"access-control-allow-origin", 27, "", 0},
+    {"age", 3, "", 0},
+    {"allow", 5, "", 0},
+    {"authorization", 13, "", 0},
+    {"cache-control", 13, "", 0},
+    {"content-disposition", 19, "", 0},
+    {"content-encoding", 16, "", 0},
+    {"content-language", 16, "", 0},
+    {"content-length", 14, "", 0},
+    {"content-location", 16, "", 0},
+    {"content-range", 13, "", 0},
+    {"content-type", 12, "", 0},
+    {"cookie", 6, "", 0},
+    {"date", 4, "", 0},
+    {"etag", 4, "", 0},
+    {"expect", 6, "", 0},
+    {"expires", 7, "", 0},
+    {"from", 4, "", 0},
+    {"host", 4, "", 0},
+    {"if-match", 8, "", 0},
+    {"if-modified-since", 17, "", 0},
+    {"if-none-match", 13, "", 0},
+    {"if-range", 8, "", 0},
+    {"if-unmodified-since", 19, "", 0},
+    {"last-modified", 13, "", 0},
+    {"link", 4, "", 0},
+    {"location", 8, "", 0},
+    {"max-forwards", 12, "", 0},
+    {"proxy-authenticate", 18, "", 0},
+    {"proxy-authorization", 19, "", 0},
+    {"range", 5, "", 0},
+    {"referer", 7, "", 0},
+    {"refresh", 7, "", 0},
+    {"retry-after", 11, "", 0},
+    {"server", 6, "", 0},
+    {"set-cookie", 10, "", 0},
+    {"strict-transport-security", 25, "", 0},
+    {"transfer-encoding", 17, "", 0},
+    {"user-agent", 10, "", 0},
+    {"vary", 4, "", 0},
+    {"via", 3, "", 0},
+    {"www-authenticate", 16, "", 0}
+};
+
+// RFC 7541, Appendix B; the last entry is EOS
+static const _CFHTTP2HuffmanCode _kHPACKHuffmanCodes[257] = {
+    {0x00001ff8, 13}, {0x007fffd8, 23}, {0x0fffffe2, 28}, {0x0fffffe3, 28},
+    {0x0fffffe4, 28}, {0x0fffffe5, 28}, {0x0fffffe6, 28}, {0x0fffffe7, 28},
+    {0x0fffffe8, 28}, {0x00ffffea, 24}, {0x3ffffffc, 30}, {0x0fffffe9, 28},
+    {0x0fffffea, 28}, {0x3ffffffd, 30}, {0x0fffffeb, 28}, {0x0fffffec, 28},
+    {0x0fffffed, 28}, {0x0fffffee, 28}, {0x0fffffef, 28}, {0x0ffffff0, 28},
+    {0x0ffffff1, 28}, {0x0ffffff2, 28}, {0x3ffffffe, 30}, {0x0ffffff3, 28},
+    {0x0ffffff4, 28}, {0x0ffffff5, 28}, {0x0ffffff6, 28}, {0x0ffffff7, 28},
+    {0x0ffffff8, 28}, {0x0ffffff9, 28}, {0x0ffffffa, 28}, {0x0ffffffb, 28},
+    {0x00000014,  6}, {0x000003f8, 10}, {0x000003f9, 10}, {0x00000ffa, 12},
+    {0x00001ff9, 13}, {0x00000015,  6}, {0x000000f8,  8}, {0x000007fa, 11},
+    {0x000003fa, 10}, {0x000003fb, 10}, {0x000000f9,  8}, {0x000007fb, 11},
+    {0x000000fa,  8}, {0x00000016,  6}, {0x00000017,  6}, {0x00000018,  6},
+    {0x00000000,  5}, {0x00000001,  5}, {0x00000002,  5}, {0x00000019,  6},
+    {0x0000001a,  6}, {0x0000001b,  6}, {0x0000001c,  6}, {0x0000001d,  6},
+    {0x0000001e,  6}, {0x0000001f,  6}, {0x0000005c,  7}, {0x000000fb,  8},
+    {0x00007ffc, 15}, {0x00000020,  6}, {0x00000ffb, 12}, {0x000003fc, 10},
+    {0x00001ffa, 13}, {0x00000021,  6}, {0x0000005d,  7}, {0x0000005e,  7},
+    {0x0000005f,  7}, {0x00000060,  7}, {0x00000061,  7}, {0x00000062,  7},
+    {0x00000063,  7}, {0x00000064,  7}, {0x00000065,  7}, {0x00000066,  7},
+    {0x00000067,  7}, {0x00000068,  7}, {0x00000069,  7}, {0x0000006a,  7},
+    {0x0000006b,  7}, {0x0000006c,  7}, {0x0000006d,  7}, {0x0000006e,  7},
+    {0x0000006f,  7}, {0x00000070,  7}, {0x00000071,  7}, {0x00000072,  7},
+    {0x000000fc,  8}, {0x00000073,  7}, {0x000000fd,  8}, {0x00001ffb, 13},
+    {0x0007fff0, 19}, {0x00001ffc, 13}, {0x00003ffc, 14}, {0x00000022,  6},
+    {0x00007ffd, 15}, {0x00000003,  5}, {0x00000023,  6}, {0x00000004,  5},
+    {0x00000024,  6}, {0x00000005,  5}, {0x00000025,  6}, {0x00000026,  6},
+    {0x00000027,  6}, {0x00000006,  5}, {0x00000074,  7}, {0x00000075,  7},
+    {0x00000028,  6}, {0x00000029,  6}, {0x0000002a,  6}, {0x00000007,  5},
+    {0x0000002b,  6}, {0x00000076,  7}, {0x0000002c,  6}, {0x00000008,  5},
+    {0x00000009,  5}, {0x0000002d,  6}, {0x00000077,  7}, {0x00000078,  7},
+    {0x00000079,  7}, {0x0000007a,  7}, {0x0000007b,  7}, {0x00007ffe, 15},
+    {0x000007fc, 11}, {0x00003ffd, 14}, {0x00001ffd, 13}, {0x0ffffffc, 28},
+    {0x000fffe6, 20}, {0x003fffd2, 22}, {0x000fffe7, 20}, {0x000fffe8, 20},
+    {0x003fffd3, 22}, {0x003fffd4, 22}, {0x003fffd5, 22}, {0x007fffd9, 23},
+    {0x003fffd6, 22}, {0x007fffda, 23}, {0x007fffdb, 23}, {0x007fffdc, 23},
+    {0x007fffdd, 23}, {0x007fffde, 23}, {0x00ffffeb, 24}, {0x007fffdf, 23},
+    {0x00ffffec, 24}, {0x00ffffed, 24}, {0x003fffd7, 22}, {0x007fffe0, 23},
+    {0x00ffffee, 24}, {0x007fffe1, 23}, {0x007fffe2, 23}, {0x007fffe3, 23},
+    {0x007fffe4, 23}, {0x001fffdc, 21}, {0x003fffd8, 22}, {0x007fffe5, 23},
+    {0x003fffd9, 22}, {0x007fffe6, 23}, {0x007fffe7, 23}, {0x00ffffef, 24},
+    {0x003fffda, 22}, {0x001fffdd, 21}, {0x000fffe9, 20}, {0x003fffdb, 22},
+    {0x003fffdc, 22}, {0x007fffe8, 23}, {0x007fffe9, 23}, {0x001fffde, 21},
+    {0x007fffea, 23}, {0x003fffdd, 22}, {0x003fffde, 22}, {0x00fffff0, 24},
+    {0x001fffdf, 21}, {0x003fffdf, 22}, {0x007fffeb, 23}, {0x007fffec, 23},
+    {0x001fffe0, 21}, {0x001fffe1, 21}, {0x003fffe0, 22}, {0x001fffe2, 21},
+    {0x007fffed, 23}, {0x003fffe1, 22}, {0x007fffee, 23}, {0x007fffef, 23},
+    {0x000fffea, 20}, {0x003fffe2, 22}, {0x003fffe3, 22}, {0x003fffe4, 22},
+    {0x007ffff0, 23}, {0x003fffe5, 22}, {0x003fffe6, 22}, {0x007ffff1, 23},
+    {0x03ffffe0, 26}, {0x03ffffe1, 26}, {0x000fffeb, 20}, {0x0007fff1, 19},
+    {0x003fffe7, 22}, {0x007ffff2, 23}, {0x003fffe8, 22}, {0x01ffffec, 25},
+    {0x03ffffe2, 26}, {0x03ffffe3, 26}, {0x03ffffe4, 26}, {0x07ffffde, 27},
+    {0x07ffffdf, 27}, {0x03ffffe5, 26}, {0x00fffff1, 24}, {0x01ffffed, 25},
+    {0x0007fff2, 19}, {0x001fffe3, 21}, {0x03ffffe6, 26}, {0x07ffffe0, 27},
+    {0x07ffffe1, 27}, {0x03ffffe7, 26}, {0x07ffffe2, 27}, {0x00fffff2, 24},
+    {0x001fffe4, 21}, {0x001fffe5, 21}, {0x03ffffe8, 26}, {0x03ffffe9, 26},
+    {0x0ffffffd, 28}, {0x07ffffe3, 27}, {0x07ffffe4, 27}, {0x07ffffe5, 27},
+    {0x000fffec, 20}, {0x00fffff3, 24}, {0x000fffed, 20}, {0x001fffe6, 21},
+    {0x003fffe9, 22}, {0x001fffe7, 21}, {0x001fffe8, 21}, {0x007ffff3, 23},
+    {0x003fffea, 22}, {0x003fffeb, 22}, {0x01ffffee, 25}, {0x01ffffef, 25},
+    {0x00fffff4, 24}, {0x00fffff5, 24}, {0x03ffffea, 26}, {0x007ffff4, 23},
+    {0x03ffffeb, 26}, {0x07ffffe6, 27}, {0x03ffffec, 26}, {0x03ffffed, 26},
+    {0x07ffffe7, 27}, {0x07ffffe8, 27}, {0x07ffffe9, 27}, {0x07ffffea, 27},
+    {0x07ffffeb, 27}, {0x0ffffffe, 28}, {0x07ffffec, 27}, {0x07ffffed, 27},
+    {0x07ffffee, 27}, {0x07ffffef, 27}, {0x07fffff0, 27}, {0x03ffffee, 26},
+    {0x3fffffff, 30}
+};
+
+static _CFHTTP2HuffmanNode _kHuffmanTree[2 * 257 - 1];
+static _CFOnceLock _kHuffmanTreeOnce = _CFOnceInitializer;
+
+static CFTypeID _kCFHTTP2ConnectionTypeID = _kCFRuntimeNotATypeID;
+static _CFOnceLock _kCFHTTP2ConnectionRegisterClass = _CFOnceInitializer;
+
+static const CFRuntimeClass _kCFHTTP2ConnectionClass = {
+    0,										// version
+    "CFHTTP2Connection",					// class name
+    NULL,									// init
+    NULL,									// copy
+    _HTTP2ConnectionDealloc,				// dealloc
+    NULL,									// equal
+    NULL,									// hash
+    NULL,									// copyFormattingDesc
+    _HTTP2ConnectionDescribe				// copyDebugDesc
+};
+
+static const CFReadStreamCallBacks _kCFHTTP2StreamCallBacks = {
+    1,
+    _HTTP2StreamCreate,
+    _HTTP2StreamFinalize,
+    _HTTP2StreamCopyDescription,
+    _HTTP2StreamOpen,
+    _HTTP2StreamOpenCompleted,
+    _HTTP2StreamRead,
+    NULL,
+    _HTTP2StreamCanRead,
+    _HTTP2StreamClose,
+    _HTTP2StreamCopyProperty,
+    _HTTP2StreamSetProperty,
+    NULL,
+    _HTTP2StreamSchedule,
+    _HTTP2StreamUnschedule
+};
+
+// Connections shared by CFHTTPStream, keyed by "host:port", and the keys of
+// servers which did not choose HTTP/2.
+static CFSpinLock_t _kCFHTTP2SharedLock = CFSpinLockInit;
+static CFMutableDictionaryRef _kCFHTTP2SharedConnections = NULL;
+static CFMutableSetRef _kCFHTTP2Refusals = NULL;
+
+
+#pragma mark -
+#pragma mark Static Function Definitions
+
+/* static */ void
+_HTTP2ConnectionRegisterClass(void) {
+
+    _kCFHTTP2ConnectionTypeID = _CFRuntimeRegisterClass(&_kCFHTTP2ConnectionClass);
+}
+
+
+/* static */ void
+_HTTP2ConnectionDealloc(CFTypeRef cf) {
+
+    _CFHTTP2Connection* conn = (_CFHTTP2Connection*)cf;
+    CFAllocatorRef alloc = CFGetAllocator(cf);
+
+    // Every stream retains the connection, so there are none left.
+    _ConnectionClose(conn);
+
+    if (conn->_host) CFRelease(conn->_host);
+    if (conn->_properties) CFRelease(conn->_properties);
+    if (conn->_sharedKey) CFRelease(conn->_sharedKey);
+    if (conn->_schedules) CFRelease(conn->_schedules);
+
+    _BufferFree(&conn->_out, alloc);
+    _BufferFree(&conn->_in, alloc);
+    _BufferFree(&conn->_block, alloc);
+    _BufferFree(&conn->_scratch, alloc);
+    _TableFree(&conn->_encoder, alloc);
+    _TableFree(&conn->_decoder, alloc);
+
+    _CFMutexDestroy(&conn->_lock);
+}
+
+
+/* static */ CFStringRef
+_HTTP2ConnectionDescribe(CFTypeRef cf) {
+
+    _CFHTTP2Connection* conn = (_CFHTTP2Connection*)cf;
+    CFIndex count = 0;
+    _CFHTTP2Stream* stream;
+
+    for (stream = conn->_head; stream; stream = stream->_next)
+        count++;
+
+    return CFStringCreateWithFormat(CFGetAllocator(cf), NULL, _kCFHTTP2ConnectionDescribeFormat,
+                                    conn, conn->_host, (int)conn->_port, (int)count);
+}
+
+
+#pragma mark -
+#pragma mark Huffman Coding
+
+/* static */ void
+_HuffmanBuildTree(void) {
+
+    CFIndex symbol, nodes = 1;
+
+    memset(_kHuffmanTree, 0, sizeof(_kHuffmanTree));
+    _kHuffmanTree[0].symbol = -1;
+
+    for (symbol = 0; symbol < 257; symbol++) {
+
+        UInt32 code = _kHPACKHuffmanCodes[symbol].code;
+        SInt32 bit = _kHPACKHuffmanCodes[symbol].length - 1;
+        CFIndex node = 0;
+
+        for (; bit >= 0; bit--) {
+
+            int branch = (code >> bit) & 1;
+
+            if (!_kHuffmanTree[node].child[branch]) {
+                _kHuffmanTree[nodes].symbol = -1;
+                _kHuffmanTree[node].child[branch] = nodes++;
+            }
+            node = _kHuffmanTree[node].child[branch];
+        }
+
+        _kHuffmanTree[node].symbol = symbol;
+    }
+}
+
+
+/* static */ Boolean
+_HuffmanDecode(const UInt8* bytes, CFIndex length, _CFHTTP2Buffer* out, CFAllocatorRef alloc) {
+
+    CFIndex i, node = 0, padding = 0;
+    Boolean ones = TRUE;
+
+    _CFDoOnce(&_kHuffmanTreeOnce, _HuffmanBuildTree);
+
+    // The shortest code is five bits, so this is the most it can decode to.
+    if (!_BufferReserve(out, (length * 8) / 5 + 1, alloc))
+        return FALSE;
+
+    for (i = 0; i < length; i++) {
+
+        int bit;
+
+        for (bit = 7; bit >= 0; bit--) {
+
+            int branch = (bytes[i] >> bit) & 1;
+
+            node = _kHuffmanTree[node].child[branch];
+            if (!node)
+                return FALSE;
+
+            if (_kHuffmanTree[node].symbol < 0) {
+                padding++;
+                ones = ones && branch;
+                continue;
+            }
+
+            // EOS is never sent as a symbol (section 5.2).
+            if (_kHuffmanTree[node].symbol == 256)
+                return FALSE;
+
+            out->bytes[out->length++] = (UInt8)_kHuffmanTree[node].symbol;
+            node = 0;
+            padding = 0;
+            ones = TRUE;
+        }
+    }
+
+    // Padding is at most seven bits of the EOS code, which is all ones.
+    return (node == 0) || (padding < 8 && ones);
+}
+
+
+/* static */ CFIndex
+_HuffmanEncodedLength(const UInt8* bytes, CFIndex length) {
+
+    CFIndex i, bits = 0;
+
+    for (i = 0; i < length; i++)
+        bits += _kHPACKHuffmanCodes[bytes[i]].length;
+
+    return (bits + 7) / 8;
+}
+
+
+/* static */ void
+_HuffmanEncode(const UInt8* bytes, CFIndex length, _CFHTTP2Buffer* out, CFAllocatorRef alloc) {
+
+    CFIndex i;
+    UInt64 bits = 0;
+    int count = 0;
+
+    if (!_BufferReserve(out, _HuffmanEncodedLength(bytes, length), alloc))
+        return;
+
+    for (i = 0; i < length; i++) {
+
+        const _CFHTTP2HuffmanCode* code = &_kHPACKHuffmanCodes[bytes[i]];
+
+        bits = (bits << code->length) | code->code;
+        count += code->length;
+
+        while (count >= 8) {
+            count -= 8;
+            out->bytes[out->length++] = (UInt8)(bits >> count);
+        }
+    }
+
+    // Pad the last byte with the start of EOS.
+    if (count)
+        out->bytes[out->length++] = (UInt8)((bits << (8 - count)) | (0xFF >> count));
+}
+
+
+#pragma mark -
+#pragma mark Buffers
+
+/* static */ Boolean
+_BufferReserve(_CFHTTP2Buffer* buffer, CFIndex more, CFAllocatorRef alloc) {
+
+    CFIndex needed;
+
+    if (buffer->failed)
+        return FALSE;
+
+    needed = buffer->length + more;
+    if (needed <= buffer->capacity)
+        return TRUE;
+
+    // Slide unconsumed bytes down before growing.
+    if (buffer->offset) {
+        memmove(buffer->bytes, buffer->bytes + buffer->offset, buffer->length - buffer->offset);
+        buffer->length -= buffer->offset;
+        buffer->offset = 0;
+        needed = buffer->length + more;
+        if (needed <= buffer->capacity)
+            return TRUE;
+    }
+
+    {
+        CFIndex capacity = buffer->capacity ? buffer->capacity : 1024;
+        UInt8* bytes;
+
+        while (capacity < needed)
+            capacity *= 2;
+
+        bytes = buffer->bytes ? CFAllocatorReallocate(alloc, buffer->bytes, capacity, 0) : CFAllocatorAllocate(alloc, capacity, 0);
+        if (!bytes) {
+            buffer->failed = TRUE;
+            return FALSE;
+        }
+
+        buffer->bytes = bytes;
+        buffer->capacity = capacity;
+    }
+
+    return TRUE;
+}
+
+
+/* static */ void
+_BufferAppend(_CFHTTP2Buffer* buffer, const UInt8* bytes, CFIndex length, CFAllocatorRef alloc) {
+
+    if (_BufferReserve(buffer, length, alloc)) {
+        memmove(buffer->bytes + buffer->length, bytes, length);
+        buffer->length += length;
+    }
+}
+
+
+/* static */ void
+_BufferConsume(_CFHTTP2Buffer* buffer, CFIndex length) {
+
+    buffer->offset += length;
+    if (buffer->offset == buffer->length)
+        buffer->offset = buffer->length = 0;
+}
+
+
+/* static */ void
+_BufferFree(_CFHTTP2Buffer* buffer, CFAllocatorRef alloc) {
+
+    if (buffer->bytes)
+        CFAllocatorDeallocate(alloc, buffer->bytes);
+    memset(buffer, 0, sizeof(buffer[0]));
+}
+
+
+#pragma mark -
+#pragma mark HPACK
+
+/* static */ void
+_TableEvict(_CFHPACKTable* table, CFIndex maxSize, CFAllocatorRef alloc) {
+
+    while (table->count && (table->size > maxSize)) {
+
+        CFIndex last = (table->first + table->count - 1) % table->slots;
+        _CFHPACKEntry* entry = table->entries[last];
+
+        table->size -= kHPACKEntryOverhead + entry->nameLength + entry->valueLength;
+        table->entries[last] = NULL;
+        table->count--;
+        CFAllocatorDeallocate(alloc, entry);
+    }
+}
+
+
+/* static */ Boolean
+_TableAdd(_CFHPACKTable* table, const UInt8* name, CFIndex nameLength, const UInt8* value, CFIndex valueLength, CFAllocatorRef alloc) {
+
+    CFIndex size = kHPACKEntryOverhead + nameLength + valueLength;
+    _CFHPACKEntry* entry;
+
+    // Too big for the table empties it and is not added (section 4.4).
+    _TableEvict(table, table->maxSize - size, alloc);
+    if (size > table->maxSize)
+        return TRUE;
+
+    if (table->count == table->slots) {
+
+        CFIndex i, slots = table->slots ? table->slots * 2 : 16;
+        _CFHPACKEntry** entries = CFAllocatorAllocate(alloc, slots * sizeof(entries[0]), 0);
+
+        if (!entries)
+            return FALSE;
+
+        for (i = 0; i < table->count; i++)
+            entries[i] = table->entries[(table->first + i) % table->slots];
+
+        if (table->entries)
+            CFAllocatorDeallocate(alloc, table->entries);
+
+        table->entries = entries;
+        table->first = 0;
+        table->slots = slots;
+    }
+
+    entry = CFAllocatorAllocate(alloc, sizeof(entry[0]) + nameLength + valueLength, 0);
+    if (!entry)
+        return FALSE;
+
+    entry->nameLength = nameLength;
+    entry->valueLength = valueLength;
+    memmove(entry + 1, name, nameLength);
+    memmove(((UInt8*)(entry + 1)) + nameLength, value, valueLength);
+
+    table->first = (table->first + table->slots - 1) % table->slots;
+    table->entries[table->first] = entry;
+    table->count++;
+    table->size += size;
+
+    return TRUE;
+}
+
+
+/* static */ _CFHPACKEntry*
+_TableGet(_CFHPACKTable* table, CFIndex index) {
+
+    if (index < 0 || index >= table->count)
+        return NULL;
+
+    return table->entries[(table->first + index) % table->slots];
+}
+
+
+/* static */ void
+_TableFree(_CFHPACKTable* table, CFAllocatorRef alloc) {
+
+    _TableEvict(table, -1, alloc);
+
+    if (table->entries)
+        CFAllocatorDeallocate(alloc, table->entries);
+
+    table->entries = NULL;
+    table->first = table->slots = 0;
+}
+
+
+/* static */ Boolean
+_HPACKDecodeInteger(const UInt8** p, const UInt8* end, UInt8 prefixBits, UInt32* value) {
+
+    UInt32 mask = (1 << prefixBits) - 1;
+    int shift = 0;
+
+    if (*p >= end)
+        return FALSE;
+
+    *value = *(*p)++ & mask;
+    if (*value < mask)
+        return TRUE;
+
+    while (*p < end) {
+
+        UInt8 b = *(*p)++;
+
+        // Nothing needs more than 28 bits beyond the prefix.
+        if (shift > 21)
+            return FALSE;
+
+        *value += (UInt32)(b & 0x7F) << shift;
+        shift += 7;
+
+        if (!(b & 0x80))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+
+/* static */ Boolean
+_HPACKDecodeString(const UInt8** p, const UInt8* end, _CFHTTP2Buffer* out, CFAllocatorRef alloc) {
+
+    Boolean huffman;
+    UInt32 length;
+
+    if (*p >= end)
+        return FALSE;
+
+    huffman = (**p & 0x80) != 0;
+    if (!_HPACKDecodeInteger(p, end, 7, &length) || (length > (UInt32)(end - *p)))
+        return FALSE;
+
+    if (huffman) {
+        if (!_HuffmanDecode(*p, length, out, alloc))
+            return FALSE;
+    }
+    else {
+        _BufferAppend(out, *p, length, alloc);
+        if (out->failed)
+            return FALSE;
+    }
+
+    *p += length;
+
+    return TRUE;
+}
+
+
+/* static */ Boolean
+_HPACKDecodeBlock(_CFHTTP2Connection* conn, const UInt8* bytes, CFIndex length, _CFHPACKFieldCallBack callBack, void* info) {
+
+    CFAllocatorRef alloc = CFGetAllocator(conn);
+    const UInt8* p = bytes;
+    const UInt8* end = bytes + length;
+    Boolean fieldsStarted = FALSE;
+
+    while (p < end) {
+
+        UInt8 b = *p;
+        UInt32 index;
+        Boolean indexing = FALSE;
+        CFIndex nameLength, valueLength;
+        _CFHTTP2Buffer* scratch = &conn->_scratch;
+
+        scratch->length = scratch->offset = 0;
+
+        // Dynamic table size update, only before the first field (section 4.2)
+        if ((b & 0xE0) == 0x20) {
+
+            if (fieldsStarted || !_HPACKDecodeInteger(&p, end, 5, &index) || (index > kHTTP2DefaultTableSize))
+                return FALSE;
+
+            conn->_decoder.maxSize = index;
+            _TableEvict(&conn->_decoder, index, alloc);
+            continue;
+        }
+
+        fieldsStarted = TRUE;
+
+        // Indexed field
+        if (b & 0x80) {
+
+            if (!_HPACKDecodeInteger(&p, end, 7, &index) || !index)
+                return FALSE;
+
+            if (index <= kHPACKStaticTableCount) {
+                const _CFHTTP2StaticEntry* entry = &_kHPACKStaticTable[index - 1];
+                callBack((const UInt8*)entry->name, entry->nameLength, (const UInt8*)entry->value, entry->valueLength, info);
+            }
+            else {
+                _CFHPACKEntry* entry = _TableGet(&conn->_decoder, index - kHPACKStaticTableCount - 1);
+                if (!entry)
+                    return FALSE;
+                callBack((const UInt8*)(entry + 1), entry->nameLength, ((const UInt8*)(entry + 1)) + entry->nameLength, entry->valueLength, info);
+            }
+
+            continue;
+        }
+
+        // Literal with incremental indexing, or without indexing, or never indexed
+        if (b & 0x40) {
+            indexing = TRUE;
+            if (!_HPACKDecodeInteger(&p, end, 6, &index))
+                return FALSE;
+        }
+        else if (!_HPACKDecodeInteger(&p, end, 4, &index))
+            return FALSE;
+
+        if (!index) {
+            if (!_HPACKDecodeString(&p, end, scratch, alloc))
+                return FALSE;
+        }
+        else if (index <= kHPACKStaticTableCount) {
+            const _CFHTTP2StaticEntry* entry = &_kHPACKStaticTable[index - 1];
+            _BufferAppend(scratch, (const UInt8*)entry->name, entry->nameLength, alloc);
+        }
+        else {
+            _CFHPACKEntry* entry = _TableGet(&conn->_decoder, index - kHPACKStaticTableCount - 1);
+            if (!entry)
+                return FALSE;
+            _BufferAppend(scratch, (const UInt8*)(entry + 1), entry->nameLength, alloc);
+        }
+
+        nameLength = scratch->length;
+        if (scratch->failed || !_HPACKDecodeString(&p, end, scratch, alloc))
+            return FALSE;
+        valueLength = scratch->length - nameLength;
+
+        callBack(scratch->bytes, nameLength, scratch->bytes + nameLength, valueLength, info);
+
+        if (indexing && !_TableAdd(&conn->_decoder, scratch->bytes, nameLength, scratch->bytes + nameLength, valueLength, alloc))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/* static */ void
+_HPACKEncodeInteger(_CFHTTP2Buffer* out, UInt8 first, UInt8 prefixBits, UInt32 value, CFAllocatorRef alloc) {
+
+    UInt32 mask = (1 << prefixBits) - 1;
+    UInt8 bytes[6];
+    CFIndex count = 0;
+
+    if (value < mask)
+        bytes[count++] = first | value;
+
+    else {
+        bytes[count++] = first | mask;
+        value -= mask;
+        while (value >= 0x80) {
+            bytes[count++] = (value & 0x7F) | 0x80;
+            value >>= 7;
+        }
+        bytes[count++] = value;
+    }
+
+    _BufferAppend(out, bytes, count, alloc);
+}
+
+
+/* static */ void
+_HPACKEncodeString(_CFHTTP2Buffer* out, const UInt8* bytes, CFIndex length, CFAllocatorRef alloc) {
+
+    CFIndex huffman = _HuffmanEncodedLength(bytes, length);
+
+    if (huffman < length) {
+        _HPACKEncodeInteger(out, 0x80, 7, huffman, alloc);
+        _HuffmanEncode(bytes, length, out, alloc);
+    }
+    else {
+        _HPACKEncodeInteger(out, 0x00, 7, length, alloc);
+        _BufferAppend(out, bytes, length, alloc);
+    }
+}
+
+
+/* static */ void
+_HPACKEncodeField(_CFHTTP2Connection* conn, _CFHTTP2Buffer* out, const UInt8* name, CFIndex nameLength, const UInt8* value, CFIndex valueLength, Boolean sensitive) {
+
+    CFAllocatorRef alloc = CFGetAllocator(conn);
+    CFIndex i, nameIndex = 0;
+
+    // Look for the whole field, or failing that its name, in both tables.
+    for (i = 0; i < kHPACKStaticTableCount; i++) {
+
+        const _CFHTTP2StaticEntry* entry = &_kHPACKStaticTable[i];
+
+        if ((entry->nameLength != nameLength) || memcmp(entry->name, name, nameLength))
+            continue;
+
+        if (!sensitive && (entry->valueLength == valueLength) && !memcmp(entry->value, value, valueLength)) {
+            _HPACKEncodeInteger(out, 0x80, 7, i + 1, alloc);
+            return;
+        }
+
+        if (!nameIndex)
+            nameIndex = i + 1;
+    }
+
+    for (i = 0; i < conn->_encoder.count; i++) {
+
+        _CFHPACKEntry* entry = _TableGet(&conn->_encoder, i);
+        const UInt8* entryName = (const UInt8*)(entry + 1);
+
+        if ((entry->nameLength != nameLength) || memcmp(entryName, name, nameLength))
+            continue;
+
+        if (!sensitive && (entry->valueLength == valueLength) && !memcmp(entryName + nameLength, value, valueLength)) {
+            _HPACKEncodeInteger(out, 0x80, 7, kHPACKStaticTableCount + i + 1, alloc);
+            return;
+        }
+
+        if (!nameIndex)
+            nameIndex = kHPACKStaticTableCount + i + 1;
+    }
+
+    // Credentials are never indexed, by either end or any intermediary.
+    if (sensitive)
+        _HPACKEncodeInteger(out, 0x10, 4, nameIndex, alloc);
+
+    else if ((kHPACKEntryOverhead + nameLength + valueLength) <= conn->_encoder.maxSize) {
+        _HPACKEncodeInteger(out, 0x40, 6, nameIndex, alloc);
+        if (!_TableAdd(&conn->_encoder, name, nameLength, value, valueLength, alloc))
+            out->failed = TRUE;
+    }
+
+    else
+        _HPACKEncodeInteger(out, 0x00, 4, nameIndex, alloc);
+
+    if (!nameIndex)
+        _HPACKEncodeString(out, name, nameLength, alloc);
+    _HPACKEncodeString(out, value, valueLength, alloc);
+}
+
+
+/* static */ void
+_HPACKEncodeStringField(_CFHTTP2Connection* conn, _CFHTTP2Buffer* out, const char* name, CFStringRef value) {
+
+    CFAllocatorRef alloc = CFGetAllocator(conn);
+    UInt8 buffer[256];
+    CFIndex length = sizeof(buffer);
+    UInt8* bytes = _CFStringGetOrCreateCString(alloc, value, buffer, &length, kCFStringEncodingUTF8);
+
+    if (!bytes) {
+        out->failed = TRUE;
+        return;
+    }
+
+    _HPACKEncodeField(conn, out, (const UInt8*)name, strlen(name), bytes, length, FALSE);
+
+    if (bytes != buffer)
+        CFAllocatorDeallocate(alloc, bytes);
+}
+
+
+/* static */ void
+_HPACKSetEncoderTableSize(_CFHTTP2Connection* conn, UInt32 value) {
+
+    // The encoder uses no more than the default, however much the server allows.
+    CFIndex maxSize = (value < kHTTP2DefaultTableSize) ? value : kHTTP2DefaultTableSize;
+
+    if (maxSize != conn->_encoder.maxSize) {
+        conn->_encoder.maxSize = maxSize;
+        _TableEvict(&conn->_encoder, maxSize, CFGetAllocator(conn));
+        __CFBitSet(conn->_flags, kFlagBitTableSizeUpdate);
+    }
+}
+
+
+/* static */ void
+_HPACKCollectField(const UInt8* name, CFIndex nameLength, const UInt8* value, CFIndex valueLength, void* info) {
+
+    CFMutableArrayRef fields = (CFMutableArrayRef)info;
+    CFAllocatorRef alloc = CFGetAllocator(fields);
+    CFStringRef strings[2];
+    CFIndex i;
+
+    strings[0] = CFStringCreateWithBytes(alloc, name, nameLength, kCFStringEncodingISOLatin1, FALSE);
+    strings[1] = CFStringCreateWithBytes(alloc, value, valueLength, kCFStringEncodingISOLatin1, FALSE);
+
+    for (i = 0; i < 2; i++) {
+        if (strings[i]) {
+            CFArrayAppendValue(fields, strings[i]);
+            CFRelease(strings[i]);
+        }
+    }
+}
+
+
+#pragma mark -
+#pragma mark Frames
+
+/* static */ void
+_WriteFrameHeader(_CFHTTP2Buffer* out, UInt32 length, UInt8 type, UInt8 flags, UInt32 streamID, CFAllocatorRef alloc) {
+
+    UInt8 header[kHTTP2FrameHeaderSize];
+
+    header[0] = (length >> 16) & 0xFF;
+    header[1] = (length >> 8) & 0xFF;
+    header[2] = length & 0xFF;
+    header[3] = type;
+    header[4] = flags;
+    header[5] = (streamID >> 24) & 0x7F;
+    header[6] = (streamID >> 16) & 0xFF;
+    header[7] = (streamID >> 8) & 0xFF;
+    header[8] = streamID & 0xFF;
+
+    _BufferAppend(out, header, sizeof(header), alloc);
+}
+
+
+/* static */ void
+_WriteRSTStream(_CFHTTP2Connection* conn, UInt32 streamID, UInt32 code) {
+
+    CFAllocatorRef alloc = CFGetAllocator(conn);
+    UInt8 payload[4] = {(code >> 24) & 0xFF, (code >> 16) & 0xFF, (code >> 8) & 0xFF, code & 0xFF};
+
+    _WriteFrameHeader(&conn->_out, sizeof(payload), kHTTP2FrameRSTStream, 0, streamID, alloc);
+    _BufferAppend(&conn->_out, payload, sizeof(payload), alloc);
+}
+
+
+/* static */ void
+_WriteWindowUpdate(_CFHTTP2Connection* conn, UInt32 streamID, UInt32 increment) {
+
+    CFAllocatorRef alloc = CFGetAllocator(conn);
+    UInt8 payload[4] = {(increment >> 24) & 0x7F, (increment >> 16) & 0xFF, (increment >> 8) & 0xFF, increment & 0xFF};
+
+    _WriteFrameHeader(&conn->_out, sizeof(payload), kHTTP2FrameWindowUpdate, 0, streamID, alloc);
+    _BufferAppend(&conn->_out, payload, sizeof(payload), alloc);
+}
+
+
+/* static */ void
+_WriteSettings(_CFHTTP2Connection* conn) {
+
+    CFAllocatorRef alloc = CFGetAllocator(conn);
+    UInt8 payload[12] = {
+        0, kHTTP2SettingEnablePush, 0, 0, 0, 0,
+        0, kHTTP2SettingInitialWindow,
+        (kHTTP2StreamWindow >> 24) & 0xFF, (kHTTP2StreamWindow >> 16) & 0xFF,
+        (kHTTP2StreamWindow >> 8) & 0xFF, kHTTP2StreamWindow & 0xFF
+    };
+
+    _BufferAppend(&conn->_out, _kHTTP2Preface, sizeof(_kHTTP2Preface) - 1, alloc);
+    _WriteFrameHeader(&conn->_out, sizeof(payload), kHTTP2FrameSettings, 0, 0, alloc);
+    _BufferAppend(&conn->_out, payload, sizeof(payload), alloc);
+
+    // The connection's window can only be changed by WINDOW_UPDATE.
+    _WriteWindowUpdate(conn, 0, kHTTP2ConnectionWindow - kHTTP2DefaultWindow);
+    conn->_recvWindow = kHTTP2ConnectionWindow;
+}
+
+
+/* static */ void
+_ResponseHeaderField(const UInt8* name, CFIndex nameLength, const UInt8* value, CFIndex valueLength, void* info) {
+
+    _CFHTTP2HeaderContext* ctxt = (_CFHTTP2HeaderContext*)info;
+    CFStringRef header, capitalized, string;
+
+    if (ctxt->malformed)
+        return;
+
+    // Pseudo-header fields come before all others, and :status is the only one
+    // a response has (section 8.1.2.4).
+    if (nameLength && (name[0] == ':')) {
+
+        CFIndex i;
+
+        if (ctxt->message || (nameLength != 7) || memcmp(name, ":status", 7) || (valueLength != 3)) {
+            ctxt->malformed = TRUE;
+            return;
+        }
+
+        ctxt->status = 0;
+        for (i = 0; i < 3; i++) {
+            if (value[i] < '0' || value[i] > '9') {
+                ctxt->malformed = TRUE;
+                return;
+            }
+            ctxt->status = (ctxt->status * 10) + (value[i] - '0');
+        }
+
+        ctxt->message = CFHTTPMessageCreateResponse(ctxt->alloc, ctxt->status, NULL, _kCFHTTP2Version);
+        if (!ctxt->message)
+            ctxt->malformed = TRUE;
+
+        return;
+    }
+
+    if (!ctxt->message) {
+        ctxt->malformed = TRUE;
+        return;
+    }
+
+    header = CFStringCreateWithBytes(ctxt->alloc, name, nameLength, kCFStringEncodingISOLatin1, FALSE);
+    string = CFStringCreateWithBytes(ctxt->alloc, value, valueLength, kCFStringEncodingISOLatin1, FALSE);
+
+    if (header && string) {
+
+        // Names arrive in lower case; give them the case HTTP/1.1 clients expect.
+        CFStringRef existing;
+
+        capitalized = _CFCapitalizeHeader(header);
+        existing = CFHTTPMessageCopyHeaderFieldValue(ctxt->message, capitalized);
+
+        if (existing) {
+            CFStringRef joined = CFStringCreateWithFormat(ctxt->alloc, NULL, _kCFHTTP2JoinedValueFormat, existing, string);
+            if (joined) {
+                _CFHTTPMessageSetHeader(ctxt->message, capitalized, joined, -1);
+                CFRelease(joined);
+            }
+            CFRelease(existing);
+        }
+        else
+            _CFHTTPMessageSetHeader(ctxt->message, capitalized, string, -1);
+
+        CFRelease(capitalized);
+    }
+    else
+        ctxt->malformed = TRUE;
+
+    if (header) CFRelease(header);
+    if (string) CFRelease(string);
+}
+
+
+#pragma mark -
+#pragma mark Connection
+
+/* static */ void
+_StreamSocketCreatedCallBack(int fd, void* ctxt) {
+
+    int yes = 1;
+
+    (void)ctxt;		/* unused */
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&yes, sizeof(yes));
+}
+
+
+/* static */ Boolean
+_ConnectionOpen(_CFHTTP2Connection* conn) {
+
+    CFAllocatorRef alloc = CFGetAllocator(conn);
+    CFStreamClientContext ctxt = {0, conn, NULL, NULL, NULL};
+    CFArrayCallBacks cb = {0, NULL, NULL, NULL, NULL};
+    const void* values[2] = {_StreamSocketCreatedCallBack, NULL};
+    CFArrayRef callback;
+    CFIndex i, count;
+
+    __CFBitSet(conn->_flags, kFlagBitOpened);
+
+    _CFSocketStreamCreatePair(alloc, conn->_host, conn->_port, 0, NULL, &conn->_rStream, &conn->_wStream);
+    if (!conn->_rStream) {
+        conn->_error.domain = kCFStreamErrorDomainPOSIX;
+        conn->_error.error = ENOMEM;
+        return FALSE;
+    }
+
+    callback = CFArrayCreate(alloc, values, sizeof(values) / sizeof(values[0]), &cb);
+    if (callback) {
+        CFWriteStreamSetProperty(conn->_wStream, _kCFStreamSocketCreatedCallBack, callback);
+        CFRelease(callback);
+    }
+
+    if (conn->_properties && (count = CFDictionaryGetCount(conn->_properties)) > 0) {
+
+        CFStringRef* keys = CFAllocatorAllocate(alloc, sizeof(CFStringRef) * count * 2, 0);
+        CFTypeRef* props = (CFTypeRef*)(keys + count);
+
+        CFDictionaryGetKeysAndValues(conn->_properties, (const void**)keys, (const void**)props);
+        for (i = 0; i < count; i++) {
+            if (CFEqual(keys[i], kCFStreamPropertySSLSettings))
+                continue;
+            CFReadStreamSetProperty(conn->_rStream, keys[i], props[i]);
+            CFWriteStreamSetProperty(conn->_wStream, keys[i], props[i]);
+        }
+        CFAllocatorDeallocate(alloc, keys);
+    }
+
+    // Offer h2 on top of any SSL settings the creator gave.  http/1.1 is offered
+    // too, so that a server without h2 finishes the handshake and says so.
+    if (conn->_type == kHTTP2) {
+
+        CFDictionaryRef given = conn->_properties ? CFDictionaryGetValue(conn->_properties, kCFStreamPropertySSLSettings) : NULL;
+        CFMutableDictionaryRef settings = given ?
+            CFDictionaryCreateMutableCopy(alloc, 0, given) :
+            CFDictionaryCreateMutable(alloc, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        const void* protocols[2] = {_kCFHTTP2Protocol, _kCFHTTP2FallbackProtocol};
+        CFArrayRef alpn = CFArrayCreate(alloc, protocols, 2, &kCFTypeArrayCallBacks);
+
+        if (!settings || !alpn) {
+            if (settings) CFRelease(settings);
+            if (alpn) CFRelease(alpn);
+            conn->_error.domain = kCFStreamErrorDomainPOSIX;
+            conn->_error.error = ENOMEM;
+            return FALSE;
+        }
+
+        if (!given)
+            CFDictionarySetValue(settings, kCFStreamSSLLevel, kCFStreamSocketSecurityLevelNegotiatedSSL);
+        CFDictionarySetValue(settings, _kCFStreamSSLApplicationProtocols, alpn);
+
+        CFReadStreamSetProperty(conn->_rStream, kCFStreamPropertySSLSettings, settings);
+
+        CFRelease(alpn);
+        CFRelease(settings);
+    }
+
+    CFReadStreamSetClient(conn->_rStream,
+                          kCFStreamEventHasBytesAvailable | kCFStreamEventEndEncountered | kCFStreamEventErrorOccurred,
+                          _SocketReadCallBack,
+                          &ctxt);
+    CFWriteStreamSetClient(conn->_wStream,
+                           kCFStreamEventOpenCompleted | kCFStreamEventCanAcceptBytes | kCFStreamEventEndEncountered | kCFStreamEventErrorOccurred,
+                           _SocketWriteCallBack,
+                           &ctxt);
+
+    count = CFArrayGetCount(conn->_schedules);
+    for (i = 0; i < count; i += 2) {
+        CFRunLoopRef rl = (CFRunLoopRef)CFArrayGetValueAtIndex(conn->_schedules, i);
+        CFStringRef mode = (CFStringRef)CFArrayGetValueAtIndex(conn->_schedules, i + 1);
+        CFReadStreamScheduleWithRunLoop(conn->_rStream, rl, mode);
+        CFWriteStreamScheduleWithRunLoop(conn->_wStream, rl, mode);
+    }
+
+    if (!CFReadStreamOpen(conn->_rStream)) {
+        conn->_error = CFReadStreamGetError(conn->_rStream);
+        return FALSE;
+    }
+
+    if (!CFWriteStreamOpen(conn->_wStream)) {
+        conn->_error = CFWriteStreamGetError(conn->_wStream);
+        return FALSE;
+    }
+
+    // Queue the preface; nothing is sent until the protocol has been checked.
+    _WriteSettings(conn);
+
+    return TRUE;
+}
+
+
+/* static */ Boolean
+_ConnectionCheckProtocol(_CFHTTP2Connection* conn) {
+
+    if (conn->_type == kHTTP2) {
+
+        CFStringRef protocol = CFWriteStreamCopyProperty(conn->_wStream, _kCFStreamPropertySSLNegotiatedProtocol);
+        Boolean chosen = protocol && CFEqual(protocol, _kCFHTTP2Protocol);
+
+        if (protocol)
+            CFRelease(protocol);
+
+        if (!chosen) {
+
+            CFStreamError error = {kCFStreamErrorDomainHTTP, kCFStreamErrorHTTP2NotNegotiated};
+
+            // Remember the server, so shared requests for it stop trying.
+            __CFSpinLock(&_kCFHTTP2SharedLock);
+            if (conn->_sharedKey && _kCFHTTP2Refusals)
+                CFSetAddValue(_kCFHTTP2Refusals, conn->_sharedKey);
+            __CFSpinUnlock(&_kCFHTTP2SharedLock);
+
+            // Nothing has been sent, so there is no GOAWAY to send either.
+            conn->_out.length = conn->_out.offset = 0;
+            _ConnectionFail(conn, kHTTP2NoError, &error);
+
+            return FALSE;
+        }
+    }
+
+    __CFBitSet(conn->_flags, kFlagBitChecked);
+
+    return TRUE;
+}
+
+
+/* static */ void
+_ConnectionFlush(_CFHTTP2Connection* conn) {
+
+    if (!conn->_wStream || !CFWriteStreamCanAcceptBytes(conn->_wStream))
+        return;
+
+    if (!__CFBitIsSet(conn->_flags, kFlagBitChecked) && !_ConnectionCheckProtocol(conn))
+        return;
+
+    while (conn->_out.offset < conn->_out.length) {
+
+        CFIndex written = CFWriteStreamWrite(conn->_wStream,
+                                             conn->_out.bytes + conn->_out.offset,
+                                             conn->_out.length - conn->_out.offset);
+
+        if (written < 0) {
+            CFStreamError error = CFWriteStreamGetError(conn->_wStream);
+            conn->_out.length = conn->_out.offset = 0;
+            _ConnectionFail(conn, kHTTP2NoError, &error);
+            return;
+        }
+
+        _BufferConsume(&conn->_out, written);
+
+        if (!written || !CFWriteStreamCanAcceptBytes(conn->_wStream))
+            break;
+    }
+}
+
+
+/* static */ void
+_ConnectionPump(_CFHTTP2Connection* conn) {
+
+    _CFHTTP2Stream *stream, *next;
+    Boolean progress;
+
+    if (__CFBitIsSet(conn->_flags, kFlagBitInvalid))
+        return;
+
+    // Start waiting streams, in order, as far as the limits allow.
+    for (stream = conn->_head; stream; stream = next) {
+
+        CFIndex limit = conn->_peerMaxConcurrent;
+
+        next = stream->_next;
+        if (__CFBitIsSet(stream->_flags, kStreamBitStarted))
+            continue;
+
+        if (conn->_maxActive && (conn->_maxActive < limit))
+            limit = conn->_maxActive;
+
+        if (conn->_active >= limit)
+            break;
+
+        _StreamStart(stream);
+    }
+
+    // Send body data, a frame from each stream in turn, while the windows allow.
+    do {
+        progress = FALSE;
+        for (stream = conn->_head; stream; stream = next) {
+            next = stream->_next;
+            if (_StreamSendData(stream))
+                progress = TRUE;
+        }
+    } while (progress);
+
+    if (conn->_out.failed) {
+        CFStreamError error = {kCFStreamErrorDomainPOSIX, ENOMEM};
+        _ConnectionFail(conn, kHTTP2NoError, &error);
+        return;
+    }
+
+    _ConnectionFlush(conn);
+}
+
+
+/* static */ void
+_ConnectionRead(_CFHTTP2Connection* conn) {
+
+    CFAllocatorRef alloc = CFGetAllocator(conn);
+
+    do {
+        CFIndex bytesRead;
+
+        if (!_BufferReserve(&conn->_in, kHTTP2ReadSize, alloc)) {
+            CFStreamError error = {kCFStreamErrorDomainPOSIX, ENOMEM};
+            _ConnectionFail(conn, kHTTP2InternalError, &error);
+            return;
+        }
+
+        bytesRead = CFReadStreamRead(conn->_rStream, conn->_in.bytes + conn->_in.length, kHTTP2ReadSize);
+
+        if (bytesRead < 0) {
+            CFStreamError error = CFReadStreamGetError(conn->_rStream);
+            _ConnectionFail(conn, kHTTP2NoError, &error);
+            return;
+        }
+
+        if (!bytesRead) {
+            CFStreamError error = {kCFStreamErrorDomainHTTP, kCFStreamErrorHTTPConnectionLost};
+            _ConnectionFail(conn, kHTTP2NoError, &error);
+            return;
+        }
+
+        conn->_in.length += bytesRead;
+        conn->_lastAccess = CFAbsoluteTimeGetCurrent();
+
+        _ConnectionHandleFrames(conn);
+
+    } while (!__CFBitIsSet(conn->_flags, kFlagBitInvalid) && CFReadStreamHasBytesAvailable(conn->_rStream));
+
+    _ConnectionPump(conn);
+}
+
+
+/* static */ void
+_ConnectionHandleFrames(_CFHTTP2Connection* conn) {
+
+    while ((conn->_in.length - conn->_in.offset) >= kHTTP2FrameHeaderSize) {
+
+        const UInt8* frame = conn->_in.bytes + conn->_in.offset;
+        UInt32 length = (frame[0] << 16) | (frame[1] << 8) | frame[2];
+        UInt8 type = frame[3];
+        UInt8 flags = frame[4];
+        UInt32 streamID = ((frame[5] & 0x7F) << 24) | (frame[6] << 16) | (frame[7] << 8) | frame[8];
+        const UInt8* payload = frame + kHTTP2FrameHeaderSize;
+
+        // This end never raises SETTINGS_MAX_FRAME_SIZE.
+        if (length > kHTTP2DefaultFrameSize) {
+            _ConnectionFail(conn, kHTTP2FrameSizeError, NULL);
+            return;
+        }
+
+        if ((conn->_in.length - conn->_in.offset) < (CFIndex)(kHTTP2FrameHeaderSize + length))
+            break;
+
+        // Header blocks are contiguous (section 6.10).
+        if (conn->_continuationID && ((type != kHTTP2FrameContinuation) || (streamID != conn->_continuationID))) {
+            _ConnectionFail(conn, kHTTP2ProtocolError, NULL);
+            return;
+        }
+
+        switch (type) {
+
+            case kHTTP2FrameData:
+                _HandleData(conn, flags, streamID, payload, length);
+                break;
+
+            case kHTTP2FrameHeaders:
+            case kHTTP2FrameContinuation:
+                _HandleHeaders(conn, type, flags, streamID, payload, length);
+                break;
+
+            case kHTTP2FramePriority:
+                if (length != 5)
+                    _ConnectionFail(conn, kHTTP2FrameSizeError, NULL);
+                break;
+
+            case kHTTP2FrameRSTStream:
+                _HandleRSTStream(conn, streamID, payload, length);
+                break;
+
+            case kHTTP2FrameSettings:
+                _HandleSettings(conn, flags, streamID, payload, length);
+                break;
+
+            // Push is off, so a promise is a protocol error (section 8.2).
+            case kHTTP2FramePushPromise:
+                _ConnectionFail(conn, kHTTP2ProtocolError, NULL);
+                break;
+
+            case kHTTP2FramePing:
+                _HandlePing(conn, flags, streamID, payload, length);
+                break;
+
+            case kHTTP2FrameGoAway:
+                _HandleGoAway(conn, streamID, payload, length);
+                break;
+
+            case kHTTP2FrameWindowUpdate:
+                _HandleWindowUpdate(conn, streamID, payload, length);
+                break;
+
+            // Unknown frame types are ignored (section 4.1).
+            default:
+                break;
+        }
+
+        if (__CFBitIsSet(conn->_flags, kFlagBitInvalid))
+            return;
+
+        _BufferConsume(&conn->_in, kHTTP2FrameHeaderSize + length);
+    }
+}
+
+
+/* static */ void
+_ConnectionFail(_CFHTTP2Connection* conn, UInt32 code, const CFStreamError* error) {
+
+    CFStreamError reset = {kCFStreamErrorDomainHTTP, kCFStreamErrorHTTP2StreamReset};
+
+    if (__CFBitIsSet(conn->_flags, kFlagBitInvalid))
+        return;
+
+    // Protocol errors are reported to the streams as resets.
+    if (!error)
+        error = &reset;
+
+    conn->_error = *error;
+    __CFBitSet(conn->_flags, kFlagBitInvalid);
+    _ConnectionStopNewStreams(conn);
+
+    if (code != kHTTP2NoError) {
+
+        CFAllocatorRef alloc = CFGetAllocator(conn);
+        UInt8 payload[8] = {0, 0, 0, 0, (code >> 24) & 0xFF, (code >> 16) & 0xFF, (code >> 8) & 0xFF, code & 0xFF};
+
+        // Best effort; the connection is going either way.
+        _WriteFrameHeader(&conn->_out, sizeof(payload), kHTTP2FrameGoAway, 0, 0, alloc);
+        _BufferAppend(&conn->_out, payload, sizeof(payload), alloc);
+        _ConnectionFlush(conn);
+    }
+
+    while (conn->_head)
+        _StreamFail(conn->_head, error);
+
+    _ConnectionClose(conn);
+}
+
+
+/* static */ void
+_ConnectionStopNewStreams(_CFHTTP2Connection* conn) {
+
+    __CFBitSet(conn->_flags, kFlagBitNoNewStreams);
+    _ConnectionUnshare(conn);
+}
+
+
+/* static */ void
+_ConnectionUnshare(_CFHTTP2Connection* conn) {
+
+    // Whoever called in holds a reference, so the table's is never the last.
+    __CFSpinLock(&_kCFHTTP2SharedLock);
+    if (conn->_sharedKey && _kCFHTTP2SharedConnections &&
+        (CFDictionaryGetValue(_kCFHTTP2SharedConnections, conn->_sharedKey) == conn))
+    {
+        CFDictionaryRemoveValue(_kCFHTTP2SharedConnections, conn->_sharedKey);
+    }
+    __CFSpinUnlock(&_kCFHTTP2SharedLock);
+}
+
+
+/* static */ void
+_ConnectionReschedule(_CFHTTP2Connection* conn) {
+
+    CFMutableArrayRef wanted = CFArrayCreateMutable(CFGetAllocator(conn), 0, &kCFTypeArrayCallBacks);
+    _CFHTTP2Stream* stream;
+    CFIndex i, count;
+
+    if (!wanted)
+        return;
+
+    // The sockets go wherever any stream still in the connection is scheduled.
+    for (stream = conn->_head; stream; stream = stream->_next) {
+        count = CFArrayGetCount(stream->_schedules);
+        for (i = 0; i < count; i += 2) {
+            _SchedulesAddRunLoopAndMode(wanted,
+                                        (CFRunLoopRef)CFArrayGetValueAtIndex(stream->_schedules, i),
+                                        (CFStringRef)CFArrayGetValueAtIndex(stream->_schedules, i + 1));
+        }
+    }
+
+    for (i = CFArrayGetCount(conn->_schedules) - 2; i >= 0; i -= 2) {
+
+        CFRunLoopRef rl = (CFRunLoopRef)CFArrayGetValueAtIndex(conn->_schedules, i);
+        CFStringRef mode = (CFStringRef)CFArrayGetValueAtIndex(conn->_schedules, i + 1);
+
+        if (_SchedulesFind(wanted, rl, mode) != kCFNotFound)
+            continue;
+
+        if (conn->_rStream) {
+            CFReadStreamUnscheduleFromRunLoop(conn->_rStream, rl, mode);
+            CFWriteStreamUnscheduleFromRunLoop(conn->_wStream, rl, mode);
+        }
+        CFArrayReplaceValues(conn->_schedules, CFRangeMake(i, 2), NULL, 0);
+    }
+
+    count = CFArrayGetCount(wanted);
+    for (i = 0; i < count; i += 2) {
+
+        CFRunLoopRef rl = (CFRunLoopRef)CFArrayGetValueAtIndex(wanted, i);
+        CFStringRef mode = (CFStringRef)CFArrayGetValueAtIndex(wanted, i + 1);
+
+        if (!_SchedulesAddRunLoopAndMode(conn->_schedules, rl, mode))
+            continue;
+
+        if (conn->_rStream) {
+            CFReadStreamScheduleWithRunLoop(conn->_rStream, rl, mode);
+            CFWriteStreamScheduleWithRunLoop(conn->_wStream, rl, mode);
+        }
+    }
+
+    CFRelease(wanted);
+}
+
+
+/* static */ void
+_ConnectionClose(_CFHTTP2Connection* conn) {
+
+    if (conn->_rStream) {
+        CFReadStreamSetClient(conn->_rStream, kCFStreamEventNone, NULL, NULL);
+        _CFTypeUnscheduleFromMultipleRunLoops(conn->_rStream, conn->_schedules);
+        CFReadStreamClose(conn->_rStream);
+        CFRelease(conn->_rStream);
+        conn->_rStream = NULL;
+    }
+
+    if (conn->_wStream) {
+        CFWriteStreamSetClient(conn->_wStream, kCFStreamEventNone, NULL, NULL);
+        _CFTypeUnscheduleFromMultipleRunLoops(conn->_wStream, conn->_schedules);
+        CFWriteStreamClose(conn->_wStream);
+        CFRelease(conn->_wStream);
+        conn->_wStream = NULL;
+    }
+
+    if (conn->_schedules)
+        CFArrayRemoveAllValues(conn->_schedules);
+}
+
+
+/* static */ _CFHTTP2Stream*
+_ConnectionFindStream(_CFHTTP2Connection* conn, UInt32 streamID) {
+
+    _CFHTTP2Stream* stream;
+
+    for (stream = conn->_head; stream; stream = stream->_next) {
+        if (__CFBitIsSet(stream->_flags, kStreamBitStarted) && (stream->_id == streamID))
+            return stream;
+    }
+
+    return NULL;
+}
+
+
+/* static */ Boolean
+_ConnectionIsIdleStream(_CFHTTP2Connection* conn, UInt32 streamID) {
+
+    // Even ids are the server's, which it may not open with push off.
+    return !(streamID & 1) || (streamID >= conn->_nextStreamID);
+}
+
+
+#pragma mark -
+#pragma mark Frame Handling
+
+/* static */ void
+_HandleData(_CFHTTP2Connection* conn, UInt8 flags, UInt32 streamID, const UInt8* payload, UInt32 length) {
+
+    _CFHTTP2Stream* stream;
+    UInt32 padding = 0;
+
+    if (!streamID) {
+        _ConnectionFail(conn, kHTTP2ProtocolError, NULL);
+        return;
+    }
+
+    if (flags & kHTTP2FlagPadded) {
+        if (!length || (payload[0] >= length)) {
+            _ConnectionFail(conn, kHTTP2ProtocolError, NULL);
+            return;
+        }
+        padding = payload[0] + 1;
+    }
+
+    // The whole frame counts against the windows, padding included (section 6.9.1).
+    if ((SInt64)length > conn->_recvWindow) {
+        _ConnectionFail(conn, kHTTP2FlowControlError, NULL);
+        return;
+    }
+
+    conn->_recvWindow -= length;
+    conn->_recvConsumed += length;
+    if (conn->_recvConsumed >= (kHTTP2ConnectionWindow / 2)) {
+        _WriteWindowUpdate(conn, 0, (UInt32)conn->_recvConsumed);
+        conn->_recvWindow += conn->_recvConsumed;
+        conn->_recvConsumed = 0;
+    }
+
+    stream = _ConnectionFindStream(conn, streamID);
+    if (!stream) {
+        // Frames still in flight for a stream which is done are dropped.
+        if (_ConnectionIsIdleStream(conn, streamID))
+            _ConnectionFail(conn, kHTTP2ProtocolError, NULL);
+        return;
+    }
+
+    if (!__CFBitIsSet(stream->_flags, kStreamBitHeadersDone) || __CFBitIsSet(stream->_flags, kStreamBitEnd)) {
+        _StreamReset(stream, kHTTP2ProtocolError, NULL);
+        return;
+    }
+
+    if ((SInt64)length > stream->_recvWindow) {
+        _StreamReset(stream, kHTTP2FlowControlError, NULL);
+        return;
+    }
+
+    // Padding is never read, so it is given back with the next update.
+    stream->_recvWindow -= length;
+    stream->_recvConsumed += padding;
+
+    if (length > padding) {
+
+        _BufferAppend(&stream->_data, payload + (padding ? 1 : 0), length - padding, CFGetAllocator(conn));
+
+        if (stream->_data.failed) {
+            CFStreamError error = {kCFStreamErrorDomainPOSIX, ENOMEM};
+            _StreamReset(stream, kHTTP2Cancel, &error);
+            return;
+        }
+
+        _CFReadStreamSignalEventDelayed(stream->_client, kCFStreamEventHasBytesAvailable, NULL);
+    }
+
+    if (flags & kHTTP2FlagEndStream)
+        _StreamEnded(stream);
+}
+
+
+/* static */ void
+_HandleHeaders(_CFHTTP2Connection* conn, UInt8 type, UInt8 flags, UInt32 streamID, const UInt8* payload, UInt32 length) {
+
+    const UInt8* fragment = payload;
+    UInt32 fragmentLength = length;
+
+    if (!streamID) {
+        _ConnectionFail(conn, kHTTP2ProtocolError, NULL);
+        return;
+    }
+
+    if (type == kHTTP2FrameHeaders) {
+
+        UInt32 padding = 0;
+
+        if (flags & kHTTP2FlagPadded) {
+            if (!fragmentLength) {
+                _ConnectionFail(conn, kHTTP2FrameSizeError, NULL);
+                return;
+            }
+            padding = fragment[0];
+            fragment++;
+            fragmentLength--;
+        }
+
+        // Priority is left to the server.
+        if (flags & kHTTP2FlagPriority) {
+            if (fragmentLength < 5) {
+                _ConnectionFail(conn, kHTTP2FrameSizeError, NULL);
+                return;
+            }
+            fragment += 5;
+            fragmentLength -= 5;
+        }
+
+        if (padding > fragmentLength) {
+            _ConnectionFail(conn, kHTTP2ProtocolError, NULL);
+            return;
+        }
+        fragmentLength -= padding;
+
+        conn->_block.length = conn->_block.offset = 0;
+        if (flags & kHTTP2FlagEndStream)
+            __CFBitSet(conn->_flags, kFlagBitBlockEndsStream);
+        else
+            __CFBitClear(conn->_flags, kFlagBitBlockEndsStream);
+    }
+
+    else if (!conn->_continuationID) {
+        _ConnectionFail(conn, kHTTP2ProtocolError, NULL);
+        return;
+    }
+
+    if ((conn->_block.length + fragmentLength) > kHTTP2MaxHeaderBlock) {
+        _ConnectionFail(conn, kHTTP2EnhanceYourCalm, NULL);
+        return;
+    }
+
+    _BufferAppend(&conn->_block, fragment, fragmentLength, CFGetAllocator(conn));
+    if (conn->_block.failed) {
+        CFStreamError error = {kCFStreamErrorDomainPOSIX, ENOMEM};
+        _ConnectionFail(conn, kHTTP2InternalError, &error);
+        return;
+    }
+
+    if (!(flags & kHTTP2FlagEndHeaders)) {
+        conn->_continuationID = streamID;
+        return;
+    }
+
+    conn->_continuationID = 0;
+    _HandleHeaderBlock(conn, streamID, __CFBitIsSet(conn->_flags, kFlagBitBlockEndsStream));
+}
+
+
+/* static */ void
+_HandleHeaderBlock(_CFHTTP2Connection* conn, UInt32 streamID, Boolean endStream) {
+
+    _CFHTTP2Stream* stream = _ConnectionFindStream(conn, streamID);
+    _CFHTTP2HeaderContext ctxt = {CFGetAllocator(conn), NULL, 0, FALSE};
+    Boolean decoded;
+
+    if (!stream && _ConnectionIsIdleStream(conn, streamID)) {
+        _ConnectionFail(conn, kHTTP2ProtocolError, NULL);
+        return;
+    }
+
+    // The block is decoded even for a stream which is done, to keep the table in step.
+    decoded = _HPACKDecodeBlock(conn, conn->_block.bytes, conn->_block.length, _ResponseHeaderField, &ctxt);
+    conn->_block.length = conn->_block.offset = 0;
+
+    if (!decoded) {
+        if (ctxt.message) CFRelease(ctxt.message);
+        _ConnectionFail(conn, kHTTP2CompressionError, NULL);
+        return;
+    }
+
+    if (!stream) {
+        if (ctxt.message) CFRelease(ctxt.message);
+        return;
+    }
+
+    // Trailers must end the stream; their fields are not kept.
+    if (__CFBitIsSet(stream->_flags, kStreamBitHeadersDone)) {
+        if (ctxt.message) CFRelease(ctxt.message);
+        if (endStream)
+            _StreamEnded(stream);
+        else
+            _StreamReset(stream, kHTTP2ProtocolError, NULL);
+        return;
+    }
+
+    if (ctxt.malformed || !ctxt.message) {
+        if (ctxt.message) CFRelease(ctxt.message);
+        _StreamReset(stream, kHTTP2ProtocolError, NULL);
+        return;
+    }
+
+    // Interim responses are dropped; the final one follows (section 8.1).
+    if (ctxt.status < 200) {
+        CFRelease(ctxt.message);
+        if (endStream)
+            _StreamReset(stream, kHTTP2ProtocolError, NULL);
+        return;
+    }
+
+    {
+        CFURLRef url = CFHTTPMessageCopyRequestURL(stream->_request);
+        if (url) {
+            _CFHTTPMessageSetResponseURL(ctxt.message, url);
+            CFRelease(url);
+        }
+    }
+
+    stream->_response = ctxt.message;
+    __CFBitSet(stream->_flags, kStreamBitHeadersDone);
+
+    if (endStream)
+        _StreamEnded(stream);
+}
+
+
+/* static */ void
+_HandleRSTStream(_CFHTTP2Connection* conn, UInt32 streamID, const UInt8* payload, UInt32 length) {
+
+    _CFHTTP2Stream* stream;
+    UInt32 code;
+    CFStreamError error = {kCFStreamErrorDomainHTTP, kCFStreamErrorHTTP2StreamReset};
+
+    if (!streamID) {
+        _ConnectionFail(conn, kHTTP2ProtocolError, NULL);
+        return;
+    }
+
+    if (length != 4) {
+        _ConnectionFail(conn, kHTTP2FrameSizeError, NULL);
+        return;
+    }
+
+    stream = _ConnectionFindStream(conn, streamID);
+    if (!stream) {
+        if (_ConnectionIsIdleStream(conn, streamID))
+            _ConnectionFail(conn, kHTTP2ProtocolError, NULL);
+        return;
+    }
+
+    code = (payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3];
+
+    // A server with the whole response out may stop the rest of the request (section 8.1).
+    if ((code == kHTTP2NoError) && __CFBitIsSet(stream->_flags, kStreamBitEnd)) {
+        __CFBitSet(stream->_flags, kStreamBitRequestSent);
+        _StreamDone(stream);
+        return;
+    }
+
+    // A refused stream was never processed, so it may go again elsewhere.
+    if (code == kHTTP2RefusedStream)
+        error.error = kCFStreamErrorHTTPConnectionLost;
+
+    _StreamFail(stream, &error);
+}
+
+
+/* static */ void
+_HandleSettings(_CFHTTP2Connection* conn, UInt8 flags, UInt32 streamID, const UInt8* payload, UInt32 length) {
+
+    CFAllocatorRef alloc = CFGetAllocator(conn);
+    UInt32 i;
+
+    if (streamID) {
+        _ConnectionFail(conn, kHTTP2ProtocolError, NULL);
+        return;
+    }
+
+    if (flags & kHTTP2FlagAck) {
+        if (length)
+            _ConnectionFail(conn, kHTTP2FrameSizeError, NULL);
+        return;
+    }
+
+    if (length % 6) {
+        _ConnectionFail(conn, kHTTP2FrameSizeError, NULL);
+        return;
+    }
+
+    for (i = 0; i < length; i += 6) {
+
+        UInt16 identifier = (payload[i] << 8) | payload[i + 1];
+        UInt32 value = (payload[i + 2] << 24) | (payload[i + 3] << 16) | (payload[i + 4] << 8) | payload[i + 5];
+
+        switch (identifier) {
+
+            case kHTTP2SettingHeaderTableSize:
+                _HPACKSetEncoderTableSize(conn, value);
+                break;
+
+            case kHTTP2SettingEnablePush:
+                if (value > 1) {
+                    _ConnectionFail(conn, kHTTP2ProtocolError, NULL);
+                    return;
+                }
+                break;
+
+            case kHTTP2SettingMaxConcurrent:
+                conn->_peerMaxConcurrent = value;
+                break;
+
+            // Changes every open stream's window by the difference (section 6.9.2).
+            case kHTTP2SettingInitialWindow:
+            {
+                _CFHTTP2Stream* stream;
+                SInt64 delta = (SInt64)value - conn->_peerInitialWindow;
+
+                if (value > kHTTP2MaxWindow) {
+                    _ConnectionFail(conn, kHTTP2FlowControlError, NULL);
+                    return;
+                }
+
+                for (stream = conn->_head; stream; stream = stream->_next) {
+                    if (!__CFBitIsSet(stream->_flags, kStreamBitStarted))
+                        continue;
+                    stream->_sendWindow += delta;
+                    if (stream->_sendWindow > kHTTP2MaxWindow) {
+                        _ConnectionFail(conn, kHTTP2FlowControlError, NULL);
+                        return;
+                    }
+                }
+
+                conn->_peerInitialWindow = value;
+                break;
+            }
+
+            case kHTTP2SettingMaxFrameSize:
+                if ((value < kHTTP2DefaultFrameSize) || (value > 0xFFFFFF)) {
+                    _ConnectionFail(conn, kHTTP2ProtocolError, NULL);
+                    return;
+                }
+                conn->_peerMaxFrame = value;
+                break;
+
+            // Unknown settings are ignored (section 6.5.2).
+            default:
+                break;
+        }
+    }
+
+    _WriteFrameHeader(&conn->_out, 0, kHTTP2FrameSettings, kHTTP2FlagAck, 0, alloc);
+}
+
+
+/* static */ void
+_HandlePing(_CFHTTP2Connection* conn, UInt8 flags, UInt32 streamID, const UInt8* payload, UInt32 length) {
+
+    CFAllocatorRef alloc = CFGetAllocator(conn);
+
+    if (streamID) {
+        _ConnectionFail(conn, kHTTP2ProtocolError, NULL);
+        return;
+    }
+
+    if (length != 8) {
+        _ConnectionFail(conn, kHTTP2FrameSizeError, NULL);
+        return;
+    }
+
+    if (!(flags & kHTTP2FlagAck)) {
+        _WriteFrameHeader(&conn->_out, length, kHTTP2FramePing, kHTTP2FlagAck, 0, alloc);
+        _BufferAppend(&conn->_out, payload, length, alloc);
+    }
+}
+
+
+/* static */ void
+_HandleGoAway(_CFHTTP2Connection* conn, UInt32 streamID, const UInt8* payload, UInt32 length) {
+
+    CFStreamError error = {kCFStreamErrorDomainHTTP, kCFStreamErrorHTTPConnectionLost};
+    _CFHTTP2Stream* stream;
+    UInt32 lastID;
+
+    if (streamID) {
+        _ConnectionFail(conn, kHTTP2ProtocolError, NULL);
+        return;
+    }
+
+    if (length < 8) {
+        _ConnectionFail(conn, kHTTP2FrameSizeError, NULL);
+        return;
+    }
+
+    lastID = ((payload[0] & 0x7F) << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3];
+
+    _ConnectionStopNewStreams(conn);
+
+    // Streams after the last the server will process were never seen by it,
+    // and may be sent again on another connection.
+    stream = conn->_head;
+    while (stream) {
+
+        _CFHTTP2Stream* next = stream->_next;
+
+        if (!__CFBitIsSet(stream->_flags, kStreamBitStarted) || (stream->_id > lastID))
+            _StreamFail(stream, &error);
+
+        stream = next;
+    }
+}
+
+
+/* static */ void
+_HandleWindowUpdate(_CFHTTP2Connection* conn, UInt32 streamID, const UInt8* payload, UInt32 length) {
+
+    _CFHTTP2Stream* stream;
+    UInt32 increment;
+
+    if (length != 4) {
+        _ConnectionFail(conn, kHTTP2FrameSizeError, NULL);
+        return;
+    }
+
+    increment = ((payload[0] & 0x7F) << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3];
+
+    if (!streamID) {
+        if (!increment)
+            _ConnectionFail(conn, kHTTP2ProtocolError, NULL);
+        else if ((conn->_sendWindow + increment) > kHTTP2MaxWindow)
+            _ConnectionFail(conn, kHTTP2FlowControlError, NULL);
+        else
+            conn->_sendWindow += increment;
+        return;
+    }
+
+    // One for a stream not yet opened is a connection error (RFC 7540 section 5.1);
+    // one for a closed stream may still be in flight, and is ignored.
+    stream = _ConnectionFindStream(conn, streamID);
+    if (!stream) {
+        if (_ConnectionIsIdleStream(conn, streamID))
+            _ConnectionFail(conn, kHTTP2ProtocolError, NULL);
+        return;
+    }
+
+    if (!increment)
+        _StreamReset(stream, kHTTP2ProtocolError, NULL);
+    else if ((stream->_sendWindow + increment) > kHTTP2MaxWindow)
+        _StreamReset(stream, kHTTP2FlowControlError, NULL);
+    else
+        stream->_sendWindow += increment;
+}
+
+
+#pragma mark -
+#pragma mark Streams
+
+/* static */ void
+_StreamStart(_CFHTTP2Stream* stream) {
+
+    _CFHTTP2Connection* conn = stream->_conn;
+    CFAllocatorRef alloc = CFGetAllocator(conn);
+    _CFHTTP2Buffer block = {NULL, 0, 0, 0, FALSE};
+    Boolean endStream = !stream->_body && !stream->_bodyStream;
+    CFURLRef url;
+    CFStringRef method, authority;
+    CFDictionaryRef headers;
+    UInt32 offset;
+
+    if (conn->_nextStreamID > kHTTP2MaxStreamID) {
+        CFStreamError error = {kCFStreamErrorDomainHTTP, kCFStreamErrorHTTPConnectionLost};
+        _ConnectionStopNewStreams(conn);
+        _StreamFail(stream, &error);
+        return;
+    }
+
+    url = CFHTTPMessageCopyRequestURL(stream->_request);
+    method = CFHTTPMessageCopyRequestMethod(stream->_request);
+    headers = CFHTTPMessageCopyAllHeaderFields(stream->_request);
+    authority = CFHTTPMessageCopyHeaderFieldValue(stream->_request, _kCFHTTP2HostHeader);
+
+    if (!authority && url) {
+
+        CFStringRef host = CFURLCopyHostName(url);
+        SInt32 port = CFURLGetPortNumber(url);
+
+        if (host) {
+            if (CFStringFind(host, _kCFHTTP2Colon, 0).location != kCFNotFound)
+                authority = (port == -1) ?
+                    CFStringCreateWithFormat(alloc, NULL, _kCFHTTP2BracketedHostFormat, host) :
+                    CFStringCreateWithFormat(alloc, NULL, _kCFHTTP2BracketedHostPortFormat, host, (int)port);
+            else
+                authority = (port == -1) ? CFRetain(host) : CFStringCreateWithFormat(alloc, NULL, _kCFHTTP2HostKeyFormat, host, (int)port);
+            CFRelease(host);
+        }
+    }
+
+    if (!url || !method || !authority) {
+        CFStreamError error = {kCFStreamErrorDomainHTTP, kCFStreamErrorHTTPBadURL};
+        if (url) CFRelease(url);
+        if (method) CFRelease(method);
+        if (authority) CFRelease(authority);
+        if (headers) CFRelease(headers);
+        _StreamFail(stream, &error);
+        return;
+    }
+
+    // The table size update, if any, goes first (section 4.2), and then the
+    // pseudo-header fields (RFC 7540 section 8.1.2.3).
+    if (__CFBitIsSet(conn->_flags, kFlagBitTableSizeUpdate)) {
+        _HPACKEncodeInteger(&block, 0x20, 5, conn->_encoder.maxSize, alloc);
+        __CFBitClear(conn->_flags, kFlagBitTableSizeUpdate);
+    }
+
+    _HPACKEncodeStringField(conn, &block, ":method", method);
+    if (conn->_type == kHTTP2Cleartext)
+        _HPACKEncodeField(conn, &block, (const UInt8*)":scheme", 7, (const UInt8*)"http", 4, FALSE);
+    else
+        _HPACKEncodeField(conn, &block, (const UInt8*)":scheme", 7, (const UInt8*)"https", 5, FALSE);
+    _HPACKEncodeStringField(conn, &block, ":authority", authority);
+
+    {
+        UInt8 buf[512], *bytes = buf, *path;
+        Boolean deallocBytes;
+
+        path = _CFURLPortionForRequest(alloc, url, FALSE, &bytes, sizeof(buf) / sizeof(UInt8), &deallocBytes);
+        _HPACKEncodeField(conn, &block, (const UInt8*)":path", 5, path, strlen((const char*)path), FALSE);
+        if (deallocBytes) CFAllocatorDeallocate(alloc, bytes);
+    }
+
+    if (headers) {
+
+        CFIndex i, count = CFDictionaryGetCount(headers);
+        CFStringRef* keys = count ? CFAllocatorAllocate(alloc, sizeof(CFStringRef) * count * 2, 0) : NULL;
+        CFStringRef* values = keys + count;
+
+        if (count && !keys)
+            block.failed = TRUE;
+
+        else if (count)
+            CFDictionaryGetKeysAndValues(headers, (const void**)keys, (const void**)values);
+
+        for (i = 0; keys && (i < count); i++) {
+
+            UInt8 nameBuf[64], valueBuf[256];
+            CFIndex nameLength = sizeof(nameBuf), valueLength = sizeof(valueBuf), j;
+            UInt8* name = _CFStringGetOrCreateCString(alloc, keys[i], nameBuf, &nameLength, kCFStringEncodingISOLatin1);
+            UInt8* value = _CFStringGetOrCreateCString(alloc, values[i], valueBuf, &valueLength, kCFStringEncodingISOLatin1);
+
+            if (!name || !value)
+                block.failed = TRUE;
+
+            else {
+
+                // Field names are sent in lower case (section 8.1.2).
+                for (j = 0; j < nameLength; j++) {
+                    if (name[j] >= 'A' && name[j] <= 'Z')
+                        name[j] += 'a' - 'A';
+                }
+
+                // Connection-specific fields have no place in HTTP/2 (section 8.1.2.2);
+                // the host is sent as :authority.
+#define _NameIs(literal)	((nameLength == (CFIndex)(sizeof(literal) - 1)) && !memcmp(name, literal, nameLength))
+                if (!_NameIs("connection") && !_NameIs("keep-alive") && !_NameIs("proxy-connection") &&
+                    !_NameIs("transfer-encoding") && !_NameIs("upgrade") && !_NameIs("host") &&
+                    (!_NameIs("te") || ((valueLength == 8) && !memcmp(value, "trailers", 8))))
+                {
+                    _HPACKEncodeField(conn, &block, name, nameLength, value, valueLength,
+                                      _NameIs("authorization") || _NameIs("proxy-authorization"));
+                }
+#undef _NameIs
+            }
+
+            if (name && (name != nameBuf)) CFAllocatorDeallocate(alloc, name);
+            if (value && (value != valueBuf)) CFAllocatorDeallocate(alloc, value);
+        }
+
+        if (keys)
+            CFAllocatorDeallocate(alloc, keys);
+    }
+
+    if (stream->_body) {
+
+        CFStringRef length = CFHTTPMessageCopyHeaderFieldValue(stream->_request, _kCFHTTP2ContentLengthHeader);
+
+        if (length)
+            CFRelease(length);
+
+        else {
+            char digits[24];
+            snprintf(digits, sizeof(digits), "%ld", (long)CFDataGetLength(stream->_body));
+            _HPACKEncodeField(conn, &block, (const UInt8*)"content-length", 14, (const UInt8*)digits, strlen(digits), FALSE);
+        }
+    }
+
+    CFRelease(url);
+    CFRelease(method);
+    CFRelease(authority);
+    if (headers) CFRelease(headers);
+
+    // The encoder's table has already moved on, so a failure here is the connection's.
+    if (block.failed) {
+        _BufferFree(&block, alloc);
+        conn->_out.failed = TRUE;
+        return;
+    }
+
+    stream->_id = conn->_nextStreamID;
+    conn->_nextStreamID += 2;
+    conn->_active++;
+    stream->_sendWindow = conn->_peerInitialWindow;
+    stream->_recvWindow = kHTTP2StreamWindow;
+    __CFBitSet(stream->_flags, kStreamBitStarted);
+
+    // Split the block into HEADERS and as many CONTINUATION frames as it takes.
+    offset = 0;
+    do {
+        UInt32 chunk = block.length - offset;
+        UInt8 flags = 0;
+
+        if (chunk > conn->_peerMaxFrame)
+            chunk = conn->_peerMaxFrame;
+
+        if (!offset && endStream)
+            flags |= kHTTP2FlagEndStream;
+        if ((offset + chunk) == (UInt32)block.length)
+            flags |= kHTTP2FlagEndHeaders;
+
+        _WriteFrameHeader(&conn->_out, chunk, offset ? kHTTP2FrameContinuation : kHTTP2FrameHeaders, flags, stream->_id, alloc);
+        _BufferAppend(&conn->_out, block.bytes + offset, chunk, alloc);
+
+        offset += chunk;
+
+    } while (offset < (UInt32)block.length);
+
+    _BufferFree(&block, alloc);
+
+    if (endStream)
+        __CFBitSet(stream->_flags, kStreamBitRequestSent);
+
+    if (!__CFBitIsSet(stream->_flags, kStreamBitOpening))
+        _CFReadStreamSignalEventDelayed(stream->_client, kCFStreamEventOpenCompleted, NULL);
+}
+
+
+/* static */ Boolean
+_StreamSendData(_CFHTTP2Stream* stream) {
+
+    _CFHTTP2Connection* conn = stream->_conn;
+    CFAllocatorRef alloc = CFGetAllocator(conn);
+    _CFHTTP2Buffer* out = &conn->_out;
+    SInt64 window;
+    CFIndex length;
+    UInt8 flags = 0;
+
+    if (!__CFBitIsSet(stream->_flags, kStreamBitStarted) || __CFBitIsSet(stream->_flags, kStreamBitRequestSent) || __CFBitIsSet(stream->_flags, kStreamBitDone))
+        return FALSE;
+
+    if ((out->length - out->offset) >= kHTTP2MaxOutputBacklog)
+        return FALSE;
+
+    window = (conn->_sendWindow < stream->_sendWindow) ? conn->_sendWindow : stream->_sendWindow;
+    if (window > conn->_peerMaxFrame)
+        window = conn->_peerMaxFrame;
+
+    if (stream->_body) {
+
+        CFIndex remaining = CFDataGetLength(stream->_body) - (CFIndex)stream->_bytesWritten;
+
+        if (window <= 0)
+            return FALSE;
+
+        length = (remaining < window) ? remaining : (CFIndex)window;
+        if (length == remaining)
+            flags |= kHTTP2FlagEndStream;
+
+        _WriteFrameHeader(out, length, kHTTP2FrameData, flags, stream->_id, alloc);
+        _BufferAppend(out, CFDataGetBytePtr(stream->_body) + stream->_bytesWritten, length, alloc);
+    }
+
+    else {
+
+        CFStreamStatus status = CFReadStreamGetStatus(stream->_bodyStream);
+        CFIndex start;
+
+        if (status == kCFStreamStatusError) {
+            CFStreamError error = CFReadStreamGetError(stream->_bodyStream);
+            _StreamReset(stream, kHTTP2Cancel, &error);
+            return TRUE;
+        }
+
+        if (status == kCFStreamStatusAtEnd) {
+            length = 0;
+            flags |= kHTTP2FlagEndStream;
+            _WriteFrameHeader(out, 0, kHTTP2FrameData, flags, stream->_id, alloc);
+        }
+
+        else {
+
+            if ((window <= 0) || !CFReadStreamHasBytesAvailable(stream->_bodyStream))
+                return FALSE;
+
+            // Read straight into the output, after room for the frame header.
+            if (!_BufferReserve(out, kHTTP2FrameHeaderSize + window, alloc))
+                return FALSE;
+
+            start = out->length;
+            length = CFReadStreamRead(stream->_bodyStream, out->bytes + start + kHTTP2FrameHeaderSize, (CFIndex)window);
+
+            if (length < 0) {
+                CFStreamError error = CFReadStreamGetError(stream->_bodyStream);
+                _StreamReset(stream, kHTTP2Cancel, &error);
+                return TRUE;
+            }
+
+            if (!length || (CFReadStreamGetStatus(stream->_bodyStream) == kCFStreamStatusAtEnd))
+                flags |= kHTTP2FlagEndStream;
+
+            _WriteFrameHeader(out, length, kHTTP2FrameData, flags, stream->_id, alloc);
+            out->length += length;
+        }
+    }
+
+    conn->_sendWindow -= length;
+    stream->_sendWindow -= length;
+    stream->_bytesWritten += length;
+
+    if (flags & kHTTP2FlagEndStream) {
+        __CFBitSet(stream->_flags, kStreamBitRequestSent);
+        if (__CFBitIsSet(stream->_flags, kStreamBitEnd))
+            _StreamDone(stream);
+    }
+
+    return TRUE;
+}
+
+
+/* static */ void
+_StreamEnded(_CFHTTP2Stream* stream) {
+
+    __CFBitSet(stream->_flags, kStreamBitEnd);
+
+    // With bytes still unread, the reader finds the end after them.
+    if (stream->_data.length == stream->_data.offset)
+        _CFReadStreamSignalEventDelayed(stream->_client, kCFStreamEventEndEncountered, NULL);
+
+    if (__CFBitIsSet(stream->_flags, kStreamBitRequestSent))
+        _StreamDone(stream);
+}
+
+
+/* static */ void
+_StreamDone(_CFHTTP2Stream* stream) {
+
+    _CFHTTP2Connection* conn = stream->_conn;
+    _CFHTTP2Stream** link;
+
+    if (__CFBitIsSet(stream->_flags, kStreamBitDone))
+        return;
+
+    __CFBitSet(stream->_flags, kStreamBitDone);
+
+    if (__CFBitIsSet(stream->_flags, kStreamBitQueued)) {
+
+        for (link = &conn->_head; *link; link = &(*link)->_next) {
+            if (*link == stream) {
+                *link = stream->_next;
+                break;
+            }
+        }
+
+        if (conn->_tail == stream) {
+            conn->_tail = conn->_head;
+            while (conn->_tail && conn->_tail->_next)
+                conn->_tail = conn->_tail->_next;
+        }
+
+        if (__CFBitIsSet(stream->_flags, kStreamBitStarted))
+            conn->_active--;
+
+        _ConnectionReschedule(conn);
+    }
+
+    if (stream->_bodyStream) {
+        CFReadStreamSetClient(stream->_bodyStream, kCFStreamEventNone, NULL, NULL);
+        _CFTypeUnscheduleFromMultipleRunLoops(stream->_bodyStream, stream->_schedules);
+        CFReadStreamClose(stream->_bodyStream);
+    }
+
+    conn->_lastAccess = CFAbsoluteTimeGetCurrent();
+}
+
+
+/* static */ void
+_StreamFail(_CFHTTP2Stream* stream, const CFStreamError* error) {
+
+    if (__CFBitIsSet(stream->_flags, kStreamBitDone))
+        return;
+
+    stream->_error = *error;
+    _StreamDone(stream);
+
+    // Open reports it directly, and a closed client is not told.
+    if (!__CFBitIsSet(stream->_flags, kStreamBitOpening) && !__CFBitIsSet(stream->_flags, kStreamBitClientClosed))
+        _CFReadStreamSignalEventDelayed(stream->_client, kCFStreamEventErrorOccurred, &stream->_error);
+}
+
+
+/* static */ void
+_StreamReset(_CFHTTP2Stream* stream, UInt32 code, const CFStreamError* error) {
+
+    CFStreamError reset = {kCFStreamErrorDomainHTTP, kCFStreamErrorHTTP2StreamReset};
+
+    if (__CFBitIsSet(stream->_flags, kStreamBitDone))
+        return;
+
+    if (__CFBitIsSet(stream->_flags, kStreamBitStarted))
+        _WriteRSTStream(stream->_conn, stream->_id, code);
+
+    _StreamFail(stream, error ? error : &reset);
+}
+
+
+/* static */ void
+_StreamCancel(_CFHTTP2Stream* stream) {
+
+    __CFBitSet(stream->_flags, kStreamBitClientClosed);
+
+    if (!__CFBitIsSet(stream->_flags, kStreamBitDone)) {
+        _StreamReset(stream, kHTTP2Cancel, NULL);
+        _ConnectionPump(stream->_conn);
+    }
+}
+
+
+/* static */ void
+_StreamGrantWindow(_CFHTTP2Stream* stream) {
+
+    // Nothing more is coming once the stream has ended.
+    if (__CFBitIsSet(stream->_flags, kStreamBitEnd) || __CFBitIsSet(stream->_flags, kStreamBitDone))
+        return;
+
+    if (stream->_recvConsumed < (kHTTP2StreamWindow / 2))
+        return;
+
+    _WriteWindowUpdate(stream->_conn, stream->_id, (UInt32)stream->_recvConsumed);
+    stream->_recvWindow += stream->_recvConsumed;
+    stream->_recvConsumed = 0;
+
+    _ConnectionFlush(stream->_conn);
+}
+
+
+/* static */ Boolean
+_StreamHasEvent(_CFHTTP2Stream* stream) {
+
+    return (stream->_data.length > stream->_data.offset) ||
+        __CFBitIsSet(stream->_flags, kStreamBitEnd) ||
+        __CFBitIsSet(stream->_flags, kStreamBitDone);
+}
+
+
+#pragma mark -
+#pragma mark Stream Callbacks
+
+/* static */ void
+_SocketReadCallBack(CFReadStreamRef stream, CFStreamEventType type, void* info) {
+
+    _CFHTTP2Connection* conn = (_CFHTTP2Connection*)info;
+
+    CFRetain(conn);
+    _CFMutexLock(&conn->_lock);
+
+    switch (type) {
+
+        case kCFStreamEventHasBytesAvailable:
+            _ConnectionRead(conn);
+            break;
+
+        case kCFStreamEventEndEncountered:
+        {
+            CFStreamError error = {kCFStreamErrorDomainHTTP, kCFStreamErrorHTTPConnectionLost};
+            _ConnectionFail(conn, kHTTP2NoError, &error);
+            break;
+        }
+
+        case kCFStreamEventErrorOccurred:
+        {
+            CFStreamError error = CFReadStreamGetError(stream);
+            _ConnectionFail(conn, kHTTP2NoError, &error);
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    _CFMutexUnlock(&conn->_lock);
+    CFRelease(conn);
+}
+
+
+/* static */ void
+_SocketWriteCallBack(CFWriteStreamRef stream, CFStreamEventType type, void* info) {
+
+    _CFHTTP2Connection* conn = (_CFHTTP2Connection*)info;
+
+    CFRetain(conn);
+    _CFMutexLock(&conn->_lock);
+
+    switch (type) {
+
+        case kCFStreamEventOpenCompleted:
+        case kCFStreamEventCanAcceptBytes:
+            _ConnectionPump(conn);
+            break;
+
+        case kCFStreamEventEndEncountered:
+        {
+            CFStreamError error = {kCFStreamErrorDomainHTTP, kCFStreamErrorHTTPConnectionLost};
+            _ConnectionFail(conn, kHTTP2NoError, &error);
+            break;
+        }
+
+        case kCFStreamEventErrorOccurred:
+        {
+            CFStreamError error = CFWriteStreamGetError(stream);
+            _ConnectionFail(conn, kHTTP2NoError, &error);
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    _CFMutexUnlock(&conn->_lock);
+    CFRelease(conn);
+}
+
+
+/* static */ void
+_BodyStreamCallBack(CFReadStreamRef stream, CFStreamEventType type, void* info) {
+
+    _CFHTTP2Connection* conn = ((_CFHTTP2Stream*)info)->_conn;
+
+    (void)stream;	/* unused */
+    (void)type;		/* unused */
+
+    // Sending picks up the bytes, the end or the error.
+    CFRetain(conn);
+    _CFMutexLock(&conn->_lock);
+    _ConnectionPump(conn);
+    _CFMutexUnlock(&conn->_lock);
+    CFRelease(conn);
+}
+
+
+/* static */ void*
+_HTTP2StreamCreate(CFReadStreamRef readStream, void* info) {
+
+    _CFHTTP2Stream* template = (_CFHTTP2Stream*)info;
+    CFAllocatorRef alloc = CFGetAllocator(readStream);
+    _CFHTTP2Stream* stream = CFAllocatorAllocate(alloc, sizeof(stream[0]), 0);
+
+    if (!stream)
+        return NULL;
+
+    memset(stream, 0, sizeof(stream[0]));
+
+    stream->_schedules = CFArrayCreateMutable(alloc, 0, &kCFTypeArrayCallBacks);
+    if (!stream->_schedules) {
+        CFAllocatorDeallocate(alloc, stream);
+        return NULL;
+    }
+
+    stream->_conn = (_CFHTTP2Connection*)CFRetain(template->_conn);
+    stream->_client = readStream;
+    stream->_request = (CFHTTPMessageRef)CFRetain(template->_request);
+
+    if (template->_bodyStream)
+        stream->_bodyStream = (CFReadStreamRef)CFRetain(template->_bodyStream);
+
+    else {
+        CFDataRef body = CFHTTPMessageCopyBody(stream->_request);
+        if (body && CFDataGetLength(body))
+            stream->_body = body;
+        else if (body)
+            CFRelease(body);
+    }
+
+    return stream;
+}
+
+
+/* static */ void
+_HTTP2StreamFinalize(CFReadStreamRef readStream, void* info) {
+
+    _CFHTTP2Stream* stream = (_CFHTTP2Stream*)info;
+    _CFHTTP2Connection* conn = stream->_conn;
+
+    _CFMutexLock(&conn->_lock);
+    _StreamCancel(stream);
+    _CFMutexUnlock(&conn->_lock);
+
+    CFRelease(stream->_schedules);
+    CFRelease(stream->_request);
+    if (stream->_body) CFRelease(stream->_body);
+    if (stream->_bodyStream) CFRelease(stream->_bodyStream);
+    if (stream->_response) CFRelease(stream->_response);
+    _BufferFree(&stream->_data, CFGetAllocator(readStream));
+
+    CFAllocatorDeallocate(CFGetAllocator(readStream), stream);
+    CFRelease(conn);
+}
+
+
+/* static */ CFStringRef
+_HTTP2StreamCopyDescription(CFReadStreamRef readStream, void* info) {
+
+    _CFHTTP2Stream* stream = (_CFHTTP2Stream*)info;
+
+    return CFStringCreateWithFormat(CFGetAllocator(readStream), NULL, _kCFHTTP2StreamDescribeFormat,
+                                    stream, (int)stream->_id, stream->_request);
+}
+
+
+/* static */ Boolean
+_HTTP2StreamOpen(CFReadStreamRef readStream, CFStreamError* error, Boolean* openComplete, void* info) {
+
+    _CFHTTP2Stream* stream = (_CFHTTP2Stream*)info;
+    _CFHTTP2Connection* conn = stream->_conn;
+    Boolean result = TRUE;
+
+    (void)readStream;	/* unused */
+
+    error->error = 0;
+    error->domain = 0;
+    *openComplete = TRUE;
+
+    _CFMutexLock(&conn->_lock);
+    __CFBitSet(stream->_flags, kStreamBitOpening);
+
+    if (__CFBitIsSet(conn->_flags, kFlagBitNoNewStreams)) {
+        if (__CFBitIsSet(conn->_flags, kFlagBitInvalid) && conn->_error.error)
+            *error = conn->_error;
+        else {
+            error->domain = kCFStreamErrorDomainHTTP;
+            error->error = kCFStreamErrorHTTPConnectionLost;
+        }
+        result = FALSE;
+    }
+
+    else if (!__CFBitIsSet(conn->_flags, kFlagBitOpened) && !_ConnectionOpen(conn)) {
+        *error = conn->_error;
+        _ConnectionFail(conn, kHTTP2NoError, error);
+        result = FALSE;
+    }
+
+    else {
+
+        // The connection sends the body, so it opens the body stream, as a
+        // CFNetConnection would.
+        if (stream->_bodyStream) {
+
+            CFStreamClientContext ctxt = {0, stream, NULL, NULL, NULL};
+
+            CFReadStreamSetClient(stream->_bodyStream,
+                                  kCFStreamEventHasBytesAvailable | kCFStreamEventEndEncountered | kCFStreamEventErrorOccurred,
+                                  _BodyStreamCallBack,
+                                  &ctxt);
+            _CFTypeScheduleOnMultipleRunLoops(stream->_bodyStream, stream->_schedules);
+
+            if (!CFReadStreamOpen(stream->_bodyStream)) {
+                *error = CFReadStreamGetError(stream->_bodyStream);
+                CFReadStreamSetClient(stream->_bodyStream, kCFStreamEventNone, NULL, NULL);
+                _CFTypeUnscheduleFromMultipleRunLoops(stream->_bodyStream, stream->_schedules);
+                result = FALSE;
+            }
+        }
+
+        if (result) {
+
+            if (conn->_tail)
+                conn->_tail->_next = stream;
+            else
+                conn->_head = stream;
+            conn->_tail = stream;
+            __CFBitSet(stream->_flags, kStreamBitQueued);
+
+            conn->_lastAccess = CFAbsoluteTimeGetCurrent();
+
+            _ConnectionReschedule(conn);
+            _ConnectionPump(conn);
+
+            if (stream->_error.error) {
+                *error = stream->_error;
+                result = FALSE;
+            }
+            else
+                *openComplete = __CFBitIsSet(stream->_flags, kStreamBitStarted);
+        }
+    }
+
+    __CFBitClear(stream->_flags, kStreamBitOpening);
+    _CFMutexUnlock(&conn->_lock);
+
+    return result;
+}
+
+
+/* static */ Boolean
+_HTTP2StreamOpenCompleted(CFReadStreamRef readStream, CFStreamError* error, void* info) {
+
+    _CFHTTP2Stream* stream = (_CFHTTP2Stream*)info;
+    Boolean result;
+
+    (void)readStream;	/* unused */
+
+    _CFMutexLock(&stream->_conn->_lock);
+
+    if (stream->_error.error) {
+        *error = stream->_error;
+        result = TRUE;
+    }
+    else
+        result = __CFBitIsSet(stream->_flags, kStreamBitStarted);
+
+    _CFMutexUnlock(&stream->_conn->_lock);
+
+    return result;
+}
+
+
+/* static */ CFIndex
+_HTTP2StreamRead(CFReadStreamRef readStream, UInt8* buffer, CFIndex bufferLength, CFStreamError* error, Boolean* atEOF, void* info) {
+
+    _CFHTTP2Stream* stream = (_CFHTTP2Stream*)info;
+    _CFHTTP2Connection* conn = stream->_conn;
+    CFIndex result = 0;
+
+    _CFMutexLock(&conn->_lock);
+
+    // Run the connection in a private mode until there is something to report.
+    if (!_StreamHasEvent(stream)) {
+
+        CFRunLoopRef rl = CFRunLoopGetCurrent();
+        CFStringRef mode = _kCFHTTP2PrivateRunLoopMode;
+        CFRunLoopSourceContext rlsCtxt = {0, stream, NULL, NULL, NULL, NULL, NULL, NULL, NULL, emptyPerform};
+        CFRunLoopSourceRef source = CFRunLoopSourceCreate(CFGetAllocator(readStream), 0, &rlsCtxt);
+
+        CFReadStreamScheduleWithRunLoop(readStream, rl, mode);
+        if (source)
+            CFRunLoopAddSource(rl, source, mode);
+
+        while (!_StreamHasEvent(stream)) {
+            _CFMutexUnlock(&conn->_lock);
+            CFRunLoopRunInMode(mode, 1e+20, TRUE);
+            _CFMutexLock(&conn->_lock);
+        }
+
+        if (source) {
+            CFRunLoopRemoveSource(rl, source, mode);
+            CFRelease(source);
+        }
+        CFReadStreamUnscheduleFromRunLoop(readStream, rl, mode);
+    }
+
+    error->error = 0;
+    error->domain = 0;
+    *atEOF = FALSE;
+
+    if (stream->_data.length > stream->_data.offset) {
+
+        result = stream->_data.length - stream->_data.offset;
+        if (result > bufferLength)
+            result = bufferLength;
+
+        memmove(buffer, stream->_data.bytes + stream->_data.offset, result);
+        _BufferConsume(&stream->_data, result);
+
+        // Give the server back what the client has taken.
+        stream->_recvConsumed += result;
+        _StreamGrantWindow(stream);
+    }
+
+    else if (stream->_error.error) {
+        *error = stream->_error;
+        result = -1;
+    }
+
+    if ((result >= 0) && (stream->_data.length == stream->_data.offset) && __CFBitIsSet(stream->_flags, kStreamBitEnd))
+        *atEOF = TRUE;
+
+    _CFMutexUnlock(&conn->_lock);
+
+    return result;
+}
+
+
+/* static */ Boolean
+_HTTP2StreamCanRead(CFReadStreamRef readStream, void* info) {
+
+    _CFHTTP2Stream* stream = (_CFHTTP2Stream*)info;
+    Boolean result;
+
+    (void)readStream;	/* unused */
+
+    _CFMutexLock(&stream->_conn->_lock);
+    result = _StreamHasEvent(stream);
+    _CFMutexUnlock(&stream->_conn->_lock);
+
+    return result;
+}
+
+
+/* static */ void
+_HTTP2StreamClose(CFReadStreamRef readStream, void* info) {
+
+    _CFHTTP2Stream* stream = (_CFHTTP2Stream*)info;
+
+    (void)readStream;	/* unused */
+
+    _CFMutexLock(&stream->_conn->_lock);
+    _StreamCancel(stream);
+    _CFMutexUnlock(&stream->_conn->_lock);
+}
+
+
+/* static */ CFTypeRef
+_HTTP2StreamCopyProperty(CFReadStreamRef readStream, CFStringRef propertyName, void* info) {
+
+    _CFHTTP2Stream* stream = (_CFHTTP2Stream*)info;
+    _CFHTTP2Connection* conn = stream->_conn;
+    CFTypeRef result = NULL;
+
+    _CFMutexLock(&conn->_lock);
+
+    if (CFEqual(propertyName, kCFStreamPropertyHTTPResponseHeader)) {
+        if (stream->_response)
+            result = CFRetain(stream->_response);
+    }
+
+    else if (CFEqual(propertyName, _kCFStreamPropertyHTTPConnection))
+        result = CFRetain(conn);
+
+    else if (CFEqual(propertyName, kCFStreamPropertyHTTPRequestBytesWrittenCount))
+        result = CFNumberCreate(CFGetAllocator(readStream), kCFNumberLongLongType, &stream->_bytesWritten);
+
+    // Anything else is the socket's, such as the peer's certificates.
+    else if (conn->_rStream) {
+        result = CFReadStreamCopyProperty(conn->_rStream, propertyName);
+        if (!result)
+            result = CFWriteStreamCopyProperty(conn->_wStream, propertyName);
+    }
+
+    _CFMutexUnlock(&conn->_lock);
+
+    return result;
+}
+
+
+/* static */ Boolean
+_HTTP2StreamSetProperty(CFReadStreamRef readStream, CFStringRef propertyName, CFTypeRef propertyValue, void* info) {
+
+    (void)readStream;		/* unused */
+    (void)propertyName;		/* unused */
+    (void)propertyValue;	/* unused */
+    (void)info;				/* unused */
+
+    // The socket is shared by every stream, so none of them may change it.
+    return FALSE;
+}
+
+
+/* static */ void
+_HTTP2StreamSchedule(CFReadStreamRef readStream, CFRunLoopRef runLoop, CFStringRef runLoopMode, void* info) {
+
+    _CFHTTP2Stream* stream = (_CFHTTP2Stream*)info;
+    _CFHTTP2Connection* conn = stream->_conn;
+
+    (void)readStream;	/* unused */
+
+    _CFMutexLock(&conn->_lock);
+
+    if (_SchedulesAddRunLoopAndMode(stream->_schedules, runLoop, runLoopMode) &&
+        __CFBitIsSet(stream->_flags, kStreamBitQueued) && !__CFBitIsSet(stream->_flags, kStreamBitDone))
+    {
+        if (stream->_bodyStream)
+            CFReadStreamScheduleWithRunLoop(stream->_bodyStream, runLoop, runLoopMode);
+        _ConnectionReschedule(conn);
+    }
+
+    _CFMutexUnlock(&conn->_lock);
+}
+
+
+/* static */ void
+_HTTP2StreamUnschedule(CFReadStreamRef readStream, CFRunLoopRef runLoop, CFStringRef runLoopMode, void* info) {
+
+    _CFHTTP2Stream* stream = (_CFHTTP2Stream*)info;
+    _CFHTTP2Connection* conn = stream->_conn;
+
+    (void)readStream;	/* unused */
+
+    _CFMutexLock(&conn->_lock);
+
+    if (_SchedulesRemoveRunLoopAndMode(stream->_schedules, runLoop, runLoopMode) &&
+        __CFBitIsSet(stream->_flags, kStreamBitQueued) && !__CFBitIsSet(stream->_flags, kStreamBitDone))
+    {
+        if (stream->_bodyStream)
+            CFReadStreamUnscheduleFromRunLoop(stream->_bodyStream, runLoop, runLoopMode);
+        _ConnectionReschedule(conn);
+    }
+
+    _CFMutexUnlock(&conn->_lock);
+}
+
+
+#pragma mark -
+#pragma mark Extern Function Definitions (Internal)
+
+/* extern */ CFTypeID
+_CFHTTP2ConnectionGetTypeID(void) {
+
+    _CFDoOnce(&_kCFHTTP2ConnectionRegisterClass, _HTTP2ConnectionRegisterClass);
+
+    return _kCFHTTP2ConnectionTypeID;
+}
+
+
+/* extern */ CFTypeRef
+_CFHTTP2ConnectionCreate(CFAllocatorRef alloc, CFStringRef host, SInt32 port, UInt32 type, CFDictionaryRef streamProperties) {
+
+    _CFHTTP2Connection* conn = (_CFHTTP2Connection*)_CFRuntimeCreateInstance(alloc,
+                                                                             _CFHTTP2ConnectionGetTypeID(),
+                                                                             sizeof(conn[0]) - sizeof(CFRuntimeBase),
+                                                                             NULL);
+
+    if (!conn)
+        return NULL;
+
+    memset(((UInt8*)conn) + sizeof(CFRuntimeBase), 0, sizeof(conn[0]) - sizeof(CFRuntimeBase));
+
+    _CFMutexInit(&conn->_lock, TRUE);
+
+    conn->_host = CFStringCreateCopy(alloc, host);
+    conn->_port = port;
+    conn->_type = type;
+    conn->_schedules = CFArrayCreateMutable(alloc, 0, &kCFTypeArrayCallBacks);
+    if (streamProperties)
+        conn->_properties = CFDictionaryCreateCopy(alloc, streamProperties);
+
+    conn->_nextStreamID = 1;
+    conn->_peerMaxConcurrent = kHTTP2DefaultMaxConcurrent;
+    conn->_peerInitialWindow = kHTTP2DefaultWindow;
+    conn->_peerMaxFrame = kHTTP2DefaultFrameSize;
+    conn->_sendWindow = kHTTP2DefaultWindow;
+    conn->_recvWindow = kHTTP2DefaultWindow;
+    conn->_encoder.maxSize = kHTTP2DefaultTableSize;
+    conn->_decoder.maxSize = kHTTP2DefaultTableSize;
+    conn->_lastAccess = CFAbsoluteTimeGetCurrent();
+
+    if (!conn->_host || !conn->_schedules || (streamProperties && !conn->_properties)) {
+        CFRelease(conn);
+        return NULL;
+    }
+
+    return conn;
+}
+
+
+/* extern */ CFTypeRef
+_CFHTTP2ConnectionCopyShared(CFAllocatorRef alloc, CFStringRef host, SInt32 port) {
+
+    CFStringRef key = CFStringCreateWithFormat(alloc, NULL, _kCFHTTP2HostKeyFormat, host, (int)port);
+    _CFHTTP2Connection* conn = NULL;
+    _CFHTTP2Connection* stale = NULL;
+
+    if (!key)
+        return NULL;
+
+    __CFSpinLock(&_kCFHTTP2SharedLock);
+
+    if (!_kCFHTTP2SharedConnections) {
+        _kCFHTTP2SharedConnections = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        _kCFHTTP2Refusals = CFSetCreateMutable(kCFAllocatorDefault, 0, &kCFTypeSetCallBacks);
+    }
+
+    if (_kCFHTTP2SharedConnections && _kCFHTTP2Refusals && !CFSetContainsValue(_kCFHTTP2Refusals, key)) {
+
+        conn = (_CFHTTP2Connection*)CFDictionaryGetValue(_kCFHTTP2SharedConnections, key);
+
+        // The flags and times are read without the connection's lock, which would
+        // be taken out of order here; a stale answer costs the request a retry.
+        if (conn && (__CFBitIsSet(conn->_flags, kFlagBitNoNewStreams) ||
+                     (!conn->_head && ((CFAbsoluteTimeGetCurrent() - conn->_lastAccess) > kHTTP2SharedIdleTimeout))))
+        {
+            stale = (_CFHTTP2Connection*)CFRetain(conn);
+            CFDictionaryRemoveValue(_kCFHTTP2SharedConnections, key);
+            conn = NULL;
+        }
+
+        if (conn)
+            CFRetain(conn);
+
+        else {
+            conn = (_CFHTTP2Connection*)_CFHTTP2ConnectionCreate(alloc, host, port, kHTTP2, NULL);
+            if (conn) {
+                conn->_sharedKey = (CFStringRef)CFRetain(key);
+                CFDictionarySetValue(_kCFHTTP2SharedConnections, key, conn);
+            }
+        }
+    }
+
+    __CFSpinUnlock(&_kCFHTTP2SharedLock);
+
+    if (stale) {
+        _CFHTTP2ConnectionLost(stale);
+        CFRelease(stale);
+    }
+
+    CFRelease(key);
+
+    return conn;
+}
+
+
+/* extern */ CFReadStreamRef
+_CFHTTP2ConnectionEnqueue(CFTypeRef connection, CFHTTPMessageRef request, CFReadStreamRef bodyStream) {
+
+    _CFHTTP2Stream template;
+
+    memset(&template, 0, sizeof(template));
+    template._conn = (_CFHTTP2Connection*)connection;
+    template._request = request;
+    template._bodyStream = bodyStream;
+
+    return CFReadStreamCreate(CFGetAllocator(connection), &_kCFHTTP2StreamCallBacks, &template);
+}
+
+
+/* extern */ void
+_CFHTTP2ConnectionSetMaxStreams(CFTypeRef connection, CFIndex maxStreams) {
+
+    _CFHTTP2Connection* conn = (_CFHTTP2Connection*)connection;
+
+    _CFMutexLock(&conn->_lock);
+    conn->_maxActive = (maxStreams > 0) ? maxStreams : 0;
+    _ConnectionPump(conn);
+    _CFMutexUnlock(&conn->_lock);
+}
+
+
+/* extern */ void
+_CFHTTP2ConnectionLost(CFTypeRef connection) {
+
+    _CFHTTP2Connection* conn = (_CFHTTP2Connection*)connection;
+    CFStreamError error = {kCFStreamErrorDomainHTTP, kCFStreamErrorHTTPConnectionLost};
+    _CFHTTP2Stream* stream;
+
+    _CFMutexLock(&conn->_lock);
+
+    // Streams under way finish; those still waiting are sent elsewhere.
+    _ConnectionStopNewStreams(conn);
+
+    stream = conn->_head;
+    while (stream) {
+        _CFHTTP2Stream* next = stream->_next;
+        if (!__CFBitIsSet(stream->_flags, kStreamBitStarted))
+            _StreamFail(stream, &error);
+        stream = next;
+    }
+
+    if (!conn->_head)
+        _ConnectionClose(conn);
+
+    _CFMutexUnlock(&conn->_lock);
+}
+
+
+/* extern */ void
+_CFHTTP2ConnectionInvalidate(CFTypeRef connection, CFStreamError* error) {
+
+    _CFHTTP2Connection* conn = (_CFHTTP2Connection*)connection;
+
+    _CFMutexLock(&conn->_lock);
+    _ConnectionFail(conn, kHTTP2Cancel, error);
+    _CFMutexUnlock(&conn->_lock);
+}
+
+
+/* extern */ Boolean
+_CFHTTP2ConnectionAcceptsRequests(CFTypeRef connection) {
+
+    _CFHTTP2Connection* conn = (_CFHTTP2Connection*)connection;
+    Boolean result;
+
+    _CFMutexLock(&conn->_lock);
+    result = !__CFBitIsSet(conn->_flags, kFlagBitNoNewStreams);
+    _CFMutexUnlock(&conn->_lock);
+
+    return result;
+}
+
+
+/* extern */ CFAbsoluteTime
+_CFHTTP2ConnectionGetLastAccessTime(CFTypeRef connection) {
+
+    _CFHTTP2Connection* conn = (_CFHTTP2Connection*)connection;
+    CFAbsoluteTime result;
+
+    _CFMutexLock(&conn->_lock);
+    result = conn->_lastAccess;
+    _CFMutexUnlock(&conn->_lock);
+
+    return result;
+}
+
+
+/* extern */ int
+_CFHTTP2ConnectionGetQueueDepth(CFTypeRef connection) {
+
+    _CFHTTP2Connection* conn = (_CFHTTP2Connection*)connection;
+    _CFHTTP2Stream* stream;
+    int result = 0;
+
+    _CFMutexLock(&conn->_lock);
+    for (stream = conn->_head; stream; stream = stream->_next)
+        result++;
+    _CFMutexUnlock(&conn->_lock);
+
+    return result;
+}
+
+
+/* extern */ CFArrayRef
+_CFHTTP2ConnectionCopyHPACKDecodedFields(CFTypeRef connection, CFDataRef block) {
+
+    _CFHTTP2Connection* conn = (_CFHTTP2Connection*)connection;
+    CFMutableArrayRef result = CFArrayCreateMutable(CFGetAllocator(connection), 0, &kCFTypeArrayCallBacks);
+
+    if (!result)
+        return NULL;
+
+    // Names and values alternate, as the decoder hands them to a response.
+    _CFMutexLock(&conn->_lock);
+    if (!_HPACKDecodeBlock(conn, CFDataGetBytePtr(block), CFDataGetLength(block), _HPACKCollectField, result)) {
+        CFRelease(result);
+        result = NULL;
+    }
+    _CFMutexUnlock(&conn->_lock);
+
+    return result;
+}
+
+
+/* extern */ CFDataRef
+_CFHTTP2ConnectionCreateHPACKBlock(CFTypeRef connection, CFArrayRef fields) {
+
+    _CFHTTP2Connection* conn = (_CFHTTP2Connection*)connection;
+    CFAllocatorRef alloc = CFGetAllocator(connection);
+    CFIndex i, count = CFArrayGetCount(fields);
+    _CFHTTP2Buffer block;
+    CFDataRef result = NULL;
+
+    memset(&block, 0, sizeof(block));
+
+    _CFMutexLock(&conn->_lock);
+
+    // A pending table size update goes first, as it would on a request.
+    if (__CFBitIsSet(conn->_flags, kFlagBitTableSizeUpdate)) {
+        _HPACKEncodeInteger(&block, 0x20, 5, conn->_encoder.maxSize, alloc);
+        __CFBitClear(conn->_flags, kFlagBitTableSizeUpdate);
+    }
+
+    for (i = 0; (i + 1) < count; i += 2) {
+
+        UInt8 name[256], value[256];
+        CFIndex nameLength, valueLength;
+        CFStringRef string = (CFStringRef)CFArrayGetValueAtIndex(fields, i);
+
+        CFStringGetBytes(string, CFRangeMake(0, CFStringGetLength(string)), kCFStringEncodingISOLatin1, 0, FALSE, name, sizeof(name), &nameLength);
+        string = (CFStringRef)CFArrayGetValueAtIndex(fields, i + 1);
+        CFStringGetBytes(string, CFRangeMake(0, CFStringGetLength(string)), kCFStringEncodingISOLatin1, 0, FALSE, value, sizeof(value), &valueLength);
+
+        _HPACKEncodeField(conn, &block, name, nameLength, value, valueLength, FALSE);
+    }
+
+    _CFMutexUnlock(&conn->_lock);
+
+    if (!block.failed)
+        result = CFDataCreate(alloc, block.bytes, block.length);
+    _BufferFree(&block, alloc);
+
+    return result;
+}
+
+
+/* extern */ void
+_CFHTTP2ConnectionSetHPACKEncoderTableSize(CFTypeRef connection, CFIndex maxSize) {
+
+    _CFHTTP2Connection* conn = (_CFHTTP2Connection*)connection;
+
+    _CFMutexLock(&conn->_lock);
+    _HPACKSetEncoderTableSize(conn, (maxSize > 0) ? maxSize : 0);
+    _CFMutexUnlock(&conn->_lock);
+}
+
+
+/* extern */ CFIndex
+_CFHTTP2ConnectionGetHPACKTableSize(CFTypeRef connection, Boolean encoder) {
+
+    _CFHTTP2Connection* conn = (_CFHTTP2Connection*)connection;
+    CFIndex result;
+
+    _CFMutexLock(&conn->_lock);
+    result = encoder ? conn->_encoder.size : conn->_decoder.size;
+    _CFMutexUnlock(&conn->_lock);
+
+    return result;
+}
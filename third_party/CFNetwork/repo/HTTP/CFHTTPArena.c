@@ -0,0 +1,483 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+/*
+ *  CFHTTPArena.c
+ *  CFNetwork
+ *
+ */
+
+
+#pragma mark Description
+/*
+    An arena is a CFAllocator that carves blocks out of chunks taken from a backing
+    allocator and gives nothing back until the arena itself goes away.  A message
+    created with one allocates its headers, strings and data from it too, since
+    CFHTTPMessage makes everything it owns with its own allocator, and every one of
+    those objects retains the arena.  So when the last of them is released the arena
+    is released as well, and hands its chunks back to the backing allocator in one
+    go, instead of each object being freed on its own.
+
+    Deallocating a block does nothing, except for the block most recently handed
+    out, whose space is taken back; and that block can grow in place, which is what
+    a CFMutableData being appended to mostly asks for.  Blocks too big for a chunk
+    to hold a few of them are allocated from the backing allocator on their own and
+    are freed when deallocated, so a large body grown by reallocation does not leave
+    each of its earlier copies behind in the arena.
+
+    The context pools are free lists of fixed-size blocks, for the per-request
+    structures of HTTP streams and filters.  They only hold blocks of the system
+    default allocator; a stream made with any other allocator allocates its contexts
+    from it as before.
+*/
+
+#pragma mark -
+#pragma mark Includes
+#if HAVE_CONFIG_H
+#include "opencfnetwork-config.h"
+#endif
+
+#include <CFNetwork/CFHTTPMessagePriv.h>
+#include "CFNetworkInternal.h"
+#include "CFHTTPInternal.h"
+
+#include <string.h>
+
+
+#pragma mark -
+#pragma mark Constants
+
+// The size of each chunk, unless the creator asks for another
+#define kHTTPArenaDefaultChunkSize		4096
+#define kHTTPArenaMinimumChunkSize		256
+
+// Blocks bigger than this fraction of a chunk are allocated on their own
+#define kHTTPArenaLargeFraction			4
+
+// All blocks are aligned to this
+#define kHTTPArenaAlignment				16
+
+// The most blocks a context pool keeps for reuse
+#define kHTTPContextPoolDepth			32
+
+#define ARENA_ROUND(size)		(((size) + (kHTTPArenaAlignment - 1)) & ~((CFIndex)kHTTPArenaAlignment - 1))
+
+#ifdef __CONSTANT_CFSTRINGS__
+#define _kCFHTTPArenaDescribeFormat		CFSTR("<CFHTTPArena %p>{chunks = %ld, reserved = %ld}")
+#else
+CONST_STRING_DECL_LOCAL(_kCFHTTPArenaDescribeFormat, "<CFHTTPArena %p>{chunks = %ld, reserved = %ld}")
+#endif	/* __CONSTANT_CFSTRINGS__ */
+
+
+#pragma mark -
+#pragma mark Type Declarations
+
+// The chunk's blocks follow this header
+typedef struct _CFHTTPArenaChunk {
+    struct _CFHTTPArenaChunk *next;
+    CFIndex size;
+    CFIndex used;
+} _CFHTTPArenaChunk;
+
+// A large block is preceded by this, and then by the block header like any other
+typedef struct _CFHTTPArenaLarge {
+    struct _CFHTTPArenaLarge *prev, *next;
+} _CFHTTPArenaLarge;
+
+typedef struct {
+    CFIndex size;
+    CFIndex isLarge;
+} _CFHTTPArenaBlock;
+
+typedef struct {
+    CFSpinLock_t lock;
+    CFAllocatorRef backing;
+    CFIndex chunkSize;
+    CFIndex largeSize;              // Blocks bigger than this are large
+    _CFHTTPArenaChunk *chunks;      // The current chunk first
+    _CFHTTPArenaLarge *large;       // The large blocks not yet deallocated
+    _CFHTTPArenaBlock *last;        // The block most recently carved from the current chunk, if it is still there
+    _CFHTTPArenaStatistics stats;
+} _CFHTTPArena;
+
+
+#pragma mark -
+#pragma mark Static Function Declarations
+
+static void *arenaAllocate(CFIndex size, CFOptionFlags hint, void *info);
+static void *arenaReallocate(void *ptr, CFIndex newsize, CFOptionFlags hint, void *info);
+static void arenaDeallocate(void *ptr, void *info);
+static void arenaRelease(const void *info);
+static CFStringRef arenaCopyDescription(const void *info);
+
+static _CFHTTPArenaBlock *allocateBlock(_CFHTTPArena *arena, CFIndex size);
+static void deallocateBlock(_CFHTTPArena *arena, _CFHTTPArenaBlock *block);
+static _CFHTTPArena *getArena(CFAllocatorRef allocator);
+
+static Boolean contextPoolUsable(CFAllocatorRef alloc);
+
+
+#pragma mark -
+#pragma mark Static Function Definitions
+
+// Called with the arena locked
+/* static */ _CFHTTPArenaBlock *
+allocateBlock(_CFHTTPArena *arena, CFIndex size) {
+
+    _CFHTTPArenaBlock *block;
+    _CFHTTPArenaChunk *chunk = arena->chunks;
+    CFIndex rounded = ARENA_ROUND(size);
+
+    if (rounded > arena->largeSize) {
+
+        _CFHTTPArenaLarge *large = CFAllocatorAllocate(arena->backing, sizeof(_CFHTTPArenaLarge) + sizeof(_CFHTTPArenaBlock) + size, 0);
+        if (!large) return NULL;
+
+        large->prev = NULL;
+        large->next = arena->large;
+        if (large->next) large->next->prev = large;
+        arena->large = large;
+
+        block = (_CFHTTPArenaBlock *)(large + 1);
+        block->size = size;
+        block->isLarge = TRUE;
+
+        arena->stats.backingAllocations++;
+        arena->stats.bytesReserved += size;
+    }
+
+    else {
+
+        if (!chunk || (chunk->size - chunk->used) < (CFIndex)sizeof(_CFHTTPArenaBlock) + rounded) {
+
+            chunk = CFAllocatorAllocate(arena->backing, ARENA_ROUND(sizeof(_CFHTTPArenaChunk)) + arena->chunkSize, 0);
+            if (!chunk) return NULL;
+
+            chunk->next = arena->chunks;
+            chunk->size = arena->chunkSize;
+            chunk->used = 0;
+            arena->chunks = chunk;
+
+            arena->stats.backingAllocations++;
+            arena->stats.chunks++;
+            arena->stats.bytesReserved += arena->chunkSize;
+        }
+
+        block = (_CFHTTPArenaBlock *)((UInt8 *)chunk + ARENA_ROUND(sizeof(_CFHTTPArenaChunk)) + chunk->used);
+        block->size = rounded;
+        block->isLarge = FALSE;
+
+        chunk->used += sizeof(_CFHTTPArenaBlock) + rounded;
+        arena->last = block;
+    }
+
+    arena->stats.allocations++;
+
+    return block;
+}
+
+
+// Called with the arena locked
+/* static */ void
+deallocateBlock(_CFHTTPArena *arena, _CFHTTPArenaBlock *block) {
+
+    if (block->isLarge) {
+
+        _CFHTTPArenaLarge *large = ((_CFHTTPArenaLarge *)block) - 1;
+
+        if (large->prev) large->prev->next = large->next;
+        else arena->large = large->next;
+        if (large->next) large->next->prev = large->prev;
+
+        arena->stats.bytesReserved -= block->size;
+
+        CFAllocatorDeallocate(arena->backing, large);
+    }
+
+    // The most recent block can simply be given back to its chunk.
+    else if (block == arena->last) {
+        arena->chunks->used -= sizeof(_CFHTTPArenaBlock) + block->size;
+        arena->last = NULL;
+    }
+}
+
+
+/* static */ void *
+arenaAllocate(CFIndex size, CFOptionFlags hint, void *info) {
+
+    _CFHTTPArena *arena = (_CFHTTPArena *)info;
+    _CFHTTPArenaBlock *block;
+
+    (void)hint;     // unused
+
+    __CFSpinLock(&arena->lock);
+    block = allocateBlock(arena, size);
+    __CFSpinUnlock(&arena->lock);
+
+    return block ? (block + 1) : NULL;
+}
+
+
+/* static */ void *
+arenaReallocate(void *ptr, CFIndex newsize, CFOptionFlags hint, void *info) {
+
+    _CFHTTPArena *arena = (_CFHTTPArena *)info;
+    _CFHTTPArenaBlock *block = ((_CFHTTPArenaBlock *)ptr) - 1;
+    _CFHTTPArenaBlock *result = NULL;
+
+    (void)hint;     // unused
+
+    __CFSpinLock(&arena->lock);
+
+    if (block->isLarge && newsize > arena->largeSize) {
+
+        // A large block stays large; the backing allocator may be able to grow it where it is.
+        _CFHTTPArenaLarge *large = ((_CFHTTPArenaLarge *)block) - 1;
+        _CFHTTPArenaLarge *moved = CFAllocatorReallocate(arena->backing, large, sizeof(_CFHTTPArenaLarge) + sizeof(_CFHTTPArenaBlock) + newsize, 0);
+
+        if (moved) {
+            if (moved->prev) moved->prev->next = moved;
+            else arena->large = moved;
+            if (moved->next) moved->next->prev = moved;
+
+            result = (_CFHTTPArenaBlock *)(moved + 1);
+            arena->stats.bytesReserved += newsize - result->size;
+            result->size = newsize;
+        }
+    }
+
+    else if (!block->isLarge && ARENA_ROUND(newsize) <= block->size) {
+        result = block;
+    }
+
+    // The most recent block grows in place if its chunk has the room.
+    else if (block == arena->last && ARENA_ROUND(newsize) <= arena->largeSize &&
+             (arena->chunks->size - arena->chunks->used) >= ARENA_ROUND(newsize) - block->size)
+    {
+        arena->chunks->used += ARENA_ROUND(newsize) - block->size;
+        block->size = ARENA_ROUND(newsize);
+        result = block;
+    }
+
+    else {
+
+        CFIndex oldsize = block->size;
+
+        result = allocateBlock(arena, newsize);
+
+        if (result) {
+            memmove(result + 1, block + 1, (oldsize < newsize) ? oldsize : newsize);
+            deallocateBlock(arena, block);
+        }
+    }
+
+    __CFSpinUnlock(&arena->lock);
+
+    return result ? (result + 1) : NULL;
+}
+
+
+/* static */ void
+arenaDeallocate(void *ptr, void *info) {
+
+    _CFHTTPArena *arena = (_CFHTTPArena *)info;
+
+    __CFSpinLock(&arena->lock);
+    deallocateBlock(arena, ((_CFHTTPArenaBlock *)ptr) - 1);
+    __CFSpinUnlock(&arena->lock);
+}
+
+
+// Called once the arena allocator itself is deallocated, so nothing can be using it.
+/* static */ void
+arenaRelease(const void *info) {
+
+    _CFHTTPArena *arena = (_CFHTTPArena *)info;
+    CFAllocatorRef backing = arena->backing;
+
+    while (arena->chunks) {
+        _CFHTTPArenaChunk *chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        CFAllocatorDeallocate(backing, chunk);
+    }
+
+    while (arena->large) {
+        _CFHTTPArenaLarge *large = arena->large;
+        arena->large = large->next;
+        CFAllocatorDeallocate(backing, large);
+    }
+
+    CFAllocatorDeallocate(backing, arena);
+    CFRelease(backing);
+}
+
+
+/* static */ CFStringRef
+arenaCopyDescription(const void *info) {
+
+    _CFHTTPArena *arena = (_CFHTTPArena *)info;
+
+    return CFStringCreateWithFormat(arena->backing, NULL, _kCFHTTPArenaDescribeFormat, arena, (long)arena->stats.chunks, (long)arena->stats.bytesReserved);
+}
+
+
+/* static */ _CFHTTPArena *
+getArena(CFAllocatorRef allocator) {
+
+    CFAllocatorContext context;
+
+    if (!allocator) return NULL;
+
+    memset(&context, 0, sizeof(context));
+    CFAllocatorGetContext(allocator, &context);
+
+    return (context.allocate == arenaAllocate) ? (_CFHTTPArena *)context.info : NULL;
+}
+
+
+/* static */ Boolean
+contextPoolUsable(CFAllocatorRef alloc) {
+
+    if (!alloc || alloc == kCFAllocatorDefault)
+        alloc = CFAllocatorGetDefault();
+
+    return (alloc == kCFAllocatorSystemDefault);
+}
+
+
+#pragma mark -
+#pragma mark Extern Function Definitions (Internal)
+
+/* extern */ void *
+_CFHTTPContextPoolAllocate(_CFHTTPContextPool *pool, CFAllocatorRef alloc) {
+
+    void *result = NULL;
+
+    if (!contextPoolUsable(alloc))
+        return CFAllocatorAllocate(alloc, pool->size, 0);
+
+    __CFSpinLock(&pool->lock);
+    if (pool->free) {
+        result = pool->free;
+        pool->free = *(void **)result;
+        pool->count--;
+    }
+    __CFSpinUnlock(&pool->lock);
+
+    if (!result)
+        result = CFAllocatorAllocate(kCFAllocatorSystemDefault, pool->size, 0);
+
+    return result;
+}
+
+
+/* extern */ void
+_CFHTTPContextPoolDeallocate(_CFHTTPContextPool *pool, CFAllocatorRef alloc, void *context) {
+
+    if (contextPoolUsable(alloc)) {
+
+        __CFSpinLock(&pool->lock);
+        if (pool->count < kHTTPContextPoolDepth) {
+            *(void **)context = pool->free;
+            pool->free = context;
+            pool->count++;
+            context = NULL;
+        }
+        __CFSpinUnlock(&pool->lock);
+
+        alloc = kCFAllocatorSystemDefault;
+    }
+
+    if (context)
+        CFAllocatorDeallocate(alloc, context);
+}
+
+
+#pragma mark -
+#pragma mark Extern Function Definitions (SPI)
+
+/* extern */ CFAllocatorRef
+_CFHTTPArenaCreate(CFAllocatorRef backing, CFIndex chunkSize) {
+
+    CFAllocatorRef result = NULL;
+    _CFHTTPArena *arena;
+
+    if (!backing || backing == kCFAllocatorDefault)
+        backing = CFAllocatorGetDefault();
+
+    // An arena on an arena would never give anything back.
+    if (getArena(backing))
+        backing = getArena(backing)->backing;
+
+    if (chunkSize <= 0)
+        chunkSize = kHTTPArenaDefaultChunkSize;
+    else if (chunkSize < kHTTPArenaMinimumChunkSize)
+        chunkSize = kHTTPArenaMinimumChunkSize;
+
+    arena = CFAllocatorAllocate(backing, sizeof(_CFHTTPArena), 0);
+
+    if (arena) {
+
+        CFAllocatorContext context = {
+            0,                      // version
+            arena,                  // info
+            NULL,                   // retain
+            arenaRelease,           // release
+            arenaCopyDescription,   // copyDescription
+            arenaAllocate,          // allocate
+            arenaReallocate,        // reallocate
+            arenaDeallocate,        // deallocate
+            NULL                    // preferredSize
+        };
+
+        memset(arena, 0, sizeof(arena[0]));
+        CF_SPINLOCK_INIT_FOR_STRUCTS(arena->lock);
+        arena->backing = CFRetain(backing);
+        arena->chunkSize = ARENA_ROUND(chunkSize);
+        arena->largeSize = arena->chunkSize / kHTTPArenaLargeFraction;
+
+        result = CFAllocatorCreate(backing, &context);
+
+        if (!result) {
+            CFRelease(backing);
+            CFAllocatorDeallocate(backing, arena);
+        }
+    }
+
+    return result;
+}
+
+
+/* extern */ Boolean
+_CFHTTPArenaGetStatistics(CFAllocatorRef allocator, _CFHTTPArenaStatistics *stats) {
+
+    _CFHTTPArena *arena = getArena(allocator);
+
+    if (!arena)
+        return FALSE;
+
+    __CFSpinLock(&arena->lock);
+    memmove(stats, &arena->stats, sizeof(stats[0]));
+    __CFSpinUnlock(&arena->lock);
+
+    return TRUE;
+}
@@ -244,6 +244,15 @@ CONST_STRING_DECL_LOCAL(kCFHTTPAuthenticationNegotiateNegotiateFormat, "Negotiat
 CONST_STRING_DECL_LOCAL(kCFHTTPAuthenticationNegotiateNTLMFormat, "NTLM %@")
 CONST_STRING_DECL_LOCAL(kCFHTTPAuthenticationNTLMDomainUserSeparator, "\\")
 #endif	/* __CONSTANT_CFSTRINGS__ */
+						 
+// Authentication cache strings
+#ifdef __CONSTANT_CFSTRINGS__
+#define kCFHTTPAuthenticationCacheQuerySeparator		CFSTR("?")
+#define kCFHTTPAuthenticationCachePathSeparator			CFSTR("/")
+#else
+CONST_STRING_DECL_LOCAL(kCFHTTPAuthenticationCacheQuerySeparator, "?")
+CONST_STRING_DECL_LOCAL(kCFHTTPAuthenticationCachePathSeparator, "/")
+#endif	/* __CONSTANT_CFSTRINGS__ */
 
 						 
 #if 0
@@ -262,6 +271,7 @@ struct _CFHTTPAuthentication {
 	CFStringRef				_user;			// Currently only used for ntlm
 	CFStringRef				_domain;		// Currently only used for ntlm
 	CFDataRef				_hash[2];		// Currently only used for ntlm (1st is ntlm hash, 2nd is lm hash)
+	CFDictionaryRef			_credentials;	// Credentials last applied; only kept for basic and digest
 
     CFMutableDictionaryRef	_preferred;		// non-retained pointer to one of the schemes
     CFMutableDictionaryRef	_schemes;		// scheme props keyed by scheme name
@@ -324,6 +334,25 @@ typedef struct {
 } _AuthConnectionSpecific;
 
 
+/*
+	Entries in the authentication cache.  Each one records the protection space in which an
+	authentication object was accepted: the scheme, host and port of the server or proxy, the
+	realm and whether it was for a proxy.  Origin entries also hold the URL prefixes they
+	cover, which are the challenge's domain list and the directory of the accepted request.
+	Everything needed to match a request is copied into the entry so lookups never need to
+	take the object's lock while holding the cache lock.
+*/
+typedef struct {
+	CFStringRef				_scheme;		// Scheme of the server or proxy
+	CFStringRef				_host;			// Host of the server or proxy
+	SInt32					_port;
+	CFStringRef				_realm;			// NULL for schemes without a realm
+	Boolean					_proxy;
+	CFArrayRef				_spaces;		// URL prefixes covered by an origin entry
+	CFHTTPAuthenticationRef	_auth;
+} _AuthCacheEntry;
+
+
 #if 0
 #pragma mark -
 #pragma mark Extern Function Declarations
@@ -382,6 +411,12 @@ static _AuthConnectionSpecific* _AuthConnectionSpecificRetain(CFAllocatorRef all
 static void _AuthConnectionSpecificRelease(CFAllocatorRef allocator, _AuthConnectionSpecific* specific);
 
 static Boolean _CFMD5(const UInt8* d, UInt32 n, UInt8* md, UInt32 md_length);
+
+static Boolean _AuthCacheCopySpaceForURL(CFURLRef url, CFStringRef* scheme, CFStringRef* host, SInt32* port);
+static CFStringRef _AuthCacheCreateDirectoryForURL(CFAllocatorRef alloc, CFURLRef url);
+static Boolean _AuthCacheEntryMatches(_AuthCacheEntry* entry, CFStringRef scheme, CFStringRef host, SInt32 port, Boolean proxy, CFStringRef url);
+static void _AuthCacheEntryRelease(_AuthCacheEntry* entry);
+static Boolean _CFHTTPAuthenticationConnectionIsAuthenticated_Unsafe(CFHTTPAuthenticationRef auth, const void* connection);
 //static Boolean _CFCanTryKerberos(void);
 
 #if 0
@@ -392,6 +427,12 @@ static Boolean _CFMD5(const UInt8* d, UInt32 n, UInt8* md, UInt32 md_length);
 static CFTypeID kHTTPAuthenticationTypeID = _kCFRuntimeNotATypeID;
 static _CFOnceLock gHTTPAuthenticationClassRegistration = _CFOnceInitializer;
 
+#define kAuthCacheMaxEntries		32
+
+static CFSpinLock_t gAuthCacheLock = CFSpinLockInit;
+static _AuthCacheEntry* gAuthCache[kAuthCacheMaxEntries];	// Most recently used first
+static CFIndex gAuthCacheCount = 0;
+
 
 #if 0
 #pragma mark -
@@ -435,6 +476,9 @@ _HTTPAuthenticationDestroy(CFHTTPAuthenticationRef auth) {
 	if (auth->_domain)
 		CFRelease(auth->_domain);
 	
+	if (auth->_credentials)
+		CFRelease(auth->_credentials);
+	
 	for (i = 0; i < (sizeof(auth->_hash) / sizeof(auth->_hash[0])); i++) {
 
 		if (auth->_hash[i])
@@ -1995,6 +2039,7 @@ CFHTTPAuthenticationRef CFHTTPAuthenticationCreateFromResponse(CFAllocatorRef al
     result->_connections = CFDictionaryCreateMutable(alloc, 0, &key_cbs, &value_cbs);
 	result->_user = NULL;
 	result->_domain = NULL;
+	result->_credentials = NULL;
 	memset(result->_hash, 0, sizeof(result->_hash));
 
 #ifdef __WIN32__
@@ -2526,8 +2571,16 @@ Boolean _CFApplyCredentials_Unsafe(CFHTTPMessageRef request, CFHTTPAuthenticatio
             _CFHTTPAuthenticationSetError(auth, kCFStreamErrorDomainHTTP, kCFStreamErrorHTTPAuthenticationTypeUnsupported);
         }
     
-        if (result)
+        if (result) {
             _CFHTTPMessageSetAuthentication(request, auth, auth->_proxy);
+
+            // Remember the credentials so the authentication cache can apply them ahead of a challenge.
+            if ((method == kCFHTTPAuthenticationSchemeBasic || method == kCFHTTPAuthenticationSchemeDigest) && (dict != auth->_credentials)) {
+                if (auth->_credentials)
+                    CFRelease(auth->_credentials);
+                auth->_credentials = CFDictionaryCreateCopy(CFGetAllocator(auth), dict);
+            }
+        }
     }
 
     *error = auth->_error;
@@ -2905,3 +2958,405 @@ Boolean CFHTTPMessageAddAuthentication(CFHTTPMessageRef request, CFHTTPMessageRe
 
     return result;
 }
+
+
+#if 0
+#pragma mark -
+#pragma mark Authentication Cache
+#endif
+
+/*
+	The authentication cache is process wide.  Once a server or proxy accepts an
+	authentication object, the object is remembered against the protection space it
+	was accepted in and later requests falling into that space have credentials
+	applied before they go out, instead of being sent bare and waiting for a 401 or 407.
+
+	Basic and digest apply the credentials last given to the object again.  Since the
+	object is shared, digest keeps answering from the current nonce, bumping the nonce
+	count for every request under the object's lock, until the server sends a nextnonce
+	or marks the nonce stale.  NTLM and Negotiate authenticate the connection rather than
+	the request, so their entries only apply on a pooled connection on which the object
+	has already completed the handshake.
+
+	The cache lock is never held while taking an object's lock.
+*/
+
+
+/* static */ Boolean
+_AuthCacheCopySpaceForURL(CFURLRef url, CFStringRef* scheme, CFStringRef* host, SInt32* port) {
+	
+	*scheme = CFURLCopyScheme(url);
+	*host = CFURLCopyHostName(url);
+	*port = CFURLGetPortNumber(url);
+	
+	if (!*scheme || !*host) {
+		
+		if (*scheme) CFRelease(*scheme);
+		if (*host) CFRelease(*host);
+		
+		return FALSE;
+	}
+	
+	if (*port == -1)
+		*port = (CFStringCompare(*scheme, kCFHTTPAuthenticationHTTPSScheme, kCFCompareCaseInsensitive) == kCFCompareEqualTo) ? 443 : 80;
+	
+	return TRUE;
+}
+
+
+/* static */ CFStringRef
+_AuthCacheCreateDirectoryForURL(CFAllocatorRef alloc, CFURLRef url) {
+	
+	CFURLRef abs_url = CFURLCopyAbsoluteURL(url);
+	CFStringRef url_str = CFURLGetString(abs_url);
+	CFRange range = CFRangeMake(0, CFStringGetLength(url_str));
+	CFRange found;
+	CFStringRef result;
+	
+	/* Everything at or below the last path separator is in the same space (RFC 2617 section 2). */
+	if (CFStringFindWithOptions(url_str, kCFHTTPAuthenticationCacheQuerySeparator, range, 0, &found))
+		range.length = found.location;
+	
+	if (CFStringFindWithOptions(url_str, kCFHTTPAuthenticationCachePathSeparator, range, kCFCompareBackwards, &found))
+		range.length = found.location + 1;
+	
+	result = CFStringCreateWithSubstring(alloc, url_str, range);
+	
+	CFRelease(abs_url);
+	
+	return result;
+}
+
+
+/* static */ Boolean
+_AuthCacheEntryMatches(_AuthCacheEntry* entry, CFStringRef scheme, CFStringRef host, SInt32 port, Boolean proxy, CFStringRef url) {
+	
+	CFIndex i, count;
+	
+	if ((entry->_proxy != proxy) || (entry->_port != port))
+		return FALSE;
+	
+	if (CFStringCompare(entry->_scheme, scheme, kCFCompareCaseInsensitive) != kCFCompareEqualTo)
+		return FALSE;
+	
+	if (CFStringCompare(entry->_host, host, kCFCompareCaseInsensitive) != kCFCompareEqualTo)
+		return FALSE;
+	
+	/* A proxy's credentials apply to everything sent through it. */
+	if (proxy)
+		return TRUE;
+	
+	count = entry->_spaces ? CFArrayGetCount(entry->_spaces) : 0;
+	for (i = 0; i < count; i++) {
+		
+		if (CFStringHasPrefix(url, (CFStringRef)CFArrayGetValueAtIndex(entry->_spaces, i)))
+			return TRUE;
+	}
+	
+	return FALSE;
+}
+
+
+/* static */ void
+_AuthCacheEntryRelease(_AuthCacheEntry* entry) {
+	
+	CFRelease(entry->_scheme);
+	CFRelease(entry->_host);
+	
+	if (entry->_realm)
+		CFRelease(entry->_realm);
+	
+	if (entry->_spaces)
+		CFRelease(entry->_spaces);
+	
+	CFRelease(entry->_auth);
+	
+	CFAllocatorDeallocate(kCFAllocatorDefault, entry);
+}
+
+
+/* static */ Boolean
+_CFHTTPAuthenticationConnectionIsAuthenticated_Unsafe(CFHTTPAuthenticationRef auth, const void* connection) {
+	
+	Boolean result = FALSE;
+	_AuthConnectionSpecific* specific = connection ? (_AuthConnectionSpecific*)CFDictionaryGetValue(auth->_connections, connection) : NULL;
+	
+	_CFAssertLocked(&auth->_lock);
+	
+	if (specific) {
+		
+#if defined(__MACH__)
+		CFStringRef method = _CFHTTPAuthenticationGetProperty(auth, kCFHTTPAuthenticationPropertyMethod);
+		
+		if (method == kCFHTTPAuthenticationSchemeNTLM)
+			result = !specific->_negotiation && specific->_authdata && !specific->_ntlm;
+		
+		else if (method == kCFHTTPAuthenticationSchemeNegotiate)
+			result = specific->_negotiation && specific->_authdata && !specific->_ntlm;
+#endif /* defined(__MACH__) */
+	}
+	
+	return result;
+}
+
+
+/* extern */ void
+_CFHTTPAuthenticationCacheUpdate(CFHTTPAuthenticationRef auth, CFHTTPMessageRef response, CFURLRef url) {
+	
+	CFIndex i;
+	UInt32 code = CFHTTPMessageGetResponseStatusCode(response);
+	CFAllocatorRef alloc = CFGetAllocator(auth);
+	_AuthCacheEntry* entry = NULL;
+	_AuthCacheEntry* evicted[2] = {NULL, NULL};
+	
+	_CFMutexLock(&auth->_lock);
+	
+	if (auth->_error.error) {
+		
+		_CFMutexUnlock(&auth->_lock);
+		
+		/* The credentials are no good any more, so stop sending them ahead of a challenge. */
+		_CFHTTPAuthenticationCacheRemove(auth);
+		
+		return;
+	}
+	
+	/* A challenge for this object means it wasn't accepted; a stale digest nonce ends up here too. */
+	if (code != (auth->_proxy ? 407 : 401)) {
+		
+		CFStringRef method = _CFHTTPAuthenticationGetProperty(auth, kCFHTTPAuthenticationPropertyMethod);
+		Boolean usable = (method == kCFHTTPAuthenticationSchemeNTLM) || (method == kCFHTTPAuthenticationSchemeNegotiate) ||
+						 (auth->_credentials != NULL);
+		
+		if (usable && url)
+			entry = (_AuthCacheEntry*)CFAllocatorAllocate(kCFAllocatorDefault, sizeof(entry[0]), 0);
+		
+		if (entry && !_AuthCacheCopySpaceForURL(url, &entry->_scheme, &entry->_host, &entry->_port)) {
+			CFAllocatorDeallocate(kCFAllocatorDefault, entry);
+			entry = NULL;
+		}
+		
+		if (entry) {
+			
+			CFStringRef realm = _CFHTTPAuthenticationGetProperty(auth, kCFHTTPAuthenticationPropertyRealm);
+			
+			entry->_realm = realm ? CFStringCreateCopy(alloc, realm) : NULL;
+			entry->_proxy = auth->_proxy;
+			entry->_spaces = NULL;
+			entry->_auth = (CFHTTPAuthenticationRef)CFRetain(auth);
+			
+			if (!auth->_proxy) {
+				
+				CFMutableArrayRef spaces = CFArrayCreateMutable(alloc, 0, &kCFTypeArrayCallBacks);
+				CFArrayRef domains = _CFHTTPAuthenticationGetProperty(auth, kCFHTTPAuthenticationPropertyDomain);
+				CFStringRef directory = _AuthCacheCreateDirectoryForURL(alloc, url);
+				CFIndex count = domains ? CFArrayGetCount(domains) : 0;
+				
+				CFArrayAppendValue(spaces, directory);
+				CFRelease(directory);
+				
+				for (i = 0; i < count; i++) {
+					
+					CFURLRef abs_url = CFURLCopyAbsoluteURL((CFURLRef)CFArrayGetValueAtIndex(domains, i));
+					
+					CFArrayAppendValue(spaces, CFURLGetString(abs_url));
+					CFRelease(abs_url);
+				}
+				
+				entry->_spaces = spaces;
+			}
+		}
+	}
+	
+	_CFMutexUnlock(&auth->_lock);
+	
+	if (!entry)
+		return;
+	
+	__CFSpinLock(&gAuthCacheLock);
+	
+	/* Replace whatever was held for the same space and realm, or failing that, the least recently used. */
+	for (i = 0; i < gAuthCacheCount; i++) {
+		
+		_AuthCacheEntry* e = gAuthCache[i];
+		
+		if ((e->_auth == auth) ||
+			((e->_proxy == entry->_proxy) &&
+			 (e->_port == entry->_port) &&
+			 (CFStringCompare(e->_scheme, entry->_scheme, kCFCompareCaseInsensitive) == kCFCompareEqualTo) &&
+			 (CFStringCompare(e->_host, entry->_host, kCFCompareCaseInsensitive) == kCFCompareEqualTo) &&
+			 ((e->_realm == entry->_realm) || (e->_realm && entry->_realm && CFEqual(e->_realm, entry->_realm)))))
+		{
+			break;
+		}
+	}
+	
+	if (i < gAuthCacheCount)
+		evicted[0] = gAuthCache[i];
+	else if (gAuthCacheCount == kAuthCacheMaxEntries)
+		evicted[0] = gAuthCache[--i];
+	else
+		gAuthCacheCount++;
+	
+	memmove(&gAuthCache[1], &gAuthCache[0], i * sizeof(gAuthCache[0]));
+	gAuthCache[0] = entry;
+	
+	/* Only one entry is kept per object; a second may be in another space the object has moved from. */
+	for (i = 1; i < gAuthCacheCount; i++) {
+		
+		if (gAuthCache[i]->_auth == auth) {
+			
+			evicted[1] = gAuthCache[i];
+			memmove(&gAuthCache[i], &gAuthCache[i + 1], (gAuthCacheCount - i - 1) * sizeof(gAuthCache[0]));
+			gAuthCacheCount--;
+			break;
+		}
+	}
+	
+	__CFSpinUnlock(&gAuthCacheLock);
+	
+	/* Release outside of the cache lock since this may drop the last reference on an object. */
+	for (i = 0; i < (sizeof(evicted) / sizeof(evicted[0])); i++) {
+		
+		if (evicted[i])
+			_AuthCacheEntryRelease(evicted[i]);
+	}
+}
+
+
+/* extern */ Boolean
+_CFHTTPAuthenticationCacheApplyToRequest(CFHTTPMessageRef request, CFURLRef url, Boolean forProxy, const void* connection) {
+	
+	CFIndex i, count = 0;
+	Boolean result = FALSE;
+	CFStringRef scheme, host, header, url_str = NULL;
+	SInt32 port;
+	CFURLRef abs_url = NULL;
+	CFHTTPAuthenticationRef candidates[kAuthCacheMaxEntries];
+	
+	/* Leave requests which already carry their own authentication alone. */
+	if (_CFHTTPMessageGetAuthentication(request, forProxy))
+		return FALSE;
+	
+	header = CFHTTPMessageCopyHeaderFieldValue(request, forProxy ? _kCFHTTPMessageHeaderProxyAuthorization : _kCFHTTPMessageHeaderAuthorization);
+	if (header) {
+		CFRelease(header);
+		return FALSE;
+	}
+	
+	if (!_AuthCacheCopySpaceForURL(url, &scheme, &host, &port))
+		return FALSE;
+	
+	if (!forProxy) {
+		abs_url = CFURLCopyAbsoluteURL(url);
+		url_str = CFURLGetString(abs_url);
+	}
+	
+	/* Collect the matching objects, most recently used first, without holding their locks. */
+	__CFSpinLock(&gAuthCacheLock);
+	
+	for (i = 0; i < gAuthCacheCount; i++) {
+		
+		if (_AuthCacheEntryMatches(gAuthCache[i], scheme, host, port, forProxy, url_str))
+			candidates[count++] = (CFHTTPAuthenticationRef)CFRetain(gAuthCache[i]->_auth);
+	}
+	
+	__CFSpinUnlock(&gAuthCacheLock);
+	
+	CFRelease(scheme);
+	CFRelease(host);
+	if (abs_url) CFRelease(abs_url);
+	
+	for (i = 0; i < count; i++) {
+		
+		CFHTTPAuthenticationRef auth = candidates[i];
+		
+		if (result) {
+			CFRelease(auth);
+			continue;
+		}
+		
+		_CFMutexLock(&auth->_lock);
+		
+		if (!auth->_error.error) {
+			
+			CFStringRef method = _CFHTTPAuthenticationGetProperty(auth, kCFHTTPAuthenticationPropertyMethod);
+			
+			if ((method == kCFHTTPAuthenticationSchemeNTLM) || (method == kCFHTTPAuthenticationSchemeNegotiate)) {
+				
+				/* Only use the object on a connection it has already authenticated. */
+				if (_CFHTTPAuthenticationConnectionIsAuthenticated_Unsafe(auth, connection)) {
+					
+					header = (method == kCFHTTPAuthenticationSchemeNTLM) ?
+								_CFHTTPAuthenticationCreateNTLMHeaderForRequest(auth, request, connection) :
+								_CFHTTPAuthenticationCreateNegotiateHeaderForRequest(auth, request, connection);
+					
+					if (header) {
+						CFHTTPMessageSetHeaderFieldValue(request, auth->_proxy ? _kCFHTTPMessageHeaderProxyAuthorization : _kCFHTTPMessageHeaderAuthorization, header);
+						CFRelease(header);
+					}
+					
+					_CFHTTPMessageSetAuthentication(request, auth, auth->_proxy);
+					result = TRUE;
+				}
+			}
+			
+			else if (auth->_credentials) {
+				
+				/* Applying digest bumps the nonce count, so each request gets its own. */
+				result = _CFApplyCredentials_Unsafe(request, auth, auth->_credentials, NULL);
+			}
+		}
+		
+		_CFMutexUnlock(&auth->_lock);
+		
+		CFRelease(auth);
+	}
+	
+	return result;
+}
+
+
+/* extern */ void
+_CFHTTPAuthenticationCacheRemove(CFHTTPAuthenticationRef auth) {
+	
+	CFIndex i = 0;
+	_AuthCacheEntry* entry = NULL;
+	
+	__CFSpinLock(&gAuthCacheLock);
+	
+	for (i = 0; i < gAuthCacheCount; i++) {
+		
+		if (gAuthCache[i]->_auth == auth) {
+			
+			entry = gAuthCache[i];
+			memmove(&gAuthCache[i], &gAuthCache[i + 1], (gAuthCacheCount - i - 1) * sizeof(gAuthCache[0]));
+			gAuthCacheCount--;
+			break;
+		}
+	}
+	
+	__CFSpinUnlock(&gAuthCacheLock);
+	
+	if (entry)
+		_AuthCacheEntryRelease(entry);
+}
+
+
+/* CF_EXPORT */ void
+_CFHTTPAuthenticationFlushCache(void) {
+	
+	CFIndex i, count;
+	_AuthCacheEntry* entries[kAuthCacheMaxEntries];
+	
+	__CFSpinLock(&gAuthCacheLock);
+	
+	count = gAuthCacheCount;
+	memmove(&entries[0], &gAuthCache[0], count * sizeof(gAuthCache[0]));
+	gAuthCacheCount = 0;
+	
+	__CFSpinUnlock(&gAuthCacheLock);
+	
+	for (i = 0; i < count; i++)
+		_AuthCacheEntryRelease(entries[i]);
+}
@@ -30,6 +30,9 @@
 
 const SInt32 kCFStreamErrorHTTPConnectionLost = -4;
 
+// Stream contexts, zombies included, are made for every request; keep a few for reuse.
+static _CFHTTPContextPool streamInfoPool = _CFHTTPContextPoolInitializer(sizeof(_CFHTTPStreamInfo));
+
 extern void _CFSocketStreamCreatePair(CFAllocatorRef alloc, CFStringRef host, UInt32 port, CFSocketNativeHandle s,
 									  const CFSocketSignature* sig, CFReadStreamRef* readStream, CFWriteStreamRef* writeStream);
 
@@ -100,13 +103,13 @@ static void destroyStreamInfo(CFAllocatorRef alloc, _CFHTTPStreamInfo *streamInf
     if (streamInfo->requestFragment) CFRelease(streamInfo->requestFragment);
     if (streamInfo->stateChangeSource) CFRelease(streamInfo->stateChangeSource);
     
-    CFAllocatorDeallocate(alloc, streamInfo); 
+    _CFHTTPContextPoolDeallocate(&streamInfoPool, alloc, streamInfo);
 }
 
 static _CFHTTPStreamInfo *createZombieDouble(CFAllocatorRef alloc, _CFHTTPStreamInfo *orig, _CFNetConnectionRef conn) {
     _CFHTTPStreamInfo *zombie;
     CFArrayRef origRLArray;
-    zombie = CFAllocatorAllocate(alloc, sizeof(_CFHTTPStreamInfo), 0);
+    zombie = _CFHTTPContextPoolAllocate(&streamInfoPool, alloc);
     if (!zombie) return NULL;
     zombie->flags = orig->flags;
     __CFBitSet(zombie->flags, IS_ZOMBIE);
@@ -152,7 +155,7 @@ static _CFHTTPStreamInfo *createZombieDouble(CFAllocatorRef alloc, _CFHTTPStream
 
 
 static const _CFNetConnectionCallBacks HTTPConnectionCallBacks =  {
-  0,
+  1,
   httpConnectionCreate,
   httpConnectionFinalize,
   httpConnectionCreateStreams,
@@ -161,7 +164,8 @@ static const _CFNetConnectionCallBacks HTTPConnectionCallBacks =  {
   httpConnectionReceiveResponse,
   httpConnectionResponseStreamCB,
   httpConnectionRequestStreamCB,
-  httpConnectionRLArrayForRequest
+  httpConnectionRLArrayForRequest,
+  httpConnectionRequestIsPipelinable
 };
 
 static const CFReadStreamCallBacks HTTPStreamCallBacks = {
@@ -183,33 +187,62 @@ static const CFReadStreamCallBacks HTTPStreamCallBacks = {
 };
 
 
+static Boolean isHTTP2Connection(CFTypeRef conn) {
+    return CFGetTypeID(conn) == _CFHTTP2ConnectionGetTypeID();
+}
+
 CFHTTPConnectionRef CFHTTPConnectionCreate(CFAllocatorRef alloc, CFStringRef host, SInt32 port, UInt32 connectionType, CFDictionaryRef streamProperties) {
     _CFHTTPConnectionInfo info = {host, port, connectionType, streamProperties}; 
-    _CFNetConnectionRef conn = _CFNetConnectionCreate(alloc, &info, &HTTPConnectionCallBacks, FALSE);
+    _CFNetConnectionRef conn;
+    if (connectionType == kHTTP2 || connectionType == kHTTP2Cleartext) {
+        return (CFHTTPConnectionRef)_CFHTTP2ConnectionCreate(alloc, host, port, connectionType, streamProperties);
+    }
+    conn = _CFNetConnectionCreate(alloc, &info, &HTTPConnectionCallBacks, FALSE);
     return conn;
 }
 
 void CFHTTPConnectionSetShouldPipeline(CFHTTPConnectionRef conn, Boolean shouldPipeline) {
+    // HTTP/2 always multiplexes.
+    if (isHTTP2Connection(conn)) return;
     _CFNetConnectionSetShouldPipeline((_CFNetConnectionRef)conn, shouldPipeline);
 }
 
+void CFHTTPConnectionSetMaxPipelineDepth(CFHTTPConnectionRef conn, CFIndex maxDepth) {
+    if (isHTTP2Connection(conn)) {
+        _CFHTTP2ConnectionSetMaxStreams(conn, maxDepth);
+        return;
+    }
+    _CFNetConnectionSetMaxPipelineDepth((_CFNetConnectionRef)conn, maxDepth);
+}
+
 void CFHTTPConnectionLost(CFHTTPConnectionRef conn) {
+    if (isHTTP2Connection(conn)) {
+        _CFHTTP2ConnectionLost(conn);
+        return;
+    }
     _CFNetConnectionLost((_CFNetConnectionRef)conn);
 }
 
 void CFHTTPConnectionInvalidate(CFHTTPConnectionRef conn, CFStreamError *err) {
+    if (isHTTP2Connection(conn)) {
+        _CFHTTP2ConnectionInvalidate(conn, err);
+        return;
+    }
     _CFNetConnectionErrorOccurred((_CFNetConnectionRef)conn, err);
 }
 
 CFAbsoluteTime CFHTTPConnectionGetLastAccessTime(CFHTTPConnectionRef connection) {
+    if (isHTTP2Connection(connection)) return _CFHTTP2ConnectionGetLastAccessTime(connection);
     return _CFNetConnectionGetLastAccessTime((_CFNetConnectionRef)connection);
 }
 
 Boolean CFHTTPConnectionAcceptsRequests(CFHTTPConnectionRef conn) {
+    if (isHTTP2Connection(conn)) return _CFHTTP2ConnectionAcceptsRequests(conn);
     return _CFNetConnectionWillEnqueueRequests((_CFNetConnectionRef)conn);
 }
 
 int CFHTTPConnectionGetQueueDepth(CFHTTPConnectionRef conn) {
+    if (isHTTP2Connection(conn)) return _CFHTTP2ConnectionGetQueueDepth(conn);
     return _CFNetConnectionGetQueueDepth((_CFNetConnectionRef)conn);
 }
 
@@ -323,7 +356,10 @@ static void prepareTransmission(_CFHTTPStreamInfo *streamInfo, CFWriteStreamRef
             CFRelease(streamInfo->requestPayload);
         }
         
-        if (length) {
+        // Where there will be a Content-Length, let the filter send the body in the same writes as the header.
+        if (length && !_CFHTTPMessageIsGetMethod(streamInfo->request) && CFWriteStreamSetProperty(requestStream, _kCFStreamPropertyHTTPNewBody, payload)) {
+            streamInfo->requestPayload = NULL;
+        } else if (length) {
             streamInfo->requestPayload = CFReadStreamCreateWithBytesNoCopy(CFGetAllocator(payload), CFDataGetBytePtr(payload), length, kCFAllocatorNull);
         } else {
             streamInfo->requestPayload = NULL;
@@ -710,6 +746,14 @@ static Boolean transmitRequest(_CFHTTPStreamInfo *streamInfo, CFWriteStreamRef d
         done = TRUE;
     }
     if (done) {
+        if (error->error == 0 && streamInfo->requestBytesWritten == 0 && __CFBitIsSet(streamInfo->flags, PAYLOAD_IS_DATA) && CFWriteStreamGetStatus(destStream) != kCFStreamStatusError) {
+            // A data payload given to the filter went out with the header, so count it now.
+            CFDataRef body = CFHTTPMessageCopyBody(streamInfo->request);
+            if (body) {
+                streamInfo->requestBytesWritten = CFDataGetLength(body);
+                CFRelease(body);
+            }
+        }
         closeRequestResources(streamInfo);
         __CFBitSet(streamInfo->flags, HAVE_SENT_REQUEST_PAYLOAD);
     }
@@ -951,8 +995,16 @@ static CFArrayRef httpConnectionRLArrayForRequest(void *request, _CFNetConnectio
     return _CFReadStreamGetRunLoopsAndModes(streamInfo->stream);
 }
 
+// Non-idempotent requests, and those whose body can't be sent twice, wait for the pipeline to drain
+static Boolean httpConnectionRequestIsPipelinable(void *request, _CFNetConnectionRef conn, const void *info) {
+    _CFHTTPStreamInfo *streamInfo = (_CFHTTPStreamInfo *)request;
+    if (__CFBitIsSet(streamInfo->flags, HAS_PAYLOAD) && !__CFBitIsSet(streamInfo->flags, PAYLOAD_IS_DATA)) return FALSE;
+    return _CFHTTPMessageIsIdempotentMethod(streamInfo->request);
+}
+
 CFReadStreamRef CFHTTPConnectionEnqueue(CFHTTPConnectionRef connection, CFHTTPMessageRef request) {
     _CFHTTPStreamInfo info;
+    if (isHTTP2Connection(connection)) return _CFHTTP2ConnectionEnqueue(connection, request, NULL);
     info.flags = 0;
     info.request = request;
     info.responseHeaders = NULL;
@@ -967,6 +1019,7 @@ CFReadStreamRef CFHTTPConnectionEnqueue(CFHTTPConnectionRef connection, CFHTTPMe
 
 CFReadStreamRef CFHTTPConnectionEnqueueWithBodyStream(CFHTTPConnectionRef connection, CFHTTPMessageRef request, CFReadStreamRef bodyStream) {
     _CFHTTPStreamInfo info;
+    if (isHTTP2Connection(connection)) return _CFHTTP2ConnectionEnqueue(connection, request, bodyStream);
     info.flags = 0;
     info.request = request;
     info.responseHeaders = NULL;
@@ -982,7 +1035,7 @@ CFReadStreamRef CFHTTPConnectionEnqueueWithBodyStream(CFHTTPConnectionRef connec
 static void *httpStreamCreate(CFReadStreamRef stream, void *info) {
     _CFHTTPStreamInfo *newInfo, *oldInfo = (_CFHTTPStreamInfo *)info;
     CFAllocatorRef alloc = CFGetAllocator(stream);
-    newInfo = CFAllocatorAllocate(alloc, sizeof(_CFHTTPStreamInfo), 0);
+    newInfo = _CFHTTPContextPoolAllocate(&streamInfoPool, alloc);
     if (!newInfo) return NULL;
     newInfo->flags = 0;
     __CFBitfieldSetValue(newInfo->flags, MAX_STATE_BIT, MIN_STATE_BIT, kNotQueued);
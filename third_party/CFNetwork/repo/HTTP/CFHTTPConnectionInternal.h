@@ -80,6 +80,7 @@ static void httpConnectionReceiveResponse(void *request, _CFNetConnectionRef con
 static void httpConnectionResponseStreamCB(void *request, CFReadStreamRef stream, CFStreamEventType eventType, _CFNetConnectionRef conn, const void *info);
 static void httpConnectionRequestStreamCB(void *request, CFWriteStreamRef stream, CFStreamEventType eventType, _CFNetConnectionRef conn, const void *info);
 static CFArrayRef httpConnectionRLArrayForRequest(void *request, _CFNetConnectionRef conn, const void *info);
+static Boolean httpConnectionRequestIsPipelinable(void *request, _CFNetConnectionRef conn, const void *info);
 
 /* Callbacks for the read streams we return */
 
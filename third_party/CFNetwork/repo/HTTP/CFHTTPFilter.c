@@ -20,10 +20,15 @@
  * 
  * @APPLE_LICENSE_HEADER_END@
  */
+#if HAVE_CONFIG_H
+#include "opencfnetwork-config.h"
+#endif
+
 #include <CoreFoundation/CFNumber.h>
 #include <CFNetwork/CFHTTPMessage.h>
 #include <CFNetwork/CFHTTPStream.h>
 #include <CFNetwork/CFHTTPStreamPriv.h>
+#include <CFNetwork/CFHTTPMessagePriv.h>
 #include <CFNetwork/CFSocketStream.h>
 #include <CoreFoundation/CFStreamPriv.h>
 #include <CFNetwork/CFSocketStreamPriv.h>
@@ -31,6 +36,9 @@
 #include "CFNetworkInternal.h"
 #include <stdlib.h>
 #include <string.h>
+#if HAVE_LIBZ
+#include <zlib.h>
+#endif
 
 extern CFDataRef _CFHTTPMessageCopySerializedHeaders(CFHTTPMessageRef msg, Boolean forProxy);
 
@@ -49,6 +57,10 @@ const SInt32 _kCFStreamErrorHTTPSProxyFailure = -2096;
 #define _kCFHTTPFilterTrailingHeadersFormat				CFSTR("%@, %@")
 #define _kCFHTTPFilterProxyAuthorizationHeader			CFSTR("Proxy-Authorization")
 #define _kCFHTTPFilterHTTPSScheme						CFSTR("https")
+#define _kCFHTTPFilterContentEncodingHeader				CFSTR("Content-Encoding")
+#define _kCFHTTPFilterContentEncodingGzip				CFSTR("gzip")
+#define _kCFHTTPFilterContentEncodingXGzip				CFSTR("x-gzip")
+#define _kCFHTTPFilterContentEncodingDeflate			CFSTR("deflate")
 #define _kCFHTTPStreamConnectionHeader					CFSTR("Connection")
 #define _kCFHTTPStreamProxyConnectionHeader				CFSTR("Proxy-Connection")
 #define _kCFHTTPStreamConnectionKeepAlive				CFSTR("keep-alive")
@@ -64,6 +76,10 @@ CONST_STRING_DECL_LOCAL(_kCFHTTPFilterTransferEncodingIdentity, "Identity")
 CONST_STRING_DECL_LOCAL(_kCFHTTPFilterTrailingHeadersFormat, "%@, %@")
 CONST_STRING_DECL_LOCAL(_kCFHTTPFilterProxyAuthorizationHeader, "Proxy-Authorization")
 CONST_STRING_DECL_LOCAL(_kCFHTTPFilterHTTPSScheme, "https")
+CONST_STRING_DECL_LOCAL(_kCFHTTPFilterContentEncodingHeader, "Content-Encoding")
+CONST_STRING_DECL_LOCAL(_kCFHTTPFilterContentEncodingGzip, "gzip")
+CONST_STRING_DECL_LOCAL(_kCFHTTPFilterContentEncodingXGzip, "x-gzip")
+CONST_STRING_DECL_LOCAL(_kCFHTTPFilterContentEncodingDeflate, "deflate")
 CONST_STRING_DECL_LOCAL(_kCFHTTPStreamConnectionHeader, "Connection")
 CONST_STRING_DECL_LOCAL(_kCFHTTPStreamProxyConnectionHeader, "Proxy-Connection")
 CONST_STRING_DECL_LOCAL(_kCFHTTPStreamConnectionKeepAlive, "keep-alive")
@@ -83,6 +99,21 @@ static Boolean httpWrFilterCanWrite(CFWriteStreamRef stream, void *info);
 //#define DEBUG_FILTER 1
 //#define LOG_FILTER 1
 
+#if HAVE_LIBZ
+#define DECODE_BUFFER_LENGTH (4 * 1024)
+
+// State for inflating a gzip- or deflate-encoded response body as it is read; see doDecodedRead.
+typedef struct {
+    z_stream zStream;
+    int windowBits;  // 0 until the first body bytes show whether a deflate body has a zlib wrapper
+    Boolean isGzip;
+    Boolean finished;  // inflate has reached the end of the compressed data
+    Boolean inputAtEnd;  // the framing layer has returned the last body byte
+    Boolean outputPending;  // inflate filled the last output buffer and may be holding more
+    UInt8 input[DECODE_BUFFER_LENGTH];  // Body bytes not yet consumed by inflate
+} _CFHTTPDecoder;
+#endif
+
 typedef struct {
     CFHTTPMessageRef header;
     UInt32 flags;
@@ -90,6 +121,7 @@ typedef struct {
     long long expectedBytes;  // Number of bytes expected; if we are chunked, this value is only for the current chunk
     long long processedBytes;  // Number of bytes thusfar returned; if we are chunked, this value is only for the current chunk, and does not include the chunk header bytes themselves.
     CFMutableDataRef _data;
+    CFDataRef body;  // Request body to be sent in the same writes as the header; see _kCFStreamPropertyHTTPNewBody.
     union {
         CFReadStreamRef r;
         CFWriteStreamRef w;
@@ -99,11 +131,19 @@ typedef struct {
         CFWriteStreamRef w;
     } filteredStream;
     CFDataRef customSSLContext;
+    long long encodedBytes;  // Body bytes of the current response read from the socket stream, less any chunk framing
+    long long decodedBytes;  // Body bytes of the current response returned to the client
+#if HAVE_LIBZ
+    _CFHTTPDecoder *decoder;  // Created for the first encoded response when DECODE_CONTENT is set; reused for later ones
+#endif
 #if defined(DEBUG_FILTER)
     CFMutableDataRef _allData;
 #endif    
 } _CFHTTPFilter;
 
+// Filter contexts come and go with every connection; keep a few for reuse.
+static _CFHTTPContextPool filterContextPool = _CFHTTPContextPoolInitializer(sizeof(_CFHTTPFilter));
+
 static Boolean httpRdFilterCanReadNoSignal(CFReadStreamRef stream, _CFHTTPFilter *httpFilter, CFStreamError *err);
 
 /* flag bits */
@@ -122,6 +162,9 @@ static Boolean httpRdFilterCanReadNoSignal(CFReadStreamRef stream, _CFHTTPFilter
 #define LAST_CHUNK (10)
 #define ZERO_LENGTH_RESPONSE_EXPECTED (11)
 #define LAX_PARSING (12)
+#define DECODE_CONTENT (13)
+#define IS_ENCODED (14)
+#define USE_ARENA (15)
 
 /* For write streams - 16-31 */
 #define HEADER_TRANSMITTED (16)
@@ -156,9 +199,20 @@ CF_INLINE Boolean httpRdFilterAtMark(_CFHTTPFilter *httpFilter) {
     }
 }
 
+// Create the message for the next header to be read, on an arena of its own if the stream asked for that.
+static CFHTTPMessageRef createNextHeader(_CFHTTPFilter *httpFilter, CFAllocatorRef alloc, Boolean isRequest) {
+    CFAllocatorRef arena = __CFBitIsSet(httpFilter->flags, USE_ARENA) ? _CFHTTPArenaCreate(alloc, 0) : NULL;
+    CFHTTPMessageRef newHeader = CFHTTPMessageCreateEmpty(arena ? arena : alloc, isRequest);
+    if (arena) CFRelease(arena);
+    if (newHeader && __CFBitIsSet(httpFilter->flags, LAX_PARSING)) {
+        _CFHTTPMessageSetLaxParsing(newHeader, TRUE);
+    }
+    return newHeader;
+}
+
 static void *httpRdFilterCreate(CFReadStreamRef stream, void *info) {
     _CFHTTPFilter *oldFilter = (_CFHTTPFilter *)info;
-    _CFHTTPFilter *filter = (_CFHTTPFilter *)CFAllocatorAllocate(CFGetAllocator(stream), sizeof(_CFHTTPFilter), 0);
+    _CFHTTPFilter *filter = (_CFHTTPFilter *)_CFHTTPContextPoolAllocate(&filterContextPool, CFGetAllocator(stream));
     filter->header = oldFilter->header;
     CFRetain(filter->header);
 	CF_SPINLOCK_INIT_FOR_STRUCTS(filter->lock);
@@ -166,6 +220,7 @@ static void *httpRdFilterCreate(CFReadStreamRef stream, void *info) {
     filter->expectedBytes = HEADERS_NOT_YET_CHECKED;
     filter->processedBytes = 0;
     filter->_data = NULL;
+    filter->body = NULL;
 #if defined(DEBUG_FILTER)
     filter->_allData = CFDataCreateMutable(NULL, 0);
 #endif    
@@ -173,6 +228,11 @@ static void *httpRdFilterCreate(CFReadStreamRef stream, void *info) {
     CFRetain(filter->socketStream.r);
     filter->filteredStream.r = stream; // Do not retain; that will introduce a retain loop.
     filter->customSSLContext = NULL;
+    filter->encodedBytes = 0;
+    filter->decodedBytes = 0;
+#if HAVE_LIBZ
+    filter->decoder = NULL;
+#endif
 #if defined(LOG_FILTER)
     fprintf(stderr, "HTTPFilter: Creating read filter 0x%x\n", (unsigned)filter);
 #endif
@@ -187,13 +247,19 @@ static void httpRdFilterDealloc(CFReadStreamRef stream, void *info) {
 	__CFSpinLock(&filter->lock);
     if (filter->header) CFRelease(filter->header);
     if (filter->_data) CFRelease(filter->_data);
+#if HAVE_LIBZ
+    if (filter->decoder) {
+        inflateEnd(&filter->decoder->zStream);
+        CFAllocatorDeallocate(CFGetAllocator(stream), filter->decoder);
+    }
+#endif
 #if defined(DEBUG_FILTER)
     filter->_allData = CFDataCreateMutable(NULL, 0);
 #endif    
     CFReadStreamClose(filter->socketStream.r);
     CFReadStreamSetClient(filter->socketStream.r, kCFStreamEventNone, NULL, NULL);
     CFRelease(filter->socketStream.r);
-    CFAllocatorDeallocate(CFGetAllocator(stream), filter);
+    _CFHTTPContextPoolDeallocate(&filterContextPool, CFGetAllocator(stream), filter);
 }
 
 // stream is filter->socketStream; clientCallBackInfo is the stream whose info pointer is filter.
@@ -361,6 +427,54 @@ static long long expectedSizeFromHeaders(CFHTTPMessageRef responseHeader) {
     return WAIT_FOR_END_OF_STREAM;
 }
 
+#if HAVE_LIBZ
+// Called once a response's headers are in; sets IS_ENCODED and readies the decoder if the body is gzip or deflate encoded.  Bodies with any other coding, or more than one, are passed through untouched.  Returns FALSE (with error set) only if the decoder cannot be created.
+static Boolean prepareContentDecoding(_CFHTTPFilter *httpFilter, CFStreamError *error) {
+    CFStringRef encoding = CFHTTPMessageCopyHeaderFieldValue(httpFilter->header, _kCFHTTPFilterContentEncodingHeader);
+    CFMutableStringRef trimmed;
+    Boolean isGzip, isDeflate;
+    _CFHTTPDecoder *decoder;
+    
+    __CFBitClear(httpFilter->flags, IS_ENCODED);
+    if (!encoding) return TRUE;
+    trimmed = CFStringCreateMutableCopy(CFGetAllocator(encoding), 0, encoding);
+    CFRelease(encoding);
+    CFStringTrimWhitespace(trimmed);
+    isGzip = (CFStringCompare(trimmed, _kCFHTTPFilterContentEncodingGzip, kCFCompareCaseInsensitive) == kCFCompareEqualTo ||
+              CFStringCompare(trimmed, _kCFHTTPFilterContentEncodingXGzip, kCFCompareCaseInsensitive) == kCFCompareEqualTo);
+    isDeflate = (CFStringCompare(trimmed, _kCFHTTPFilterContentEncodingDeflate, kCFCompareCaseInsensitive) == kCFCompareEqualTo);
+    CFRelease(trimmed);
+    if (!isGzip && !isDeflate) return TRUE;
+    
+    decoder = httpFilter->decoder;
+    if (!decoder) {
+        decoder = (_CFHTTPDecoder *)CFAllocatorAllocate(CFGetAllocator(httpFilter->filteredStream.r), sizeof(_CFHTTPDecoder), 0);
+        if (decoder) {
+            memset(&decoder->zStream, 0, sizeof(z_stream));
+            if (inflateInit2(&decoder->zStream, 15 + 32) != Z_OK) {
+                CFAllocatorDeallocate(CFGetAllocator(httpFilter->filteredStream.r), decoder);
+                decoder = NULL;
+            }
+        }
+        if (!decoder) {
+            error->domain = kCFStreamErrorDomainPOSIX;
+            error->error = ENOMEM;
+            return FALSE;
+        }
+        httpFilter->decoder = decoder;
+    }
+    decoder->windowBits = 0;
+    decoder->isGzip = isGzip;
+    decoder->finished = FALSE;
+    decoder->inputAtEnd = FALSE;
+    decoder->outputPending = FALSE;
+    decoder->zStream.next_in = decoder->input;
+    decoder->zStream.avail_in = 0;
+    __CFBitSet(httpFilter->flags, IS_ENCODED);
+    return TRUE;
+}
+#endif
+
 static Boolean readHeaderBytes(_CFHTTPFilter *httpFilter, Boolean toCompletion, UInt8 *buffer, CFIndex bufferLength, CFStreamError *error) {
     Boolean parseSucceeded = TRUE;
     Boolean connectionLost = FALSE;
@@ -449,10 +563,7 @@ static Boolean readHeaderBytes(_CFHTTPFilter *httpFilter, Boolean toCompletion,
     // See if this is a 10x response; if it is, we swallow it and start a new header immediately.  10x responses cannot carry bodies, so there cannot be any further bytes.
     status = CFHTTPMessageGetResponseStatusCode(httpFilter->header);
     if (status >= 100 && status < 200) {
-        CFHTTPMessageRef newHeader = CFHTTPMessageCreateEmpty(CFGetAllocator(httpFilter->header), FALSE);
-        if (__CFBitIsSet(httpFilter->flags, LAX_PARSING)) {
-            _CFHTTPMessageSetLaxParsing(newHeader, TRUE);
-        }
+        CFHTTPMessageRef newHeader = createNextHeader(httpFilter, CFGetAllocator(httpFilter->filteredStream.r), FALSE);
         CFRelease(httpFilter->header);
         httpFilter->header = newHeader;
         return readHeaderBytes(httpFilter, toCompletion, buffer, bufferLength, error);
@@ -504,6 +615,11 @@ static Boolean readHeaderBytes(_CFHTTPFilter *httpFilter, Boolean toCompletion,
 		if ((httpFilter->expectedBytes == WAIT_FOR_END_OF_STREAM) && (CFReadStreamGetStatus(stream) == kCFStreamStatusAtEnd))
 			httpFilter->expectedBytes = 0;
     }
+#if HAVE_LIBZ
+    if (__CFBitIsSet(httpFilter->flags, DECODE_CONTENT) && !CFHTTPMessageIsRequest(httpFilter->header) && (__CFBitIsSet(httpFilter->flags, IS_CHUNKED) || httpFilter->expectedBytes != 0)) {
+        return prepareContentDecoding(httpFilter, error);
+    }
+#endif
     return TRUE;
 }
 
@@ -1076,6 +1192,93 @@ static CFIndex doPlainRead(_CFHTTPFilter *httpFilter, UInt8 *buffer, CFIndex buf
     return result;
 }
 
+#if HAVE_LIBZ
+// Inflates the body into buffer, pulling framed bytes through doChunkedRead or doPlainRead as inflate needs them.  As with those, we block only if we have nothing at all to return.
+static CFIndex doDecodedRead(_CFHTTPFilter *httpFilter, UInt8 *buffer, CFIndex bufferLength, CFStreamError *error, Boolean *atEOF) {
+    _CFHTTPDecoder *decoder = httpFilter->decoder;
+    z_stream *zStream = &decoder->zStream;
+    CFIndex lengthFilled = 0;
+    *atEOF = FALSE;
+    error->error = 0;
+    
+    if (bufferLength > UINT_MAX) bufferLength = UINT_MAX;
+    while (lengthFilled < bufferLength) {
+        int zResult;
+        
+        // Refill the input once inflate has taken all of it; the first two bytes are gathered together so we can tell a zlib-wrapped deflate body from a raw one.
+        if (!decoder->outputPending && (zStream->avail_in == 0 || (decoder->windowBits == 0 && zStream->avail_in < 2))) {
+            CFIndex numRead;
+            Boolean framedEOF;
+            if (decoder->inputAtEnd) {
+                if (!decoder->finished && (decoder->windowBits != 0 || zStream->avail_in != 0)) {
+                    // The body ended in the middle of the compressed data
+                    setParseFailure(httpFilter, error);
+                    return -1;
+                }
+                *atEOF = TRUE;
+                break;
+            }
+            if (lengthFilled > 0) break;
+            if (__CFBitIsSet(httpFilter->flags, IS_CHUNKED)) {
+                numRead = doChunkedRead(httpFilter, decoder->input + zStream->avail_in, DECODE_BUFFER_LENGTH - zStream->avail_in, error, &framedEOF);
+            } else {
+                numRead = doPlainRead(httpFilter, decoder->input + zStream->avail_in, DECODE_BUFFER_LENGTH - zStream->avail_in, error, &framedEOF);
+            }
+            if (numRead < 0) {
+                return -1;
+            }
+            httpFilter->encodedBytes += numRead;
+            zStream->next_in = decoder->input;
+            zStream->avail_in += numRead;
+            decoder->inputAtEnd = framedEOF;
+            if (numRead == 0 && !framedEOF) break;
+            continue;
+        }
+        
+        if (decoder->finished) {
+            // Anything past the end of the compressed data is not part of the entity; discard it so the framing still completes
+            zStream->avail_in = 0;
+            continue;
+        }
+        
+        if (decoder->windowBits == 0) {
+            if (decoder->isGzip) {
+                decoder->windowBits = 15 + 32;  // Also accept a zlib wrapper from servers that mislabel it
+            } else if ((zStream->next_in[0] & 0x0F) == Z_DEFLATED && ((zStream->next_in[0] << 8) | zStream->next_in[1]) % 31 == 0) {
+                decoder->windowBits = 15;
+            } else {
+                decoder->windowBits = -15;  // Raw deflate, as some servers send despite RFC 2616
+            }
+            if (inflateReset2(zStream, decoder->windowBits) != Z_OK) {
+                setParseFailure(httpFilter, error);
+                return -1;
+            }
+        }
+        
+        zStream->next_out = buffer + lengthFilled;
+        zStream->avail_out = (uInt)(bufferLength - lengthFilled);
+        zResult = inflate(zStream, Z_NO_FLUSH);
+        lengthFilled = bufferLength - zStream->avail_out;
+        decoder->outputPending = (zStream->avail_out == 0) ? TRUE : FALSE;
+        if (zResult == Z_STREAM_END) {
+            decoder->finished = TRUE;
+            decoder->outputPending = FALSE;
+        } else if (zResult == Z_BUF_ERROR) {
+            // No progress was possible; we need more input
+            decoder->outputPending = FALSE;
+        } else if (zResult != Z_OK) {
+            setParseFailure(httpFilter, error);
+            return -1;
+        }
+    }
+    return lengthFilled;
+}
+
+CF_INLINE Boolean decoderHasBytes(_CFHTTPDecoder *decoder) {
+    return (decoder->outputPending || (!decoder->finished && decoder->zStream.avail_in > 0)) ? TRUE : FALSE;
+}
+#endif
+
 static CFIndex httpRdFilterRead(CFReadStreamRef stream, UInt8 *buffer, CFIndex bufferLength, CFStreamError *error, Boolean *atEOF, void *info) {
     _CFHTTPFilter *httpFilter = (_CFHTTPFilter *)info;
     Boolean parseSucceeded = TRUE;
@@ -1127,11 +1330,19 @@ static CFIndex httpRdFilterRead(CFReadStreamRef stream, UInt8 *buffer, CFIndex b
         return -1; // readHeaderBytes set our error code for us.
     }
     
+#if HAVE_LIBZ
+    if (__CFBitIsSet(httpFilter->flags, IS_ENCODED)) {
+        result = doDecodedRead(httpFilter, buffer, bufferLength, error, atEOF);
+    } else
+#endif
     if (__CFBitIsSet(httpFilter->flags, IS_CHUNKED)) {
         result = doChunkedRead(httpFilter, buffer, bufferLength, error, atEOF);
+        if (result > 0) httpFilter->encodedBytes += result;
     } else {
         result = doPlainRead(httpFilter, buffer, bufferLength, error, atEOF);
+        if (result > 0) httpFilter->encodedBytes += result;
     }
+    if (result > 0) httpFilter->decodedBytes += result;
     if (*atEOF && !error->error && __CFBitIsSet(httpFilter->flags, MARK_ENABLED)) {
         *atEOF = FALSE;
         __CFBitSet(httpFilter->flags, AT_MARK);
@@ -1171,6 +1382,13 @@ static Boolean httpRdFilterCanReadNoSignal(CFReadStreamRef stream, _CFHTTPFilter
         } 
     }
     
+#if HAVE_LIBZ
+    // Bytes already pulled off the wire but not yet inflated are readable even if the framing is at its end
+    if (__CFBitIsSet(httpFilter->flags, IS_ENCODED) && decoderHasBytes(httpFilter->decoder)) {
+        return TRUE;
+    }
+#endif
+
     // We are safely past the http header; now see if we need to pass a chunk header.  We cannot fold this into the code above because we may be between chunks
     if (__CFBitIsSet(httpFilter->flags, IS_CHUNKED) && (httpFilter->expectedBytes == httpFilter->processedBytes || httpFilter->expectedBytes == MID_CHUNK_HEADER_PARSE)) {
         if (__CFBitIsSet(httpFilter->flags, LAST_CHUNK)) {
@@ -1236,15 +1454,13 @@ void _CFHTTPReadStreamReadMark(CFReadStreamRef fStream) {
 #endif
     if (__CFBitIsSet(httpFilter->flags, MARK_ENABLED) && __CFBitIsSet(httpFilter->flags, AT_MARK)) {
         CFHTTPMessageRef newHeader;
-        CFAllocatorRef alloc = CFGetAllocator(httpFilter->header);
-        newHeader = CFHTTPMessageCreateEmpty(alloc, CFHTTPMessageIsRequest(httpFilter->header));
-        if (__CFBitIsSet(httpFilter->flags, LAX_PARSING)) {
-            _CFHTTPMessageSetLaxParsing(newHeader, TRUE);
-        }
+        newHeader = createNextHeader(httpFilter, CFGetAllocator(fStream), CFHTTPMessageIsRequest(httpFilter->header));
         CFRelease(httpFilter->header);
         httpFilter->header = newHeader;
         httpFilter->expectedBytes = HEADERS_NOT_YET_CHECKED;
         httpFilter->processedBytes = 0;
+        httpFilter->encodedBytes = 0;
+        httpFilter->decodedBytes = 0;
         __CFBitClear(httpFilter->flags, AT_MARK);
         __CFBitClear(httpFilter->flags, MARK_SIGNALLED);
         __CFBitClear(httpFilter->flags, IS_CHUNKED);
@@ -1253,6 +1469,7 @@ void _CFHTTPReadStreamReadMark(CFReadStreamRef fStream) {
         __CFBitClear(httpFilter->flags, PARSE_FAILED);
         __CFBitClear(httpFilter->flags, CONNECTION_LOST);
         __CFBitClear(httpFilter->flags, ZERO_LENGTH_RESPONSE_EXPECTED);
+        __CFBitClear(httpFilter->flags, IS_ENCODED);
 #if defined(DEBUG_FILTER)
         CFRelease(httpFilter->_allData);
         httpFilter->_allData = CFDataCreateMutable(NULL, 0);
@@ -1298,6 +1515,14 @@ static CFTypeRef httpRdFilterCopyProperty(CFReadStreamRef stream, CFStringRef pr
             response = NULL;
         }
         result = response;
+    } else if (CFEqual(propertyName, _kCFStreamPropertyHTTPDecodeContentEncoding)) {
+        result = (__CFBitIsSet(filter->flags, DECODE_CONTENT)) ? kCFBooleanTrue : kCFBooleanFalse;
+    } else if (CFEqual(propertyName, _kCFStreamPropertyHTTPUseArena)) {
+        result = (__CFBitIsSet(filter->flags, USE_ARENA)) ? kCFBooleanTrue : kCFBooleanFalse;
+    } else if (CFEqual(propertyName, _kCFStreamPropertyHTTPEncodedBodyBytes)) {
+        result = CFNumberCreate(CFGetAllocator(stream), kCFNumberLongLongType, &filter->encodedBytes);
+    } else if (CFEqual(propertyName, _kCFStreamPropertyHTTPDecodedBodyBytes)) {
+        result = CFNumberCreate(CFGetAllocator(stream), kCFNumberLongLongType, &filter->decodedBytes);
     } else {
         result = CFReadStreamCopyProperty(filter->socketStream.r, propertyName);
     }
@@ -1336,6 +1561,36 @@ static Boolean httpRdFilterSetProperty(CFReadStreamRef stream, CFStringRef propN
         }
 		__CFSpinUnlock(&filter->lock);
         return TRUE;
+    } else if (CFEqual(propName, _kCFStreamPropertyHTTPDecodeContentEncoding)) {
+#if HAVE_LIBZ
+        // Takes effect with the next response whose headers have not yet been read
+        if (propValue == kCFBooleanTrue) {
+            __CFBitSet(filter->flags, DECODE_CONTENT);
+        } else {
+            __CFBitClear(filter->flags, DECODE_CONTENT);
+        }
+		__CFSpinUnlock(&filter->lock);
+        return TRUE;
+#else
+		__CFSpinUnlock(&filter->lock);
+        return FALSE;
+#endif
+    } else if (CFEqual(propName, _kCFStreamPropertyHTTPUseArena)) {
+        if (propValue == kCFBooleanTrue) {
+            __CFBitSet(filter->flags, USE_ARENA);
+        } else {
+            __CFBitClear(filter->flags, USE_ARENA);
+        }
+        // Takes effect with the next response, or this one if none of it has been read
+        if (filter->header && _CFHTTPMessageIsEmpty(filter->header)) {
+            CFHTTPMessageRef newHeader = createNextHeader(filter, CFGetAllocator(stream), CFHTTPMessageIsRequest(filter->header));
+            if (newHeader) {
+                CFRelease(filter->header);
+                filter->header = newHeader;
+            }
+        }
+		__CFSpinUnlock(&filter->lock);
+        return TRUE;
 #if defined(__MACH__)
     } else if (CFEqual(propName, kCFStreamPropertySocketSSLContext)) {
         // This must be set on the write filter
@@ -1383,7 +1638,7 @@ CFReadStreamRef CFReadStreamCreateHTTPStream(CFAllocatorRef alloc, CFReadStreamR
 
 static void *httpWrFilterCreate(CFWriteStreamRef stream, void *info) {
     _CFHTTPFilter *oldFilter = (_CFHTTPFilter *)info;
-    _CFHTTPFilter *filter = (_CFHTTPFilter *)CFAllocatorAllocate(CFGetAllocator(stream), sizeof(_CFHTTPFilter), 0);
+    _CFHTTPFilter *filter = (_CFHTTPFilter *)_CFHTTPContextPoolAllocate(&filterContextPool, CFGetAllocator(stream));
 	CF_SPINLOCK_INIT_FOR_STRUCTS(filter->lock);
     filter->header = NULL;
     filter->flags = 0;
@@ -1394,6 +1649,7 @@ static void *httpWrFilterCreate(CFWriteStreamRef stream, void *info) {
     filter->expectedBytes = 0;
     filter->processedBytes = 0;
     filter->_data = NULL;
+    filter->body = NULL;
     filter->socketStream.w = oldFilter->socketStream.w;
     CFRetain(filter->socketStream.w);
     filter->filteredStream.w = stream; // Do not retain; that will introduce a retain loop.
@@ -1406,11 +1662,12 @@ static void httpWrFilterDealloc(CFWriteStreamRef stream, void *info) {
 	__CFSpinLock(&filter->lock);
     if (filter->header) CFRelease(filter->header);
     if (filter->_data) CFRelease(filter->_data);
+    if (filter->body) CFRelease(filter->body);
     CFWriteStreamClose(filter->socketStream.w);
     CFWriteStreamSetClient(filter->socketStream.w, kCFStreamEventNone, NULL, NULL);
     CFRelease(filter->socketStream.w);
     if (filter->customSSLContext) CFRelease(filter->customSSLContext);
-    CFAllocatorDeallocate(CFGetAllocator(stream), filter);
+    _CFHTTPContextPoolDeallocate(&filterContextPool, CFGetAllocator(stream), filter);
 }
 
 static void httpWrFilterStreamCallBack(CFWriteStreamRef stream, CFStreamEventType event, void *clientCallBackInfo) {
@@ -1428,6 +1685,8 @@ static void httpWrFilterStreamCallBack(CFWriteStreamRef stream, CFStreamEventTyp
 					if (!filter->processedBytes) {
 						if (filter->_data) CFRelease(filter->_data);
 						filter->_data = NULL;
+						if (filter->body) CFRelease(filter->body);
+						filter->body = NULL;
 						__CFBitSet(filter->flags, HEADER_TRANSMITTED);
 						__CFBitSet(filter->flags, HTTPS_PROXY_FAILURE);
 					}
@@ -1506,6 +1765,8 @@ static CFStreamError transmitHeader(_CFHTTPFilter *filter, Boolean blockUntilDon
         CFRelease(proxyResponse);
         if (status != 200) {
 			filter->_data = NULL;
+			if (filter->body) CFRelease(filter->body);
+			filter->body = NULL;
 			filter->processedBytes = 0;
 			__CFBitSet(filter->flags, HEADER_TRANSMITTED);
 			__CFBitSet(filter->flags, HTTPS_PROXY_FAILURE);
@@ -1562,6 +1823,16 @@ static CFStreamError transmitHeader(_CFHTTPFilter *filter, Boolean blockUntilDon
         filter->_data = (CFMutableDataRef)_CFHTTPMessageCopySerializedHeaders(filter->header, __CFBitIsSet(filter->flags, IS_PROXY));  
         isFirstWriteOfHeader = TRUE;
         filter->processedBytes = 0;
+
+        // A body handed over ahead of the header goes out in the same writes, so it has to be exactly what the header promises.
+        if (filter->body && (__CFBitIsSet(filter->flags, IS_CHUNKED) || filter->expectedBytes != CFDataGetLength(filter->body))) {
+            CFRelease(filter->body);
+            filter->body = NULL;
+            if (filter->_data) {
+                CFRelease(filter->_data);
+                filter->_data = NULL;
+            }
+        }
     }
 
     if (!filter->_data) {
@@ -1571,8 +1842,18 @@ static CFStreamError transmitHeader(_CFHTTPFilter *filter, Boolean blockUntilDon
     }
     length = CFDataGetLength(filter->_data);
     bytes = CFDataGetBytePtr(filter->_data);
+    if (filter->body) {
+        length += CFDataGetLength(filter->body);
+    }
     while (filter->processedBytes < length && (blockUntilDone || CFWriteStreamCanAcceptBytes(stream))) {
-        CFIndex bytesWritten = CFWriteStreamWrite(stream, bytes + filter->processedBytes, length - filter->processedBytes);
+        CFIndex bytesWritten;
+        if (filter->body) {
+            // Gather the header and body into the same writes rather than copying them together.
+            CFDataRef buffers[2] = {filter->_data, filter->body};
+            bytesWritten = _CFWriteStreamWriteDataVector(stream, buffers, 2, filter->processedBytes);
+        } else {
+            bytesWritten = CFWriteStreamWrite(stream, bytes + filter->processedBytes, length - filter->processedBytes);
+        }
         if (bytesWritten < 0) {
             err = CFWriteStreamGetError(stream);
             if (isFirstWriteOfHeader && err.domain == _kCFStreamErrorDomainNativeSockets && (err.error == EPIPE || err.error == ECONNRESET)) {
@@ -1598,6 +1879,14 @@ static CFStreamError transmitHeader(_CFHTTPFilter *filter, Boolean blockUntilDon
         CFRelease(filter->_data);
         filter->_data = NULL;
         filter->processedBytes = 0;
+        if (filter->body) {
+            // The whole body went out with the header, so there is nothing left for httpWrFilterWrite to accept.
+            if (err.error == 0) {
+                filter->processedBytes = filter->expectedBytes;
+            }
+            CFRelease(filter->body);
+            filter->body = NULL;
+        }
         __CFBitSet(filter->flags, HEADER_TRANSMITTED);
     }
     return err;
@@ -1899,6 +2188,13 @@ static Boolean httpWrFilterSetProperty(CFWriteStreamRef stream, CFStringRef prop
 			transmitHeader(filter, FALSE);
 		}
 		
+		__CFSpinUnlock(&filter->lock);
+		return TRUE;
+    } else if ((filter->header == NULL || (__CFBitIsSet(filter->flags, MARK_ENABLED) && __CFBitIsSet(filter->flags, AT_MARK))) && CFEqual(propName, _kCFStreamPropertyHTTPNewBody) && (!propValue || CFGetTypeID(propValue) == CFDataGetTypeID())) {
+		// Set just before _kCFStreamPropertyHTTPNewHeader; the body is then sent along with that header.
+		if (propValue) CFRetain(propValue);
+		if (filter->body) CFRelease(filter->body);
+		filter->body = (CFDataRef)propValue;
 		__CFSpinUnlock(&filter->lock);
 		return TRUE;
 #if defined(__MACH__)
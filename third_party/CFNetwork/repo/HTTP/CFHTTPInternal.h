@@ -45,6 +45,12 @@ extern CFHTTPAuthenticationRef _CFHTTPMessageGetAuthentication(CFHTTPMessageRef
 extern void _CFHTTPMessageSetAuthentication(CFHTTPMessageRef message, CFHTTPAuthenticationRef auth, Boolean proxy);
 extern void _CFHTTPMessageSetResponseURL(CFHTTPMessageRef response, CFURLRef url);
 
+/* Process-wide authentication cache (CFHTTPAuthentication.c).  url is the server's URL for origin
+   authentication and the proxy's URL for proxy authentication. */
+extern void _CFHTTPAuthenticationCacheUpdate(CFHTTPAuthenticationRef auth, CFHTTPMessageRef response, CFURLRef url);
+extern Boolean _CFHTTPAuthenticationCacheApplyToRequest(CFHTTPMessageRef request, CFURLRef url, Boolean forProxy, const void* connection);
+extern void _CFHTTPAuthenticationCacheRemove(CFHTTPAuthenticationRef auth);
+
 extern void _CFHTTPMessageSetHeader(CFHTTPMessageRef msg, CFStringRef theHeader, CFStringRef value, CFIndex position);
 
     
@@ -56,6 +62,7 @@ extern Boolean _CFHTTPMessageIsEmpty(CFHTTPMessageRef message);
 extern Boolean _CFHTTPMessageCanStandAlone(CFHTTPMessageRef message);
 extern CFDataRef _CFHTTPMessageGetBody(CFHTTPMessageRef msg);
 extern Boolean _CFHTTPMessageIsGetMethod(CFHTTPMessageRef msg);
+extern Boolean _CFHTTPMessageIsIdempotentMethod(CFHTTPMessageRef msg);
 
 extern const CFStringRef _kCFStreamPropertyHTTPZeroLengthResponseExpected;
 extern const CFStringRef _kCFStreamPropertyHTTPLaxParsing;
@@ -64,6 +71,7 @@ extern const CFStringRef _kCFStreamPropertyHTTPSProxyHoldYourFire;
 // Internal support for persistant connection stuff
 extern const CFStringRef _kCFStreamPropertyHTTPPersistent;
 extern const CFStringRef _kCFStreamPropertyHTTPNewHeader;
+extern const CFStringRef _kCFStreamPropertyHTTPNewBody;
 extern const SInt32 _kCFStreamErrorHTTPStreamAtMark;
 
 // Private HTTP error codes
@@ -91,6 +99,57 @@ extern const CFStringRef kCFHTTPAuthenticationSchemeNTLM;
 extern CFStringRef _CFCapitalizeHeader(CFStringRef headerString);
 extern UInt8 *_CFURLPortionForRequest(CFAllocatorRef alloc, CFURLRef url, Boolean useCompleteURL, UInt8 **buf, CFIndex bufLength, Boolean *deallocateBuffer);
 
+/* Response cache in CFHTTPResponseCache.c */
+typedef enum {
+    kCFHTTPResponseCacheUnusable = 0,   // The request must go to the server and its response must not be stored
+    kCFHTTPResponseCacheMiss,           // The request must go to the server; its response may be stored
+    kCFHTTPResponseCacheFresh,          // The stored response may be used without the server
+    kCFHTTPResponseCacheStale           // The stored response may be used once the server validates it
+} _CFHTTPResponseCacheResult;
+
+extern _CFHTTPResponseCacheResult _CFHTTPResponseCacheLookup(CFHTTPMessageRef request, CFHTTPMessageRef *response, CFDataRef *body);
+extern void _CFHTTPResponseCacheAddValidators(CFHTTPMessageRef request, CFHTTPMessageRef response);
+extern void _CFHTTPResponseCacheRemoveValidators(CFHTTPMessageRef request);
+extern Boolean _CFHTTPResponseCacheCanStore(CFHTTPMessageRef request, CFHTTPMessageRef response);
+extern CFIndex _CFHTTPResponseCacheGetMaxEntrySize(void);
+extern void _CFHTTPResponseCacheStore(CFHTTPMessageRef request, CFHTTPMessageRef response, CFDataRef body, CFAbsoluteTime requestTime, CFAbsoluteTime responseTime);
+extern CFHTTPMessageRef _CFHTTPResponseCacheCopyRevalidated(CFHTTPMessageRef request, CFHTTPMessageRef stored, CFHTTPMessageRef notModified, CFDataRef body, CFAbsoluteTime requestTime, CFAbsoluteTime responseTime);
+extern void _CFHTTPResponseCacheRemove(CFHTTPMessageRef request);
+
+/* Arenas and context pools in CFHTTPArena.c */
+typedef struct {
+    CFSpinLock_t lock;
+    CFIndex size;       // Of each context
+    CFIndex count;
+    void *free;         // Linked through each context's first word
+} _CFHTTPContextPool;
+
+#define _CFHTTPContextPoolInitializer(contextSize)	{CFSpinLockInit, (contextSize), 0, NULL}
+
+extern void *_CFHTTPContextPoolAllocate(_CFHTTPContextPool *pool, CFAllocatorRef alloc);
+extern void _CFHTTPContextPoolDeallocate(_CFHTTPContextPool *pool, CFAllocatorRef alloc, void *context);
+
+/* HTTP/2 connections in CFHTTP2Connection.c.  CFHTTPConnection passes its calls on for
+   connections of this type; CFHTTPStream shares one per host and port, or gets NULL for a
+   host known not to speak HTTP/2.  A request is queued when its stream is opened. */
+extern CFTypeID _CFHTTP2ConnectionGetTypeID(void);
+extern CFTypeRef _CFHTTP2ConnectionCreate(CFAllocatorRef alloc, CFStringRef host, SInt32 port, UInt32 type, CFDictionaryRef streamProperties);
+extern CFTypeRef _CFHTTP2ConnectionCopyShared(CFAllocatorRef alloc, CFStringRef host, SInt32 port);
+extern CFReadStreamRef _CFHTTP2ConnectionEnqueue(CFTypeRef connection, CFHTTPMessageRef request, CFReadStreamRef bodyStream);
+extern void _CFHTTP2ConnectionSetMaxStreams(CFTypeRef connection, CFIndex maxStreams);
+extern void _CFHTTP2ConnectionLost(CFTypeRef connection);
+extern void _CFHTTP2ConnectionInvalidate(CFTypeRef connection, CFStreamError *error);
+extern Boolean _CFHTTP2ConnectionAcceptsRequests(CFTypeRef connection);
+extern CFAbsoluteTime _CFHTTP2ConnectionGetLastAccessTime(CFTypeRef connection);
+extern int _CFHTTP2ConnectionGetQueueDepth(CFTypeRef connection);
+
+/* The connection's HPACK coder, for testing against RFC 7541 Appendix C.  Fields are CFStrings,
+   names and values alternating; decoding a bad block returns NULL. */
+extern CFArrayRef _CFHTTP2ConnectionCopyHPACKDecodedFields(CFTypeRef connection, CFDataRef block);
+extern CFDataRef _CFHTTP2ConnectionCreateHPACKBlock(CFTypeRef connection, CFArrayRef fields);
+extern void _CFHTTP2ConnectionSetHPACKEncoderTableSize(CFTypeRef connection, CFIndex maxSize);
+extern CFIndex _CFHTTP2ConnectionGetHPACKTableSize(CFTypeRef connection, Boolean encoder);
+
 #if defined(__WIN32__)
 extern void _CFHTTPMessageCleanup(void);
 extern void _CFHTTPStreamCleanup(void);
@@ -43,6 +43,10 @@
 #include "spnegoKrb.h"
 #endif // __MACH__
 
+#if defined(__GNUC__) && (defined(__SSE2__) || defined(__AVX2__))
+#include <immintrin.h>
+#endif
+
 
 /* To do - add in asserts/argument checking */
 
@@ -54,8 +58,16 @@ struct __CFHTTPMessage {
     CFURLRef _url;
     CFMutableDictionaryRef _headers;
     CFMutableArrayRef _headerOrder;
-    CFStringRef	_lastKey;	// This is the last key that was parsed in _parseHeadersFromData.
+    CFStringRef	_lastKey;	// This is the last key that was materialized from _headerRanges.
     CFDataRef _data;
+    CFDataRef _headerData;	// Header bytes, split off from _data once the header is complete.
+    struct _CFHTTPHeaderRange* _headerRanges;	// Parsed but not necessarily materialized header lines.
+    CFIndex _headerCount;
+    CFIndex _headerCapacity;
+    CFIndex _headerMaterialized;	// Number of _headerRanges already folded into _headers.
+    CFIndex _parseOffset;	// Start of the first unparsed line in _data.
+    CFIndex _scanOffset;	// How far past _parseOffset the line has been scanned for LF.
+    CFIndex _colonOffset;	// First ':' seen in the line being scanned or kCFNotFound.
 	CFHTTPAuthenticationRef _auth;
 	CFHTTPAuthenticationRef _proxyAuth;
     UInt32 _flags;
@@ -80,29 +92,21 @@ struct __CFHTTPMessage {
 
 #define IS_GET_METHOD		0x00010000
 
-// table used in message header parsing
-struct MessageHeaderMap {
-    const char			_header[19];
-    int					_length;
+// One parsed header line, kept as offsets into the message's header bytes
+// until somebody asks for the header as a CFString.  Continuation lines
+// have a _keyOffset of kCFNotFound and append to the previous header.
+struct _CFHTTPHeaderRange {
+    CFIndex				_keyOffset;
+    CFIndex				_keyLength;
+    CFIndex				_valueOffset;
+    CFIndex				_valueLength;
 };
 
-static const struct MessageHeaderMap kHTTPMessageHeaderMap[] = {
-    {"Accept-Ranges",		13},
-    {"Cache-Control",		13},
-    {"Connection",			10},
-    {"Content-Language",	16},
-    {"Content-Length",		14},
-    {"Content-Location",	16},
-    {"Content-Type",		12},
-    {"Date",				 4},
-    {"Etag",				 4},
-    {"Expires",				 7},
-    {"Last-Modified",		13},
-    {"Location",			 8},
-    {"Proxy-Authenticate",	18},
-    {"Server",				 6},
-    {"Set-Cookie",			10}
-};
+#define kHTTPMessageHeaderRangeCapacity		16
+#define kHTTPMessageHeaderNameBufferSize	256
+
+static void _CFHTTPMessageMaterializeHeaders(CFHTTPMessageRef msg);
+static void _CFHTTPMessageReleaseHeaderRanges(CFHTTPMessageRef msg);
 
 #ifdef __CONSTANT_CFSTRINGS__
 #define _kCFHTTPMessageAcceptRangesHeader		CFSTR("Accept-Ranges")
@@ -138,44 +142,84 @@ CONST_STRING_DECL_LOCAL(_kCFHTTPMessageServerHeader, "Server")
 CONST_STRING_DECL_LOCAL(_kCFHTTPMessageSetCookieHeader, "Set-Cookie")
 #endif	/* __CONSTANT_CFSTRINGS__ */
 
-static const CFStringRef kHTTPMessageHeaderMap2[] = {
-	(CFStringRef)&_kCFHTTPMessageAcceptRangesHeader,
-	(CFStringRef)&_kCFHTTPMessageCacheControlHeader,
-	(CFStringRef)&_kCFHTTPMessageConnectHeader,
-	(CFStringRef)&_kCFHTTPMessageContentLanguageHeader,
-	(CFStringRef)&_kCFHTTPMessageContentLengthHeader,
-	(CFStringRef)&_kCFHTTPMessageContentLocationHeader,
-	(CFStringRef)&_kCFHTTPMessageContentTypeHeader,
-	(CFStringRef)&_kCFHTTPMessageDateHeader,
-	(CFStringRef)&_kCFHTTPMessageEtagHeader,
-	(CFStringRef)&_kCFHTTPMessageExpiresHeader,
-	(CFStringRef)&_kCFHTTPMessageLastModifiedHeader,
-	(CFStringRef)&_kCFHTTPMessageLocationHeader,
-	(CFStringRef)&_kCFHTTPMessageProxyAuthenticateHeader,
-	(CFStringRef)&_kCFHTTPMessageServerHeader,
-	(CFStringRef)&_kCFHTTPMessageSetCookieHeader
-};
+// Map a capitalized header name onto its constant string, if it is one of
+// the headers seen in nearly every response.  Dispatches on length so that
+// at most three names are ever compared.
+static CFStringRef _CFHTTPMessageFindKnownHeader(const UInt8* name, CFIndex length) {
 
-#define kHTTPMessageNumItems (sizeof(kHTTPMessageHeaderMap) / sizeof(kHTTPMessageHeaderMap[0]))
+    switch (length) {
+        case 4:
+            if (!memcmp(name, "Date", 4)) return _kCFHTTPMessageDateHeader;
+            if (!memcmp(name, "Etag", 4)) return _kCFHTTPMessageEtagHeader;
+            break;
+        case 6:
+            if (!memcmp(name, "Server", 6)) return _kCFHTTPMessageServerHeader;
+            break;
+        case 7:
+            if (!memcmp(name, "Expires", 7)) return _kCFHTTPMessageExpiresHeader;
+            break;
+        case 8:
+            if (!memcmp(name, "Location", 8)) return _kCFHTTPMessageLocationHeader;
+            break;
+        case 10:
+            if (!memcmp(name, "Connection", 10)) return _kCFHTTPMessageConnectHeader;
+            if (!memcmp(name, "Set-Cookie", 10)) return _kCFHTTPMessageSetCookieHeader;
+            break;
+        case 12:
+            if (!memcmp(name, "Content-Type", 12)) return _kCFHTTPMessageContentTypeHeader;
+            break;
+        case 13:
+            if (!memcmp(name, "Accept-Ranges", 13)) return _kCFHTTPMessageAcceptRangesHeader;
+            if (!memcmp(name, "Cache-Control", 13)) return _kCFHTTPMessageCacheControlHeader;
+            if (!memcmp(name, "Last-Modified", 13)) return _kCFHTTPMessageLastModifiedHeader;
+            break;
+        case 14:
+            if (!memcmp(name, "Content-Length", 14)) return _kCFHTTPMessageContentLengthHeader;
+            break;
+        case 16:
+            if (!memcmp(name, "Content-Language", 16)) return _kCFHTTPMessageContentLanguageHeader;
+            if (!memcmp(name, "Content-Location", 16)) return _kCFHTTPMessageContentLocationHeader;
+            break;
+        case 18:
+            if (!memcmp(name, "Proxy-Authenticate", 18)) return _kCFHTTPMessageProxyAuthenticateHeader;
+            break;
+        default:
+            break;
+    }
+
+    return NULL;
+}
 
 #ifdef __CONSTANT_CFSTRINGS__
 #define _kCFHTTPMessageDescribeFormat		CFSTR("<CFHTTPMessage 0x%x>{url = %@; %@ = %@}")
 #define _kCFHTTPMessageDescribeRequest		CFSTR("request")
 #define _kCFHTTPMessageDescribeStatus		CFSTR("status")
 #define _kCFHTTPMessageGETMethod			CFSTR("GET")
+#define _kCFHTTPMessageHEADMethod			CFSTR("HEAD")
+#define _kCFHTTPMessagePUTMethod			CFSTR("PUT")
+#define _kCFHTTPMessageDELETEMethod			CFSTR("DELETE")
+#define _kCFHTTPMessageOPTIONSMethod		CFSTR("OPTIONS")
+#define _kCFHTTPMessageTRACEMethod			CFSTR("TRACE")
 #define _kCFHTTPMessageResponseLineFormat	CFSTR(" %d ")
 #define _kCFHTTPMessageSpace				CFSTR(" ")
 #define _kCFHTTPMessageEmptyString			CFSTR("")
 #define _kCFHTTPMessageAppendHeaderFormat	CFSTR("%@, %@")
+#define _kCFHTTPMessageAppendHeaderSeparator	CFSTR(", ")
 #else
 CONST_STRING_DECL_LOCAL(_kCFHTTPMessageDescribeFormat, "<CFHTTPMessage 0x%x>{url = %@; %@ = %@}")
 CONST_STRING_DECL_LOCAL(_kCFHTTPMessageDescribeRequest, "request")
 CONST_STRING_DECL_LOCAL(_kCFHTTPMessageDescribeStatus, "status")
 CONST_STRING_DECL_LOCAL(_kCFHTTPMessageGETMethod, "GET")
+CONST_STRING_DECL_LOCAL(_kCFHTTPMessageHEADMethod, "HEAD")
+CONST_STRING_DECL_LOCAL(_kCFHTTPMessagePUTMethod, "PUT")
+CONST_STRING_DECL_LOCAL(_kCFHTTPMessageDELETEMethod, "DELETE")
+CONST_STRING_DECL_LOCAL(_kCFHTTPMessageOPTIONSMethod, "OPTIONS")
+CONST_STRING_DECL_LOCAL(_kCFHTTPMessageTRACEMethod, "TRACE")
 CONST_STRING_DECL_LOCAL(_kCFHTTPMessageResponseLineFormat, " %d ")
 CONST_STRING_DECL_LOCAL(_kCFHTTPMessageSpace, " ")
 CONST_STRING_DECL_LOCAL(_kCFHTTPMessageEmptyString, "")
 CONST_STRING_DECL_LOCAL(_kCFHTTPMessageAppendHeaderFormat, "%@, %@")
+CONST_STRING_DECL_LOCAL(_kCFHTTPMessageAppendHeaderSeparator, ", ")
 #endif	/* __CONSTANT_CFSTRINGS__ */
 
 static CFStringRef __CFHTTPMessageCopyDescription(CFTypeRef cf) {
@@ -194,6 +238,8 @@ static void __CFHTTPMessageDeallocate(CFTypeRef cf) {
 	if (req->_auth) CFRelease(req->_auth);
 	if (req->_proxyAuth) CFRelease(req->_proxyAuth);
     if (req->_lastKey) CFRelease(req->_lastKey);
+    if (req->_headerData) CFRelease(req->_headerData);
+    if (req->_headerRanges) CFAllocatorDeallocate(CFGetAllocator(req), req->_headerRanges);
 }
 
 CONST_STRING_DECL(kCFHTTPVersion1_0, "HTTP/1.0")  
@@ -204,6 +250,7 @@ CONST_STRING_DECL(kCFStreamPropertyHTTPResponseHeader,"kCFStreamPropertyHTTPResp
 
 CONST_STRING_DECL(_kCFStreamPropertyHTTPPersistent, "_kCFStreamPropertyHTTPPersistent")
 CONST_STRING_DECL(_kCFStreamPropertyHTTPNewHeader, "_kCFStreamPropertyHTTPNewHeader")
+CONST_STRING_DECL(_kCFStreamPropertyHTTPNewBody, "_kCFStreamPropertyHTTPNewBody")
 CONST_STRING_DECL(_kCFStreamPropertyHTTPLaxParsing, "_kCFStreamPropertyHTTPLaxParsing")
 CONST_STRING_DECL(kCFStreamPropertyHTTPProxy, "kCFStreamPropertyHTTPProxy")
 CONST_STRING_DECL(kCFStreamPropertyHTTPProxyHost, "HTTPProxy")
@@ -219,6 +266,41 @@ CONST_STRING_DECL(_kCFStreamPropertyHTTPZeroLengthResponseExpected, "_kCFStreamP
 CONST_STRING_DECL(_kCFStreamPropertyHTTPProxyProxyAutoConfigURLString, "ProxyAutoConfigURLString")
 CONST_STRING_DECL(_kCFStreamPropertyHTTPProxyProxyAutoConfigEnable, "ProxyAutoConfigEnable")
 CONST_STRING_DECL(_kCFStreamPropertyHTTPConnection, "_kCFStreamPropertyHTTPConnection")
+CONST_STRING_DECL(_kCFHTTPStreamConnectionCacheHits, "_kCFHTTPStreamConnectionCacheHits")
+CONST_STRING_DECL(_kCFHTTPStreamConnectionCacheMisses, "_kCFHTTPStreamConnectionCacheMisses")
+CONST_STRING_DECL(_kCFHTTPStreamConnectionCacheEvictions, "_kCFHTTPStreamConnectionCacheEvictions")
+CONST_STRING_DECL(_kCFHTTPStreamConnectionCacheWaits, "_kCFHTTPStreamConnectionCacheWaits")
+CONST_STRING_DECL(_kCFStreamPropertyHTTPDecodeContentEncoding, "_kCFStreamPropertyHTTPDecodeContentEncoding")
+CONST_STRING_DECL(_kCFStreamPropertyHTTPEncodedBodyBytes, "_kCFStreamPropertyHTTPEncodedBodyBytes")
+CONST_STRING_DECL(_kCFStreamPropertyHTTPDecodedBodyBytes, "_kCFStreamPropertyHTTPDecodedBodyBytes")
+CONST_STRING_DECL(_kCFStreamPropertyHTTPCollectTimingMetrics, "_kCFStreamPropertyHTTPCollectTimingMetrics")
+CONST_STRING_DECL(_kCFStreamPropertyHTTPTimingMetrics, "_kCFStreamPropertyHTTPTimingMetrics")
+CONST_STRING_DECL(_kCFHTTPTimingMetricsFetchStart, "_kCFHTTPTimingMetricsFetchStart")
+CONST_STRING_DECL(_kCFHTTPTimingMetricsDomainLookupStart, "_kCFHTTPTimingMetricsDomainLookupStart")
+CONST_STRING_DECL(_kCFHTTPTimingMetricsDomainLookupEnd, "_kCFHTTPTimingMetricsDomainLookupEnd")
+CONST_STRING_DECL(_kCFHTTPTimingMetricsConnectStart, "_kCFHTTPTimingMetricsConnectStart")
+CONST_STRING_DECL(_kCFHTTPTimingMetricsConnectEnd, "_kCFHTTPTimingMetricsConnectEnd")
+CONST_STRING_DECL(_kCFHTTPTimingMetricsSecureConnectionStart, "_kCFHTTPTimingMetricsSecureConnectionStart")
+CONST_STRING_DECL(_kCFHTTPTimingMetricsSecureConnectionEnd, "_kCFHTTPTimingMetricsSecureConnectionEnd")
+CONST_STRING_DECL(_kCFHTTPTimingMetricsQueueStart, "_kCFHTTPTimingMetricsQueueStart")
+CONST_STRING_DECL(_kCFHTTPTimingMetricsRequestStart, "_kCFHTTPTimingMetricsRequestStart")
+CONST_STRING_DECL(_kCFHTTPTimingMetricsRequestEnd, "_kCFHTTPTimingMetricsRequestEnd")
+CONST_STRING_DECL(_kCFHTTPTimingMetricsResponseStart, "_kCFHTTPTimingMetricsResponseStart")
+CONST_STRING_DECL(_kCFHTTPTimingMetricsResponseEnd, "_kCFHTTPTimingMetricsResponseEnd")
+CONST_STRING_DECL(_kCFHTTPTimingMetricsConnectionReused, "_kCFHTTPTimingMetricsConnectionReused")
+CONST_STRING_DECL(_kCFHTTPTimingMetricsBytesSent, "_kCFHTTPTimingMetricsBytesSent")
+CONST_STRING_DECL(_kCFHTTPTimingMetricsBytesReceived, "_kCFHTTPTimingMetricsBytesReceived")
+CONST_STRING_DECL(_kCFStreamPropertyHTTPUseResponseCache, "_kCFStreamPropertyHTTPUseResponseCache")
+CONST_STRING_DECL(_kCFStreamPropertyHTTPResponseFromCache, "_kCFStreamPropertyHTTPResponseFromCache")
+CONST_STRING_DECL(_kCFHTTPStreamResponseCacheHits, "_kCFHTTPStreamResponseCacheHits")
+CONST_STRING_DECL(_kCFHTTPStreamResponseCacheMisses, "_kCFHTTPStreamResponseCacheMisses")
+CONST_STRING_DECL(_kCFHTTPStreamResponseCacheRevalidations, "_kCFHTTPStreamResponseCacheRevalidations")
+CONST_STRING_DECL(_kCFHTTPStreamResponseCacheStores, "_kCFHTTPStreamResponseCacheStores")
+CONST_STRING_DECL(_kCFHTTPStreamResponseCacheEvictions, "_kCFHTTPStreamResponseCacheEvictions")
+CONST_STRING_DECL(_kCFHTTPStreamResponseCacheMemoryUsage, "_kCFHTTPStreamResponseCacheMemoryUsage")
+CONST_STRING_DECL(_kCFHTTPStreamResponseCacheDiskUsage, "_kCFHTTPStreamResponseCacheDiskUsage")
+CONST_STRING_DECL(_kCFStreamPropertyHTTPUseArena, "_kCFStreamPropertyHTTPUseArena")
+CONST_STRING_DECL(_kCFStreamPropertyHTTPUseHTTP2, "_kCFStreamPropertyHTTPUseHTTP2")
 
 static _CFOnceLock gHTTPMessageClassRegistration = _CFOnceInitializer;
 static CFTypeID __kCFHTTPMessageTypeID = _kCFRuntimeNotATypeID;
@@ -239,14 +321,6 @@ _HTTPMessageRegisterClass(void) {
 	};
 	
 
-	// On Windows CFSTR is a function call, not compiler supported, so we init this table ourselves
-#if defined(__WIN32__)
-	// **FIXME** Broken with changes for shrinking DATA section
-	int i;
-	for (i = 0; i < kHTTPMessageNumItems; i++)
-		kHTTPMessageHeaderMap[i]._constant = CFStringCreateWithCStringNoCopy(NULL, kHTTPMessageHeaderMap[i]._header, kCFStringEncodingASCII, kCFAllocatorNull);
-#endif
-
     __kCFHTTPMessageTypeID = _CFRuntimeRegisterClass(&__CFHTTPMessageClass);
 }
 
@@ -261,16 +335,8 @@ CFTypeID CFHTTPMessageGetTypeID(void) {
 #if defined(__WIN32__)
 extern void _CFHTTPMessageCleanup(void) {
 	
-	// **FIXME** This is not protected versus the call to register.
-	// **FIXME** Broken with changes for shrinking DATA section
-	
-    if (__kCFHTTPMessageTypeID != _kCFRuntimeNotATypeID) {
-        int i;
-        for (i = 0; i < kHTTPMessageNumItems; i++) {
-            CFRelease(kHTTPMessageHeaderMap[i]._constant);
-            kHTTPMessageHeaderMap[i]._constant = NULL;
-        }
-    }
+	// The known header names are constant strings looked up by
+	// _CFHTTPMessageFindKnownHeader, so there is no table to tear down.
 }
 #endif
 
@@ -287,6 +353,14 @@ static CFHTTPMessageRef _CFHTTPMessageCreate(CFAllocatorRef allocator) {
         newMsg->_headerOrder = CFArrayCreateMutable(allocator, 17, &kCFTypeArrayCallBacks);
         newMsg->_lastKey = NULL;
         newMsg->_data = NULL;
+        newMsg->_headerData = NULL;
+        newMsg->_headerRanges = NULL;
+        newMsg->_headerCount = 0;
+        newMsg->_headerCapacity = 0;
+        newMsg->_headerMaterialized = 0;
+        newMsg->_parseOffset = 0;
+        newMsg->_scanOffset = 0;
+        newMsg->_colonOffset = kCFNotFound;
         newMsg->_auth = NULL;
         newMsg->_proxyAuth = NULL;
         newMsg->_flags = LAX_PARSING; // Turn on lax parsing by default.
@@ -312,6 +386,19 @@ CFHTTPMessageRef CFHTTPMessageCreateCopy(CFAllocatorRef allocator, CFHTTPMessage
         } else {
             result->_data = CFDataCreateMutableCopy(allocator, 0, msg->_data);
         }
+        // Parse state refers to offsets, so it carries over to the copied bytes as is.
+        result->_headerData = msg->_headerData ? CFRetain(msg->_headerData) : NULL;
+        result->_headerRanges = NULL;
+        result->_headerCount = msg->_headerCount;
+        result->_headerCapacity = msg->_headerCount;
+        result->_headerMaterialized = msg->_headerMaterialized;
+        result->_parseOffset = msg->_parseOffset;
+        result->_scanOffset = msg->_scanOffset;
+        result->_colonOffset = msg->_colonOffset;
+        if (msg->_headerCount) {
+            result->_headerRanges = CFAllocatorAllocate(allocator, msg->_headerCount * sizeof(struct _CFHTTPHeaderRange), 0);
+            memmove(result->_headerRanges, msg->_headerRanges, msg->_headerCount * sizeof(struct _CFHTTPHeaderRange));
+        }
         result->_auth = msg->_auth;
         result->_proxyAuth = msg->_proxyAuth;
         if (result->_auth)
@@ -554,7 +641,10 @@ CFStringRef CFHTTPMessageCopyVersion(CFHTTPMessageRef message) {
 }
 
 CFDataRef CFHTTPMessageCopyBody(CFHTTPMessageRef msg) {
-    if (msg->_data) {
+    if (msg->_data && msg->_parseOffset) {
+        // Still parsing the header; the lines parsed so far aren't body.
+        return CFDataCreate(CFGetAllocator(msg), CFDataGetBytePtr(msg->_data) + msg->_parseOffset, CFDataGetLength(msg->_data) - msg->_parseOffset);
+    } else if (msg->_data) {
         if ((msg->_flags & MUTABLE_DATA) == 0) {
             CFRetain(msg->_data);
             return msg->_data;
@@ -567,6 +657,14 @@ CFDataRef CFHTTPMessageCopyBody(CFHTTPMessageRef msg) {
 }
 
 void CFHTTPMessageSetBody(CFHTTPMessageRef msg, CFDataRef data) {
+    if (msg->_parseOffset) {
+        // Header lines parsed so far point into the bytes being replaced.
+        _CFHTTPMessageMaterializeHeaders(msg);
+        _CFHTTPMessageReleaseHeaderRanges(msg);
+        msg->_parseOffset = 0;
+        msg->_scanOffset = 0;
+        msg->_colonOffset = kCFNotFound;
+    }
     msg->_flags &= (~MUTABLE_DATA);
     if (data)  {
         data = CFDataCreateCopy(CFGetAllocator(msg), data);
@@ -640,20 +738,8 @@ CFStringRef _CFCapitalizeHeader(CFStringRef headerString) {
     }
 }
 
-CFStringRef CFHTTPMessageCopyHeaderFieldValue(CFHTTPMessageRef msg, CFStringRef header) {
-    CFStringRef lowerHeader = _CFCapitalizeHeader(header);
-    CFStringRef result = CFDictionaryGetValue(msg->_headers, lowerHeader);
-    CFRelease(lowerHeader);
-    if (result) CFRetain(result);
-    return result;
-}
-
-CFDictionaryRef CFHTTPMessageCopyAllHeaderFields(CFHTTPMessageRef msg) {
-    CFRetain(msg->_headers);
-    return msg->_headers;
-}
-
-extern void _CFHTTPMessageSetHeader(CFHTTPMessageRef msg, CFStringRef header, CFStringRef value, CFIndex position) {
+// Same as _CFHTTPMessageSetHeader, but leaves pending header ranges alone.
+static void __CFHTTPMessageSetHeader(CFHTTPMessageRef msg, CFStringRef header, CFStringRef value, CFIndex position) {
 
     if (!value) {
         CFDictionaryRemoveValue(msg->_headers, header);
@@ -684,6 +770,256 @@ extern void _CFHTTPMessageSetHeader(CFHTTPMessageRef msg, CFStringRef header, CF
     }
 }
 
+static inline const UInt8* _CFHTTPMessageGetHeaderBytes(CFHTTPMessageRef msg) {
+    return CFDataGetBytePtr(msg->_headerData ? msg->_headerData : msg->_data);
+}
+
+static void _CFHTTPMessageReleaseHeaderRanges(CFHTTPMessageRef msg) {
+    if (msg->_headerRanges) {
+        CFAllocatorDeallocate(CFGetAllocator(msg), msg->_headerRanges);
+        msg->_headerRanges = NULL;
+    }
+    msg->_headerCount = 0;
+    msg->_headerCapacity = 0;
+    msg->_headerMaterialized = 0;
+    if (msg->_headerData) {
+        CFRelease(msg->_headerData);
+        msg->_headerData = NULL;
+    }
+}
+
+static Boolean _CFHTTPMessageAddHeaderRange(CFHTTPMessageRef msg, CFIndex keyOffset, CFIndex keyLength, CFIndex valueOffset, CFIndex valueLength) {
+
+    struct _CFHTTPHeaderRange* range;
+
+    if (msg->_headerCount == msg->_headerCapacity) {
+        CFIndex capacity = msg->_headerCapacity ? (msg->_headerCapacity * 2) : kHTTPMessageHeaderRangeCapacity;
+        void* ranges = CFAllocatorReallocate(CFGetAllocator(msg), msg->_headerRanges, capacity * sizeof(range[0]), 0);
+        if (!ranges)
+            return FALSE;
+        msg->_headerRanges = (struct _CFHTTPHeaderRange*)ranges;
+        msg->_headerCapacity = capacity;
+    }
+
+    range = &msg->_headerRanges[msg->_headerCount++];
+    range->_keyOffset = keyOffset;
+    range->_keyLength = keyLength;
+    range->_valueOffset = valueOffset;
+    range->_valueLength = valueLength;
+
+    return TRUE;
+}
+
+// Create the dictionary key for a header name sitting in the message bytes.
+// The name is capitalized on the stack first, the same way _CFCapitalizeHeader
+// would, so that the well-known headers come back as constants.
+static CFStringRef _CFHTTPMessageCreateHeaderName(CFAllocatorRef alloc, const UInt8* bytes, CFIndex length) {
+
+    UInt8 name[kHTTPMessageHeaderNameBufferSize];
+    Boolean shouldCapitalize = TRUE;
+    CFStringRef result;
+    CFIndex i;
+
+    if (length > (CFIndex)sizeof(name)) {
+        CFStringRef temp = CFStringCreateWithBytes(alloc, bytes, length, kCFStringEncodingISOLatin1, FALSE);
+        result = _CFCapitalizeHeader(temp);
+        CFRelease(temp);
+        return result;
+    }
+
+    for (i = 0; i < length; i++) {
+        UInt8 ch = bytes[i];
+        if (shouldCapitalize && ch >= 'a' && ch <= 'z')
+            ch = ch + 'A' - 'a';
+        else if (!shouldCapitalize && ch >= 'A' && ch <= 'Z')
+            ch = ch + 'a' - 'A';
+        name[i] = ch;
+        shouldCapitalize = (ch == '-') ? TRUE : FALSE;
+    }
+
+    result = _CFHTTPMessageFindKnownHeader(name, length);
+    if (result)
+        return CFRetain(result);
+
+    return CFStringCreateWithBytes(alloc, name, length, kCFStringEncodingISOLatin1, FALSE);
+}
+
+static CFStringRef _CFHTTPMessageCreateHeaderValue(CFAllocatorRef alloc, const UInt8* bytes, CFIndex length) {
+    if (!length)
+        return CFRetain(_kCFHTTPMessageEmptyString);
+    return CFStringCreateWithBytes(alloc, bytes, length, kCFStringEncodingISOLatin1, FALSE);
+}
+
+// Fold every header line parsed since the last call into _headers.  Once the
+// header is complete and everything has been folded in, the ranges and the
+// header bytes they point into are let go.
+static void _CFHTTPMessageMaterializeHeaders(CFHTTPMessageRef msg) {
+
+    CFAllocatorRef alloc;
+    const UInt8* bytes;
+
+    if (msg->_headerMaterialized == msg->_headerCount)
+        return;
+
+    alloc = CFGetAllocator(msg);
+    bytes = _CFHTTPMessageGetHeaderBytes(msg);
+
+    for (; msg->_headerMaterialized < msg->_headerCount; msg->_headerMaterialized++) {
+
+        const struct _CFHTTPHeaderRange* range = &msg->_headerRanges[msg->_headerMaterialized];
+        CFStringRef value = _CFHTTPMessageCreateHeaderValue(alloc, bytes + range->_valueOffset, range->_valueLength);
+
+        // Continuation line
+        if (range->_keyOffset == kCFNotFound) {
+
+            CFStringRef old = msg->_lastKey ? CFDictionaryGetValue(msg->_headers, msg->_lastKey) : NULL;
+
+            if (old) {
+                CFMutableStringRef joined = CFStringCreateMutableCopy(alloc, 0, old);
+                CFStringAppend(joined, value);
+                __CFHTTPMessageSetHeader(msg, msg->_lastKey, joined, -1);
+                CFRelease(joined);
+            }
+        }
+
+        else {
+
+            CFStringRef key = _CFHTTPMessageCreateHeaderName(alloc, bytes + range->_keyOffset, range->_keyLength);
+            CFStringRef old = CFDictionaryGetValue(msg->_headers, key);
+
+            if (old) {
+                CFStringRef joined = CFStringCreateWithFormat(alloc, NULL, _kCFHTTPMessageAppendHeaderFormat, old, value);
+                CFRelease(value);
+                value = joined;
+            }
+
+            __CFHTTPMessageSetHeader(msg, key, value, -1);
+
+            if (msg->_lastKey)
+                CFRelease(msg->_lastKey);
+            msg->_lastKey = key;
+        }
+
+        CFRelease(value);
+    }
+
+    if (msg->_flags & HEADERS_COMPLETE) {
+        _CFHTTPMessageReleaseHeaderRanges(msg);
+        if (msg->_lastKey) {
+            CFRelease(msg->_lastKey);
+            msg->_lastKey = NULL;
+        }
+    }
+}
+
+static inline Boolean _CFHTTPMessageHeaderNameEqual(const UInt8* bytes, CFIndex length, const char* name, CFIndex nameLength) {
+
+    CFIndex i;
+
+    if (length != nameLength)
+        return FALSE;
+
+    for (i = 0; i < length; i++) {
+        UInt8 a = bytes[i], b = (UInt8)name[i];
+        if (a >= 'A' && a <= 'Z') a = a + 'a' - 'A';
+        if (b >= 'A' && b <= 'Z') b = b + 'a' - 'A';
+        if (a != b)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Look a header up straight from the parsed ranges, creating a string for its
+// value only.  Returns FALSE when the lookup has to go through _headers, which
+// is whenever anything has been put in there already.
+static Boolean _CFHTTPMessageCopyUnmaterializedHeader(CFHTTPMessageRef msg, CFStringRef header, CFStringRef* value) {
+
+    CFAllocatorRef alloc = CFGetAllocator(msg);
+    char name[kHTTPMessageHeaderNameBufferSize];
+    CFMutableStringRef joined = NULL;
+    Boolean matching = FALSE;
+    const UInt8* bytes;
+    CFIndex i, length;
+
+    *value = NULL;
+
+    if (!msg->_headerCount || msg->_headerMaterialized || msg->_lastKey || CFDictionaryGetCount(msg->_headers))
+        return FALSE;
+
+    if (!CFStringGetCString(header, name, sizeof(name), kCFStringEncodingISOLatin1))
+        return FALSE;
+
+    length = strlen(name);
+    bytes = _CFHTTPMessageGetHeaderBytes(msg);
+
+    for (i = 0; i < msg->_headerCount; i++) {
+
+        const struct _CFHTTPHeaderRange* range = &msg->_headerRanges[i];
+        CFStringRef piece;
+
+        if (range->_keyOffset != kCFNotFound) {
+
+            matching = _CFHTTPMessageHeaderNameEqual(bytes + range->_keyOffset, range->_keyLength, name, length);
+
+            // Repeated headers are joined the same way _CFHTTPMessageMaterializeHeaders does it.
+            if (matching && *value) {
+                if (!joined) {
+                    joined = CFStringCreateMutableCopy(alloc, 0, *value);
+                    CFRelease(*value);
+                    *value = joined;
+                }
+                CFStringAppend(joined, _kCFHTTPMessageAppendHeaderSeparator);
+            }
+        }
+
+        if (!matching)
+            continue;
+
+        piece = _CFHTTPMessageCreateHeaderValue(alloc, bytes + range->_valueOffset, range->_valueLength);
+
+        if (!*value) {
+            *value = piece;
+            continue;
+        }
+
+        if (!joined) {
+            joined = CFStringCreateMutableCopy(alloc, 0, *value);
+            CFRelease(*value);
+            *value = joined;
+        }
+
+        CFStringAppend(joined, piece);
+        CFRelease(piece);
+    }
+
+    return TRUE;
+}
+
+CFStringRef CFHTTPMessageCopyHeaderFieldValue(CFHTTPMessageRef msg, CFStringRef header) {
+    CFStringRef lowerHeader, result;
+    if (_CFHTTPMessageCopyUnmaterializedHeader(msg, header, &result)) {
+        return result;
+    }
+    _CFHTTPMessageMaterializeHeaders(msg);
+    lowerHeader = _CFCapitalizeHeader(header);
+    result = CFDictionaryGetValue(msg->_headers, lowerHeader);
+    CFRelease(lowerHeader);
+    if (result) CFRetain(result);
+    return result;
+}
+
+CFDictionaryRef CFHTTPMessageCopyAllHeaderFields(CFHTTPMessageRef msg) {
+    _CFHTTPMessageMaterializeHeaders(msg);
+    CFRetain(msg->_headers);
+    return msg->_headers;
+}
+
+extern void _CFHTTPMessageSetHeader(CFHTTPMessageRef msg, CFStringRef header, CFStringRef value, CFIndex position) {
+    _CFHTTPMessageMaterializeHeaders(msg);
+    __CFHTTPMessageSetHeader(msg, header, value, position);
+}
+
 void CFHTTPMessageSetHeaderFieldValue(CFHTTPMessageRef message, CFStringRef headerField, CFStringRef value) {
     CFStringRef header = _CFCapitalizeHeader(headerField);
     _CFHTTPMessageSetHeader(message, header, value, -1);
@@ -697,6 +1033,8 @@ extern CFDataRef _CFHTTPMessageCopySerializedHeaders(CFHTTPMessageRef msg, Boole
     CFDataRef result;
     unsigned i,c;
     
+    _CFHTTPMessageMaterializeHeaders(msg);
+
     if ((msg->_flags & IS_RESPONSE) != 0 || !forProxy) {
         headers = CFStringCreateMutableCopy(allocator, 0, msg->_firstLine);
     } else {
@@ -761,6 +1099,39 @@ Boolean CFHTTPMessageIsHeaderComplete(CFHTTPMessageRef message) {
 }
 
 
+// Whether repeating the request has the same effect on the server as sending it
+// once (RFC 7231 section 4.2.2), which is what makes it safe to pipeline behind
+// other requests and to send again if the connection dies before it is answered.
+/* extern */ Boolean _CFHTTPMessageIsIdempotentMethod(CFHTTPMessageRef msg) {
+
+	CFStringRef method;
+	Boolean result = FALSE;
+
+	if (_CFHTTPMessageIsGetMethod(msg))
+		return TRUE;
+
+	method = CFHTTPMessageCopyRequestMethod(msg);
+	if (method) {
+
+		CFStringRef idempotent[] = {
+			_kCFHTTPMessageHEADMethod,
+			_kCFHTTPMessagePUTMethod,
+			_kCFHTTPMessageDELETEMethod,
+			_kCFHTTPMessageOPTIONSMethod,
+			_kCFHTTPMessageTRACEMethod
+		};
+		int i;
+
+		for (i = 0; !result && i < (sizeof(idempotent) / sizeof(idempotent[0])); i++)
+			result = (CFStringCompare(method, idempotent[i], kCFCompareCaseInsensitive) == kCFCompareEqualTo);
+
+		CFRelease(method);
+	}
+
+	return result;
+}
+
+
 CFStringRef CFHTTPMessageCopyRequestMethod(CFHTTPMessageRef request) {
 //    __CFGenericValidateType(request, CFHTTPMessageGetTypeID());
 //    CFAssert2(((request->_flags & IS_RESPONSE) == 0), __kCFLogAssertion, "%s(): message 0x%x is an HTTP response, not a request", __PRETTY_FUNCTION__, request);
@@ -986,33 +1357,126 @@ static const UInt8 *_extractRequestFirstLine(CFHTTPMessageRef request, const UIn
     }
 }
 
-static inline const UInt8 *_findEOL(CFHTTPMessageRef response, const UInt8 *bytes, CFIndex len) {
-    
-    // According to the HTTP specification EOL is defined as
-    // a CRLF pair.  Unfortunately, some servers will use LF
-    // instead.  Worse yet, some servers will use a combination
-    // of both (e.g. <headers>CRLFLF<body>), so findEOL needs
-    // to be more forgiving.  It will now accept CRLF, LF, or
-    // CR.
-    //
-    // It returns NULL if EOL is not found or it will return
-    // a pointer to the first terminating character.
+// Scan bytes[from, to) for the LF ending a header line, returning its offset
+// or "to" if there isn't one yet.  If *colon is still kCFNotFound, it is set
+// to the first ':' ahead of the LF.  Headers are scanned 32 or 16 bytes at a
+// time where the compiler targets AVX2 or SSE2.
+static CFIndex _scanHeaderLine(const UInt8* bytes, CFIndex from, CFIndex to, CFIndex* colon) {
+
+    CFIndex i = from;
+
+#if defined(__GNUC__) && defined(__AVX2__)
+    {
+        const __m256i lf = _mm256_set1_epi8('\n');
+        const __m256i co = _mm256_set1_epi8(':');
+
+        for (; (i + 32) <= to; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(bytes + i));
+            UInt32 lfMask = (UInt32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+
+            if (*colon == kCFNotFound) {
+                UInt32 coMask = (UInt32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, co));
+                if (lfMask)
+                    coMask &= (lfMask & (0U - lfMask)) - 1;	// Only those ahead of the LF
+                if (coMask)
+                    *colon = i + __builtin_ctz(coMask);
+            }
+
+            if (lfMask)
+                return i + __builtin_ctz(lfMask);
+        }
+    }
+#endif
+
+#if defined(__GNUC__) && defined(__SSE2__)
+    {
+        const __m128i lf = _mm_set1_epi8('\n');
+        const __m128i co = _mm_set1_epi8(':');
+
+        for (; (i + 16) <= to; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(bytes + i));
+            UInt32 lfMask = (UInt32)_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+
+            if (*colon == kCFNotFound) {
+                UInt32 coMask = (UInt32)_mm_movemask_epi8(_mm_cmpeq_epi8(v, co));
+                if (lfMask)
+                    coMask &= (lfMask & (0U - lfMask)) - 1;	// Only those ahead of the LF
+                if (coMask)
+                    *colon = i + __builtin_ctz(coMask);
+            }
+
+            if (lfMask)
+                return i + __builtin_ctz(lfMask);
+        }
+    }
+
+    for (; i < to; i++) {
+        if (bytes[i] == '\n')
+            return i;
+        if ((bytes[i] == ':') && (*colon == kCFNotFound))
+            *colon = i;
+    }
+
+    return to;
+#else
+    {
+        const UInt8* eol = memchr(bytes + i, '\n', to - i);
+        CFIndex end = eol ? (eol - bytes) : to;
+
+        if (*colon == kCFNotFound) {
+            const UInt8* found = memchr(bytes + i, ':', end - i);
+            if (found)
+                *colon = found - bytes;
+        }
+
+        return end;
+    }
+#endif
+}
+
+
+// Called once HEADERS_COMPLETE is set.  The header bytes ahead of _parseOffset
+// move over to _headerData, where the parsed ranges keep pointing, and _data
+// is left holding just the body bytes that arrived along with the header.
+static void _CFHTTPMessageSplitHeaders(CFHTTPMessageRef message) {
+
+    if (message->_parseOffset) {
+        
+        CFMutableDataRef body = CFDataCreateMutable(CFGetAllocator(message), 0);
+        
+        CFDataAppendBytes(body, CFDataGetBytePtr(message->_data) + message->_parseOffset, CFDataGetLength(message->_data) - message->_parseOffset);
+        
+        if (message->_headerData)
+            CFRelease(message->_headerData);
+        message->_headerData = message->_data;
+        message->_data = body;
+        message->_flags |= MUTABLE_DATA;
+    }
     
-    const UInt8* result = memchr(bytes, '\n', len);
-    if (!result)
-        result = memchr(bytes, '\r', len - 1);  // NOTE (len - 1) in order to prevent spanning CRLF.
+    message->_parseOffset = 0;
+    message->_scanOffset = 0;
+    message->_colonOffset = kCFNotFound;
     
-    return result;
+    if (message->_headerMaterialized == message->_headerCount) {
+        _CFHTTPMessageReleaseHeaderRanges(message);
+        if (message->_lastKey) {
+            CFRelease(message->_lastKey);
+            message->_lastKey = NULL;
+        }
+    }
 }
 
 
-// The data to be parsed is sitting in message->_data
+// The data to be parsed is sitting in message->_data.  Parsing picks up at
+// _parseOffset, the start of the first line not yet parsed, and lines are
+// only recorded as ranges; see _CFHTTPMessageMaterializeHeaders.
 static Boolean _parseHeadersFromData(CFHTTPMessageRef message) {
 
     Boolean result = TRUE;
-    CFAllocatorRef alloc = CFGetAllocator(message);
-    const UInt8* start = CFDataGetBytePtr(message->_data);
-    const UInt8* end = start + CFDataGetLength(message->_data);
+    Boolean sawNewline = TRUE;
+    const UInt8* bytes = CFDataGetBytePtr(message->_data);
+    CFIndex end = CFDataGetLength(message->_data);
+    CFIndex start = message->_parseOffset;
 
     if (!message->_firstLine) {
         
@@ -1021,72 +1485,93 @@ static Boolean _parseHeadersFromData(CFHTTPMessageRef message) {
         // NOTE this is not using CFHTTPMessageIsRequest in order
         // to avoid the function dispatch.
         if (message->_flags & IS_RESPONSE)
-            newStart = _extractResponseStatusLine(message, start, end - start);
+            newStart = _extractResponseStatusLine(message, bytes, end);
         else
-            newStart = _extractRequestFirstLine(message, start, end - start);
+            newStart = _extractRequestFirstLine(message, bytes, end);
             
-        if (newStart == start)
+        if (newStart == bytes)
             return TRUE;
             
         if (!newStart)
             return FALSE;
             
-        start = newStart;
+        start = newStart - bytes;
+        message->_scanOffset = start;
+        message->_colonOffset = kCFNotFound;
     }
     
     while ((start != end) && !(message->_flags & HEADERS_COMPLETE)) {
         
         UInt8 c;
-        const UInt8* eov;	// End of value?
-        const UInt8* eol = _findEOL(message, start, end - start);
+        CFIndex eov;	// End of value?
+        CFIndex eol = end;
+        CFIndex colon = message->_colonOffset;
         
-        if (!eol)
-            break;
+        // According to the HTTP specification EOL is defined as
+        // a CRLF pair.  Unfortunately, some servers will use LF
+        // instead.  Worse yet, some servers will use a combination
+        // of both (e.g. <headers>CRLFLF<body>), so this needs
+        // to be more forgiving.  It will accept CRLF, LF, or CR,
+        // but a bare CR only in a message whose first line ended
+        // with one, and only if there's no LF left at all.  In any
+        // other message a bare CR is part of the line, whose LF
+        // has yet to arrive, so the result doesn't depend on how
+        // the bytes were split up.
+        if (sawNewline)
+            eol = _scanHeaderLine(bytes, message->_scanOffset, end, &colon);
+        
+        if (eol == end) {
+            
+            // NOTE (end - start - 1) in order to prevent spanning CRLF.
+            const UInt8* cr = (DELIMITER(message->_flags) != DELIM_CR) ? NULL : memchr(bytes + start, '\r', end - start - 1);
+            
+            sawNewline = FALSE;
+            
+            if (!cr) {
+                message->_scanOffset = end;
+                message->_colonOffset = colon;
+                break;
+            }
+            
+            eol = cr - bytes;
+            cr = memchr(bytes + start, ':', eol - start);
+            colon = cr ? (cr - bytes) : kCFNotFound;
+        }
         
         // Make end-of-value point to the character just before
         // the first eol marker.
         eov = eol - 1;
-        if ((*eov == '\r') && (*eol == '\n'))
+        if ((eov >= 0) && (bytes[eov] == '\r') && (bytes[eol] == '\n'))
             eov--;
         
         // Check if it's the empty line between head and body
         if (start >= eov) {
             start = eol + 1;
             message->_flags |= HEADERS_COMPLETE;
-            if (message->_lastKey) {
-                CFRelease(message->_lastKey);
-                message->_lastKey = NULL;
-            }
             break;
         }
         
-        c = *start;
+        c = bytes[start];
         
         // Check for continuation header
         if ((c == ' ') || (c == '\t')) {
             
-            if (!message->_lastKey) {
+            if (!message->_headerCount && !message->_lastKey) {
                 if (!(message->_flags & LAX_PARSING)) {
                     result = FALSE;
                     break;
                 }
             } 
-            else {
-                CFMutableStringRef value = CFStringCreateMutableCopy(alloc, 0, CFDictionaryGetValue(message->_headers, message->_lastKey));
-                CFStringRef str = CFStringCreateWithBytes(alloc, start, eov - start + 1, kCFStringEncodingISOLatin1, FALSE);
-                CFStringAppend(value, str);
-                CFRelease(str);
-                CFHTTPMessageSetHeaderFieldValue(message, message->_lastKey, value);
-                CFRelease(value);
+            else if (!_CFHTTPMessageAddHeaderRange(message, kCFNotFound, 0, start, eov - start + 1)) {
+                result = FALSE;
+                break;
             }
         }
         
         // It's a new header
         else {
         
-            const UInt8* colon = memchr(start, ':', eol - start);
-            
-            if (!colon) {
+            if (colon == kCFNotFound) {
                 // Bad header; check to see if it's the IIS/eBay bug (second status
                 // line being sent) before declaring it a parse error - 3140081
 
@@ -1102,69 +1587,27 @@ static Boolean _parseHeadersFromData(CFHTTPMessageRef message) {
             
             else {
                 
-                CFStringRef key = NULL;
-                CFStringRef value, old;
-                int i;
+                CFIndex value = colon + 1;
                 
-                for (i = 0; i < kHTTPMessageNumItems; i++) {
-                    const struct MessageHeaderMap* map = &kHTTPMessageHeaderMap[i];
-                    if (((colon - start) == map->_length) &&
-                        !strncmp(map->_header, (const char*)start, map->_length))
-                    {
-                        key = CFRetain(kHTTPMessageHeaderMap2[i]);
-                        break;
-                    }
-                }
-                
-                if (!key) {
-                    CFStringRef temp;
-                    key = CFStringCreateWithBytes(alloc, start, colon - start, kCFStringEncodingISOLatin1, FALSE);
-                    temp = _CFCapitalizeHeader(key);
-                    CFRelease(key);
-                    key = temp;
-                }
-                
-                if (message->_lastKey)
-                    CFRelease(message->_lastKey);
-                message->_lastKey = CFRetain(key);
+                while ((value < eol) && ((bytes[value] == ' ') || (bytes[value] == '\t')))
+                    value++;
                 
-                c = *++colon;
-                while ((c == ' ') || (c == '\t'))
-                    c = *++colon;
-                    
-                if (colon > eov)
-                    value = CFRetain(_kCFHTTPMessageEmptyString);
-                else
-                    value = CFStringCreateWithBytes(alloc, colon, eov - colon + 1, kCFStringEncodingISOLatin1, FALSE);
-                    
-                old = CFDictionaryGetValue(message->_headers, key);
-                if (old) {
-                    CFStringRef newValue = CFStringCreateWithFormat(alloc, NULL, _kCFHTTPMessageAppendHeaderFormat, old, value);
-                    CFRelease(value);
-                    value = newValue;
+                if (!_CFHTTPMessageAddHeaderRange(message, start, colon - start, value, (value > eov) ? 0 : (eov - value + 1))) {
+                    result = FALSE;
+                    break;
                 }
-                
-                _CFHTTPMessageSetHeader(message, key, value, -1);
-                
-                CFRelease(key);
-                CFRelease(value);
             }
         }
             
         start = eol + 1;
+        message->_scanOffset = start;
+        message->_colonOffset = kCFNotFound;
     }
     
-    if (start != CFDataGetBytePtr(message->_data)) {
+    message->_parseOffset = start;
     
-        if (message->_flags & MUTABLE_DATA) {
-            CFDataReplaceBytes((CFMutableDataRef)message->_data, CFRangeMake(0, start - CFDataGetBytePtr(message->_data)), NULL, 0);
-        }
-        else {
-            message->_flags &= (~MUTABLE_DATA);
-            CFRelease(message->_data);
-            message->_data = CFDataCreate(alloc, start, end - start);
-        }
-    }
+    if (message->_flags & HEADERS_COMPLETE)
+        _CFHTTPMessageSplitHeaders(message);
 
     return result;
 }
@@ -1199,6 +1642,7 @@ extern Boolean _CFHTTPMessageConvertToDataOnlyResponse(CFHTTPMessageRef message)
     if (!(message->_flags & IS_RESPONSE)) return FALSE;
     message->_firstLine = CFRetain(_kCFHTTPMessageEmptyString);
     message->_flags |= HEADERS_COMPLETE;
+    _CFHTTPMessageSplitHeaders(message);
     return TRUE;
 } 
 
@@ -1215,8 +1659,9 @@ extern Boolean _CFHTTPMessageCanStandAlone(CFHTTPMessageRef message) {
     if (!(message->_flags & IS_RESPONSE)) return FALSE;
 	if (message->_flags & HEADERS_COMPLETE) return TRUE;
 	if (!message->_firstLine) return FALSE;
-	if (message->_data && !CFDataGetLength(message->_data)) {
+	if (message->_data && (CFDataGetLength(message->_data) == message->_parseOffset)) {
 		message->_flags |= HEADERS_COMPLETE;
+		_CFHTTPMessageSplitHeaders(message);
 		return TRUE;
 	}
 	return FALSE;
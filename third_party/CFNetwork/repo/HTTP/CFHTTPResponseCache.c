@@ -0,0 +1,1352 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+/*
+ *  CFHTTPResponseCache.c
+ *  CFNetwork
+ *
+ */
+
+
+#pragma mark Description
+/*
+    The response cache keeps responses to GET requests made on HTTP streams which
+    ask for it with _kCFStreamPropertyHTTPUseResponseCache, so that the same request
+    can be answered again without the server, or with just a 304 from it.  It follows
+    RFC 7234 as a private cache.
+
+    Responses are stored by request URL, one per URL.  If the response has a Vary
+    header, the request's values of the fields it names are stored with it, and only
+    a request with the same values is answered from it.  An entry's freshness is
+    worked out once, when it is stored: its freshness lifetime, from max-age, Expires
+    or, failing those, a tenth of the time since Last-Modified; and its age when it
+    was received, from its Date and Age headers and how long the request took.  A
+    lookup then only has to add the time since.
+
+    Entries live in two tiers, each bounded by bytes, sharing one list in order of
+    use.  The memory tier holds the parsed response headers and the body.  The disk
+    tier, kept only once a directory is given, holds a file per entry: a fixed header,
+    the Vary values, the serialized headers and the body.  An entry only on disk is
+    loaded by mapping its file; the body is left in the mapping.  The directory also
+    holds an index of the entries on disk, in order of use, with everything a lookup
+    needs short of the response itself, so starting up only reads the index.  It is
+    rewritten, by renaming a new one over it, whenever the disk tier changes.  Entry
+    files are always written under a new number and are only ever found through the
+    index, so a crash leaves at worst files no index refers to, which are deleted the
+    next time the directory is opened.
+
+    When a stored response is stale but has an ETag or Last-Modified, the stream
+    sends the request made conditional on them.  A 304 answer updates the stored
+    headers and is passed to the client as the stored response, with the stored
+    body.  Anything else replaces the stored response, if it may be stored at all.
+
+    All of the cache's state is guarded by a single mutex; file I/O is done holding
+    it, which keeps the index consistent with the files.
+*/
+
+#pragma mark -
+#pragma mark Includes
+#if HAVE_CONFIG_H
+#include "opencfnetwork-config.h"
+#endif
+
+#include <CFNetwork/CFHTTPStreamPriv.h>
+#include <CFNetwork/CFHTTPMessagePriv.h>
+#include "CFNetworkInternal.h"
+#include "CFHTTPInternal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__MACH__) || defined(__linux__)
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+#pragma mark -
+#pragma mark Constants
+
+// The memory tier's default capacity; the disk tier has none until it is given a directory
+#define kHTTPResponseCacheMemoryCapacity		(4 * 1024 * 1024)
+#define kHTTPResponseCacheDiskCapacity			(32 * 1024 * 1024)
+
+// No response is stored in a tier if it would take more than this fraction of the tier
+#define kHTTPResponseCacheEntryFraction			8
+
+// Heuristic freshness (RFC 7234 section 4.2.2) is this much of the time since Last-Modified, up to a day
+#define kHTTPResponseCacheHeuristicFraction		0.1
+#define kHTTPResponseCacheHeuristicLimit		86400.0
+
+#define kHTTPResponseCacheFileMagic				0x43464843		// 'CFHC'
+#define kHTTPResponseCacheIndexMagic			0x43464849		// 'CFHI'
+#define kHTTPResponseCacheVersion				1
+
+// Entry flags
+#define kEntryNoCache							0x1		// Must be revalidated before every use
+#define kEntryMustRevalidate					0x2		// Must not be used stale, whatever the request allows
+#define kEntryHasValidator						0x4		// Has an ETag or Last-Modified to be revalidated with
+
+#ifdef __CONSTANT_CFSTRINGS__
+#define _kCFHTTPResponseCacheAgeHeader					CFSTR("Age")
+#define _kCFHTTPResponseCacheAuthorizationHeader		CFSTR("Authorization")
+#define _kCFHTTPResponseCacheControlHeader				CFSTR("Cache-Control")
+#define _kCFHTTPResponseCacheContentEncodingHeader		CFSTR("Content-Encoding")
+#define _kCFHTTPResponseCacheContentLengthHeader		CFSTR("Content-Length")
+#define _kCFHTTPResponseCacheDateHeader					CFSTR("Date")
+#define _kCFHTTPResponseCacheEtagHeader					CFSTR("Etag")
+#define _kCFHTTPResponseCacheExpiresHeader				CFSTR("Expires")
+#define _kCFHTTPResponseCacheIfMatchHeader				CFSTR("If-Match")
+#define _kCFHTTPResponseCacheIfModifiedSinceHeader		CFSTR("If-Modified-Since")
+#define _kCFHTTPResponseCacheIfNoneMatchHeader			CFSTR("If-None-Match")
+#define _kCFHTTPResponseCacheIfRangeHeader				CFSTR("If-Range")
+#define _kCFHTTPResponseCacheIfUnmodifiedSinceHeader	CFSTR("If-Unmodified-Since")
+#define _kCFHTTPResponseCacheLastModifiedHeader			CFSTR("Last-Modified")
+#define _kCFHTTPResponseCachePragmaHeader				CFSTR("Pragma")
+#define _kCFHTTPResponseCacheRangeHeader				CFSTR("Range")
+#define _kCFHTTPResponseCacheTransferEncodingHeader		CFSTR("Transfer-Encoding")
+#define _kCFHTTPResponseCacheVaryHeader					CFSTR("Vary")
+#define _kCFHTTPResponseCacheIdentityEncoding			CFSTR("identity")
+#define _kCFHTTPResponseCacheNoCache					CFSTR("no-cache")
+#define _kCFHTTPResponseCacheVaryAll					CFSTR("*")
+#define _kCFHTTPResponseCacheVarySeparator				CFSTR(",")
+#define _kCFHTTPResponseCacheVaryFormat					CFSTR("%@: %@\n")
+#define _kCFHTTPResponseCacheAgeFormat					CFSTR("%ld")
+#define _kCFHTTPResponseCacheHEADMethod					CFSTR("HEAD")
+#define _kCFHTTPResponseCacheOPTIONSMethod				CFSTR("OPTIONS")
+#define _kCFHTTPResponseCacheTRACEMethod				CFSTR("TRACE")
+#else
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheAgeHeader, "Age")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheAuthorizationHeader, "Authorization")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheControlHeader, "Cache-Control")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheContentEncodingHeader, "Content-Encoding")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheContentLengthHeader, "Content-Length")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheDateHeader, "Date")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheEtagHeader, "Etag")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheExpiresHeader, "Expires")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheIfMatchHeader, "If-Match")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheIfModifiedSinceHeader, "If-Modified-Since")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheIfNoneMatchHeader, "If-None-Match")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheIfRangeHeader, "If-Range")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheIfUnmodifiedSinceHeader, "If-Unmodified-Since")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheLastModifiedHeader, "Last-Modified")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCachePragmaHeader, "Pragma")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheRangeHeader, "Range")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheTransferEncodingHeader, "Transfer-Encoding")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheVaryHeader, "Vary")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheIdentityEncoding, "identity")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheNoCache, "no-cache")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheVaryAll, "*")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheVarySeparator, ",")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheVaryFormat, "%@: %@\n")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheAgeFormat, "%ld")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheHEADMethod, "HEAD")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheOPTIONSMethod, "OPTIONS")
+CONST_STRING_DECL_LOCAL(_kCFHTTPResponseCacheTRACEMethod, "TRACE")
+#endif	/* __CONSTANT_CFSTRINGS__ */
+
+
+#pragma mark -
+#pragma mark Type Declarations
+
+// The Cache-Control directives the cache pays attention to, from a request or a response
+typedef struct {
+    Boolean noStore;
+    Boolean noCache;
+    Boolean mustRevalidate;
+    Boolean isPublic;
+    Boolean hasSharedMaxAge;
+    CFTimeInterval maxAge;      // Negative if absent
+    CFTimeInterval minFresh;
+    CFTimeInterval maxStale;    // Zero if absent; effectively forever if given without a value
+} _CFHTTPCacheControl;
+
+typedef struct _CFHTTPResponseCacheEntry {
+    struct _CFHTTPResponseCacheEntry *prev, *next;  // In order of use, least recent first
+    CFStringRef key;                // The request's URL
+    CFStringRef variant;            // See copyVariant; only set while the response is
+    CFHTTPMessageRef response;      // NULL while the entry is only on disk
+    CFDataRef body;
+    CFIndex size;                   // The serialized headers and the body
+    UInt32 file;                    // The number of its file in the disk tier; zero if it isn't on disk
+    UInt32 flags;
+    CFAbsoluteTime responseTime;    // When the response was received
+    CFTimeInterval initialAge;      // corrected_initial_age (RFC 7234 section 4.2.3)
+    CFTimeInterval lifetime;        // freshness_lifetime (RFC 7234 section 4.2.1)
+} _CFHTTPResponseCacheEntry;
+
+typedef struct {
+    CFIndex hits;
+    CFIndex revalidations;
+    CFIndex misses;
+    CFIndex stores;
+    CFIndex evictions;
+} _CFHTTPResponseCacheStatistics;
+
+// On disk, an entry's file is this header, then the variant, serialized headers and body
+typedef struct {
+    UInt32 magic;
+    UInt32 version;
+    UInt32 variantLength;
+    UInt32 headersLength;
+    UInt64 bodyLength;
+} _CFHTTPResponseCacheFileHeader;
+
+// The index is this header, then a record per entry on disk, each followed by its key padded to eight bytes
+typedef struct {
+    UInt32 magic;
+    UInt32 version;
+    UInt32 count;
+    UInt32 nextFile;
+} _CFHTTPResponseCacheIndexHeader;
+
+typedef struct {
+    UInt32 file;
+    UInt32 flags;
+    UInt32 keyLength;
+    UInt32 reserved;
+    UInt64 size;
+    CFAbsoluteTime responseTime;
+    CFTimeInterval initialAge;
+    CFTimeInterval lifetime;
+} _CFHTTPResponseCacheIndexRecord;
+
+
+#pragma mark -
+#pragma mark Static Variable Definitions
+
+static _CFOnceLock responseCacheOnce = _CFOnceInitializer;
+static _CFMutex responseCacheLock;
+static CFMutableDictionaryRef responseCacheEntries = NULL;     // By key; the entries are not retained
+static _CFHTTPResponseCacheEntry *responseCacheHead = NULL;    // Least recently used
+static _CFHTTPResponseCacheEntry *responseCacheTail = NULL;
+static CFIndex responseCacheMemoryCapacity = kHTTPResponseCacheMemoryCapacity;
+static CFIndex responseCacheDiskCapacity = kHTTPResponseCacheDiskCapacity;
+static CFIndex responseCacheMemoryUsage = 0;
+static CFIndex responseCacheDiskUsage = 0;
+static char *responseCacheDirectory = NULL;                     // The disk tier's directory; NULL if there is no disk tier
+static UInt32 responseCacheNextFile = 1;
+static _CFHTTPResponseCacheStatistics responseCacheStatistics = {0, 0, 0, 0, 0};
+
+
+#pragma mark -
+#pragma mark Static Function Declarations
+
+static void initializeResponseCache(void);
+static void lockResponseCache(void);
+static void unlockResponseCache(void);
+
+static void getCacheControl(CFHTTPMessageRef msg, _CFHTTPCacheControl *cc);
+static Boolean getHeaderDate(CFHTTPMessageRef msg, CFStringRef header, CFAbsoluteTime *when);
+static Boolean hasHeader(CFHTTPMessageRef msg, CFStringRef header);
+static void removeHeader(CFHTTPMessageRef msg, CFStringRef header);
+static UInt32 getFreshness(CFHTTPMessageRef response, CFAbsoluteTime requestTime, CFAbsoluteTime responseTime, CFTimeInterval *initialAge, CFTimeInterval *lifetime);
+static CFStringRef copyCacheKey(CFHTTPMessageRef request);
+static Boolean copyVariant(CFHTTPMessageRef request, CFHTTPMessageRef response, CFStringRef *variant);
+
+static void linkEntry(_CFHTTPResponseCacheEntry *entry);
+static void unlinkEntry(_CFHTTPResponseCacheEntry *entry);
+static void dropEntryMemory(_CFHTTPResponseCacheEntry *entry);
+static void removeEntry(_CFHTTPResponseCacheEntry *entry);
+static Boolean trimResponseCache(void);
+
+static UInt32 writeEntryFile(CFStringRef variant, CFDataRef headers, CFDataRef body);
+static Boolean mapEntryFile(_CFHTTPResponseCacheEntry *entry);
+static void deleteEntryFile(_CFHTTPResponseCacheEntry *entry);
+static void writeResponseCacheIndex(void);
+static void openResponseCacheDirectory(const char *path);
+static void closeResponseCacheDirectory(void);
+
+
+#pragma mark -
+#pragma mark Static Function Definitions
+
+/* static */ void
+initializeResponseCache(void) {
+    _CFMutexInit(&responseCacheLock, FALSE);
+    responseCacheEntries = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+}
+
+
+/* static */ void
+lockResponseCache(void) {
+    _CFDoOnce(&responseCacheOnce, initializeResponseCache);
+    _CFMutexLock(&responseCacheLock);
+}
+
+
+/* static */ void
+unlockResponseCache(void) {
+    _CFMutexUnlock(&responseCacheLock);
+}
+
+
+// Delta-seconds, as in max-age=60; an overflowing value is as good as forever
+static CFTimeInterval parseDeltaSeconds(const char *value) {
+    CFTimeInterval result = 0;
+    while (*value == '"') value++;
+    while (*value >= '0' && *value <= '9') {
+        result = result * 10 + (*value - '0');
+        value++;
+    }
+    return result;
+}
+
+
+/* static */ void
+getCacheControl(CFHTTPMessageRef msg, _CFHTTPCacheControl *cc) {
+    CFStringRef value = CFHTTPMessageCopyHeaderFieldValue(msg, _kCFHTTPResponseCacheControlHeader);
+    char buffer[512];
+    CFIndex length = 0;
+    char *directive, *next;
+
+    memset(cc, 0, sizeof(cc[0]));
+    cc->maxAge = -1;
+
+    if (!value) {
+        // HTTP/1.0 caches know only "Pragma: no-cache" (RFC 7234 section 5.4)
+        value = CFHTTPMessageCopyHeaderFieldValue(msg, _kCFHTTPResponseCachePragmaHeader);
+        if (value) {
+            if (CFStringFind(value, _kCFHTTPResponseCacheNoCache, kCFCompareCaseInsensitive).location != kCFNotFound)
+                cc->noCache = TRUE;
+            CFRelease(value);
+        }
+        return;
+    }
+
+    // Anything past the buffer is dropped; directives that long aren't ones this cache knows
+    CFStringGetBytes(value, CFRangeMake(0, CFStringGetLength(value)), kCFStringEncodingASCII, '?', FALSE, (UInt8 *)buffer, sizeof(buffer) - 1, &length);
+    buffer[length] = '\0';
+    CFRelease(value);
+
+    for (directive = buffer; directive; directive = next) {
+        char *argument, *end;
+        next = strchr(directive, ',');
+        if (next) *next++ = '\0';
+        while (*directive == ' ' || *directive == '\t') directive++;
+        argument = strchr(directive, '=');
+        if (argument) *argument++ = '\0';
+        // Directive names are matched as whole tokens, so "no-cache-ext" is not no-cache
+        end = directive + strlen(directive);
+        while (end > directive && (end[-1] == ' ' || end[-1] == '\t')) *--end = '\0';
+
+        if (!strcasecmp(directive, "no-store")) {
+            cc->noStore = TRUE;
+        } else if (!strcasecmp(directive, "no-cache")) {
+            // no-cache with field names is treated like no-cache for the whole response
+            cc->noCache = TRUE;
+        } else if (!strcasecmp(directive, "must-revalidate") || !strcasecmp(directive, "proxy-revalidate")) {
+            cc->mustRevalidate = TRUE;
+        } else if (!strcasecmp(directive, "public")) {
+            cc->isPublic = TRUE;
+        } else if (!strcasecmp(directive, "s-maxage")) {
+            cc->hasSharedMaxAge = TRUE;
+        } else if (!strcasecmp(directive, "max-age") && argument) {
+            cc->maxAge = parseDeltaSeconds(argument);
+        } else if (!strcasecmp(directive, "min-fresh") && argument) {
+            cc->minFresh = parseDeltaSeconds(argument);
+        } else if (!strcasecmp(directive, "max-stale")) {
+            cc->maxStale = argument ? parseDeltaSeconds(argument) : 1e+20;
+        }
+    }
+}
+
+
+/* static */ Boolean
+getHeaderDate(CFHTTPMessageRef msg, CFStringRef header, CFAbsoluteTime *when) {
+    CFStringRef value = CFHTTPMessageCopyHeaderFieldValue(msg, header);
+    Boolean result = FALSE;
+    if (value) {
+        CFGregorianDate date;
+        CFTimeZoneRef tz = NULL;
+        if (_CFGregorianDateCreateWithString(CFGetAllocator(msg), value, &date, &tz) > 0) {
+            *when = CFGregorianDateGetAbsoluteTime(date, tz);
+            result = TRUE;
+        }
+        if (tz) CFRelease(tz);
+        CFRelease(value);
+    }
+    return result;
+}
+
+
+/* static */ Boolean
+hasHeader(CFHTTPMessageRef msg, CFStringRef header) {
+    CFStringRef value = CFHTTPMessageCopyHeaderFieldValue(msg, header);
+    if (!value) return FALSE;
+    CFRelease(value);
+    return TRUE;
+}
+
+
+// Removing a header the message doesn't have is not allowed
+/* static */ void
+removeHeader(CFHTTPMessageRef msg, CFStringRef header) {
+    if (hasHeader(msg, header)) CFHTTPMessageSetHeaderFieldValue(msg, header, NULL);
+}
+
+
+// Works out a response's freshness lifetime and its age on arrival (RFC 7234 sections 4.2.1 to 4.2.3), and returns its entry flags
+/* static */ UInt32
+getFreshness(CFHTTPMessageRef response, CFAbsoluteTime requestTime, CFAbsoluteTime responseTime, CFTimeInterval *initialAge, CFTimeInterval *lifetime) {
+    _CFHTTPCacheControl cc;
+    CFAbsoluteTime date, expires, lastModified;
+    CFStringRef ageValue;
+    CFTimeInterval age = 0, apparentAge;
+    UInt32 flags = 0;
+    Boolean hasLastModified;
+
+    getCacheControl(response, &cc);
+    if (!getHeaderDate(response, _kCFHTTPResponseCacheDateHeader, &date)) date = responseTime;
+    hasLastModified = getHeaderDate(response, _kCFHTTPResponseCacheLastModifiedHeader, &lastModified);
+
+    if (cc.maxAge >= 0) {
+        *lifetime = cc.maxAge;
+    } else if (hasHeader(response, _kCFHTTPResponseCacheExpiresHeader)) {
+        // An Expires that can't be parsed means already expired
+        *lifetime = getHeaderDate(response, _kCFHTTPResponseCacheExpiresHeader, &expires) ? expires - date : 0;
+    } else if (hasLastModified && lastModified < date) {
+        *lifetime = (date - lastModified) * kHTTPResponseCacheHeuristicFraction;
+        if (*lifetime > kHTTPResponseCacheHeuristicLimit) *lifetime = kHTTPResponseCacheHeuristicLimit;
+    } else {
+        *lifetime = 0;
+    }
+    if (*lifetime < 0) *lifetime = 0;
+
+    ageValue = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPResponseCacheAgeHeader);
+    if (ageValue) {
+        age = CFStringGetIntValue(ageValue);
+        if (age < 0) age = 0;
+        CFRelease(ageValue);
+    }
+    apparentAge = responseTime - date;
+    age += responseTime - requestTime;
+    *initialAge = (apparentAge > age) ? apparentAge : age;
+    if (*initialAge < 0) *initialAge = 0;
+
+    if (cc.noCache) flags |= kEntryNoCache;
+    if (cc.mustRevalidate) flags |= kEntryMustRevalidate;
+    if (hasLastModified || hasHeader(response, _kCFHTTPResponseCacheEtagHeader)) flags |= kEntryHasValidator;
+    return flags;
+}
+
+
+/* static */ CFStringRef
+copyCacheKey(CFHTTPMessageRef request) {
+    CFURLRef url = CFHTTPMessageCopyRequestURL(request);
+    CFStringRef key = NULL;
+    if (url) {
+        CFURLRef absolute = CFURLCopyAbsoluteURL(url);
+        if (absolute) {
+            key = CFURLGetString(absolute);
+            CFRetain(key);
+            CFRelease(absolute);
+        }
+        CFRelease(url);
+    }
+    return key;
+}
+
+
+// The request's values of the fields named by the response's Vary header, one "name: value" line each;
+// *variant is NULL if there is no Vary header.  Returns FALSE if the response varies on everything.
+/* static */ Boolean
+copyVariant(CFHTTPMessageRef request, CFHTTPMessageRef response, CFStringRef *variant) {
+    CFAllocatorRef alloc = CFGetAllocator(request);
+    CFStringRef vary = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPResponseCacheVaryHeader);
+    CFArrayRef names;
+    CFMutableStringRef result;
+    CFIndex i, c;
+
+    *variant = NULL;
+    if (!vary) return TRUE;
+
+    names = CFStringCreateArrayBySeparatingStrings(alloc, vary, _kCFHTTPResponseCacheVarySeparator);
+    CFRelease(vary);
+    if (!names) return FALSE;
+
+    result = CFStringCreateMutable(alloc, 0);
+    for (i = 0, c = CFArrayGetCount(names); result && i < c; i++) {
+        CFMutableStringRef name = CFStringCreateMutableCopy(alloc, 0, CFArrayGetValueAtIndex(names, i));
+        CFStringRef value;
+        CFStringTrimWhitespace(name);
+        CFStringLowercase(name, NULL);
+        if (CFEqual(name, _kCFHTTPResponseCacheVaryAll)) {
+            CFRelease(result);
+            result = NULL;
+        } else if (CFStringGetLength(name)) {
+            value = CFHTTPMessageCopyHeaderFieldValue(request, name);
+            CFStringAppendFormat(result, NULL, _kCFHTTPResponseCacheVaryFormat, name, value ? value : CFSTR(""));
+            if (value) CFRelease(value);
+        }
+        CFRelease(name);
+    }
+    CFRelease(names);
+
+    *variant = result;
+    return result ? TRUE : FALSE;
+}
+
+
+/* static */ void
+linkEntry(_CFHTTPResponseCacheEntry *entry) {
+    entry->prev = responseCacheTail;
+    entry->next = NULL;
+    if (responseCacheTail)
+        responseCacheTail->next = entry;
+    else
+        responseCacheHead = entry;
+    responseCacheTail = entry;
+}
+
+
+/* static */ void
+unlinkEntry(_CFHTTPResponseCacheEntry *entry) {
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        responseCacheHead = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        responseCacheTail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+
+/* static */ void
+dropEntryMemory(_CFHTTPResponseCacheEntry *entry) {
+    if (!entry->response) return;
+    responseCacheMemoryUsage -= entry->size;
+    CFRelease(entry->response);
+    entry->response = NULL;
+    if (entry->body) CFRelease(entry->body);
+    entry->body = NULL;
+    if (entry->variant) CFRelease(entry->variant);
+    entry->variant = NULL;
+}
+
+
+// The caller rewrites the index if the entry was on disk
+/* static */ void
+removeEntry(_CFHTTPResponseCacheEntry *entry) {
+    unlinkEntry(entry);
+    CFDictionaryRemoveValue(responseCacheEntries, entry->key);
+    dropEntryMemory(entry);
+    deleteEntryFile(entry);
+    CFRelease(entry->key);
+    free(entry);
+}
+
+
+// Evicts the least recently used entries from each tier until both are within capacity; returns whether the disk tier changed
+/* static */ Boolean
+trimResponseCache(void) {
+    _CFHTTPResponseCacheEntry *entry = responseCacheHead;
+    Boolean diskChanged = FALSE;
+
+    while (entry && (responseCacheMemoryUsage > responseCacheMemoryCapacity || responseCacheDiskUsage > responseCacheDiskCapacity)) {
+        _CFHTTPResponseCacheEntry *next = entry->next;
+        Boolean evicted = FALSE;
+        if (entry->response && responseCacheMemoryUsage > responseCacheMemoryCapacity) {
+            dropEntryMemory(entry);
+            evicted = TRUE;
+        }
+        if (entry->file && responseCacheDiskUsage > responseCacheDiskCapacity) {
+            deleteEntryFile(entry);
+            diskChanged = evicted = TRUE;
+        }
+        if (!entry->response && !entry->file) removeEntry(entry);
+        if (evicted) responseCacheStatistics.evictions++;
+        entry = next;
+    }
+    return diskChanged;
+}
+
+
+#if defined(__MACH__) || defined(__linux__)
+
+typedef struct {
+    void *base;
+    size_t length;
+} _CFHTTPResponseCacheMapping;
+
+static void *allocateFromMapping(CFIndex size, CFOptionFlags hint, void *info) {
+    (void)size;		/* unused */
+    (void)hint;		/* unused */
+    (void)info;		/* unused */
+    return NULL;
+}
+
+static void unmapMapping(void *ptr, void *info) {
+    _CFHTTPResponseCacheMapping *mapping = (_CFHTTPResponseCacheMapping *)info;
+    munmap(mapping->base, mapping->length);
+}
+
+static void releaseMapping(const void *info) {
+    free((void *)info);
+}
+
+// An allocator whose only job is to unmap a file once the body living in it is released
+static CFAllocatorRef createMappingAllocator(void *base, size_t length) {
+    _CFHTTPResponseCacheMapping *mapping = malloc(sizeof(_CFHTTPResponseCacheMapping));
+    CFAllocatorContext ctxt = {0, mapping, NULL, releaseMapping, NULL, allocateFromMapping, NULL, unmapMapping, NULL};
+    CFAllocatorRef result;
+    if (!mapping) return NULL;
+    mapping->base = base;
+    mapping->length = length;
+    result = CFAllocatorCreate(kCFAllocatorDefault, &ctxt);
+    if (!result) free(mapping);
+    return result;
+}
+
+static Boolean writeAll(int fd, const void *bytes, size_t length) {
+    const UInt8 *next = (const UInt8 *)bytes;
+    while (length) {
+        ssize_t written = write(fd, next, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return FALSE;
+        }
+        next += written;
+        length -= (size_t)written;
+    }
+    return TRUE;
+}
+
+static void getEntryFilePath(UInt32 file, char *path, size_t size) {
+    snprintf(path, size, "%s/%08lx.cache", responseCacheDirectory, (unsigned long)file);
+}
+
+/* static */ UInt32
+writeEntryFile(CFStringRef variant, CFDataRef headers, CFDataRef body) {
+    _CFHTTPResponseCacheFileHeader header;
+    CFDataRef variantData = variant ? CFStringCreateExternalRepresentation(kCFAllocatorDefault, variant, kCFStringEncodingUTF8, 0) : NULL;
+    char path[PATH_MAX];
+    UInt32 file;
+    Boolean ok;
+    int fd;
+
+    file = responseCacheNextFile++;
+    if (!responseCacheNextFile) responseCacheNextFile = 1;
+    getEntryFilePath(file, path, sizeof(path));
+
+    header.magic = kHTTPResponseCacheFileMagic;
+    header.version = kHTTPResponseCacheVersion;
+    header.variantLength = variantData ? (UInt32)CFDataGetLength(variantData) : 0;
+    header.headersLength = (UInt32)CFDataGetLength(headers);
+    header.bodyLength = (UInt64)CFDataGetLength(body);
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    ok = (fd >= 0 &&
+          writeAll(fd, &header, sizeof(header)) &&
+          (!variantData || writeAll(fd, CFDataGetBytePtr(variantData), CFDataGetLength(variantData))) &&
+          writeAll(fd, CFDataGetBytePtr(headers), CFDataGetLength(headers)) &&
+          writeAll(fd, CFDataGetBytePtr(body), CFDataGetLength(body)));
+    if (fd >= 0) close(fd);
+    if (variantData) CFRelease(variantData);
+
+    if (!ok) {
+        unlink(path);
+        return 0;
+    }
+    return file;
+}
+
+// Loads an entry only on disk into the memory tier; the body stays in the mapped file
+/* static */ Boolean
+mapEntryFile(_CFHTTPResponseCacheEntry *entry) {
+    const _CFHTTPResponseCacheFileHeader *header;
+    char path[PATH_MAX];
+    struct stat sb;
+    void *base = MAP_FAILED;
+    size_t length = 0;
+    const UInt8 *bytes;
+    CFHTTPMessageRef response = NULL;
+    CFStringRef variant = NULL;
+    CFDataRef body = NULL;
+    int fd;
+
+    if (!entry->file || !responseCacheDirectory) return FALSE;
+    getEntryFilePath(entry->file, path, sizeof(path));
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return FALSE;
+    if (fstat(fd, &sb) == 0 && sb.st_size >= (off_t)sizeof(_CFHTTPResponseCacheFileHeader)) {
+        length = (size_t)sb.st_size;
+        base = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) return FALSE;
+
+    header = (const _CFHTTPResponseCacheFileHeader *)base;
+    bytes = (const UInt8 *)base + sizeof(_CFHTTPResponseCacheFileHeader);
+    if (header->magic == kHTTPResponseCacheFileMagic && header->version == kHTTPResponseCacheVersion &&
+        sizeof(_CFHTTPResponseCacheFileHeader) + (UInt64)header->variantLength + header->headersLength + header->bodyLength == (UInt64)length)
+    {
+        if (header->variantLength) {
+            variant = CFStringCreateWithBytes(kCFAllocatorDefault, bytes, header->variantLength, kCFStringEncodingUTF8, FALSE);
+        }
+        response = CFHTTPMessageCreateEmpty(kCFAllocatorDefault, FALSE);
+        if (response && (!CFHTTPMessageAppendBytes(response, bytes + header->variantLength, header->headersLength) || !CFHTTPMessageIsHeaderComplete(response))) {
+            CFRelease(response);
+            response = NULL;
+        }
+    }
+    if (response && (variant || !header->variantLength)) {
+        const UInt8 *bodyBytes = bytes + header->variantLength + header->headersLength;
+        CFAllocatorRef deallocator = header->bodyLength ? createMappingAllocator(base, length) : NULL;
+        if (deallocator) {
+            body = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, bodyBytes, (CFIndex)header->bodyLength, deallocator);
+            CFRelease(deallocator);
+            if (body) base = MAP_FAILED; // The body owns the mapping now
+        } else if (!header->bodyLength) {
+            body = CFDataCreate(kCFAllocatorDefault, NULL, 0);
+        }
+    }
+    if (base != MAP_FAILED) munmap(base, length);
+
+    if (!body) {
+        if (response) CFRelease(response);
+        if (variant) CFRelease(variant);
+        return FALSE;
+    }
+    entry->response = response;
+    entry->body = body;
+    entry->variant = variant;
+    responseCacheMemoryUsage += entry->size;
+    return TRUE;
+}
+
+/* static */ void
+deleteEntryFile(_CFHTTPResponseCacheEntry *entry) {
+    char path[PATH_MAX];
+    if (!entry->file) return;
+    if (responseCacheDirectory) {
+        getEntryFilePath(entry->file, path, sizeof(path));
+        unlink(path);
+    }
+    responseCacheDiskUsage -= entry->size;
+    entry->file = 0;
+}
+
+/* static */ void
+writeResponseCacheIndex(void) {
+    CFMutableDataRef data;
+    _CFHTTPResponseCacheIndexHeader header;
+    _CFHTTPResponseCacheEntry *entry;
+    char path[PATH_MAX], tmpPath[PATH_MAX];
+    Boolean ok;
+    int fd;
+
+    if (!responseCacheDirectory) return;
+    data = CFDataCreateMutable(kCFAllocatorDefault, 0);
+    if (!data) return;
+
+    header.magic = kHTTPResponseCacheIndexMagic;
+    header.version = kHTTPResponseCacheVersion;
+    header.count = 0;
+    header.nextFile = responseCacheNextFile;
+    CFDataAppendBytes(data, (const UInt8 *)&header, sizeof(header));
+
+    for (entry = responseCacheHead; entry; entry = entry->next) {
+        static const UInt8 padding[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+        _CFHTTPResponseCacheIndexRecord record;
+        CFDataRef key;
+        if (!entry->file) continue;
+        key = CFStringCreateExternalRepresentation(kCFAllocatorDefault, entry->key, kCFStringEncodingUTF8, 0);
+        if (!key) continue;
+        record.file = entry->file;
+        record.flags = entry->flags;
+        record.keyLength = (UInt32)CFDataGetLength(key);
+        record.reserved = 0;
+        record.size = (UInt64)entry->size;
+        record.responseTime = entry->responseTime;
+        record.initialAge = entry->initialAge;
+        record.lifetime = entry->lifetime;
+        CFDataAppendBytes(data, (const UInt8 *)&record, sizeof(record));
+        CFDataAppendBytes(data, CFDataGetBytePtr(key), CFDataGetLength(key));
+        CFDataAppendBytes(data, padding, (8 - (record.keyLength % 8)) % 8);
+        CFRelease(key);
+        header.count++;
+    }
+    memmove(CFDataGetMutableBytePtr(data), &header, sizeof(header));
+
+    snprintf(path, sizeof(path), "%s/index", responseCacheDirectory);
+    snprintf(tmpPath, sizeof(tmpPath), "%s/index.tmp", responseCacheDirectory);
+    fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    ok = (fd >= 0 && writeAll(fd, CFDataGetBytePtr(data), CFDataGetLength(data)));
+    if (fd >= 0) close(fd);
+    if (!ok || rename(tmpPath, path) != 0) unlink(tmpPath);
+    CFRelease(data);
+}
+
+// Reads the index, adding its entries, disk only, behind any already in memory
+static void readResponseCacheIndex(void) {
+    const _CFHTTPResponseCacheIndexHeader *header;
+    const UInt8 *next, *end;
+    char path[PATH_MAX];
+    struct stat sb;
+    void *base = MAP_FAILED;
+    size_t length = 0;
+    UInt32 i;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/index", responseCacheDirectory);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    if (fstat(fd, &sb) == 0 && sb.st_size >= (off_t)sizeof(_CFHTTPResponseCacheIndexHeader)) {
+        length = (size_t)sb.st_size;
+        base = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) return;
+
+    header = (const _CFHTTPResponseCacheIndexHeader *)base;
+    next = (const UInt8 *)base + sizeof(_CFHTTPResponseCacheIndexHeader);
+    end = (const UInt8 *)base + length;
+    if (header->magic == kHTTPResponseCacheIndexMagic && header->version == kHTTPResponseCacheVersion) {
+        if (header->nextFile > responseCacheNextFile) responseCacheNextFile = header->nextFile;
+        for (i = 0; i < header->count && (size_t)(end - next) >= sizeof(_CFHTTPResponseCacheIndexRecord); i++) {
+            _CFHTTPResponseCacheIndexRecord record;
+            _CFHTTPResponseCacheEntry *entry;
+            CFStringRef key;
+            memmove(&record, next, sizeof(record));
+            next += sizeof(record);
+            if ((size_t)(end - next) < record.keyLength) break;
+            key = CFStringCreateWithBytes(kCFAllocatorDefault, next, record.keyLength, kCFStringEncodingUTF8, FALSE);
+            next += record.keyLength + (8 - (record.keyLength % 8)) % 8;
+            if (!key) continue;
+            if (!record.file || CFDictionaryGetValue(responseCacheEntries, key) || !(entry = calloc(1, sizeof(_CFHTTPResponseCacheEntry)))) {
+                CFRelease(key);
+                continue;
+            }
+            entry->key = key;
+            entry->size = (CFIndex)record.size;
+            entry->file = record.file;
+            entry->flags = record.flags;
+            entry->responseTime = record.responseTime;
+            entry->initialAge = record.initialAge;
+            entry->lifetime = record.lifetime;
+            if (record.file >= responseCacheNextFile) responseCacheNextFile = record.file + 1;
+            CFDictionarySetValue(responseCacheEntries, key, entry);
+            linkEntry(entry);
+            responseCacheDiskUsage += entry->size;
+        }
+    }
+    munmap(base, length);
+}
+
+/* static */ void
+openResponseCacheDirectory(const char *path) {
+    _CFHTTPResponseCacheEntry *entry;
+    CFMutableSetRef files;
+    struct dirent *dp;
+    DIR *dir;
+
+    if (mkdir(path, 0700) != 0 && errno != EEXIST) return;
+    responseCacheDirectory = strdup(path);
+    if (!responseCacheDirectory) return;
+    readResponseCacheIndex();
+
+    // Delete the files the index doesn't know, left by a crash or by an index which couldn't be written
+    files = CFSetCreateMutable(kCFAllocatorDefault, 0, NULL);
+    for (entry = responseCacheHead; files && entry; entry = entry->next) {
+        if (entry->file) CFSetAddValue(files, (const void *)(uintptr_t)entry->file);
+    }
+    dir = files ? opendir(path) : NULL;
+    if (dir) {
+        while ((dp = readdir(dir)) != NULL) {
+            unsigned long file;
+            char suffix[8];
+            if (sscanf(dp->d_name, "%8lx.%7s", &file, suffix) == 2 && !strcmp(suffix, "cache") && !CFSetContainsValue(files, (const void *)(uintptr_t)file)) {
+                char filePath[PATH_MAX];
+                snprintf(filePath, sizeof(filePath), "%s/%s", path, dp->d_name);
+                unlink(filePath);
+            }
+        }
+        closedir(dir);
+    }
+    if (files) CFRelease(files);
+}
+
+#else
+
+/* static */ UInt32
+writeEntryFile(CFStringRef variant, CFDataRef headers, CFDataRef body) {
+    return 0;
+}
+
+/* static */ Boolean
+mapEntryFile(_CFHTTPResponseCacheEntry *entry) {
+    return FALSE;
+}
+
+/* static */ void
+deleteEntryFile(_CFHTTPResponseCacheEntry *entry) {
+    entry->file = 0;
+}
+
+/* static */ void
+writeResponseCacheIndex(void) {
+}
+
+/* static */ void
+openResponseCacheDirectory(const char *path) {
+}
+
+#endif /* defined(__MACH__) || defined(__linux__) */
+
+
+// Leaves the entries on disk behind; those only on disk are dropped altogether
+/* static */ void
+closeResponseCacheDirectory(void) {
+    _CFHTTPResponseCacheEntry *entry = responseCacheHead;
+    while (entry) {
+        _CFHTTPResponseCacheEntry *next = entry->next;
+        entry->file = 0;
+        if (!entry->response) removeEntry(entry);
+        entry = next;
+    }
+    responseCacheDiskUsage = 0;
+    if (responseCacheDirectory) free(responseCacheDirectory);
+    responseCacheDirectory = NULL;
+}
+
+
+#pragma mark -
+#pragma mark Extern Function Definitions (Internal)
+
+/* extern */ _CFHTTPResponseCacheResult
+_CFHTTPResponseCacheLookup(CFHTTPMessageRef request, CFHTTPMessageRef *response, CFDataRef *body) {
+    _CFHTTPResponseCacheResult result = kCFHTTPResponseCacheMiss;
+    _CFHTTPResponseCacheEntry *entry;
+    _CFHTTPCacheControl cc;
+    CFStringRef key;
+
+    *response = NULL;
+    *body = NULL;
+
+    if (!_CFHTTPMessageIsGetMethod(request)) {
+        CFStringRef method = CFHTTPMessageCopyRequestMethod(request);
+        // A request which may change the resource leaves what is stored for it out of date (RFC 7234 section 4.4)
+        if (method && !CFEqual(method, _kCFHTTPResponseCacheHEADMethod) && !CFEqual(method, _kCFHTTPResponseCacheOPTIONSMethod) && !CFEqual(method, _kCFHTTPResponseCacheTRACEMethod)) {
+            _CFHTTPResponseCacheRemove(request);
+        }
+        if (method) CFRelease(method);
+        return kCFHTTPResponseCacheUnusable;
+    }
+
+    // The client is making its own conditional or partial request; its answer is for it alone
+    if (hasHeader(request, _kCFHTTPResponseCacheIfNoneMatchHeader) ||
+        hasHeader(request, _kCFHTTPResponseCacheIfModifiedSinceHeader) ||
+        hasHeader(request, _kCFHTTPResponseCacheIfMatchHeader) ||
+        hasHeader(request, _kCFHTTPResponseCacheIfUnmodifiedSinceHeader) ||
+        hasHeader(request, _kCFHTTPResponseCacheIfRangeHeader) ||
+        hasHeader(request, _kCFHTTPResponseCacheRangeHeader))
+    {
+        return kCFHTTPResponseCacheUnusable;
+    }
+
+    getCacheControl(request, &cc);
+    if (cc.noStore) return kCFHTTPResponseCacheUnusable;
+
+    key = copyCacheKey(request);
+    if (!key) return kCFHTTPResponseCacheUnusable;
+
+    lockResponseCache();
+    entry = (_CFHTTPResponseCacheEntry *)CFDictionaryGetValue(responseCacheEntries, key);
+    if (entry && !entry->response && !mapEntryFile(entry)) {
+        removeEntry(entry);
+        writeResponseCacheIndex();
+        entry = NULL;
+    }
+    if (entry) {
+        CFStringRef variant;
+        // A request for another variant goes to the server; its response will replace this one
+        if (!copyVariant(request, entry->response, &variant) ||
+            (variant != entry->variant && (!variant || !entry->variant || !CFEqual(variant, entry->variant))))
+        {
+            entry = NULL;
+        }
+        if (variant) CFRelease(variant);
+    }
+    if (entry) {
+        CFTimeInterval age = entry->initialAge + (CFAbsoluteTimeGetCurrent() - entry->responseTime);
+        CFTimeInterval staleness = (entry->flags & kEntryMustRevalidate) ? 0 : cc.maxStale;
+        Boolean fresh = (!cc.noCache && !(entry->flags & kEntryNoCache) &&
+                         age + cc.minFresh < entry->lifetime + staleness &&
+                         (cc.maxAge < 0 || age <= cc.maxAge));
+        if (fresh) {
+            // A response used without asking the server must say how old it is (RFC 7234 section 4)
+            CFStringRef ageValue = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, _kCFHTTPResponseCacheAgeFormat, (long)age);
+            *response = CFHTTPMessageCreateCopy(kCFAllocatorDefault, entry->response);
+            if (*response && ageValue) CFHTTPMessageSetHeaderFieldValue(*response, _kCFHTTPResponseCacheAgeHeader, ageValue);
+            if (ageValue) CFRelease(ageValue);
+            result = *response ? kCFHTTPResponseCacheFresh : kCFHTTPResponseCacheMiss;
+        } else if (entry->flags & kEntryHasValidator) {
+            *response = (CFHTTPMessageRef)CFRetain(entry->response);
+            result = kCFHTTPResponseCacheStale;
+        }
+        if (result != kCFHTTPResponseCacheMiss) {
+            *body = (CFDataRef)CFRetain(entry->body);
+            unlinkEntry(entry);
+            linkEntry(entry);
+        }
+    }
+    if (result == kCFHTTPResponseCacheFresh) {
+        responseCacheStatistics.hits++;
+    } else {
+        responseCacheStatistics.misses++;
+    }
+    // A lookup may have loaded an entry from disk
+    if (trimResponseCache()) writeResponseCacheIndex();
+    unlockResponseCache();
+
+    CFRelease(key);
+    return result;
+}
+
+
+/* extern */ void
+_CFHTTPResponseCacheAddValidators(CFHTTPMessageRef request, CFHTTPMessageRef response) {
+    CFStringRef etag = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPResponseCacheEtagHeader);
+    CFStringRef lastModified = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPResponseCacheLastModifiedHeader);
+    if (etag) {
+        CFHTTPMessageSetHeaderFieldValue(request, _kCFHTTPResponseCacheIfNoneMatchHeader, etag);
+        CFRelease(etag);
+    }
+    if (lastModified) {
+        CFHTTPMessageSetHeaderFieldValue(request, _kCFHTTPResponseCacheIfModifiedSinceHeader, lastModified);
+        CFRelease(lastModified);
+    }
+}
+
+
+/* extern */ void
+_CFHTTPResponseCacheRemoveValidators(CFHTTPMessageRef request) {
+    removeHeader(request, _kCFHTTPResponseCacheIfNoneMatchHeader);
+    removeHeader(request, _kCFHTTPResponseCacheIfModifiedSinceHeader);
+}
+
+
+/* extern */ Boolean
+_CFHTTPResponseCacheCanStore(CFHTTPMessageRef request, CFHTTPMessageRef response) {
+    _CFHTTPCacheControl requestCC, responseCC;
+    CFStringRef encoding, variant;
+    CFTimeInterval initialAge, lifetime;
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    UInt32 flags;
+
+    // Only final responses which are cacheable by default (RFC 7231 section 6.1); redirections are followed instead
+    switch (CFHTTPMessageGetResponseStatusCode(response)) {
+    case 200: case 203: case 204: case 404: case 405: case 410: case 414: case 501:
+        break;
+    default:
+        return FALSE;
+    }
+    if (!_CFHTTPMessageIsGetMethod(request)) return FALSE;
+
+    getCacheControl(request, &requestCC);
+    getCacheControl(response, &responseCC);
+    if (requestCC.noStore || responseCC.noStore) return FALSE;
+
+    // Answers to requests with credentials are only for those credentials, unless they say otherwise (RFC 7234 section 3.2)
+    if (hasHeader(request, _kCFHTTPResponseCacheAuthorizationHeader) && !responseCC.isPublic && !responseCC.mustRevalidate && !responseCC.hasSharedMaxAge) {
+        return FALSE;
+    }
+
+    // The stream may have decoded the body, so it might not match the headers stored with it
+    encoding = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPResponseCacheContentEncodingHeader);
+    if (encoding) {
+        Boolean identity = (CFStringCompare(encoding, _kCFHTTPResponseCacheIdentityEncoding, kCFCompareCaseInsensitive) == kCFCompareEqualTo);
+        CFRelease(encoding);
+        if (!identity) return FALSE;
+    }
+
+    if (!copyVariant(request, response, &variant)) return FALSE;
+    if (variant) CFRelease(variant);
+
+    // Not worth keeping if it can neither be used as is nor revalidated
+    flags = getFreshness(response, now, now, &initialAge, &lifetime);
+    return (lifetime > 0 || (flags & kEntryHasValidator)) ? TRUE : FALSE;
+}
+
+
+/* extern */ CFIndex
+_CFHTTPResponseCacheGetMaxEntrySize(void) {
+    CFIndex result;
+    lockResponseCache();
+    result = responseCacheMemoryCapacity;
+    if (responseCacheDirectory && responseCacheDiskCapacity > result) result = responseCacheDiskCapacity;
+    unlockResponseCache();
+    return (result > 0) ? result / kHTTPResponseCacheEntryFraction : 0;
+}
+
+
+/* extern */ void
+_CFHTTPResponseCacheStore(CFHTTPMessageRef request, CFHTTPMessageRef response, CFDataRef body, CFAbsoluteTime requestTime, CFAbsoluteTime responseTime) {
+    _CFHTTPResponseCacheEntry *entry;
+    CFStringRef key, variant;
+    CFDataRef headers;
+    CFIndex size;
+    Boolean inMemory, onDisk;
+
+    if (!copyVariant(request, response, &variant)) return;
+    key = copyCacheKey(request);
+    headers = _CFHTTPMessageCopySerializedMessage(response, FALSE);
+    if (!key || !headers) {
+        if (key) CFRelease(key);
+        if (headers) CFRelease(headers);
+        if (variant) CFRelease(variant);
+        return;
+    }
+    size = CFDataGetLength(headers) + CFDataGetLength(body);
+
+    lockResponseCache();
+    inMemory = (size <= responseCacheMemoryCapacity / kHTTPResponseCacheEntryFraction);
+    onDisk = (responseCacheDirectory && size <= responseCacheDiskCapacity / kHTTPResponseCacheEntryFraction);
+
+    // What was stored for the URL is out of date now, whether or not this replaces it
+    entry = (_CFHTTPResponseCacheEntry *)CFDictionaryGetValue(responseCacheEntries, key);
+    if (entry) {
+        Boolean wasOnDisk = entry->file ? TRUE : FALSE;
+        removeEntry(entry);
+        if (wasOnDisk && !onDisk) writeResponseCacheIndex();
+    }
+
+    entry = (inMemory || onDisk) ? calloc(1, sizeof(_CFHTTPResponseCacheEntry)) : NULL;
+    if (entry) {
+        entry->key = key;
+        CFRetain(key);
+        entry->size = size;
+        entry->responseTime = responseTime;
+        entry->flags = getFreshness(response, requestTime, responseTime, &entry->initialAge, &entry->lifetime);
+        if (inMemory) {
+            entry->response = CFHTTPMessageCreateCopy(kCFAllocatorDefault, response);
+            entry->body = CFDataCreateCopy(kCFAllocatorDefault, body);
+            if (entry->response && entry->body) {
+                if (variant) entry->variant = CFRetain(variant);
+                responseCacheMemoryUsage += size;
+            } else {
+                if (entry->response) CFRelease(entry->response);
+                if (entry->body) CFRelease(entry->body);
+                entry->response = NULL;
+                entry->body = NULL;
+            }
+        }
+        if (onDisk) {
+            entry->file = writeEntryFile(variant, headers, body);
+            if (entry->file) responseCacheDiskUsage += size;
+        }
+        if (entry->response || entry->file) {
+            responseCacheStatistics.stores++;
+            CFDictionarySetValue(responseCacheEntries, key, entry);
+            linkEntry(entry);
+            trimResponseCache();
+            if (onDisk) writeResponseCacheIndex();
+        } else {
+            CFRelease(entry->key);
+            free(entry);
+        }
+    }
+    unlockResponseCache();
+
+    CFRelease(key);
+    CFRelease(headers);
+    if (variant) CFRelease(variant);
+}
+
+
+/* extern */ CFHTTPMessageRef
+_CFHTTPResponseCacheCopyRevalidated(CFHTTPMessageRef request, CFHTTPMessageRef stored, CFHTTPMessageRef notModified, CFDataRef body, CFAbsoluteTime requestTime, CFAbsoluteTime responseTime) {
+    CFHTTPMessageRef result = CFHTTPMessageCreateCopy(CFGetAllocator(stored), stored);
+    CFDictionaryRef headers = CFHTTPMessageCopyAllHeaderFields(notModified);
+    _CFHTTPResponseCacheEntry *entry;
+    CFStringRef key, variant = NULL;
+    Boolean updated = FALSE;
+
+    if (!result) {
+        if (headers) CFRelease(headers);
+        return NULL;
+    }
+
+    // The 304's headers replace the stored ones (RFC 7234 section 4.3.4), except for those framing its own, empty, body
+    if (headers) {
+        CFIndex i, count = CFDictionaryGetCount(headers);
+        if (count > 0) {
+            CFStringRef *keys, *values;
+            keys = CFAllocatorAllocate(kCFAllocatorDefault, sizeof(CFStringRef) * 2 * count, 0);
+            values = keys + count;
+            CFDictionaryGetKeysAndValues(headers, (const void **)keys, (const void **)values);
+            for (i = 0; i < count; i++) {
+                if (CFStringCompare(keys[i], _kCFHTTPResponseCacheContentLengthHeader, kCFCompareCaseInsensitive) == kCFCompareEqualTo ||
+                    CFStringCompare(keys[i], _kCFHTTPResponseCacheTransferEncodingHeader, kCFCompareCaseInsensitive) == kCFCompareEqualTo)
+                {
+                    continue;
+                }
+                CFHTTPMessageSetHeaderFieldValue(result, keys[i], values[i]);
+            }
+            CFAllocatorDeallocate(kCFAllocatorDefault, keys);
+        }
+        CFRelease(headers);
+    }
+
+    key = copyCacheKey(request);
+    if (key && copyVariant(request, result, &variant)) {
+        lockResponseCache();
+        responseCacheStatistics.revalidations++;
+
+        // An entry on disk keeps its file, whose headers are only out of date in what the index now overrides
+        entry = (_CFHTTPResponseCacheEntry *)CFDictionaryGetValue(responseCacheEntries, key);
+        if (entry && entry->file && entry->response &&
+            (variant == entry->variant || (variant && entry->variant && CFEqual(variant, entry->variant))))
+        {
+            entry->responseTime = responseTime;
+            entry->flags = getFreshness(result, requestTime, responseTime, &entry->initialAge, &entry->lifetime);
+            CFRelease(entry->response);
+            entry->response = CFHTTPMessageCreateCopy(kCFAllocatorDefault, result);
+            if (!entry->response) {
+                responseCacheMemoryUsage -= entry->size;
+                if (entry->body) CFRelease(entry->body);
+                entry->body = NULL;
+                if (entry->variant) CFRelease(entry->variant);
+                entry->variant = NULL;
+            }
+            unlinkEntry(entry);
+            linkEntry(entry);
+            writeResponseCacheIndex();
+            updated = TRUE;
+        }
+        unlockResponseCache();
+
+        if (!updated && _CFHTTPResponseCacheCanStore(request, result)) {
+            _CFHTTPResponseCacheStore(request, result, body, requestTime, responseTime);
+        }
+    }
+    if (key) CFRelease(key);
+    if (variant) CFRelease(variant);
+    return result;
+}
+
+
+/* extern */ void
+_CFHTTPResponseCacheRemove(CFHTTPMessageRef request) {
+    CFStringRef key = copyCacheKey(request);
+    _CFHTTPResponseCacheEntry *entry;
+    if (!key) return;
+    lockResponseCache();
+    entry = (_CFHTTPResponseCacheEntry *)CFDictionaryGetValue(responseCacheEntries, key);
+    if (entry) {
+        Boolean wasOnDisk = entry->file ? TRUE : FALSE;
+        removeEntry(entry);
+        if (wasOnDisk) writeResponseCacheIndex();
+    }
+    unlockResponseCache();
+    CFRelease(key);
+}
+
+
+#pragma mark -
+#pragma mark Extern Function Definitions (API)
+
+/* extern */ void
+_CFHTTPStreamSetResponseCacheLimits(CFIndex memoryCapacity, CFIndex diskCapacity, CFURLRef directory) {
+    char path[PATH_MAX];
+    Boolean hasPath = FALSE;
+
+    if (directory) {
+        CFURLRef absolute = CFURLCopyAbsoluteURL(directory);
+        if (absolute) {
+            hasPath = CFURLGetFileSystemRepresentation(absolute, TRUE, (UInt8 *)path, sizeof(path));
+            CFRelease(absolute);
+        }
+    }
+
+    lockResponseCache();
+    responseCacheMemoryCapacity = (memoryCapacity > 0) ? memoryCapacity : 0;
+    responseCacheDiskCapacity = (diskCapacity > 0) ? diskCapacity : 0;
+    if (!hasPath || !responseCacheDirectory || strcmp(path, responseCacheDirectory)) {
+        closeResponseCacheDirectory();
+        if (hasPath) openResponseCacheDirectory(path);
+    }
+    if (trimResponseCache()) writeResponseCacheIndex();
+    unlockResponseCache();
+}
+
+
+/* extern */ void
+_CFHTTPStreamRemoveAllCachedResponses(void) {
+    Boolean hadDisk;
+    lockResponseCache();
+    hadDisk = responseCacheDiskUsage ? TRUE : FALSE;
+    while (responseCacheHead) {
+        removeEntry(responseCacheHead);
+    }
+    if (hadDisk) writeResponseCacheIndex();
+    unlockResponseCache();
+}
+
+
+/* extern */ CFDictionaryRef
+_CFHTTPStreamCopyResponseCacheStatistics(CFAllocatorRef alloc) {
+    _CFHTTPResponseCacheStatistics stats;
+    CFIndex memoryUsage, diskUsage;
+    CFStringRef keys[] = {
+        _kCFHTTPStreamResponseCacheHits,
+        _kCFHTTPStreamResponseCacheRevalidations,
+        _kCFHTTPStreamResponseCacheMisses,
+        _kCFHTTPStreamResponseCacheStores,
+        _kCFHTTPStreamResponseCacheEvictions,
+        _kCFHTTPStreamResponseCacheMemoryUsage,
+        _kCFHTTPStreamResponseCacheDiskUsage
+    };
+    CFNumberRef values[sizeof(keys) / sizeof(keys[0])];
+    CFDictionaryRef result;
+    int i;
+
+    lockResponseCache();
+    memmove(&stats, &responseCacheStatistics, sizeof(stats));
+    memoryUsage = responseCacheMemoryUsage;
+    diskUsage = responseCacheDiskUsage;
+    unlockResponseCache();
+
+    values[0] = CFNumberCreate(alloc, kCFNumberCFIndexType, &stats.hits);
+    values[1] = CFNumberCreate(alloc, kCFNumberCFIndexType, &stats.revalidations);
+    values[2] = CFNumberCreate(alloc, kCFNumberCFIndexType, &stats.misses);
+    values[3] = CFNumberCreate(alloc, kCFNumberCFIndexType, &stats.stores);
+    values[4] = CFNumberCreate(alloc, kCFNumberCFIndexType, &stats.evictions);
+    values[5] = CFNumberCreate(alloc, kCFNumberCFIndexType, &memoryUsage);
+    values[6] = CFNumberCreate(alloc, kCFNumberCFIndexType, &diskUsage);
+
+    result = CFDictionaryCreate(alloc, (const void **)keys, (const void **)values, sizeof(keys) / sizeof(keys[0]), &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+
+    for (i = 0; i < (sizeof(values) / sizeof(values[0])); i++)
+        CFRelease(values[i]);
+
+    return result;
+}
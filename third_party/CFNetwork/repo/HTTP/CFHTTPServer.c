@@ -51,10 +51,30 @@
     queue of ordered requests on the connection.  This ordered array is maintained in
     order to send the responses in the correct order.  The second part is a dictionary
     mapping an individual request to its response.  A response is comprised of a set of
-    headers (CFHTTPMessageRef) and a stream (CFReadStreamRef) which acts as the body.
-    Every outgoing response has both of these elements.  This means that
-    _CFHTTPServerAddResponse creates a stream for the body of the response and then calls
-    _CFHTTPServerAddStreamedResponse.
+    headers (CFHTTPMessageRef), a body, and the framing of that body.  The body is the
+    CFDataRef given to _CFHTTPServerAddResponse, the CFReadStreamRef given to
+    _CFHTTPServerAddStreamedResponse, or the file CFURLRef given to
+    _CFHTTPServerAddFileResponse.  Streamed bodies of unknown length are sent chunked.
+    
+    Outgoing bytes are queued on the connection as a list of CFDataRef segments, along
+    with how much of the first has already been sent.  The segments are written with a
+    single vectored write, so headers and body go out together without being copied into
+    one buffer.  File bodies are written straight from the file, using sendfile where the
+    socket allows it.
+    
+    HttpConnection's are serviced by HttpWorkers.  By default, there is a single worker
+    servicing every connection on the run loop on which the server was started.  If a
+    worker count is set with _CFHTTPServerSetWorkerCount, the server instead spawns that
+    many threads, each running its own run loop.  New sockets are still accepted on the
+    run loop on which the server was started and are handed off to the workers in turn.
+    The worker creates the HttpConnection and schedules its streams on its own run loop,
+    so all of a connection's work is done on one thread.  A response added on any other
+    thread is queued to the connection's worker, which then pumps it.
+    
+    Rather than a timer per connection, each worker has a single timer which sweeps a
+    wheel of connections bucketed by the second in which they time out.  Activity on a
+    connection just pushes its deadline out.  As the sweep reaches a slot, connections
+    whose deadlines have moved are re-bucketed and the rest are timed out.
     
     Some cheap object model:
     
@@ -72,21 +92,33 @@
 #pragma mark Includes
 #include <CFNetwork/CFServerPriv.h>
 #include <CFNetwork/CFHTTPServerPriv.h>
+#include <CFNetwork/CFSocketStreamPriv.h>
 #include "CFNetworkInternal.h"
 
 #include <CoreFoundation/CFRuntime.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
 #if !defined(__WIN32__)
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #else
 #include <winsock2.h>
 #define SOCK_MAXADDRLEN 255
+#define close(s) closesocket(s)
 #endif
 
 #ifndef SOCK_MAXADDRLEN
 #define SOCK_MAXADDRLEN 255
 #endif
 
+#ifndef PATH_MAX
+#define PATH_MAX 1024
+#endif
+
 #if 0
 #pragma mark -
 #pragma mark Constant Strings
@@ -97,7 +129,8 @@
 #define _kCFHTTPServerPtrFormat					CFSTR("<0x%x>")
 #define _kCFHTTPServerContentLengthHeader		CFSTR("Content-length")
 #define _kCFHTTPServerContentLengthFormat		CFSTR("%d")
-#define _kCFHTTPServerConnectionDescribeFormat	CFSTR("<_HttpConnection 0x%x>{server=0x%x, timer=%@, inStream=%@, outStream=%@, responses=%@, requests=%@, buffered=%@}")
+#define _kCFHTTPServerContentLengthFileFormat	CFSTR("%lld")
+#define _kCFHTTPServerConnectionDescribeFormat	CFSTR("<_HttpConnection 0x%x>{server=0x%x, worker=0x%x, inStream=%@, outStream=%@, responses=%@, requests=%@, output=%@}")
 #define _kCFHTTPServerTransferEncodingHeader	CFSTR("Transfer-Encoding")
 #define _kCFHTTPServerTransferEncodingChunked	CFSTR("chunked")
 #define _kCFHTTPServerConnectionHeader			CFSTR("Connection")
@@ -107,38 +140,57 @@ CONST_STRING_DECL_LOCAL(_kCFHTTPServerDescribeFormat, "<HttpServer 0x%x>{server=
 CONST_STRING_DECL_LOCAL(_kCFHTTPServerPtrFormat, "<0x%x>")
 CONST_STRING_DECL_LOCAL(_kCFHTTPServerContentLengthHeader, "Content-length")
 CONST_STRING_DECL_LOCAL(_kCFHTTPServerContentLengthFormat, "%d")
-CONST_STRING_DECL_LOCAL(_kCFHTTPServerConnectionDescribeFormat, "<_HttpConnection 0x%x>{server=0x%x, timer=%@, inStream=%@, outStream=%@, responses=%@, requests=%@, buffered=%@}")
+CONST_STRING_DECL_LOCAL(_kCFHTTPServerContentLengthFileFormat, "%lld")
+CONST_STRING_DECL_LOCAL(_kCFHTTPServerConnectionDescribeFormat, "<_HttpConnection 0x%x>{server=0x%x, worker=0x%x, inStream=%@, outStream=%@, responses=%@, requests=%@, output=%@}")
 CONST_STRING_DECL_LOCAL(_kCFHTTPServerTransferEncodingHeader, "Transfer-Encoding")
 CONST_STRING_DECL_LOCAL(_kCFHTTPServerTransferEncodingChunked, "chunked")
 CONST_STRING_DECL_LOCAL(_kCFHTTPServerConnectionHeader, "Connection")
 CONST_STRING_DECL_LOCAL(_kCFHTTPServerConnectionClose, "close")
 #endif	/* __CONSTANT_CFSTRINGS__ */
 
+static const UInt8 _kCFHTTPServerChunkTerminator[] = {'\r', '\n'};
+static const UInt8 _kCFHTTPServerLastChunk[] = {'0', '\r', '\n', '\r', '\n'};
+
 
 #pragma mark -
 #pragma mark Type Declarations
 
+typedef struct __HttpConnection HttpConnection;
+typedef struct __HttpWorker HttpWorker;
+
 typedef struct {
     CFRuntimeBase			_base;			// CFRuntimeBase for CF types
 	
 	_CFServerRef			_server;		// Underlying server object.
 	
+	_CFMutex				_lock;			// Guards the connections and their queues
 	CFMutableArrayRef		_connections;	// All outstanding HttpConnection's
+	
+	CFIndex					_workerThreads;	// Number of worker threads requested
+	CFIndex					_workerCount;	// Number of workers servicing connections
+	CFIndex					_nextWorker;	// Worker receiving the next connection
+	HttpWorker**			_workers;		// Workers servicing connections
     
     _CFHTTPServerCallBacks	_callbacks;		// Callback functions for user
     _CFHTTPServerContext	_ctxt;			// User's context for callback
 } HttpServer;
 
 
-typedef struct {
+struct __HttpConnection {
     CFAllocatorRef			_alloc;			// Allocator used to allocate this
     UInt32					_rc;			// Number of times retained.
 	
 	HttpServer*				_server;		// Reference back to the owning server context.
 	
+	HttpWorker*				_worker;		// Servicing worker (NULL once removed)
+	CFRunLoopRef			_runLoop;		// Run loop on which the streams are scheduled
+	
     CFDataRef				_peer;			// Peer's address
     
-    CFRunLoopTimerRef		_timer;			// Timer for controlling timeouts
+    CFAbsoluteTime			_deadline;		// Time at which the connection times out
+    CFIndex					_slot;			// Worker's timeout wheel slot holding this
+    HttpConnection*			_wheelNext;		// Next connection in the same slot
+    HttpConnection*			_wheelPrev;		// Previous connection in the same slot
     
     CFReadStreamRef			_inStream;		// Incoming data stream
     CFWriteStreamRef		_outStream;		// Outgoing data stream
@@ -146,8 +198,38 @@ typedef struct {
 	CFMutableDictionaryRef	_responses;		// Responses keyed by their requests
 	CFMutableArrayRef		_requests;		// Ordered incoming requests
 	
-	CFMutableDataRef		_bufferedBytes;	// Bytes bound for delivery but not yet sent
-} HttpConnection;
+	CFMutableArrayRef		_output;		// CFData segments bound for delivery but not yet sent
+	CFIndex					_outputOffset;	// Bytes of the first segment already sent
+	
+	Boolean					_sending;		// Head response's headers have been queued
+	Boolean					_chunked;		// Head response's body is being sent chunked
+	Boolean					_bodyDone;		// Head response's body has been entirely queued
+	int						_file;			// Open file holding the head response's body, or -1
+	off_t					_fileOffset;	// Offset in the file of the next byte to send
+	off_t					_fileRemaining;	// Bytes of the file left to send
+};
+
+
+struct __HttpWorker {
+    CFAllocatorRef			_alloc;			// Allocator used to allocate this
+	
+	HttpServer*				_server;		// Owning server (not retained)
+	
+	_CFMutex				_lock;			// Guards the hand-off queues and the state below
+	CFRunLoopRef			_runLoop;		// Run loop servicing the connections
+	CFMutableArrayRef		_sockets;		// Accepted sockets awaiting a connection
+	CFMutableArrayRef		_pumps;			// Connections with responses to be pumped
+	Boolean					_stopping;		// Worker has been asked to stop
+	UInt32					_owners;		// Server and thread yet to let go of the worker
+	
+	Boolean					_threaded;		// Worker services its own thread's run loop
+	_CFThread				_thread;		// Thread running the run loop
+	
+	CFRunLoopSourceRef		_handoff;		// Signalled as sockets and pumps are queued
+	CFRunLoopTimerRef		_sweep;			// Timer sweeping the timeout wheel
+	SInt64					_tick;			// Next tick to be swept on the wheel
+	HttpConnection**		_wheel;			// Connections bucketed by deadline
+};
 
 
 #pragma mark -
@@ -158,7 +240,7 @@ static void _HttpServerRelease(_CFHTTPServerRef server);
 static CFStringRef _HttpServerCopyDescription(_CFHTTPServerRef server);
 
 // Functions for HttpConnection object
-static HttpConnection* _HttpConnectionCreate(CFAllocatorRef alloc, HttpServer* server, CFSocketNativeHandle s);
+static HttpConnection* _HttpConnectionCreate(CFAllocatorRef alloc, HttpServer* server, HttpWorker* worker, CFSocketNativeHandle s);
 static HttpConnection* _HttpConnectionRetain(HttpConnection* connection);
 static void _HttpConnectionRelease(HttpConnection* connection);
 static CFStringRef _HttpConnectionCopyDescription(HttpConnection* connection);
@@ -167,8 +249,14 @@ static CFStringRef _HttpConnectionCopyDescription(HttpConnection* connection);
 static void _HttpConnectionHandleRequest(HttpConnection* connection);
 static void _HttpConnectionHandleHasBytesAvailable(HttpConnection* connection);
 static void _HttpConnectionHandleCanAcceptBytes(HttpConnection* connection);
+static Boolean _HttpConnectionStartResponse(HttpConnection* connection, CFHTTPMessageRef response, CFTypeRef body, CFTypeRef framing);
+static Boolean _HttpConnectionFillOutput(HttpConnection* connection, CFReadStreamRef body);
+static void _HttpConnectionAppendOutput(HttpConnection* connection, CFDataRef segment);
+static void _HttpConnectionConsumeOutput(HttpConnection* connection, CFIndex bytes);
+static Boolean _HttpConnectionFinishResponse(HttpConnection* connection, CFHTTPMessageRef request, CFHTTPMessageRef response);
 static void _HttpConnectionHandleErrorOccurred(HttpConnection* connection, const CFStreamError* error);
 static void _HttpConnectionHandleTimeOut(HttpConnection* connection);
+static void _HttpConnectionPump(HttpConnection* connection);
 
 static const void*	_ArrayRetainCallBack(CFAllocatorRef allocator, const HttpConnection* connection);
 static void _ArrayReleaseCallBack(CFAllocatorRef allocator, const HttpConnection* connection);
@@ -177,14 +265,41 @@ static void _ArrayReleaseCallBack(CFAllocatorRef allocator, const HttpConnection
 // CFType callbacks -- call into HttpConnection's handlers
 static void _ReadStreamCallBack(CFReadStreamRef inStream, CFStreamEventType type, HttpConnection* connection);
 static void _WriteStreamCallBack(CFWriteStreamRef outStream, CFStreamEventType type, HttpConnection* connection);
-static void _TimerCallBack(CFRunLoopTimerRef timer, HttpConnection* connection);
+
+// Functions for HttpWorker object
+static HttpWorker* _HttpWorkerCreate(CFAllocatorRef alloc, HttpServer* server, Boolean threaded);
+static void _HttpWorkerStop(HttpWorker* worker, Boolean join);
+static void _HttpWorkerDestroy(HttpWorker* worker);
+static void _HttpWorkerRelease(HttpWorker* worker);
+static void _HttpWorkerFree(HttpWorker* worker);
+static Boolean _HttpWorkerIsStopping(HttpWorker* worker);
+static void _HttpWorkerHandOff(HttpWorker* worker, CFMutableArrayRef queue, const void* item);
+static void* _HttpWorkerMain(HttpWorker* worker);
+
+// Functions for manipulating HttpWorker's timeout wheel
+static void _HttpWorkerWheelInsert(HttpWorker* worker, HttpConnection* connection);
+static void _HttpWorkerWheelRemove(HttpWorker* worker, HttpConnection* connection);
+
+// Handlers for HttpWorker object
+static void _HttpWorkerHandleHandOff(HttpWorker* worker);
+static void _HttpWorkerHandleSweep(HttpWorker* worker);
+
+// CFType callbacks -- call into HttpWorker's handlers
+static void _HandOffCallBack(HttpWorker* worker);
+static void _SweepCallBack(CFRunLoopTimerRef timer, HttpWorker* worker);
+
+// Functions for HttpServer's set of HttpWorker's
+static Boolean _HttpServerCreateWorkers(HttpServer* server);
+static void _HttpServerDestroyWorkers(HttpServer* server);
 
 // Functions for manipulating HttpServer's array of HttpConnection's
 static void _HttpServerAddConnection(HttpServer* server, HttpConnection* connection);
 static void _HttpServerRemoveConnection(HttpServer* server, HttpConnection* connection);
+static void _HttpServerQueueResponse(HttpServer* server, CFHTTPMessageRef request, CFHTTPMessageRef response, CFTypeRef body, CFTypeRef framing);
 
 // Handlers for HttpServer object
 static void _HttpServerHandleNewConnection(HttpServer* server, CFSocketNativeHandle sock);
+static void _HttpServerCreateConnection(HttpServer* server, HttpWorker* worker, CFSocketNativeHandle sock);
 static void _HttpServerHandleError(HttpServer* server, const CFStreamError* error);
 
 // Server callback -- call into HttpServer's handlers
@@ -201,6 +316,7 @@ static CFNumberRef _CFNumberCreateWithString(CFAllocatorRef allocator, CFStringR
 
 extern void _CFSocketStreamCreatePair(CFAllocatorRef alloc, CFStringRef host, UInt32 port, CFSocketNativeHandle s,
 									  const CFSocketSignature* sig, CFReadStreamRef* readStream, CFWriteStreamRef* writeStream);
+extern CFDataRef _CFHTTPMessageCopySerializedHeaders(CFHTTPMessageRef msg, Boolean forProxy);
 
 
 
@@ -210,8 +326,22 @@ extern void _CFSocketStreamCreatePair(CFAllocatorRef alloc, CFStringRef host, UI
 
 // A shorter timeout should be used for a more heavily used server.
 #define kTimeOutInSeconds ((CFTimeInterval)60.0)
+
+// The timeout wheel must span more than kTimeOutInSeconds.
+#define kTimeOutWheelResolution ((CFTimeInterval)1.0)
+#define kTimeOutWheelSlots ((CFIndex)64)
+
 #define kBufferSize ((CFIndex)8192)
 
+// Reads of streamed response bodies
+#define kBodyBufferSize ((CFIndex)65536)
+
+// Most segments handed to a single vectored write
+#define kOutputVectorCount ((CFIndex)16)
+
+// Most bytes of a file body handed to a single write
+#define kFileSendSize ((off_t)0x40000000)
+
 #define kReadEvents	((CFOptionFlags)(kCFStreamEventHasBytesAvailable | kCFStreamEventErrorOccurred))
 #define kWriteEvents	((CFOptionFlags)(kCFStreamEventCanAcceptBytes | kCFStreamEventErrorOccurred))
 
@@ -283,8 +413,15 @@ _CFHTTPServerCreate(CFAllocatorRef alloc, const _CFHTTPServerCallBacks* callback
         if (server == NULL)
                 break;
 	
+        // Recursive, since the connection array's callbacks retain under it.
+        _CFMutexInit(&server->_lock, TRUE);
+	
         server->_server = NULL;
 	    server->_connections = NULL;
+        server->_workerThreads = 0;
+        server->_workerCount = 0;
+        server->_nextWorker = 0;
+        server->_workers = NULL;
         memset(&server->_callbacks, 0, sizeof(server->_callbacks));
         memset(&server->_ctxt, 0, sizeof(server->_ctxt));
         
@@ -331,6 +468,8 @@ _HttpServerRelease(_CFHTTPServerRef server) {
     
     // Invalidate the server which will release server and outstanding connections.
     _CFHTTPServerInvalidate(server);
+    
+    _CFMutexDestroy(&((HttpServer*)server)->_lock);
 }
 
 
@@ -344,6 +483,8 @@ _HttpServerCopyDescription(_CFHTTPServerRef server) {
     if (s->_server)
         serverDescription = CFCopyDescription(s->_server);
     
+    _CFMutexLock(&s->_lock);
+    
 	// Set the user's context based upon supplied "copyDescription"
 	if (s->_ctxt.copyDescription)
 		info = s->_ctxt.copyDescription(s->_ctxt.info);
@@ -358,6 +499,8 @@ _HttpServerCopyDescription(_CFHTTPServerRef server) {
                                       serverDescription,
 									  s->_connections,
 									  info);
+    
+    _CFMutexUnlock(&s->_lock);
                                       
     if (serverDescription)
         CFRelease(serverDescription);
@@ -373,16 +516,62 @@ _CFHTTPServerStart(_CFHTTPServerRef server, CFStringRef name, CFStringRef type,
 
     HttpServer* s = (HttpServer*)server;
 
-    // Nothing special needed for the HTTP server.
+    // Bring up the workers before any connections can arrive.
+    if ((s->_workers == NULL) && !_HttpServerCreateWorkers(s))
+        return FALSE;
     
     return _CFServerStart(s->_server, name, type, port);
 }
 
 
+/* CF_EXPORT */ Boolean
+_CFHTTPServerSetWorkerCount(_CFHTTPServerRef server, CFIndex count) {
+
+    HttpServer* s = (HttpServer*)server;
+
+    // Workers are fixed once the server has started.
+    if ((s->_workers != NULL) || (count < 0))
+        return FALSE;
+
+    s->_workerThreads = count;
+
+    return TRUE;
+}
+
+
 /* CF_EXPORT */ void
 _CFHTTPServerInvalidate(_CFHTTPServerRef server) {
 	
 	HttpServer* s = (HttpServer*)server;
+	CFMutableArrayRef connections;
+	HttpWorker* current = NULL;
+	CFIndex i, j;
+	
+    // If the server has been created, invalidate it and delete it.
+    if (s->_server) {
+        _CFServerInvalidate(s->_server);
+        CFRelease(s->_server);
+        s->_server = NULL;
+    }
+    
+    // Find the worker, if any, on whose thread this is.  None of the workers
+    // can be waited upon from here, since any of them may in turn be waiting
+    // upon this one.
+    for (i = 0; (current == NULL) && (i < s->_workerCount); i++) {
+    
+        HttpWorker* worker = s->_workers[i];
+        
+        _CFMutexLock(&worker->_lock);
+        if (worker->_threaded && (worker->_runLoop == CFRunLoopGetCurrent()))
+            current = worker;
+        _CFMutexUnlock(&worker->_lock);
+    }
+    
+    // Stop the workers, so no connection is serviced while tearing down.  Off
+    // the workers' threads, wait for them to finish.
+    for (i = 0; i < s->_workerCount; i++) {
+        _HttpWorkerStop(s->_workers[i], (current == NULL));
+    }
 	
 	// Release the user's context info pointer.
 	if (s->_ctxt.info && s->_ctxt.release)
@@ -394,18 +583,51 @@ _CFHTTPServerInvalidate(_CFHTTPServerRef server) {
 	// Guarantee that there will be no user callbacks.
     memset(&s->_callbacks, 0, sizeof(s->_callbacks));
     
-    // Close out any outstanding connections.
-    if (s->_connections) {
-        CFRelease(s->_connections);
-        s->_connections = NULL;
+    // Detach any outstanding connections from their workers.
+    _CFMutexLock(&s->_lock);
+    
+    connections = s->_connections;
+    s->_connections = NULL;
+    
+    if (connections) {
+        for (i = 0; i < CFArrayGetCount(connections); i++)
+            ((HttpConnection*)CFArrayGetValueAtIndex(connections, i))->_worker = NULL;
     }
     
-    // If the server has been created, invalidate it and delete it.
-    if (s->_server) {
-        _CFServerInvalidate(s->_server);
-        CFRelease(s->_server);
-        s->_server = NULL;
+    _CFMutexUnlock(&s->_lock);
+    
+    // The other workers may still be servicing their connections, so each
+    // holds on to its own until its thread leaves the run loop.  They're
+    // queued as pumps, which a stopped worker drops without pumping.
+    if (connections && (current != NULL)) {
+    
+        for (i = 0; i < CFArrayGetCount(connections); i++) {
+        
+            HttpConnection* c = (HttpConnection*)CFArrayGetValueAtIndex(connections, i);
+            
+            for (j = 0; j < s->_workerCount; j++) {
+            
+                HttpWorker* worker = s->_workers[j];
+                CFRunLoopRef runLoop;
+                
+                _CFMutexLock(&worker->_lock);
+                runLoop = worker->_runLoop;
+                _CFMutexUnlock(&worker->_lock);
+                
+                if ((worker != current) && (runLoop == c->_runLoop)) {
+                    _HttpWorkerHandOff(worker, worker->_pumps, _HttpConnectionRetain(c));
+                    break;
+                }
+            }
+        }
     }
+    
+    // Close out any outstanding connections.
+    if (connections)
+        CFRelease(connections);
+    
+    // Toss the workers now that nothing refers to them.
+    _HttpServerDestroyWorkers(s);
 }
 
 
@@ -421,9 +643,12 @@ _CFHTTPServerCopyPeerAddressForRequest(_CFHTTPServerRef server, CFHTTPMessageRef
     
     CFIndex i, count;
     HttpServer* s = (HttpServer*)server;
+    CFDataRef result = NULL;
+    
+    _CFMutexLock(&s->_lock);
     
     // Prepare to look for the given request in the connections
-    count = CFArrayGetCount(s->_connections);
+    count = s->_connections ? CFArrayGetCount(s->_connections) : 0;
     
     // Start the search
     for (i = 0; i < count; i++) {
@@ -442,11 +667,14 @@ _CFHTTPServerCopyPeerAddressForRequest(_CFHTTPServerRef server, CFHTTPMessageRef
         if (j != kCFNotFound) {
         
             // return the copy that was found
-            return (c->_peer == NULL) ? NULL : CFDataCreateCopy(CFGetAllocator(server), c->_peer);
+            result = (c->_peer == NULL) ? NULL : CFDataCreateCopy(CFGetAllocator(server), c->_peer);
+            break;
         }
     }
+    
+    _CFMutexUnlock(&s->_lock);
 
-    return NULL;
+    return result;
 }
 
 
@@ -454,9 +682,6 @@ _CFHTTPServerCopyPeerAddressForRequest(_CFHTTPServerRef server, CFHTTPMessageRef
 _CFHTTPServerAddResponse(_CFHTTPServerRef server, CFHTTPMessageRef request, CFHTTPMessageRef response) {
 
     CFDataRef body;
-    UInt8* bytes;
-    CFReadStreamRef stream;
-    CFIndex length;
     CFStringRef contentLength;
     
     CFAllocatorRef alloc = CFGetAllocator(server);
@@ -464,29 +689,15 @@ _CFHTTPServerAddResponse(_CFHTTPServerRef server, CFHTTPMessageRef request, CFHT
     // Make a copy of the response
     response = CFHTTPMessageCreateCopy(alloc, response);
     
-    // Get the body and its length
+    // Get the body
     body = CFHTTPMessageCopyBody(response);
     
     if (body == NULL)
         body = CFDataCreate(alloc, NULL, 0);
     
-    length = CFDataGetLength(body);
-    
-    // Pull the body off the response since the stream will be used
+    // Pull the body off the response, since it is queued separately
     CFHTTPMessageSetBody(response, NULL);
     
-    // Allocate the buffer for the body
-    bytes = (UInt8*)CFAllocatorAllocate(alloc, length, 0);
-    
-    // Copy the body into the buffer for streaming
-    memmove(bytes, CFDataGetBytePtr(body), length);
-    
-    // Don't need the body anymore
-    CFRelease(body);
-    
-    // Create the stream for the body
-    stream = CFReadStreamCreateWithBytesNoCopy(alloc, bytes, length, alloc);
-    
     // Check to see if there is a content length header.
     contentLength = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPServerContentLengthHeader);
     
@@ -494,18 +705,18 @@ _CFHTTPServerAddResponse(_CFHTTPServerRef server, CFHTTPMessageRef request, CFHT
     if (contentLength == NULL) {
 
         // Create the header value with the length
-        contentLength = CFStringCreateWithFormat(alloc, NULL, _kCFHTTPServerContentLengthFormat, length);
+        contentLength = CFStringCreateWithFormat(alloc, NULL, _kCFHTTPServerContentLengthFormat, CFDataGetLength(body));
         
         // Add the header
         CFHTTPMessageSetHeaderFieldValue(response, _kCFHTTPServerContentLengthHeader, contentLength);
     }
     CFRelease(contentLength);
     
-    // Add the streamed response
-    _CFHTTPServerAddStreamedResponse(server, request, response, stream);
+    // Queue the body as is; it goes out in the same write as the headers.
+    _HttpServerQueueResponse((HttpServer*)server, request, response, body, kCFBooleanFalse);
     
     // No longer needed now that it's in the queue
-    CFRelease(stream);
+    CFRelease(body);
     CFRelease(response);
 }
 
@@ -513,56 +724,106 @@ _CFHTTPServerAddResponse(_CFHTTPServerRef server, CFHTTPMessageRef request, CFHT
 /* CF_EXPORT */ void
 _CFHTTPServerAddStreamedResponse(_CFHTTPServerRef server, CFHTTPMessageRef request, CFHTTPMessageRef response, CFReadStreamRef body) {
 
-    CFArrayRef list;
-    CFIndex i, count;
+    CFStringRef length, encoding;
     
-    HttpServer* s = (HttpServer*)server;
     CFAllocatorRef alloc = CFGetAllocator(server);
-    
-    // Things to be put into the response list for a request
-    CFTypeRef objs[] = {NULL, body};
+    CFBooleanRef chunked = kCFBooleanFalse;
     
     // Create a copy 'cause it may need adjustment
-    objs[0] = CFHTTPMessageCreateCopy(alloc, response);
-    
-    // Create the response list for the request
-    list = CFArrayCreate(alloc, objs, sizeof(objs) / sizeof(objs[0]), &kCFTypeArrayCallBacks);
+    response = CFHTTPMessageCreateCopy(alloc, response);
     
-    // Prepare to look for the given request in the connections
-    count = CFArrayGetCount(s->_connections);
+    // See how the client delimited the body, if at all.
+    length = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPServerContentLengthHeader);
+    encoding = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPServerTransferEncodingHeader);
     
-    // Start the search
-    for (i = 0; i < count; i++) {
+    // If the length isn't known, the end of the body has to be marked somehow.
+    if ((length == NULL) && (encoding == NULL)) {
         
-        // **FIXME** This is somewhat incestuous.  The server should not be reaching
-        // into the connections.  There should really be a HttpConnection method for
-        // adding a response.
-        
-        // Pull out the current connection
-        HttpConnection* c = (HttpConnection*)CFArrayGetValueAtIndex(s->_connections, i);
-        
-        // Check to see if the connection knows of the request
-        CFIndex j = CFArrayGetFirstIndexOfValue(c->_requests, CFRangeMake(0, CFArrayGetCount(c->_requests)), request);
+        UInt32 status = CFHTTPMessageGetResponseStatusCode(response);
         
-        // Handle the response if it was found
-        if (j != kCFNotFound) {
+        // These responses never carry a body, so there's nothing to mark.
+        if ((status >= 200) && (status != 204) && (status != 304)) {
             
-            // Add the response list to the connection for the given request
-            CFDictionaryAddValue(c->_responses, request, list);
-        
-            // If the request was the head of the request queue and the stream can send, pump it.
-            if ((j == 0) && CFWriteStreamCanAcceptBytes(c->_outStream))
-                _HttpConnectionHandleCanAcceptBytes(c);
-        
-            // Everything has been handled
-            break;
+            CFStringRef requestVersion = CFHTTPMessageCopyVersion(request);
+            CFStringRef responseVersion = CFHTTPMessageCopyVersion(response);
+            
+            // Chunk the body if both ends speak HTTP/1.1.
+            if ((requestVersion != NULL) && (responseVersion != NULL) &&
+                (CFStringCompare(requestVersion, kCFHTTPVersion1_1, kCFCompareCaseInsensitive) == kCFCompareEqualTo) &&
+                (CFStringCompare(responseVersion, kCFHTTPVersion1_1, kCFCompareCaseInsensitive) == kCFCompareEqualTo))
+            {
+                CFHTTPMessageSetHeaderFieldValue(response, _kCFHTTPServerTransferEncodingHeader, _kCFHTTPServerTransferEncodingChunked);
+                chunked = kCFBooleanTrue;
+            }
+            
+            // Otherwise the body ends when the connection does.
+            else
+                CFHTTPMessageSetHeaderFieldValue(response, _kCFHTTPServerConnectionHeader, _kCFHTTPServerConnectionClose);
+            
+            if (requestVersion != NULL)
+                CFRelease(requestVersion);
+            
+            if (responseVersion != NULL)
+                CFRelease(responseVersion);
         }
     }
     
-    // List has been handled, so it's not needed anymore.
-    CFRelease(list);
+    if (length != NULL)
+        CFRelease(length);
+    
+    if (encoding != NULL)
+        CFRelease(encoding);
+    
+    // Queue the response
+    _HttpServerQueueResponse((HttpServer*)server, request, response, body, chunked);
+    
+    CFRelease(response);
+}
+
+
+/* CF_EXPORT */ Boolean
+_CFHTTPServerAddFileResponse(_CFHTTPServerRef server, CFHTTPMessageRef request, CFHTTPMessageRef response, CFURLRef file) {
+
+#if !defined(__WIN32__)
+    UInt8 path[PATH_MAX];
+    struct stat info;
+    long long size;
+    CFNumberRef length;
+    CFStringRef contentLength;
+    
+    CFAllocatorRef alloc = CFGetAllocator(server);
+    
+    // Only regular files have a length known up front.
+    if (!CFURLGetFileSystemRepresentation(file, TRUE, path, sizeof(path)) ||
+        (stat((const char*)path, &info) != 0) ||
+        !S_ISREG(info.st_mode))
+    {
+        return FALSE;
+    }
+    
+    size = info.st_size;
+    
+    // The file is sent as it is now, no matter how it changes before it is sent.
+    length = CFNumberCreate(alloc, kCFNumberLongLongType, &size);
+    
+    // Make a copy of the response
+    response = CFHTTPMessageCreateCopy(alloc, response);
+    
+    // The file is the body, so its length is the content length.
+    contentLength = CFStringCreateWithFormat(alloc, NULL, _kCFHTTPServerContentLengthFileFormat, size);
+    CFHTTPMessageSetHeaderFieldValue(response, _kCFHTTPServerContentLengthHeader, contentLength);
+    CFRelease(contentLength);
+    
+    // Queue the response.  The file isn't opened until it is to be sent.
+    _HttpServerQueueResponse((HttpServer*)server, request, response, file, length);
     
-    CFRelease(objs[0]);
+    CFRelease(length);
+    CFRelease(response);
+    
+    return TRUE;
+#else
+    return FALSE;
+#endif /* !defined(__WIN32__) */
 }
 
 
@@ -570,7 +831,7 @@ _CFHTTPServerAddStreamedResponse(_CFHTTPServerRef server, CFHTTPMessageRef reque
 #pragma mark Static Function Definitions
 
 /* static */ HttpConnection*
-_HttpConnectionCreate(CFAllocatorRef alloc, HttpServer* server, CFSocketNativeHandle s) {
+_HttpConnectionCreate(CFAllocatorRef alloc, HttpServer* server, HttpWorker* worker, CFSocketNativeHandle s) {
     
     HttpConnection* connection = NULL;
 	    
@@ -578,15 +839,8 @@ _HttpConnectionCreate(CFAllocatorRef alloc, HttpServer* server, CFSocketNativeHa
         uint8_t name[SOCK_MAXADDRLEN];
         socklen_t namelen = sizeof(name);
 
-        CFRunLoopRef rl = CFRunLoopGetCurrent();
-        
-        CFRunLoopTimerContext timerCtxt = {
-            0,
-            NULL,
-            NULL,
-            NULL,
-            (CFStringRef (*)(const void*))_HttpConnectionCopyDescription
-        };
+        // Connections are always created on their worker's run loop.
+        CFRunLoopRef rl = worker->_runLoop;
         
         CFStreamClientContext streamCtxt = {
             0,
@@ -608,35 +862,30 @@ _HttpConnectionCreate(CFAllocatorRef alloc, HttpServer* server, CFSocketNativeHa
 		// Save the allocator for deallocating later.
 		connection->_alloc = alloc ? CFRetain(alloc) : NULL;
 		
+		// Make sure the server is saved for the callback.  This comes before
+		// the retain, since the server's lock guards the retain count.
+		connection->_server = (HttpServer*)CFRetain((_CFHTTPServerRef)server);
+		
         // Bump the retain count.
         _HttpConnectionRetain(connection);
         
-		// Make sure the server is saved for the callback.
-		connection->_server = (HttpServer*)CFRetain((_CFHTTPServerRef)server);
-		
+        // Save the worker and the run loop on which it services the connection.
+        connection->_worker = worker;
+        connection->_runLoop = (CFRunLoopRef)CFRetain(rl);
+        
+        // Not on the timeout wheel until added to the server.
+        connection->_deadline = CFAbsoluteTimeGetCurrent() + kTimeOutInSeconds;
+        connection->_slot = kCFNotFound;
+        
+        // No file is open until a file body is sent.
+        connection->_file = -1;
+        
         if (0 == getpeername(s, (struct sockaddr *)name, &namelen))
             connection->_peer = CFDataCreate(alloc, name, namelen);
         
-        // Set the info pointer for the contexts to be the connection.
-        timerCtxt.info = connection;
+        // Set the info pointer for the context to be the connection.
         streamCtxt.info = connection;
         
-        // Create the timer for detecting dead connections
-        connection->_timer = CFRunLoopTimerCreate(alloc,
-                                                  CFAbsoluteTimeGetCurrent() + kTimeOutInSeconds,
-                                                  kTimeOutInSeconds,
-                                                  0,
-                                                  0,
-                                                  (CFRunLoopTimerCallBack)_TimerCallBack,
-                                                  &timerCtxt);
-        
-        // Make sure it succeeded
-        if (connection->_timer == NULL)
-            break;
-            
-        // Add the timer to the run loop
-        CFRunLoopAddTimer(rl, connection->_timer, kCFRunLoopCommonModes);
-        
         // Create a pair of streams for performing HTTP.
 		_CFSocketStreamCreatePair(alloc, NULL, 0, s, NULL, &(connection->_inStream), &(connection->_outStream));
         
@@ -679,11 +928,11 @@ _HttpConnectionCreate(CFAllocatorRef alloc, HttpServer* server, CFSocketNativeHa
         if (connection->_requests == NULL)
             break;
         
-        // Create a buffer for any buffered bytes which will be sent out
-        connection->_bufferedBytes = CFDataCreateMutable(alloc, 0);
+        // Create the queue of segments which will be sent out
+        connection->_output = CFArrayCreateMutable(alloc, 0, &kCFTypeArrayCallBacks);
         
-        // Make sure there is a buffer
-        if (connection->_bufferedBytes == NULL)
+        // Make sure there is a queue
+        if (connection->_output == NULL)
             break;
         
         // It's all good
@@ -702,8 +951,11 @@ _HttpConnectionCreate(CFAllocatorRef alloc, HttpServer* server, CFSocketNativeHa
 /* static */ HttpConnection*
 _HttpConnectionRetain(HttpConnection* connection) {
 	
-	// Bump the retain count.
+	// Bump the retain count under the server's lock, since connections
+	// are held from more than one thread.
+	_CFMutexLock(&connection->_server->_lock);
 	connection->_rc++;
+	_CFMutexUnlock(&connection->_server->_lock);
 		
 	return connection;
 }
@@ -712,16 +964,21 @@ _HttpConnectionRetain(HttpConnection* connection) {
 /* static */ void
 _HttpConnectionRelease(HttpConnection* connection) {
 	
+	UInt32 rc;
+	
 	// Decrease the retain count.
-	connection->_rc--;
+	_CFMutexLock(&connection->_server->_lock);
+	rc = --connection->_rc;
+	_CFMutexUnlock(&connection->_server->_lock);
 	
 	// Destroy the object if not being held.
-	if (connection->_rc == 0) {
+	if (rc == 0) {
 		
 		// Hold locally so deallocation can happen and then safely release.
 		CFAllocatorRef alloc = connection->_alloc;
 
-        CFRunLoopRef runLoop = CFRunLoopGetCurrent();
+        // Streams are scheduled on the worker's run loop, not necessarily this one.
+        CFRunLoopRef runLoop = connection->_runLoop;
 
         if (connection->_server)
             CFRelease((_CFHTTPServerRef)connection->_server);
@@ -749,12 +1006,9 @@ _HttpConnectionRelease(HttpConnection* connection) {
             CFRelease(connection->_outStream);
         }
         
-        // If the timer exists, toss it too.
-        if (connection->_timer != NULL) {
-            CFRunLoopRemoveTimer(runLoop, connection->_timer, kCFRunLoopCommonModes);
-            CFRunLoopTimerInvalidate(connection->_timer);
-            CFRelease(connection->_timer);
-        }
+        // Toss the worker's run loop
+        if (runLoop)
+            CFRelease(runLoop);
         
         // Toss the dictionary of requests and responses
         if (connection->_responses)
@@ -764,9 +1018,13 @@ _HttpConnectionRelease(HttpConnection* connection) {
         if (connection->_requests)
             CFRelease(connection->_requests);
             
-        // Toss the buffered bytes
-        if (connection->_bufferedBytes)
-            CFRelease(connection->_bufferedBytes);
+        // Toss the unsent segments
+        if (connection->_output)
+            CFRelease(connection->_output);
+        
+        // Close the body file if one was being sent
+        if (connection->_file != -1)
+            close(connection->_file);
         
 		// Free the memory in use by the connection.
 		CFAllocatorDeallocate(alloc, connection);
@@ -789,12 +1047,12 @@ _HttpConnectionCopyDescription(HttpConnection* connection) {
 									  _kCFHTTPServerConnectionDescribeFormat,
 									  (UInt32)connection,
                                       (UInt32)connection->_server,
-									  connection->_timer,
+									  (UInt32)connection->_worker,
 									  connection->_inStream,
                                       connection->_outStream,
                                       connection->_responses,
                                       connection->_requests,
-                                      connection->_bufferedBytes);
+                                      connection->_output);
                                       
     return result;
 }
@@ -803,11 +1061,18 @@ _HttpConnectionCopyDescription(HttpConnection* connection) {
 /* static */ void
 _HttpConnectionHandleRequest(HttpConnection* connection) {
     
+    CFHTTPMessageRef msg;
+    
+    _CFMutexLock(&connection->_server->_lock);
+    
     assert(0 != CFArrayGetCount(connection->_requests));
     
-    // Get the message with which to work (the last one)
-    CFHTTPMessageRef msg = (CFHTTPMessageRef)CFArrayGetValueAtIndex(connection->_requests,
-                                                                    CFArrayGetCount(connection->_requests) - 1);
+    // Get the message with which to work (the last one).  Only this thread
+    // removes requests, so it stays valid once the lock is dropped.
+    msg = (CFHTTPMessageRef)CFArrayGetValueAtIndex(connection->_requests,
+                                                   CFArrayGetCount(connection->_requests) - 1);
+    
+    _CFMutexUnlock(&connection->_server->_lock);
 
     while (msg) {
 
@@ -940,7 +1205,9 @@ _HttpConnectionHandleRequest(HttpConnection* connection) {
                 msg = newMsg;
                 
                 // Put the new request in the requests list.
+                _CFMutexLock(&connection->_server->_lock);
                 CFArrayAppendValue(connection->_requests, msg);
+                _CFMutexUnlock(&connection->_server->_lock);
 
                 // Drop the retain count now since it's being held by the queue.
                 CFRelease(msg);
@@ -1003,9 +1270,12 @@ _HttpConnectionHandleHasBytesAvailable(HttpConnection* connection) {
 	UInt8 buffer[kBufferSize];
 	
 	CFHTTPMessageRef msg;
+	CFIndex i;
+	
+	_CFMutexLock(&connection->_server->_lock);
 	
     // Get the count of requests currently known.
-	CFIndex i = CFArrayGetCount(connection->_requests);
+	i = CFArrayGetCount(connection->_requests);
 	
     // If there is, grab the last one with which to work
 	if (i != 0)
@@ -1019,6 +1289,8 @@ _HttpConnectionHandleHasBytesAvailable(HttpConnection* connection) {
 		CFRelease(msg);
 	}
 	
+	_CFMutexUnlock(&connection->_server->_lock);
+	
     // Try to read bytes off the wire
 	bytes = CFReadStreamRead(connection->_inStream, buffer, sizeof(buffer));
 	
@@ -1027,8 +1299,8 @@ _HttpConnectionHandleHasBytesAvailable(HttpConnection* connection) {
 		
         Boolean complete = CFHTTPMessageIsHeaderComplete(msg);
         
-        // Tickle the timer
-        CFRunLoopTimerSetNextFireDate(connection->_timer, CFAbsoluteTimeGetCurrent() + kTimeOutInSeconds);
+        // Push the deadline out; the worker's sweep picks up the change.
+        connection->_deadline = CFAbsoluteTimeGetCurrent() + kTimeOutInSeconds;
         
         // Attach read bytes to current request
         if (!CFHTTPMessageAppendBytes(msg, buffer, bytes)) {
@@ -1078,176 +1350,422 @@ _HttpConnectionHandleCanAcceptBytes(HttpConnection* connection) {
 	
     // How are responses handled (read the "Description" at the top)?
     //
-    // Responses have two parts: a CFHTTPMessageRef containing only headers and a CFReadStreamRef
-    // which is a stream to the body contents.  These responses will be sent in the order in
-    // which their respective requests were vended.
+    // Responses have three parts: a CFHTTPMessageRef containing only headers, the body, and
+    // the framing of the body.  These responses will be sent in the order in which their
+    // respective requests were vended.
     //
-    // A local buffer on the connection is used for all writing to the wire.  Buffered bytes are
-    // always sent first.  An empty buffer signals the start of a new response.  If the buffer is
-    // empty, the first, queued response's headers are serialized and placed in the buffer.
+    // All writing to the wire goes through the connection's output queue of CFData segments.
+    // Queued segments are always sent first, with a single vectored write.  A partial write
+    // just advances the offset into the queue, so nothing already queued is ever moved.
     //
-    // Bytes in the buffer are sent to the wire.  If all bytes in the buffer were written, the
-    // response's stream is read for bytes.  The read bytes are placed into the connection's
-    // buffer.  This buffer will be used for writing when this function is called again.
+    // When the head response is started, its serialized headers are queued.  A CFData body is
+    // queued right behind them, so that both go out in the same write.  A streamed body is
+    // read into new segments each time the queue empties.  Those are wrapped in chunk framing
+    // if the server chose to send it chunked.  A file body is written straight from the file
+    // once its headers are out.
     //
-    // If the response's stream has been exhausted, that request-response pair is removed from
-    // the connection's queue, and the buffer is left empty.  Since the buffer is empty, the
-    // next response will be handled when this function is called again.
+    // Once the body has been entirely queued and the queue has been sent, the request-response
+    // pair is removed from the connection's queue, and the next response is started.
     //
     // At the end of each response, the headers are checked for the proper termination of the
     // open connection.  If a "Connection: close" header exists or if in default mode under
     // HTTP version 1.0, the connection will be terminated and dequeued from the server.
     
+    CFHTTPMessageRef request = NULL;
+    CFArrayRef list = NULL;
+    
+    _CFMutexLock(&connection->_server->_lock);
+    
     // Check to make sure there are queued items.
     if (CFArrayGetCount(connection->_requests) != 0) {
         
-        // Pull off the request and its related response information
-        CFHTTPMessageRef request = (CFHTTPMessageRef)CFArrayGetValueAtIndex(connection->_requests, 0);
-        CFArrayRef list = request ? (CFArrayRef)CFDictionaryGetValue(connection->_responses, request) : NULL;
-        CFHTTPMessageRef response = list ? (CFHTTPMessageRef)CFArrayGetValueAtIndex(list, 0) : NULL;
-        CFReadStreamRef stream = list ? (CFReadStreamRef)CFArrayGetValueAtIndex(list, 1) : NULL;
+        // Pull off the request and its related response information.  Other threads only
+        // ever add responses, so both stay valid once the lock is dropped.
+        request = (CFHTTPMessageRef)CFArrayGetValueAtIndex(connection->_requests, 0);
+        list = request ? (CFArrayRef)CFDictionaryGetValue(connection->_responses, request) : NULL;
+    }
+    
+    _CFMutexUnlock(&connection->_server->_lock);
         
-        // Only handle if there is a response ready to go
-        if (list != NULL) {
+    // Only handle if there is a response ready to go
+    if (list != NULL) {
+    
+        CFHTTPMessageRef response = (CFHTTPMessageRef)CFArrayGetValueAtIndex(list, 0);
+        CFTypeRef body = CFArrayGetValueAtIndex(list, 1);
+        CFIndex bytesWritten, count;
+        Boolean wrote = FALSE;
         
-            CFIndex bytesWritten;
+        // If the response hasn't been started, queue its headers and what body is at hand.
+        if (!connection->_sending && !_HttpConnectionStartResponse(connection, response, body, CFArrayGetValueAtIndex(list, 2)))
+            return;													// NOTE the early return.
         
-            // If there are no buffered bytes, need to start the next request.
-            if (CFDataGetLength(connection->_bufferedBytes) == 0) {
+        // If everything queued has gone out, get more of the body.
+        if ((CFArrayGetCount(connection->_output) == 0) && !connection->_bodyDone) {
+            
+            // File bodies go straight from the file to the stream.
+            if (connection->_file != -1) {
+                
+                bytesWritten = _CFWriteStreamWriteFile(connection->_outStream,
+                                                       connection->_file,
+                                                       connection->_fileOffset,
+                                                       (CFIndex)((connection->_fileRemaining < kFileSendSize) ? connection->_fileRemaining : kFileSendSize));
+                
+                // Errors on the stream itself are signalled by the stream.
+                if (bytesWritten < 0)
+                    return;											// NOTE the early return.
+                
+                // The file came up short of the length which was sent in the headers.
+                if (bytesWritten == 0) {
+                    
+                    CFStreamError error = {kCFStreamErrorDomainPOSIX, EIO};
+                    
+                    _HttpConnectionHandleErrorOccurred(connection, &error);
+                    
+                    return;											// NOTE the early return.
+                }
                 
-                // Serialize if for sending
-                CFDataRef serialized = CFHTTPMessageCopySerializedMessage(response);
+                // Push the deadline out
+                connection->_deadline = CFAbsoluteTimeGetCurrent() + kTimeOutInSeconds;
+                wrote = TRUE;
                 
-                // Get rid of the old one before getting the new
-                CFRelease(connection->_bufferedBytes);
+                connection->_fileOffset += bytesWritten;
+                connection->_fileRemaining -= bytesWritten;
                 
-                // Use a mutable copy, because it gets sized down as bytes are sent.
-                connection->_bufferedBytes = CFDataCreateMutableCopy(connection->_alloc, 0, serialized);
+                // Wait for the stream to take more, unless that was the last of it.
+                if (connection->_fileRemaining != 0)
+                    return;											// NOTE the early return.
                 
-                // Release the original.
-                CFRelease(serialized);
+                close(connection->_file);
+                connection->_file = -1;
+                connection->_bodyDone = TRUE;
             }
             
-            // Try writing the entire buffer
-            bytesWritten = CFWriteStreamWrite(connection->_outStream,
-                                              CFDataGetBytePtr(connection->_bufferedBytes),
-                                              CFDataGetLength(connection->_bufferedBytes));
+            // Otherwise read the next piece of the body's stream.
+            else if (!_HttpConnectionFillOutput(connection, (CFReadStreamRef)body))
+                return;												// NOTE the early return.
+        }
+        
+        count = CFArrayGetCount(connection->_output);
+        
+        // Send as much of the queue as the stream will take.
+        if (count != 0) {
+            
+            CFDataRef segments[kOutputVectorCount];
             
-            // If successfully wrote, continue on.
-            if (bytesWritten > 0) {
+            if (count > kOutputVectorCount)
+                count = kOutputVectorCount;
             
-                // Compute the new size of the buffer after the write
-                CFIndex newSize = CFDataGetLength(connection->_bufferedBytes) - bytesWritten;
-                
-                // Tickle the timer
-                CFRunLoopTimerSetNextFireDate(connection->_timer, CFAbsoluteTimeGetCurrent() + kTimeOutInSeconds);
+            CFArrayGetValues(connection->_output, CFRangeMake(0, count), (const void**)segments);
+            
+            bytesWritten = _CFWriteStreamWriteDataVector(connection->_outStream, segments, count, connection->_outputOffset);
+            
+            // Nothing more to do if the stream didn't take anything.
+            if (bytesWritten <= 0)
+                return;												// NOTE the early return.
+            
+            // Push the deadline out
+            connection->_deadline = CFAbsoluteTimeGetCurrent() + kTimeOutInSeconds;
+            wrote = TRUE;
+            
+            // Drop what was sent
+            _HttpConnectionConsumeOutput(connection, bytesWritten);
+        }
         
-                // Move the remaining bytes down in the buffer
-                memmove(CFDataGetMutableBytePtr(connection->_bufferedBytes),
-                        CFDataGetBytePtr(connection->_bufferedBytes) + bytesWritten,
-                        newSize);
-                        
-                // Resize the buffer to indicate what is left
-                CFDataSetLength(connection->_bufferedBytes, newSize);
+        // The response is done once all of its body has been sent.  A write brings another
+        // "can accept bytes" event for the next response; without one, start it now.
+        if ((CFArrayGetCount(connection->_output) == 0) && connection->_bodyDone) {
+            if (_HttpConnectionFinishResponse(connection, request, response) && !wrote)
+                _HttpConnectionPump(connection);
+        }
+    }
+}
+
+
+/* static */ Boolean
+_HttpConnectionStartResponse(HttpConnection* connection, CFHTTPMessageRef response, CFTypeRef body, CFTypeRef framing) {
+    
+    CFTypeID type = CFGetTypeID(body);
+    
+    // Serialize the headers only; the body is queued on its own.
+    CFDataRef headers = _CFHTTPMessageCopySerializedHeaders(response, FALSE);
+    
+    if (headers != NULL) {
+        _HttpConnectionAppendOutput(connection, headers);
+        CFRelease(headers);
+    }
+    
+    connection->_sending = TRUE;
+    connection->_chunked = (framing == kCFBooleanTrue);
+    connection->_bodyDone = FALSE;
+    
+    // A whole body goes right behind the headers.
+    if (type == CFDataGetTypeID()) {
+        _HttpConnectionAppendOutput(connection, (CFDataRef)body);
+        connection->_bodyDone = TRUE;
+    }
+    
+    // A file body is opened now, so that files are only held open while being sent.
+    else if (type == CFURLGetTypeID()) {
+        
+        long long size = 0;
+        
+        CFNumberGetValue((CFNumberRef)framing, kCFNumberLongLongType, &size);
+        
+        if (size == 0)
+            connection->_bodyDone = TRUE;
+        
+        else {
+            
+            int err = ENOENT;
+#if !defined(__WIN32__)
+            UInt8 path[PATH_MAX];
+            
+            if (CFURLGetFileSystemRepresentation((CFURLRef)body, TRUE, path, sizeof(path))) {
                 
-                // If nothing left in the buffer, fill the buffer
-                if (newSize == 0) {
+                connection->_file = open((const char*)path, O_RDONLY);
                 
-                    CFIndex bytesRead;
-                    
-                    // If the response's stream isn't open yet, open it.
-                    if (CFReadStreamGetStatus(stream) == kCFStreamStatusNotOpen)
-                        CFReadStreamOpen(stream);
+                if (connection->_file == -1)
+                    err = errno;
+            }
+#endif /* !defined(__WIN32__) */
             
-                    // Size the buffer for a full read
-                    CFDataSetLength(connection->_bufferedBytes, kBufferSize);
-                    
-                    // Try reading a full buffer into the buffer
-                    bytesRead = CFReadStreamRead(stream, CFDataGetMutableBytePtr(connection->_bufferedBytes), kBufferSize);
+            // Unable to get to the file, which is as bad as a failed read.
+            if (connection->_file == -1) {
                 
-                    // Size the buffer to what ever size was read if successful
-                    if (bytesRead >= 0)
-                        CFDataSetLength(connection->_bufferedBytes, bytesRead);
-                    
-                    // Was there an error?
-                    if (bytesRead < 0) {
-                        
-                        // Get the error from the read stream
-                        CFStreamError error = CFReadStreamGetError(stream);
-                        
-                        // Inform the client of the error.
-                        _HttpConnectionHandleErrorOccurred(connection, &error);
-                    }
-                    
-                    // Was this the end of the response's stream?
-                    else if (bytesRead == 0) {
-                        
-                        // Get the HTTP version and the connection header from the response.
-                        CFStringRef close = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPServerConnectionHeader);
-                        CFStringRef version = CFHTTPMessageCopyVersion(response);
-                        
-                        // If no header, check the original request for one.
-                        if (close == NULL)
-                            close = CFHTTPMessageCopyHeaderFieldValue(request, _kCFHTTPServerConnectionHeader);
-                        
-                        // Inform the client of a successful send of the response.
-                        if (connection->_server->_callbacks.didSendResponseCallBack != NULL) {
-                            connection->_server->_callbacks.didSendResponseCallBack((_CFHTTPServerRef)connection->_server,
-                                                                                    request,
-                                                                                    response,
-                                                                                    connection->_server->_ctxt.info);
-                        }
-                        
-                        // Remove the request-response pair from the conneciton's queue
-                        CFDictionaryRemoveValue(connection->_responses, request);
-                        CFArrayRemoveValueAtIndex(connection->_requests, 0);
-                        
-                        // If there was a header and it said, "close," or if there was no header and HTTP version
-                        // 1.0 is being used, then close the connection and remove it from the server.
-                        if (((close != NULL) &&
-                            CFStringCompare(close, _kCFHTTPServerConnectionClose, kCFCompareCaseInsensitive) == kCFCompareEqualTo) ||
-                        	((close == NULL) && (version != NULL) &&
-                            CFStringCompare(version, kCFHTTPVersion1_1, kCFCompareCaseInsensitive) != kCFCompareEqualTo))
-                        {
-                            _HttpServerRemoveConnection(connection->_server, connection);
-                        }
-                        if (close != NULL)
-                            CFRelease(close);
-                            
-                        if (version != NULL)
-                            CFRelease(version);
-                    }
-                }
+                CFStreamError error = {kCFStreamErrorDomainPOSIX, err};
+                
+                _HttpConnectionHandleErrorOccurred(connection, &error);
+                
+                return FALSE;
             }
+            
+            connection->_fileOffset = 0;
+            connection->_fileRemaining = size;
         }
     }
+    
+    // If the response's stream isn't open yet, open it.
+    else if (CFReadStreamGetStatus((CFReadStreamRef)body) == kCFStreamStatusNotOpen)
+        CFReadStreamOpen((CFReadStreamRef)body);
+    
+    return TRUE;
 }
 
 
-/* static */ void
-_HttpConnectionHandleErrorOccurred(HttpConnection* connection, const CFStreamError* error) {
+/* static */ Boolean
+_HttpConnectionFillOutput(HttpConnection* connection, CFReadStreamRef body) {
     
-    CFArrayRef requests = CFArrayCreateCopy(connection->_alloc, connection->_requests);
-    CFIndex i, count = CFArrayGetCount(requests);
+    CFIndex bytesRead;
     
-    // Error-out each request in the queue
-    for (i = 0; i < count; i++) {
-
-        // Get the request and the response pair
-        CFHTTPMessageRef request = (CFHTTPMessageRef)CFArrayGetValueAtIndex(connection->_requests, i);
-        CFArrayRef list = (CFArrayRef)CFDictionaryGetValue(connection->_responses, request);
+    // Read straight into the segment which will be queued, so the bytes aren't copied again.
+    CFMutableDataRef segment = CFDataCreateMutable(connection->_alloc, kBodyBufferSize);
+    
+    if (segment == NULL) {
         
-        // If there is a response and there is a client, inform the client of the error.
-        if ((list != NULL) && (connection->_server->_callbacks.errorCallBack != NULL)) {
-            connection->_server->_callbacks.errorCallBack((_CFHTTPServerRef)connection->_server,
-                                                          error,
-                                                          request,
-                                                          (CFHTTPMessageRef)CFArrayGetValueAtIndex(list, 0),
-                                                          connection->_server->_ctxt.info);
-        }
+        CFStreamError error = {kCFStreamErrorDomainPOSIX, ENOMEM};
+        
+        _HttpConnectionHandleErrorOccurred(connection, &error);
+        
+        return FALSE;
+    }
+    
+    // Size the segment for a full read
+    CFDataSetLength(segment, kBodyBufferSize);
+    
+    // Try reading a full segment
+    bytesRead = CFReadStreamRead(body, CFDataGetMutableBytePtr(segment), kBodyBufferSize);
+    
+    // Was there an error?
+    if (bytesRead < 0) {
+        
+        // Get the error from the read stream
+        CFStreamError error = CFReadStreamGetError(body);
+        
+        CFRelease(segment);
+        
+        // Inform the client of the error.
+        _HttpConnectionHandleErrorOccurred(connection, &error);
+        
+        return FALSE;
+    }
+    
+    // Was this the end of the response's stream?
+    if (bytesRead == 0) {
+        
+        // A chunked body ends with an empty chunk.
+        if (connection->_chunked) {
+            
+            CFDataRef last = CFDataCreateWithBytesNoCopy(connection->_alloc,
+                                                         _kCFHTTPServerLastChunk,
+                                                         sizeof(_kCFHTTPServerLastChunk),
+                                                         kCFAllocatorNull);
+            
+            _HttpConnectionAppendOutput(connection, last);
+            CFRelease(last);
+        }
+        
+        connection->_bodyDone = TRUE;
+    }
+    
+    else {
+        
+        // Size the segment to what was read
+        CFDataSetLength(segment, bytesRead);
+        
+        // Chunked bodies frame each segment with its size and a terminator.
+        if (connection->_chunked) {
+            
+            char size[24];
+            CFDataRef header, terminator;
+            
+            header = CFDataCreate(connection->_alloc,
+                                  (const UInt8*)size,
+                                  snprintf(size, sizeof(size), "%lx\r\n", (unsigned long)bytesRead));
+            terminator = CFDataCreateWithBytesNoCopy(connection->_alloc,
+                                                     _kCFHTTPServerChunkTerminator,
+                                                     sizeof(_kCFHTTPServerChunkTerminator),
+                                                     kCFAllocatorNull);
+            
+            _HttpConnectionAppendOutput(connection, header);
+            _HttpConnectionAppendOutput(connection, segment);
+            _HttpConnectionAppendOutput(connection, terminator);
+            
+            CFRelease(header);
+            CFRelease(terminator);
+        }
+        
+        else
+            _HttpConnectionAppendOutput(connection, segment);
+    }
+    
+    CFRelease(segment);
+    
+    return TRUE;
+}
+
+
+/* static */ void
+_HttpConnectionAppendOutput(HttpConnection* connection, CFDataRef segment) {
+    
+    // Empty segments would only cost a slot in the vector.
+    if ((segment != NULL) && (CFDataGetLength(segment) != 0))
+        CFArrayAppendValue(connection->_output, segment);
+}
+
+
+/* static */ void
+_HttpConnectionConsumeOutput(HttpConnection* connection, CFIndex bytes) {
+    
+    CFIndex i, count = CFArrayGetCount(connection->_output);
+    
+    // Count from the start of the first segment, not from what of it was sent earlier.
+    bytes += connection->_outputOffset;
+    
+    // Find the segments which have been sent in full.
+    for (i = 0; i < count; i++) {
+        
+        CFIndex length = CFDataGetLength((CFDataRef)CFArrayGetValueAtIndex(connection->_output, i));
+        
+        if (bytes < length)
+            break;
+        
+        bytes -= length;
+    }
+    
+    // Drop those, and remember how far into the next one the write got.
+    CFArrayReplaceValues(connection->_output, CFRangeMake(0, i), NULL, 0);
+    connection->_outputOffset = bytes;
+}
+
+
+/* static */ Boolean
+_HttpConnectionFinishResponse(HttpConnection* connection, CFHTTPMessageRef request, CFHTTPMessageRef response) {
+    
+    Boolean closing;
+    
+    // Get the HTTP version and the connection header from the response.
+    CFStringRef close = CFHTTPMessageCopyHeaderFieldValue(response, _kCFHTTPServerConnectionHeader);
+    CFStringRef version = CFHTTPMessageCopyVersion(response);
+    
+    // If no header, check the original request for one.
+    if (close == NULL)
+        close = CFHTTPMessageCopyHeaderFieldValue(request, _kCFHTTPServerConnectionHeader);
+    
+    // If there was a header and it said, "close," or if there was no header and HTTP version
+    // 1.0 is being used, then the connection is to be closed.
+    closing = (((close != NULL) &&
+                CFStringCompare(close, _kCFHTTPServerConnectionClose, kCFCompareCaseInsensitive) == kCFCompareEqualTo) ||
+               ((close == NULL) && (version != NULL) &&
+                CFStringCompare(version, kCFHTTPVersion1_1, kCFCompareCaseInsensitive) != kCFCompareEqualTo));
+    
+    if (close != NULL)
+        CFRelease(close);
+        
+    if (version != NULL)
+        CFRelease(version);
+    
+    // Ready for the next response
+    connection->_sending = FALSE;
+    connection->_chunked = FALSE;
+    connection->_bodyDone = FALSE;
+    connection->_outputOffset = 0;
+    
+    // Inform the client of a successful send of the response.
+    if (connection->_server->_callbacks.didSendResponseCallBack != NULL) {
+        connection->_server->_callbacks.didSendResponseCallBack((_CFHTTPServerRef)connection->_server,
+                                                                request,
+                                                                response,
+                                                                connection->_server->_ctxt.info);
+    }
+    
+    // Remove the request-response pair from the conneciton's queue
+    _CFMutexLock(&connection->_server->_lock);
+    CFDictionaryRemoveValue(connection->_responses, request);
+    CFArrayRemoveValueAtIndex(connection->_requests, 0);
+    _CFMutexUnlock(&connection->_server->_lock);
+    
+    // Close the connection and remove it from the server.
+    if (closing)
+        _HttpServerRemoveConnection(connection->_server, connection);
+    
+    return !closing;
+}
+
+
+/* static */ void
+_HttpConnectionHandleErrorOccurred(HttpConnection* connection, const CFStreamError* error) {
+    
+    CFArrayRef requests;
+    CFDictionaryRef responses;
+    CFIndex i, count;
+    
+    // Work from copies, since responses may be added from other threads.
+    _CFMutexLock(&connection->_server->_lock);
+    requests = CFArrayCreateCopy(connection->_alloc, connection->_requests);
+    responses = CFDictionaryCreateCopy(connection->_alloc, connection->_responses);
+    _CFMutexUnlock(&connection->_server->_lock);
+    
+    count = CFArrayGetCount(requests);
+    
+    // Error-out each request in the queue
+    for (i = 0; i < count; i++) {
+
+        // Get the request and the response pair
+        CFHTTPMessageRef request = (CFHTTPMessageRef)CFArrayGetValueAtIndex(requests, i);
+        CFArrayRef list = (CFArrayRef)CFDictionaryGetValue(responses, request);
+        
+        // If there is a response and there is a client, inform the client of the error.
+        if ((list != NULL) && (connection->_server->_callbacks.errorCallBack != NULL)) {
+            connection->_server->_callbacks.errorCallBack((_CFHTTPServerRef)connection->_server,
+                                                          error,
+                                                          request,
+                                                          (CFHTTPMessageRef)CFArrayGetValueAtIndex(list, 0),
+                                                          connection->_server->_ctxt.info);
+        }
     }
 
     CFRelease(requests);
+    CFRelease(responses);
     
     // Remove the connection from the pool
     _HttpServerRemoveConnection(connection->_server, connection);
@@ -1265,6 +1783,20 @@ _HttpConnectionHandleTimeOut(HttpConnection* connection) {
 }
 
 
+/* static */ void
+_HttpConnectionPump(HttpConnection* connection) {
+
+    // Nothing to send once the connection has been removed from the server.
+    if (connection->_worker == NULL)
+        return;
+    
+    // Send what is queued if the stream can take it, otherwise the stream's
+    // next "can accept bytes" event will pick it up.
+    if (CFWriteStreamCanAcceptBytes(connection->_outStream))
+        _HttpConnectionHandleCanAcceptBytes(connection);
+}
+
+
 
 /* static */ const void*
 _ArrayRetainCallBack(CFAllocatorRef allocator, const HttpConnection* connection) {
@@ -1329,36 +1861,691 @@ _WriteStreamCallBack(CFWriteStreamRef outStream, CFStreamEventType type, HttpCon
 }
 
 
+/* static */ HttpWorker*
+_HttpWorkerCreate(CFAllocatorRef alloc, HttpServer* server, Boolean threaded) {
+
+    HttpWorker* worker = NULL;
+    
+    do {
+        CFRunLoopSourceContext sourceCtxt = {
+            0,
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            (void (*)(void*))_HandOffCallBack
+        };
+        
+        CFRunLoopTimerContext timerCtxt = {
+            0,
+            NULL,
+            NULL,
+            NULL,
+            NULL
+        };
+        
+        // Allocate the buffer for the worker.
+        worker = CFAllocatorAllocate(alloc, sizeof(worker[0]), 0);
+        
+        // Fail if unable to create the worker
+        if (worker == NULL)
+            break;
+        
+        memset(worker, 0, sizeof(worker[0]));
+        
+        // Save the allocator for deallocating later.
+        worker->_alloc = alloc ? CFRetain(alloc) : NULL;
+        
+        worker->_server = server;
+        
+        // The server holds the worker until it's destroyed.
+        worker->_owners = 1;
+        
+        _CFMutexInit(&worker->_lock, FALSE);
+        
+        // Set the info pointer for the contexts to be the worker.
+        sourceCtxt.info = worker;
+        timerCtxt.info = worker;
+        
+        // Create the timeout wheel, starting at the current tick.
+        worker->_wheel = (HttpConnection**)CFAllocatorAllocate(alloc, kTimeOutWheelSlots * sizeof(worker->_wheel[0]), 0);
+        
+        if (worker->_wheel == NULL)
+            break;
+        
+        memset(worker->_wheel, 0, kTimeOutWheelSlots * sizeof(worker->_wheel[0]));
+        worker->_tick = (SInt64)(CFAbsoluteTimeGetCurrent() / kTimeOutWheelResolution);
+        
+        // Create the queues for handing off sockets and pumps.  These hold raw
+        // values; the connections in _pumps are retained by hand.
+        worker->_sockets = CFArrayCreateMutable(alloc, 0, NULL);
+        worker->_pumps = CFArrayCreateMutable(alloc, 0, NULL);
+        
+        if ((worker->_sockets == NULL) || (worker->_pumps == NULL))
+            break;
+        
+        // Create the source signalled as items are handed off.
+        worker->_handoff = CFRunLoopSourceCreate(alloc, 0, &sourceCtxt);
+        
+        if (worker->_handoff == NULL)
+            break;
+        
+        // Create the one timer which sweeps the timeout wheel.
+        worker->_sweep = CFRunLoopTimerCreate(alloc,
+                                              CFAbsoluteTimeGetCurrent() + kTimeOutWheelResolution,
+                                              kTimeOutWheelResolution,
+                                              0,
+                                              0,
+                                              (CFRunLoopTimerCallBack)_SweepCallBack,
+                                              &timerCtxt);
+        
+        if (worker->_sweep == NULL)
+            break;
+        
+        // Without a thread of its own, the worker services the current run loop.
+        if (!threaded) {
+            worker->_runLoop = (CFRunLoopRef)CFRetain(CFRunLoopGetCurrent());
+            CFRunLoopAddSource(worker->_runLoop, worker->_handoff, kCFRunLoopCommonModes);
+            CFRunLoopAddTimer(worker->_runLoop, worker->_sweep, kCFRunLoopCommonModes);
+        }
+        
+        // Otherwise spawn the thread which runs the worker's run loop.  The
+        // thread holds the worker too, until it leaves the run loop.
+        else {
+        
+            worker->_threaded = TRUE;
+            worker->_owners++;
+            
+            if (_CFThreadSpawn(&worker->_thread, (void* (*)(void*))_HttpWorkerMain, worker) != 0)
+                break;
+        }
+        
+        return worker;
+        
+    } while (0);
+    
+    // Something failed, so clean up.
+    if (worker)
+        _HttpWorkerFree(worker);
+    
+    return NULL;
+}
+
+
+/* static */ void
+_HttpWorkerStop(HttpWorker* worker, Boolean join) {
+
+    CFRunLoopRef runLoop;
+    
+    _CFMutexLock(&worker->_lock);
+    
+    // Only stop once.
+    if (worker->_stopping) {
+        _CFMutexUnlock(&worker->_lock);
+        return;
+    }
+    
+    worker->_stopping = TRUE;
+    runLoop = worker->_runLoop;
+    
+    _CFMutexUnlock(&worker->_lock);
+    
+    if (worker->_threaded) {
+    
+        // Wake the worker so its run loop exits.  If the run loop hasn't been
+        // published yet, the signalled source stops it as soon as it runs.
+        CFRunLoopSourceSignal(worker->_handoff);
+        if (runLoop != NULL)
+            CFRunLoopStop(runLoop);
+        
+        // A thread which isn't waited upon lets go of the worker as it exits.
+        if (join)
+            _CFThreadJoin(worker->_thread);
+        else
+            _CFThreadDetach(worker->_thread);
+    }
+}
+
+
+/* static */ void
+_HttpWorkerDestroy(HttpWorker* worker) {
+
+    // The server is going away.
+    _CFMutexLock(&worker->_lock);
+    worker->_server = NULL;
+    _CFMutexUnlock(&worker->_lock);
+    
+    _HttpWorkerRelease(worker);
+}
+
+
+/* static */ void
+_HttpWorkerRelease(HttpWorker* worker) {
+
+    CFArrayRef sockets, pumps;
+    CFIndex i;
+    UInt32 owners;
+    
+    _CFMutexLock(&worker->_lock);
+    owners = --worker->_owners;
+    _CFMutexUnlock(&worker->_lock);
+    
+    // Torn down only once both the server and the thread have let go, so
+    // it's never done under a worker still servicing its run loop.
+    if (owners != 0)
+        return;
+    
+    // Take whatever is still queued.  It's dropped outside of the lock, since
+    // releasing a connection takes the server's lock.
+    _CFMutexLock(&worker->_lock);
+    
+    sockets = CFArrayCreateCopy(worker->_alloc, worker->_sockets);
+    CFArrayRemoveAllValues(worker->_sockets);
+    
+    pumps = CFArrayCreateCopy(worker->_alloc, worker->_pumps);
+    CFArrayRemoveAllValues(worker->_pumps);
+    
+    _CFMutexUnlock(&worker->_lock);
+    
+    // Close any sockets which never made it to a connection.
+    if (sockets) {
+        for (i = 0; i < CFArrayGetCount(sockets); i++)
+            close((CFSocketNativeHandle)(intptr_t)CFArrayGetValueAtIndex(sockets, i));
+        CFRelease(sockets);
+    }
+    
+    // Drop the connections which were waiting to be pumped.
+    if (pumps) {
+        for (i = 0; i < CFArrayGetCount(pumps); i++)
+            _HttpConnectionRelease((HttpConnection*)CFArrayGetValueAtIndex(pumps, i));
+        CFRelease(pumps);
+    }
+    
+    _HttpWorkerFree(worker);
+}
+
+
 /* static */ void
-_TimerCallBack(CFRunLoopTimerRef timer, HttpConnection* connection) {
+_HttpWorkerFree(HttpWorker* worker) {
+
+    // Hold locally so deallocation can happen and then safely release.
+    CFAllocatorRef alloc = worker->_alloc;
+    
+    // A worker without a thread is still on the run loop on which it was created.
+    if (!worker->_threaded && (worker->_runLoop != NULL)) {
+        CFRunLoopRemoveSource(worker->_runLoop, worker->_handoff, kCFRunLoopCommonModes);
+        CFRunLoopRemoveTimer(worker->_runLoop, worker->_sweep, kCFRunLoopCommonModes);
+    }
+    
+    if (worker->_handoff) {
+        CFRunLoopSourceInvalidate(worker->_handoff);
+        CFRelease(worker->_handoff);
+    }
+    
+    if (worker->_sweep) {
+        CFRunLoopTimerInvalidate(worker->_sweep);
+        CFRelease(worker->_sweep);
+    }
+    
+    if (worker->_runLoop)
+        CFRelease(worker->_runLoop);
+    
+    if (worker->_sockets)
+        CFRelease(worker->_sockets);
+    
+    if (worker->_pumps)
+        CFRelease(worker->_pumps);
+    
+    if (worker->_wheel)
+        CFAllocatorDeallocate(alloc, worker->_wheel);
+    
+    _CFMutexDestroy(&worker->_lock);
+    
+    // Free the memory in use by the worker.
+    CFAllocatorDeallocate(alloc, worker);
+    
+    // Release the allocator.
+    if (alloc)
+        CFRelease(alloc);
+}
 
-	assert(timer == connection->_timer);
 
-	// Dispatch the timer event.
-	_HttpConnectionHandleTimeOut(connection);
+/* static */ Boolean
+_HttpWorkerIsStopping(HttpWorker* worker) {
+
+    Boolean result;
+    
+    _CFMutexLock(&worker->_lock);
+    result = worker->_stopping;
+    _CFMutexUnlock(&worker->_lock);
+    
+    return result;
+}
+
+
+/* static */ void
+_HttpWorkerHandOff(HttpWorker* worker, CFMutableArrayRef queue, const void* item) {
+
+    CFRunLoopRef runLoop;
+    
+    // Queue the item for the worker.
+    _CFMutexLock(&worker->_lock);
+    CFArrayAppendValue(queue, item);
+    runLoop = worker->_runLoop;
+    _CFMutexUnlock(&worker->_lock);
+    
+    // Signal the worker and wake its run loop, if it's running yet.
+    CFRunLoopSourceSignal(worker->_handoff);
+    if (runLoop != NULL)
+        CFRunLoopWakeUp(runLoop);
+}
+
+
+/* static */ void*
+_HttpWorkerMain(HttpWorker* worker) {
+
+    CFRunLoopRef runLoop = CFRunLoopGetCurrent();
+    
+    // Service the hand-offs and the timeout wheel on this thread's run loop.
+    CFRunLoopAddSource(runLoop, worker->_handoff, kCFRunLoopCommonModes);
+    CFRunLoopAddTimer(runLoop, worker->_sweep, kCFRunLoopCommonModes);
+    
+    // Publish the run loop, so hand-offs can wake it up.
+    _CFMutexLock(&worker->_lock);
+    worker->_runLoop = (CFRunLoopRef)CFRetain(runLoop);
+    _CFMutexUnlock(&worker->_lock);
+    
+    // Service the connections until asked to stop.
+    CFRunLoopRun();
+    
+    CFRunLoopRemoveTimer(runLoop, worker->_sweep, kCFRunLoopCommonModes);
+    CFRunLoopRemoveSource(runLoop, worker->_handoff, kCFRunLoopCommonModes);
+    
+    // Let go of the worker, cleaning up after it if the server already has.
+    _HttpWorkerRelease(worker);
+    
+    return NULL;
+}
+
+
+/* static */ void
+_HttpWorkerWheelInsert(HttpWorker* worker, HttpConnection* connection) {
+
+    // Bucket the connection by the tick in which its deadline falls.
+    CFIndex slot = (CFIndex)(((SInt64)(connection->_deadline / kTimeOutWheelResolution)) % kTimeOutWheelSlots);
+    
+    connection->_slot = slot;
+    connection->_wheelPrev = NULL;
+    connection->_wheelNext = worker->_wheel[slot];
+    
+    if (connection->_wheelNext != NULL)
+        connection->_wheelNext->_wheelPrev = connection;
+    
+    worker->_wheel[slot] = connection;
+}
+
+
+/* static */ void
+_HttpWorkerWheelRemove(HttpWorker* worker, HttpConnection* connection) {
+
+    // Nothing to do if not on the wheel.
+    if (connection->_slot == kCFNotFound)
+        return;
+    
+    // Unlink the connection from its slot.
+    if (connection->_wheelPrev != NULL)
+        connection->_wheelPrev->_wheelNext = connection->_wheelNext;
+    else
+        worker->_wheel[connection->_slot] = connection->_wheelNext;
+    
+    if (connection->_wheelNext != NULL)
+        connection->_wheelNext->_wheelPrev = connection->_wheelPrev;
+    
+    connection->_slot = kCFNotFound;
+    connection->_wheelNext = NULL;
+    connection->_wheelPrev = NULL;
+}
+
+
+/* static */ void
+_HttpWorkerHandleHandOff(HttpWorker* worker) {
+
+    CFArrayRef sockets = NULL;
+    CFArrayRef pumps = NULL;
+    CFIndex i, count;
+    Boolean stopping;
+    
+    _CFMutexLock(&worker->_lock);
+    
+    stopping = worker->_stopping;
+    
+    // Take everything which has been queued.  If stopping, it's left for the
+    // teardown instead.
+    if (!stopping && CFArrayGetCount(worker->_sockets)) {
+        sockets = CFArrayCreateCopy(worker->_alloc, worker->_sockets);
+        CFArrayRemoveAllValues(worker->_sockets);
+    }
+    
+    if (!stopping && CFArrayGetCount(worker->_pumps)) {
+        pumps = CFArrayCreateCopy(worker->_alloc, worker->_pumps);
+        CFArrayRemoveAllValues(worker->_pumps);
+    }
+    
+    _CFMutexUnlock(&worker->_lock);
+    
+    // The server is going away, so leave the run loop.
+    if (stopping) {
+        CFRunLoopStop(CFRunLoopGetCurrent());
+        return;
+    }
+    
+    // Create connections for the newly accepted sockets.  A client callback
+    // may invalidate the server along the way, so check before each.
+    if (sockets != NULL) {
+    
+        count = CFArrayGetCount(sockets);
+        
+        for (i = 0; i < count; i++) {
+        
+            CFSocketNativeHandle sock = (CFSocketNativeHandle)(intptr_t)CFArrayGetValueAtIndex(sockets, i);
+            
+            if (_HttpWorkerIsStopping(worker))
+                close(sock);
+            else
+                _HttpServerCreateConnection(worker->_server, worker, sock);
+        }
+        
+        CFRelease(sockets);
+    }
+    
+    // Pump the responses added on other threads.
+    if (pumps != NULL) {
+    
+        count = CFArrayGetCount(pumps);
+        
+        for (i = 0; i < count; i++) {
+        
+            HttpConnection* connection = (HttpConnection*)CFArrayGetValueAtIndex(pumps, i);
+            
+            _HttpConnectionPump(connection);
+            _HttpConnectionRelease(connection);
+        }
+        
+        CFRelease(pumps);
+    }
+}
+
+
+/* static */ void
+_HttpWorkerHandleSweep(HttpWorker* worker) {
+
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    SInt64 tick = (SInt64)(now / kTimeOutWheelResolution);
+    SInt64 t = worker->_tick;
+    HttpConnection* expired = NULL;
+    
+    // The wheel is torn down with the server.
+    if (_HttpWorkerIsStopping(worker))
+        return;
+    
+    // A full turn visits every slot, so never sweep further, even if the
+    // run loop was held up.
+    if ((tick - t) > kTimeOutWheelSlots)
+        t = tick - kTimeOutWheelSlots;
+    
+    // Visit each slot whose tick has entirely passed since the last sweep.
+    // The wheel only picks the slots; each deadline is checked in full, so
+    // no connection times out early.
+    for (; t < tick; t++) {
+    
+        CFIndex slot = (CFIndex)(t % kTimeOutWheelSlots);
+        
+        // Detach the slot's connections so they can be moved.
+        HttpConnection* connection = worker->_wheel[slot];
+        worker->_wheel[slot] = NULL;
+        
+        while (connection != NULL) {
+        
+            HttpConnection* next = connection->_wheelNext;
+            
+            // A connection whose deadline was pushed out moves to a later slot.
+            if (now < connection->_deadline)
+                _HttpWorkerWheelInsert(worker, connection);
+            
+            // Otherwise, hold on to it to be timed out once the wheel is settled.
+            else {
+                connection->_slot = kCFNotFound;
+                connection->_wheelPrev = NULL;
+                connection->_wheelNext = expired;
+                expired = _HttpConnectionRetain(connection);
+            }
+            
+            connection = next;
+        }
+    }
+    
+    worker->_tick = tick;
+    
+    // Time out the expired connections.
+    while (expired != NULL) {
+    
+        HttpConnection* connection = expired;
+        
+        expired = connection->_wheelNext;
+        connection->_wheelNext = NULL;
+        
+        // Skip it if an earlier time out took the server down.
+        if (connection->_worker != NULL)
+            _HttpConnectionHandleTimeOut(connection);
+        
+        _HttpConnectionRelease(connection);
+    }
+}
+
+
+/* static */ void
+_HandOffCallBack(HttpWorker* worker) {
+
+    // Dispatch the hand-off.
+    _HttpWorkerHandleHandOff(worker);
+}
+
+
+/* static */ void
+_SweepCallBack(CFRunLoopTimerRef timer, HttpWorker* worker) {
+
+    assert(timer == worker->_sweep);
+
+    // Dispatch the timer event.
+    _HttpWorkerHandleSweep(worker);
+}
+
+
+/* static */ Boolean
+_HttpServerCreateWorkers(HttpServer* server) {
+
+    CFAllocatorRef alloc = CFGetAllocator((_CFHTTPServerRef)server);
+    
+    // Without worker threads, a single worker services the current run loop.
+    CFIndex i, count = (server->_workerThreads > 0) ? server->_workerThreads : 1;
+    
+    server->_workers = (HttpWorker**)CFAllocatorAllocate(alloc, count * sizeof(server->_workers[0]), 0);
+    
+    if (server->_workers == NULL)
+        return FALSE;
+    
+    server->_workerCount = 0;
+    server->_nextWorker = 0;
+    
+    // Create each of the workers.
+    for (i = 0; i < count; i++) {
+    
+        HttpWorker* worker = _HttpWorkerCreate(alloc, server, (server->_workerThreads > 0));
+        
+        // Tear down any already created on failure.
+        if (worker == NULL) {
+        
+            for (i = 0; i < server->_workerCount; i++)
+                _HttpWorkerStop(server->_workers[i], TRUE);
+            
+            _HttpServerDestroyWorkers(server);
+            
+            return FALSE;
+        }
+        
+        server->_workers[server->_workerCount++] = worker;
+    }
+    
+    return TRUE;
+}
+
+
+/* static */ void
+_HttpServerDestroyWorkers(HttpServer* server) {
+
+    CFIndex i;
+    
+    if (server->_workers == NULL)
+        return;
+    
+    // Workers have all been stopped, so they can be torn down.
+    for (i = 0; i < server->_workerCount; i++)
+        _HttpWorkerDestroy(server->_workers[i]);
+    
+    CFAllocatorDeallocate(CFGetAllocator((_CFHTTPServerRef)server), server->_workers);
+    
+    server->_workers = NULL;
+    server->_workerCount = 0;
 }
 
 
 /* static */ void
 _HttpServerAddConnection(HttpServer* server, HttpConnection* connection) {
 
+    Boolean added = FALSE;
+    
     // Add the given connection to the list
-    CFArrayAppendValue(server->_connections, connection);
+    _CFMutexLock(&server->_lock);
+    
+    if (server->_connections != NULL) {
+        CFArrayAppendValue(server->_connections, connection);
+        added = TRUE;
+    }
+    
+    _CFMutexUnlock(&server->_lock);
+    
+    // Start timing out the connection now that it's being serviced.
+    if (added)
+        _HttpWorkerWheelInsert(connection->_worker, connection);
 }
 
 
 /* static */ void
 _HttpServerRemoveConnection(HttpServer* server, HttpConnection* connection) {
     
+    CFMutableArrayRef connections;
+    HttpWorker* worker;
+    CFIndex i = kCFNotFound;
+    
+    // Hold on to the connection, so its last release isn't made under the lock.
+    _HttpConnectionRetain(connection);
+    
+    _CFMutexLock(&server->_lock);
+    
     // Find the given connection in the list of connections
-    CFMutableArrayRef connections = server->_connections;
-    CFIndex i = CFArrayGetFirstIndexOfValue(connections,
-                                            CFRangeMake(0, CFArrayGetCount(connections)),
-                                            connection);
+    connections = server->_connections;
+    if (connections != NULL) {
+        i = CFArrayGetFirstIndexOfValue(connections,
+                                        CFRangeMake(0, CFArrayGetCount(connections)),
+                                        connection);
+    }
     
     // If it existed, remove it from the list.
     if (i != kCFNotFound)
         CFArrayRemoveValueAtIndex(connections, i);
+    
+    // The worker no longer services the connection.
+    worker = connection->_worker;
+    connection->_worker = NULL;
+    
+    _CFMutexUnlock(&server->_lock);
+    
+    // Take it off the worker's timeout wheel.
+    if (worker != NULL)
+        _HttpWorkerWheelRemove(worker, connection);
+    
+    _HttpConnectionRelease(connection);
+}
+
+
+/* static */ void
+_HttpServerQueueResponse(HttpServer* server, CFHTTPMessageRef request, CFHTTPMessageRef response, CFTypeRef body, CFTypeRef framing) {
+
+    CFArrayRef list;
+    CFIndex i, count;
+    
+    HttpConnection* pump = NULL;
+    
+    // Things to be put into the response list for a request
+    CFTypeRef objs[] = {response, body, framing};
+    
+    // Create the response list for the request
+    list = CFArrayCreate(CFGetAllocator((_CFHTTPServerRef)server), objs, sizeof(objs) / sizeof(objs[0]), &kCFTypeArrayCallBacks);
+    
+    _CFMutexLock(&server->_lock);
+    
+    // Prepare to look for the given request in the connections
+    count = server->_connections ? CFArrayGetCount(server->_connections) : 0;
+    
+    // Start the search
+    for (i = 0; i < count; i++) {
+        
+        // **FIXME** This is somewhat incestuous.  The server should not be reaching
+        // into the connections.  There should really be a HttpConnection method for
+        // adding a response.
+        
+        // Pull out the current connection
+        HttpConnection* c = (HttpConnection*)CFArrayGetValueAtIndex(server->_connections, i);
+        
+        // Check to see if the connection knows of the request
+        CFIndex j = CFArrayGetFirstIndexOfValue(c->_requests, CFRangeMake(0, CFArrayGetCount(c->_requests)), request);
+        
+        // Handle the response if it was found
+        if (j != kCFNotFound) {
+            
+            // Add the response list to the connection for the given request
+            CFDictionaryAddValue(c->_responses, request, list);
+        
+            // If the request was the head of the request queue, it needs pumping.
+            if ((j == 0) && (c->_worker != NULL)) {
+            
+                // Pump it here if this is the connection's run loop, otherwise
+                // leave it to the connection's worker.
+                if (c->_runLoop == CFRunLoopGetCurrent())
+                    pump = _HttpConnectionRetain(c);
+                else
+                    _HttpWorkerHandOff(c->_worker, c->_worker->_pumps, _HttpConnectionRetain(c));
+            }
+        
+            // Everything has been handled
+            break;
+        }
+    }
+    
+    _CFMutexUnlock(&server->_lock);
+    
+    // Pump outside of the lock, since pumping may call out to the client.
+    if (pump != NULL) {
+        _HttpConnectionPump(pump);
+        _HttpConnectionRelease(pump);
+    }
+    
+    // List has been handled, so it's not needed anymore.
+    CFRelease(list);
 }
 
 
@@ -1395,25 +2582,44 @@ _HttpServerHandleNewConnection(HttpServer* server, CFSocketNativeHandle sock) {
         }
     }
     
-    if (accepted) {
+    if (accepted && (server->_workerCount != 0)) {
     
-        // Create a new incoming connection
-        HttpConnection* connection = _HttpConnectionCreate(alloc, server, sock);
+        // Pick the worker for the connection, round-robin.
+        HttpWorker* worker = server->_workers[server->_nextWorker];
+        server->_nextWorker = (server->_nextWorker + 1) % server->_workerCount;
         
-        // Add the connection to the server if it created.
-        if (connection != NULL) {
-            _HttpServerAddConnection(server, connection);
-            _HttpConnectionRelease(connection);
-        }
-            
-        else {
-            
-            // Create an error for the bad situation
-            CFStreamError error = {kCFStreamErrorDomainCFHTTPServer, kCFStreamErrorCFHTTPServerInternal};
-            
-            // Handle the error
-            _HttpServerHandleError(server, &error);
-        }
+        // A worker without a thread services this run loop, so create the connection now.
+        if (!worker->_threaded)
+            _HttpServerCreateConnection(server, worker, sock);
+        
+        // Otherwise, hand the socket off to the worker's thread.
+        else
+            _HttpWorkerHandOff(worker, worker->_sockets, (const void*)(intptr_t)sock);
+    }
+}
+
+
+/* static */ void
+_HttpServerCreateConnection(HttpServer* server, HttpWorker* worker, CFSocketNativeHandle sock) {
+    
+    CFAllocatorRef alloc = CFGetAllocator((_CFHTTPServerRef)server);
+    
+    // Create a new incoming connection
+    HttpConnection* connection = _HttpConnectionCreate(alloc, server, worker, sock);
+    
+    // Add the connection to the server if it created.
+    if (connection != NULL) {
+        _HttpServerAddConnection(server, connection);
+        _HttpConnectionRelease(connection);
+    }
+        
+    else {
+        
+        // Create an error for the bad situation
+        CFStreamError error = {kCFStreamErrorDomainCFHTTPServer, kCFStreamErrorCFHTTPServerInternal};
+        
+        // Handle the error
+        _HttpServerHandleError(server, &error);
     }
 }
 
@@ -81,6 +81,29 @@
     that to cause us to send an endEncountered event.  Now, if we receive such an event and we have not yet read the mark,
     we simply do so and continue.  */
 #define HAVE_READ_MARK (20)
+// Set from _kCFStreamPropertyHTTPUseResponseCache
+#define USE_RESPONSE_CACHE (21)
+// The response cache may store the response to the current request, if the response allows it
+#define STORE_RESPONSE (22)
+// The response is being read from cachedResponse and cachedBody, not from the connection
+#define SERVING_CACHED_RESPONSE (23)
+// Set from _kCFStreamPropertyHTTPUseHTTP2
+#define USE_HTTP2 (24)
+
+// Timing metrics, kept only while they are being collected; all times are from _CFNetworkGetMonotonicTime
+typedef struct {
+    CFTimeInterval fetchStart; // When the stream was opened
+    CFTimeInterval queueStart; // When the current request was last queued on a connection
+    CFTimeInterval requestStart;
+    CFTimeInterval requestEnd;
+    CFTimeInterval responseStart; // When the response headers were checked
+    CFTimeInterval responseEnd;
+    UInt64 bytesSentBase, bytesReceivedBase; // The connection's counts when the request started transmitting
+    _CFSocketStreamMetrics connection; // The connection's phases and counts as of responseEnd
+    Boolean haveConnection; // Whether connection could be read from the socket stream
+    Boolean reused;
+    Boolean reported; // Whether the process-wide callback has seen these
+} _CFHTTPRequestMetrics;
 
 typedef struct _CFHTTPRequest {
     CFOptionFlags flags;
@@ -103,6 +126,17 @@ typedef struct _CFHTTPRequest {
     CFRunLoopSourceRef stateChangeSource; // This source is used when we need to wait on an outside state change - either for bytes to come in on the connection, or for some request upstream of us to progress.
     CFMutableDictionaryRef connProps;
 	CFArrayRef peerCertificates;
+    int replayCount; // Times this request has been sent again after its connection died before answering it
+    _CFHTTPRequestMetrics *metrics; // NULL unless timing metrics are being collected
+
+    // Response cache; all NULL unless USE_RESPONSE_CACHE is set
+    CFHTTPMessageRef cachedResponse; // The stored response, while it is being revalidated or served
+    CFDataRef cachedBody;
+    CFIndex cachedBodyRead; // How much of cachedBody has been served
+    CFMutableDataRef responseBody; // The body read so far, if the response is to be stored
+    CFAbsoluteTime cacheRequestTime, cacheResponseTime;
+
+    CFReadStreamRef http2Stream; // The stream carrying the current request over a shared HTTP/2 connection; NULL when the request goes over HTTP/1.1
 } _CFHTTPRequest;
 
 struct _CFHTTPTestSOCKSContext {
@@ -138,6 +172,9 @@ static void advanceToNextProxyFromProxyArray(CFMutableArrayRef proxyArray);
 #define _kCFHTTPStreamLocationHeader			CFSTR("Location")
 #define _kCFHTTPStreamLocationSeparator			CFSTR(", ")
 #define _kCFHTTPStreamHEADMethod				CFSTR("HEAD")
+#define _kCFHTTPStreamServerHeader				CFSTR("Server")
+#define _kCFHTTPStreamAcceptEncodingHeader		CFSTR("Accept-Encoding")
+#define _kCFHTTPStreamAcceptEncodingGzipDeflate	CFSTR("gzip, deflate")
 #define _kCFStreamSocketCreatedCallBack			CFSTR("_kCFStreamSocketCreatedCallBack")
 #define _kCFHTTPStreamPrivateRunLoopMode		CFSTR("_kCFHTTPStreamPrivateRunLoopMode")
 #define _kCFNTLMMethod							CFSTR("NTLM")
@@ -163,16 +200,79 @@ CONST_STRING_DECL_LOCAL(_kCFHTTPStreamHostFormat, "%@:%d")
 CONST_STRING_DECL_LOCAL(_kCFHTTPStreamLocationHeader, "Location")
 CONST_STRING_DECL_LOCAL(_kCFHTTPStreamLocationSeparator, ", ")
 CONST_STRING_DECL_LOCAL(_kCFHTTPStreamHEADMethod, "HEAD")
+CONST_STRING_DECL_LOCAL(_kCFHTTPStreamServerHeader, "Server")
+CONST_STRING_DECL_LOCAL(_kCFHTTPStreamAcceptEncodingHeader, "Accept-Encoding")
+CONST_STRING_DECL_LOCAL(_kCFHTTPStreamAcceptEncodingGzipDeflate, "gzip, deflate")
 CONST_STRING_DECL_LOCAL(_kCFStreamSocketCreatedCallBack, "_kCFStreamSocketCreatedCallBack")
 CONST_STRING_DECL_LOCAL(_kCFHTTPStreamPrivateRunLoopMode, "_kCFHTTPStreamPrivateRunLoopMode")
 CONST_STRING_DECL_LOCAL(_kCFNTLMMethod, "NTLM")
 #endif	/* __CONSTANT_CFSTRINGS__ */
 
-// Connection cache management; the cache is created and accessed in getConnectionForRequest
+// Connection cache management; the cache is created by getConnectionCache, the first time a request needs a connection
+
+// Browser-like pool limits; a server's keep-alive usually runs 5 to 15 seconds
+#define kHTTPConnectionCacheMaxPerHost		6
+#define kHTTPConnectionCacheMaxTotal		32
+#define kHTTPConnectionCacheIdleTimeout		15.0
 
 static CFSpinLock_t cacheInitLock = CFSpinLockInit;
 static CFNetConnectionCacheRef httpConnectionCache = NULL;
 
+static CFNetConnectionCacheRef getConnectionCache(void);
+
+// Pipelining management; connections start pipelining once their first response shows they will persist
+
+// Deep enough to hide a round trip or two without betting many requests on one connection surviving
+#define kHTTPMaxPipelineDepth				4
+// How many times a request is sent again after its connection dies before it is answered
+#define kHTTPMaxReplays						3
+
+static CFIndex httpMaxPipelineDepth = kHTTPMaxPipelineDepth;
+static CFSpinLock_t pipeliningBlacklistLock = CFSpinLockInit;
+static CFMutableSetRef pipeliningBlacklist = NULL;    // Lowercased host names never to pipeline to
+
+// Servers known to mishandle pipelined requests, by Server header prefix
+static const char* const kHTTPPipeliningBrokenServers[] = {
+    "Microsoft-IIS/4.",
+    "Microsoft-IIS/5.",
+    "Netscape-Enterprise/3.",
+    "Netscape-Enterprise/4.",
+    "Netscape-Enterprise/5.",
+    "Netscape-Enterprise/6.",
+    "WebLogic 3.",
+    "WebLogic 4.",
+    "WebLogic 5.",
+    "WebLogic 6.",
+    "Winstone Servlet Engine v0."
+};
+
+static void enablePipelining(_CFHTTPRequest *req);
+static void blacklistPipelining(CFStringRef host);
+
+// Timing metrics; recorded only for streams that ask for them, or for all streams while a callback is installed
+
+static CFSpinLock_t timingMetricsLock = CFSpinLockInit;
+static _CFHTTPStreamTimingMetricsCallBack timingMetricsCallBack = NULL;
+static void *timingMetricsInfo = NULL;
+
+static _CFHTTPRequestMetrics *createTimingMetrics(CFAllocatorRef alloc);
+static void timeRequestStart(_CFHTTPRequest *req, _CFNetConnectionRef conn);
+static void timeResponseEnd(_CFHTTPRequest *req, _CFNetConnectionRef conn);
+static CFDictionaryRef copyTimingMetrics(CFAllocatorRef alloc, _CFHTTPRequest *req);
+
+// Response cache; the cache itself is in CFHTTPResponseCache.c
+
+static Boolean lookUpResponseCache(_CFHTTPRequest *http, CFHTTPMessageRef request);
+static void checkResponseCache(_CFHTTPRequest *http, int nextAction);
+static void dropCachedResponse(_CFHTTPRequest *http);
+static CFIndex readFromResponseCache(_CFHTTPRequest *http, UInt8 *buffer, CFIndex bufferLength, Boolean *atEOF);
+
+// HTTP/2
+static Boolean openOverHTTP2(_CFHTTPRequest *http, CFHTTPMessageRef request, CFStreamError *error);
+static Boolean fallBackFromHTTP2(_CFHTTPRequest *http, CFStreamError *err);
+static void closeHTTP2Stream(_CFHTTPRequest *http);
+static void grabHTTP2ResponseHeaders(_CFHTTPRequest *http);
+
 static void *httpRequestCreate(CFReadStreamRef stream, void *info);
 static void httpRequestFinalize(CFReadStreamRef stream, void *info);
 static CFStringRef httpRequestDescription(CFReadStreamRef stream, void *info);
@@ -211,9 +311,10 @@ static void httpReceiveResponse(void *request, _CFNetConnectionRef connection, c
 static void httpResponseStreamCallBack(void *request, CFReadStreamRef stream, CFStreamEventType type, _CFNetConnectionRef conn, const void*);
 static void httpRequestStreamCallBack(void *request, CFWriteStreamRef stream, CFStreamEventType type, _CFNetConnectionRef conn, const void*);
 static CFArrayRef httpRunLoopArrayForRequest(void *request, _CFNetConnectionRef conn, const void* info);
+static Boolean httpRequestIsPipelinable(void *request, _CFNetConnectionRef conn, const void* info);
 
 static const _CFNetConnectionCallBacks httpConnectionCallBacks = {
-    0,
+    1,
     connCacheKeyRetain,
     connCacheKeyRelease,
     httpCreateConnectionStreams,
@@ -222,7 +323,8 @@ static const _CFNetConnectionCallBacks httpConnectionCallBacks = {
     httpReceiveResponse,
     httpResponseStreamCallBack,
     httpRequestStreamCallBack,
-    httpRunLoopArrayForRequest
+    httpRunLoopArrayForRequest,
+    httpRequestIsPipelinable
 };
 
 static void requestPayloadCallBack(CFReadStreamRef stream, CFStreamEventType type, void *info);
@@ -504,10 +606,13 @@ static int extractSocksProperties(CFDictionaryRef dict, CFTypeRef *outKeys, CFTy
     return numFound;
 }
 
+// Request contexts, zombies included, are made for every request; keep a few for reuse.
+static _CFHTTPContextPool requestContextPool = _CFHTTPContextPoolInitializer(sizeof(_CFHTTPRequest));
+
 static void *httpRequestCreate(CFReadStreamRef stream, void *info) {
     _CFHTTPRequest *newReq, *oldReq = (_CFHTTPRequest *)info;
     CFAllocatorRef alloc = CFGetAllocator(stream);
-    newReq = CFAllocatorAllocate(alloc, sizeof(_CFHTTPRequest), 0);
+    newReq = _CFHTTPContextPoolAllocate(&requestContextPool, alloc);
     if (!newReq) return NULL;
     newReq->flags = 0;
     newReq->connProps = CFDictionaryCreateMutable(alloc, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
@@ -541,6 +646,14 @@ static void *httpRequestCreate(CFReadStreamRef stream, void *info) {
     newReq->firstRedirection = NULL;
     newReq->conn = NULL;
     newReq->stateChangeSource = NULL;
+    newReq->replayCount = 0;
+    newReq->metrics = NULL;
+    newReq->cachedResponse = NULL;
+    newReq->cachedBody = NULL;
+    newReq->cachedBodyRead = 0;
+    newReq->responseBody = NULL;
+    newReq->cacheRequestTime = newReq->cacheResponseTime = 0;
+    newReq->http2Stream = NULL;
 #if defined(LOG_REQUESTS)
     fprintf(stderr, "Created request 0x%x\n", (int)newReq);
 #endif
@@ -554,7 +667,7 @@ _CFHTTPRequest *createZombieDouble1(CFAllocatorRef alloc, _CFHTTPRequest *orig,
 #if defined(LOG_REQUESTS)
     fprintf(stderr, "substituteZombieDouble(0x%x, 0x%x, 0x%x) -", (int)alloc, (int)orig, (int)(conn));
 #endif
-    zombie = CFAllocatorAllocate(alloc, sizeof(_CFHTTPRequest), 0);
+    zombie = _CFHTTPContextPoolAllocate(&requestContextPool, alloc);
     if (!zombie) return NULL;
     zombie->flags = orig->flags;
     __CFBitSet(zombie->flags, IS_ZOMBIE);
@@ -571,6 +684,20 @@ _CFHTTPRequest *createZombieDouble1(CFAllocatorRef alloc, _CFHTTPRequest *orig,
     zombie->requestBytesWritten = orig->requestBytesWritten;
     zombie->stateChangeSource = NULL;
 	zombie->peerCertificates = NULL;
+    zombie->replayCount = orig->replayCount;
+    zombie->metrics = NULL; // The original reports its own metrics
+    // A zombie only drains the response; nothing it reads is stored
+    __CFBitClear(zombie->flags, USE_RESPONSE_CACHE);
+    __CFBitClear(zombie->flags, STORE_RESPONSE);
+    __CFBitClear(zombie->flags, SERVING_CACHED_RESPONSE);
+    zombie->cachedResponse = NULL;
+    zombie->cachedBody = NULL;
+    zombie->cachedBodyRead = 0;
+    zombie->responseBody = NULL;
+    zombie->cacheRequestTime = zombie->cacheResponseTime = 0;
+    // Zombies only ever come from HTTP/1.1 connections
+    __CFBitClear(zombie->flags, USE_HTTP2);
+    zombie->http2Stream = NULL;
     // Sadly, the zombie needs the original request in case there was auth on it; we may need to advance the state of the auth token when our response comes in.
     zombie->originalRequest = orig->originalRequest;
     CFRetain(zombie->originalRequest);
@@ -610,7 +737,7 @@ _CFHTTPRequest *createZombieDouble1(CFAllocatorRef alloc, _CFHTTPRequest *orig,
 
 extern Boolean _CFHTTPAuthenticationConnectionAuthenticated(CFHTTPAuthenticationRef auth, const void* connection);
 
-static Boolean canShutdownConnection(_CFNetConnectionRef conn, _CFHTTPRequest *req, Boolean allowOneEntry) {
+static Boolean canShutdownConnection(_CFNetConnectionRef conn, _CFHTTPRequest *req, Boolean allowOneEntry, Boolean *reusable) {
     int i, bad = 0;
     CFHTTPAuthenticationRef auth[2];
     Boolean isPersistent = _CFNetConnectionWillEnqueueRequests(conn);
@@ -638,7 +765,7 @@ static Boolean canShutdownConnection(_CFNetConnectionRef conn, _CFHTTPRequest *r
     }
     
     /*
-    ** There are four reasons for which to pull the connection from the cache:
+    ** There are four reasons for which to pull the connection out of use:
     **
     **	1. If the connection isn't persistent, make sure it's not in the cache.
     **
@@ -653,7 +780,13 @@ static Boolean canShutdownConnection(_CFNetConnectionRef conn, _CFHTTPRequest *r
     **	4. If there is authentication and it has gone to completion, treat the
     **		connection like there is no authentication.  This means that as soon
     **		as the connection has gone empty, it can be removed.
+    **
+    ** In cases 2 and 4 the connection is still good, so it can go back to the
+    ** cache's idle pool instead of being closed.
     */
+    if (reusable)
+        *reusable = isPersistent && !bad && empty;
+
     return (!isPersistent ||
             (!hasAuth && empty) ||
             (hasAuth && bad) ||
@@ -667,6 +800,7 @@ static void dequeueFromConnection1(_CFHTTPRequest *req) {
 #endif
     if (req->conn) {
         _CFNetConnectionRef conn = req->conn;
+        Boolean reusable;
         req->conn = NULL;
         if (!__CFBitIsSet(req->flags, IS_PERSISTENT)) {
             // We own this connection, just destroy it outright
@@ -674,7 +808,7 @@ static void dequeueFromConnection1(_CFHTTPRequest *req) {
             CFRelease(conn);
         } else {
             if (!_CFNetConnectionDequeue(conn, req)) {
-                if (canShutdownConnection(conn, req, TRUE)) {
+                if (canShutdownConnection(conn, req, TRUE, NULL)) {
                     _CFNetConnectionSetAllowsNewRequests(conn, FALSE);
                     removeFromConnectionCache(httpConnectionCache, conn, (_CFNetConnectionCacheKey)_CFNetConnectionGetInfoPointer(conn));
                 } else {
@@ -688,9 +822,13 @@ static void dequeueFromConnection1(_CFHTTPRequest *req) {
                         _CFNetConnectionReplaceRequest(conn, req, zombie);
                     }
                 }
-            } else if (canShutdownConnection(conn, req, FALSE)) {
-                _CFNetConnectionSetAllowsNewRequests(conn, FALSE);
-                removeFromConnectionCache(httpConnectionCache, conn, (_CFNetConnectionCacheKey)_CFNetConnectionGetInfoPointer(conn));
+            } else if (canShutdownConnection(conn, req, FALSE, &reusable)) {
+                if (reusable) {
+                    checkInToConnectionCache(httpConnectionCache, conn, (_CFNetConnectionCacheKey)_CFNetConnectionGetInfoPointer(conn));
+                } else {
+                    _CFNetConnectionSetAllowsNewRequests(conn, FALSE);
+                    removeFromConnectionCache(httpConnectionCache, conn, (_CFNetConnectionCacheKey)_CFNetConnectionGetInfoPointer(conn));
+                }
             }
             CFRelease(conn);
         }
@@ -718,8 +856,13 @@ static void httpRequestDestroy(CFAllocatorRef alloc, _CFHTTPRequest *req) {
     if (req->connProps) CFRelease(req->connProps);
     if (req->stateChangeSource) CFRelease(req->stateChangeSource);
 	if (req->peerCertificates) CFRelease(req->peerCertificates);
+    if (req->metrics) CFAllocatorDeallocate(alloc, req->metrics);
+    if (req->cachedResponse) CFRelease(req->cachedResponse);
+    if (req->cachedBody) CFRelease(req->cachedBody);
+    if (req->responseBody) CFRelease(req->responseBody);
+    if (req->http2Stream) closeHTTP2Stream(req);
     
-    CFAllocatorDeallocate(alloc, req); 
+    _CFHTTPContextPoolDeallocate(&requestContextPool, alloc, req);
 }
 
 static void httpRequestFinalize(CFReadStreamRef stream, void *info) {
@@ -750,6 +893,131 @@ static void closeRequestResources1(_CFHTTPRequest *req) {
     }
 }
 
+static _CFHTTPRequestMetrics *createTimingMetrics(CFAllocatorRef alloc) {
+    _CFHTTPRequestMetrics *metrics = CFAllocatorAllocate(alloc, sizeof(_CFHTTPRequestMetrics), 0);
+    if (metrics) memset(metrics, 0, sizeof(_CFHTTPRequestMetrics));
+    return metrics;
+}
+
+// Custom connection streams don't answer this, in which case there is nothing to report about the connection
+static Boolean copySocketMetrics(_CFNetConnectionRef conn, _CFSocketStreamMetrics *metrics) {
+    CFWriteStreamRef requestStream = conn ? _CFNetConnectionGetRequestStream(conn) : NULL;
+    CFDataRef wrapper = requestStream ? (CFDataRef)CFWriteStreamCopyProperty(requestStream, _kCFStreamPropertySocketMetrics) : NULL;
+    Boolean result = FALSE;
+    if (wrapper) {
+        if (CFGetTypeID(wrapper) == CFDataGetTypeID() && CFDataGetLength(wrapper) == sizeof(_CFSocketStreamMetrics)) {
+            memmove(metrics, CFDataGetBytePtr(wrapper), sizeof(_CFSocketStreamMetrics));
+            result = TRUE;
+        }
+        CFRelease(wrapper);
+    }
+    return result;
+}
+
+// Called each time the request starts transmitting; a redirected or retried request starts over
+static void timeRequestStart(_CFHTTPRequest *req, _CFNetConnectionRef conn) {
+    _CFHTTPRequestMetrics *metrics = req->metrics;
+    _CFSocketStreamMetrics socket;
+    metrics->requestStart = _CFNetworkGetMonotonicTime();
+    metrics->requestEnd = 0;
+    metrics->responseStart = 0;
+    metrics->responseEnd = 0;
+    metrics->reused = (_CFNetConnectionGetTransmittedCount(conn) > 1) ? TRUE : FALSE;
+    if (copySocketMetrics(conn, &socket)) {
+        metrics->bytesSentBase = socket.bytesWritten;
+        metrics->bytesReceivedBase = socket.bytesRead;
+    } else {
+        metrics->bytesSentBase = 0;
+        metrics->bytesReceivedBase = 0;
+    }
+}
+
+// Called once the response is complete or has failed; hands the metrics to the process-wide callback, if any
+static void timeResponseEnd(_CFHTTPRequest *req, _CFNetConnectionRef conn) {
+    _CFHTTPRequestMetrics *metrics = req->metrics;
+    _CFHTTPStreamTimingMetricsCallBack callBack;
+    void *info;
+    if (!metrics || metrics->reported) return;
+    metrics->reported = TRUE;
+    metrics->responseEnd = _CFNetworkGetMonotonicTime();
+    // The connection's phases are read now rather than at requestStart, since a new connection is still opening then
+    metrics->haveConnection = (metrics->requestStart && copySocketMetrics(conn, &metrics->connection)) ? TRUE : FALSE;
+
+    __CFSpinLock(&timingMetricsLock);
+    callBack = timingMetricsCallBack;
+    info = timingMetricsInfo;
+    __CFSpinUnlock(&timingMetricsLock);
+
+    if (callBack) {
+        CFDictionaryRef dict = copyTimingMetrics(CFGetAllocator(req->responseStream), req);
+        if (dict) {
+            callBack(req->responseStream, dict, info);
+            CFRelease(dict);
+        }
+    }
+}
+
+static void addTimingMetric(CFMutableDictionaryRef dict, CFStringRef key, CFTimeInterval when) {
+    CFNumberRef value;
+    if (!when) return; // The phase hasn't happened
+    value = CFNumberCreate(CFGetAllocator(dict), kCFNumberDoubleType, &when);
+    if (value) {
+        CFDictionarySetValue(dict, key, value);
+        CFRelease(value);
+    }
+}
+
+static void addByteCountMetric(CFMutableDictionaryRef dict, CFStringRef key, UInt64 count, UInt64 base) {
+    SInt64 bytes = (count > base) ? (SInt64)(count - base) : 0;
+    CFNumberRef value = CFNumberCreate(CFGetAllocator(dict), kCFNumberSInt64Type, &bytes);
+    if (value) {
+        CFDictionarySetValue(dict, key, value);
+        CFRelease(value);
+    }
+}
+
+static CFDictionaryRef copyTimingMetrics(CFAllocatorRef alloc, _CFHTTPRequest *req) {
+    _CFHTTPRequestMetrics metrics;
+    CFMutableDictionaryRef dict;
+    CFTimeInterval requestStart;
+    if (!req->metrics) return NULL;
+    dict = CFDictionaryCreateMutable(alloc, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (!dict) return NULL;
+
+    // While the request is in flight, report the connection as it stands
+    memmove(&metrics, req->metrics, sizeof(metrics));
+    if (!metrics.reported && metrics.requestStart) {
+        metrics.haveConnection = copySocketMetrics(req->conn, &metrics.connection);
+    }
+
+    addTimingMetric(dict, _kCFHTTPTimingMetricsFetchStart, metrics.fetchStart);
+    addTimingMetric(dict, _kCFHTTPTimingMetricsQueueStart, metrics.queueStart);
+    requestStart = metrics.requestStart;
+    if (metrics.haveConnection && !metrics.reused) {
+        // A new connection's phases belong to this request; nothing can be sent until they're over
+        addTimingMetric(dict, _kCFHTTPTimingMetricsDomainLookupStart, metrics.connection.lookupStart);
+        addTimingMetric(dict, _kCFHTTPTimingMetricsDomainLookupEnd, metrics.connection.lookupEnd);
+        addTimingMetric(dict, _kCFHTTPTimingMetricsConnectStart, metrics.connection.connectStart);
+        addTimingMetric(dict, _kCFHTTPTimingMetricsConnectEnd, metrics.connection.connectEnd);
+        addTimingMetric(dict, _kCFHTTPTimingMetricsSecureConnectionStart, metrics.connection.secureStart);
+        addTimingMetric(dict, _kCFHTTPTimingMetricsSecureConnectionEnd, metrics.connection.secureEnd);
+        if (requestStart && metrics.connection.connectEnd > requestStart) requestStart = metrics.connection.connectEnd;
+        if (requestStart && metrics.connection.secureEnd > requestStart) requestStart = metrics.connection.secureEnd;
+    }
+    addTimingMetric(dict, _kCFHTTPTimingMetricsRequestStart, requestStart);
+    addTimingMetric(dict, _kCFHTTPTimingMetricsRequestEnd, metrics.requestEnd);
+    addTimingMetric(dict, _kCFHTTPTimingMetricsResponseStart, metrics.responseStart);
+    addTimingMetric(dict, _kCFHTTPTimingMetricsResponseEnd, metrics.responseEnd);
+    if (metrics.requestStart) {
+        CFDictionarySetValue(dict, _kCFHTTPTimingMetricsConnectionReused, metrics.reused ? kCFBooleanTrue : kCFBooleanFalse);
+    }
+    if (metrics.haveConnection) {
+        addByteCountMetric(dict, _kCFHTTPTimingMetricsBytesSent, metrics.connection.bytesWritten, metrics.bytesSentBase);
+        addByteCountMetric(dict, _kCFHTTPTimingMetricsBytesReceived, metrics.connection.bytesRead, metrics.bytesReceivedBase);
+    }
+    return dict;
+}
+
 extern CFStringRef _CFNetworkUserAgentString(void) {
     static CFStringRef userAgentString = NULL;
     if (!userAgentString) {
@@ -847,7 +1115,11 @@ static void prepareTransmission1(_CFHTTPRequest *req, CFWriteStreamRef requestSt
             CFRelease(req->requestPayload);
         }
         
-        if (length) {
+        // Where there will be a Content-Length, let the filter send the body in the same writes as the header.
+        if (length && !_CFHTTPMessageIsGetMethod(req->currentRequest) && CFWriteStreamSetProperty(requestStream, _kCFStreamPropertyHTTPNewBody, payload)) {
+            req->requestPayload = NULL;
+        }
+        else if (length) {
             req->requestPayload = CFReadStreamCreateWithBytesNoCopy(CFGetAllocator(payload), CFDataGetBytePtr(payload), length, kCFAllocatorNull);
         }
         else
@@ -861,6 +1133,19 @@ static void prepareTransmission1(_CFHTTPRequest *req, CFWriteStreamRef requestSt
         cleanUpRequest(req->currentRequest, -1, reqIsPersistent, forProxy);
     }
     
+    // Ask for a compressed response if the response filter agreed to decode one; the client may have chosen its own codings.
+    if (CFDictionaryGetValue(req->connProps, _kCFStreamPropertyHTTPDecodeContentEncoding) == kCFBooleanTrue) {
+        CFReadStreamRef responseStream = _CFNetConnectionGetResponseStream(conn);
+        CFTypeRef decoding = responseStream ? CFReadStreamCopyProperty(responseStream, _kCFStreamPropertyHTTPDecodeContentEncoding) : NULL;
+        CFStringRef acceptEncoding = CFHTTPMessageCopyHeaderFieldValue(req->currentRequest, _kCFHTTPStreamAcceptEncodingHeader);
+        if (acceptEncoding) {
+            CFRelease(acceptEncoding);
+        } else if (decoding == kCFBooleanTrue) {
+            CFHTTPMessageSetHeaderFieldValue(req->currentRequest, _kCFHTTPStreamAcceptEncodingHeader, _kCFHTTPStreamAcceptEncodingGzipDeflate);
+        }
+        if (decoding) CFRelease(decoding);
+    }
+    
     // Set client on both streams and schedule.  Open payload (requestStream is already open)
     if (req->requestPayload) {
         CFArrayRef rlArray;
@@ -928,15 +1213,27 @@ static void concludeReception1(_CFHTTPRequest *req, CFReadStreamRef responseStre
                     _CFNetConnectionLost(req->conn);
 #if !defined(NO_PIPELINING)
                 } else {
-                    _CFNetConnectionSetShouldPipeline(req->conn, TRUE);
+                    enablePipelining(req);
 #endif
                 }
             }
         }
         if (err.error != 0) {
+            timeResponseEnd(req, req->conn);
             _CFReadStreamSignalEventDelayed(req->responseStream, kCFStreamEventErrorOccurred, &err);
         } else if (readFromThisStream) {
-            _CFReadStreamSignalEventDelayed(req->responseStream, kCFStreamEventEndEncountered, NULL);
+            timeResponseEnd(req, req->conn);
+            if (req->responseBody) {
+                _CFHTTPResponseCacheStore(req->currentRequest, req->responseHeaders, req->responseBody, req->cacheRequestTime, req->cacheResponseTime);
+                CFRelease(req->responseBody);
+                req->responseBody = NULL;
+            }
+            if (!__CFBitIsSet(req->flags, SERVING_CACHED_RESPONSE)) {
+                _CFReadStreamSignalEventDelayed(req->responseStream, kCFStreamEventEndEncountered, NULL);
+            } else if (!__CFBitIsSet(req->flags, IN_READ_CALLBACK)) {
+                // The response is the cached one, which has yet to be read
+                _CFReadStreamSignalEventDelayed(req->responseStream, kCFStreamEventHasBytesAvailable, NULL);
+            }
         }
     }
 }
@@ -961,18 +1258,23 @@ static Boolean shouldReattemptRequest(_CFHTTPRequest *req, CFStreamError *err, i
         return TRUE;
     } else if (__CFBitIsSet(req->flags, HAS_PAYLOAD) && !__CFBitIsSet(req->flags, PAYLOAD_IS_DATA)) {
         return FALSE;
-    } else if (err->domain == kCFStreamErrorDomainHTTP && err->error == kCFStreamErrorHTTPConnectionLost) {
-        // Somewhere upstream, the server decided to stop processing further pipelined requests
-        return TRUE;
-    } else if (oldState == kTransmittingRequest) {
+    } else if (oldState == kTransmittingRequest && !(err->domain == kCFStreamErrorDomainHTTP && err->error == kCFStreamErrorHTTPConnectionLost)) {
         if (req->proxyList && CFArrayGetCount(req->proxyList) > 1) {
             *advanceToNextProxy = TRUE;
             return TRUE;
         } else {
             return FALSE;
         }
+    } else if (!_CFHTTPMessageIsIdempotentMethod(req->currentRequest ? req->currentRequest : req->originalRequest)) {
+        // The request went out and the server may have acted on it; sending it again could repeat that.
+        return FALSE;
+    } else if (req->replayCount >= kHTTPMaxReplays) {
+        // Every connection we try dies before answering; give up rather than loop
+        return FALSE;
     } else {
-        // oldState == kWaitingForResponse
+        // oldState == kWaitingForResponse, or somewhere upstream, the server decided to stop
+        // processing further pipelined requests.  Send it again on a fresh connection.
+        req->replayCount++;
         return TRUE;
     }
 }
@@ -992,6 +1294,20 @@ static void haveBeenOrphaned1(_CFHTTPRequest *req, int oldState, CFStreamError *
     Boolean advanceToNextProxy;
 
     *haveBeenDealloced = FALSE;
+    
+    // A request only waits for its response behind another's when it has been pipelined.  If the
+    // connection failed under it, rather than being closed cleanly, don't pipeline to that peer again.
+    if (oldState == kWaitingForResponse && err && err->error != 0 &&
+        !(err->domain == kCFStreamErrorDomainHTTP && err->error == kCFStreamErrorHTTPConnectionLost))
+    {
+        CFStringRef host;
+        SInt32 port;
+        UInt32 connType;
+        CFDictionaryRef properties;
+        getValuesFromKey((_CFNetConnectionCacheKey)_CFNetConnectionGetInfoPointer(conn), &host, &port, &connType, &properties);
+        blacklistPipelining(host);
+    }
+    
     shouldReattempt = shouldReattemptRequest(req, err, oldState, conn, &advanceToNextProxy);
     
     if (shouldReattempt) {
@@ -1014,6 +1330,7 @@ static void haveBeenOrphaned1(_CFHTTPRequest *req, int oldState, CFStreamError *
             req->requestFragment = NULL;
         }
         if (!__CFBitIsSet(req->flags, IS_ZOMBIE)) {
+            timeResponseEnd(req, conn);
             if (err->domain == kCFStreamErrorDomainHTTP && err->error == _kCFStreamErrorHTTPSProxyFailure) {
                     req->responseHeaders = (CFHTTPMessageRef)CFWriteStreamCopyProperty(_CFNetConnectionGetRequestStream(conn), kCFStreamPropertyCONNECTResponse);
                     addAuthenticationInfoToResponse1(req);
@@ -1048,9 +1365,11 @@ static void httpRequestStateChanged(void *request, int newState, CFStreamError *
     case kQueued:
         break;
     case kTransmittingRequest:
+        if (req->metrics) timeRequestStart(req, conn);
         prepareTransmission1(req, _CFNetConnectionGetRequestStream(conn), conn);
         break;
     case kWaitingForResponse:
+        if (req->metrics) req->metrics->requestEnd = _CFNetworkGetMonotonicTime();
         concludeTransmission1(req, _CFNetConnectionGetRequestStream(conn));
         break;
     case kReceivingResponse:
@@ -1171,6 +1490,14 @@ static Boolean transmitRequest1(_CFHTTPRequest *http, CFWriteStreamRef destStrea
         done = TRUE;
     }
     if (done) {
+        if (error->error == 0 && http->requestBytesWritten == 0 && __CFBitIsSet(http->flags, PAYLOAD_IS_DATA) && CFWriteStreamGetStatus(destStream) != kCFStreamStatusError) {
+            // A data payload given to the filter went out with the header, so count it now.
+            CFDataRef body = CFHTTPMessageCopyBody(http->originalRequest);
+            if (body) {
+                http->requestBytesWritten = CFDataGetLength(body);
+                CFRelease(body);
+            }
+        }
         closeRequestResources1(http);
         __CFBitSet(http->flags, HAVE_SENT_REQUEST_PAYLOAD);
     }
@@ -1295,6 +1622,46 @@ static CFHTTPAuthenticationRef connectionOrientedAuth(_CFHTTPRequest *http, Bool
     return connAuth;
 }
 
+// Returns the proxy the request is going through if it is one that reads the request's headers, i.e. a
+// plain HTTP proxy rather than a CONNECT tunnel or a SOCKS proxy.  Otherwise returns NULL.
+static CFURLRef headerProxyURL(_CFHTTPRequest *http) {
+    CFURLRef proxyURL = (http->proxyList && CFArrayGetCount(http->proxyList) > 0) ? CFArrayGetValueAtIndex(http->proxyList, 0) : NULL;
+    if (proxyURL && (CFTypeRef)proxyURL != kCFNull) {
+        CFStringRef scheme = CFURLCopyScheme(proxyURL);
+        Boolean isHTTP = scheme && (CFStringCompare(scheme, _kCFHTTPStreamHTTPScheme, kCFCompareCaseInsensitive) == kCFCompareEqualTo);
+        if (scheme) CFRelease(scheme);
+        if (isHTTP) return proxyURL;
+    }
+    return NULL;
+}
+
+// Attaches authentication from the process-wide cache to a request that carries none of its own, so
+// a server or proxy which has accepted it before doesn't have to challenge again.  Connection-oriented
+// schemes are only attached if conn has already completed their handshake.
+static void applyCachedAuthentication(_CFHTTPRequest *http, _CFNetConnectionRef conn) {
+    CFURLRef url, proxyURL;
+    if (!http->currentRequest) return;
+    url = CFHTTPMessageCopyRequestURL(http->currentRequest);
+    if (url) {
+        _CFHTTPAuthenticationCacheApplyToRequest(http->currentRequest, url, FALSE, conn);
+        CFRelease(url);
+    }
+    proxyURL = headerProxyURL(http);
+    if (proxyURL) {
+        _CFHTTPAuthenticationCacheApplyToRequest(http->currentRequest, proxyURL, TRUE, conn);
+    }
+}
+
+static CFNetConnectionCacheRef getConnectionCache(void) {
+    __CFSpinLock(&cacheInitLock);
+    if (httpConnectionCache == NULL) {
+        httpConnectionCache = createConnectionCache();
+        setConnectionCacheLimits(httpConnectionCache, kHTTPConnectionCacheMaxPerHost, kHTTPConnectionCacheMaxTotal, kHTTPConnectionCacheIdleTimeout);
+    }
+    __CFSpinUnlock(&cacheInitLock);
+    return httpConnectionCache;
+}
+
 static void setConnectionFromProxyStream(_CFHTTPRequest *http, CFStreamError *err) {
     Boolean isComplete;
     err->domain = 0;
@@ -1323,13 +1690,9 @@ static void setConnectionFromProxyStream(_CFHTTPRequest *http, CFStreamError *er
         CFURLRef targetURL = CFHTTPMessageCopyRequestURL(request);
         _CFNetConnectionCacheKey key = nextConnectionCacheKeyFromProxyArray(http, http->proxyList, targetURL, http->connProps);
         CFRelease(targetURL);
-		__CFSpinLock(&cacheInitLock);
-        if (httpConnectionCache == NULL) {
-            httpConnectionCache = createConnectionCache();
-        }
-		__CFSpinUnlock(&cacheInitLock);
-        http->conn = findOrCreateNetConnection(httpConnectionCache, CFGetAllocator(http->responseStream), &httpConnectionCallBacks, key, key, isPersistent(http), http->connProps);
+        http->conn = findOrCreateNetConnection(getConnectionCache(), CFGetAllocator(http->responseStream), &httpConnectionCallBacks, key, key, isPersistent(http), http->connProps);
         releaseConnectionCacheKey(key);
+        if (http->conn) applyCachedAuthentication(http, http->conn);
 		
 		if ((auth || proxyAuth) && http->conn) {
 			
@@ -1350,6 +1713,7 @@ static void setConnectionFromProxyStream(_CFHTTPRequest *http, CFStreamError *er
 			}
 		}
 		
+        if (http->metrics) http->metrics->queueStart = _CFNetworkGetMonotonicTime();
         _CFNetConnectionEnqueue(http->conn, http);
         if (!isPersistent(http)) {
             _CFNetConnectionSetAllowsNewRequests(http->conn, FALSE);
@@ -1443,13 +1807,9 @@ static _CFNetConnectionRef getConnectionForRequest(_CFHTTPRequest *req, Boolean
         } else {
             // Just advance to the next proxy
             _CFNetConnectionCacheKey key = nextConnectionCacheKeyFromProxyArray(req, req->proxyList, targetURL, req->connProps);
-            __CFSpinLock(&cacheInitLock);
-            if (httpConnectionCache == NULL) {
-                httpConnectionCache = createConnectionCache();
-            }
-            __CFSpinUnlock(&cacheInitLock);
-            conn = findOrCreateNetConnection(httpConnectionCache, CFGetAllocator(req->responseStream), &httpConnectionCallBacks, key, key, isPersistent(req), req->connProps);
+            conn = findOrCreateNetConnection(getConnectionCache(), CFGetAllocator(req->responseStream), &httpConnectionCallBacks, key, key, isPersistent(req), req->connProps);
             releaseConnectionCacheKey(key);
+            if (conn) applyCachedAuthentication(req, conn);
         }
     }
 	
@@ -1632,6 +1992,7 @@ static Boolean resetForRequest(CFHTTPMessageRef newRequest, _CFHTTPRequest *http
         // Asynchronous discovery of the correct connection; getConnectionForRequest took care of setting everything up 
         return TRUE;
     } else {
+        if (http->metrics) http->metrics->queueStart = _CFNetworkGetMonotonicTime();
         _CFNetConnectionEnqueue(http->conn, http);
         if (!isPersistent(http)) {
             _CFNetConnectionSetAllowsNewRequests(http->conn, FALSE);
@@ -1640,14 +2001,174 @@ static Boolean resetForRequest(CFHTTPMessageRef newRequest, _CFHTTPRequest *http
     }
 }
 
+// Whether the request may go over HTTP/2; it may not if it needs anything only the HTTP/1.1 path does
+static Boolean canUseHTTP2(_CFHTTPRequest *http) {
+    if (!__CFBitIsSet(http->flags, USE_HTTP2)) return FALSE;
+    if (http->proxyDict || __CFBitIsSet(http->flags, AUTOREDIRECT) || http->requestPayload) return FALSE;
+    if (__CFBitIsSet(http->flags, USE_RESPONSE_CACHE) || CFDictionaryGetCount(http->connProps) != 0) return FALSE;
+    // NTLM and Negotiate authenticate the connection, which HTTP/2 does not allow
+    if (connectionOrientedAuth(http, FALSE) || connectionOrientedAuth(http, TRUE)) return FALSE;
+    return TRUE;
+}
+
+static void http2StreamCallBack(CFReadStreamRef stream, CFStreamEventType type, void *info) {
+    _CFHTTPRequest *http = (_CFHTTPRequest *)info;
+#if defined(LOG_REQUESTS)
+    fprintf(stderr, "http2StreamCallBack(req = 0x%x, event = %d)\n", (int)http, type);
+#endif
+    if (stream != http->http2Stream || __CFBitIsSet(http->flags, IN_READ_CALLBACK)) return;
+    switch (type) {
+    case kCFStreamEventOpenCompleted:
+        if (!__CFBitIsSet(http->flags, OPEN_SIGNALLED)) {
+            __CFBitSet(http->flags, OPEN_SIGNALLED);
+            CFReadStreamSignalEvent(http->responseStream, kCFStreamEventOpenCompleted, NULL);
+        }
+        break;
+    case kCFStreamEventHasBytesAvailable:
+        grabHTTP2ResponseHeaders(http);
+        CFReadStreamSignalEvent(http->responseStream, kCFStreamEventHasBytesAvailable, NULL);
+        break;
+    case kCFStreamEventEndEncountered:
+        grabHTTP2ResponseHeaders(http);
+        if (http->metrics) http->metrics->responseEnd = _CFNetworkGetMonotonicTime();
+        CFReadStreamSignalEvent(http->responseStream, kCFStreamEventEndEncountered, NULL);
+        break;
+    case kCFStreamEventErrorOccurred:
+    {
+        CFStreamError err = CFReadStreamGetError(stream);
+        if (!fallBackFromHTTP2(http, &err) || err.domain != 0) {
+            CFReadStreamSignalEvent(http->responseStream, kCFStreamEventErrorOccurred, &err);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Tries to send the request over the shared HTTP/2 connection to its server.  Returns FALSE if it must go over
+// HTTP/1.1 instead; otherwise returns TRUE, with error set if the request has already failed.
+static Boolean openOverHTTP2(_CFHTTPRequest *http, CFHTTPMessageRef request, CFStreamError *error) {
+    CFURLRef url;
+    CFStringRef scheme, host;
+    CFTypeRef conn = NULL;
+
+    if (request != http->currentRequest) {
+        if (http->currentRequest) CFRelease(http->currentRequest);
+        CFRetain(request);
+        http->currentRequest = request;
+        http->requestBytesWritten = 0;
+    }
+    if (!canUseHTTP2(http)) return FALSE;
+
+    url = CFHTTPMessageCopyRequestURL(request);
+    scheme = url ? CFURLCopyScheme(url) : NULL;
+    host = url ? CFURLCopyHostName(url) : NULL;
+    if (scheme && host && CFStringCompare(scheme, _kCFHTTPStreamHTTPSScheme, kCFCompareCaseInsensitive) == kCFCompareEqualTo) {
+        SInt32 port = CFURLGetPortNumber(url);
+        // NULL for a server which has refused HTTP/2 before
+        conn = _CFHTTP2ConnectionCopyShared(CFGetAllocator(http->responseStream), host, port == -1 ? 443 : port);
+    }
+    if (host) CFRelease(host);
+    if (scheme) CFRelease(scheme);
+    if (url) CFRelease(url);
+    if (!conn) return FALSE;
+
+    {
+        CFDataRef body = CFHTTPMessageCopyBody(request);
+        cleanUpRequest(request, body ? CFDataGetLength(body) : -1, TRUE, FALSE);
+        if (body) CFRelease(body);
+    }
+    http->http2Stream = _CFHTTP2ConnectionEnqueue(conn, request, NULL);
+    CFRelease(conn);
+    if (!http->http2Stream) return FALSE;
+
+    {
+        CFStreamClientContext ctxt = {0, http, NULL, NULL, NULL};
+        CFArrayRef rlArray = _CFReadStreamGetRunLoopsAndModes(http->responseStream);
+        CFReadStreamSetClient(http->http2Stream, kCFStreamEventOpenCompleted | kCFStreamEventHasBytesAvailable | kCFStreamEventEndEncountered | kCFStreamEventErrorOccurred, http2StreamCallBack, &ctxt);
+        if (rlArray) {
+            CFIndex i, c = CFArrayGetCount(rlArray);
+            for (i = 0; i + 1 < c; i += 2) {
+                CFRunLoopRef rl = (CFRunLoopRef)CFArrayGetValueAtIndex(rlArray, i);
+                CFStringRef mode = CFArrayGetValueAtIndex(rlArray, i + 1);
+                CFReadStreamScheduleWithRunLoop(http->http2Stream, rl, mode);
+            }
+        }
+    }
+    if (http->metrics) http->metrics->queueStart = http->metrics->requestStart = _CFNetworkGetMonotonicTime();
+    error->domain = 0;
+    error->error = 0;
+    if (!CFReadStreamOpen(http->http2Stream)) {
+        CFStreamError err = CFReadStreamGetError(http->http2Stream);
+        if (!fallBackFromHTTP2(http, &err) || err.domain != 0) {
+            *error = err;
+        }
+    }
+    return TRUE;
+}
+
+// Sends the request again over HTTP/1.1 if err says the server does not speak HTTP/2, or that the connection went
+// away before the response began.  Returns FALSE, leaving err alone, if the request must fail with err instead.
+// Otherwise returns TRUE, with err cleared or set to whatever sending it over HTTP/1.1 failed with.
+static Boolean fallBackFromHTTP2(_CFHTTPRequest *http, CFStreamError *err) {
+    CFHTTPMessageRef newRequest;
+    if (err->domain != kCFStreamErrorDomainHTTP || http->responseHeaders) return FALSE;
+    if (err->error != kCFStreamErrorHTTP2NotNegotiated) {
+        // The body may have gone out already; only a request without one is safe to send twice
+        if (err->error != kCFStreamErrorHTTPConnectionLost || __CFBitIsSet(http->flags, HAS_PAYLOAD)) return FALSE;
+    }
+    closeHTTP2Stream(http);
+    __CFBitClear(http->flags, USE_HTTP2);
+    err->domain = 0;
+    err->error = 0;
+    newRequest = CFHTTPMessageCreateCopy(CFGetAllocator(http->responseStream), http->originalRequest);
+    resetForRequest(newRequest, http, err);
+    CFRelease(newRequest);
+    return TRUE;
+}
+
+static void closeHTTP2Stream(_CFHTTPRequest *http) {
+    CFReadStreamSetClient(http->http2Stream, kCFStreamEventNone, NULL, NULL);
+    CFReadStreamClose(http->http2Stream);
+    CFRelease(http->http2Stream);
+    http->http2Stream = NULL;
+}
+
+// Keeps the response headers, as for HTTP/1.1, so they are still there once the HTTP/2 stream is gone
+static void grabHTTP2ResponseHeaders(_CFHTTPRequest *http) {
+    if (!http->responseHeaders && http->http2Stream) {
+        http->responseHeaders = (CFHTTPMessageRef)CFReadStreamCopyProperty(http->http2Stream, kCFStreamPropertyHTTPResponseHeader);
+        if (http->responseHeaders) {
+            __CFBitSet(http->flags, HAVE_CHECKED_RESPONSE_HEADERS);
+            if (http->metrics) http->metrics->responseStart = _CFNetworkGetMonotonicTime();
+        }
+    }
+}
+
 static Boolean httpRequestOpen(CFReadStreamRef stream, CFStreamError *error, Boolean *openComplete, void *info) {
     _CFHTTPRequest *http = (_CFHTTPRequest *)info;
     CFHTTPMessageRef newRequest = CFHTTPMessageCreateCopy(CFGetAllocator(stream), http->originalRequest);
+    _CFHTTPStreamTimingMetricsCallBack callBack;
     Boolean result;
 #if defined(LOG_REQUESTS)
     fprintf(stderr, "httpRequestOpen(req = 0x%x)\n", (int)http);
 #endif
-    if (!resetForRequest(newRequest, http, error)) {
+    __CFSpinLock(&timingMetricsLock);
+    callBack = timingMetricsCallBack;
+    __CFSpinUnlock(&timingMetricsLock);
+    if (!http->metrics && callBack) {
+        http->metrics = createTimingMetrics(CFGetAllocator(stream));
+    }
+    if (http->metrics) http->metrics->fetchStart = _CFNetworkGetMonotonicTime();
+    if (__CFBitIsSet(http->flags, USE_RESPONSE_CACHE) && lookUpResponseCache(http, newRequest)) {
+        // Answered from the response cache; there's nothing to connect to
+        *openComplete = TRUE;
+        result = TRUE;
+    } else if (openOverHTTP2(http, newRequest, error)) {
+        *openComplete = (error->domain != 0);
+        result = (error->domain == 0);
+    } else if (!resetForRequest(newRequest, http, error)) {
         *openComplete = TRUE;
         result = FALSE;
     } else {
@@ -1665,6 +2186,9 @@ static Boolean httpRequestOpenCompleted(CFReadStreamRef stream, CFStreamError *e
     fprintf(stderr, "httpRequestOpenCompleted(req = 0x%x)\n", (int)req);
 #endif
     if (__CFBitIsSet(req->flags, OPEN_SIGNALLED)) return TRUE;
+    if (req->http2Stream) {
+        return (CFReadStreamGetStatus(req->http2Stream) != kCFStreamStatusOpening);
+    }
     if (req->proxyStream) {
         setConnectionFromProxyStream(req, error);
         if (error->domain != 0) return TRUE;
@@ -1773,6 +2297,8 @@ static void addAuthenticationInfoToResponse1(_CFHTTPRequest *http) {
 	_CFNetConnectionRef conn = http->conn;
 	Boolean persistent = _CFNetConnectionWillEnqueueRequests(conn);
     CFHTTPAuthenticationRef auth = NULL;
+    // The current request is a copy of the original, and also carries any authentication added from the cache
+    CFHTTPMessageRef request = http->currentRequest ? http->currentRequest : http->originalRequest;
     if (__CFBitIsSet(http->flags, AUTOREDIRECT)) {
         requestedURL = CFArrayGetValueAtIndex(http->redirectedURLs, CFArrayGetCount(http->redirectedURLs) - 1);
         CFRetain(requestedURL);
@@ -1780,25 +2306,148 @@ static void addAuthenticationInfoToResponse1(_CFHTTPRequest *http) {
         requestedURL = CFHTTPMessageCopyRequestURL(http->originalRequest);
     }
     _CFHTTPMessageSetResponseURL(http->responseHeaders, requestedURL);
-    CFRelease(requestedURL);
 	
     // Update auth token if there is one
-    auth = _CFHTTPMessageGetAuthentication(http->originalRequest, FALSE);
+    auth = _CFHTTPMessageGetAuthentication(request, FALSE);
     if (auth) {
         _CFHTTPAuthenticationUpdateFromResponse(auth, http->responseHeaders, conn);
+        _CFHTTPAuthenticationCacheUpdate(auth, http->responseHeaders, requestedURL);
 		if (!persistent)
 			_CFHTTPAuthenticationDisassociateConnection(auth, conn);
     }
+    CFRelease(requestedURL);
 	
 	// Update the proxy auth if there is one
-    auth = _CFHTTPMessageGetAuthentication(http->originalRequest, TRUE);
+    auth = _CFHTTPMessageGetAuthentication(request, TRUE);
     if (auth) {
         _CFHTTPAuthenticationUpdateFromResponse(auth, http->responseHeaders, conn);
+        _CFHTTPAuthenticationCacheUpdate(auth, http->responseHeaders, headerProxyURL(http));
 		if (!persistent)
 			_CFHTTPAuthenticationDisassociateConnection(auth, conn);
     }
 }
 
+// Looks the request up in the response cache.  Returns TRUE if the cached response can be used as is, in which case the stream is set up to read it.
+static Boolean lookUpResponseCache(_CFHTTPRequest *http, CFHTTPMessageRef request) {
+    CFHTTPMessageRef cached;
+    CFDataRef body;
+    _CFHTTPResponseCacheResult found = _CFHTTPResponseCacheLookup(request, &cached, &body);
+
+    dropCachedResponse(http);
+    __CFBitClear(http->flags, STORE_RESPONSE);
+    __CFBitClear(http->flags, SERVING_CACHED_RESPONSE);
+    http->cacheRequestTime = CFAbsoluteTimeGetCurrent();
+
+    switch (found) {
+    case kCFHTTPResponseCacheFresh: {
+        CFURLRef url = CFHTTPMessageCopyRequestURL(request);
+        if (http->currentRequest) CFRelease(http->currentRequest);
+        http->currentRequest = request;
+        CFRetain(request);
+        if (http->responseHeaders) CFRelease(http->responseHeaders);
+        http->responseHeaders = cached;
+        if (url) {
+            _CFHTTPMessageSetResponseURL(http->responseHeaders, url);
+            CFRelease(url);
+        }
+        http->cachedBody = body;
+        __CFBitSet(http->flags, SERVING_CACHED_RESPONSE);
+        __CFBitSet(http->flags, HAVE_CHECKED_RESPONSE_HEADERS);
+        if (http->metrics) http->metrics->responseStart = _CFNetworkGetMonotonicTime();
+        timeResponseEnd(http, NULL);
+        _CFReadStreamSignalEventDelayed(http->responseStream, kCFStreamEventHasBytesAvailable, NULL);
+        return TRUE;
+    }
+    case kCFHTTPResponseCacheStale:
+        // Ask the server whether the cached response is still good; checkResponseCache sees to the answer
+        http->cachedResponse = cached;
+        http->cachedBody = body;
+        _CFHTTPResponseCacheAddValidators(request, cached);
+        __CFBitSet(http->flags, STORE_RESPONSE);
+        return FALSE;
+    case kCFHTTPResponseCacheMiss:
+        __CFBitSet(http->flags, STORE_RESPONSE);
+        return FALSE;
+    case kCFHTTPResponseCacheUnusable:
+    default:
+        return FALSE;
+    }
+}
+
+// Called with each set of response headers to a request which may use the response cache
+static void checkResponseCache(_CFHTTPRequest *http, int nextAction) {
+    int status = CFHTTPMessageGetResponseStatusCode(http->responseHeaders);
+
+    if (status >= 100 && status < 200) return;
+
+    switch (nextAction) {
+    case REDIRECT:
+        // The validators were for the cached response, not whatever is at the next URL
+        if (http->cachedResponse) _CFHTTPResponseCacheRemoveValidators(http->currentRequest);
+        dropCachedResponse(http);
+        break;
+    case AUTHENTICATE:
+    case PROXY_AUTHENTICATE:
+        // The request will be sent again as is
+        break;
+    default:
+        http->cacheResponseTime = CFAbsoluteTimeGetCurrent();
+        if (status == 304 && http->cachedResponse) {
+            // The server validated the cached response; read it instead, with the headers the 304 updated
+            CFHTTPMessageRef revalidated = _CFHTTPResponseCacheCopyRevalidated(http->currentRequest, http->cachedResponse, http->responseHeaders, http->cachedBody, http->cacheRequestTime, http->cacheResponseTime);
+            if (revalidated) {
+                CFURLRef url = CFHTTPMessageCopyRequestURL(http->currentRequest);
+                if (url) {
+                    _CFHTTPMessageSetResponseURL(revalidated, url);
+                    CFRelease(url);
+                }
+                CFRelease(http->responseHeaders);
+                http->responseHeaders = revalidated;
+                CFRelease(http->cachedResponse);
+                http->cachedResponse = NULL;
+                http->cachedBodyRead = 0;
+                __CFBitSet(http->flags, SERVING_CACHED_RESPONSE);
+                return;
+            }
+        }
+        dropCachedResponse(http);
+        if (!__CFBitIsSet(http->flags, STORE_RESPONSE)) {
+            // The lookup said the response mustn't be stored
+        } else if ((nextAction == OK || (nextAction == DONE && status == 204)) && _CFHTTPResponseCacheCanStore(http->currentRequest, http->responseHeaders)) {
+            http->responseBody = CFDataCreateMutable(CFGetAllocator(http->responseStream), 0);
+        } else if (status >= 200 && status < 300) {
+            // Whatever was cached for the request is out of date now, though it can't be replaced
+            _CFHTTPResponseCacheRemove(http->currentRequest);
+        }
+    }
+}
+
+static void dropCachedResponse(_CFHTTPRequest *http) {
+    if (http->cachedResponse) CFRelease(http->cachedResponse);
+    http->cachedResponse = NULL;
+    if (http->cachedBody) CFRelease(http->cachedBody);
+    http->cachedBody = NULL;
+    http->cachedBodyRead = 0;
+    if (http->responseBody) CFRelease(http->responseBody);
+    http->responseBody = NULL;
+}
+
+static CFIndex readFromResponseCache(_CFHTTPRequest *http, UInt8 *buffer, CFIndex bufferLength, Boolean *atEOF) {
+    CFIndex remaining = http->cachedBody ? CFDataGetLength(http->cachedBody) - http->cachedBodyRead : 0;
+    CFIndex result = (remaining < bufferLength) ? remaining : bufferLength;
+    if (result > 0) {
+        CFDataGetBytes(http->cachedBody, CFRangeMake(http->cachedBodyRead, result), buffer);
+        http->cachedBodyRead += result;
+    }
+    if (result < remaining) {
+        *atEOF = FALSE;
+        _CFReadStreamSignalEventDelayed(http->responseStream, kCFStreamEventHasBytesAvailable, NULL);
+    } else {
+        *atEOF = TRUE;
+    }
+    return result;
+}
+
 // Our first peek at the headers; see if further action is required
 // Returns true if the stream did not need to be reconfigured; false otherwise
 static Boolean checkHeaders(_CFHTTPRequest *http, CFReadStreamRef stream, CFStreamError *error, Boolean *connectionStaysPersistent) {
@@ -1814,6 +2463,7 @@ static Boolean checkHeaders(_CFHTTPRequest *http, CFReadStreamRef stream, CFStre
     }
 
     error->error = 0;
+    if (http->metrics) http->metrics->responseStart = _CFNetworkGetMonotonicTime();
     if (http->responseHeaders) CFRelease(http->responseHeaders);
     http->responseHeaders = (CFHTTPMessageRef)CFReadStreamCopyProperty(stream, kCFStreamPropertyHTTPResponseHeader);
 
@@ -1835,7 +2485,7 @@ static Boolean checkHeaders(_CFHTTPRequest *http, CFReadStreamRef stream, CFStre
 			_CFNetConnectionLost(http->conn);
 #if !defined(NO_PIPELINING)
 		} else {
-			_CFNetConnectionSetShouldPipeline(http->conn, TRUE);
+			enablePipelining(http);
 #endif
 		}
 	}
@@ -1844,6 +2494,9 @@ static Boolean checkHeaders(_CFHTTPRequest *http, CFReadStreamRef stream, CFStre
 	if (http->responseHeaders)
 		addAuthenticationInfoToResponse1(http);
 
+    if (__CFBitIsSet(http->flags, USE_RESPONSE_CACHE) && http->responseHeaders)
+        checkResponseCache(http, nextAction);
+
     switch (nextAction) {
     case DONE:
         __CFBitSet(http->flags, FORCE_EOF);
@@ -1925,7 +2578,7 @@ static CFIndex readFromConnection(_CFHTTPRequest *req, UInt8 *buffer, CFIndex le
                 _CFNetConnectionLost(req->conn);
 #if !defined(NO_PIPELINING)
             } else {
-                _CFNetConnectionSetShouldPipeline(req->conn, TRUE);
+                enablePipelining(req);
 #endif
             }
         }
@@ -1938,12 +2591,30 @@ static CFIndex readFromConnection(_CFHTTPRequest *req, UInt8 *buffer, CFIndex le
             // We're done, but the filtered stream can't know that (we used some knowledge from the request, like that this is a HEAD request, to determine that there's no content coming).  We must force the correct responses here.
             connWeAreDoneWith = req->conn;
             result = 0;
+        } else if (req->responseBody && result > 0) {
+            // Keep a copy of the body for the response cache, unless it's grown too big to be stored
+            if (CFDataGetLength(req->responseBody) + result > _CFHTTPResponseCacheGetMaxEntrySize()) {
+                CFRelease(req->responseBody);
+                req->responseBody = NULL;
+            } else {
+                CFDataAppendBytes(req->responseBody, buffer, result);
+            }
         }
     }
     if (connWeAreDoneWith) {
-        _CFNetConnectionResponseIsComplete(connWeAreDoneWith, req);
+        if (__CFBitIsSet(req->flags, SERVING_CACHED_RESPONSE)) {
+            // The server validated the cached response; its body is returned below, so the completion mustn't signal the end
+            __CFBitSet(req->flags, IN_READ_CALLBACK);
+            _CFNetConnectionResponseIsComplete(connWeAreDoneWith, req);
+            __CFBitClear(req->flags, IN_READ_CALLBACK);
+        } else {
+            _CFNetConnectionResponseIsComplete(connWeAreDoneWith, req);
+        }
         CFRelease(connWeAreDoneWith);
     }
+    if (error->error == 0 && result == 0 && __CFBitIsSet(req->flags, SERVING_CACHED_RESPONSE)) {
+        result = readFromResponseCache(req, buffer, length, atEOF);
+    }
     return result;
 }
 
@@ -1960,6 +2631,30 @@ static CFIndex httpRequestRead(CFReadStreamRef stream, UInt8 *buffer, CFIndex bu
     fprintf(stderr, "httpRequestRead(req = 0x%x)\n", (int)req);
 #endif
 
+    if (__CFBitIsSet(req->flags, SERVING_CACHED_RESPONSE) && (!req->conn || _CFHTTPRequestGetState(req) >= kFinished)) {
+        error->error = 0;
+        return readFromResponseCache(req, buffer, bufferLength, atEOF);
+    }
+    if (req->http2Stream) {
+        // Events from the HTTP/2 stream while it blocks are for us, and we're already reading
+        __CFBitSet(req->flags, IN_READ_CALLBACK);
+        result = CFReadStreamRead(req->http2Stream, buffer, bufferLength);
+        __CFBitClear(req->flags, IN_READ_CALLBACK);
+        grabHTTP2ResponseHeaders(req);
+        if (result > 0) {
+            *atEOF = FALSE;
+        } else if (result == 0) {
+            if (req->metrics) req->metrics->responseEnd = _CFNetworkGetMonotonicTime();
+            *atEOF = TRUE;
+        } else {
+            *error = CFReadStreamGetError(req->http2Stream);
+            if (fallBackFromHTTP2(req, error)) {
+                if (error->domain != 0) return -1;
+                return httpRequestRead(stream, buffer, bufferLength, error, atEOF, info);
+            }
+        }
+        return result;
+    }
     if (req->proxyStream) {
         setConnectionFromProxyStream(req, error);
         if (error->domain != 0) {
@@ -2049,6 +2744,14 @@ static Boolean httpRequestCanRead(CFReadStreamRef ourStream, void *info) {
 #if defined(LOG_REQUESTS)
     fprintf(stderr, "httpRequestCanRead(req = 0x%x)\n", (int)req);
 #endif
+    if (__CFBitIsSet(req->flags, SERVING_CACHED_RESPONSE) && (!req->conn || _CFHTTPRequestGetState(req) >= kFinished)) {
+        return TRUE;
+    }
+    if (req->http2Stream) {
+        CFStreamStatus status = CFReadStreamGetStatus(req->http2Stream);
+        // At the end or on error, a read is what reports it
+        return (status == kCFStreamStatusAtEnd || status == kCFStreamStatusError || CFReadStreamHasBytesAvailable(req->http2Stream));
+    }
     if (req->proxyStream) {
         // Attempt to get the proxy info
         CFStreamError err;
@@ -2099,7 +2802,7 @@ static Boolean httpRequestCanRead(CFReadStreamRef ourStream, void *info) {
                 _CFNetConnectionLost(req->conn);
 #if !defined(NO_PIPELINING)
             } else {
-                _CFNetConnectionSetShouldPipeline(req->conn, TRUE);
+                enablePipelining(req);
 #endif
             }
         }
@@ -2115,9 +2818,15 @@ static void httpRequestClose(CFReadStreamRef stream, void *info) {
 #if defined(LOG_REQUESTS)
     fprintf(stderr, "httpRequestClose(req = 0x%x)\n", (int)req);
 #endif
+    // Closed before the response finished; report how far it got
+    if (req->metrics) timeResponseEnd(req, req->conn);
     if (req->conn) {
         dequeueFromConnection1(req);
     }
+    if (req->http2Stream) {
+        // Resets the stream if the response is not yet done; the connection stays up for the others
+        closeHTTP2Stream(req);
+    }
     if (req->proxyStream) {
         CFReadStreamClose(req->proxyStream);
         CFRelease(req->proxyStream);
@@ -2132,11 +2841,14 @@ static CFTypeRef httpRequestCopyProperty(CFReadStreamRef stream, CFStringRef pro
     fprintf(stderr, "httpRequestCopyProperty(req = 0x%x)\n", (int)req);
 #endif
     if (CFEqual(propertyName, kCFStreamPropertyHTTPResponseHeader)) {
+        grabHTTP2ResponseHeaders(req);
         property = req->responseHeaders;
         if (property) CFRetain(property);
 	} else if (CFEqual(propertyName, kCFStreamPropertySSLPeerCertificates)) {
 		if (req->peerCertificates)
 			property = CFRetain(req->peerCertificates);
+		else if (req->http2Stream)
+			property = CFReadStreamCopyProperty(req->http2Stream, propertyName);
 		else if (req->conn) {
 			CFReadStreamRef rStream = _CFNetConnectionGetResponseStream(req->conn);
 			if (rStream) {
@@ -2172,6 +2884,18 @@ static CFTypeRef httpRequestCopyProperty(CFReadStreamRef stream, CFStringRef pro
         if (property) CFRetain(property);
     } else if (CFEqual(propertyName, kCFStreamPropertyHTTPRequestBytesWrittenCount)) {
         property = CFNumberCreate(CFGetAllocator(stream), kCFNumberLongLongType, &(req->requestBytesWritten));
+    } else if (CFEqual(propertyName, _kCFStreamPropertyHTTPTimingMetrics)) {
+        property = copyTimingMetrics(CFGetAllocator(stream), req);
+    } else if (CFEqual(propertyName, _kCFStreamPropertyHTTPCollectTimingMetrics)) {
+        property = CFRetain(req->metrics ? kCFBooleanTrue : kCFBooleanFalse);
+    } else if (CFEqual(propertyName, _kCFStreamPropertyHTTPUseResponseCache)) {
+        property = CFRetain(__CFBitIsSet(req->flags, USE_RESPONSE_CACHE) ? kCFBooleanTrue : kCFBooleanFalse);
+    } else if (CFEqual(propertyName, _kCFStreamPropertyHTTPResponseFromCache)) {
+        property = CFRetain(__CFBitIsSet(req->flags, SERVING_CACHED_RESPONSE) ? kCFBooleanTrue : kCFBooleanFalse);
+    } else if (CFEqual(propertyName, _kCFStreamPropertyHTTPUseHTTP2)) {
+        property = CFRetain(__CFBitIsSet(req->flags, USE_HTTP2) ? kCFBooleanTrue : kCFBooleanFalse);
+    } else if (req->http2Stream) {
+        property = CFReadStreamCopyProperty(req->http2Stream, propertyName);
     } else if (req->conn) {
         CFReadStreamRef rStream = _CFNetConnectionGetResponseStream(req->conn);
         if (rStream) {
@@ -2286,6 +3010,41 @@ static Boolean httpRequestSetProperty(CFReadStreamRef stream, CFStringRef proper
         } else {
             return FALSE;
         }
+    } else if (CFEqual(propertyName, _kCFStreamPropertyHTTPCollectTimingMetrics)) {
+        if (propertyValue == kCFBooleanTrue) {
+            if (!http->metrics) http->metrics = createTimingMetrics(CFGetAllocator(stream));
+            return http->metrics ? TRUE : FALSE;
+        } else if (propertyValue == kCFBooleanFalse) {
+            if (http->metrics) {
+                CFAllocatorDeallocate(CFGetAllocator(stream), http->metrics);
+                http->metrics = NULL;
+            }
+            return TRUE;
+        } else {
+            return FALSE;
+        }
+    } else if (CFEqual(propertyName, _kCFStreamPropertyHTTPUseResponseCache)) {
+        if (propertyValue == kCFBooleanTrue) {
+            __CFBitSet(http->flags, USE_RESPONSE_CACHE);
+            return TRUE;
+        } else if (propertyValue == kCFBooleanFalse) {
+            __CFBitClear(http->flags, USE_RESPONSE_CACHE);
+            return TRUE;
+        } else {
+            return FALSE;
+        }
+    } else if (CFEqual(propertyName, _kCFStreamPropertyHTTPResponseFromCache)) {
+        return FALSE;
+    } else if (CFEqual(propertyName, _kCFStreamPropertyHTTPUseHTTP2)) {
+        if (propertyValue == kCFBooleanTrue) {
+            __CFBitSet(http->flags, USE_HTTP2);
+            return TRUE;
+        } else if (propertyValue == kCFBooleanFalse) {
+            __CFBitClear(http->flags, USE_HTTP2);
+            return TRUE;
+        } else {
+            return FALSE;
+        }
     } else if (CFEqual(propertyName, kCFStreamPropertySocketSecurityLevel) ||
                CFEqual(propertyName, kCFStreamPropertyShouldCloseNativeSocket)) {
         // We own these (socket) properties; prevent the client from setting them
@@ -2320,6 +3079,9 @@ static void httpRequestSchedule(CFReadStreamRef stream, CFRunLoopRef runLoop, CF
         if (req->conn) {
             _CFNetConnectionSchedule(req->conn, req, runLoop, runLoopMode);
         }
+        if (req->http2Stream) {
+            CFReadStreamScheduleWithRunLoop(req->http2Stream, runLoop, runLoopMode);
+        }
         if (req->proxyStream) {
             CFReadStreamScheduleWithRunLoop(req->proxyStream, runLoop, runLoopMode);
         }
@@ -2335,6 +3097,9 @@ static void httpRequestUnschedule(CFReadStreamRef stream, CFRunLoopRef runLoop,
         if (req->conn) {
             _CFNetConnectionUnschedule(req->conn, req, runLoop, runLoopMode);
         }
+        if (req->http2Stream) {
+            CFReadStreamUnscheduleFromRunLoop(req->http2Stream, runLoop, runLoopMode);
+        }
         if (req->proxyStream) {
             CFReadStreamUnscheduleFromRunLoop(req->proxyStream, runLoop, runLoopMode);
         }
@@ -2520,7 +3285,10 @@ void httpResponseStreamCallBack(void *theReq, CFReadStreamRef stream, CFStreamEv
         if (isPersistent(req)) {
             _CFNetConnectionLost(req->conn); // This  will do the right thing if the connection had already been "lost" (marked as not persistent) once
         } 
-        if (!__CFBitIsSet(req->flags, IS_ZOMBIE)) {
+        if (__CFBitIsSet(req->flags, SERVING_CACHED_RESPONSE)) {
+            // The connection's end isn't ours; the cached response has yet to be read
+            _CFReadStreamSignalEventDelayed(req->responseStream, kCFStreamEventHasBytesAvailable, NULL);
+        } else if (!__CFBitIsSet(req->flags, IS_ZOMBIE)) {
             _CFReadStreamSignalEventDelayed(req->responseStream, kCFStreamEventEndEncountered, NULL);
         }
         break;
@@ -2589,6 +3357,81 @@ static CFArrayRef httpRunLoopArrayForRequest(void *request, _CFNetConnectionRef
     return _CFReadStreamGetRunLoopsAndModes(req->responseStream);
 }
 
+// Only requests that could safely be sent twice go out behind others; a streamed body can't be sent twice at all
+static Boolean httpRequestIsPipelinable(void *request, _CFNetConnectionRef conn, const void* info) {
+    _CFHTTPRequest *req = (_CFHTTPRequest *)request;
+    if (__CFBitIsSet(req->flags, HAS_PAYLOAD) && !__CFBitIsSet(req->flags, PAYLOAD_IS_DATA)) return FALSE;
+    return _CFHTTPMessageIsIdempotentMethod(req->currentRequest ? req->currentRequest : req->originalRequest);
+}
+
+static CFStringRef copyPipeliningBlacklistHost(CFStringRef host) {
+    CFMutableStringRef result = CFStringCreateMutableCopy(kCFAllocatorDefault, 0, host);
+    if (result) CFStringLowercase(result, NULL);
+    return result;
+}
+
+static void blacklistPipelining(CFStringRef host) {
+    CFStringRef key;
+    if (!host || !(key = copyPipeliningBlacklistHost(host))) return;
+    __CFSpinLock(&pipeliningBlacklistLock);
+    if (!pipeliningBlacklist) {
+        pipeliningBlacklist = CFSetCreateMutable(kCFAllocatorDefault, 0, &kCFTypeSetCallBacks);
+    }
+    if (pipeliningBlacklist) {
+        CFSetAddValue(pipeliningBlacklist, key);
+    }
+    __CFSpinUnlock(&pipeliningBlacklistLock);
+    CFRelease(key);
+}
+
+static Boolean isPipeliningBlacklisted(CFStringRef host) {
+    CFStringRef key;
+    Boolean result = FALSE;
+    if (!host || !(key = copyPipeliningBlacklistHost(host))) return FALSE;
+    __CFSpinLock(&pipeliningBlacklistLock);
+    result = pipeliningBlacklist && CFSetContainsValue(pipeliningBlacklist, key);
+    __CFSpinUnlock(&pipeliningBlacklistLock);
+    CFRelease(key);
+    return result;
+}
+
+static Boolean serverMishandlesPipelining(CFHTTPMessageRef responseHeaders) {
+    CFStringRef server = responseHeaders ? CFHTTPMessageCopyHeaderFieldValue(responseHeaders, _kCFHTTPStreamServerHeader) : NULL;
+    Boolean result = FALSE;
+    if (server) {
+        char buffer[64];
+        CFIndex length = 0;
+        int i;
+        // The prefixes are short, so the start of the header is all that needs comparing
+        CFStringGetBytes(server, CFRangeMake(0, CFStringGetLength(server)), kCFStringEncodingASCII, '?', FALSE, (UInt8 *)buffer, sizeof(buffer) - 1, &length);
+        buffer[length] = '\0';
+        for (i = 0; !result && i < (sizeof(kHTTPPipeliningBrokenServers) / sizeof(kHTTPPipeliningBrokenServers[0])); i++) {
+            result = (strncmp(buffer, kHTTPPipeliningBrokenServers[i], strlen(kHTTPPipeliningBrokenServers[i])) == 0);
+        }
+        CFRelease(server);
+    }
+    return result;
+}
+
+// Called once a persistent connection's response shows it will stay open
+static void enablePipelining(_CFHTTPRequest *req) {
+    CFStringRef host;
+    SInt32 port;
+    UInt32 connType;
+    CFDictionaryRef properties;
+    CFIndex maxDepth = httpMaxPipelineDepth;
+    
+    if (maxDepth == 1) return;
+    
+    getValuesFromKey((_CFNetConnectionCacheKey)_CFNetConnectionGetInfoPointer(req->conn), &host, &port, &connType, &properties);
+    if (serverMishandlesPipelining(req->responseHeaders)) {
+        blacklistPipelining(host);
+    } else if (!isPipeliningBlacklisted(host)) {
+        _CFNetConnectionSetMaxPipelineDepth(req->conn, maxDepth);
+        _CFNetConnectionSetShouldPipeline(req->conn, TRUE);
+    }
+}
+
 
 CF_EXPORT
 CFReadStreamRef CFReadStreamCreateForHTTPRequest(CFAllocatorRef alloc, CFHTTPMessageRef request) {
@@ -2642,6 +3485,69 @@ void CFHTTPReadStreamSetProxy(CFReadStreamRef stream, CFStringRef proxyHost, CFI
     }
 }
 
+/* extern */ void
+_CFHTTPStreamSetConnectionCacheLimits(CFIndex maxPerHost, CFIndex maxTotal, CFTimeInterval idleTimeout) {
+    setConnectionCacheLimits(getConnectionCache(), maxPerHost, maxTotal, idleTimeout);
+}
+
+/* extern */ void
+_CFHTTPStreamSetMaxPipelineDepth(CFIndex maxDepth) {
+    httpMaxPipelineDepth = maxDepth;
+}
+
+/* extern */ void
+_CFHTTPStreamSetPipeliningBlacklisted(CFStringRef host, Boolean blacklisted) {
+    if (blacklisted) {
+        blacklistPipelining(host);
+    } else {
+        CFStringRef key = copyPipeliningBlacklistHost(host);
+        if (key) {
+            __CFSpinLock(&pipeliningBlacklistLock);
+            if (pipeliningBlacklist) {
+                CFSetRemoveValue(pipeliningBlacklist, key);
+            }
+            __CFSpinUnlock(&pipeliningBlacklistLock);
+            CFRelease(key);
+        }
+    }
+}
+
+/* extern */ void
+_CFHTTPStreamSetTimingMetricsCallBack(_CFHTTPStreamTimingMetricsCallBack callback, void *info) {
+    __CFSpinLock(&timingMetricsLock);
+    timingMetricsCallBack = callback;
+    timingMetricsInfo = callback ? info : NULL;
+    __CFSpinUnlock(&timingMetricsLock);
+}
+
+/* extern */ CFDictionaryRef
+_CFHTTPStreamCopyConnectionCacheStatistics(CFAllocatorRef alloc) {
+    _CFNetConnectionCacheStatistics stats;
+    CFStringRef keys[] = {
+        _kCFHTTPStreamConnectionCacheHits,
+        _kCFHTTPStreamConnectionCacheMisses,
+        _kCFHTTPStreamConnectionCacheEvictions,
+        _kCFHTTPStreamConnectionCacheWaits
+    };
+    CFNumberRef values[sizeof(keys) / sizeof(keys[0])];
+    CFDictionaryRef result;
+    int i;
+
+    getConnectionCacheStatistics(getConnectionCache(), &stats);
+
+    values[0] = CFNumberCreate(alloc, kCFNumberCFIndexType, &stats.hits);
+    values[1] = CFNumberCreate(alloc, kCFNumberCFIndexType, &stats.misses);
+    values[2] = CFNumberCreate(alloc, kCFNumberCFIndexType, &stats.evictions);
+    values[3] = CFNumberCreate(alloc, kCFNumberCFIndexType, &stats.waits);
+
+    result = CFDictionaryCreate(alloc, (const void **)keys, (const void **)values, sizeof(keys) / sizeof(keys[0]), &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+
+    for (i = 0; i < (sizeof(values) / sizeof(values[0])); i++)
+        CFRelease(values[i]);
+
+    return result;
+}
+
 #if defined(__WIN32__)
 extern void _CFHTTPStreamCleanup(void) {
     __CFSpinLock(&cacheInitLock);
@@ -100,6 +100,271 @@ extern const CFStringRef _kCFStreamPropertyFTPRemoveResource         AVAILABLE_M
  */
 extern const CFStringRef _kCFStreamPropertyFTPNewResourceName        AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
 
+/*
+ *  _kCFStreamPropertyFTPSegmentDestination
+ *  
+ *  Discussion:
+ *    Stream property key, for both set and copy operations, on streams
+ *    created by _CFReadStreamCreateWithFTPURLSegments.  CFURL type
+ *    giving a file URL to which the segments are written directly, at
+ *    their offsets, as they arrive.  If set, the stream returns no
+ *    bytes from reads and simply ends once every segment has been
+ *    written.  Must be set before the stream is opened.
+ *  
+ */
+extern const CFStringRef _kCFStreamPropertyFTPSegmentDestination     AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFReadStreamCreateWithFTPURLSegments()
+ *  
+ *  Discussion:
+ *    Create a read stream which downloads the file at an FTP URL over
+ *    up to segmentCount control and data connection pairs at once,
+ *    each retrieving its own byte range using REST.  The first
+ *    connection asks for the size of the file; once it is known, the
+ *    rest of the file is divided among the others.  A file whose size
+ *    can not be found, or which is too small to be worth dividing, is
+ *    retrieved over the first connection alone.  A segment which
+ *    fails is restarted from where it stopped, a few times, before
+ *    the stream reports the error.
+ *    
+ *    The segments are reassembled in a temporary file and read back
+ *    in order, unless _kCFStreamPropertyFTPSegmentDestination is set.
+ *    Any other property set before the stream is opened is set on
+ *    each segment's stream.  kCFStreamPropertyFTPResourceSize may be
+ *    copied once the size is known.  The stream must be scheduled on
+ *    a run loop before it is opened.
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ *  Parameters:
+ *    
+ *    alloc:
+ *      A pointer to the CFAllocator which should be used to allocate
+ *      memory for the CF read stream and its storage for values.
+ *    
+ *    ftpURL:
+ *      The FTP URL of the file to retrieve.
+ *    
+ *    segmentCount:
+ *      The largest number of connections to use at once.
+ *  
+ *  Result:
+ *    The read stream created, or NULL if failed.
+ *  
+ */
+extern CFReadStreamRef
+_CFReadStreamCreateWithFTPURLSegments(CFAllocatorRef alloc, CFURLRef ftpURL, CFIndex segmentCount) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFFTPListingRef
+ *  
+ *  Discussion:
+ *    A directory listing parsed in bulk.  The entries are kept as an
+ *    array of _CFFTPListingEntry structures rather than dictionaries;
+ *    owner and group names are stored once each however many entries
+ *    share them.  A dictionary like those made by
+ *    CFFTPCreateParsedResourceListing is only made for an entry when
+ *    asked for.
+ *  
+ */
+typedef struct __CFFTPListing*  _CFFTPListingRef;
+
+/*
+ *  _CFFTPListingFormat
+ *  
+ *  Discussion:
+ *    The listing formats understood.  _kCFFTPListingFormatUnknown asks
+ *    for the format to be worked out from the first entry.
+ *  
+ */
+enum {
+  _kCFFTPListingFormatUnknown   = 0,    /* Detect the format */
+  _kCFFTPListingFormatUnix      = 1,    /* "ls -l" style LIST output */
+  _kCFFTPListingFormatDOS       = 2,    /* DOS or IIS style LIST output */
+  _kCFFTPListingFormatMLSD      = 3     /* RFC 3659 MLSD output */
+};
+typedef UInt32 _CFFTPListingFormat;
+
+/*
+ *  _CFFTPListingEntry flags
+ *  
+ *  Discussion:
+ *    Which of the optional fields of a _CFFTPListingEntry were given
+ *    by the server.
+ *  
+ */
+enum {
+  _kCFFTPListingEntryHasMode    = 0x01,
+  _kCFFTPListingEntryHasSize    = 0x02,
+  _kCFFTPListingEntryHasModDate = 0x04
+};
+
+/*
+ *  _CFFTPListingEntry
+ *  
+ *  Discussion:
+ *    One entry of a _CFFTPListingRef.  The name and link are offsets
+ *    into the bytes returned by _CFFTPListingGetBytes; they are not
+ *    NUL terminated.  The owner and group are indexes for
+ *    _CFFTPListingGetUserName, or -1 if not given.  The type is one
+ *    of the DT_* values of <dirent.h>, as with kCFFTPResourceType.
+ *  
+ */
+typedef struct {
+  UInt32            name;
+  UInt32            nameLength;
+  UInt32            link;
+  UInt32            linkLength;         /* 0 if not a link */
+  SInt32            owner;
+  SInt32            group;
+  UInt64            size;
+  CFAbsoluteTime    modDate;
+  UInt16            mode;
+  UInt8             type;
+  UInt8             flags;
+} _CFFTPListingEntry;
+
+/*
+ *  _CFFTPListingGetTypeID()
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ */
+extern CFTypeID
+_CFFTPListingGetTypeID(void) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFFTPListingCreate()
+ *  
+ *  Discussion:
+ *    Create an empty listing, to which the output of LIST or MLSD is
+ *    given with _CFFTPListingAppendBytes as it arrives.
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ *  Parameters:
+ *    
+ *    alloc:
+ *      The CFAllocator to use for the listing and its entries.
+ *    
+ *    format:
+ *      The format of the listing, or _kCFFTPListingFormatUnknown.
+ *  
+ *  Result:
+ *    The listing created, or NULL if failed.
+ *  
+ */
+extern _CFFTPListingRef
+_CFFTPListingCreate(CFAllocatorRef alloc, _CFFTPListingFormat format) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFFTPListingCreateWithBytes()
+ *  
+ *  Discussion:
+ *    Create a listing from the entire output of LIST or MLSD, parsed
+ *    in one pass.  A last line without a line ending is parsed too.
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ *  Result:
+ *    The listing created, or NULL if failed.
+ *  
+ */
+extern _CFFTPListingRef
+_CFFTPListingCreateWithBytes(CFAllocatorRef alloc, const UInt8* bytes, CFIndex length, _CFFTPListingFormat format) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFFTPListingAppendBytes()
+ *  
+ *  Discussion:
+ *    Parse the next part of a listing.  Bytes need not end on a line
+ *    boundary; a partial last line is held until the rest of it is
+ *    appended, or until atEnd is TRUE.  Pointers returned by
+ *    _CFFTPListingGetEntries and _CFFTPListingGetBytes are no longer
+ *    valid afterwards.
+ *  
+ *  Mac OS X threading:
+ *    Not thread safe
+ *  
+ *  Result:
+ *    The number of entries added.
+ *  
+ */
+extern CFIndex
+_CFFTPListingAppendBytes(_CFFTPListingRef listing, const UInt8* bytes, CFIndex length, Boolean atEnd) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFFTPListingGetFormat()
+ *  
+ *  Discussion:
+ *    Returns the format of the listing, or _kCFFTPListingFormatUnknown
+ *    if it has not yet been detected.
+ *  
+ */
+extern _CFFTPListingFormat
+_CFFTPListingGetFormat(_CFFTPListingRef listing) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFFTPListingGetCount()
+ *  
+ *  Discussion:
+ *    Returns the number of entries in the listing.
+ *  
+ */
+extern CFIndex
+_CFFTPListingGetCount(_CFFTPListingRef listing) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFFTPListingGetEntries()
+ *  
+ *  Discussion:
+ *    Returns the listing's entries, in the order listed.
+ *  
+ */
+extern const _CFFTPListingEntry*
+_CFFTPListingGetEntries(_CFFTPListingRef listing) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFFTPListingGetBytes()
+ *  
+ *  Discussion:
+ *    Returns the bytes to which entry names and links are offsets.
+ *  
+ */
+extern const UInt8*
+_CFFTPListingGetBytes(_CFFTPListingRef listing) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFFTPListingGetUserName()
+ *  
+ *  Discussion:
+ *    Returns the owner or group name for an index from an entry, or
+ *    NULL if the index is -1 or out of range.  The string belongs to
+ *    the listing.
+ *  
+ */
+extern CFStringRef
+_CFFTPListingGetUserName(_CFFTPListingRef listing, SInt32 user) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFFTPListingCopyResourceInfo()
+ *  
+ *  Discussion:
+ *    Create a dictionary for an entry with the same keys as one from
+ *    CFFTPCreateParsedResourceListing.
+ *  
+ *  Result:
+ *    The dictionary created, or NULL if the index is out of range.
+ *  
+ */
+extern CFDictionaryRef
+_CFFTPListingCopyResourceInfo(_CFFTPListingRef listing, CFIndex index) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
 #if PRAGMA_ENUM_ALWAYSINT
     #pragma enumsalwaysint reset
 #endif
@@ -103,7 +103,20 @@ enum _CFHTTPConnectionType {
    * A connection to an HTTPS proxy
    */
   kHTTPSProxy                   = 3,
-  kSOCKSProxy                   = 4
+  kSOCKSProxy                   = 4,
+
+  /*
+   * A direct HTTPS connection to the server, speaking HTTP/2 once the
+   * server has chosen it by ALPN.  Requests are multiplexed over the
+   * one connection rather than queued.
+   */
+  kHTTP2                        = 5,
+
+  /*
+   * A direct HTTP/2 connection to the server without SSL, for servers
+   * known beforehand to speak HTTP/2
+   */
+  kHTTP2Cleartext               = 6
 };
 typedef enum _CFHTTPConnectionType _CFHTTPConnectionType;
 
@@ -130,6 +143,29 @@ typedef CFTypeRef                       CFHTTPConnectionRef;
  *  
  */
 extern const SInt32 kCFStreamErrorHTTPConnectionLost                 AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+/*
+ *  kCFStreamErrorHTTP2NotNegotiated
+ *  
+ *  Discussion:
+ *    The error in the domain kCFStreamErrorDomainHTTP returned by
+ *    requests on a kHTTP2 connection whose server did not choose
+ *    HTTP/2 by ALPN.  The requests were not sent; they may be sent
+ *    again over a kHTTPS connection.
+ *  
+ */
+extern const SInt32 kCFStreamErrorHTTP2NotNegotiated                 AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+/*
+ *  kCFStreamErrorHTTP2StreamReset
+ *  
+ *  Discussion:
+ *    The error in the domain kCFStreamErrorDomainHTTP returned when a
+ *    request on an HTTP/2 connection was reset, by the server or
+ *    because either end broke the protocol.  Requests the server
+ *    refused without processing, or which were cut off by the server
+ *    going away, get kCFStreamErrorHTTPConnectionLost instead.
+ *  
+ */
+extern const SInt32 kCFStreamErrorHTTP2StreamReset                   AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
 /*
  *  _kCFStreamPropertyHTTPConnection
  *  
@@ -263,6 +299,35 @@ CFHTTPConnectionSetShouldPipeline(
   Boolean               shouldPipeline)                       AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
 
 
+/*
+ *  CFHTTPConnectionSetMaxPipelineDepth()
+ *  
+ *  Discussion:
+ *    Sets how many requests a pipelining connection may have sent
+ *    and still awaiting their responses before it holds back the
+ *    next. Requests with non-idempotent methods, or with a body
+ *    stream, are never pipelined: they wait for every earlier
+ *    response, and later requests wait for theirs.  On an HTTP/2
+ *    connection, where every request is sent at once, this limits
+ *    how many may be in progress, below whatever limit the server
+ *    sets.
+ *  
+ *  Parameters:
+ *    
+ *    connection:
+ *      The connection to be configured
+ *    
+ *    maxDepth:
+ *      The most requests awaiting responses at once; 0, the default,
+ *      for no limit
+ *  
+ */
+extern void 
+CFHTTPConnectionSetMaxPipelineDepth(
+  CFHTTPConnectionRef   connection,
+  CFIndex               maxDepth)                             AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
 /*
  *  CFHTTPConnectionLost()
  *  
@@ -358,6 +358,28 @@ _CFHTTPMessageCanRetry(CFHTTPMessageRef response)             AVAILABLE_MAC_OS_X
 
 
 
+/*
+ *  _CFHTTPAuthenticationFlushCache()
+ *  
+ *  Discussion:
+ *    Empties the process-wide authentication cache.  Once a server or
+ *    proxy accepts credentials applied through a
+ *    CFHTTPAuthenticationRef, HTTP streams apply them to later
+ *    requests in the same protection space (scheme, host, port,
+ *    realm and whether it is for a proxy) before sending them, rather
+ *    than waiting for a 401 or 407.  Call this when those credentials
+ *    should no longer be sent, such as when the user logs out.
+ *    Requests which already carry authentication are not affected.
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ */
+extern void 
+_CFHTTPAuthenticationFlushCache(void)                           AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+
 
 
 /*
@@ -514,6 +536,82 @@ _CFStringCreateRFC2616DateStringWithGregorianDate(
 
 
 
+/*
+ *  _CFHTTPArenaCreate()
+ *  
+ *  Discussion:
+ *    Creates an allocator which hands out memory from chunks taken
+ *    from backing and gives none of it back until the allocator is
+ *    deallocated, when all of the chunks are freed at once.  A
+ *    message created with it makes its headers, strings and data with
+ *    it as well, all of which retain it, so the allocator lasts until
+ *    the message and everything copied from it are released.  The
+ *    caller should release its own reference once the message is
+ *    made.  Blocks too large for the chunks are allocated from backing
+ *    individually and freed when deallocated.
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ *  Parameters:
+ *    
+ *    backing:
+ *      The allocator the chunks are taken from, or NULL for the
+ *      default allocator.
+ *    
+ *    chunkSize:
+ *      The size of each chunk, or zero for the default of 4096 bytes.
+ *  
+ *  Result:
+ *    The new allocator, or NULL if it could not be created.
+ *  
+ */
+extern CFAllocatorRef 
+_CFHTTPArenaCreate(
+  CFAllocatorRef   backing,
+  CFIndex          chunkSize)                                 AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+
+/*
+ *  _CFHTTPArenaStatistics
+ *  
+ *  Discussion:
+ *    What an arena has done since it was created.  allocations counts
+ *    the blocks handed out and backingAllocations the requests made
+ *    of the backing allocator for them.  chunks is the number of
+ *    chunks taken and bytesReserved the bytes now held from the
+ *    backing allocator, not counting bookkeeping.
+ *  
+ */
+typedef struct {
+  CFIndex             allocations;
+  CFIndex             backingAllocations;
+  CFIndex             chunks;
+  CFIndex             bytesReserved;
+} _CFHTTPArenaStatistics;
+
+
+/*
+ *  _CFHTTPArenaGetStatistics()
+ *  
+ *  Discussion:
+ *    Fills in stats for an allocator made by _CFHTTPArenaCreate.
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ *  Result:
+ *    FALSE, leaving stats untouched, if allocator is not an arena.
+ *  
+ */
+extern Boolean 
+_CFHTTPArenaGetStatistics(
+  CFAllocatorRef            allocator,
+  _CFHTTPArenaStatistics *  stats)                            AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+
 #if PRAGMA_ENUM_ALWAYSINT
     #pragma enumsalwaysint reset
 #endif
@@ -396,6 +396,45 @@ _CFHTTPServerCreate(
   _CFHTTPServerContext *          context)                    AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
 
 
+/*
+ *  _CFHTTPServerSetWorkerCount()
+ *  
+ *  Discussion:
+ *    Sets the number of worker threads which service the server's
+ *    connections.  With no workers, the default, connections are
+ *    serviced on the run loop on which the server was started.
+ *    Otherwise, the server spawns the given number of threads, each
+ *    running its own run loop, and hands new connections to them in
+ *    turn.  Connections are always accepted on the run loop on which
+ *    the server was started, so the accept new connection callback
+ *    is invoked there.  All other callbacks for a connection are
+ *    invoked on its worker's thread, concurrently with those for
+ *    connections on other workers.
+ *  
+ *  Mac OS X threading:
+ *    Not thread safe
+ *  
+ *  Parameters:
+ *    
+ *    server:
+ *      The server being configured.  Must be non-NULL. If this
+ *      reference is not a valid _CFHTTPServerRef, the behavior is
+ *      undefined.
+ *    
+ *    count:
+ *      The number of worker threads, or zero for none.
+ *  
+ *  Result:
+ *    Returns TRUE if the count was set.  It returns FALSE if the
+ *    server has already been started or the count is negative.
+ *  
+ */
+extern Boolean 
+_CFHTTPServerSetWorkerCount(
+  _CFHTTPServerRef   server,
+  CFIndex            count)                                   AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
 /*
  *  _CFHTTPServerStart()
  *  
@@ -552,6 +591,10 @@ _CFHTTPServerAddResponse(
  *  Discussion:
  *    Adds the given response headers and body for the request to the
  *    server.  Only one response should be added per individual request.
+ *    If the headers give neither a content length nor a transfer
+ *    encoding, the body is sent chunked when both the request and
+ *    the response are HTTP/1.1.  Otherwise the connection is closed
+ *    after the body is sent.
  *  
  *  Mac OS X threading:
  *    Thread safe
@@ -583,6 +626,50 @@ _CFHTTPServerAddStreamedResponse(
   CFReadStreamRef    body)                                    AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
 
 
+/*
+ *  _CFHTTPServerAddFileResponse()
+ *  
+ *  Discussion:
+ *    Adds the given response headers for the request to the server,
+ *    with the contents of the given file as the body.  Only one
+ *    response should be added per individual request.  The content
+ *    length is set to the size of the file when added.  The file is
+ *    not opened until the response is sent, and is then written
+ *    straight to the connection, using sendfile where available.
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ *  Parameters:
+ *    
+ *    server:
+ *      The server on which the request was received.  Must be
+ *      non-NULL.  If this reference is not a valid _CFHTTPServerRef,
+ *      the behavior is undefined.
+ *    
+ *    request:
+ *      The request which was received and for which the response being
+ *      added corresponds.
+ *    
+ *    responseHeaders:
+ *      The headers for the response being added.
+ *    
+ *    file:
+ *      A file URL to the regular file holding the response's body.
+ *  
+ *  Result:
+ *    TRUE if the response was added, or FALSE if the file is not a
+ *    regular file which could be found.
+ *  
+ */
+extern Boolean 
+_CFHTTPServerAddFileResponse(
+  _CFHTTPServerRef   server,
+  CFHTTPMessageRef   request,
+  CFHTTPMessageRef   responseHeaders,
+  CFURLRef           file)                                    AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
 
 #if PRAGMA_ENUM_ALWAYSINT
     #pragma enumsalwaysint reset
@@ -114,6 +114,341 @@ extern const CFStringRef _kCFStreamPropertyHTTPZeroLengthResponseExpected AVAILA
 extern const CFStringRef _kCFStreamPropertyHTTPProxyProxyAutoConfigURLString AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
 extern const CFStringRef _kCFStreamPropertyHTTPProxyProxyAutoConfigEnable AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
 
+
+/*
+ *  _CFHTTPStreamSetConnectionCacheLimits()
+ *  
+ *  Discussion:
+ *    Sets the limits on the pool of persistent connections shared by
+ *    all HTTP streams: the most connections open to any one host, the
+ *    most open in all, and how long a connection may sit idle before
+ *    it is closed.  A limit of zero or less means no limit; an idle
+ *    timeout of zero or less closes connections as soon as their last
+ *    request completes.  When a host is at its limit, new requests
+ *    wait in line on its connection with the shortest queue.  The
+ *    defaults are 6 per host, 32 in all and 15 seconds.
+ *  
+ */
+extern void 
+_CFHTTPStreamSetConnectionCacheLimits(
+  CFIndex          maxPerHost,
+  CFIndex          maxTotal,
+  CFTimeInterval   idleTimeout)                               AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+
+/*
+ *  _CFHTTPStreamCopyConnectionCacheStatistics()
+ *  
+ *  Discussion:
+ *    Returns a dictionary of CFNumbers counting, since the first HTTP
+ *    stream was opened, the requests that reused a pooled connection
+ *    (_kCFHTTPStreamConnectionCacheHits), that opened a new one
+ *    (_kCFHTTPStreamConnectionCacheMisses), and that waited behind
+ *    others on a busy one (_kCFHTTPStreamConnectionCacheWaits), and
+ *    the idle connections closed for room or for the idle timeout
+ *    (_kCFHTTPStreamConnectionCacheEvictions).
+ *  
+ */
+extern CFDictionaryRef 
+_CFHTTPStreamCopyConnectionCacheStatistics(CFAllocatorRef alloc) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+/*
+ *  _CFHTTPStreamSetMaxPipelineDepth()
+ *  
+ *  Discussion:
+ *    Sets how many requests an HTTP stream connection may have sent
+ *    and still awaiting responses once it is pipelining.  Zero means
+ *    no limit and one turns pipelining off; the default is 4.  Only
+ *    idempotent requests without a streamed body are pipelined, and
+ *    those are sent again on a new connection, up to three times, if
+ *    their connection dies before answering them.
+ *  
+ */
+extern void 
+_CFHTTPStreamSetMaxPipelineDepth(CFIndex maxDepth)           AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+
+/*
+ *  _CFHTTPStreamSetPipeliningBlacklisted()
+ *  
+ *  Discussion:
+ *    Adds or removes a host from the set never pipelined to.  Hosts
+ *    are added on their own when a connection fails with pipelined
+ *    requests outstanding, or when the response's Server header names
+ *    a server known to mishandle pipelining.
+ *  
+ */
+extern void 
+_CFHTTPStreamSetPipeliningBlacklisted(
+  CFStringRef   host,
+  Boolean       blacklisted)                                  AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+extern const CFStringRef _kCFHTTPStreamConnectionCacheHits           AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPStreamConnectionCacheMisses         AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPStreamConnectionCacheEvictions      AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPStreamConnectionCacheWaits          AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+/*
+ *  _kCFStreamPropertyHTTPDecodeContentEncoding
+ *  
+ *  Discussion:
+ *    Stream property key, a CFBoolean.  When true, an HTTP stream asks
+ *    for compressed responses with "Accept-Encoding: gzip, deflate"
+ *    (unless the request already carries an Accept-Encoding header)
+ *    and inflates bodies sent with either Content-Encoding as they
+ *    are read, without buffering the whole body.  The response's
+ *    Content-Encoding and Content-Length headers are left as sent.
+ *    Setting it fails if CFNetwork was built without zlib.
+ *  
+ */
+extern const CFStringRef _kCFStreamPropertyHTTPDecodeContentEncoding AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+/*
+ *  _kCFStreamPropertyHTTPEncodedBodyBytes
+ *  
+ *  Discussion:
+ *    Stream property key, a read-only CFNumber (long long).  The
+ *    number of body bytes of the current response read from the
+ *    connection so far, after removing any chunked framing.
+ *  
+ */
+extern const CFStringRef _kCFStreamPropertyHTTPEncodedBodyBytes      AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+/*
+ *  _kCFStreamPropertyHTTPDecodedBodyBytes
+ *  
+ *  Discussion:
+ *    Stream property key, a read-only CFNumber (long long).  The
+ *    number of body bytes of the current response returned to the
+ *    client so far.  It differs from the encoded count only for a
+ *    body being decoded (see _kCFStreamPropertyHTTPDecodeContentEncoding).
+ *  
+ */
+extern const CFStringRef _kCFStreamPropertyHTTPDecodedBodyBytes      AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+/*
+ *  _kCFStreamPropertyHTTPCollectTimingMetrics
+ *  
+ *  Discussion:
+ *    Stream property key, a CFBoolean set before the stream is opened.
+ *    When true, the stream records when each phase of its request
+ *    happens, for _kCFStreamPropertyHTTPTimingMetrics.  Streams also
+ *    record them while a timing metrics callback is installed (see
+ *    _CFHTTPStreamSetTimingMetricsCallBack); otherwise nothing is
+ *    recorded.
+ *  
+ */
+extern const CFStringRef _kCFStreamPropertyHTTPCollectTimingMetrics  AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+/*
+ *  _kCFStreamPropertyHTTPTimingMetrics
+ *  
+ *  Discussion:
+ *    Stream property key, a read-only CFDictionary, or NULL if the
+ *    stream is not recording timing metrics.  Times are CFNumbers
+ *    (double) in seconds on a monotonic clock; only the differences
+ *    between them are meaningful.  The fetch start is when the stream
+ *    was opened.  The rest describe the last request sent, after any
+ *    redirection or retry: when it was queued on a connection, when
+ *    it began and finished transmitting, when its response headers
+ *    were read and when its response was finished or failed.  On a
+ *    new connection, the host lookup, connect and SSL handshake times
+ *    are included where those happened; they are left out when the
+ *    request reused a connection (_kCFHTTPTimingMetricsConnectionReused
+ *    is a CFBoolean).  The byte counts (CFNumbers, SInt64) are those
+ *    the connection sent and received while the request was on it,
+ *    not counting SSL overhead, so they include any requests pipelined
+ *    alongside it.
+ *    Phases which have not happened are absent.
+ *  
+ */
+extern const CFStringRef _kCFStreamPropertyHTTPTimingMetrics         AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+extern const CFStringRef _kCFHTTPTimingMetricsFetchStart              AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPTimingMetricsDomainLookupStart       AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPTimingMetricsDomainLookupEnd         AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPTimingMetricsConnectStart            AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPTimingMetricsConnectEnd              AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPTimingMetricsSecureConnectionStart   AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPTimingMetricsSecureConnectionEnd     AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPTimingMetricsQueueStart              AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPTimingMetricsRequestStart            AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPTimingMetricsRequestEnd              AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPTimingMetricsResponseStart           AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPTimingMetricsResponseEnd             AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPTimingMetricsConnectionReused        AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPTimingMetricsBytesSent               AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPTimingMetricsBytesReceived           AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+/*
+ *  _CFHTTPStreamTimingMetricsCallBack
+ *  
+ *  Discussion:
+ *    Called once for each HTTP stream recording timing metrics, when
+ *    its response has been read or has failed, or when it is closed
+ *    first.  metrics is the stream's _kCFStreamPropertyHTTPTimingMetrics
+ *    dictionary.  It is called on whichever thread finished the
+ *    stream, so it must be thread safe and should be quick.
+ *  
+ */
+typedef void (*_CFHTTPStreamTimingMetricsCallBack)(CFReadStreamRef stream, CFDictionaryRef metrics, void* info);
+
+
+/*
+ *  _CFHTTPStreamSetTimingMetricsCallBack()
+ *  
+ *  Discussion:
+ *    Installs a process-wide callback to receive the timing metrics of
+ *    every HTTP stream opened from now on, or removes it if callback
+ *    is NULL.  While none is installed, streams not asked for timing
+ *    metrics record nothing.
+ *  
+ */
+extern void 
+_CFHTTPStreamSetTimingMetricsCallBack(
+  _CFHTTPStreamTimingMetricsCallBack   callback,
+  void*                                info)                  AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+/*
+ *  _kCFStreamPropertyHTTPUseResponseCache
+ *  
+ *  Discussion:
+ *    Stream property key, a CFBoolean set before the stream is opened.
+ *    When true, the stream answers its request from the process-wide
+ *    response cache if it holds a fresh response for it, without
+ *    connecting to the server.  If the cached response is stale but
+ *    has an ETag or Last-Modified header, the request is sent with
+ *    If-None-Match or If-Modified-Since, and a 304 answer is read as
+ *    the cached response, with its headers updated.  Otherwise the
+ *    response is read from the server and, for a GET which RFC 7234
+ *    allows to be cached, stored once it has been read to the end.
+ *    Responses with a Content-Encoding are not stored.
+ *  
+ */
+extern const CFStringRef _kCFStreamPropertyHTTPUseResponseCache      AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+/*
+ *  _kCFStreamPropertyHTTPResponseFromCache
+ *  
+ *  Discussion:
+ *    Stream property key, a read-only CFBoolean.  True once the
+ *    response headers are available if the response is being read
+ *    from the response cache, whether or not the server was asked to
+ *    validate it.
+ *  
+ */
+extern const CFStringRef _kCFStreamPropertyHTTPResponseFromCache     AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+/*
+ *  _CFHTTPStreamSetResponseCacheLimits()
+ *  
+ *  Discussion:
+ *    Sets how many bytes of responses the response cache may keep in
+ *    memory and on disk, and the directory it keeps them in on disk.
+ *    A capacity of zero or less turns that tier off; a NULL directory
+ *    turns the disk tier off, leaving its files in place.  A directory
+ *    is created if need be, and the responses already in it are used
+ *    from then on.  It must not be shared with other processes.  No
+ *    response is kept in a tier if it would take more than an eighth
+ *    of the tier.  The defaults are 4 MB in memory and no disk tier.
+ *  
+ */
+extern void 
+_CFHTTPStreamSetResponseCacheLimits(
+  CFIndex    memoryCapacity,
+  CFIndex    diskCapacity,
+  CFURLRef   directory)                                       AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+
+/*
+ *  _CFHTTPStreamRemoveAllCachedResponses()
+ *  
+ *  Discussion:
+ *    Empties the response cache, in memory and on disk.
+ *  
+ */
+extern void 
+_CFHTTPStreamRemoveAllCachedResponses(void)                  AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+
+/*
+ *  _CFHTTPStreamCopyResponseCacheStatistics()
+ *  
+ *  Discussion:
+ *    Returns a dictionary of CFNumbers counting, since the response
+ *    cache was first used, the lookups answered without the server
+ *    (_kCFHTTPStreamResponseCacheHits) and those which were not
+ *    (_kCFHTTPStreamResponseCacheMisses), the stale responses the
+ *    server validated (_kCFHTTPStreamResponseCacheRevalidations), the
+ *    responses stored (_kCFHTTPStreamResponseCacheStores) and those
+ *    dropped from a tier for room (_kCFHTTPStreamResponseCacheEvictions),
+ *    along with the bytes the cache now holds in memory
+ *    (_kCFHTTPStreamResponseCacheMemoryUsage) and on disk
+ *    (_kCFHTTPStreamResponseCacheDiskUsage).
+ *  
+ */
+extern CFDictionaryRef 
+_CFHTTPStreamCopyResponseCacheStatistics(CFAllocatorRef alloc) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+extern const CFStringRef _kCFHTTPStreamResponseCacheHits             AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPStreamResponseCacheMisses           AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPStreamResponseCacheRevalidations    AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPStreamResponseCacheStores           AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPStreamResponseCacheEvictions        AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPStreamResponseCacheMemoryUsage      AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+extern const CFStringRef _kCFHTTPStreamResponseCacheDiskUsage        AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+/*
+ *  _kCFStreamPropertyHTTPUseArena
+ *  
+ *  Discussion:
+ *    Stream property key, a CFBoolean set before the stream is opened.
+ *    When true, each response is parsed into a message created with
+ *    its own arena (see _CFHTTPArenaCreate), so that its headers and
+ *    body buffers are freed together when the response is released.
+ *    The arena is kept for as long as anything made from the response
+ *    is, such as header values copied from it.
+ *  
+ */
+extern const CFStringRef _kCFStreamPropertyHTTPUseArena              AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+/*
+ *  _kCFStreamPropertyHTTPUseHTTP2
+ *  
+ *  Discussion:
+ *    Stream property key, a CFBoolean set before the stream is opened.
+ *    When true, an https request is sent over HTTP/2 on a connection
+ *    shared with every other such request to the same server, if the
+ *    server agrees to it by ALPN.  Requests which need what only the
+ *    HTTP/1.1 path does are sent that way as before: those through a
+ *    proxy, with automatic redirection, with a body stream, using the
+ *    response cache, with connection properties of their own, or
+ *    authenticating with NTLM.  So are requests to a server found not
+ *    to speak HTTP/2, and a request whose HTTP/2 connection is lost
+ *    before its response begins.
+ *  
+ */
+extern const CFStringRef _kCFStreamPropertyHTTPUseHTTP2             AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
 #if PRAGMA_ENUM_ALWAYSINT
     #pragma enumsalwaysint reset
 #endif
@@ -110,6 +110,396 @@ CFHostGetInfo(
   Boolean *        hasBeenResolved)                           AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
 
 
+/*
+ *  _kCFHostPropertyCacheCapacity
+ *
+ *  Discussion:
+ *    Host property key, for both set and copy operations.  CFNumberRef
+ *    (CFIndex) indicating the maximum number of host names held in
+ *    the process-wide address cache.  Setting a value of zero disables
+ *    the cache.  Reducing the capacity immediately evicts the least
+ *    recently used entries.  Recency is tracked per shard of the
+ *    cache, so the eviction order across names is approximate.
+ *
+ */
+extern const CFStringRef _kCFHostPropertyCacheCapacity;
+
+/*
+ *  _kCFHostPropertyCacheDefaultTimeToLive
+ *
+ *  Discussion:
+ *    Host property key, for both set and copy operations.  CFNumberRef
+ *    (CFTimeInterval) indicating the lifetime of a cached address
+ *    lookup when the resolver did not report a record time-to-live,
+ *    such as for entries from the local hosts file.
+ *
+ */
+extern const CFStringRef _kCFHostPropertyCacheDefaultTimeToLive;
+
+/*
+ *  _kCFHostPropertyCacheMaximumTimeToLive
+ *
+ *  Discussion:
+ *    Host property key, for both set and copy operations.  CFNumberRef
+ *    (CFTimeInterval) capping the lifetime of any cached address
+ *    lookup, regardless of the record time-to-live.
+ *
+ */
+extern const CFStringRef _kCFHostPropertyCacheMaximumTimeToLive;
+
+/*
+ *  _kCFHostPropertyCacheNegativeTimeToLive
+ *
+ *  Discussion:
+ *    Host property key, for both set and copy operations.  CFNumberRef
+ *    (CFTimeInterval) indicating the lifetime of a cached "no such
+ *    host" result.  A value of zero disables negative caching.
+ *
+ */
+extern const CFStringRef _kCFHostPropertyCacheNegativeTimeToLive;
+
+/*
+ *  _kCFHostPropertyCacheStatistics
+ *
+ *  Discussion:
+ *    Host property key, for copy operations.  CFDictionaryRef
+ *    containing a snapshot of the process-wide address cache counters,
+ *    keyed by the _kCFHostCacheStatistics* keys below, each with a
+ *    CFNumberRef (SInt64) value.
+ *
+ */
+extern const CFStringRef _kCFHostPropertyCacheStatistics;
+
+extern const CFStringRef _kCFHostCacheStatisticsEntries;
+extern const CFStringRef _kCFHostCacheStatisticsHits;
+extern const CFStringRef _kCFHostCacheStatisticsMisses;
+extern const CFStringRef _kCFHostCacheStatisticsNegativeHits;
+extern const CFStringRef _kCFHostCacheStatisticsEvictions;
+extern const CFStringRef _kCFHostCacheStatisticsExpirations;
+
+/*
+ *  _kCFHostPropertyResolverSharedChannel
+ *
+ *  Discussion:
+ *    Host property key, for both set and copy operations.  CFBooleanRef
+ *    indicating whether lookups multiplex over one long-lived,
+ *    process-wide resolver channel serviced by a dedicated thread
+ *    rather than each creating, and tearing down, their own.  Only
+ *    lookups started after the property is changed are affected.
+ *    Supported only where CFHost resolves with c-ares.
+ *
+ */
+extern const CFStringRef _kCFHostPropertyResolverSharedChannel;
+
+/*
+ *  _kCFHostPropertyResolverServers
+ *
+ *  Discussion:
+ *    Host property key, for both set and copy operations.  CFStringRef
+ *    containing a comma-separated list of DNS servers, each an IPv4 or
+ *    bracketed IPv6 address with an optional port (for example,
+ *    "127.0.0.1:5353,[::1]:53"), overriding the system resolver
+ *    configuration for subsequent lookups.  Setting NULL restores the
+ *    system configuration, except for an already-running shared
+ *    channel (see _kCFHostPropertyResolverSharedChannel).  Supported
+ *    only where CFHost resolves with c-ares.
+ *
+ */
+extern const CFStringRef _kCFHostPropertyResolverServers;
+
+/*
+ *  CFHostCopyProperty()
+ *
+ *  Discussion:
+ *    Returns the value of the given property.  The address cache and
+ *    resolver properties are shared by all hosts in the process, so
+ *    theHost may be NULL when copying them.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ *  Parameters:
+ *
+ *    theHost:
+ *      The CFHostRef for which to copy the property, or NULL.
+ *
+ *    propertyName:
+ *      The property key.  Must be non-NULL.
+ *
+ *  Result:
+ *    A retained reference to the property value, or NULL if the
+ *    property is unknown.
+ *
+ */
+extern CFTypeRef
+CFHostCopyProperty(
+  CFHostRef     theHost,            /* can be NULL */
+  CFStringRef   propertyName);
+
+/*
+ *  CFHostSetProperty()
+ *
+ *  Discussion:
+ *    Sets the value of the given property.  The address cache and
+ *    resolver properties are shared by all hosts in the process, so
+ *    theHost may be NULL when setting them.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ *  Parameters:
+ *
+ *    theHost:
+ *      The CFHostRef for which to set the property, or NULL.
+ *
+ *    propertyName:
+ *      The property key.  Must be non-NULL.
+ *
+ *    propertyValue:
+ *      The new value for the property.
+ *
+ *  Result:
+ *    TRUE if the property was recognized and the value accepted;
+ *    otherwise FALSE.
+ *
+ */
+extern Boolean
+CFHostSetProperty(
+  CFHostRef     theHost,            /* can be NULL */
+  CFStringRef   propertyName,
+  CFTypeRef     propertyValue);
+
+
+/*
+ *  CFHostBatchResolutionRef
+ *
+ *  Discussion:
+ *    This is the type of a reference to a batch of host name to
+ *    address resolutions.  Unlike resolving each name with its own
+ *    CFHostRef, a batch coalesces duplicate names, answers names from
+ *    the process-wide address cache without a lookup, and issues the
+ *    remaining lookups together, reporting each as it completes and
+ *    the whole batch once all have.
+ */
+typedef struct __CFHostBatchResolution*  CFHostBatchResolutionRef;
+
+/*
+ *  CFHostBatchResolutionCallBack
+ *
+ *  Discussion:
+ *    Callback function which is called as the resolution of each
+ *    unique name in a batch completes.
+ *
+ *  Parameters:
+ *
+ *    theBatch:
+ *      Batch containing the name.
+ *
+ *    name:
+ *      The name whose resolution is complete.
+ *
+ *    addresses:
+ *      The resolved addresses, as CFDataRef-wrapped struct sockaddr,
+ *      or NULL if the resolution failed.
+ *
+ *    error:
+ *      Reference to an error structure if the resolution failed.
+ *
+ *    info:
+ *      Client's info reference which was passed into the client
+ *      context.
+ */
+typedef CALLBACK_API_C( void , CFHostBatchResolutionCallBack )(CFHostBatchResolutionRef theBatch, CFStringRef name, CFArrayRef addresses, const CFStreamError *error, void *info);
+
+/*
+ *  CFHostBatchResolutionCompletionCallBack
+ *
+ *  Discussion:
+ *    Callback function which is called once the resolution of every
+ *    name in a batch is complete.  The results are available from
+ *    CFHostBatchResolutionCopyResults.
+ *
+ *  Parameters:
+ *
+ *    theBatch:
+ *      Batch whose resolution is complete.
+ *
+ *    info:
+ *      Client's info reference which was passed into the client
+ *      context.
+ */
+typedef CALLBACK_API_C( void , CFHostBatchResolutionCompletionCallBack )(CFHostBatchResolutionRef theBatch, void *info);
+
+/*
+ *  CFHostBatchResolutionGetTypeID()
+ *
+ *  Discussion:
+ *    Returns the type identifier of all CFHostBatchResolution
+ *    instances.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ */
+extern CFTypeID
+CFHostBatchResolutionGetTypeID(void);
+
+/*
+ *  CFHostCreateBatchResolution()
+ *
+ *  Discussion:
+ *    Creates a new batch for resolving the addresses of the given
+ *    names.  Duplicate names are resolved, and reported, once.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ *  Parameters:
+ *
+ *    allocator:
+ *      The CFAllocator which should be used to allocate memory for the
+ *      batch.
+ *
+ *    names:
+ *      A CFArrayRef of CFStringRef host names.  Must be non-NULL and
+ *      contain only CFStringRefs.
+ *
+ *  Result:
+ *    A valid CFHostBatchResolutionRef which may now be started, or
+ *    NULL if unsuccessful.
+ *
+ */
+extern CFHostBatchResolutionRef
+CFHostCreateBatchResolution(
+  CFAllocatorRef   allocator,
+  CFArrayRef       names);
+
+/*
+ *  CFHostBatchResolutionSetClient()
+ *
+ *  Discussion:
+ *    Associates the client callbacks with the batch.  Either callback
+ *    may be NULL: a client wanting results incrementally sets
+ *    clientCB and one wanting a single notification sets
+ *    completionCB.  Passing NULL for both callbacks, or for the
+ *    context, removes the client.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ *  Result:
+ *    Returns TRUE if the procedure was a success, otherwise it returns
+ *    FALSE.
+ *
+ */
+extern Boolean
+CFHostBatchResolutionSetClient(
+  CFHostBatchResolutionRef                  theBatch,
+  CFHostBatchResolutionCallBack             clientCB,           /* can be NULL */
+  CFHostBatchResolutionCompletionCallBack   completionCB,       /* can be NULL */
+  CFHostClientContext *                     clientContext);     /* can be NULL */
+
+/*
+ *  CFHostBatchResolutionScheduleWithRunLoop()
+ *
+ *  Discussion:
+ *    Schedules the given batch, and all of its outstanding lookups,
+ *    on a run loop and mode so the client will receive its callbacks
+ *    on that loop and mode.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ */
+extern void
+CFHostBatchResolutionScheduleWithRunLoop(
+  CFHostBatchResolutionRef   theBatch,
+  CFRunLoopRef               runLoop,
+  CFStringRef                runLoopMode);
+
+/*
+ *  CFHostBatchResolutionUnscheduleFromRunLoop()
+ *
+ *  Discussion:
+ *    Unschedules the given batch from a run loop and mode so the
+ *    client will not receive its callbacks on that loop and mode.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ */
+extern void
+CFHostBatchResolutionUnscheduleFromRunLoop(
+  CFHostBatchResolutionRef   theBatch,
+  CFRunLoopRef               runLoop,
+  CFStringRef                runLoopMode);
+
+/*
+ *  CFHostBatchResolutionStart()
+ *
+ *  Discussion:
+ *    Starts resolving every name in the batch.  Resolution is always
+ *    asynchronous: results, including those answered from the address
+ *    cache, are only reported from the run loops and modes on which
+ *    the batch is scheduled.  A batch may only be started once.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ *  Parameters:
+ *
+ *    theBatch:
+ *      The batch to start.  Must be non-NULL.
+ *
+ *    error:
+ *      A reference to a CFStreamError structure which will be filled
+ *      with any error which occurred in starting the batch.  This
+ *      value is optional.  Failing to start the lookup of an
+ *      individual name does not fail the batch; that name is reported
+ *      as failed instead.
+ *
+ *  Result:
+ *    Returns TRUE on success and FALSE on failure.
+ *
+ */
+extern Boolean
+CFHostBatchResolutionStart(
+  CFHostBatchResolutionRef   theBatch,
+  CFStreamError *            error);      /* can be NULL */
+
+/*
+ *  CFHostBatchResolutionCancel()
+ *
+ *  Discussion:
+ *    Cancels the outstanding lookups of the batch.  No further
+ *    callbacks, including the completion callback, will be made.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ */
+extern void
+CFHostBatchResolutionCancel(CFHostBatchResolutionRef theBatch);
+
+/*
+ *  CFHostBatchResolutionCopyResults()
+ *
+ *  Discussion:
+ *    Returns the results available so far, keyed by name.  The value
+ *    for each is a CFArrayRef of addresses, or kCFNull if the
+ *    resolution of that name failed.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ *  Result:
+ *    A retained CFDictionaryRef of results, or NULL if unsuccessful.
+ *
+ */
+extern CFDictionaryRef
+CFHostBatchResolutionCopyResults(CFHostBatchResolutionRef theBatch);
+
+
 
 #if PRAGMA_ENUM_ALWAYSINT
     #pragma enumsalwaysint reset
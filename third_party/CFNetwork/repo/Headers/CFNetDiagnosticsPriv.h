@@ -132,6 +132,162 @@ CFNetDiagnosticCopyNetworkStatusActively(
 
 
 
+/*
+ *  _CFNetDiagnosticProberRef
+ *  
+ *  Discussion:
+ *    An asynchronous ICMP echo prober.  Any number of targets, IPv4 or
+ *    IPv6, are probed at once over one unprivileged datagram ICMP
+ *    socket per address family, shared by all of them; replies are
+ *    matched to probes by echo identifier, sequence number and source
+ *    address, and count only if they come within the timeout.  Once
+ *    each target has had all of its probes answered or timed out, its
+ *    round trip times and loss are given to the client's callback on
+ *    the prober's run loops.
+ *  
+ */
+typedef struct __CFNetDiagnosticProber*  _CFNetDiagnosticProberRef;
+
+/*
+ *  _CFNetDiagnosticProbeStatistics
+ *  
+ *  Discussion:
+ *    The results for one target.  Round trip times are in seconds,
+ *    and are zero if no probe was answered.
+ *  
+ */
+typedef struct {
+  CFIndex           sent;
+  CFIndex           received;
+  CFTimeInterval    minimum;
+  CFTimeInterval    average;
+  CFTimeInterval    maximum;
+} _CFNetDiagnosticProbeStatistics;
+
+/*
+ *  _CFNetDiagnosticProberClientContext
+ *  
+ *  Discussion:
+ *    Structure containing the user-defined data and callbacks for the
+ *    prober, as with CFHostClientContext.
+ *  
+ */
+typedef struct {
+  CFIndex                             version;
+  void *                              info;
+  CFAllocatorRetainCallBack           retain;
+  CFAllocatorReleaseCallBack          release;
+  CFAllocatorCopyDescriptionCallBack  copyDescription;
+} _CFNetDiagnosticProberClientContext;
+
+/*
+ *  _CFNetDiagnosticProberCallBack
+ *  
+ *  Discussion:
+ *    Called once for each target, when it is finished.  target is the
+ *    name or address string it was added with, and address the
+ *    struct sockaddr probed, which is NULL if the name could not be
+ *    resolved.  If error is non-zero, the target could not be probed
+ *    at all and the statistics are empty.
+ *  
+ */
+typedef void (*_CFNetDiagnosticProberCallBack)(_CFNetDiagnosticProberRef prober, CFStringRef target, CFDataRef address, const _CFNetDiagnosticProbeStatistics *statistics, const CFStreamError *error, void *info);
+
+/*
+ *  _CFNetDiagnosticProberGetTypeID()
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ */
+extern CFTypeID
+_CFNetDiagnosticProberGetTypeID(void)                         AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFNetDiagnosticProberCreate()
+ *  
+ *  Discussion:
+ *    Creates a prober which sends count probes to each target, one
+ *    every interval seconds, and counts a probe lost if it is not
+ *    answered within timeout seconds.
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ *  Result:
+ *    The prober created, or NULL if failed.
+ *  
+ */
+extern _CFNetDiagnosticProberRef
+_CFNetDiagnosticProberCreate(
+  CFAllocatorRef                         allocator,
+  CFIndex                                count,
+  CFTimeInterval                         interval,
+  CFTimeInterval                         timeout,
+  _CFNetDiagnosticProberCallBack         callback,
+  _CFNetDiagnosticProberClientContext *  context)             AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFNetDiagnosticProberAddTarget()
+ *  
+ *  Discussion:
+ *    Adds a target, given as a host name or an IPv4 or IPv6 address.
+ *    Names are resolved asynchronously, with CFHost.  Probing starts
+ *    once the address is known and the prober is scheduled.
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ *  Result:
+ *    TRUE if the target was added.
+ *  
+ */
+extern Boolean
+_CFNetDiagnosticProberAddTarget(
+  _CFNetDiagnosticProberRef   prober,
+  CFStringRef                 target)                         AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFNetDiagnosticProberScheduleWithRunLoop()
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ */
+extern void
+_CFNetDiagnosticProberScheduleWithRunLoop(
+  _CFNetDiagnosticProberRef   prober,
+  CFRunLoopRef                runLoop,
+  CFStringRef                 runLoopMode)                    AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFNetDiagnosticProberUnscheduleFromRunLoop()
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ */
+extern void
+_CFNetDiagnosticProberUnscheduleFromRunLoop(
+  _CFNetDiagnosticProberRef   prober,
+  CFRunLoopRef                runLoop,
+  CFStringRef                 runLoopMode)                    AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+/*
+ *  _CFNetDiagnosticProberInvalidate()
+ *  
+ *  Discussion:
+ *    Stops all probing and closes the prober's sockets.  No further
+ *    callbacks are made.
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ */
+extern void
+_CFNetDiagnosticProberInvalidate(_CFNetDiagnosticProberRef prober) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
 #if PRAGMA_ENUM_ALWAYSINT
     #pragma enumsalwaysint reset
 #endif
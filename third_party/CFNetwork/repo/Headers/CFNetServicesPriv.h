@@ -147,6 +147,144 @@ CFNetServiceSetInfo(
 
 
 
+/*
+ *  _CFNetServiceBrowserBatchCallBack
+ *  
+ *  Discussion:
+ *    Callback function which is called with all the services found and
+ *    gone away in a burst of replies, in place of a call to the
+ *    CFNetServiceBrowserClientCallBack for each.  Errors and domains
+ *    are still given to the CFNetServiceBrowserClientCallBack.
+ *  
+ *  Parameters:
+ *    
+ *    browser:
+ *      CFNetServiceBrowser receiving the event.
+ *    
+ *    added:
+ *      The services found, possibly empty.
+ *    
+ *    removed:
+ *      The services which went away, possibly empty.
+ *    
+ *    info:
+ *      Client's info reference which was passed into the client
+ *      context.
+ */
+typedef CALLBACK_API_C( void , _CFNetServiceBrowserBatchCallBack )(CFNetServiceBrowserRef browser, CFArrayRef added, CFArrayRef removed, void *info);
+
+
+/*
+ *  _CFNetServiceBrowserSetUsesSharedConnection()
+ *  
+ *  Discussion:
+ *    Sets whether the browser's searches are made over the one DNS-SD
+ *    connection shared by the process, using
+ *    kDNSServiceFlagsShareConnection, rather than a connection of
+ *    their own.  The connection is serviced by a thread of its own and
+ *    the browser is called on its run loops once per burst of
+ *    replies.  Takes effect at the next search.
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ *  Parameters:
+ *    
+ *    browser:
+ *      The CFNetServiceBrowserRef to change. Must be non-NULL.
+ *    
+ *    shared:
+ *      TRUE to use the shared connection.
+ *  
+ */
+extern void 
+_CFNetServiceBrowserSetUsesSharedConnection(
+  CFNetServiceBrowserRef   browser,
+  Boolean                  shared)                            AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+
+/*
+ *  _CFNetServiceBrowserSetBatchCallBack()
+ *  
+ *  Discussion:
+ *    Sets a callback to receive found and removed services as arrays,
+ *    once per burst of replies, coalescing services which are found
+ *    and then go away, or the reverse, within it.
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ *  Parameters:
+ *    
+ *    browser:
+ *      The CFNetServiceBrowserRef to change. Must be non-NULL.
+ *    
+ *    callback:
+ *      The callback, or NULL to go back to a call per service.
+ *  
+ */
+extern void 
+_CFNetServiceBrowserSetBatchCallBack(
+  CFNetServiceBrowserRef              browser,
+  _CFNetServiceBrowserBatchCallBack   callback)               AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+
+/*
+ *  _CFNetServiceBrowserCopyServices()
+ *  
+ *  Discussion:
+ *    Returns the services currently known to a service search.  Each
+ *    service is listed once, however many interfaces it is found on.
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ *  Parameters:
+ *    
+ *    browser:
+ *      The CFNetServiceBrowserRef to query. Must be non-NULL.
+ *  
+ *  Result:
+ *    An array of CFNetServiceRef, which the caller must release.
+ *  
+ */
+extern CFArrayRef 
+_CFNetServiceBrowserCopyServices(CFNetServiceBrowserRef browser) AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+
+/*
+ *  _CFNetServiceMonitorSetUsesSharedConnection()
+ *  
+ *  Discussion:
+ *    Sets whether the monitor's queries are made over the one DNS-SD
+ *    connection shared by the process, as for
+ *    _CFNetServiceBrowserSetUsesSharedConnection.  Record changes in
+ *    a burst of replies are coalesced, so the client is called once
+ *    with the latest data.  Takes effect at the next start.
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ *  Parameters:
+ *    
+ *    theMonitor:
+ *      The CFNetServiceMonitorRef to change. Must be non-NULL.
+ *    
+ *    shared:
+ *      TRUE to use the shared connection.
+ *  
+ */
+extern void 
+_CFNetServiceMonitorSetUsesSharedConnection(
+  CFNetServiceMonitorRef   theMonitor,
+  Boolean                  shared)                            AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
+
+
+
 #if PRAGMA_ENUM_ALWAYSINT
     #pragma enumsalwaysint reset
 #endif
@@ -54,6 +54,8 @@
 #include <CoreFoundation/CFStream.h>
 #endif
 
+#include <sys/types.h>
+
 
 
 
@@ -90,6 +92,144 @@ extern const CFStringRef kCFStreamSocketSecurityLevelTLSv1SSLv3      AVAILABLE_M
  */
 extern const CFStringRef kCFStreamPropertyUseAddressCache            AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
 
+/*
+ *  kCFStreamPropertySocketHappyEyeballs
+ *
+ *  Discussion:
+ *    Stream property key, for both set and copy operations.
+ *    CFBooleanRef to race connection attempts to the resolved
+ *    addresses, alternating address families and starting each
+ *    attempt a short delay after the previous one (RFC 8305).  The
+ *    first attempt to connect wins and the others are cancelled.
+ *    The value is kCFBooleanFalse by default, in which case the
+ *    addresses are tried one after another.
+ *
+ */
+extern const CFStringRef kCFStreamPropertySocketHappyEyeballs;
+
+/*
+ *  kCFStreamPropertySocketConnectionAttemptDelay
+ *
+ *  Discussion:
+ *    Stream property key, for both set and copy operations.
+ *    CFNumberRef holding the number of seconds, as a CFTimeInterval,
+ *    to wait before starting the next racing connection attempt when
+ *    kCFStreamPropertySocketHappyEyeballs is set.  The value is 0.25
+ *    seconds by default.
+ *
+ */
+extern const CFStringRef kCFStreamPropertySocketConnectionAttemptDelay;
+
+/*
+ *  kCFStreamPropertySocketConnectedAddress
+ *
+ *  Discussion:
+ *    Stream property key, for copy operations.  CFDataRef holding the
+ *    struct sockaddr of the remote address to which the stream
+ *    connected.  Available once the open has completed.
+ *
+ */
+extern const CFStringRef kCFStreamPropertySocketConnectedAddress;
+
+/*
+ *  _CFSocketStreamMetrics
+ *
+ *  Discussion:
+ *    Connection phase timestamps and byte counts for a socket stream
+ *    pair.  Timestamps are in seconds on a monotonic clock and are
+ *    only meaningful relative to each other; a phase which did not
+ *    occur (e.g. no lookup for a stream created with an address, or
+ *    no SSL) is left as zero.  Byte counts are those passed between
+ *    the client and the stream, after any SSL encryption.
+ *
+ */
+typedef struct {
+  CFTimeInterval      lookupStart;
+  CFTimeInterval      lookupEnd;
+  CFTimeInterval      connectStart;
+  CFTimeInterval      connectEnd;
+  CFTimeInterval      secureStart;
+  CFTimeInterval      secureEnd;
+  UInt64              bytesRead;
+  UInt64              bytesWritten;
+} _CFSocketStreamMetrics;
+
+/*
+ *  _kCFStreamPropertySocketMetrics
+ *
+ *  Discussion:
+ *    Stream property key, for copy operations.  CFDataRef holding a
+ *    _CFSocketStreamMetrics snapshot of the stream pair.  Filter
+ *    streams forward this to the socket stream beneath them.
+ *
+ */
+extern const CFStringRef _kCFStreamPropertySocketMetrics;
+
+#ifdef __MACH__
+/*
+ *  _kCFStreamPropertySSLSessionResumed
+ *
+ *  Discussion:
+ *    Stream property key, for copy operations.  CFBooleanRef which is
+ *    kCFBooleanTrue if the stream's SSL handshake resumed a session
+ *    from the SSL session cache rather than performing a full
+ *    handshake.  Available once the handshake has completed.
+ *
+ */
+extern const CFStringRef _kCFStreamPropertySSLSessionResumed;
+
+/*
+ *  _kCFStreamPropertySSLSessionCacheStatistics
+ *
+ *  Discussion:
+ *    Stream property key, for copy operations.  CFDictionaryRef of
+ *    CFNumbers counting, for the whole process, the SSL handshakes
+ *    which resumed a cached session (_kCFStreamSSLSessionCacheHits)
+ *    and those which performed a full one
+ *    (_kCFStreamSSLSessionCacheMisses), the sessions dropped for room
+ *    (_kCFStreamSSLSessionCacheEvictions) and for having lapsed
+ *    (_kCFStreamSSLSessionCacheExpirations), and the sessions now
+ *    cached (_kCFStreamSSLSessionCacheCount).  Sessions are cached by
+ *    the far end's host, port and SNI name, so every SSL stream, be
+ *    it for HTTPS or FTPS, shares them.  Filter streams forward this
+ *    to the socket stream beneath them.
+ *
+ */
+extern const CFStringRef _kCFStreamPropertySSLSessionCacheStatistics;
+
+extern const CFStringRef _kCFStreamSSLSessionCacheHits;
+extern const CFStringRef _kCFStreamSSLSessionCacheMisses;
+extern const CFStringRef _kCFStreamSSLSessionCacheEvictions;
+extern const CFStringRef _kCFStreamSSLSessionCacheExpirations;
+extern const CFStringRef _kCFStreamSSLSessionCacheCount;
+#endif  /* defined(__MACH__) */
+
+/*
+ *  _kCFStreamSSLApplicationProtocols
+ *
+ *  Discussion:
+ *    Key in the kCFStreamPropertySSLSettings dictionary.  CFArrayRef
+ *    of CFStrings naming the application protocols, most preferred
+ *    first, to offer the server by ALPN (RFC 7301), for instance
+ *    "h2" and "http/1.1".  Ignored where the SSL implementation has
+ *    no ALPN support.
+ *
+ */
+extern const CFStringRef _kCFStreamSSLApplicationProtocols;
+
+/*
+ *  _kCFStreamPropertySSLNegotiatedProtocol
+ *
+ *  Discussion:
+ *    Stream property key, for copy operations.  CFStringRef naming
+ *    the application protocol the server chose from those offered
+ *    with _kCFStreamSSLApplicationProtocols.  Available once the
+ *    handshake has completed; NULL if none were offered, or the
+ *    server did not choose one.
+ *
+ */
+extern const CFStringRef _kCFStreamPropertySSLNegotiatedProtocol;
+
 /*
  *  kCFStreamPropertyCONNECTProxy
  *  
@@ -290,6 +430,131 @@ CFStreamCreatePairWithNetServicePieces(
   CFWriteStreamRef *  writeStream)       /* can be NULL */    AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
 
 
+/*
+ *  _CFWriteStreamWriteDataVector()
+ *  
+ *  Discussion:
+ *    Writes the concatenation of a list of CFData's, starting offset
+ *    bytes in, without first copying them into one buffer.  On a
+ *    socket stream the pieces are gathered into a single writev, and
+ *    large writes may go out with MSG_ZEROCOPY, in which case the
+ *    CFData's are retained until the kernel has finished with them.
+ *    Any other stream gets an ordinary CFWriteStreamWrite of the
+ *    first unsent piece.  As with CFWriteStreamWrite, fewer bytes
+ *    than remain may be written.
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ *  Parameters:
+ *  
+ *    stream:
+ *      The open write stream to which to write.
+ *  
+ *    buffers:
+ *      The CFData's to write, in order.
+ *  
+ *    count:
+ *      The number of CFData's in buffers.
+ *  
+ *    offset:
+ *      The number of bytes of the concatenation already written by
+ *      earlier calls.
+ *  
+ *  Result:
+ *    The number of bytes written, 0 if the stream has reached its
+ *    end, or -1 if an error occurred.
+ *  
+ */
+extern CFIndex
+_CFWriteStreamWriteDataVector(
+  CFWriteStreamRef    stream,
+  const CFDataRef *   buffers,
+  CFIndex             count,
+  CFIndex             offset);
+
+
+/*
+ *  _CFWriteStreamWriteFile()
+ *  
+ *  Discussion:
+ *    Writes bytes from an open file, starting at the given offset in
+ *    the file, without first reading them into the caller's memory.
+ *    On a plain socket stream where sendfile is available, the bytes
+ *    go from the file to the socket in the kernel.  Any other stream,
+ *    including one using SSL, gets an ordinary CFWriteStreamWrite of
+ *    a buffer read from the file.  As with CFWriteStreamWrite, fewer
+ *    bytes than asked may be written.
+ *  
+ *  Mac OS X threading:
+ *    Thread safe
+ *  
+ *  Parameters:
+ *  
+ *    stream:
+ *      The open write stream to which to write.
+ *  
+ *    fd:
+ *      The open file from which to read.  Its file offset is not
+ *      changed.
+ *  
+ *    offset:
+ *      The offset in the file of the first byte to write.
+ *  
+ *    length:
+ *      The most bytes to write.
+ *  
+ *  Result:
+ *    The number of bytes written, 0 if the stream has reached its
+ *    end or the file has no bytes at offset, or -1 if an error
+ *    occurred.
+ *  
+ */
+extern CFIndex
+_CFWriteStreamWriteFile(
+  CFWriteStreamRef    stream,
+  int                 fd,
+  off_t               offset,
+  CFIndex             length);
+
+
+#ifdef __MACH__
+/*
+ *  _CFSocketStreamSetSSLSessionCacheLimits()
+ *
+ *  Discussion:
+ *    Sets how many SSL sessions the process-wide session cache holds
+ *    before dropping the least recently used, and for how long a
+ *    session may be resumed after the full handshake which
+ *    established it.  A capacity of zero turns resumption off.  The
+ *    defaults are 256 sessions and 600 seconds.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ */
+extern void
+_CFSocketStreamSetSSLSessionCacheLimits(
+  CFIndex             capacity,
+  CFTimeInterval      lifetime);
+
+
+/*
+ *  _CFSocketStreamFlushSSLSessionCache()
+ *
+ *  Discussion:
+ *    Forgets every cached SSL session, so that the next handshake to
+ *    each peer is a full one.
+ *
+ *  Mac OS X threading:
+ *    Thread safe
+ *
+ */
+extern void
+_CFSocketStreamFlushSSLSessionCache(void);
+#endif  /* defined(__MACH__) */
+
+
 
 #ifdef __cplusplus
 }
@@ -116,6 +116,7 @@
 # include <signal.h>
 # include <sys/signalfd.h>
 # include <sys/syscall.h>
+# include <fcntl.h>
 # include <poll.h>
 # include <unistd.h>
 #endif /* defined(__MACH__) */
@@ -124,6 +125,17 @@
 #include <ares.h>
 #endif
 
+/*
+ * ares_getaddrinfo, which, unlike ares_gethostbyname, reports the
+ * time-to-live of the records it resolves, first appeared in c-ares
+ * 1.16.0.
+ */
+#if HAVE_ARES_INIT && defined(ARES_VERSION) && (ARES_VERSION >= 0x011000)
+#define _CFHOST_HAVE_ARES_GETADDRINFO 1
+#else
+#define _CFHOST_HAVE_ARES_GETADDRINFO 0
+#endif
+
 #if 0
 #pragma mark -
 #pragma mark Constants
@@ -163,9 +175,16 @@
 #define _kCFHostIPv6Addresses				((CFHostInfoType)0x0000FFFD)
 #define _kCFHostMasterAddressLookup			((CFHostInfoType)0x0000FFFC)
 #define _kCFHostByPassMasterAddressLookup	((CFHostInfoType)0x0000FFFB)
+#define _kCFHostTimeToLive					((CFHostInfoType)0x0000FFFA)
+
+#define _kCFHostCacheShardCount				16
+#define _kCFHostCacheDefaultCapacity		512
+#define _kCFHostCacheDefaultTimeToLive		((CFTimeInterval)1.0)
+#define _kCFHostCacheMaximumTimeToLive		((CFTimeInterval)3600.0)
+#define _kCFHostCacheNegativeTimeToLive		((CFTimeInterval)1.0)
 
-#define _kCFHostCacheMaxEntries				25
-#define _kCFHostCacheTimeout				((CFTimeInterval)1.0)
+#define _kCFHostAresPollBackoffMinimum		10		/* milliseconds */
+#define _kCFHostAresPollBackoffMaximum		1000	/* milliseconds */
 
 
 #if 0
@@ -176,11 +195,29 @@
 #ifdef __CONSTANT_CFSTRINGS__
 #define _kCFHostBlockingMode	CFSTR("_kCFHostBlockingMode")
 #define _kCFHostDescribeFormat	CFSTR("<CFHost 0x%x>{info=%@}")
+#define _kCFHostBatchDescribeFormat	CFSTR("<CFHostBatchResolution 0x%x>{names=%@, results=%@}")
 #else
 CONST_STRING_DECL_LOCAL(_kCFHostBlockingMode, "_kCFHostBlockingMode")
 CONST_STRING_DECL_LOCAL(_kCFHostDescribeFormat, "<CFHost 0x%x>{info=%@}")
+CONST_STRING_DECL_LOCAL(_kCFHostBatchDescribeFormat, "<CFHostBatchResolution 0x%x>{names=%@, results=%@}")
 #endif	/* __CONSTANT_CFSTRINGS__ */
 
+/* Properties made available as SPI */
+CONST_STRING_DECL(_kCFHostPropertyCacheCapacity, "_kCFHostPropertyCacheCapacity")
+CONST_STRING_DECL(_kCFHostPropertyCacheDefaultTimeToLive, "_kCFHostPropertyCacheDefaultTimeToLive")
+CONST_STRING_DECL(_kCFHostPropertyCacheMaximumTimeToLive, "_kCFHostPropertyCacheMaximumTimeToLive")
+CONST_STRING_DECL(_kCFHostPropertyCacheNegativeTimeToLive, "_kCFHostPropertyCacheNegativeTimeToLive")
+CONST_STRING_DECL(_kCFHostPropertyCacheStatistics, "_kCFHostPropertyCacheStatistics")
+CONST_STRING_DECL(_kCFHostPropertyResolverSharedChannel, "_kCFHostPropertyResolverSharedChannel")
+CONST_STRING_DECL(_kCFHostPropertyResolverServers, "_kCFHostPropertyResolverServers")
+
+CONST_STRING_DECL(_kCFHostCacheStatisticsEntries, "Entries")
+CONST_STRING_DECL(_kCFHostCacheStatisticsHits, "Hits")
+CONST_STRING_DECL(_kCFHostCacheStatisticsMisses, "Misses")
+CONST_STRING_DECL(_kCFHostCacheStatisticsNegativeHits, "NegativeHits")
+CONST_STRING_DECL(_kCFHostCacheStatisticsEvictions, "Evictions")
+CONST_STRING_DECL(_kCFHostCacheStatisticsExpirations, "Expirations")
+
 #if defined(__linux__)
 #define __kCFHostLinuxSignalFdSignal ((int)SIGRTMIN + 11)
 #endif
@@ -209,6 +246,94 @@ typedef struct {
 	CFHostClientContext		_client;
 } _CFHost;
 
+#if 0
+#pragma mark -
+#pragma mark CFHostBatchResolution struct
+#endif
+
+/*
+	A batch resolves each of its unique names with a private host running the
+	master address lookup directly, bypassing the per-client lookup sources and
+	_HostLookups registration a public CFHost address lookup goes through.  Names
+	answered from the address cache, or whose lookup could not be started, never
+	get a host; their results are queued and reported from the batch source.
+*/
+typedef struct {
+
+	CFRuntimeBase							_base;
+
+	CFSpinLock_t							_lock;
+
+	CFArrayRef								_names;			// Unique names, in the order given
+	CFMutableDictionaryRef					_results;		// key = name and value = addresses or kCFNull
+	CFMutableDictionaryRef					_errors;		// key = name and value = CFData of CFStreamError
+	CFMutableDictionaryRef					_lookups;		// key = name and value = CFHost with lookup outstanding
+	CFMutableArrayRef						_ready;			// Names with results not yet reported
+	CFIndex									_pending;		// Names not yet reported
+
+	CFRunLoopSourceRef						_source;		// Signalled to report _ready
+	Boolean									_started;
+	Boolean									_canceled;
+	Boolean									_completed;
+
+	CFMutableArrayRef						_schedules;		// List of loops and modes
+	CFHostBatchResolutionCallBack			_callback;
+	CFHostBatchResolutionCompletionCallBack	_completion;
+	CFHostClientContext						_client;
+} _CFHostBatch;
+
+#if 0
+#pragma mark -
+#pragma mark Host Cache structs
+#endif
+
+/*
+	The address cache is split into _kCFHostCacheShardCount shards, selected by the
+	hash of the host name, so that concurrent lookups of different names rarely
+	contend for the same lock.  Each shard keeps a dictionary from name to entry for
+	O(1) lookup and a doubly-linked list of the same entries, most recently used at
+	the head, for O(1) LRU eviction.  Entries without addresses record a failed
+	lookup (negative caching) and the error to replay.
+
+	The capacity bounds the total across all shards.  Recency is only tracked
+	within a shard, so eviction takes the least recently used entry of the shard
+	being inserted into first and then of the others in turn; the order across
+	shards is therefore approximate.
+*/
+typedef struct __CFHostCacheEntry {
+	struct __CFHostCacheEntry*	_prev;
+	struct __CFHostCacheEntry*	_next;
+
+	CFStringRef					_name;
+	CFArrayRef					_addresses;		// NULL for a cached failure
+	CFStreamError				_error;			// Error to replay for a cached failure
+
+	CFAbsoluteTime				_fetched;
+	CFTimeInterval				_lifetime;
+} _CFHostCacheEntry;
+
+typedef struct {
+	_CFMutex					_lock;
+
+	CFMutableDictionaryRef		_entries;		// key = name and value = _CFHostCacheEntry*
+	_CFHostCacheEntry*			_head;			// Most recently used
+	_CFHostCacheEntry*			_tail;			// Least recently used
+	CFIndex						_count;
+
+	SInt64						_hits;
+	SInt64						_misses;
+	SInt64						_negativeHits;
+	SInt64						_evictions;
+	SInt64						_expirations;
+} _CFHostCacheShard;
+
+typedef struct {
+	CFIndex						_capacity;
+	CFTimeInterval				_defaultTimeToLive;
+	CFTimeInterval				_maximumTimeToLive;
+	CFTimeInterval				_negativeTimeToLive;
+} _CFHostCacheConfiguration;
+
 #if defined(__linux__)
 #if (HAVE_GETADDRINFO_A && 0)
 /**
@@ -299,10 +424,78 @@ typedef struct {
                                                     //!< addrinfo as successful
                                                     //!< request responses are
                                                     //!< processed.
+    int                 _request_ttl;               //!< The smallest record
+                                                    //!< time-to-live, in
+                                                    //!< seconds, reported for
+                                                    //!< forward DNS requests,
+                                                    //!< or -1 if none was
+                                                    //!< reported.
     _CFHost *           _request_host;              //!< A pointer to the host
                                                     //!< object associated with
                                                     //!< the request(s).
+    Boolean             _request_shared;            //!< True if the request
+                                                    //!< is multiplexed over
+                                                    //!< the shared channel
+                                                    //!< rather than owning
+                                                    //!< _request_channel.
+    CFSpinLock_t        _request_lock;              //!< The lock guarding
+                                                    //!< _request_refs and
+                                                    //!< _request_run_loops
+                                                    //!< for shared requests.
+    CFIndex             _request_refs;              //!< The references held
+                                                    //!< on a shared request:
+                                                    //!< one by the host
+                                                    //!< lookup and one by
+                                                    //!< the outstanding
+                                                    //!< channel queries.
+    CFMutableArrayRef   _request_run_loops;         //!< The run loops on
+                                                    //!< which the lookup of
+                                                    //!< a shared request is
+                                                    //!< scheduled, to wake
+                                                    //!< upon completion.
+    CFStreamError       _request_shared_error;      //!< The stream error for
+                                                    //!< a shared request,
+                                                    //!< which may complete
+                                                    //!< on the shared channel
+                                                    //!< thread after the host
+                                                    //!< is gone.
 } _CFHostAresRequest;
+
+/**
+ *  @brief
+ *    The process-wide c-ares channel over which all lookups are
+ *    multiplexed when _kCFHostPropertyResolverSharedChannel is set.
+ *
+ *  Rather than each lookup initializing (and reading the resolver
+ *  configuration for), opening sockets on, and destroying its own
+ *  channel, requests submit their queries to this one long-lived
+ *  channel. A dedicated thread polls the channel sockets, along with
+ *  a wake up pipe signalled whenever new queries are submitted, and
+ *  honors the channel timeouts that CFFileDescriptor-based lookups
+ *  cannot.
+ *
+ *  Completed queries signal the run loop source lookup of their
+ *  request, deferring finalization to the run loop(s) on which the
+ *  host is scheduled, just as "null" lookups do. A canceled request
+ *  is merely detached; its queries run to completion on the channel
+ *  and their results are discarded.
+ *
+ */
+typedef struct {
+    _CFMutex            _lock;                      //!< The lock guarding
+                                                    //!< all use of _channel.
+    ares_channel        _channel;                   //!< The shared c-ares
+                                                    //!< name service channel.
+    int                 _wakeup[2];                 //!< The read and write
+                                                    //!< ends of the pipe used
+                                                    //!< to wake up the
+                                                    //!< channel thread.
+    _CFThread           _thread;                    //!< The thread servicing
+                                                    //!< _channel.
+    Boolean             _valid;                     //!< True if the channel
+                                                    //!< and its thread were
+                                                    //!< successfully started.
+} _CFHostAresSharedChannel;
 #endif /* (HAVE_ARES_INIT && 1) */
 #endif /* defined(__linux__) */
 
@@ -332,7 +525,6 @@ static CFTypeRef                _CreateDNSLookup(CFTypeRef thing, CFHostInfoType
 static Boolean                  _CreateLookup_NoLock(_CFHost* host, CFHostInfoType info, Boolean* _Radar4012176);
 static CFTypeRef                _CreateMasterAddressLookup(CFStringRef name, CFHostInfoType info, CFTypeRef context, CFStreamError* error);
 static CFTypeRef                _CreateNameLookup(CFDataRef address, void* context, CFStreamError* error);
-static void                     _ExpireCacheEntries(void);
 #if defined(__MACH__) || (HAVE_GETADDRINFO_A && 0)
 static void                     _GetAddrInfoCallBack(int eai_status, const struct addrinfo* res, void* ctxt);
 #endif
@@ -347,6 +539,36 @@ static _CFHost*                 _HostCreate(CFAllocatorRef allocator);
 static void                     _HostDestroy(_CFHost* host);
 static CFStringRef              _HostDescribe(_CFHost* host);
 static void                     _HostLookupCancel_NoLock(_CFHost* host);
+static void                     _HostBatchCancel_NoLock(_CFHostBatch* batch);
+static CFStringRef              _HostBatchDescribe(_CFHostBatch* batch);
+static void                     _HostBatchDestroy(_CFHostBatch* batch);
+static void                     _HostBatchLookupCallBack(CFHostRef theHost, CFHostInfoType typeInfo, const CFStreamError *error, _CFHostBatch* batch);
+static void                     _HostBatchRecord_NoLock(_CFHostBatch* batch, CFStringRef name, CFArrayRef addrs, const CFStreamError* error);
+static void                     _HostBatchRegisterClass(void);
+static void                     _HostBatchReport(_CFHostBatch* batch);
+static void                     _HostBatchSignal_NoLock(_CFHostBatch* batch);
+static void                     _HostBatchStartLookup(_CFHostBatch* batch, CFStringRef name);
+static void                     _HostCacheAdd(CFStringRef name, CFArrayRef addrs, const CFStreamError* error, CFTimeInterval lifetime, CFIndex capacity);
+static void                     _HostCacheAddAddresses(CFArrayRef names, CFArrayRef addrs, CFTimeInterval ttl);
+static void                     _HostCacheAddLookupResult(CFHostRef lookup, CFStringRef name, const CFStreamError* error);
+static void                     _HostCacheAddNegative(CFStringRef name, const CFStreamError* error);
+static Boolean                  _HostCacheCopyAddresses(CFStringRef name, CFArrayRef* addrs, CFStreamError* error);
+static CFDictionaryRef          _HostCacheCopyStatistics(void);
+static void                     _HostCacheEntryDestroy(_CFHostCacheEntry* entry);
+static Boolean                  _HostCacheEntryIsExpired(const _CFHostCacheEntry* entry, CFAbsoluteTime now);
+static void                     _HostCacheGetConfiguration(_CFHostCacheConfiguration* config);
+static void                     _HostCacheInitialize(void);
+static Boolean                  _HostCacheIsNegativeError(const CFStreamError* error);
+static Boolean                  _HostCacheSetConfigurationValue(CFStringRef key, CFTypeRef value);
+static _CFHostCacheShard*       _HostCacheShardForName(CFStringRef name);
+static void                     _HostCacheShardPushFront_NoLock(_CFHostCacheShard* shard, _CFHostCacheEntry* entry);
+static void                     _HostCacheShardRemove_NoLock(_CFHostCacheShard* shard, _CFHostCacheEntry* entry);
+static void                     _HostCacheCountAdjust(CFIndex delta);
+static CFIndex                  _HostCacheCountGet(void);
+static void                     _HostCacheShardEvict_NoLock(_CFHostCacheShard* shard, _CFHostCacheEntry* entry, CFAbsoluteTime now);
+static void                     _HostCacheShardTrim_NoLock(_CFHostCacheShard* shard, CFIndex capacity, const _CFHostCacheEntry* keep, CFAbsoluteTime now);
+static void                     _HostCacheShardUnlink_NoLock(_CFHostCacheShard* shard, _CFHostCacheEntry* entry);
+static void                     _HostCacheTrim(CFIndex capacity, CFIndex start);
 #if defined(__MACH__) || (HAVE_GETADDRINFO_A && 0)
 static void                     _InitGetAddrInfoHints(CFHostInfoType info, struct addrinfo *hints);
 #endif
@@ -376,6 +598,13 @@ static struct gaicb *           _SignalFdGetAddrInfoResult(CFFileDescriptorRef f
 
 #if HAVE_ARES_INIT && 1
 static void                     _AresAccumulateAddrInfo(_CFHostAresRequest *ares_request, struct addrinfo *ai);
+#if _CFHOST_HAVE_ARES_GETADDRINFO
+static void                     _AresAddrInfoCompletedCallBack(void *arg,
+                                                               int status,
+                                                               int timeouts,
+                                                               struct ares_addrinfo *res);
+static struct addrinfo *        _AresAddrInfoToAddrInfo(const struct ares_addrinfo *res, int *ttl, CFStreamError *error);
+#endif /* _CFHOST_HAVE_ARES_GETADDRINFO */
 static void                     _AresClearOrSetRequestEvents(_CFHostAresRequest *ares_request,
                                                              uint16_t event,
                                                              Boolean set);
@@ -384,14 +613,32 @@ static _CFHostAresRequest *     _AresCreateRequestAndChannel(_CFHost *host, CFHo
 static void                     _AresDestroyRequestAndChannel(_CFHostAresRequest *ares_request);
 static Boolean                  _AresIsNullLookup(const _CFHostAresRequest *ares_request);
 static void                     _AresSocketDataCallBack(CFFileDescriptorRef fdref, CFOptionFlags callBackTypes, void *info);
+static void                     _AresSharedChannelBeginQueries(_CFHostAresRequest *ares_request);
+static void                     _AresSharedChannelEndQueries(_CFHostAresRequest *ares_request);
+static void                     _AresSharedChannelInitialize(void);
+static void *                   _AresSharedChannelMain(void *context);
+static Boolean                  _AresSharedChannelIsEnabled(void);
+static CFRunLoopSourceRef       _AresSharedLookupCreate(_CFHostAresRequest *ares_request);
+static void                     _AresSharedLookupDetach(CFTypeRef lookup);
+static void                     _AresSharedLookupSchedule(void *info, CFRunLoopRef rl, CFStringRef mode);
+static void                     _AresSharedLookupSignal(_CFHostAresRequest *ares_request);
+static void                     _AresSharedLookupUnschedule(void *info, CFRunLoopRef rl, CFStringRef mode);
+static void                     _AresSharedRequestRelease(_CFHostAresRequest *ares_request);
+static void                     _AresSharedRequestRetain(_CFHostAresRequest *ares_request);
+static void                     _AresSignalNullLookup(_CFHostAresRequest *ares_request);
+static void                     _AresApplyServers_NoLock(ares_channel channel);
+static CFTypeRef                _AresCopyConfigurationValue(CFStringRef key);
+static Boolean                  _AresSetConfigurationValue(CFStringRef key, CFTypeRef value);
 static void                     _AresFinalizeForwardDNSLookup(_CFHostAresRequest *ares_request,
                                                               int status);
 static void                     _AresFreeAddrInfo(struct addrinfo *res);
 static void                     _AresFreeNameInfo(char *hostname, char *serv);
+#if !_CFHOST_HAVE_ARES_GETADDRINFO
 static void                     _AresHostByCompletedCallBack(void *arg,
                                                              int status,
                                                              int timeouts,
                                                              struct hostent *hostent);
+#endif /* !_CFHOST_HAVE_ARES_GETADDRINFO */
 static void                     _AresNameInfoCompletedCallBack(void *arg,
                                                                int status,
                                                                int timeouts,
@@ -399,11 +646,16 @@ static void                     _AresNameInfoCompletedCallBack(void *arg,
                                                                char *service);
 static void                     _AresSocketStateCallBack(void *data, ares_socket_t socket_fd, int readable, int writable);
 static int                      _AresStatusMapToAddrInfoError(int ares_status);
+#if !_CFHOST_HAVE_ARES_GETADDRINFO
 static struct addrinfo * _AresHostentToAddrInfo(const struct hostent *hostent, CFStreamError *error);
+#endif /* !_CFHOST_HAVE_ARES_GETADDRINFO */
 static void                     _AresStatusMapToStreamError(int status, CFStreamError *error);
+static void                     _AresUpdateHostTimeToLive(_CFHostAresRequest *ares_request);
 static void                     _AresUpdateLastStatus(_CFHostAresRequest *ares_request, int status);
 static void                     _CFHostInitializeAres(void);
+#if !_CFHOST_HAVE_ARES_GETADDRINFO
 static void                     _CopyHostentAddrToAddrInfo(int family, struct addrinfo *ai, const char *data);
+#endif /* !_CFHOST_HAVE_ARES_GETADDRINFO */
 static CFTypeRef                _CreateNameLookup_Ares(CFDataRef address, void* context, CFStreamError* error);
 static CFTypeRef                _CreatePrimaryAddressLookup_Ares(CFStringRef name, CFHostInfoType info, CFTypeRef context, CFStreamError* error);
 #if LOG_CFHOST
@@ -444,13 +696,32 @@ static _CFOnceLock _kCFHostRegisterClass = _CFOnceInitializer;
 #if defined(__linux__)
 #if (HAVE_ARES_INIT && 1)
 static _CFOnceLock _kCFHostInitializeAres = _CFOnceInitializer;
+static _CFOnceLock _kCFHostInitializeAresSharedChannel = _CFOnceInitializer;
+
+static _CFHostAresSharedChannel _AresSharedChannel;	/* Channel for all lookups when sharing */
+static CFSpinLock_t _AresConfigurationLock = CFSpinLockInit;
+static Boolean _AresUseSharedChannel = FALSE;		/* Whether new lookups use _AresSharedChannel */
+static char* _AresServers = NULL;					/* Server override, in c-ares CSV form */
 #endif /* (HAVE_ARES_INIT && 1) */
 #endif /* defined(__linux__) */
 static CFTypeID _kCFHostTypeID = _kCFRuntimeNotATypeID;
 
-static _CFMutex* _HostLock;						/* Lock used for cache and master list */
+static _CFOnceLock _kCFHostBatchRegisterClass = _CFOnceInitializer;
+static CFTypeID _kCFHostBatchTypeID = _kCFRuntimeNotATypeID;
+
+static _CFMutex* _HostLock;						/* Lock used for master list */
 static CFMutableDictionaryRef _HostLookups;		/* Active hostname lookups; for duplicate supression */
-static CFMutableDictionaryRef _HostCache;		/* Cached hostname lookups (successes only) */
+
+static _CFHostCacheShard _HostCache[_kCFHostCacheShardCount];	/* Cached hostname lookups, sharded by name */
+static CFSpinLock_t _HostCacheCountLock = CFSpinLockInit;
+static CFIndex _HostCacheCount = 0;				/* Entries across all shards */
+static CFSpinLock_t _HostCacheConfigurationLock = CFSpinLockInit;
+static _CFHostCacheConfiguration _HostCacheConfiguration = {
+	_kCFHostCacheDefaultCapacity,
+	_kCFHostCacheDefaultTimeToLive,
+	_kCFHostCacheMaximumTimeToLive,
+	_kCFHostCacheNegativeTimeToLive
+};
 
 
 #if 0
@@ -514,10 +785,8 @@ _CFHostRegisterClass(void) {
 													&kCFTypeDictionaryKeyCallBacks,
 													&kCFTypeDictionaryValueCallBacks);
 
-	_HostCache = CFDictionaryCreateMutable(kCFAllocatorDefault,
-										   0,
-										   &kCFTypeDictionaryKeyCallBacks,
-										   &kCFTypeDictionaryValueCallBacks);
+	/* Set up the shards of the address cache. */
+	_HostCacheInitialize();
 }
 
 
@@ -702,6 +971,13 @@ _HostLookupCancel_NoLock(_CFHost* host) {
     // Invalidate the lookup
     _CFTypeInvalidate(host->_lookup);
 
+#if defined(__linux__)
+#if (HAVE_ARES_INIT && 1)
+    // Detach from any request on the shared channel
+    _AresSharedLookupDetach(host->_lookup);
+#endif /* (HAVE_ARES_INIT && 1) */
+#endif /* defined(__linux__) */
+
     // Release the lookup.
     CFRelease(host->_lookup);
     host->_lookup = NULL;
@@ -738,33 +1014,18 @@ _CreateLookup_NoLock(_CFHost* host, CFHostInfoType info, Boolean* _Radar4012176)
 			if (name) {
 
 				CFArrayRef cached = NULL;
+				CFStreamError cachedError = {0, 0};
 
-				/* Expire any entries from the cache */
-				_ExpireCacheEntries();
-
-				/* Lock the cache */
-				_CFMutexLock(_HostLock);
-
-				/* Go for a cache entry. */
-				if (_HostCache)
-					cached = (CFArrayRef)CFDictionaryGetValue(_HostCache, name);
-
-				if (cached)
-					CFRetain(cached);
-
-				_CFMutexUnlock(_HostLock);
-
-				/* Create a lookup if no cache entry. */
-				if (!cached)
+				/* Go for a cache entry, either a list of addresses or a failure. */
+				if (!_HostCacheCopyAddresses(name, &cached, &cachedError))
 					host->_lookup = _CreateAddressLookup(name, info, host, &(host->_error));
 
 				else {
 
 					CFAllocatorRef alloc = CFGetAllocator(name);
 
-					/* Make a copy of the addresses in the cached entry. */
-					CFArrayRef cp = _CFArrayCreateDeepCopy(alloc,
-														   CFHostGetInfo((CFHostRef)CFArrayGetValueAtIndex(cached, 0), _kCFHostMasterAddressLookup, NULL));
+					/* Make a copy of the addresses in the cached entry or mark the cached failure. */
+					CFTypeRef cp = cached ? (CFTypeRef)_CFArrayCreateDeepCopy(alloc, cached) : CFRetain(kCFNull);
 
 					CFRunLoopSourceContext ctxt = {
 						0,
@@ -787,6 +1048,10 @@ _CreateLookup_NoLock(_CFHost* host, CFHostInfoType info, Boolean* _Radar4012176)
 
 						CFDictionaryAddValue(host->_info, (const void*)info, cp);
 
+						/* Replay the failure for a negative entry. */
+						if (!cached)
+							memmove(&(host->_error), &cachedError, sizeof(cachedError));
+
 						CFRunLoopSourceSignal((CFRunLoopSourceRef)host->_lookup);
 						*_Radar4012176 = TRUE;
 					}
@@ -804,7 +1069,8 @@ _CreateLookup_NoLock(_CFHost* host, CFHostInfoType info, Boolean* _Radar4012176)
 						host->_lookup = NULL;
 					}
 
-					CFRelease(cached);
+					if (cached)
+						CFRelease(cached);
 				}
 			}
 
@@ -1447,6 +1713,12 @@ _CreatePrimaryAddressLookup_Linux_GetAddrInfo_A(CFStringRef name, CFHostInfoType
 _CFHostInitializeAres(void) {
     int status = ares_library_init(ARES_LIB_INIT_ALL);
     __Verify_Action(status == ARES_SUCCESS, abort());
+
+    // The shared channel lock is initialized here, rather than with
+    // the channel, so that configuration changes may always take it
+    // to learn whether the channel is running.
+
+    _CFMutexInit(&_AresSharedChannel._lock, FALSE);
 }
 
 /* static */ int
@@ -1861,6 +2133,7 @@ _AresFreeNameInfo(char *node, char *serv) {
     if (serv) free(serv);
 }
 
+#if !_CFHOST_HAVE_ARES_GETADDRINFO
 /* static */ void
 _CopyHostentAddrToAddrInfo(int family, struct addrinfo *ai, const char *data) {
     struct sockaddr_in *  saddr;
@@ -1989,6 +2262,97 @@ map_status:
 done:
     return result;
 }
+#endif /* !_CFHOST_HAVE_ARES_GETADDRINFO */
+
+#if _CFHOST_HAVE_ARES_GETADDRINFO
+/* static */ struct addrinfo *
+_AresAddrInfoToAddrInfo(const struct ares_addrinfo *res, int *ttl, CFStreamError *error) {
+    int                               status   = 0;
+    const struct ares_addrinfo_node * node     = NULL;
+    const struct ares_addrinfo_cname *cname    = NULL;
+    const size_t                      canonname_len = (((res == NULL) || (res->name == NULL)) ? 0 : strlen(res->name) + 1);
+    struct addrinfo *                 result   = NULL;
+    struct addrinfo *                 previous = NULL;
+    struct addrinfo *                 current  = NULL;
+
+    __Require_Action(res != NULL, map_status, status = EINVAL);
+    __Require_Action(ttl != NULL, map_status, status = EINVAL);
+    __Require_Action(error != NULL, map_status, status = EINVAL);
+
+    // The lifetime of the whole answer is that of its shortest-lived
+    // record, including any CNAME records followed along the way. A
+    // zero time-to-live is indistinguishable from an unreported one
+    // (for example, from the local hosts file), so ignore it.
+
+    for (cname = res->cnames; cname != NULL; cname = cname->next) {
+        if ((cname->ttl > 0) && ((*ttl < 0) || (cname->ttl < *ttl)))
+            *ttl = cname->ttl;
+    }
+
+    // Loop over each c-ares addrinfo node and map it into an
+    // addrinfo, in the same inlined form as #_AresHostentToAddrInfo.
+
+    for (node = res->nodes; node != NULL; node = node->ai_next)
+    {
+        const int    family = node->ai_family;
+        size_t       addr_size;
+        size_t       total_size;
+
+        addr_size = _AddressSizeForSupportedFamily(family);
+        __Require_Action(addr_size > 0,
+                         done,
+                         error->error  = EAI_ADDRFAMILY;
+                         error->domain = (CFStreamErrorDomain)kCFStreamErrorDomainNetDB);
+
+        total_size = sizeof(struct addrinfo) + addr_size + canonname_len;
+
+        current = CFAllocatorAllocate(kCFAllocatorDefault, total_size, 0);
+        __Require_Action(current != NULL, map_status, status = ENOMEM);
+
+        memset(current, 0, total_size);
+
+        current->ai_addr      = (struct sockaddr *)((uint8_t *)current + sizeof(struct addrinfo));
+        current->ai_canonname = (char *)((uint8_t *)current->ai_addr + addr_size);
+
+        current->ai_family   = family;
+        current->ai_socktype = SOCK_STREAM;
+        current->ai_addrlen  = addr_size;
+
+        if (canonname_len > 0) {
+            memcpy(current->ai_canonname, res->name, canonname_len);
+        }
+
+        memcpy(current->ai_addr, node->ai_addr, addr_size);
+
+        if ((node->ai_ttl > 0) && ((*ttl < 0) || (node->ai_ttl < *ttl)))
+            *ttl = node->ai_ttl;
+
+        // Chain up the addrinfo data, as created.
+
+        if (result == NULL)
+            result = current;
+
+        if (previous != NULL)
+            previous->ai_next = current;
+
+        previous = current;
+    }
+
+map_status:
+    if (status != 0) {
+        error->error = status;
+        error->domain = kCFStreamErrorDomainPOSIX;
+
+        if (result != NULL) {
+            _AresFreeAddrInfo(result);
+            result = NULL;
+        }
+    }
+
+done:
+    return result;
+}
+#endif /* _CFHOST_HAVE_ARES_GETADDRINFO */
 
 /* static */ void
 _AresAccumulateAddrInfo(_CFHostAresRequest *ares_request, struct addrinfo *ai) {
@@ -2063,11 +2427,17 @@ _AresFinalizeForwardDNSLookup(_CFHostAresRequest *ares_request,
 
     __CFHostMaybeLog("Finalizing a name-to-addresses (forward DNS) lookup...\n");
 
+    _AresUpdateHostTimeToLive(ares_request);
+
     _GetAddrInfoCallBackWithFree(eai_status,
                                  ares_request->_request_resolved_addrinfo,
                                  ares_request->_request_host,
                                  free_cb);
 
+    // The addrinfo has been released by the call back.
+
+    ares_request->_request_resolved_addrinfo = NULL;
+
     // Release the buffer that was previously allocated
     // for the lookup name when the request was made.
 
@@ -2097,11 +2467,23 @@ static void
 _AresNullLookupPerform(void *info) {
     _CFHostAresRequest *ares_request = (_CFHostAresRequest *)(info);
 
+    // Finalization cancels the host lookup which, for a shared
+    // request, releases the lookup reference on the request. Hold
+    // another until finalization is complete.
+
+    if (ares_request->_request_shared) {
+        _AresSharedRequestRetain(ares_request);
+    }
+
     if (ares_request->_request_type == kCFHostAddresses) {
         _AresFinalizeForwardDNSLookup(ares_request,
                                       ares_request->_request_final_status);
 
-        _AresDestroyRequestAndChannel(ares_request);
+        if (ares_request->_request_shared) {
+            _AresSharedRequestRelease(ares_request);
+        } else {
+            _AresDestroyRequestAndChannel(ares_request);
+        }
     } else if (ares_request->_request_type == kCFHostNames) {
         const int            eai_status = _AresStatusMapToAddrInfoError(ares_request->_request_final_status);
         FreeNameInfoCallBack free_cb    = _AresFreeNameInfo;
@@ -2126,7 +2508,11 @@ _AresNullLookupPerform(void *info) {
             ares_request->_request_resolved_service = NULL;
         }
 
-        _AresDestroyRequestAndChannel(ares_request);
+        if (ares_request->_request_shared) {
+            _AresSharedRequestRelease(ares_request);
+        } else {
+            _AresDestroyRequestAndChannel(ares_request);
+        }
     }
 
     __CFHostTraceExit();
@@ -2203,6 +2589,41 @@ _AresIsNullLookup(const _CFHostAresRequest *ares_request) {
     return result;
 }
 
+/**
+ *  @brief
+ *    Record the time-to-live of a c-ares forward DNS lookup with its
+ *    host.
+ *
+ *  The address cache uses this, via the #_kCFHostTimeToLive
+ *  information type, to decide how long the resolved addresses may
+ *  be reused. Nothing is recorded if c-ares did not report one.
+ *
+ *  @param[in]  ares_request  A pointer to the c-ares request object
+ *                            for which to record the time-to-live.
+ *
+ */
+/* static */ void
+_AresUpdateHostTimeToLive(_CFHostAresRequest *ares_request) {
+    _CFHost *   host = ares_request->_request_host;
+    CFNumberRef ttl;
+
+    __Require(ares_request->_request_ttl > 0, done);
+
+    ttl = CFNumberCreate(CFGetAllocator((CFHostRef)host),
+                         kCFNumberIntType,
+                         &ares_request->_request_ttl);
+    __Require(ttl != NULL, done);
+
+    _CFHostLock(host);
+    CFDictionarySetValue(host->_info, (const void *)_kCFHostTimeToLive, ttl);
+    _CFHostUnlock(host);
+
+    CFRelease(ttl);
+
+ done:
+    return;
+}
+
 /* static */ void
 _AresUpdateLastStatus(_CFHostAresRequest *ares_request, int status) {
     __CFHostMaybeLog("    Last status was %d (%ssuccessful)\n",
@@ -2214,6 +2635,7 @@ _AresUpdateLastStatus(_CFHostAresRequest *ares_request, int status) {
     }
 }
 
+#if !_CFHOST_HAVE_ARES_GETADDRINFO
 /* static */ void
 _AresHostByCompletedCallBack(void *arg,
                              int status,
@@ -2288,14 +2710,93 @@ _AresHostByCompletedCallBack(void *arg,
         if (is_null) {
             ares_request->_request_final_status = final_status;
 
-            CFRunLoopSourceSignal((CFRunLoopSourceRef)(ares_request->_request_lookup));
+            _AresSignalNullLookup(ares_request);
         } else {
             _AresFinalizeForwardDNSLookup(ares_request, final_status);
         }
     }
 
     _AresUpdateLastStatus(ares_request, status);
+
+    // Once all of its queries are complete, the channel no longer
+    // needs a shared request.
+
+    if (ares_request->_request_pending == 0) {
+        _AresSharedRequestRelease(ares_request);
+    }
+}
+#endif /* !_CFHOST_HAVE_ARES_GETADDRINFO */
+
+#if _CFHOST_HAVE_ARES_GETADDRINFO
+/* static */ void
+_AresAddrInfoCompletedCallBack(void *arg,
+                               int status,
+                               int timeouts,
+                               struct ares_addrinfo *res) {
+    _CFHostAresRequest *ares_request = (_CFHostAresRequest *)(arg);
+    Boolean             is_null;
+
+
+    // A single ares_getaddrinfo request covers both address families,
+    // so this is always the last callback for the lookup.
+
+    ares_request->_request_pending = 0;
+
+    if (status == ARES_SUCCESS) {
+        if (res != NULL) {
+            struct addrinfo *ai;
+
+            ai = _AresAddrInfoToAddrInfo(res, &ares_request->_request_ttl, ares_request->_request_error);
+            if (ai != NULL) {
+                _AresAccumulateAddrInfo(ares_request, ai);
+            }
+        }
+    } else {
+        __CFHostMaybeLog("Forward DNS lookup failed: %d: %s\n",
+                         status, ares_strerror(status));
+    }
+
+    if (res != NULL) {
+        ares_freeaddrinfo(res);
+    }
+
+    // If the lookup was a "fallthrough", socket-free lookup (for
+    // example, a numeric address or one from the local hosts file),
+    // create a null lookup source to keep CFHost common
+    // infrastructure requirements satisfied: there must always be a
+    // lookup source.
+
+    if (ares_request->_request_lookup == NULL) {
+        ares_request->_request_lookup = _AresCreateNullLookup(ares_request);
+        __Require(ares_request->_request_lookup != NULL, done);
+    }
+
+    is_null = _AresIsNullLookup(ares_request);
+
+    __CFHostMaybeLog("    Concluding host lookup w/ %s lookup...\n",
+                     ((is_null) ? "run loop source" : "descriptor"));
+
+    if (is_null) {
+        ares_request->_request_final_status = status;
+
+        _AresSignalNullLookup(ares_request);
+    } else {
+        _AresFinalizeForwardDNSLookup(ares_request, status);
+    }
+
+    _AresUpdateLastStatus(ares_request, status);
+
+    // Once all of its queries are complete, the channel no longer
+    // needs a shared request.
+
+    if (ares_request->_request_pending == 0) {
+        _AresSharedRequestRelease(ares_request);
+    }
+
+ done:
+    return;
 }
+#endif /* _CFHOST_HAVE_ARES_GETADDRINFO */
 
 /* static */ void
 _AresNameInfoCompletedCallBack(void *arg,
@@ -2373,7 +2874,7 @@ _AresNameInfoCompletedCallBack(void *arg,
                 ares_request->_request_resolved_service = strdup(service);
             }
 
-            CFRunLoopSourceSignal((CFRunLoopSourceRef)(ares_request->_request_lookup));
+            _AresSignalNullLookup(ares_request);
         } else {
             // In this non-deferred finalization path, the resolved node or
             // service name storage will be released by c-ares after this
@@ -2391,322 +2892,961 @@ _AresNameInfoCompletedCallBack(void *arg,
     }
 
     _AresUpdateLastStatus(ares_request, status);
-}
 
-/**
- *  @brief
- *    Create and initialize a heap-based c-ares request object and
- *    channel.
- *
- *  This allocates and initializes a heap-based c-ares request object
- *  and channel for use in making forward and reverse DNS lookups via
- *  c-ares.
- *
- *  @param[in]   host           The host, obtained by previously calling
- *                              #CFHostCreateCopy,
- *                              #CFHostCreateWithAddress, or
- *                              #CFHostCreateWithName, for which the
- *                              request object and channel is to be
- *                              created. This value must not be NULL.
- *  @param[in]   sock_state_cb  A pointer to the socket state callback
- *                              that will be invoked on any state
- *                              changes in sockets associated with the
- *                              request and channel.
- *  @param[out]  error          A pointer to a #CFStreamError object
- *                              that will be set if an error occurs
- *                              during allocation and initialization
- *
- *  @returns
- *    A pointer to the allocated and initialized object on success;
- *    otherwise, null.
- *
- */
-/* static */ _CFHostAresRequest *
-_AresCreateRequestAndChannel(_CFHost *host, CFHostInfoType type, ares_sock_state_cb sock_state_cb, CFStreamError *error) {
-    const int            optmask = ARES_OPT_SOCK_STATE_CB;
-    struct ares_options  options;
-    int                  status;
-    _CFHostAresRequest * result = NULL;
+    // Once all of its queries are complete, the channel no longer
+    // needs a shared request.
 
-    __Require(host != NULL, done);
-    __Require(sock_state_cb != NULL, done);
-    __Require(error != NULL, done);
+    if (ares_request->_request_pending == 0) {
+        _AresSharedRequestRelease(ares_request);
+    }
+}
 
-    // Allocate the request object.
+/* static */ CFTypeRef
+_AresCopyConfigurationValue(CFStringRef key) {
+    CFTypeRef result = NULL;
 
-	result = (_CFHostAresRequest *)CFAllocatorAllocate(kCFAllocatorDefault, sizeof(_CFHostAresRequest), 0);
-	__Require_Action(result != NULL,
-					 done,
-					 error->error  = ENOMEM;
-					 error->domain = kCFStreamErrorDomainPOSIX);
+    __CFSpinLock(&_AresConfigurationLock);
 
-    memset(result, 0, sizeof(_CFHostAresRequest));
+    if (CFEqual(key, _kCFHostPropertyResolverSharedChannel)) {
+        result = CFRetain(_AresUseSharedChannel ? kCFBooleanTrue : kCFBooleanFalse);
 
-    // Initialize the c-ares lookup request channel with the socket
-    // state callback option.
+    } else if (CFEqual(key, _kCFHostPropertyResolverServers) && (_AresServers != NULL)) {
+        result = CFStringCreateWithCString(kCFAllocatorDefault, _AresServers, kCFStringEncodingUTF8);
 
-    options.sock_state_cb      = sock_state_cb;
-    options.sock_state_cb_data = result;
+    }
 
-    status = ares_init_options(&result->_request_channel,
-                               &options,
-                               optmask);
-    __Require_Action(status == ARES_SUCCESS,
-                     done,
-                     _AresStatusMapToStreamError(status, error);
-                     CFAllocatorDeallocate(kCFAllocatorDefault, result));
-
-    result->_request_error = error;
-    result->_request_host  = host;
-    result->_request_type  = type;
+    __CFSpinUnlock(&_AresConfigurationLock);
 
- done:
     return result;
 }
 
-/* static */ void
-_AresDestroyRequestAndChannel(_CFHostAresRequest *ares_request) {
-    __Require(ares_request != NULL, done);
+/* static */ Boolean
+_AresSetConfigurationValue(CFStringRef key, CFTypeRef value) {
+    Boolean result = FALSE;
 
-    ares_destroy(ares_request->_request_channel);
+    if (CFEqual(key, _kCFHostPropertyResolverSharedChannel)) {
+        __Require(value != NULL, done);
+        __Require(CFGetTypeID(value) == CFBooleanGetTypeID(), done);
 
-    CFAllocatorDeallocate(kCFAllocatorDefault, ares_request);
+        __CFSpinLock(&_AresConfigurationLock);
+        _AresUseSharedChannel = CFBooleanGetValue((CFBooleanRef)value);
+        __CFSpinUnlock(&_AresConfigurationLock);
 
- done:
-    return;
-}
+        result = TRUE;
 
-/* static */ CFTypeRef
-_CreatePrimaryAddressLookup_Ares(CFStringRef name, CFHostInfoType info, CFTypeRef context, CFStreamError* error) {
-	const CFAllocatorRef allocator = CFGetAllocator(name);
-	UInt8*               buffer;
-    _CFHostAresRequest * ares_request = NULL;
-    Boolean              ipv4only     = FALSE;
-    Boolean              ipv6only     = FALSE;
-    CFFileDescriptorRef  result       = NULL;
+    } else if (CFEqual(key, _kCFHostPropertyResolverServers)) {
+        char *servers = NULL;
 
+        // A NULL value clears the override.
 
-	// Create a CFString representation of the lookup by converting it
-	// into a null-terminated C string buffer consumable by
-	// getaddrinfo_a.
+        if (value != NULL) {
+            CFIndex size;
 
-	buffer = _CFStringToCStringWithError(name, error);
-	__Require(buffer != NULL, done);
+            __Require(CFGetTypeID(value) == CFStringGetTypeID(), done);
 
-	ares_request = _AresCreateRequestAndChannel((_CFHost *)context,
-                                                kCFHostAddresses,
-                                                _AresSocketStateCallBack,
-                                                error);
-	__Require_Action(ares_request != NULL,
-					 done,
-                     CFAllocatorDeallocate(allocator, buffer));
+            size = CFStringGetMaximumSizeForEncoding(CFStringGetLength((CFStringRef)value),
+                                                     kCFStringEncodingUTF8) + 1;
 
-    ares_request->_request_name = (const char *)buffer;
+            servers = (char *)malloc(size);
+            __Require(servers != NULL, done);
 
-	if (info == _kCFHostIPv4Addresses) {
-        ipv4only = TRUE;
-        ares_request->_request_pending = 1;
-	} else if (info == _kCFHostIPv6Addresses) {
-        ipv6only = TRUE;
-        ares_request->_request_pending = 1;
-	} else {
-        ares_request->_request_pending = 2;
-    }
+            __Require_Action(CFStringGetCString((CFStringRef)value, servers, size, kCFStringEncodingUTF8),
+                             done,
+                             free(servers));
+        }
 
-    if (!ipv6only) {
-        ares_gethostbyname(ares_request->_request_channel,
-                           ares_request->_request_name,
-                           AF_INET,
-                           _AresHostByCompletedCallBack,
-                           ares_request);
-    }
+        // If the shared channel is already running, it must pick up
+        // new servers, too; c-ares refuses while it has queries
+        // outstanding. There is no going back to the system servers
+        // for it, however, short of reinitializing it.
 
-    if (!ipv4only) {
-        ares_gethostbyname(ares_request->_request_channel,
-                           ares_request->_request_name,
-                           AF_INET6,
-                           _AresHostByCompletedCallBack,
-                           ares_request);
+        _CFMutexLock(&_AresSharedChannel._lock);
+
+        __CFSpinLock(&_AresConfigurationLock);
+
+        if (_AresServers != NULL) {
+            free(_AresServers);
+        }
+
+        _AresServers = servers;
+
+        if (_AresSharedChannel._valid && (servers != NULL)) {
+            result = (ares_set_servers_ports_csv(_AresSharedChannel._channel, servers) == ARES_SUCCESS);
+        } else {
+            result = TRUE;
+        }
+
+        __CFSpinUnlock(&_AresConfigurationLock);
+
+        _CFMutexUnlock(&_AresSharedChannel._lock);
     }
 
-    result = ares_request->_request_lookup;
+ done:
+    return result;
+}
+
+/**
+ *  @brief
+ *    Apply any server override to a c-ares channel.
+ *
+ *  @note
+ *    The caller must hold _AresConfigurationLock.
+ *
+ *  @param[in]  channel  The channel to which to apply the override.
+ *
+ */
+/* static */ void
+_AresApplyServers_NoLock(ares_channel channel) {
+    int status;
+
+    __Require(_AresServers != NULL, done);
+
+    status = ares_set_servers_ports_csv(channel, _AresServers);
+    __Verify(status == ARES_SUCCESS);
 
  done:
-	return result;
+    return;
 }
-#endif /* HAVE_ARES_INIT && 1 */
-#endif /* #if defined(__linux__) */
 
-/* static */ CFTypeRef
-_CreateAddressLookup(CFStringRef name, CFHostInfoType info, void* context, CFStreamError* error) {
-	Boolean started = FALSE;
-	CFTypeRef result = NULL;
+/**
+ *  @brief
+ *    Determine whether new lookups should use the shared channel.
+ *
+ *  This starts the shared channel and its thread on first use.
+ *
+ *  @returns
+ *    True if _kCFHostPropertyResolverSharedChannel is set and the
+ *    shared channel is running; otherwise, false.
+ *
+ */
+/* static */ Boolean
+_AresSharedChannelIsEnabled(void) {
+    Boolean result;
 
-	memset(error, 0, sizeof(error[0]));
+    __CFSpinLock(&_AresConfigurationLock);
+    result = _AresUseSharedChannel;
+    __CFSpinUnlock(&_AresConfigurationLock);
 
-	if (info == _kCFHostMasterAddressLookup)
-		result = _CreateMasterAddressLookup(name, info, context, error);
+    __Require(result, done);
 
-	else {
-		CFHostRef host = NULL;
-		CFMutableArrayRef list = NULL;
+    _CFDoOnce(&_kCFHostInitializeAresSharedChannel, _AresSharedChannelInitialize);
 
-		/* Lock the master lookups list and cache */
-		_CFMutexLock(_HostLock);
+    _CFMutexLock(&_AresSharedChannel._lock);
+    result = _AresSharedChannel._valid;
+    _CFMutexUnlock(&_AresSharedChannel._lock);
 
-		/* Get the list with the host lookup and other sources for this name */
-		list = (CFMutableArrayRef)CFDictionaryGetValue(_HostLookups, name);
+ done:
+    return result;
+}
 
-		/* Get the host if there is a list.  Host is at index zero. */
-		if (list)
-			host = (CFHostRef)CFArrayGetValueAtIndex(list, 0);
+/**
+ *  Initialize the shared c-ares channel, its wake up pipe, and the
+ *  thread that services them.
+ *
+ */
+/* static */ void
+_AresSharedChannelInitialize(void) {
+    _CFHostAresSharedChannel * shared = &_AresSharedChannel;
+    int                        i;
+    int                        status;
 
-		/* If there is no list, this is the first; so set everything up. */
-		else {
+    shared->_wakeup[0] = shared->_wakeup[1] = -1;
 
-			/* Create the list to hold the host and sources. */
-			list = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+    status = pipe(shared->_wakeup);
+    __Require(status == 0, done);
 
-			/* Set up the error in case the list wasn't created. */
-			if (!list) {
-				error->error = ENOMEM;
-				error->domain = kCFStreamErrorDomainPOSIX;
-			}
+    for (i = 0; i < 2; i++) {
+        fcntl(shared->_wakeup[i], F_SETFL, fcntl(shared->_wakeup[i], F_GETFL) | O_NONBLOCK);
+        fcntl(shared->_wakeup[i], F_SETFD, FD_CLOEXEC);
+    }
 
-			else {
+    _CFMutexLock(&shared->_lock);
 
-				name = CFStringCreateCopy(kCFAllocatorDefault, name);
+    status = ares_init(&shared->_channel);
+    __Require(status == ARES_SUCCESS, unlock);
 
-				/* Add the list of clients for the name to the dictionary. */
-				CFDictionaryAddValue(_HostLookups, name, list);
+    __CFSpinLock(&_AresConfigurationLock);
+    _AresApplyServers_NoLock(shared->_channel);
+    __CFSpinUnlock(&_AresConfigurationLock);
 
-				CFRelease(name);
+    status = _CFThreadSpawn(&shared->_thread, _AresSharedChannelMain, shared);
+    __Require(status == 0, destroy_channel);
 
-				/* Dictionary holds it now. */
-				CFRelease(list);
+    shared->_valid = TRUE;
 
-				/* Make the real lookup. */
-				host = CFHostCreateWithName(kCFAllocatorDefault, name);
+    _CFMutexUnlock(&shared->_lock);
 
-				if (!host) {
-					error->error = ENOMEM;
-					error->domain = kCFStreamErrorDomainPOSIX;
-				}
+    goto done;
 
-				else {
-					CFHostClientContext ctxt = {0, (void*)name, CFRetain, CFRelease, CFCopyDescription};
+ destroy_channel:
+    ares_destroy(shared->_channel);
 
-					/* Place the CFHost at index 0. */
-					CFArrayAppendValue(list, host);
+ unlock:
+    _CFMutexUnlock(&shared->_lock);
 
-					/* The list holds it now. */
-					CFRelease(host);
+ close_pipe:
+    close(shared->_wakeup[0]);
+    close(shared->_wakeup[1]);
 
-                    // Kick off an internal, asynchronous resolution
-                    // that will nest with the external resolution. It
-                    // is definitionally asynchronous because a
-                    // internal asynchronous client callback is set,
-                    // which may not be the case with the outer
-                    // resolution that triggered this one.
+ done:
+    return;
+}
 
-					// Set the asynchronous client callback.
+/**
+ *  @brief
+ *    The body of the thread servicing the shared c-ares channel.
+ *
+ *  This polls the channel sockets and the wake up pipe, bounded by
+ *  the earliest channel timeout, and then lets c-ares process
+ *  whatever became ready or timed out. Query completion call backs
+ *  are therefore invoked on this thread, with the channel locked.
+ *
+ *  Should poll itself fail, for other than an interruption, the
+ *  outstanding queries are failed, so that no lookup waits on a
+ *  channel that cannot be serviced, and the thread backs off before
+ *  polling again.
+ *
+ *  @param[in]  context  A pointer to the shared channel.
+ *
+ */
+/* static */ void *
+_AresSharedChannelMain(void *context) {
+    _CFHostAresSharedChannel * shared  = (_CFHostAresSharedChannel *)(context);
+    int                        backoff = _kCFHostAresPollBackoffMinimum;
+
+    while (TRUE) {
+        ares_socket_t   socks[ARES_GETSOCK_MAXNUM];
+        struct pollfd   fds[ARES_GETSOCK_MAXNUM + 1];
+        struct timeval  tv;
+        struct timeval *tvp;
+        nfds_t          nfds    = 0;
+        int             timeout = -1;
+        int             bits;
+        int             i;
+        int             status;
+
+        fds[nfds].fd      = shared->_wakeup[0];
+        fds[nfds].events  = POLLIN;
+        fds[nfds].revents = 0;
+        nfds++;
+
+        _CFMutexLock(&shared->_lock);
+
+        bits = ares_getsock(shared->_channel, socks, ARES_GETSOCK_MAXNUM);
+
+        for (i = 0; i < ARES_GETSOCK_MAXNUM; i++) {
+            short events = 0;
+
+            if (ARES_GETSOCK_READABLE(bits, i))
+                events |= POLLIN;
+
+            if (ARES_GETSOCK_WRITABLE(bits, i))
+                events |= POLLOUT;
+
+            if (events != 0) {
+                fds[nfds].fd      = socks[i];
+                fds[nfds].events  = events;
+                fds[nfds].revents = 0;
+                nfds++;
+            }
+        }
 
-					CFHostSetClient(host, (CFHostClientCallBack)_PrimaryLookupCallBack, &ctxt);
+        tvp = ares_timeout(shared->_channel, NULL, &tv);
 
-					// Kick off the internal, asynchronous nested
-					// resolution.
+        _CFMutexUnlock(&shared->_lock);
 
-					started = CFHostStartInfoResolution(host, _kCFHostMasterAddressLookup, error);
-					if (!started) {
-						// It is absolutely imperative that
-						// CFHostStartInfoResolution (or its
-						// info-type-specific helpers) set an error of
-						// some sort if it (they) failed. In response
-						// to failure, the name/list key/value pair
-						// will be removed from _HostLookups and,
-						// along with them, the host will then be
-						// invalid and go out of scope.
-						//
-						// If processing continues on the false
-						// assumption that there were no errors,
-						// execution flow will fault when the newly
-						// created run loop source below is added to a
-						// list that is no longer valid.
+        if (tvp != NULL) {
+            timeout = (tvp->tv_sec * 1000) + ((tvp->tv_usec + 999) / 1000);
+        }
 
-						// CFAssert2(error->error != 0, __kCFLogAssertion, ""resolution failed but error is not set");
+        status = poll(fds, nfds, timeout);
+        if ((status < 0) && (errno != EINTR)) {
+            __CFHostMaybeLog("Shared channel poll failed: %d\n", errno);
 
-						CFHostSetClient(host, NULL, NULL);
+            _CFMutexLock(&shared->_lock);
+            ares_cancel(shared->_channel);
+            _CFMutexUnlock(&shared->_lock);
 
-						/* If it failed, don't keep it in the outstanding lookups list. */
-						CFDictionaryRemoveValue(_HostLookups, name);
+            poll(NULL, 0, backoff);
 
-						// Name, host, and list are no longer valid
-						// and in scope at this point. A stream error
-						// MUST be set, per the comment above or any
-						// manipulation of name, list, or host
-						// hereafter will fault.
-					}
-				}
-			}
-		}
+            if (backoff < _kCFHostAresPollBackoffMaximum) {
+                backoff *= 2;
+            }
 
-		/* Everything is still good? */
-		if (started && !error->error) {
+            continue;
+        }
 
-			CFRunLoopSourceContext ctxt = {
-				0,
-				context,
-				CFRetain,
-				CFRelease,
-				CFCopyDescription,
-				NULL,
-				NULL,
-				(void (*)(void*, CFRunLoopRef, CFStringRef))_AddressLookupSchedule_NoLock,
-				NULL,
-				(void (*)(void*))_AddressLookupPerform
-			};
+        backoff = _kCFHostAresPollBackoffMinimum;
 
-			/* Create the lookup source.  This source will be signalled once the shared lookup finishes. */
-			result = CFRunLoopSourceCreate(CFGetAllocator(name), 0, &ctxt);
+        // Drain the wake up pipe. Its only purpose was to get the
+        // newly-submitted queries' sockets into the next poll.
 
-			/* If it succeed, add it to the list of other pending clients. */
-			if (result) {
-				CFArrayAppendValue(list, result);
-			}
+        if (fds[0].revents & POLLIN) {
+            char buffer[64];
 
-			else {
+            while (read(shared->_wakeup[0], buffer, sizeof(buffer)) > 0)
+                continue;
+        }
 
-				error->error = ENOMEM;
-				error->domain = kCFStreamErrorDomainPOSIX;
+        _CFMutexLock(&shared->_lock);
 
-				/* If this was going to be the only client, need to clean up. */
-				if (host && CFArrayGetCount(list) == 1) {
+        for (i = 1; i < (int)nfds; i++) {
+            const short revents = fds[i].revents;
 
-					/* NULL the client for the Mmster lookup and cancel it. */
-					CFHostSetClient(host, NULL, NULL);
-					CFHostCancelInfoResolution(host, _kCFHostMasterAddressLookup);
+            if (revents != 0) {
+                ares_process_fd(shared->_channel,
+                                (revents & (POLLIN | POLLERR | POLLHUP)) ? fds[i].fd : ARES_SOCKET_BAD,
+                                (revents & POLLOUT) ? fds[i].fd : ARES_SOCKET_BAD);
+            }
+        }
 
-					/* Remove it from the list of pending lookups and clients. */
-					CFDictionaryRemoveValue(_HostLookups, name);
-				}
-			}
-		}
+        // Let c-ares retry or fail any queries that timed out.
 
-		_CFMutexUnlock(_HostLock);
-	}
+        ares_process_fd(shared->_channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
 
-	return result;
-}
+        _CFMutexUnlock(&shared->_lock);
+    }
 
-/* static */ CFTypeRef
-_CreateNameLookup(CFDataRef address, void* context, CFStreamError* error) {
-	CFTypeRef result = NULL;
+    return NULL;
+}
 
-#if defined(__MACH__)
-	result = _CreateNameLookup_Mach(address, context, error);
-#elif defined(__linux__)
-# if HAVE_ARES_INIT && 1
-    result = _CreateNameLookup_Ares(address, context, error);
+/**
+ *  @brief
+ *    Prepare to submit queries for a request.
+ *
+ *  For a shared request, this locks the shared channel. Completion
+ *  call backs for queries satisfied without the network (for example,
+ *  from the local hosts file) may be invoked before submission
+ *  returns.
+ *
+ *  @param[in]  ares_request  A pointer to the c-ares request object
+ *                            for which queries will be submitted.
+ *
+ */
+/* static */ void
+_AresSharedChannelBeginQueries(_CFHostAresRequest *ares_request) {
+    if (ares_request->_request_shared) {
+        _CFMutexLock(&_AresSharedChannel._lock);
+    }
+}
+
+/**
+ *  @brief
+ *    Conclude submitting queries for a request.
+ *
+ *  For a shared request, this unlocks the shared channel and wakes
+ *  its thread so that it polls any sockets the queries opened.
+ *
+ *  @param[in]  ares_request  A pointer to the c-ares request object
+ *                            for which queries were submitted.
+ *
+ */
+/* static */ void
+_AresSharedChannelEndQueries(_CFHostAresRequest *ares_request) {
+    if (ares_request->_request_shared) {
+        static const char kWakeUp = 0;
+        ssize_t           status;
+
+        _CFMutexUnlock(&_AresSharedChannel._lock);
+
+        status = write(_AresSharedChannel._wakeup[1], &kWakeUp, sizeof(kWakeUp));
+        __Verify((status == sizeof(kWakeUp)) || (errno == EAGAIN));
+    }
+}
+
+/* static */ void
+_AresSharedRequestRetain(_CFHostAresRequest *ares_request) {
+    __CFSpinLock(&ares_request->_request_lock);
+    ares_request->_request_refs++;
+    __CFSpinUnlock(&ares_request->_request_lock);
+}
+
+/**
+ *  @brief
+ *    Release a reference on a shared request, destroying it when
+ *    neither its host lookup nor its channel queries need it any
+ *    longer.
+ *
+ *  This has no effect on requests that own their channel.
+ *
+ *  @param[in]  ares_request  A pointer to the c-ares request object
+ *                            to release.
+ *
+ */
+/* static */ void
+_AresSharedRequestRelease(_CFHostAresRequest *ares_request) {
+    CFIndex refs;
+
+    __Require(ares_request->_request_shared, done);
+
+    __CFSpinLock(&ares_request->_request_lock);
+    refs = --ares_request->_request_refs;
+    __CFSpinUnlock(&ares_request->_request_lock);
+
+    if (refs == 0) {
+        _AresDestroyRequestAndChannel(ares_request);
+    }
+
+ done:
+    return;
+}
+
+/**
+ *  @brief
+ *    Create the run loop source lookup for a shared request.
+ *
+ *  Like a "null" lookup, this source is signalled when the request's
+ *  queries complete and finalizes the lookup when performed. Unlike
+ *  one, it tracks the run loops on which it is scheduled so that they
+ *  may be woken from the shared channel thread, and canceling it does
+ *  not cancel the (shared) channel.
+ *
+ *  @param[in,out]  ares_request  A pointer to the c-ares request
+ *                                object for which the lookup is to be
+ *                                created.
+ *
+ *  @returns
+ *    A pointer to the lookup object.
+ *
+ */
+/* static */ CFRunLoopSourceRef
+_AresSharedLookupCreate(_CFHostAresRequest *ares_request) {
+    const CFAllocatorRef   allocator = CFGetAllocator(ares_request->_request_host);
+    CFRunLoopSourceContext context = {
+        0,                           // Version
+        ares_request,                // Info
+        NULL,                        // Retain
+        NULL,                        // Release
+        NULL,                        // Describe
+        NULL,                        // Equal
+        NULL,                        // Hash
+        _AresSharedLookupSchedule,   // Schedule
+        _AresSharedLookupUnschedule, // Cancel
+        _AresNullLookupPerform       // Perform
+    };
+
+    return CFRunLoopSourceCreate(allocator, 0, &context);
+}
+
+/* static */ void
+_AresSharedLookupSchedule(void *info, CFRunLoopRef rl, CFStringRef mode) {
+    _CFHostAresRequest *ares_request = (_CFHostAresRequest *)(info);
+
+    __CFSpinLock(&ares_request->_request_lock);
+    CFArrayAppendValue(ares_request->_request_run_loops, rl);
+    __CFSpinUnlock(&ares_request->_request_lock);
+}
+
+/* static */ void
+_AresSharedLookupUnschedule(void *info, CFRunLoopRef rl, CFStringRef mode) {
+    _CFHostAresRequest *ares_request = (_CFHostAresRequest *)(info);
+    CFIndex             index;
+
+    __CFSpinLock(&ares_request->_request_lock);
+
+    index = CFArrayGetFirstIndexOfValue(ares_request->_request_run_loops,
+                                        CFRangeMake(0, CFArrayGetCount(ares_request->_request_run_loops)),
+                                        rl);
+    if (index != kCFNotFound) {
+        CFArrayRemoveValueAtIndex(ares_request->_request_run_loops, index);
+    }
+
+    __CFSpinUnlock(&ares_request->_request_lock);
+}
+
+/**
+ *  @brief
+ *    Signal the lookup of a shared request and wake the run loops on
+ *    which it is scheduled.
+ *
+ *  @param[in]  ares_request  A pointer to the c-ares request object
+ *                            whose lookup is to be signalled.
+ *
+ */
+/* static */ void
+_AresSharedLookupSignal(_CFHostAresRequest *ares_request) {
+    CFArrayRef run_loops;
+    CFIndex    i;
+
+    CFRunLoopSourceSignal((CFRunLoopSourceRef)(ares_request->_request_lookup));
+
+    __CFSpinLock(&ares_request->_request_lock);
+    run_loops = CFArrayCreateCopy(kCFAllocatorDefault, ares_request->_request_run_loops);
+    __CFSpinUnlock(&ares_request->_request_lock);
+
+    __Require(run_loops != NULL, done);
+
+    for (i = 0; i < CFArrayGetCount(run_loops); i++) {
+        CFRunLoopWakeUp((CFRunLoopRef)CFArrayGetValueAtIndex(run_loops, i));
+    }
+
+    CFRelease(run_loops);
+
+ done:
+    return;
+}
+
+/**
+ *  @brief
+ *    Detach a host from the shared request behind its lookup.
+ *
+ *  This is how a host lookup is canceled on the shared channel. The
+ *  channel queries cannot be individually canceled, so they are left
+ *  to complete and the request is destroyed once they have.
+ *
+ *  @note
+ *    The lookup must already be invalidated.
+ *
+ *  @param[in]  lookup  The host lookup, which need not be for a
+ *                      shared request.
+ *
+ */
+/* static */ void
+_AresSharedLookupDetach(CFTypeRef lookup) {
+    CFRunLoopSourceContext context;
+
+    __Require(CFGetTypeID(lookup) == CFRunLoopSourceGetTypeID(), done);
+
+    CFRunLoopSourceGetContext((CFRunLoopSourceRef)(lookup), &context);
+    __Require(context.schedule == _AresSharedLookupSchedule, done);
+
+    _AresSharedRequestRelease((_CFHostAresRequest *)(context.info));
+
+ done:
+    return;
+}
+
+/**
+ *  Signal the "null" or shared lookup of a request whose queries are
+ *  complete so that it is finalized from the run loop.
+ *
+ */
+/* static */ void
+_AresSignalNullLookup(_CFHostAresRequest *ares_request) {
+    if (ares_request->_request_shared) {
+        _AresSharedLookupSignal(ares_request);
+    } else {
+        CFRunLoopSourceSignal((CFRunLoopSourceRef)(ares_request->_request_lookup));
+    }
+}
+
+/**
+ *  @brief
+ *    Create and initialize a heap-based c-ares request object and
+ *    channel.
+ *
+ *  This allocates and initializes a heap-based c-ares request object
+ *  and channel for use in making forward and reverse DNS lookups via
+ *  c-ares.
+ *
+ *  @param[in]   host           The host, obtained by previously calling
+ *                              #CFHostCreateCopy,
+ *                              #CFHostCreateWithAddress, or
+ *                              #CFHostCreateWithName, for which the
+ *                              request object and channel is to be
+ *                              created. This value must not be NULL.
+ *  @param[in]   sock_state_cb  A pointer to the socket state callback
+ *                              that will be invoked on any state
+ *                              changes in sockets associated with the
+ *                              request and channel.
+ *  @param[out]  error          A pointer to a #CFStreamError object
+ *                              that will be set if an error occurs
+ *                              during allocation and initialization
+ *
+ *  @returns
+ *    A pointer to the allocated and initialized object on success;
+ *    otherwise, null.
+ *
+ */
+/* static */ _CFHostAresRequest *
+_AresCreateRequestAndChannel(_CFHost *host, CFHostInfoType type, ares_sock_state_cb sock_state_cb, CFStreamError *error) {
+    const int            optmask = ARES_OPT_SOCK_STATE_CB;
+    struct ares_options  options;
+    int                  status;
+    _CFHostAresRequest * result = NULL;
+
+    __Require(host != NULL, done);
+    __Require(sock_state_cb != NULL, done);
+    __Require(error != NULL, done);
+
+    // Allocate the request object.
+
+	result = (_CFHostAresRequest *)CFAllocatorAllocate(kCFAllocatorDefault, sizeof(_CFHostAresRequest), 0);
+	__Require_Action(result != NULL,
+					 done,
+					 error->error  = ENOMEM;
+					 error->domain = kCFStreamErrorDomainPOSIX);
+
+    memset(result, 0, sizeof(_CFHostAresRequest));
+
+    result->_request_ttl = -1;
+
+    // If sharing, there is no channel to initialize; queries will be
+    // multiplexed over the shared channel. Instead, the request
+    // carries its own lookup, with one reference for it and another
+    // for the queries.
+
+    if (_AresSharedChannelIsEnabled()) {
+        CF_SPINLOCK_INIT_FOR_STRUCTS(result->_request_lock);
+
+        result->_request_shared    = TRUE;
+        result->_request_refs      = 2;
+        result->_request_channel   = _AresSharedChannel._channel;
+        result->_request_error     = &result->_request_shared_error;
+        result->_request_host      = host;
+        result->_request_type      = type;
+        result->_request_run_loops = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+        __Require_Action(result->_request_run_loops != NULL,
+                         done,
+                         error->error  = ENOMEM;
+                         error->domain = kCFStreamErrorDomainPOSIX;
+                         CFAllocatorDeallocate(kCFAllocatorDefault, result);
+                         result = NULL);
+
+        // The host owns the created lookup; retain it for the
+        // request, too, since the queries may complete after the host
+        // has released it.
+
+        result->_request_lookup = _AresSharedLookupCreate(result);
+        __Require_Action(result->_request_lookup != NULL,
+                         done,
+                         error->error  = ENOMEM;
+                         error->domain = kCFStreamErrorDomainPOSIX;
+                         CFRelease(result->_request_run_loops);
+                         CFAllocatorDeallocate(kCFAllocatorDefault, result);
+                         result = NULL);
+
+        CFRetain(result->_request_lookup);
+
+        goto done;
+    }
+
+    // Initialize the c-ares lookup request channel with the socket
+    // state callback option.
+
+    options.sock_state_cb      = sock_state_cb;
+    options.sock_state_cb_data = result;
+
+    status = ares_init_options(&result->_request_channel,
+                               &options,
+                               optmask);
+    __Require_Action(status == ARES_SUCCESS,
+                     done,
+                     _AresStatusMapToStreamError(status, error);
+                     CFAllocatorDeallocate(kCFAllocatorDefault, result);
+                     result = NULL);
+
+    __CFSpinLock(&_AresConfigurationLock);
+    _AresApplyServers_NoLock(result->_request_channel);
+    __CFSpinUnlock(&_AresConfigurationLock);
+
+    result->_request_error = error;
+    result->_request_host  = host;
+    result->_request_type  = type;
+
+ done:
+    return result;
+}
+
+/* static */ void
+_AresDestroyRequestAndChannel(_CFHostAresRequest *ares_request) {
+    __Require(ares_request != NULL, done);
+
+    // A shared request doesn't own its channel but does own its
+    // lookup and whatever results were never finalized because the
+    // lookup was canceled.
+
+    if (ares_request->_request_shared) {
+        if (ares_request->_request_name != NULL) {
+            CFAllocatorDeallocate(kCFAllocatorDefault,
+                                  (void *)ares_request->_request_name);
+        }
+
+        _AresFreeAddrInfo(ares_request->_request_resolved_addrinfo);
+        _AresFreeNameInfo(ares_request->_request_resolved_node,
+                          ares_request->_request_resolved_service);
+
+        CFRelease(ares_request->_request_run_loops);
+        CFRelease(ares_request->_request_lookup);
+    } else {
+        ares_destroy(ares_request->_request_channel);
+    }
+
+    CFAllocatorDeallocate(kCFAllocatorDefault, ares_request);
+
+ done:
+    return;
+}
+
+/* static */ CFTypeRef
+_CreatePrimaryAddressLookup_Ares(CFStringRef name, CFHostInfoType info, CFTypeRef context, CFStreamError* error) {
+	const CFAllocatorRef allocator = CFGetAllocator(name);
+	UInt8*               buffer;
+    _CFHostAresRequest * ares_request = NULL;
+#if !_CFHOST_HAVE_ARES_GETADDRINFO
+    Boolean              ipv4only     = FALSE;
+    Boolean              ipv6only     = FALSE;
+#endif /* !_CFHOST_HAVE_ARES_GETADDRINFO */
+    CFFileDescriptorRef  result       = NULL;
+
+
+	// Create a CFString representation of the lookup by converting it
+	// into a null-terminated C string buffer consumable by
+	// getaddrinfo_a.
+
+	buffer = _CFStringToCStringWithError(name, error);
+	__Require(buffer != NULL, done);
+
+	ares_request = _AresCreateRequestAndChannel((_CFHost *)context,
+                                                kCFHostAddresses,
+                                                _AresSocketStateCallBack,
+                                                error);
+	__Require_Action(ares_request != NULL,
+					 done,
+                     CFAllocatorDeallocate(allocator, buffer));
+
+    ares_request->_request_name = (const char *)buffer;
+
+    _AresSharedChannelBeginQueries(ares_request);
+
+#if _CFHOST_HAVE_ARES_GETADDRINFO
+    // Prefer a single ares_getaddrinfo request for both address
+    // families since, unlike ares_gethostbyname, it reports the
+    // record time-to-live used by the address cache.
+
+    {
+        struct ares_addrinfo_hints hints;
+
+        memset(&hints, 0, sizeof(hints));
+
+        if (info == _kCFHostIPv4Addresses) {
+            hints.ai_family = AF_INET;
+        } else if (info == _kCFHostIPv6Addresses) {
+            hints.ai_family = AF_INET6;
+        } else {
+            hints.ai_family = AF_UNSPEC;
+        }
+
+        hints.ai_socktype = SOCK_STREAM;
+
+        ares_request->_request_pending = 1;
+
+        ares_getaddrinfo(ares_request->_request_channel,
+                         ares_request->_request_name,
+                         NULL,
+                         &hints,
+                         _AresAddrInfoCompletedCallBack,
+                         ares_request);
+    }
+#else
+	if (info == _kCFHostIPv4Addresses) {
+        ipv4only = TRUE;
+        ares_request->_request_pending = 1;
+	} else if (info == _kCFHostIPv6Addresses) {
+        ipv6only = TRUE;
+        ares_request->_request_pending = 1;
+	} else {
+        ares_request->_request_pending = 2;
+    }
+
+    if (!ipv6only) {
+        ares_gethostbyname(ares_request->_request_channel,
+                           ares_request->_request_name,
+                           AF_INET,
+                           _AresHostByCompletedCallBack,
+                           ares_request);
+    }
+
+    if (!ipv4only) {
+        ares_gethostbyname(ares_request->_request_channel,
+                           ares_request->_request_name,
+                           AF_INET6,
+                           _AresHostByCompletedCallBack,
+                           ares_request);
+    }
+
+#endif /* _CFHOST_HAVE_ARES_GETADDRINFO */
+
+    _AresSharedChannelEndQueries(ares_request);
+
+    result = ares_request->_request_lookup;
+
+ done:
+	return result;
+}
+#endif /* HAVE_ARES_INIT && 1 */
+#endif /* #if defined(__linux__) */
+
+/* static */ CFTypeRef
+_CreateAddressLookup(CFStringRef name, CFHostInfoType info, void* context, CFStreamError* error) {
+	Boolean started = FALSE;
+	CFTypeRef result = NULL;
+
+	memset(error, 0, sizeof(error[0]));
+
+	if (info == _kCFHostMasterAddressLookup)
+		result = _CreateMasterAddressLookup(name, info, context, error);
+
+	else {
+		CFHostRef host = NULL;
+		CFMutableArrayRef list = NULL;
+
+		/* Lock the master lookups list and cache */
+		_CFMutexLock(_HostLock);
+
+		/* Get the list with the host lookup and other sources for this name */
+		list = (CFMutableArrayRef)CFDictionaryGetValue(_HostLookups, name);
+
+		/* Get the host if there is a list.  Host is at index zero. */
+		if (list)
+			host = (CFHostRef)CFArrayGetValueAtIndex(list, 0);
+
+		/* If there is no list, this is the first; so set everything up. */
+		else {
+
+			/* Create the list to hold the host and sources. */
+			list = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+
+			/* Set up the error in case the list wasn't created. */
+			if (!list) {
+				error->error = ENOMEM;
+				error->domain = kCFStreamErrorDomainPOSIX;
+			}
+
+			else {
+
+				name = CFStringCreateCopy(kCFAllocatorDefault, name);
+
+				/* Add the list of clients for the name to the dictionary. */
+				CFDictionaryAddValue(_HostLookups, name, list);
+
+				CFRelease(name);
+
+				/* Dictionary holds it now. */
+				CFRelease(list);
+
+				/* Make the real lookup. */
+				host = CFHostCreateWithName(kCFAllocatorDefault, name);
+
+				if (!host) {
+					error->error = ENOMEM;
+					error->domain = kCFStreamErrorDomainPOSIX;
+				}
+
+				else {
+					CFHostClientContext ctxt = {0, (void*)name, CFRetain, CFRelease, CFCopyDescription};
+
+					/* Place the CFHost at index 0. */
+					CFArrayAppendValue(list, host);
+
+					/* The list holds it now. */
+					CFRelease(host);
+
+                    // Kick off an internal, asynchronous resolution
+                    // that will nest with the external resolution. It
+                    // is definitionally asynchronous because a
+                    // internal asynchronous client callback is set,
+                    // which may not be the case with the outer
+                    // resolution that triggered this one.
+
+					// Set the asynchronous client callback.
+
+					CFHostSetClient(host, (CFHostClientCallBack)_PrimaryLookupCallBack, &ctxt);
+
+					// Kick off the internal, asynchronous nested
+					// resolution.
+
+					started = CFHostStartInfoResolution(host, _kCFHostMasterAddressLookup, error);
+					if (!started) {
+						// It is absolutely imperative that
+						// CFHostStartInfoResolution (or its
+						// info-type-specific helpers) set an error of
+						// some sort if it (they) failed. In response
+						// to failure, the name/list key/value pair
+						// will be removed from _HostLookups and,
+						// along with them, the host will then be
+						// invalid and go out of scope.
+						//
+						// If processing continues on the false
+						// assumption that there were no errors,
+						// execution flow will fault when the newly
+						// created run loop source below is added to a
+						// list that is no longer valid.
+
+						// CFAssert2(error->error != 0, __kCFLogAssertion, ""resolution failed but error is not set");
+
+						CFHostSetClient(host, NULL, NULL);
+
+						/* If it failed, don't keep it in the outstanding lookups list. */
+						CFDictionaryRemoveValue(_HostLookups, name);
+
+						// Name, host, and list are no longer valid
+						// and in scope at this point. A stream error
+						// MUST be set, per the comment above or any
+						// manipulation of name, list, or host
+						// hereafter will fault.
+					}
+				}
+			}
+		}
+
+		/* Everything is still good? */
+		if (started && !error->error) {
+
+			CFRunLoopSourceContext ctxt = {
+				0,
+				context,
+				CFRetain,
+				CFRelease,
+				CFCopyDescription,
+				NULL,
+				NULL,
+				(void (*)(void*, CFRunLoopRef, CFStringRef))_AddressLookupSchedule_NoLock,
+				NULL,
+				(void (*)(void*))_AddressLookupPerform
+			};
+
+			/* Create the lookup source.  This source will be signalled once the shared lookup finishes. */
+			result = CFRunLoopSourceCreate(CFGetAllocator(name), 0, &ctxt);
+
+			/* If it succeed, add it to the list of other pending clients. */
+			if (result) {
+				CFArrayAppendValue(list, result);
+			}
+
+			else {
+
+				error->error = ENOMEM;
+				error->domain = kCFStreamErrorDomainPOSIX;
+
+				/* If this was going to be the only client, need to clean up. */
+				if (host && CFArrayGetCount(list) == 1) {
+
+					/* NULL the client for the Mmster lookup and cancel it. */
+					CFHostSetClient(host, NULL, NULL);
+					CFHostCancelInfoResolution(host, _kCFHostMasterAddressLookup);
+
+					/* Remove it from the list of pending lookups and clients. */
+					CFDictionaryRemoveValue(_HostLookups, name);
+				}
+			}
+		}
+
+		_CFMutexUnlock(_HostLock);
+	}
+
+	return result;
+}
+
+/* static */ CFTypeRef
+_CreateNameLookup(CFDataRef address, void* context, CFStreamError* error) {
+	CFTypeRef result = NULL;
+
+#if defined(__MACH__)
+	result = _CreateNameLookup_Mach(address, context, error);
+#elif defined(__linux__)
+# if HAVE_ARES_INIT && 1
+    result = _CreateNameLookup_Ares(address, context, error);
 # else
 #  error "No Linux name (Reverse DNS) lookup implementation!"
 # endif /* HAVE_ARES_INIT && 1 */
@@ -2714,1035 +3854,1776 @@ _CreateNameLookup(CFDataRef address, void* context, CFStreamError* error) {
 #warning "Platform portability issue!"
 #endif /* defined(__MACH__) */
 
-	return result;
+	return result;
+}
+
+#if defined(__MACH__)
+/* static */ CFMachPortRef
+_CreateNameLookup_Mach(CFDataRef address, void* context, CFStreamError* error) {
+
+	mach_port_t prt = MACH_PORT_NULL;
+	CFMachPortRef result = NULL;
+
+	CFMachPortContext ctxt = {0, (void*)context, CFRetain, CFRelease, CFCopyDescription};
+	struct sockaddr* sa = (struct sockaddr*)CFDataGetBytePtr(address);
+
+	// Start the async lookup
+	error->error = getnameinfo_async_start(&prt, sa, sa->sa_len, 0, _GetNameInfoCallBack, (void*)context);
+
+	// If the callback port was created, attempt to create the CFMachPort wrapper on it.
+	if (!prt ||
+		!(result = CFMachPortCreateWithPort(CFGetAllocator(address), prt, _GetNameInfoMachPortCallBack, &ctxt, NULL)))
+	{
+		_HandleGetAddrInfoStatus(error->error, error, TRUE);
+	}
+
+	// Return the CFMachPortRef
+	return result;
+}
+#endif /* #if defined(__MACH__) */
+
+#if defined(__linux__)
+#if HAVE_ARES_INIT && 1
+/* static */ CFTypeRef
+_CreateNameLookup_Ares(CFDataRef address, void* context, CFStreamError* error) {
+    const struct sockaddr * sa           = (const struct sockaddr *)CFDataGetBytePtr(address);
+    const ares_socklen_t    sa_len       = CFDataGetLength(address);
+    _CFHost *               host         = (_CFHost *)(context);
+    _CFHostAresRequest *    ares_request = NULL;
+    CFFileDescriptorRef     result       = NULL;
+
+
+    ares_request = _AresCreateRequestAndChannel(host,
+                                                kCFHostNames,
+                                                _AresSocketStateCallBack,
+                                                error);
+	__Require(ares_request != NULL, done);
+
+    ares_request->_request_pending = 1;
+
+    _AresSharedChannelBeginQueries(ares_request);
+
+    if (sa_len > 0) {
+        const int flags = (ARES_NI_LOOKUPHOST | ARES_NI_LOOKUPSERVICE);
+
+        ares_getnameinfo(ares_request->_request_channel,
+                         sa,
+                         sa_len,
+                         flags,
+                         _AresNameInfoCompletedCallBack,
+                         ares_request);
+    }
+
+    _AresSharedChannelEndQueries(ares_request);
+
+    // A shared request always has a lookup, signalled with the
+    // outcome, whether success or failure, when its query completes.
+
+    if (ares_request->_request_shared) {
+        result = ares_request->_request_lookup;
+        goto done;
+    }
+
+    // It is possible, whether on error or whether on cache or local
+    // file-based resolution, that we will land here without either
+    // _AresQueryCompletedCallBack (less likely) or
+    // _AresSocketDataCallBack (more likely) being called. If either
+    // of those cases is a non-success case, handle clean-up
+    // appropriately.
+
+    if (ares_request->_request_last_status != ARES_SUCCESS) {
+        _AresStatusMapToStreamError(ares_request->_request_last_status, error);
+
+        _AresDestroyRequestAndChannel(ares_request);
+    } else {
+        result = ares_request->_request_lookup;
+
+        // If the result is NULL, then we had a callback-free lookup
+        // and can destroy the channel and the request. Otherwise, the
+        // request and channel will be deallocated in the socket state
+        // callback.
+
+        if (result == NULL) {
+            _AresDestroyRequestAndChannel(ares_request);
+        }
+    }
+
+ done:
+	return result;
+}
+#endif /* HAVE_ARES_INIT && 1 */
+#endif /* defined(__linux__) */
+
+#if defined(__MACH__)
+/* static */ SCNetworkReachabilityRef
+_CreateReachabilityLookup(CFTypeRef thing, void* context, CFStreamError* error) {
+
+	SCNetworkReachabilityRef result = NULL;
+
+	// If the passed in argument is a CFData, create the reachability object
+	// with the address.
+	if (CFGetTypeID(thing) == CFDataGetTypeID()) {
+		result = SCNetworkReachabilityCreateWithAddress(CFGetAllocator(thing),
+														(struct sockaddr*)CFDataGetBytePtr((CFDataRef)thing));
+	}
+
+	// A CFStringRef means to create a reachability object by name.
+	else {
+		const CFAllocatorRef allocator = CFGetAllocator(thing);
+		UInt8* buffer;
+
+		buffer = _CFStringToCStringWithError(thing, error);
+
+		if (!buffer)
+			return result;
+
+		// Got a good name to send to lookup.
+		else {
+
+			// Create the reachability lookup
+			result = SCNetworkReachabilityCreateWithName(allocator, (const char*)buffer);
+		}
+
+		// Release the buffer that was allocated for the name
+		CFAllocatorDeallocate(allocator, buffer);
+	}
+
+	// If the reachability object was created, need to set the callback context.
+	if (result) {
+		SCNetworkReachabilityContext ctxt = {0, (void*)context, CFRetain, CFRelease, CFCopyDescription};
+
+		// Set the callback information
+		SCNetworkReachabilitySetCallback(result, _NetworkReachabilityCallBack, &ctxt);
+	}
+
+	// If no reachability was created, make sure the error is set.
+	else if (!error->error) {
+
+		// Set it to errno
+		error->error = errno;
+
+		// If errno was set, place in the POSIX error domain.
+		if (error->error)
+			error->domain = (CFStreamErrorDomain)kCFStreamErrorDomainPOSIX;
+	}
+
+	return result;
+}
+#endif /* defined(__MACH__) */
+
+/* static */ CFTypeRef
+_CreateDNSLookup(CFTypeRef thing, CFHostInfoType info, void* context, CFStreamError* error) {
+	CFTypeRef result = NULL;
+
+#if defined(__MACH__)
+	result = _CreateDNSLookup_Mach(thing, info, context, error);
+#elif defined(__linux__)
+    result = _CreateDNSLookup_Linux(thing, info, context, error);
+#else
+#warning "Platform portability issue!"
+#endif
+
+	return result;
+}
+
+#if defined(__MACH__)
+/* static */ CFMachPortRef
+_CreateDNSLookup_Mach(CFTypeRef thing, CFHostInfoType info, void* context, CFStreamError* error) {
+	const CFAllocatorRef allocator = CFGetAllocator(thing);
+	UInt8* buffer;
+	CFMachPortRef result = NULL;
+
+	buffer = _CFStringToCStringWithError(thing, error);
+
+	if (!buffer)
+		return result;
+
+	// Got a good name to send to lookup.
+	else {
+
+		mach_port_t prt = MACH_PORT_NULL;
+		CFMachPortContext ctxt = {0, (void*)context, CFRetain, CFRelease, CFCopyDescription};
+
+		// Start the async lookup
+		error->error = dns_async_start(&prt, (const char*)buffer, ((info & 0xFFFF0000) >> 16), (info & 0x0000FFFF), 1, _DNSCallBack_Mach, (void*)context);
+
+		// If the callback port was created, attempt to create the CFMachPort wrapper on it.
+		if (!prt ||
+			!(result = CFMachPortCreateWithPort(allocator, prt, _DNSMachPortCallBack, &ctxt, NULL)))
+		{
+			_HandleGetAddrInfoStatus(error->error, error, TRUE);
+		}
+	}
+
+	// Release the buffer that was allocated for the name
+	CFAllocatorDeallocate(allocator, buffer);
+
+	return result;
+}
+#endif /* defined(__MACH__) */
+
+#if defined(__linux__)
+/* static */ CFFileDescriptorRef
+_CreateDNSLookup_Linux(CFTypeRef thing, CFHostInfoType info, void* context, CFStreamError* error) {
+	CFFileDescriptorRef     result = NULL;
+
+	__CFHostTraceEnterWithFormat("thing %p info %x context %p error %p\n",
+								 thing, info, context, error);
+
+#if LOG_CFHOST
+	CFShow(thing);
+#endif
+
+    // It is not clear that this function is practically reachable as
+    // CFHost and CFNetwork are currently implemented. Trigger an
+    // unconditional assertion if any use pratically traverses this
+    // path such that it can be properly documented and tested.
+
+    assert(TRUE);
+
+    result = (CFFileDescriptorRef)_CreateMasterAddressLookup(thing, info, context, error);
+
+	__CFHostTraceExitWithFormat("result %p\n", result);
+
+	return result;
+}
+#endif /* defined(__linux__) */
+
+/* static */ size_t
+_AddressSizeForSupportedFamily(int family) {
+    size_t result;
+
+    switch (family) {
+
+    case AF_INET:
+        result = sizeof(struct sockaddr_in);
+        break;
+
+    case AF_INET6:
+        result = sizeof(struct sockaddr_in6);
+        break;
+
+    default:
+        result = 0;
+        break;
+
+    }
+
+    return result;
+}
+
+/* static */ void
+_GetAddrInfoCallBackWithFree(int eai_status, const struct addrinfo *res, void *ctxt, FreeAddrInfoCallBack freeaddrinfo_cb) {
+	_CFHost* host = (_CFHost*)ctxt;
+	CFHostClientCallBack cb = NULL;
+	CFStreamError error;
+	void* info = NULL;
+	CFHostInfoType type = _kCFNullHostInfoType;
+
+	// Retain here to guarantee safety really after the lookups release,
+	// but definitely before the callback.
+	CFRetain((CFHostRef)host);
+
+	// Lock the host
+	_CFHostLock(host);
+
+	// If the lookup canceled, don't need to do any of this.
+	if (host->_lookup) {
+
+		// Make sure to toss the cached info now.
+		CFDictionaryRemoveValue(host->_info, (const void*)(host->_type));
+
+		// Set the error if got one back from getaddrinfo
+		if (eai_status) {
+			_HandleGetAddrInfoStatus(eai_status, &host->_error, FALSE);
+
+			// Mark to indicate the resolution was performed.
+			CFDictionaryAddValue(host->_info, (const void*)(host->_type), kCFNull);
+		}
+
+		else {
+
+			CFMutableArrayRef addrs;
+			CFAllocatorRef allocator = CFGetAllocator((CFHostRef)host);
+
+			// This is the list of new addresses to be saved.
+			addrs = CFArrayCreateMutable(allocator, 0, &kCFTypeArrayCallBacks);
+
+			// Save the memory error if the address cache failed to create.
+			if (!addrs) {
+				host->_error.error = ENOMEM;
+				host->_error.domain = kCFStreamErrorDomainPOSIX;
+
+				// Mark to indicate the resolution was performed.
+				CFDictionaryAddValue(host->_info, (const void*)(host->_type), kCFNull);
+			}
+
+			else {
+				const struct addrinfo* i;
+
+				// Loop through all of the addresses saving them in the array.
+				for (i = res; i; i = i->ai_next) {
+                    const int family = i->ai_addr->sa_family;
+					CFDataRef data   = NULL;
+					CFIndex   length = 0;
+
+					// Bypass any address families that are not understood by CFSocketStream
+					if (family != AF_INET && family != AF_INET6)
+						continue;
+
+					// Wrap the address in a CFData
+#if HAVE_STRUCT_SOCKADDR_SA_LEN
+					length = i->ai_addr->sa_len;
+#else
+                    length = _AddressSizeForSupportedFamily(family);
+#endif /* HAVE_STRUCT_SOCKADDR_SA_LEN */
+					if (length > 0) {
+						data = CFDataCreate(allocator, (UInt8*)(i->ai_addr), length);
+					}
+
+					// Fail with a memory error if the address wouldn't wrap.
+					if (!data) {
+
+						host->_error.error = ENOMEM;
+						host->_error.domain = kCFStreamErrorDomainPOSIX;
+
+						// Release the addresses and mark as NULL so as not to save later.
+						CFRelease(addrs);
+						addrs = NULL;
+
+						// Just fail now.
+						break;
+					}
+
+					// Add the address and continue on to the next.
+					CFArrayAppendValue(addrs, data);
+					CFRelease(data);
+				}
+
+				// If the list is still good, need to save it.
+				if (addrs) {
+
+					// Save the list of address on the host.
+					CFDictionaryAddValue(host->_info, (const void*)(host->_type), addrs);
+					CFRelease(addrs);
+				}
+			}
+		}
+
+		// Save the callback if there is one at this time.
+		cb = host->_callback;
+
+		type = host->_type;
+
+		// Save the error and client information for the callback
+		memmove(&error, &(host->_error), sizeof(error));
+		info = host->_client.info;
+
+        _HostLookupCancel_NoLock(host);
+	}
+
+	// Unlock the host so the callback can be made safely.
+	_CFHostUnlock(host);
+
+	// Release the results if some were received.
+    if (res) {
+        if (freeaddrinfo_cb) {
+            freeaddrinfo_cb((struct addrinfo *)res);
+        }
+	}
+
+	// If there is a callback, inform the client of the finish.
+	if (cb) {
+		cb((CFHostRef)host, type, &error, info);
+	}
+
+	// Go ahead and release now that the callback is done.
+	CFRelease((CFHostRef)host);
+}
+
+#if defined(__MACH__) || (HAVE_GETADDRINFO_A && 0)
+/* static */ void
+_GetAddrInfoCallBack(int eai_status, const struct addrinfo* res, void* ctxt) {
+    _GetAddrInfoCallBackWithFree(eai_status, res, ctxt, freeaddrinfo);
+}
+#endif /* defined(__MACH__) || (HAVE_GETADDRINFO_A && 0) */
+
+#if defined(__MACH__)
+/* static */ void
+_GetAddrInfoMachPortCallBack(CFMachPortRef port, void* msg, CFIndex size, void* info) {
+
+	getaddrinfo_async_handle_reply(msg);
+}
+#endif /* defined(__MACH__) */
+
+/* static */ void
+_GetNameInfoCallBackWithFree_NoLock(int eai_status, char *hostname, char *serv, _CFHost * host, CFHostClientCallBack *cb, void **info, CFStreamError *error) {
+    __Require(hostname != NULL, done);
+    __Require(host != NULL, done);
+    __Require(cb != NULL, done);
+    __Require(info != NULL, done);
+    __Require(error != NULL, done);
+
+	// If the lookup canceled, don't need to do any of this.
+	if (host->_lookup) {
+
+		// Make sure to toss the cached info now.
+		CFDictionaryRemoveValue(host->_info, (const void*)kCFHostNames);
+
+		// Set the error if got one back from getnameinfo
+		if (eai_status) {
+			_HandleGetAddrInfoStatus(eai_status, &host->_error, FALSE);
+
+			// Mark to indicate the resolution was performed.
+			CFDictionaryAddValue(host->_info, (const void*)kCFHostNames, kCFNull);
+		}
+
+		else {
+
+			CFAllocatorRef allocator = CFGetAllocator((CFHostRef)host);
+
+			// Create the name from the given response.
+			CFStringRef name = CFStringCreateWithCString(allocator, hostname, kCFStringEncodingUTF8);
+
+			// If didn't create the name, fail with out of memory.
+			if (!name) {
+				host->_error.error = ENOMEM;
+				host->_error.domain = kCFStreamErrorDomainPOSIX;
+			}
+
+			else {
+				// Create the list to hold the name.
+				CFArrayRef names = CFArrayCreate(allocator, (const void**)(&name), 1, &kCFTypeArrayCallBacks);
+
+				// Don't need the retain anymore
+				CFRelease(name);
+
+				// Failed to create the list of names so mark out of memory.
+				if (!names) {
+					host->_error.error = ENOMEM;
+					host->_error.domain = kCFStreamErrorDomainPOSIX;
+				}
+
+				// Save the list of names on the host.
+				else {
+					CFDictionaryAddValue(host->_info, (const void*)kCFHostNames, names);
+					CFRelease(names);
+				}
+			}
+		}
+
+		// Save the callback if there is one at this time.
+		*cb = host->_callback;
+
+		// Save the error and client information for the callback
+		memmove(error, &(host->_error), sizeof(*error));
+		*info = host->_client.info;
+
+        _HostLookupCancel_NoLock(host);
+	}
+
+ done:
+    return;
+}
+
+/* static */ void
+_GetNameInfoCallBackWithFreeAndWithShouldLock(int eai_status, char *hostname, char *serv, void* ctxt, FreeNameInfoCallBack freenameinfo_cb, Boolean should_lock) {
+	_CFHost *            host = (_CFHost*)ctxt;
+	CFHostClientCallBack cb   = NULL;
+	void *               info = NULL;
+    CFStreamError        error;
+
+	// Retain here to guarantee safety really after the lookups release,
+	// but definitely before the callback.
+	CFRetain((CFHostRef)host);
+
+	// Lock the host, if requested.
+
+    if (should_lock) {
+        _CFHostLock(host);
+    }
+
+    _GetNameInfoCallBackWithFree_NoLock(eai_status,
+                                        hostname,
+                                        serv,
+                                        ctxt,
+                                        &cb,
+                                        &info,
+                                        &error);
+
+	// Unlock the host, if previously-requested to be locked, so the
+	// callback can be made safely.
+
+    if (should_lock) {
+        _CFHostUnlock(host);
+    }
+
+	// Release the results if there were any.
+    if (freenameinfo_cb) {
+        freenameinfo_cb(hostname, serv);
+    }
+
+    // Conversely, if no locking was requested, then the host is
+    // already locked. Unlock it before the call out to the client
+    // which may call back into public API functions which WILL lock
+    // and, as a result, WILL deadlock if we call out with the host
+    // locked.
+
+    if (!should_lock) {
+        _CFHostUnlock(host);
+    }
+
+	// If there is a callback, inform the client of the finish.
+	if (cb)
+		cb((CFHostRef)host, kCFHostNames, &error, info);
+
+    // Restore the host lock state, as appropriate and requested.
+
+    if (!should_lock) {
+        _CFHostLock(host);
+    }
+
+	// Go ahead and release now that the callback is done.
+	CFRelease((CFHostRef)host);
+}
+
+/* static */ void
+_GetNameInfoCallBackWithFree(int eai_status, char *hostname, char *serv, void* ctxt, FreeNameInfoCallBack freenameinfo_cb) {
+    static const Boolean should_lock = TRUE;
+
+    _GetNameInfoCallBackWithFreeAndWithShouldLock(eai_status, hostname, serv, ctxt, freenameinfo_cb, should_lock);
+}
+
+#if defined(__MACH__)
+/* static */ void
+_FreeNameInfoCallBack_Mach(char *hostname, char *serv) {
+    if (hostname) free(hostname);
+    if (serv) free (serv);
+}
+
+/* static */ void
+_GetNameInfoCallBack(int eai_status, char *hostname, char *serv, void* ctxt) {
+    static const Boolean should_lock = TRUE;
+    FreeNameInfoCallBack free_cb     = _FreeNameInfoCallBack_Mach;
+
+    _GetNameInfoCallBackWithFreeAndWithShouldLock(eai_status, hostname, serv, ctxt, free_cb, should_lock);
+}
+
+/* static */ void
+_GetNameInfoMachPortCallBack(CFMachPortRef port, void* msg, CFIndex size, void* info) {
+
+	getnameinfo_async_handle_reply(msg);
+}
+
+/* static */ void
+_NetworkReachabilityCallBack(SCNetworkReachabilityRef target, SCNetworkConnectionFlags flags, void* ctxt) {
+
+	_CFHost* host = (_CFHost*)ctxt;
+	CFHostClientCallBack cb = NULL;
+	CFStreamError error;
+	void* info = NULL;
+
+	// Retain here to guarantee safety really after the lookups release,
+	// but definitely before the callback.
+	CFRetain((CFHostRef)host);
+
+	// Lock the host
+	_CFHostLock(host);
+
+	// If the lookup canceled, don't need to do any of this.
+	if (host->_lookup) {
+
+		// Create the data for hanging off the host info dictionary
+		CFDataRef reachability = CFDataCreate(CFGetAllocator(target), (const UInt8*)&flags, sizeof(flags));
+
+		// Make sure to toss the cached info now.
+		CFDictionaryRemoveValue(host->_info, (const void*)kCFHostReachability);
+
+		// If didn't create the data, fail with out of memory.
+		if (!reachability) {
+			host->_error.error = ENOMEM;
+			host->_error.domain = kCFStreamErrorDomainPOSIX;
+		}
+
+		else {
+			// Save the reachability information
+			CFDictionaryAddValue(host->_info, (const void*)kCFHostReachability, reachability);
+			CFRelease(reachability);
+		}
+
+		// Save the callback if there is one at this time.
+		cb = host->_callback;
+
+		// Save the error and client information for the callback
+		memmove(&error, &(host->_error), sizeof(error));
+		info = host->_client.info;
+
+        _HostLookupCancel_NoLock(host);
+	}
+
+	// Unlock the host so the callback can be made safely.
+	_CFHostUnlock(host);
+
+	// If there is a callback, inform the client of the finish.
+	if (cb)
+		cb((CFHostRef)host, kCFHostReachability, &error, info);
+
+	// Go ahead and release now that the callback is done.
+	CFRelease((CFHostRef)host);
 }
+#endif /* #if defined(__MACH__) */
 
 #if defined(__MACH__)
-/* static */ CFMachPortRef
-_CreateNameLookup_Mach(CFDataRef address, void* context, CFStreamError* error) {
+/* static */ void
+_NetworkReachabilityByIPCallBack(_CFHost* host) {
 
-	mach_port_t prt = MACH_PORT_NULL;
-	CFMachPortRef result = NULL;
+	CFHostClientCallBack cb = NULL;
+	CFStreamError error;
+	void* info = NULL;
 
-	CFMachPortContext ctxt = {0, (void*)context, CFRetain, CFRelease, CFCopyDescription};
-	struct sockaddr* sa = (struct sockaddr*)CFDataGetBytePtr(address);
+	// Retain here to guarantee safety really after the lookups release,
+	// but definitely before the callback.
+	CFRetain((CFHostRef)host);
 
-	// Start the async lookup
-	error->error = getnameinfo_async_start(&prt, sa, sa->sa_len, 0, _GetNameInfoCallBack, (void*)context);
+	// Lock the host
+	_CFHostLock(host);
 
-	// If the callback port was created, attempt to create the CFMachPort wrapper on it.
-	if (!prt ||
-		!(result = CFMachPortCreateWithPort(CFGetAllocator(address), prt, _GetNameInfoMachPortCallBack, &ctxt, NULL)))
-	{
-		_HandleGetAddrInfoStatus(error->error, error, TRUE);
+	// If the lookup canceled, don't need to do any of this.
+	if (host->_lookup) {
+
+		// Save the callback if there is one at this time.
+		cb = host->_callback;
+
+		// Save the error and client information for the callback
+		memmove(&error, &(host->_error), sizeof(error));
+		info = host->_client.info;
+
+        _HostLookupCancel_NoLock(host);
 	}
 
-	// Return the CFMachPortRef
-	return result;
+	// Unlock the host so the callback can be made safely.
+	_CFHostUnlock(host);
+
+	// If there is a callback, inform the client of the finish.
+	if (cb)
+		cb((CFHostRef)host, kCFHostReachability, &error, info);
+
+	// Go ahead and release now that the callback is done.
+	CFRelease((CFHostRef)host);
+}
+#endif /* defined(__MACH__) */
+
+#if defined(__MACH__)
+/* static */ void
+_DNSCallBack_Mach(int32_t status, char *buf, uint32_t len, struct sockaddr *from, int fromlen, void *context) {
+
+	_CFHost* host = (_CFHost*)context;
+	CFHostClientCallBack cb = NULL;
+	CFStreamError error;
+	void* info = NULL;
+	CFHostInfoType type = _kCFNullHostInfoType;
+
+	// Retain here to guarantee safety really after the lookups release,
+	// but definitely before the callback.
+	CFRetain((CFHostRef)context);
+
+	// Lock the host
+	_CFHostLock(host);
+
+	// If the lookup canceled, don't need to do any of this.
+	if (host->_lookup) {
+
+		// Make sure to toss the cached info now.
+		CFDictionaryRemoveValue(host->_info, (const void*)(host->_type));
+
+		// Set the error if got one back from the lookup
+		if (status) {
+			_HandleGetAddrInfoStatus(status, &host->_error, FALSE);
+
+			// Mark to indicate the resolution was performed.
+			CFDictionaryAddValue(host->_info, (const void*)(host->_type), kCFNull);
+		}
+
+		else {
+			CFAllocatorRef allocator = CFGetAllocator((CFHostRef)context);
+
+			// Wrap the reply and the source of the reply
+			CFDataRef rr = CFDataCreate(allocator, (const UInt8*)buf, len);
+			CFDataRef sa = CFDataCreate(allocator, (const UInt8*)from, fromlen);
+
+			// If couldn't wrap, fail with no memory error.
+			if (!rr || !sa) {
+				host->_error.error = ENOMEM;
+				host->_error.domain = kCFStreamErrorDomainPOSIX;
+			}
+
+			else {
+
+				// Create the information to put in the info dictionary.
+				CFTypeRef list[2] = {rr, sa};
+				CFArrayRef array = CFArrayCreate(allocator, list, sizeof(list) / sizeof(list[0]), &kCFTypeArrayCallBacks);
+
+				// Make sure it was created and add it.
+				if (array) {
+					CFDictionaryAddValue(host->_info, (const void*)(host->_type), array);
+					CFRelease(array);
+				}
+
+				// Did make the information list so fail with out of memory
+				else {
+					host->_error.error = ENOMEM;
+					host->_error.domain = kCFStreamErrorDomainPOSIX;
+				}
+			}
+
+			// Release the reply if it was created.
+			if (rr)
+				CFRelease(rr);
+
+			// Release the sockaddr wrapper if it was created
+			if (sa)
+				CFRelease(sa);
+		}
+
+		// Save the callback if there is one at this time.
+		cb = host->_callback;
+
+		// Save the type of lookup for the callback.
+		type = host->_type;
+
+		// Save the error and client information for the callback
+		memmove(&error, &(host->_error), sizeof(error));
+		info = host->_client.info;
+
+        _HostLookupCancel_NoLock(host);
+	}
+
+	// Unlock the host so the callback can be made safely.
+	_CFHostUnlock(host);
+
+	// If there is a callback, inform the client of the finish.
+	if (cb)
+		cb((CFHostRef)context, type, &error, info);
+
+	// Go ahead and release now that the callback is done.
+	CFRelease((CFHostRef)context);
+}
+
+/* static */ void
+_DNSMachPortCallBack(CFMachPortRef port, void* msg, CFIndex size, void* info) {
+
+	dns_async_handle_reply(msg);
 }
 #endif /* #if defined(__MACH__) */
 
-#if defined(__linux__)
-#if HAVE_ARES_INIT && 1
-/* static */ CFTypeRef
-_CreateNameLookup_Ares(CFDataRef address, void* context, CFStreamError* error) {
-    const struct sockaddr * sa           = (const struct sockaddr *)CFDataGetBytePtr(address);
-    const ares_socklen_t    sa_len       = CFDataGetLength(address);
-    _CFHost *               host         = (_CFHost *)(context);
-    _CFHostAresRequest *    ares_request = NULL;
-    CFFileDescriptorRef     result       = NULL;
+/* static */ void
+_PrimaryLookupCallBack(CFHostRef theHost, CFHostInfoType typeInfo, const CFStreamError *error, CFStringRef name) {
 
+	CFArrayRef list;
 
-    ares_request = _AresCreateRequestAndChannel(host,
-                                                kCFHostNames,
-                                                _AresSocketStateCallBack,
-                                                error);
-	__Require(ares_request != NULL, done);
+	/* Shut down the host lookup. */
+	CFHostSetClient(theHost, NULL, NULL);
 
-    ares_request->_request_pending = 1;
+	/* Lock the host master list */
+	_CFMutexLock(_HostLock);
 
-    if (sa_len > 0) {
-        const int flags = (ARES_NI_LOOKUPHOST | ARES_NI_LOOKUPSERVICE);
+	/* Get the list of clients. */
+	list = CFDictionaryGetValue(_HostLookups, name);
 
-        ares_getnameinfo(ares_request->_request_channel,
-                         sa,
-                         sa_len,
-                         flags,
-                         _AresNameInfoCompletedCallBack,
-                         ares_request);
-    }
+	if (list) {
 
-    // It is possible, whether on error or whether on cache or local
-    // file-based resolution, that we will land here without either
-    // _AresQueryCompletedCallBack (less likely) or
-    // _AresSocketDataCallBack (more likely) being called. If either
-    // of those cases is a non-success case, handle clean-up
-    // appropriately.
+		CFRetain(list);
 
-    if (ares_request->_request_last_status != ARES_SUCCESS) {
-        _AresStatusMapToStreamError(ares_request->_request_last_status, error);
+		/* Remove the entry from the list of master lookups. */
+		CFDictionaryRemoveValue(_HostLookups, name);
+	}
 
-        _AresDestroyRequestAndChannel(ares_request);
-    } else {
-        result = ares_request->_request_lookup;
+	_CFMutexUnlock(_HostLock);
 
-        // If the result is NULL, then we had a callback-free lookup
-        // and can destroy the channel and the request. Otherwise, the
-        // request and channel will be deallocated in the socket state
-        // callback.
+	if (list) {
+
+		CFIndex i, count;
+		CFArrayRef addrs = CFHostGetInfo(theHost, _kCFHostMasterAddressLookup, NULL);
+
+		/* Cache the addresses or remember hosts that don't exist. */
+		_HostCacheAddLookupResult(theHost, name, error);
+
+		count = CFArrayGetCount(list);
+
+		for (i = 1; i < count; i++) {
+
+			_CFHost* client;
+			CFRunLoopSourceContext ctxt = {0};
+			CFRunLoopSourceRef src = (CFRunLoopSourceRef)CFArrayGetValueAtIndex(list, i);
+
+			CFRunLoopSourceGetContext(src, &ctxt);
+			client = (_CFHost*)ctxt.info;
+
+			_CFHostLock(client);
+
+			/* Make sure to toss the cached info now. */
+			CFDictionaryRemoveValue(client->_info, (const void*)(client->_type));
+
+			/* Deal with the error if there was one. */
+			if (error->error) {
+
+				/* Copy the error over to the client. */
+				memmove(&client->_error, error, sizeof(error[0]));
+
+				/* Mark to indicate the resolution was performed. */
+				CFDictionaryAddValue(client->_info, (const void*)(client->_type), kCFNull);
+			}
+
+			else {
+
+				/* Make a copy of the addresses with the client's allocator. */
+				CFArrayRef cp = _CFArrayCreateDeepCopy(CFGetAllocator((CFHostRef)client), addrs);
+
+				if (cp) {
+
+					CFDictionaryAddValue(client->_info, (const void*)(client->_type), addrs);
+
+					CFRelease(cp);
+				}
+
+				else {
+
+					/* Make sure to error if couldn't create the list. */
+					client->_error.error = ENOMEM;
+					client->_error.domain = kCFStreamErrorDomainPOSIX;
 
-        if (result == NULL) {
-            _AresDestroyRequestAndChannel(ares_request);
-        }
-    }
+					/* Mark to indicate the resolution was performed. */
+					CFDictionaryAddValue(client->_info, (const void*)(client->_type), kCFNull);
+				}
+			}
 
- done:
-	return result;
-}
-#endif /* HAVE_ARES_INIT && 1 */
-#endif /* defined(__linux__) */
+			/* Signal the client for immediate attention. */
+			CFRunLoopSourceSignal((CFRunLoopSourceRef)(client->_lookup));
 
-#if defined(__MACH__)
-/* static */ SCNetworkReachabilityRef
-_CreateReachabilityLookup(CFTypeRef thing, void* context, CFStreamError* error) {
+			CFArrayRef schedules = client->_schedules;
+			CFIndex j, c = CFArrayGetCount(schedules);
 
-	SCNetworkReachabilityRef result = NULL;
+			/* Make sure the signal can make it through */
+			for (j = 0; j < c; j += 2) {
 
-	// If the passed in argument is a CFData, create the reachability object
-	// with the address.
-	if (CFGetTypeID(thing) == CFDataGetTypeID()) {
-		result = SCNetworkReachabilityCreateWithAddress(CFGetAllocator(thing),
-														(struct sockaddr*)CFDataGetBytePtr((CFDataRef)thing));
-	}
+				/* Grab the run loop for checking */
+				CFRunLoopRef runloop = (CFRunLoopRef)CFArrayGetValueAtIndex(schedules, j);
 
-	// A CFStringRef means to create a reachability object by name.
-	else {
-		const CFAllocatorRef allocator = CFGetAllocator(thing);
-		UInt8* buffer;
+				/* If it's sleeping, need to further check it. */
+				if (CFRunLoopIsWaiting(runloop)) {
 
-		buffer = _CFStringToCStringWithError(thing, error);
+					/* Grab the mode for further check */
+					CFStringRef mode = CFRunLoopCopyCurrentMode(runloop);
 
-		if (!buffer)
-			return result;
+					if (mode) {
 
-		// Got a good name to send to lookup.
-		else {
+						/* If the lookup is in the right mode, need to wake up the run loop. */
+						if (CFRunLoopContainsSource(runloop, (CFRunLoopSourceRef)(client->_lookup), mode)) {
+							CFRunLoopWakeUp(runloop);
+						}
 
-			// Create the reachability lookup
-			result = SCNetworkReachabilityCreateWithName(allocator, (const char*)buffer);
+						/* Don't need this anymore. */
+						CFRelease(mode);
+					}
+				}
+			}
+
+			_CFHostUnlock(client);
 		}
 
-		// Release the buffer that was allocated for the name
-		CFAllocatorDeallocate(allocator, buffer);
+		CFRelease(list);
 	}
+}
 
-	// If the reachability object was created, need to set the callback context.
-	if (result) {
-		SCNetworkReachabilityContext ctxt = {0, (void*)context, CFRetain, CFRelease, CFCopyDescription};
 
-		// Set the callback information
-		SCNetworkReachabilitySetCallback(result, _NetworkReachabilityCallBack, &ctxt);
-	}
+/* static */ void
+_AddressLookupSchedule_NoLock(_CFHost* host, CFRunLoopRef rl, CFStringRef mode) {
 
-	// If no reachability was created, make sure the error is set.
-	else if (!error->error) {
+	CFArrayRef list;
+	CFArrayRef names = (CFArrayRef)CFDictionaryGetValue(host->_info, (const void*)kCFHostNames);
+	CFStringRef name = (CFStringRef)CFArrayGetValueAtIndex(names, 0);
 
-		// Set it to errno
-		error->error = errno;
+	/* Lock the list of master lookups and cache */
+	_CFMutexLock(_HostLock);
 
-		// If errno was set, place in the POSIX error domain.
-		if (error->error)
-			error->domain = (CFStreamErrorDomain)kCFStreamErrorDomainPOSIX;
+	list = CFDictionaryGetValue(_HostLookups, name);
+
+	if (list) {
+		CFHostScheduleWithRunLoop((CFHostRef)CFArrayGetValueAtIndex(list, 0), rl, mode);
 	}
 
-	return result;
+	_CFMutexUnlock(_HostLock);
 }
-#endif /* defined(__MACH__) */
-
-/* static */ CFTypeRef
-_CreateDNSLookup(CFTypeRef thing, CFHostInfoType info, void* context, CFStreamError* error) {
-	CFTypeRef result = NULL;
 
-#if defined(__MACH__)
-	result = _CreateDNSLookup_Mach(thing, info, context, error);
-#elif defined(__linux__)
-    result = _CreateDNSLookup_Linux(thing, info, context, error);
-#else
-#warning "Platform portability issue!"
-#endif
 
-	return result;
-}
+/* static */ void
+_AddressLookupPerform(_CFHost* host) {
 
-#if defined(__MACH__)
-/* static */ CFMachPortRef
-_CreateDNSLookup_Mach(CFTypeRef thing, CFHostInfoType info, void* context, CFStreamError* error) {
-	const CFAllocatorRef allocator = CFGetAllocator(thing);
-	UInt8* buffer;
-	CFMachPortRef result = NULL;
+	CFHostClientCallBack cb = NULL;
+	CFStreamError error;
+	void* info = NULL;
 
-	buffer = _CFStringToCStringWithError(thing, error);
+	// Retain here to guarantee safety really after the lookups release,
+	// but definitely before the callback.
+	CFRetain((CFHostRef)host);
 
-	if (!buffer)
-		return result;
+	// Lock the host
+	_CFHostLock(host);
 
-	// Got a good name to send to lookup.
-	else {
+	// Save the callback if there is one at this time.
+	cb = host->_callback;
 
-		mach_port_t prt = MACH_PORT_NULL;
-		CFMachPortContext ctxt = {0, (void*)context, CFRetain, CFRelease, CFCopyDescription};
+	// Save the error and client information for the callback
+	memmove(&error, &(host->_error), sizeof(error));
+	info = host->_client.info;
 
-		// Start the async lookup
-		error->error = dns_async_start(&prt, (const char*)buffer, ((info & 0xFFFF0000) >> 16), (info & 0x0000FFFF), 1, _DNSCallBack_Mach, (void*)context);
+    _HostLookupCancel_NoLock(host);
 
-		// If the callback port was created, attempt to create the CFMachPort wrapper on it.
-		if (!prt ||
-			!(result = CFMachPortCreateWithPort(allocator, prt, _DNSMachPortCallBack, &ctxt, NULL)))
-		{
-			_HandleGetAddrInfoStatus(error->error, error, TRUE);
-		}
-	}
+	// Unlock the host so the callback can be made safely.
+	_CFHostUnlock(host);
 
-	// Release the buffer that was allocated for the name
-	CFAllocatorDeallocate(allocator, buffer);
+	// If there is a callback, inform the client of the finish.
+	if (cb)
+		cb((CFHostRef)host, kCFHostAddresses, &error, info);
 
-	return result;
+	// Go ahead and release now that the callback is done.
+	CFRelease((CFHostRef)host);
 }
-#endif /* defined(__MACH__) */
 
-#if defined(__linux__)
-/* static */ CFFileDescriptorRef
-_CreateDNSLookup_Linux(CFTypeRef thing, CFHostInfoType info, void* context, CFStreamError* error) {
-	CFFileDescriptorRef     result = NULL;
 
-	__CFHostTraceEnterWithFormat("thing %p info %x context %p error %p\n",
-								 thing, info, context, error);
-
-#if LOG_CFHOST
-	CFShow(thing);
+#if 0
+#pragma mark -
+#pragma mark Host Cache
 #endif
 
-    // It is not clear that this function is practically reachable as
-    // CFHost and CFNetwork are currently implemented. Trigger an
-    // unconditional assertion if any use pratically traverses this
-    // path such that it can be properly documented and tested.
-
-    assert(TRUE);
-
-    result = (CFFileDescriptorRef)_CreateMasterAddressLookup(thing, info, context, error);
-
-	__CFHostTraceExitWithFormat("result %p\n", result);
+/* static */ void
+_HostCacheInitialize(void) {
 
-	return result;
-}
-#endif /* defined(__linux__) */
+	CFIndex i;
 
-/* static */ size_t
-_AddressSizeForSupportedFamily(int family) {
-    size_t result;
+	for (i = 0; i < _kCFHostCacheShardCount; i++) {
 
-    switch (family) {
+		_CFHostCacheShard* shard = &_HostCache[i];
 
-    case AF_INET:
-        result = sizeof(struct sockaddr_in);
-        break;
+		_CFMutexInit(&shard->_lock, FALSE);
 
-    case AF_INET6:
-        result = sizeof(struct sockaddr_in6);
-        break;
+		/* Entries are owned by the shard's list, so the dictionary doesn't retain values. */
+		shard->_entries = CFDictionaryCreateMutable(kCFAllocatorDefault,
+													0,
+													&kCFTypeDictionaryKeyCallBacks,
+													NULL);
+	}
+}
 
-    default:
-        result = 0;
-        break;
 
-    }
+/* static */ void
+_HostCacheGetConfiguration(_CFHostCacheConfiguration* config) {
 
-    return result;
+	__CFSpinLock(&_HostCacheConfigurationLock);
+	memmove(config, &_HostCacheConfiguration, sizeof(config[0]));
+	__CFSpinUnlock(&_HostCacheConfigurationLock);
 }
 
-/* static */ void
-_GetAddrInfoCallBackWithFree(int eai_status, const struct addrinfo *res, void *ctxt, FreeAddrInfoCallBack freeaddrinfo_cb) {
-	_CFHost* host = (_CFHost*)ctxt;
-	CFHostClientCallBack cb = NULL;
-	CFStreamError error;
-	void* info = NULL;
-	CFHostInfoType type = _kCFNullHostInfoType;
 
-	// Retain here to guarantee safety really after the lookups release,
-	// but definitely before the callback.
-	CFRetain((CFHostRef)host);
+/* static */ _CFHostCacheShard*
+_HostCacheShardForName(CFStringRef name) {
 
-	// Lock the host
-	_CFHostLock(host);
+	return &_HostCache[CFHash(name) % _kCFHostCacheShardCount];
+}
 
-	// If the lookup canceled, don't need to do any of this.
-	if (host->_lookup) {
 
-		// Make sure to toss the cached info now.
-		CFDictionaryRemoveValue(host->_info, (const void*)(host->_type));
+/* static */ void
+_HostCacheCountAdjust(CFIndex delta) {
 
-		// Set the error if got one back from getaddrinfo
-		if (eai_status) {
-			_HandleGetAddrInfoStatus(eai_status, &host->_error, FALSE);
+	__CFSpinLock(&_HostCacheCountLock);
+	_HostCacheCount += delta;
+	__CFSpinUnlock(&_HostCacheCountLock);
+}
 
-			// Mark to indicate the resolution was performed.
-			CFDictionaryAddValue(host->_info, (const void*)(host->_type), kCFNull);
-		}
 
-		else {
+/* static */ CFIndex
+_HostCacheCountGet(void) {
 
-			CFMutableArrayRef addrs;
-			CFAllocatorRef allocator = CFGetAllocator((CFHostRef)host);
+	CFIndex result;
 
-			// This is the list of new addresses to be saved.
-			addrs = CFArrayCreateMutable(allocator, 0, &kCFTypeArrayCallBacks);
+	__CFSpinLock(&_HostCacheCountLock);
+	result = _HostCacheCount;
+	__CFSpinUnlock(&_HostCacheCountLock);
 
-			// Save the memory error if the address cache failed to create.
-			if (!addrs) {
-				host->_error.error = ENOMEM;
-				host->_error.domain = kCFStreamErrorDomainPOSIX;
+	return result;
+}
 
-				// Mark to indicate the resolution was performed.
-				CFDictionaryAddValue(host->_info, (const void*)(host->_type), kCFNull);
-			}
 
-			else {
-				const struct addrinfo* i;
+/* static */ void
+_HostCacheEntryDestroy(_CFHostCacheEntry* entry) {
 
-				// Loop through all of the addresses saving them in the array.
-				for (i = res; i; i = i->ai_next) {
-                    const int family = i->ai_addr->sa_family;
-					CFDataRef data   = NULL;
-					CFIndex   length = 0;
+	CFRelease(entry->_name);
 
-					// Bypass any address families that are not understood by CFSocketStream
-					if (family != AF_INET && family != AF_INET6)
-						continue;
+	if (entry->_addresses)
+		CFRelease(entry->_addresses);
 
-					// Wrap the address in a CFData
-#if HAVE_STRUCT_SOCKADDR_SA_LEN
-					length = i->ai_addr->sa_len;
-#else
-                    length = _AddressSizeForSupportedFamily(family);
-#endif /* HAVE_STRUCT_SOCKADDR_SA_LEN */
-					if (length > 0) {
-						data = CFDataCreate(allocator, (UInt8*)(i->ai_addr), length);
-					}
+	CFAllocatorDeallocate(kCFAllocatorDefault, entry);
+}
 
-					// Fail with a memory error if the address wouldn't wrap.
-					if (!data) {
 
-						host->_error.error = ENOMEM;
-						host->_error.domain = kCFStreamErrorDomainPOSIX;
+/* static */ void
+_HostCacheShardUnlink_NoLock(_CFHostCacheShard* shard, _CFHostCacheEntry* entry) {
 
-						// Release the addresses and mark as NULL so as not to save later.
-						CFRelease(addrs);
-						addrs = NULL;
+	if (entry->_prev)
+		entry->_prev->_next = entry->_next;
+	else
+		shard->_head = entry->_next;
 
-						// Just fail now.
-						break;
-					}
+	if (entry->_next)
+		entry->_next->_prev = entry->_prev;
+	else
+		shard->_tail = entry->_prev;
 
-					// Add the address and continue on to the next.
-					CFArrayAppendValue(addrs, data);
-					CFRelease(data);
-				}
+	entry->_prev = entry->_next = NULL;
+}
 
-				// If the list is still good, need to save it.
-				if (addrs) {
 
-					// Save the list of address on the host.
-					CFDictionaryAddValue(host->_info, (const void*)(host->_type), addrs);
-					CFRelease(addrs);
-				}
-			}
-		}
+/* static */ void
+_HostCacheShardPushFront_NoLock(_CFHostCacheShard* shard, _CFHostCacheEntry* entry) {
 
-		// Save the callback if there is one at this time.
-		cb = host->_callback;
+	entry->_prev = NULL;
+	entry->_next = shard->_head;
 
-		type = host->_type;
+	if (shard->_head)
+		shard->_head->_prev = entry;
+	else
+		shard->_tail = entry;
 
-		// Save the error and client information for the callback
-		memmove(&error, &(host->_error), sizeof(error));
-		info = host->_client.info;
+	shard->_head = entry;
+}
 
-        _HostLookupCancel_NoLock(host);
-	}
 
-	// Unlock the host so the callback can be made safely.
-	_CFHostUnlock(host);
+/* static */ void
+_HostCacheShardRemove_NoLock(_CFHostCacheShard* shard, _CFHostCacheEntry* entry) {
 
-	// Release the results if some were received.
-    if (res) {
-        if (freeaddrinfo_cb) {
-            freeaddrinfo_cb((struct addrinfo *)res);
-        }
-	}
+	_HostCacheShardUnlink_NoLock(shard, entry);
+	CFDictionaryRemoveValue(shard->_entries, entry->_name);
+	shard->_count--;
+	_HostCacheCountAdjust(-1);
 
-	// If there is a callback, inform the client of the finish.
-	if (cb) {
-		cb((CFHostRef)host, type, &error, info);
-	}
+	_HostCacheEntryDestroy(entry);
+}
 
-	// Go ahead and release now that the callback is done.
-	CFRelease((CFHostRef)host);
+
+/* static */ Boolean
+_HostCacheEntryIsExpired(const _CFHostCacheEntry* entry, CFAbsoluteTime now) {
+
+	/* Use abs in order to handle clock changes. */
+	return (fabs(now - entry->_fetched) >= entry->_lifetime);
 }
 
-#if defined(__MACH__) || (HAVE_GETADDRINFO_A && 0)
+
 /* static */ void
-_GetAddrInfoCallBack(int eai_status, const struct addrinfo* res, void* ctxt) {
-    _GetAddrInfoCallBackWithFree(eai_status, res, ctxt, freeaddrinfo);
+_HostCacheShardEvict_NoLock(_CFHostCacheShard* shard, _CFHostCacheEntry* entry, CFAbsoluteTime now) {
+
+	/* Account for entries that would have gone anyway. */
+	if (_HostCacheEntryIsExpired(entry, now))
+		shard->_expirations++;
+	else
+		shard->_evictions++;
+
+	_HostCacheShardRemove_NoLock(shard, entry);
 }
-#endif /* defined(__MACH__) || (HAVE_GETADDRINFO_A && 0) */
 
-#if defined(__MACH__)
+
 /* static */ void
-_GetAddrInfoMachPortCallBack(CFMachPortRef port, void* msg, CFIndex size, void* info) {
+_HostCacheShardTrim_NoLock(_CFHostCacheShard* shard, CFIndex capacity, const _CFHostCacheEntry* keep, CFAbsoluteTime now) {
 
-	getaddrinfo_async_handle_reply(msg);
+	/* Drop the shard's least recently used entries, short of keep, until the cache is within capacity. */
+	while (shard->_tail && (shard->_tail != keep) && (_HostCacheCountGet() > capacity))
+		_HostCacheShardEvict_NoLock(shard, shard->_tail, now);
 }
-#endif /* defined(__MACH__) */
+
 
 /* static */ void
-_GetNameInfoCallBackWithFree_NoLock(int eai_status, char *hostname, char *serv, _CFHost * host, CFHostClientCallBack *cb, void **info, CFStreamError *error) {
-    __Require(hostname != NULL, done);
-    __Require(host != NULL, done);
-    __Require(cb != NULL, done);
-    __Require(info != NULL, done);
-    __Require(error != NULL, done);
+_HostCacheTrim(CFIndex capacity, CFIndex start) {
 
-	// If the lookup canceled, don't need to do any of this.
-	if (host->_lookup) {
+	CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+	Boolean evicted = TRUE;
 
-		// Make sure to toss the cached info now.
-		CFDictionaryRemoveValue(host->_info, (const void*)kCFHostNames);
+	/*
+	** Take the least recently used entry of each shard in turn, beginning
+	** with start, until the cache is within capacity.  Only one shard lock
+	** is held at a time.
+	*/
+	while (evicted && (_HostCacheCountGet() > capacity)) {
 
-		// Set the error if got one back from getnameinfo
-		if (eai_status) {
-			_HandleGetAddrInfoStatus(eai_status, &host->_error, FALSE);
+		CFIndex i;
 
-			// Mark to indicate the resolution was performed.
-			CFDictionaryAddValue(host->_info, (const void*)kCFHostNames, kCFNull);
-		}
+		evicted = FALSE;
 
-		else {
+		for (i = 0; (i < _kCFHostCacheShardCount) && (_HostCacheCountGet() > capacity); i++) {
 
-			CFAllocatorRef allocator = CFGetAllocator((CFHostRef)host);
+			_CFHostCacheShard* shard = &_HostCache[(start + i) % _kCFHostCacheShardCount];
 
-			// Create the name from the given response.
-			CFStringRef name = CFStringCreateWithCString(allocator, hostname, kCFStringEncodingUTF8);
+			_CFMutexLock(&shard->_lock);
 
-			// If didn't create the name, fail with out of memory.
-			if (!name) {
-				host->_error.error = ENOMEM;
-				host->_error.domain = kCFStreamErrorDomainPOSIX;
+			if (shard->_tail) {
+				_HostCacheShardEvict_NoLock(shard, shard->_tail, now);
+				evicted = TRUE;
 			}
 
-			else {
-				// Create the list to hold the name.
-				CFArrayRef names = CFArrayCreate(allocator, (const void**)(&name), 1, &kCFTypeArrayCallBacks);
+			_CFMutexUnlock(&shard->_lock);
+		}
+	}
+}
 
-				// Don't need the retain anymore
-				CFRelease(name);
 
-				// Failed to create the list of names so mark out of memory.
-				if (!names) {
-					host->_error.error = ENOMEM;
-					host->_error.domain = kCFStreamErrorDomainPOSIX;
-				}
+/* static */ Boolean
+_HostCacheCopyAddresses(CFStringRef name, CFArrayRef* addrs, CFStreamError* error) {
 
-				// Save the list of names on the host.
-				else {
-					CFDictionaryAddValue(host->_info, (const void*)kCFHostNames, names);
-					CFRelease(names);
-				}
-			}
-		}
+	Boolean result = FALSE;
+	_CFHostCacheShard* shard;
+	_CFHostCacheEntry* entry;
 
-		// Save the callback if there is one at this time.
-		*cb = host->_callback;
+	*addrs = NULL;
 
-		// Save the error and client information for the callback
-		memmove(error, &(host->_error), sizeof(*error));
-		*info = host->_client.info;
+	/* Make sure the cache has been set up. */
+	CFHostGetTypeID();
 
-        _HostLookupCancel_NoLock(host);
+	shard = _HostCacheShardForName(name);
+
+	_CFMutexLock(&shard->_lock);
+
+	entry = (_CFHostCacheEntry*)CFDictionaryGetValue(shard->_entries, name);
+
+	/* Expire the entry lazily, upon access. */
+	if (entry && _HostCacheEntryIsExpired(entry, CFAbsoluteTimeGetCurrent())) {
+
+		shard->_expirations++;
+		_HostCacheShardRemove_NoLock(shard, entry);
+		entry = NULL;
 	}
 
- done:
-    return;
+	if (!entry)
+		shard->_misses++;
+
+	else {
+
+		/* Move the entry to the front as the most recently used. */
+		_HostCacheShardUnlink_NoLock(shard, entry);
+		_HostCacheShardPushFront_NoLock(shard, entry);
+
+		if (entry->_addresses) {
+			shard->_hits++;
+			*addrs = (CFArrayRef)CFRetain(entry->_addresses);
+		}
+
+		else {
+			shard->_negativeHits++;
+			memmove(error, &entry->_error, sizeof(error[0]));
+		}
+
+		result = TRUE;
+	}
+
+	_CFMutexUnlock(&shard->_lock);
+
+	return result;
 }
 
-/* static */ void
-_GetNameInfoCallBackWithFreeAndWithShouldLock(int eai_status, char *hostname, char *serv, void* ctxt, FreeNameInfoCallBack freenameinfo_cb, Boolean should_lock) {
-	_CFHost *            host = (_CFHost*)ctxt;
-	CFHostClientCallBack cb   = NULL;
-	void *               info = NULL;
-    CFStreamError        error;
 
-	// Retain here to guarantee safety really after the lookups release,
-	// but definitely before the callback.
-	CFRetain((CFHostRef)host);
+/* static */ void
+_HostCacheAdd(CFStringRef name, CFArrayRef addrs, const CFStreamError* error, CFTimeInterval lifetime, CFIndex capacity) {
 
-	// Lock the host, if requested.
+	CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+	_CFHostCacheShard* shard = _HostCacheShardForName(name);
+	_CFHostCacheEntry* entry;
 
-    if (should_lock) {
-        _CFHostLock(host);
-    }
+	/* A zero capacity or lifetime means nothing gets cached. */
+	if ((capacity <= 0) || (lifetime <= 0.0))
+		return;
 
-    _GetNameInfoCallBackWithFree_NoLock(eai_status,
-                                        hostname,
-                                        serv,
-                                        ctxt,
-                                        &cb,
-                                        &info,
-                                        &error);
+	_CFMutexLock(&shard->_lock);
 
-	// Unlock the host, if previously-requested to be locked, so the
-	// callback can be made safely.
+	/* Replace any existing entry for the name. */
+	entry = (_CFHostCacheEntry*)CFDictionaryGetValue(shard->_entries, name);
+	if (entry)
+		_HostCacheShardRemove_NoLock(shard, entry);
 
-    if (should_lock) {
-        _CFHostUnlock(host);
-    }
+	entry = (_CFHostCacheEntry*)CFAllocatorAllocate(kCFAllocatorDefault, sizeof(entry[0]), 0);
 
-	// Release the results if there were any.
-    if (freenameinfo_cb) {
-        freenameinfo_cb(hostname, serv);
-    }
+	if (entry) {
 
-    // Conversely, if no locking was requested, then the host is
-    // already locked. Unlock it before the call out to the client
-    // which may call back into public API functions which WILL lock
-    // and, as a result, WILL deadlock if we call out with the host
-    // locked.
+		memset(entry, 0, sizeof(entry[0]));
 
-    if (!should_lock) {
-        _CFHostUnlock(host);
-    }
+		entry->_name = CFStringCreateCopy(kCFAllocatorDefault, name);
+		entry->_addresses = addrs ? (CFArrayRef)CFRetain(addrs) : NULL;
+		if (error)
+			memmove(&entry->_error, error, sizeof(entry->_error));
+		entry->_fetched = now;
+		entry->_lifetime = lifetime;
 
-	// If there is a callback, inform the client of the finish.
-	if (cb)
-		cb((CFHostRef)host, kCFHostNames, &error, info);
+		if (!entry->_name)
+			_HostCacheEntryDestroy(entry);
 
-    // Restore the host lock state, as appropriate and requested.
+		else {
 
-    if (!should_lock) {
-        _CFHostLock(host);
-    }
+			CFDictionaryAddValue(shard->_entries, entry->_name, entry);
+			_HostCacheShardPushFront_NoLock(shard, entry);
+			shard->_count++;
+			_HostCacheCountAdjust(1);
 
-	// Go ahead and release now that the callback is done.
-	CFRelease((CFHostRef)host);
-}
+			/* Make room from this shard first, since its lock is already held. */
+			_HostCacheShardTrim_NoLock(shard, capacity, entry, now);
+		}
+	}
 
-/* static */ void
-_GetNameInfoCallBackWithFree(int eai_status, char *hostname, char *serv, void* ctxt, FreeNameInfoCallBack freenameinfo_cb) {
-    static const Boolean should_lock = TRUE;
+	_CFMutexUnlock(&shard->_lock);
 
-    _GetNameInfoCallBackWithFreeAndWithShouldLock(eai_status, hostname, serv, ctxt, freenameinfo_cb, should_lock);
+	/* Anything left over comes from the other shards, starting after this one. */
+	if (_HostCacheCountGet() > capacity)
+		_HostCacheTrim(capacity, (shard - _HostCache) + 1);
 }
 
-#if defined(__MACH__)
-/* static */ void
-_FreeNameInfoCallBack_Mach(char *hostname, char *serv) {
-    if (hostname) free(hostname);
-    if (serv) free (serv);
-}
 
 /* static */ void
-_GetNameInfoCallBack(int eai_status, char *hostname, char *serv, void* ctxt) {
-    static const Boolean should_lock = TRUE;
-    FreeNameInfoCallBack free_cb     = _FreeNameInfoCallBack_Mach;
+_HostCacheAddAddresses(CFArrayRef names, CFArrayRef addrs, CFTimeInterval ttl) {
 
-    _GetNameInfoCallBackWithFreeAndWithShouldLock(eai_status, hostname, serv, ctxt, free_cb, should_lock);
-}
+	CFIndex i, count = CFArrayGetCount(names);
+	_CFHostCacheConfiguration config;
 
-/* static */ void
-_GetNameInfoMachPortCallBack(CFMachPortRef port, void* msg, CFIndex size, void* info) {
+	_HostCacheGetConfiguration(&config);
 
-	getnameinfo_async_handle_reply(msg);
-}
+	/* Use the default if the resolver didn't say, but never hold on longer than the maximum. */
+	if (ttl <= 0.0)
+		ttl = config._defaultTimeToLive;
+	if (ttl > config._maximumTimeToLive)
+		ttl = config._maximumTimeToLive;
 
-/* static */ void
-_NetworkReachabilityCallBack(SCNetworkReachabilityRef target, SCNetworkConnectionFlags flags, void* ctxt) {
+	/* Add an entry for each name of the host. */
+	for (i = 0; i < count; i++)
+		_HostCacheAdd((CFStringRef)CFArrayGetValueAtIndex(names, i), addrs, NULL, ttl, config._capacity);
+}
 
-	_CFHost* host = (_CFHost*)ctxt;
-	CFHostClientCallBack cb = NULL;
-	CFStreamError error;
-	void* info = NULL;
 
-	// Retain here to guarantee safety really after the lookups release,
-	// but definitely before the callback.
-	CFRetain((CFHostRef)host);
+/* static */ void
+_HostCacheAddLookupResult(CFHostRef lookup, CFStringRef name, const CFStreamError* error) {
 
-	// Lock the host
-	_CFHostLock(host);
+	/* If no error, add the host to the cache. */
+	if (!error->error) {
 
-	// If the lookup canceled, don't need to do any of this.
-	if (host->_lookup) {
+		/* The host will be saved for each name in the list of names for the host. */
+		CFArrayRef names = CFHostGetInfo(lookup, kCFHostNames, NULL);
+		CFArrayRef addrs = CFHostGetInfo(lookup, _kCFHostMasterAddressLookup, NULL);
 
-		// Create the data for hanging off the host info dictionary
-		CFDataRef reachability = CFDataCreate(CFGetAllocator(target), (const UInt8*)&flags, sizeof(flags));
+		if (names && ((CFTypeRef)names != kCFNull) && addrs && ((CFTypeRef)addrs != kCFNull)) {
 
-		// Make sure to toss the cached info now.
-		CFDictionaryRemoveValue(host->_info, (const void*)kCFHostReachability);
+			/* Use the record time-to-live if the resolver reported one. */
+			CFTimeInterval ttl = -1.0;
+			CFNumberRef number = (CFNumberRef)CFHostGetInfo(lookup, _kCFHostTimeToLive, NULL);
 
-		// If didn't create the data, fail with out of memory.
-		if (!reachability) {
-			host->_error.error = ENOMEM;
-			host->_error.domain = kCFStreamErrorDomainPOSIX;
-		}
+			if (number && ((CFTypeRef)number != kCFNull))
+				CFNumberGetValue(number, kCFNumberDoubleType, &ttl);
 
-		else {
-			// Save the reachability information
-			CFDictionaryAddValue(host->_info, (const void*)kCFHostReachability, reachability);
-			CFRelease(reachability);
+			_HostCacheAddAddresses(names, addrs, ttl);
 		}
+	}
 
-		// Save the callback if there is one at this time.
-		cb = host->_callback;
+	/* Otherwise remember hosts that don't exist. */
+	else
+		_HostCacheAddNegative(name, error);
+}
 
-		// Save the error and client information for the callback
-		memmove(&error, &(host->_error), sizeof(error));
-		info = host->_client.info;
 
-        _HostLookupCancel_NoLock(host);
-	}
+/* static */ Boolean
+_HostCacheIsNegativeError(const CFStreamError* error) {
 
-	// Unlock the host so the callback can be made safely.
-	_CFHostUnlock(host);
+	/* Only "no such host" is worth remembering; anything else may be transient. */
+	if (error->domain != (CFStreamErrorDomain)kCFStreamErrorDomainNetDB)
+		return FALSE;
 
-	// If there is a callback, inform the client of the finish.
-	if (cb)
-		cb((CFHostRef)host, kCFHostReachability, &error, info);
+#if defined(EAI_NODATA) && (EAI_NODATA != EAI_NONAME)
+	if (error->error == EAI_NODATA)
+		return TRUE;
+#endif
 
-	// Go ahead and release now that the callback is done.
-	CFRelease((CFHostRef)host);
+	return ((error->error == EAI_NONAME) || (error->error == HOST_NOT_FOUND));
 }
-#endif /* #if defined(__MACH__) */
 
-#if defined(__MACH__)
+
 /* static */ void
-_NetworkReachabilityByIPCallBack(_CFHost* host) {
+_HostCacheAddNegative(CFStringRef name, const CFStreamError* error) {
 
-	CFHostClientCallBack cb = NULL;
-	CFStreamError error;
-	void* info = NULL;
+	_CFHostCacheConfiguration config;
 
-	// Retain here to guarantee safety really after the lookups release,
-	// but definitely before the callback.
-	CFRetain((CFHostRef)host);
+	if (!_HostCacheIsNegativeError(error))
+		return;
 
-	// Lock the host
-	_CFHostLock(host);
+	_HostCacheGetConfiguration(&config);
 
-	// If the lookup canceled, don't need to do any of this.
-	if (host->_lookup) {
+	if (config._negativeTimeToLive > config._maximumTimeToLive)
+		config._negativeTimeToLive = config._maximumTimeToLive;
 
-		// Save the callback if there is one at this time.
-		cb = host->_callback;
+	_HostCacheAdd(name, NULL, error, config._negativeTimeToLive, config._capacity);
+}
 
-		// Save the error and client information for the callback
-		memmove(&error, &(host->_error), sizeof(error));
-		info = host->_client.info;
 
-        _HostLookupCancel_NoLock(host);
-	}
+/* static */ CFDictionaryRef
+_HostCacheCopyStatistics(void) {
 
-	// Unlock the host so the callback can be made safely.
-	_CFHostUnlock(host);
+	CFIndex i;
+	SInt64 values[6] = {0, 0, 0, 0, 0, 0};
+	CFStringRef keys[6] = {
+		_kCFHostCacheStatisticsEntries,
+		_kCFHostCacheStatisticsHits,
+		_kCFHostCacheStatisticsMisses,
+		_kCFHostCacheStatisticsNegativeHits,
+		_kCFHostCacheStatisticsEvictions,
+		_kCFHostCacheStatisticsExpirations
+	};
+	CFNumberRef numbers[6];
+	CFDictionaryRef result = NULL;
 
-	// If there is a callback, inform the client of the finish.
-	if (cb)
-		cb((CFHostRef)host, kCFHostReachability, &error, info);
+	/* Make sure the cache has been set up. */
+	CFHostGetTypeID();
 
-	// Go ahead and release now that the callback is done.
-	CFRelease((CFHostRef)host);
-}
-#endif /* defined(__MACH__) */
+	for (i = 0; i < _kCFHostCacheShardCount; i++) {
 
-#if defined(__MACH__)
-/* static */ void
-_DNSCallBack_Mach(int32_t status, char *buf, uint32_t len, struct sockaddr *from, int fromlen, void *context) {
+		_CFHostCacheShard* shard = &_HostCache[i];
 
-	_CFHost* host = (_CFHost*)context;
-	CFHostClientCallBack cb = NULL;
-	CFStreamError error;
-	void* info = NULL;
-	CFHostInfoType type = _kCFNullHostInfoType;
+		_CFMutexLock(&shard->_lock);
 
-	// Retain here to guarantee safety really after the lookups release,
-	// but definitely before the callback.
-	CFRetain((CFHostRef)context);
+		values[0] += shard->_count;
+		values[1] += shard->_hits;
+		values[2] += shard->_misses;
+		values[3] += shard->_negativeHits;
+		values[4] += shard->_evictions;
+		values[5] += shard->_expirations;
 
-	// Lock the host
-	_CFHostLock(host);
+		_CFMutexUnlock(&shard->_lock);
+	}
 
-	// If the lookup canceled, don't need to do any of this.
-	if (host->_lookup) {
+	for (i = 0; i < (CFIndex)(sizeof(numbers) / sizeof(numbers[0])); i++)
+		numbers[i] = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &values[i]);
 
-		// Make sure to toss the cached info now.
-		CFDictionaryRemoveValue(host->_info, (const void*)(host->_type));
+	if (numbers[0] && numbers[1] && numbers[2] && numbers[3] && numbers[4] && numbers[5]) {
 
-		// Set the error if got one back from the lookup
-		if (status) {
-			_HandleGetAddrInfoStatus(status, &host->_error, FALSE);
+		result = CFDictionaryCreate(kCFAllocatorDefault,
+									(const void**)keys,
+									(const void**)numbers,
+									sizeof(keys) / sizeof(keys[0]),
+									&kCFTypeDictionaryKeyCallBacks,
+									&kCFTypeDictionaryValueCallBacks);
+	}
 
-			// Mark to indicate the resolution was performed.
-			CFDictionaryAddValue(host->_info, (const void*)(host->_type), kCFNull);
-		}
+	for (i = 0; i < (CFIndex)(sizeof(numbers) / sizeof(numbers[0])); i++) {
+		if (numbers[i])
+			CFRelease(numbers[i]);
+	}
 
-		else {
-			CFAllocatorRef allocator = CFGetAllocator((CFHostRef)context);
+	return result;
+}
 
-			// Wrap the reply and the source of the reply
-			CFDataRef rr = CFDataCreate(allocator, (const UInt8*)buf, len);
-			CFDataRef sa = CFDataCreate(allocator, (const UInt8*)from, fromlen);
 
-			// If couldn't wrap, fail with no memory error.
-			if (!rr || !sa) {
-				host->_error.error = ENOMEM;
-				host->_error.domain = kCFStreamErrorDomainPOSIX;
-			}
+/* static */ Boolean
+_HostCacheSetConfigurationValue(CFStringRef key, CFTypeRef value) {
 
-			else {
+	Boolean result = FALSE;
+	CFIndex capacity = -1;
 
-				// Create the information to put in the info dictionary.
-				CFTypeRef list[2] = {rr, sa};
-				CFArrayRef array = CFArrayCreate(allocator, list, sizeof(list) / sizeof(list[0]), &kCFTypeArrayCallBacks);
+	if (!value || (CFGetTypeID(value) != CFNumberGetTypeID()))
+		return result;
 
-				// Make sure it was created and add it.
-				if (array) {
-					CFDictionaryAddValue(host->_info, (const void*)(host->_type), array);
-					CFRelease(array);
-				}
+	__CFSpinLock(&_HostCacheConfigurationLock);
 
-				// Did make the information list so fail with out of memory
-				else {
-					host->_error.error = ENOMEM;
-					host->_error.domain = kCFStreamErrorDomainPOSIX;
-				}
-			}
+	if (CFEqual(key, _kCFHostPropertyCacheCapacity)) {
 
-			// Release the reply if it was created.
-			if (rr)
-				CFRelease(rr);
+		CFIndex v;
 
-			// Release the sockaddr wrapper if it was created
-			if (sa)
-				CFRelease(sa);
+		if (CFNumberGetValue((CFNumberRef)value, kCFNumberCFIndexType, &v) && (v >= 0)) {
+			_HostCacheConfiguration._capacity = v;
+			capacity = v;
+			result = TRUE;
 		}
+	}
 
-		// Save the callback if there is one at this time.
-		cb = host->_callback;
+	else {
 
-		// Save the type of lookup for the callback.
-		type = host->_type;
+		CFTimeInterval v;
 
-		// Save the error and client information for the callback
-		memmove(&error, &(host->_error), sizeof(error));
-		info = host->_client.info;
+		if (CFNumberGetValue((CFNumberRef)value, kCFNumberDoubleType, &v) && (v >= 0.0)) {
 
-        _HostLookupCancel_NoLock(host);
+			if (CFEqual(key, _kCFHostPropertyCacheDefaultTimeToLive)) {
+				_HostCacheConfiguration._defaultTimeToLive = v;
+				result = TRUE;
+			}
+
+			else if (CFEqual(key, _kCFHostPropertyCacheMaximumTimeToLive)) {
+				_HostCacheConfiguration._maximumTimeToLive = v;
+				result = TRUE;
+			}
+
+			else if (CFEqual(key, _kCFHostPropertyCacheNegativeTimeToLive)) {
+				_HostCacheConfiguration._negativeTimeToLive = v;
+				result = TRUE;
+			}
+		}
 	}
 
-	// Unlock the host so the callback can be made safely.
-	_CFHostUnlock(host);
+	__CFSpinUnlock(&_HostCacheConfigurationLock);
 
-	// If there is a callback, inform the client of the finish.
-	if (cb)
-		cb((CFHostRef)context, type, &error, info);
+	/* Shrinking the cache takes effect immediately. */
+	if (capacity >= 0)
+		_HostCacheTrim(capacity, 0);
 
-	// Go ahead and release now that the callback is done.
-	CFRelease((CFHostRef)context);
+	return result;
 }
 
+
+#if 0
+#pragma mark -
+#pragma mark Batch Resolution
+#endif
+
 /* static */ void
-_DNSMachPortCallBack(CFMachPortRef port, void* msg, CFIndex size, void* info) {
+_HostBatchRegisterClass(void) {
 
-	dns_async_handle_reply(msg);
+	static const CFRuntimeClass _kCFHostBatchClass = {
+		0,												// version
+		"CFHostBatchResolution",						// class name
+		NULL,      										// init
+		NULL,      										// copy
+		(void(*)(CFTypeRef))_HostBatchDestroy,			// dealloc
+		NULL,      										// equal
+		NULL,      										// hash
+		NULL,      										// copyFormattingDesc
+		(CFStringRef(*)(CFTypeRef cf))_HostBatchDescribe	// copyDebugDesc
+	};
+
+	_kCFHostBatchTypeID = _CFRuntimeRegisterClass(&_kCFHostBatchClass);
 }
-#endif /* #if defined(__MACH__) */
+
 
 /* static */ void
-_PrimaryLookupCallBack(CFHostRef theHost, CFHostInfoType typeInfo, const CFStreamError *error, CFStringRef name) {
+_HostBatchDestroy(_CFHostBatch* batch) {
 
-	CFArrayRef list;
+	// Prevent anything else from taking hold
+	__CFSpinLock(&(batch->_lock));
 
-	/* Shut down the host lookup. */
-	CFHostSetClient(theHost, NULL, NULL);
+	// Stop any outstanding lookups and reporting.
+	_HostBatchCancel_NoLock(batch);
 
-	/* Lock the host master list and cache */
-	_CFMutexLock(_HostLock);
+	// Release the user's context info if there is some and a release method
+	if (batch->_client.info && batch->_client.release)
+		batch->_client.release(batch->_client.info);
 
-	/* Get the list of clients. */
-	list = CFDictionaryGetValue(_HostLookups, name);
+	if (batch->_names)
+		CFRelease(batch->_names);
 
-	if (list) {
+	if (batch->_results)
+		CFRelease(batch->_results);
 
-		CFRetain(list);
+	if (batch->_errors)
+		CFRelease(batch->_errors);
 
-		/* Remove the entry from the list of master lookups. */
-		CFDictionaryRemoveValue(_HostLookups, name);
-	}
+	if (batch->_lookups)
+		CFRelease(batch->_lookups);
 
-	_CFMutexUnlock(_HostLock);
+	if (batch->_ready)
+		CFRelease(batch->_ready);
 
-	if (list) {
+	// Release the list of loops and modes
+	if (batch->_schedules)
+		CFRelease(batch->_schedules);
+}
 
-		CFIndex i, count;
-		CFArrayRef addrs = CFHostGetInfo(theHost, _kCFHostMasterAddressLookup, NULL);
 
-		/* If no error, add the host to the cache. */
-		if (!error->error) {
+/* static */ CFStringRef
+_HostBatchDescribe(_CFHostBatch* batch) {
 
-			/* The host will be saved for each name in the list of names for the host. */
-			CFArrayRef names = CFHostGetInfo(theHost, kCFHostNames, NULL);
+	CFStringRef result;
 
-			if (names && ((CFTypeRef)names != kCFNull)) {
+	__CFSpinLock(&(batch->_lock));
 
-				/* Each host cache entry is a host with its fetch time. */
-				CFTypeRef orig[2] = {theHost, CFDateCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent())};
+	result = CFStringCreateWithFormat(CFGetAllocator((CFTypeRef)batch),
+									  NULL,
+									  _kCFHostBatchDescribeFormat,
+									  batch,
+									  batch->_names,
+									  batch->_results);
 
-				/* Only add the entries if the date was created. */
-				if (orig[1]) {
+	__CFSpinUnlock(&(batch->_lock));
 
-					/* Create the CFArray to be added into the cache. */
-					CFArrayRef items = CFArrayCreate(kCFAllocatorDefault, orig, sizeof(orig) / sizeof(orig[0]), &kCFTypeArrayCallBacks);
+	return result;
+}
 
-					CFRelease(orig[1]);
 
-					/* Once again, only add if the list was created. */
-					if (items) {
+/* static */ void
+_HostBatchCancel_NoLock(_CFHostBatch* batch) {
 
-						/* Loop through all the names of the host. */
-						count = CFArrayGetCount(names);
+	CFIndex i, count = batch->_lookups ? CFDictionaryGetCount(batch->_lookups) : 0;
 
-						/* Add an entry for each name. */
-						for (i = 0; i < count; i++)
-							CFDictionaryAddValue(_HostCache, CFArrayGetValueAtIndex(names, i), items);
+	batch->_canceled = TRUE;
 
-						CFRelease(items);
-					}
-				}
-			}
-		}
+	// Stop the outstanding lookups.  Removing the client cancels the lookup.
+	if (count) {
 
-		count = CFArrayGetCount(list);
+		CFTypeRef* hosts = (CFTypeRef*)CFAllocatorAllocate(kCFAllocatorDefault, sizeof(hosts[0]) * count, 0);
 
-		for (i = 1; i < count; i++) {
+		if (hosts) {
 
-			_CFHost* client;
-			CFRunLoopSourceContext ctxt = {0};
-			CFRunLoopSourceRef src = (CFRunLoopSourceRef)CFArrayGetValueAtIndex(list, i);
+			CFDictionaryGetKeysAndValues(batch->_lookups, NULL, hosts);
 
-			CFRunLoopSourceGetContext(src, &ctxt);
-			client = (_CFHost*)ctxt.info;
+			for (i = 0; i < count; i++)
+				CFHostSetClient((CFHostRef)hosts[i], NULL, NULL);
 
-			_CFHostLock(client);
+			CFAllocatorDeallocate(kCFAllocatorDefault, hosts);
+		}
 
-			/* Make sure to toss the cached info now. */
-			CFDictionaryRemoveValue(client->_info, (const void*)(client->_type));
+		CFDictionaryRemoveAllValues(batch->_lookups);
+	}
 
-			/* Deal with the error if there was one. */
-			if (error->error) {
+	if (batch->_ready)
+		CFArrayRemoveAllValues(batch->_ready);
 
-				/* Copy the error over to the client. */
-				memmove(&client->_error, error, sizeof(error[0]));
+	// Stop reporting.
+	if (batch->_source) {
+		_CFTypeUnscheduleFromMultipleRunLoops(batch->_source, batch->_schedules);
+		_CFTypeInvalidate(batch->_source);
+		CFRelease(batch->_source);
+		batch->_source = NULL;
+	}
+}
 
-				/* Mark to indicate the resolution was performed. */
-				CFDictionaryAddValue(client->_info, (const void*)(client->_type), kCFNull);
-			}
 
-			else {
+/* static */ void
+_HostBatchSignal_NoLock(_CFHostBatch* batch) {
 
-				/* Make a copy of the addresses with the client's allocator. */
-				CFArrayRef cp = _CFArrayCreateDeepCopy(CFGetAllocator((CFHostRef)client), addrs);
+	CFArrayRef schedules = batch->_schedules;
+	CFIndex i, count = CFArrayGetCount(schedules);
 
-				if (cp) {
+	/* Signal the source for immediate attention. */
+	CFRunLoopSourceSignal(batch->_source);
 
-					CFDictionaryAddValue(client->_info, (const void*)(client->_type), addrs);
+	/* Make sure the signal can make it through */
+	for (i = 0; i < count; i += 2) {
 
-					CFRelease(cp);
-				}
+		/* Wake up run loop */
+		CFRunLoopWakeUp((CFRunLoopRef)CFArrayGetValueAtIndex(schedules, i));
+	}
+}
 
-				else {
 
-					/* Make sure to error if couldn't create the list. */
-					client->_error.error = ENOMEM;
-					client->_error.domain = kCFStreamErrorDomainPOSIX;
+/* static */ void
+_HostBatchRecord_NoLock(_CFHostBatch* batch, CFStringRef name, CFArrayRef addrs, const CFStreamError* error) {
 
-					/* Mark to indicate the resolution was performed. */
-					CFDictionaryAddValue(client->_info, (const void*)(client->_type), kCFNull);
-				}
-			}
+	/* Save the addresses or mark the failure. */
+	CFDictionarySetValue(batch->_results, name, addrs ? (CFTypeRef)addrs : kCFNull);
 
-			/* Signal the client for immediate attention. */
-			CFRunLoopSourceSignal((CFRunLoopSourceRef)(client->_lookup));
+	if (error && error->error) {
 
-			CFArrayRef schedules = client->_schedules;
-			CFIndex j, c = CFArrayGetCount(schedules);
+		CFDataRef data = CFDataCreate(kCFAllocatorDefault, (const UInt8*)error, sizeof(error[0]));
 
-			/* Make sure the signal can make it through */
-			for (j = 0; j < c; j += 2) {
+		if (data) {
+			CFDictionarySetValue(batch->_errors, name, data);
+			CFRelease(data);
+		}
+	}
 
-				/* Grab the run loop for checking */
-				CFRunLoopRef runloop = (CFRunLoopRef)CFArrayGetValueAtIndex(schedules, j);
+	/* Queue the name for reporting. */
+	CFArrayAppendValue(batch->_ready, name);
+}
 
-				/* If it's sleeping, need to further check it. */
-				if (CFRunLoopIsWaiting(runloop)) {
 
-					/* Grab the mode for further check */
-					CFStringRef mode = CFRunLoopCopyCurrentMode(runloop);
+/* static */ void
+_HostBatchStartLookup(_CFHostBatch* batch, CFStringRef name) {
 
-					if (mode) {
+	CFArrayRef cached = NULL;
+	CFStreamError error = {0, 0};
+	CFHostRef host = NULL;
 
-						/* If the lookup is in the right mode, need to wake up the run loop. */
-						if (CFRunLoopContainsSource(runloop, (CFRunLoopSourceRef)(client->_lookup), mode)) {
-							CFRunLoopWakeUp(runloop);
-						}
+	/* Go for a cache entry, either a list of addresses or a failure. */
+	if (_HostCacheCopyAddresses(name, &cached, &error)) {
 
-						/* Don't need this anymore. */
-						CFRelease(mode);
-					}
-				}
-			}
+		CFArrayRef cp = cached ? _CFArrayCreateDeepCopy(CFGetAllocator((CFTypeRef)batch), cached) : NULL;
 
-			_CFHostUnlock(client);
+		if (cached && !cp) {
+			error.error = ENOMEM;
+			error.domain = kCFStreamErrorDomainPOSIX;
 		}
 
-		CFRelease(list);
+		__CFSpinLock(&(batch->_lock));
+		_HostBatchRecord_NoLock(batch, name, cp, &error);
+		__CFSpinUnlock(&(batch->_lock));
+
+		if (cp)
+			CFRelease(cp);
+
+		if (cached)
+			CFRelease(cached);
+
+		return;
 	}
-}
 
+	host = CFHostCreateWithName(CFGetAllocator((CFTypeRef)batch), name);
 
-/* static */ void
-_AddressLookupSchedule_NoLock(_CFHost* host, CFRunLoopRef rl, CFStringRef mode) {
+	if (!host) {
+		error.error = ENOMEM;
+		error.domain = kCFStreamErrorDomainPOSIX;
+	}
+
+	else {
+
+		/* The batch owns the host, so the host doesn't retain the batch. */
+		CFHostClientContext ctxt = {0, batch, NULL, NULL, NULL};
+		CFArrayRef schedules;
+		CFIndex i, count;
+		Boolean started;
+
+		CFHostSetClient(host, (CFHostClientCallBack)_HostBatchLookupCallBack, &ctxt);
+
+		__CFSpinLock(&(batch->_lock));
+
+		schedules = CFArrayCreateCopy(kCFAllocatorDefault, batch->_schedules);
+
+		/* Track the host before starting, since the lookup may complete as soon as it's scheduled. */
+		if (!batch->_canceled)
+			CFDictionaryAddValue(batch->_lookups, name, host);
+
+		__CFSpinUnlock(&(batch->_lock));
+
+		count = schedules ? CFArrayGetCount(schedules) : 0;
+
+		for (i = 0; i < count; i += 2) {
+			CFHostScheduleWithRunLoop(host,
+									  (CFRunLoopRef)CFArrayGetValueAtIndex(schedules, i),
+									  (CFStringRef)CFArrayGetValueAtIndex(schedules, i + 1));
+		}
+
+		if (schedules)
+			CFRelease(schedules);
+
+		/* Go straight for the master lookup; the batch has already coalesced duplicates. */
+		started = CFHostStartInfoResolution(host, _kCFHostMasterAddressLookup, &error);
+
+		if (started) {
+			CFRelease(host);
+			return;
+		}
 
-	CFArrayRef list;
-	CFArrayRef names = (CFArrayRef)CFDictionaryGetValue(host->_info, (const void*)kCFHostNames);
-	CFStringRef name = (CFStringRef)CFArrayGetValueAtIndex(names, 0);
+		CFHostSetClient(host, NULL, NULL);
 
-	/* Lock the list of master lookups and cache */
-	_CFMutexLock(_HostLock);
+		__CFSpinLock(&(batch->_lock));
+		CFDictionaryRemoveValue(batch->_lookups, name);
+		__CFSpinUnlock(&(batch->_lock));
 
-	list = CFDictionaryGetValue(_HostLookups, name);
+		CFRelease(host);
 
-	if (list) {
-		CFHostScheduleWithRunLoop((CFHostRef)CFArrayGetValueAtIndex(list, 0), rl, mode);
+		/* Make sure a failure is reported as one. */
+		if (!error.error) {
+			error.error = EINVAL;
+			error.domain = kCFStreamErrorDomainPOSIX;
+		}
 	}
 
-	_CFMutexUnlock(_HostLock);
+	__CFSpinLock(&(batch->_lock));
+	_HostBatchRecord_NoLock(batch, name, NULL, &error);
+	__CFSpinUnlock(&(batch->_lock));
 }
 
 
 /* static */ void
-_AddressLookupPerform(_CFHost* host) {
+_HostBatchLookupCallBack(CFHostRef theHost, CFHostInfoType typeInfo, const CFStreamError *error, _CFHostBatch* batch) {
 
-	CFHostClientCallBack cb = NULL;
-	CFStreamError error;
-	void* info = NULL;
+	CFArrayRef names = CFHostGetInfo(theHost, kCFHostNames, NULL);
+	CFStringRef name = (CFStringRef)CFArrayGetValueAtIndex(names, 0);
+	CFArrayRef addrs = CFHostGetInfo(theHost, _kCFHostMasterAddressLookup, NULL);
+
+	/* Cache the addresses or remember hosts that don't exist, just as for other lookups. */
+	_HostCacheAddLookupResult(theHost, name, error);
 
 	// Retain here to guarantee safety really after the lookups release,
-	// but definitely before the callback.
-	CFRetain((CFHostRef)host);
+	// but definitely before the report.
+	CFRetain((CFTypeRef)batch);
+	CFRetain(name);
 
-	// Lock the host
-	_CFHostLock(host);
+	__CFSpinLock(&(batch->_lock));
 
-	// Save the callback if there is one at this time.
-	cb = host->_callback;
+	/* Only record the result if the batch is still waiting on this host. */
+	if (CFDictionaryGetValue(batch->_lookups, name) == theHost) {
 
-	// Save the error and client information for the callback
-	memmove(&error, &(host->_error), sizeof(error));
-	info = host->_client.info;
+		CFHostSetClient(theHost, NULL, NULL);
 
-    _HostLookupCancel_NoLock(host);
+		_HostBatchRecord_NoLock(batch, name, (error->error ? NULL : addrs), error);
 
-	// Unlock the host so the callback can be made safely.
-	_CFHostUnlock(host);
+		/* The host is kept alive by the lookup callout until this returns. */
+		CFDictionaryRemoveValue(batch->_lookups, name);
+	}
 
-	// If there is a callback, inform the client of the finish.
-	if (cb)
-		cb((CFHostRef)host, kCFHostAddresses, &error, info);
+	__CFSpinUnlock(&(batch->_lock));
 
-	// Go ahead and release now that the callback is done.
-	CFRelease((CFHostRef)host);
+	/* Already on a run loop on which the batch is scheduled, so report now. */
+	_HostBatchReport(batch);
+
+	CFRelease(name);
+	CFRelease((CFTypeRef)batch);
 }
 
 
 /* static */ void
-_ExpireCacheEntries(void) {
+_HostBatchReport(_CFHostBatch* batch) {
 
-	CFIndex count;
+	CFHostBatchResolutionCompletionCallBack completion = NULL;
+	void* info = NULL;
 
-	CFStringRef keys_buffer[_kCFHostCacheMaxEntries];
-	CFArrayRef values_buffer[_kCFHostCacheMaxEntries];
+	CFRetain((CFTypeRef)batch);
 
-	CFStringRef* keys = &keys_buffer[0];
-	CFArrayRef* values = &values_buffer[0];
+	/* Report one name at a time, since a callback may cancel the batch. */
+	while (TRUE) {
 
-	/* Lock the cache */
-	_CFMutexLock(_HostLock);
+		CFHostBatchResolutionCallBack cb;
+		CFStringRef name;
+		CFTypeRef addrs;
+		CFDataRef data;
+		CFStreamError error = {0, 0};
 
-	if (_HostCache) {
+		__CFSpinLock(&(batch->_lock));
 
-		/* Get the count for proper allocation if needed and for iteration. */
-		count = CFDictionaryGetCount(_HostCache);
+		if (batch->_canceled || !CFArrayGetCount(batch->_ready)) {
 
-		/* Allocate buffers for keys and values if don't have large enough static buffers. */
-		if (count > _kCFHostCacheMaxEntries) {
+			/* Everything has been reported, so the batch is complete. */
+			if (!batch->_canceled && batch->_started && !batch->_pending && !batch->_completed) {
+				batch->_completed = TRUE;
+				completion = batch->_completion;
+				info = batch->_client.info;
+			}
 
-			keys = (CFStringRef*)CFAllocatorAllocate(kCFAllocatorDefault, sizeof(keys[0]) * count, 0);
-			values = (CFArrayRef*)CFAllocatorAllocate(kCFAllocatorDefault, sizeof(values[0]) * count, 0);
+			__CFSpinUnlock(&(batch->_lock));
+			break;
 		}
 
-		/* Only iterate if buffers were allocated. */
-		if (keys && values) {
-
-			CFIndex i, j = 0;
-			CFTimeInterval oldest = 0.0;
+		name = (CFStringRef)CFRetain(CFArrayGetValueAtIndex(batch->_ready, 0));
+		CFArrayRemoveValueAtIndex(batch->_ready, 0);
+		batch->_pending--;
 
-			/* Get "now" for comparison for freshness. */
-			CFDateRef now = CFDateCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent());
+		addrs = CFRetain(CFDictionaryGetValue(batch->_results, name));
 
-			/* Get all the hosts in the cache */
-			CFDictionaryGetKeysAndValues(_HostCache, (const void **)keys, (const void **)values);
+		data = (CFDataRef)CFDictionaryGetValue(batch->_errors, name);
+		if (data)
+			memmove(&error, CFDataGetBytePtr(data), sizeof(error));
 
-			/* Iterate through and get rid of expired ones. */
-			for (i = 0; i < count; i++) {
+		cb = batch->_callback;
+		info = batch->_client.info;
 
-				/* How long since now?  Use abs in order to handle clock changes. */
-				CFTimeInterval since = fabs(CFDateGetTimeIntervalSinceDate(now, (CFDateRef)CFArrayGetValueAtIndex(values[i], 1)));
+		__CFSpinUnlock(&(batch->_lock));
 
-				/* If timeout, remove the entry. */
-				if (since >= _kCFHostCacheTimeout)
-					CFDictionaryRemoveValue(_HostCache, keys[i]);
+		if (cb)
+			cb((CFHostBatchResolutionRef)batch, name, ((addrs != kCFNull) ? (CFArrayRef)addrs : NULL), &error, info);
 
-				/* If this one is older than the oldest, save it's index. */
-				else if (since > oldest) {
-					j = i;
-					oldest = since;
-				}
-			}
-
-			CFRelease(now);
-
-			/* If the count still isn't in the bounds of maximum number of entries, remove the oldest. */
-			if (CFDictionaryGetCount(_HostCache) >= _kCFHostCacheMaxEntries)
-				CFDictionaryRemoveValue(_HostCache, keys[j]);
-		}
-
-		/* If space for keys was made, deallocate it. */
-		if (keys && (keys != &keys_buffer[0]))
-			CFAllocatorDeallocate(kCFAllocatorDefault, keys);
-
-		/* If space for values was made, deallocate it. */
-		if (values && (values != &values_buffer[0]))
-			CFAllocatorDeallocate(kCFAllocatorDefault, values);
+		CFRelease(addrs);
+		CFRelease(name);
 	}
 
-	_CFMutexUnlock(_HostLock);
+	if (completion)
+		completion((CFHostBatchResolutionRef)batch, info);
+
+	CFRelease((CFTypeRef)batch);
 }
 
 
@@ -4108,6 +5989,62 @@ CFHostGetNames(CFHostRef theHost, Boolean* hasBeenResolved) {
 }
 
 
+/* extern */ CFTypeRef
+CFHostCopyProperty(CFHostRef theHost, CFStringRef propertyName) {
+
+	CFTypeRef result = NULL;
+	_CFHostCacheConfiguration config;
+
+	/* The cache and resolver properties are process-wide; the host isn't needed. */
+	_HostCacheGetConfiguration(&config);
+
+	if (CFEqual(propertyName, _kCFHostPropertyCacheCapacity))
+		result = CFNumberCreate(kCFAllocatorDefault, kCFNumberCFIndexType, &config._capacity);
+
+	else if (CFEqual(propertyName, _kCFHostPropertyCacheDefaultTimeToLive))
+		result = CFNumberCreate(kCFAllocatorDefault, kCFNumberDoubleType, &config._defaultTimeToLive);
+
+	else if (CFEqual(propertyName, _kCFHostPropertyCacheMaximumTimeToLive))
+		result = CFNumberCreate(kCFAllocatorDefault, kCFNumberDoubleType, &config._maximumTimeToLive);
+
+	else if (CFEqual(propertyName, _kCFHostPropertyCacheNegativeTimeToLive))
+		result = CFNumberCreate(kCFAllocatorDefault, kCFNumberDoubleType, &config._negativeTimeToLive);
+
+	else if (CFEqual(propertyName, _kCFHostPropertyCacheStatistics))
+		result = _HostCacheCopyStatistics();
+
+#if defined(__linux__)
+#if (HAVE_ARES_INIT && 1)
+	else
+		result = _AresCopyConfigurationValue(propertyName);
+#endif /* (HAVE_ARES_INIT && 1) */
+#endif /* defined(__linux__) */
+
+	return result;
+}
+
+
+/* extern */ Boolean
+CFHostSetProperty(CFHostRef theHost, CFStringRef propertyName, CFTypeRef propertyValue) {
+
+	/* The cache and resolver properties are process-wide; the host isn't needed.
+	   Make sure the cache has been set up before it may be trimmed. */
+	CFHostGetTypeID();
+
+#if defined(__linux__)
+#if (HAVE_ARES_INIT && 1)
+	if (CFEqual(propertyName, _kCFHostPropertyResolverSharedChannel) ||
+		CFEqual(propertyName, _kCFHostPropertyResolverServers))
+	{
+		return _AresSetConfigurationValue(propertyName, propertyValue);
+	}
+#endif /* (HAVE_ARES_INIT && 1) */
+#endif /* defined(__linux__) */
+
+	return _HostCacheSetConfigurationValue(propertyName, propertyValue);
+}
+
+
 #if defined(__MACH__)
 /* extern */ CFDataRef
 CFHostGetReachability(CFHostRef theHost, Boolean* hasBeenResolved) {
@@ -4189,6 +6126,13 @@ CFHostCancelInfoResolution(CFHostRef theHost, CFHostInfoType info) {
 			_CFMutexUnlock(_HostLock);
 		}
 
+#if defined(__linux__)
+#if (HAVE_ARES_INIT && 1)
+		// Detach from any request on the shared channel
+		_AresSharedLookupDetach(host->_lookup);
+#endif /* (HAVE_ARES_INIT && 1) */
+#endif /* defined(__linux__) */
+
 		// Release the lookup now.
 		CFRelease(host->_lookup);
 
@@ -4305,6 +6249,13 @@ CFHostSetClient(CFHostRef theHost, CFHostClientCallBack clientCB, CFHostClientCo
 				_CFMutexUnlock(_HostLock);
 			}
 
+#if defined(__linux__)
+#if (HAVE_ARES_INIT && 1)
+			// Detach from any request on the shared channel
+			_AresSharedLookupDetach(host->_lookup);
+#endif /* (HAVE_ARES_INIT && 1) */
+#endif /* defined(__linux__) */
+
 			// Release the lookup now.
 			CFRelease(host->_lookup);
 			host->_lookup = NULL;
@@ -4386,3 +6337,332 @@ CFHostUnscheduleFromRunLoop(CFHostRef theHost, CFRunLoopRef runLoop, CFStringRef
 	_CFHostUnlock(host);
 }
 
+
+
+/* extern */ CFTypeID
+CFHostBatchResolutionGetTypeID(void) {
+
+	/* Batches are built from hosts, so make sure those are set up, too. */
+	CFHostGetTypeID();
+
+	_CFDoOnce(&_kCFHostBatchRegisterClass, _HostBatchRegisterClass);
+
+	return _kCFHostBatchTypeID;
+}
+
+
+/* extern */ CFHostBatchResolutionRef
+CFHostCreateBatchResolution(CFAllocatorRef allocator, CFArrayRef names) {
+
+	CFIndex i, count = CFArrayGetCount(names);
+	CFMutableArrayRef unique = NULL;
+	CFMutableSetRef seen = NULL;
+
+	_CFHostBatch* result = (_CFHostBatch*)_CFRuntimeCreateInstance(allocator,
+																	CFHostBatchResolutionGetTypeID(),
+																	sizeof(result[0]) - sizeof(CFRuntimeBase),
+																	NULL);
+
+	if (!result)
+		return NULL;
+
+	{
+		// Save a copy of the base so it's easier to zero the struct
+		CFRuntimeBase copy = result->_base;
+
+		// Clear everything.
+		memset(result, 0, sizeof(result[0]));
+
+		// Put back the base
+		memmove(&(result->_base), &copy, sizeof(result->_base));
+	}
+
+	CF_SPINLOCK_INIT_FOR_STRUCTS(result->_lock);
+
+	unique = CFArrayCreateMutable(allocator, count, &kCFTypeArrayCallBacks);
+	seen = CFSetCreateMutable(kCFAllocatorDefault, count, &kCFTypeSetCallBacks);
+
+	result->_results = CFDictionaryCreateMutable(allocator, count, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	result->_errors = CFDictionaryCreateMutable(allocator, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	result->_lookups = CFDictionaryCreateMutable(allocator, count, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	result->_ready = CFArrayCreateMutable(allocator, count, &kCFTypeArrayCallBacks);
+	result->_schedules = CFArrayCreateMutable(allocator, 0, &kCFTypeArrayCallBacks);
+
+	// If any failed, need to release and return null
+	if (!unique || !seen || !result->_results || !result->_errors || !result->_lookups || !result->_ready || !result->_schedules) {
+		CFRelease((CFTypeRef)result);
+		result = NULL;
+	}
+
+	else {
+
+		/* Coalesce duplicate names, keeping the first of each. */
+		for (i = 0; i < count; i++) {
+
+			CFStringRef name = (CFStringRef)CFArrayGetValueAtIndex(names, i);
+
+			if (!name || (CFGetTypeID(name) != CFStringGetTypeID())) {
+				CFRelease((CFTypeRef)result);
+				result = NULL;
+				break;
+			}
+
+			if (!CFSetContainsValue(seen, name)) {
+
+				CFStringRef cp = CFStringCreateCopy(allocator, name);
+
+				if (!cp) {
+					CFRelease((CFTypeRef)result);
+					result = NULL;
+					break;
+				}
+
+				CFSetAddValue(seen, cp);
+				CFArrayAppendValue(unique, cp);
+				CFRelease(cp);
+			}
+		}
+
+		if (result) {
+			result->_names = unique;
+			result->_pending = CFArrayGetCount(unique);
+			unique = NULL;
+		}
+	}
+
+	if (unique)
+		CFRelease(unique);
+
+	if (seen)
+		CFRelease(seen);
+
+	return (CFHostBatchResolutionRef)result;
+}
+
+
+/* extern */ Boolean
+CFHostBatchResolutionSetClient(CFHostBatchResolutionRef theBatch, CFHostBatchResolutionCallBack clientCB, CFHostBatchResolutionCompletionCallBack completionCB, CFHostClientContext* clientContext) {
+
+	_CFHostBatch* batch = (_CFHostBatch*)theBatch;
+
+	// Lock down the batch
+	__CFSpinLock(&(batch->_lock));
+
+	// Release the user's context info if there is some and a release method
+	if (batch->_client.info && batch->_client.release)
+		batch->_client.release(batch->_client.info);
+
+	// NULL callbacks or context signals to remove the client
+	if ((!clientCB && !completionCB) || !clientContext) {
+
+		// Zero out the callbacks and client context.
+		batch->_callback = NULL;
+		batch->_completion = NULL;
+		memset(&(batch->_client), 0, sizeof(batch->_client));
+	}
+
+	else {
+
+		// Save the client's new callbacks
+		batch->_callback = clientCB;
+		batch->_completion = completionCB;
+
+		// Copy the client's context
+		memmove(&(batch->_client), clientContext, sizeof(batch->_client));
+
+		// If there is user data and a retain method, call it.
+		if (batch->_client.info && batch->_client.retain)
+			batch->_client.info = (void*)(batch->_client.retain(batch->_client.info));
+	}
+
+	// Unlock the batch
+	__CFSpinUnlock(&(batch->_lock));
+
+	return TRUE;
+}
+
+
+/* extern */ void
+CFHostBatchResolutionScheduleWithRunLoop(CFHostBatchResolutionRef theBatch, CFRunLoopRef runLoop, CFStringRef runLoopMode) {
+
+	_CFHostBatch* batch = (_CFHostBatch*)theBatch;
+
+	/* Lock down the batch before work */
+	__CFSpinLock(&(batch->_lock));
+
+	/* Try adding the schedule to the list.  If it's added, need to do more work. */
+	if (_SchedulesAddRunLoopAndMode(batch->_schedules, runLoop, runLoopMode)) {
+
+		CFIndex i, count = CFDictionaryGetCount(batch->_lookups);
+
+		/* If reporting, need to schedule the source. */
+		if (batch->_source)
+			_CFTypeScheduleOnRunLoop(batch->_source, runLoop, runLoopMode);
+
+		/* Schedule each of the outstanding lookups, too. */
+		if (count) {
+
+			CFTypeRef* hosts = (CFTypeRef*)CFAllocatorAllocate(kCFAllocatorDefault, sizeof(hosts[0]) * count, 0);
+
+			if (hosts) {
+
+				CFDictionaryGetKeysAndValues(batch->_lookups, NULL, hosts);
+
+				for (i = 0; i < count; i++)
+					CFHostScheduleWithRunLoop((CFHostRef)hosts[i], runLoop, runLoopMode);
+
+				CFAllocatorDeallocate(kCFAllocatorDefault, hosts);
+			}
+		}
+	}
+
+	/* Unlock the batch */
+	__CFSpinUnlock(&(batch->_lock));
+}
+
+
+/* extern */ void
+CFHostBatchResolutionUnscheduleFromRunLoop(CFHostBatchResolutionRef theBatch, CFRunLoopRef runLoop, CFStringRef runLoopMode) {
+
+	_CFHostBatch* batch = (_CFHostBatch*)theBatch;
+
+	/* Lock down the batch before work */
+	__CFSpinLock(&(batch->_lock));
+
+	/* Try to remove the schedule from the list.  If it is removed, need to do more. */
+	if (_SchedulesRemoveRunLoopAndMode(batch->_schedules, runLoop, runLoopMode)) {
+
+		CFIndex i, count = CFDictionaryGetCount(batch->_lookups);
+
+		/* If reporting, need to unschedule the source. */
+		if (batch->_source)
+			_CFTypeUnscheduleFromRunLoop(batch->_source, runLoop, runLoopMode);
+
+		/* Unschedule each of the outstanding lookups, too. */
+		if (count) {
+
+			CFTypeRef* hosts = (CFTypeRef*)CFAllocatorAllocate(kCFAllocatorDefault, sizeof(hosts[0]) * count, 0);
+
+			if (hosts) {
+
+				CFDictionaryGetKeysAndValues(batch->_lookups, NULL, hosts);
+
+				for (i = 0; i < count; i++)
+					CFHostUnscheduleFromRunLoop((CFHostRef)hosts[i], runLoop, runLoopMode);
+
+				CFAllocatorDeallocate(kCFAllocatorDefault, hosts);
+			}
+		}
+	}
+
+	/* Unlock the batch */
+	__CFSpinUnlock(&(batch->_lock));
+}
+
+
+/* extern */ Boolean
+CFHostBatchResolutionStart(CFHostBatchResolutionRef theBatch, CFStreamError* error) {
+
+	_CFHostBatch* batch = (_CFHostBatch*)theBatch;
+	CFStreamError extra;
+	CFIndex i, count;
+
+	CFRunLoopSourceContext ctxt = {
+		0,									// version
+		batch,								// info
+		NULL,								// retain
+		NULL,								// release
+		NULL,								// copyDescription
+		NULL,								// equal
+		NULL,								// hash
+		NULL,								// schedule
+		NULL,								// cancel
+		(void(*)(void*))(&_HostBatchReport)	// perform
+	};
+
+	if (!error)
+		error = &extra;
+
+	memset(error, 0, sizeof(error[0]));
+
+	// Retain so it doesn't go away underneath in the case of a callout.
+	CFRetain(theBatch);
+
+	__CFSpinLock(&(batch->_lock));
+
+	// A batch only runs once.
+	if (batch->_started || batch->_canceled) {
+		error->error = EINVAL;
+		error->domain = kCFStreamErrorDomainPOSIX;
+	}
+
+	else {
+
+		// Create the source from which queued results are reported.  It doesn't
+		// retain the batch, which invalidates it before going away.
+		batch->_source = CFRunLoopSourceCreate(CFGetAllocator(theBatch), 0, &ctxt);
+
+		if (!batch->_source) {
+			error->error = ENOMEM;
+			error->domain = kCFStreamErrorDomainPOSIX;
+		}
+
+		else {
+			_CFTypeScheduleOnMultipleRunLoops(batch->_source, batch->_schedules);
+			batch->_started = TRUE;
+		}
+	}
+
+	__CFSpinUnlock(&(batch->_lock));
+
+	if (!error->error) {
+
+		// Issue every lookup before reporting any result.
+		count = CFArrayGetCount(batch->_names);
+
+		for (i = 0; i < count; i++)
+			_HostBatchStartLookup(batch, (CFStringRef)CFArrayGetValueAtIndex(batch->_names, i));
+
+		// Report the results already known, and completion of an empty batch,
+		// from the run loop rather than from here.
+		__CFSpinLock(&(batch->_lock));
+
+		if (batch->_source && (CFArrayGetCount(batch->_ready) || !batch->_pending))
+			_HostBatchSignal_NoLock(batch);
+
+		__CFSpinUnlock(&(batch->_lock));
+	}
+
+	CFRelease(theBatch);
+
+	return (error->error ? FALSE : TRUE);
+}
+
+
+/* extern */ void
+CFHostBatchResolutionCancel(CFHostBatchResolutionRef theBatch) {
+
+	_CFHostBatch* batch = (_CFHostBatch*)theBatch;
+
+	__CFSpinLock(&(batch->_lock));
+
+	_HostBatchCancel_NoLock(batch);
+
+	__CFSpinUnlock(&(batch->_lock));
+}
+
+
+/* extern */ CFDictionaryRef
+CFHostBatchResolutionCopyResults(CFHostBatchResolutionRef theBatch) {
+
+	_CFHostBatch* batch = (_CFHostBatch*)theBatch;
+	CFDictionaryRef result;
+
+	__CFSpinLock(&(batch->_lock));
+
+	result = CFDictionaryCreateCopy(CFGetAllocator(theBatch), batch->_results);
+
+	__CFSpinUnlock(&(batch->_lock));
+
+	return result;
+}
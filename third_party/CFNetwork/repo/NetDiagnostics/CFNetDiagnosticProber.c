@@ -0,0 +1,986 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+/*
+ *  CFNetDiagnosticProber.c
+ *  CFNetwork
+ *
+ */
+
+
+#pragma mark Description
+/*
+    The prober sends ICMP echo requests to many targets at once, where
+    _CFNetDiagnosticPing pings one host at a time and blocks while it waits.
+
+    There is one socket per address family, made the first time a target of that
+    family is probed and shared by every target after.  They are unprivileged
+    datagram ICMP sockets, as _CFNetDiagnosticPing uses; on Linux, the user must be
+    in net.ipv4.ping_group_range.  Linux chooses the echo identifier of such a socket
+    itself, as the port it is bound to, so each socket is bound when made and its
+    identifier read back.  Replies are matched on the identifier and on the sequence
+    number, which is unique across the prober, then checked against the source
+    address and a cookie in the payload naming the target.  IPv4 replies may or may
+    not come with their IP header, depending on the system; it is skipped if present.
+
+    Names are resolved with CFHost, scheduled on the prober's run loops, so nothing
+    blocks.  A single timer, rescheduled after every event to the earliest time
+    anything is due, sends each target's probes every interval and counts a probe
+    lost once its timeout passes; a reply which comes later than that is ignored.  Once all of a target's probes are answered or
+    lost, the target is removed and its statistics given to the client.
+
+    All state is guarded by the prober's lock, which is released before calling the
+    client.
+*/
+
+#pragma mark -
+#pragma mark Includes
+#if HAVE_CONFIG_H
+#include "opencfnetwork-config.h"
+#endif
+
+#include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFNetDiagnosticsPriv.h>
+#include "CFNetworkInternal.h"							/* for __CFSpinLock and __CFSpinUnlock */
+#include "CFNetworkSchedule.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#pragma mark -
+#pragma mark Constants
+
+#define kProberICMPEchoRequest          8
+#define kProberICMPEchoReply            0
+#define kProberICMPv6EchoRequest        128
+#define kProberICMPv6EchoReply          129
+
+#define kProberFamilyIPv4               0
+#define kProberFamilyIPv6               1
+#define kProberFamilyCount              2
+
+// Large enough for any reply to our probes, with an IPv4 header and options in front
+#define kProberReceiveBufferSize        2048
+
+// The timer repeats this rarely, so that it stays valid between explicit fire dates
+#define kProberTimerIdleInterval        1.0e10
+
+#ifdef __CONSTANT_CFSTRINGS__
+#define _kCFNetDiagnosticProberDescribeFormat	CFSTR("<_CFNetDiagnosticProber 0x%x>{targets=%d, outstanding=%d}")
+#else
+CONST_STRING_DECL_LOCAL(_kCFNetDiagnosticProberDescribeFormat, "<_CFNetDiagnosticProber 0x%x>{targets=%d, outstanding=%d}")
+#endif	/* __CONSTANT_CFSTRINGS__ */
+
+
+#pragma mark -
+#pragma mark Type Declarations
+
+typedef struct {
+    UInt8                   type;
+    UInt8                   code;
+    UInt16                  checksum;
+    UInt16                  identifier;
+    UInt16                  sequence;
+} _ProberICMPHeader;
+
+// What is sent, and echoed back.
+typedef struct {
+    _ProberICMPHeader       header;
+    UInt64                  cookie;         // The target, so stray replies can not be taken for ours
+    CFAbsoluteTime          sent;
+} _ProberPacket;
+
+typedef struct {
+    CFStringRef             name;
+    CFDataRef               address;        // NULL until resolved
+    CFHostRef               host;           // Set while resolving
+    CFIndex                 sent;
+    CFIndex                 received;
+    CFIndex                 outstanding;
+    CFTimeInterval          minimum;
+    CFTimeInterval          maximum;
+    CFTimeInterval          total;
+    CFAbsoluteTime          nextSend;
+    CFStreamError           error;
+} _ProberTarget;
+
+typedef struct {
+    _ProberTarget*          target;
+    CFAbsoluteTime          sent;
+    CFAbsoluteTime          deadline;
+} _ProberProbe;
+
+typedef struct {
+    CFRuntimeBase                           _base;
+
+    CFSpinLock_t                            _lock;
+
+    CFIndex                                 _count;
+    CFTimeInterval                          _interval;
+    CFTimeInterval                          _timeout;
+
+    _CFNetDiagnosticProberCallBack          _callback;
+    _CFNetDiagnosticProberClientContext     _client;
+
+    CFMutableArrayRef                       _schedules;
+    CFRunLoopTimerRef                       _timer;
+    CFSocketRef                             _sockets[kProberFamilyCount];
+
+    CFMutableArrayRef                       _targets;       // _ProberTarget*, not retained
+    CFMutableDictionaryRef                  _probes;        // Sequence number to outstanding _ProberProbe*
+    UInt16                                  _sequence;
+    UInt16                                  _identifiers[kProberFamilyCount];
+} _CFNetDiagnosticProber;
+
+
+#pragma mark -
+#pragma mark Static Function Declarations
+
+static void _ProberRegisterClass(void);
+static void _ProberDestroy(_CFNetDiagnosticProber* prober);
+static CFStringRef _ProberDescribe(_CFNetDiagnosticProber* prober);
+static void _ProberInvalidate_NoLock(_CFNetDiagnosticProber* prober);
+
+static void _ProberTimerCallBack(CFRunLoopTimerRef timer, _CFNetDiagnosticProber* prober);
+static void _ProberSocketCallBack(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void* data, _CFNetDiagnosticProber* prober);
+static void _ProberHostCallBack(CFHostRef host, CFHostInfoType typeInfo, const CFStreamError* error, _CFNetDiagnosticProber* prober);
+
+static CFSocketRef _ProberGetSocket_NoLock(_CFNetDiagnosticProber* prober, int family, CFStreamError* error);
+static void _ProberSend_NoLock(_CFNetDiagnosticProber* prober, _ProberTarget* target, CFAbsoluteTime now);
+static void _ProberReceive_NoLock(_CFNetDiagnosticProber* prober, CFSocketRef s, CFAbsoluteTime now);
+static CFArrayRef _ProberRun_NoLock(_CFNetDiagnosticProber* prober);
+static void _ProberReport(_CFNetDiagnosticProber* prober, CFArrayRef finished);
+static void _ProberTargetDestroy(_ProberTarget* target);
+static UInt16 _ProberChecksum(const void* data, CFIndex length);
+
+
+#pragma mark -
+#pragma mark Globals
+
+static _CFOnceLock _kCFNetDiagnosticProberRegisterClass = _CFOnceInitializer;
+static CFTypeID _kCFNetDiagnosticProberTypeID = _kCFRuntimeNotATypeID;
+
+
+#pragma mark -
+#pragma mark Static Function Definitions
+
+/* static */ void
+_ProberRegisterClass(void) {
+
+    static const CFRuntimeClass _kCFNetDiagnosticProberClass = {
+        0,                                                  // version
+        "_CFNetDiagnosticProber",                           // class name
+        NULL,                                               // init
+        NULL,                                               // copy
+        (void(*)(CFTypeRef))_ProberDestroy,                 // dealloc
+        NULL,                                               // equal
+        NULL,                                               // hash
+        NULL,                                               // copyFormattingDesc
+        (CFStringRef(*)(CFTypeRef cf))_ProberDescribe       // copyDebugDesc
+    };
+
+    _kCFNetDiagnosticProberTypeID = _CFRuntimeRegisterClass(&_kCFNetDiagnosticProberClass);
+}
+
+
+/* static */ void
+_ProberDestroy(_CFNetDiagnosticProber* prober) {
+
+    __CFSpinLock(&prober->_lock);
+
+    _ProberInvalidate_NoLock(prober);
+
+    if (prober->_schedules)
+        CFRelease(prober->_schedules);
+    if (prober->_targets)
+        CFRelease(prober->_targets);
+    if (prober->_probes)
+        CFRelease(prober->_probes);
+
+    __CFSpinUnlock(&prober->_lock);
+}
+
+
+/* static */ CFStringRef
+_ProberDescribe(_CFNetDiagnosticProber* prober) {
+
+    CFStringRef result;
+
+    __CFSpinLock(&prober->_lock);
+
+    result = CFStringCreateWithFormat(CFGetAllocator((CFTypeRef)prober),
+                                      NULL,
+                                      _kCFNetDiagnosticProberDescribeFormat,
+                                      prober,
+                                      (int)(prober->_targets ? CFArrayGetCount(prober->_targets) : 0),
+                                      (int)(prober->_probes ? CFDictionaryGetCount(prober->_probes) : 0));
+
+    __CFSpinUnlock(&prober->_lock);
+
+    return result;
+}
+
+
+static void
+_ProberFreeProbe(const void* key, const void* value, void* context) {
+    CFAllocatorDeallocate((CFAllocatorRef)context, (void*)value);
+}
+
+
+/* static */ void
+_ProberInvalidate_NoLock(_CFNetDiagnosticProber* prober) {
+
+    CFAllocatorRef alloc = CFGetAllocator((CFTypeRef)prober);
+    CFIndex i;
+
+    if (prober->_timer) {
+        CFRunLoopTimerInvalidate(prober->_timer);
+        CFRelease(prober->_timer);
+        prober->_timer = NULL;
+    }
+
+    for (i = 0; i < kProberFamilyCount; i++) {
+        if (prober->_sockets[i]) {
+            CFSocketInvalidate(prober->_sockets[i]);
+            CFRelease(prober->_sockets[i]);
+            prober->_sockets[i] = NULL;
+        }
+    }
+
+    if (prober->_probes) {
+        CFDictionaryApplyFunction(prober->_probes, _ProberFreeProbe, (void*)alloc);
+        CFDictionaryRemoveAllValues(prober->_probes);
+    }
+
+    if (prober->_targets) {
+
+        for (i = CFArrayGetCount(prober->_targets) - 1; i >= 0; i--) {
+
+            _ProberTarget* target = (_ProberTarget*)CFArrayGetValueAtIndex(prober->_targets, i);
+
+            if (target->host) {
+                CFHostSetClient(target->host, NULL, NULL);
+                CFHostCancelInfoResolution(target->host, kCFHostAddresses);
+                _CFTypeUnscheduleFromMultipleRunLoops(target->host, prober->_schedules);
+            }
+
+            _ProberTargetDestroy(target);
+        }
+
+        CFArrayRemoveAllValues(prober->_targets);
+    }
+
+    if (prober->_client.info && prober->_client.release)
+        prober->_client.release(prober->_client.info);
+
+    memset(&prober->_client, 0, sizeof(prober->_client));
+    prober->_callback = NULL;
+}
+
+
+/* static */ void
+_ProberTargetDestroy(_ProberTarget* target) {
+
+    CFAllocatorRef alloc = CFGetAllocator(target->name);
+
+    if (target->host)
+        CFRelease(target->host);
+    if (target->address)
+        CFRelease(target->address);
+    CFRelease(target->name);
+
+    CFAllocatorDeallocate(alloc, target);
+}
+
+
+/* static */ UInt16
+_ProberChecksum(const void* data, CFIndex length) {
+
+    const UInt16* words = (const UInt16*)data;
+    UInt32 sum = 0;
+
+    for (; length > 1; length -= 2)
+        sum += *words++;
+
+    if (length)
+        sum += *(const UInt8*)words;
+
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    sum += (sum >> 16);
+
+    return (UInt16)~sum;
+}
+
+
+/* static */ CFSocketRef
+_ProberGetSocket_NoLock(_CFNetDiagnosticProber* prober, int family, CFStreamError* error) {
+
+    CFIndex index = (family == AF_INET6) ? kProberFamilyIPv6 : kProberFamilyIPv4;
+    CFSocketContext ctxt = {0, prober, NULL, NULL, NULL};
+    int s;
+
+    if (prober->_sockets[index])
+        return prober->_sockets[index];
+
+    s = socket(family, SOCK_DGRAM, (family == AF_INET6) ? IPPROTO_ICMPV6 : IPPROTO_ICMP);
+    if (s < 0) {
+        error->domain = kCFStreamErrorDomainPOSIX;
+        error->error = errno;
+        return NULL;
+    }
+
+    prober->_sockets[index] = CFSocketCreateWithNative(CFGetAllocator((CFTypeRef)prober),
+                                                       s,
+                                                       kCFSocketReadCallBack,
+                                                       (CFSocketCallBack)_ProberSocketCallBack,
+                                                       &ctxt);
+
+    if (!prober->_sockets[index]) {
+        close(s);
+        error->domain = kCFStreamErrorDomainPOSIX;
+        error->error = ENOMEM;
+        return NULL;
+    }
+
+#if defined(__linux__)
+    {
+        struct sockaddr_storage local;
+        socklen_t length = sizeof(local);
+
+        memset(&local, 0, sizeof(local));
+        local.ss_family = family;
+
+        if ((bind(s, (struct sockaddr*)&local, (family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) == 0) &&
+            (getsockname(s, (struct sockaddr*)&local, &length) == 0))
+        {
+            if (family == AF_INET6)
+                prober->_identifiers[index] = ntohs(((struct sockaddr_in6*)&local)->sin6_port);
+            else
+                prober->_identifiers[index] = ntohs(((struct sockaddr_in*)&local)->sin_port);
+        }
+    }
+#endif
+
+    _CFTypeScheduleOnMultipleRunLoops(prober->_sockets[index], prober->_schedules);
+
+    return prober->_sockets[index];
+}
+
+
+/* static */ void
+_ProberSend_NoLock(_CFNetDiagnosticProber* prober, _ProberTarget* target, CFAbsoluteTime now) {
+
+    const struct sockaddr* sa = (const struct sockaddr*)CFDataGetBytePtr(target->address);
+    CFStreamError error = {0, 0};
+    CFSocketRef s = _ProberGetSocket_NoLock(prober, sa->sa_family, &error);
+    CFIndex index = (sa->sa_family == AF_INET6) ? kProberFamilyIPv6 : kProberFamilyIPv4;
+    _ProberPacket packet;
+    _ProberProbe* probe;
+    UInt16 sequence;
+
+    if (!s) {
+        target->error = error;
+        return;
+    }
+
+    // Skip any sequence number still outstanding from 65536 probes ago.
+    do {
+        sequence = prober->_sequence++;
+    } while (CFDictionaryContainsKey(prober->_probes, (const void*)(uintptr_t)sequence));
+
+    memset(&packet, 0, sizeof(packet));
+    packet.header.type = (sa->sa_family == AF_INET6) ? kProberICMPv6EchoRequest : kProberICMPEchoRequest;
+    packet.header.identifier = htons(prober->_identifiers[index]);
+    packet.header.sequence = htons(sequence);
+    packet.cookie = (UInt64)(uintptr_t)target;
+    packet.sent = now;
+
+    // The kernel fills in the ICMPv6 checksum, which covers a pseudo-header.
+    if (sa->sa_family == AF_INET)
+        packet.header.checksum = _ProberChecksum(&packet, sizeof(packet));
+
+    target->sent++;
+    target->nextSend = now + prober->_interval;
+
+    // A probe which can not be sent is simply lost.
+    if (sendto(CFSocketGetNative(s), &packet, sizeof(packet), 0, sa, (socklen_t)CFDataGetLength(target->address)) != sizeof(packet))
+        return;
+
+    probe = CFAllocatorAllocate(CFGetAllocator((CFTypeRef)prober), sizeof(probe[0]), 0);
+    if (!probe)
+        return;
+
+    probe->target = target;
+    probe->sent = now;
+    probe->deadline = now + prober->_timeout;
+
+    CFDictionarySetValue(prober->_probes, (const void*)(uintptr_t)sequence, probe);
+    target->outstanding++;
+}
+
+
+/* static */ void
+_ProberReceive_NoLock(_CFNetDiagnosticProber* prober, CFSocketRef s, CFAbsoluteTime now) {
+
+    CFAllocatorRef alloc = CFGetAllocator((CFTypeRef)prober);
+    Boolean isIPv6 = (s == prober->_sockets[kProberFamilyIPv6]);
+    UInt16 identifier = prober->_identifiers[isIPv6 ? kProberFamilyIPv6 : kProberFamilyIPv4];
+    UInt8 buffer[kProberReceiveBufferSize];
+
+    while (1) {
+
+        struct sockaddr_storage from;
+        socklen_t fromLength = sizeof(from);
+        const _ProberPacket* packet;
+        const struct sockaddr* sa;
+        _ProberProbe* probe;
+        _ProberTarget* target;
+        ssize_t length;
+        CFTimeInterval rtt;
+        UInt16 sequence;
+
+        length = recvfrom(CFSocketGetNative(s), buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr*)&from, &fromLength);
+        if (length < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        packet = (const _ProberPacket*)buffer;
+
+        // Skip the IPv4 header if the system gives it.
+        if (!isIPv6 && (length >= 20) && ((buffer[0] >> 4) == 4)) {
+            CFIndex headerLength = (buffer[0] & 0x0F) << 2;
+            if (headerLength > length)
+                continue;
+            packet = (const _ProberPacket*)(buffer + headerLength);
+            length -= headerLength;
+        }
+
+        if (length < (ssize_t)sizeof(_ProberPacket))
+            continue;
+
+        if ((packet->header.type != (isIPv6 ? kProberICMPv6EchoReply : kProberICMPEchoReply)) ||
+            (ntohs(packet->header.identifier) != identifier))
+        {
+            continue;
+        }
+
+        sequence = ntohs(packet->header.sequence);
+        probe = (_ProberProbe*)CFDictionaryGetValue(prober->_probes, (const void*)(uintptr_t)sequence);
+        if (!probe || (packet->cookie != (UInt64)(uintptr_t)probe->target))
+            continue;
+
+        target = probe->target;
+        sa = (const struct sockaddr*)CFDataGetBytePtr(target->address);
+
+        if (from.ss_family != sa->sa_family)
+            continue;
+
+        if (isIPv6) {
+            if (memcmp(&((struct sockaddr_in6*)&from)->sin6_addr, &((const struct sockaddr_in6*)sa)->sin6_addr, sizeof(struct in6_addr)))
+                continue;
+        }
+        else if (((struct sockaddr_in*)&from)->sin_addr.s_addr != ((const struct sockaddr_in*)sa)->sin_addr.s_addr)
+            continue;
+
+        // Too late; the timer counts the probe lost.
+        if (now > probe->deadline)
+            continue;
+
+        rtt = now - probe->sent;
+
+        if (!target->received || (rtt < target->minimum))
+            target->minimum = rtt;
+        if (rtt > target->maximum)
+            target->maximum = rtt;
+        target->total += rtt;
+        target->received++;
+        target->outstanding--;
+
+        CFDictionaryRemoveValue(prober->_probes, (const void*)(uintptr_t)sequence);
+        CFAllocatorDeallocate(alloc, probe);
+    }
+}
+
+
+static void
+_ProberExpireProbe(const void* key, const void* value, void* context) {
+
+    _ProberProbe* probe = (_ProberProbe*)value;
+    void** args = (void**)context;
+
+    if (probe->deadline <= *(CFAbsoluteTime*)args[0])
+        CFArrayAppendValue((CFMutableArrayRef)args[1], key);
+}
+
+
+/* static */ CFArrayRef
+_ProberRun_NoLock(_CFNetDiagnosticProber* prober) {
+
+    CFAllocatorRef alloc = CFGetAllocator((CFTypeRef)prober);
+    CFMutableArrayRef finished = CFArrayCreateMutable(alloc, 0, NULL);
+    CFMutableArrayRef expired = CFArrayCreateMutable(alloc, 0, NULL);
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    CFAbsoluteTime next = now + kProberTimerIdleInterval;
+    CFIndex i, count;
+
+    if (!finished || !expired) {
+        if (finished) CFRelease(finished);
+        if (expired) CFRelease(expired);
+        return NULL;
+    }
+
+    // Count as lost every probe whose time is up.
+    {
+        void* args[2] = {&now, expired};
+        CFDictionaryApplyFunction(prober->_probes, _ProberExpireProbe, args);
+    }
+
+    for (i = 0, count = CFArrayGetCount(expired); i < count; i++) {
+
+        const void* key = CFArrayGetValueAtIndex(expired, i);
+        _ProberProbe* probe = (_ProberProbe*)CFDictionaryGetValue(prober->_probes, key);
+
+        probe->target->outstanding--;
+        CFDictionaryRemoveValue(prober->_probes, key);
+        CFAllocatorDeallocate(alloc, probe);
+    }
+
+    CFRelease(expired);
+
+    // Send whatever is due, and take out the targets which are done.
+    for (i = CFArrayGetCount(prober->_targets) - 1; i >= 0; i--) {
+
+        _ProberTarget* target = (_ProberTarget*)CFArrayGetValueAtIndex(prober->_targets, i);
+
+        if (!target->error.error && target->address && (target->sent < prober->_count) && (target->nextSend <= now))
+            _ProberSend_NoLock(prober, target, now);
+
+        if (target->error.error || (target->address && (target->sent == prober->_count) && !target->outstanding)) {
+            CFArrayInsertValueAtIndex(finished, 0, target);
+            CFArrayRemoveValueAtIndex(prober->_targets, i);
+        }
+
+        else if (target->address && (target->sent < prober->_count) && (target->nextSend < next))
+            next = target->nextSend;
+    }
+
+    // Then wake for the next send or the next probe to time out, whichever is first.
+    {
+        CFIndex probes = CFDictionaryGetCount(prober->_probes);
+
+        if (probes) {
+
+            const void** values = CFAllocatorAllocate(alloc, probes * sizeof(values[0]), 0);
+
+            if (values) {
+                CFDictionaryGetKeysAndValues(prober->_probes, NULL, values);
+                for (i = 0; i < probes; i++) {
+                    if (((_ProberProbe*)values[i])->deadline < next)
+                        next = ((_ProberProbe*)values[i])->deadline;
+                }
+                CFAllocatorDeallocate(alloc, (void*)values);
+            }
+        }
+    }
+
+    if (prober->_timer)
+        CFRunLoopTimerSetNextFireDate(prober->_timer, next);
+
+    return finished;
+}
+
+
+/* static */ void
+_ProberReport(_CFNetDiagnosticProber* prober, CFArrayRef finished) {
+
+    CFIndex i, count;
+
+    if (!finished)
+        return;
+
+    for (i = 0, count = CFArrayGetCount(finished); i < count; i++) {
+
+        _ProberTarget* target = (_ProberTarget*)CFArrayGetValueAtIndex(finished, i);
+        _CFNetDiagnosticProbeStatistics statistics;
+        _CFNetDiagnosticProberCallBack cb;
+        void* info;
+
+        memset(&statistics, 0, sizeof(statistics));
+
+        if (!target->error.error) {
+            statistics.sent = target->sent;
+            statistics.received = target->received;
+            if (target->received) {
+                statistics.minimum = target->minimum;
+                statistics.average = target->total / target->received;
+                statistics.maximum = target->maximum;
+            }
+        }
+
+        __CFSpinLock(&prober->_lock);
+        cb = prober->_callback;
+        info = prober->_client.info;
+        __CFSpinUnlock(&prober->_lock);
+
+        if (cb)
+            cb((_CFNetDiagnosticProberRef)prober, target->name, target->address, &statistics, &target->error, info);
+
+        _ProberTargetDestroy(target);
+    }
+
+    CFRelease(finished);
+}
+
+
+/* static */ void
+_ProberTimerCallBack(CFRunLoopTimerRef timer, _CFNetDiagnosticProber* prober) {
+
+    CFArrayRef finished;
+
+    CFRetain(prober);
+
+    __CFSpinLock(&prober->_lock);
+    finished = _ProberRun_NoLock(prober);
+    __CFSpinUnlock(&prober->_lock);
+
+    _ProberReport(prober, finished);
+
+    CFRelease(prober);
+}
+
+
+/* static */ void
+_ProberSocketCallBack(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void* data, _CFNetDiagnosticProber* prober) {
+
+    CFArrayRef finished = NULL;
+
+    CFRetain(prober);
+
+    __CFSpinLock(&prober->_lock);
+
+    if (CFSocketIsValid(s)) {
+        _ProberReceive_NoLock(prober, s, CFAbsoluteTimeGetCurrent());
+        finished = _ProberRun_NoLock(prober);
+    }
+
+    __CFSpinUnlock(&prober->_lock);
+
+    _ProberReport(prober, finished);
+
+    CFRelease(prober);
+}
+
+
+/* static */ void
+_ProberHostCallBack(CFHostRef host, CFHostInfoType typeInfo, const CFStreamError* error, _CFNetDiagnosticProber* prober) {
+
+    CFArrayRef finished = NULL;
+    CFIndex i, count;
+
+    CFRetain(prober);
+
+    __CFSpinLock(&prober->_lock);
+
+    for (i = 0, count = CFArrayGetCount(prober->_targets); i < count; i++) {
+
+        _ProberTarget* target = (_ProberTarget*)CFArrayGetValueAtIndex(prober->_targets, i);
+
+        if (target->host != host)
+            continue;
+
+        if (error && error->error)
+            target->error = *error;
+
+        else {
+            CFArrayRef addresses = CFHostGetAddressing(host, NULL);
+            CFIndex j, addressCount = addresses ? CFArrayGetCount(addresses) : 0;
+
+            // Take the first address of a family there is a socket for.
+            for (j = 0; !target->address && (j < addressCount); j++) {
+                CFDataRef address = (CFDataRef)CFArrayGetValueAtIndex(addresses, j);
+                const struct sockaddr* sa = (const struct sockaddr*)CFDataGetBytePtr(address);
+                if ((sa->sa_family == AF_INET) || (sa->sa_family == AF_INET6))
+                    target->address = CFRetain(address);
+            }
+
+            if (!target->address) {
+                target->error.domain = kCFStreamErrorDomainNetDB;
+                target->error.error = EAI_NONAME;
+            }
+        }
+
+        CFHostSetClient(host, NULL, NULL);
+        _CFTypeUnscheduleFromMultipleRunLoops(host, prober->_schedules);
+        CFRelease(host);
+        target->host = NULL;
+
+        finished = _ProberRun_NoLock(prober);
+        break;
+    }
+
+    __CFSpinUnlock(&prober->_lock);
+
+    _ProberReport(prober, finished);
+
+    CFRelease(prober);
+}
+
+
+#pragma mark -
+#pragma mark Extern Function Definitions (SPI)
+
+/* extern */ CFTypeID
+_CFNetDiagnosticProberGetTypeID(void) {
+
+    _CFDoOnce(&_kCFNetDiagnosticProberRegisterClass, _ProberRegisterClass);
+
+    return _kCFNetDiagnosticProberTypeID;
+}
+
+
+/* extern */ _CFNetDiagnosticProberRef
+_CFNetDiagnosticProberCreate(CFAllocatorRef allocator, CFIndex count, CFTimeInterval interval, CFTimeInterval timeout,
+                             _CFNetDiagnosticProberCallBack callback, _CFNetDiagnosticProberClientContext* context)
+{
+    CFRunLoopTimerContext timerContext = {0, NULL, NULL, NULL, NULL};
+    _CFNetDiagnosticProber* result;
+
+    if ((count < 1) || (interval < 0.0) || (timeout <= 0.0) || !callback)
+        return NULL;
+
+    result = (_CFNetDiagnosticProber*)_CFRuntimeCreateInstance(allocator,
+                                                               _CFNetDiagnosticProberGetTypeID(),
+                                                               sizeof(result[0]) - sizeof(CFRuntimeBase),
+                                                               NULL);
+
+    if (!result)
+        return NULL;
+
+    {
+        // Save a copy of the base so it's easier to zero the struct
+        CFRuntimeBase copy = result->_base;
+
+        memset(result, 0, sizeof(result[0]));
+        memmove(&(result->_base), &copy, sizeof(result->_base));
+    }
+
+    CF_SPINLOCK_INIT_FOR_STRUCTS(result->_lock);
+
+    result->_count = count;
+    result->_interval = interval;
+    result->_timeout = timeout;
+    result->_callback = callback;
+
+    if (context) {
+        memmove(&result->_client, context, sizeof(result->_client));
+        if (result->_client.info && result->_client.retain)
+            result->_client.info = (void*)result->_client.retain(result->_client.info);
+    }
+
+    result->_identifiers[kProberFamilyIPv4] = (UInt16)getpid();
+    result->_identifiers[kProberFamilyIPv6] = (UInt16)getpid();
+
+    timerContext.info = result;
+
+    result->_schedules = CFArrayCreateMutable(allocator, 0, &kCFTypeArrayCallBacks);
+    result->_targets = CFArrayCreateMutable(allocator, 0, NULL);
+    result->_probes = CFDictionaryCreateMutable(allocator, 0, NULL, NULL);
+    result->_timer = CFRunLoopTimerCreate(allocator,
+                                          CFAbsoluteTimeGetCurrent() + kProberTimerIdleInterval,
+                                          kProberTimerIdleInterval,
+                                          0,
+                                          0,
+                                          (CFRunLoopTimerCallBack)_ProberTimerCallBack,
+                                          &timerContext);
+
+    if (!result->_schedules || !result->_targets || !result->_probes || !result->_timer) {
+        CFRelease((CFTypeRef)result);
+        return NULL;
+    }
+
+    return (_CFNetDiagnosticProberRef)result;
+}
+
+
+/* extern */ Boolean
+_CFNetDiagnosticProberAddTarget(_CFNetDiagnosticProberRef proberRef, CFStringRef name) {
+
+    _CFNetDiagnosticProber* prober = (_CFNetDiagnosticProber*)proberRef;
+    CFAllocatorRef alloc = CFGetAllocator((CFTypeRef)prober);
+    _ProberTarget* target;
+    char buffer[INET6_ADDRSTRLEN];
+    Boolean result = FALSE;
+
+    target = CFAllocatorAllocate(alloc, sizeof(target[0]), 0);
+    if (!target)
+        return FALSE;
+
+    memset(target, 0, sizeof(target[0]));
+    target->name = CFStringCreateCopy(alloc, name);
+
+    // Addresses need no lookup.
+    if (CFStringGetCString(name, buffer, sizeof(buffer), kCFStringEncodingASCII)) {
+
+        struct sockaddr_in sin;
+        struct sockaddr_in6 sin6;
+
+        memset(&sin, 0, sizeof(sin));
+        memset(&sin6, 0, sizeof(sin6));
+
+        if (inet_pton(AF_INET, buffer, &sin.sin_addr) == 1) {
+#if !defined(__WIN32__) && !defined(__linux__)
+            sin.sin_len = sizeof(sin);
+#endif
+            sin.sin_family = AF_INET;
+            target->address = CFDataCreate(alloc, (const UInt8*)&sin, sizeof(sin));
+        }
+
+        else if (inet_pton(AF_INET6, buffer, &sin6.sin6_addr) == 1) {
+#if !defined(__WIN32__) && !defined(__linux__)
+            sin6.sin6_len = sizeof(sin6);
+#endif
+            sin6.sin6_family = AF_INET6;
+            target->address = CFDataCreate(alloc, (const UInt8*)&sin6, sizeof(sin6));
+        }
+    }
+
+    if (!target->address)
+        target->host = CFHostCreateWithName(alloc, name);
+
+    if (!target->name || (!target->address && !target->host)) {
+        _ProberTargetDestroy(target);
+        return FALSE;
+    }
+
+    __CFSpinLock(&prober->_lock);
+
+    if (prober->_timer) {
+
+        if (target->host) {
+            CFHostClientContext ctxt = {0, prober, NULL, NULL, NULL};
+            CFStreamError error = {0, 0};
+
+            CFHostSetClient(target->host, (CFHostClientCallBack)_ProberHostCallBack, &ctxt);
+            _CFTypeScheduleOnMultipleRunLoops(target->host, prober->_schedules);
+
+            if (!CFHostStartInfoResolution(target->host, kCFHostAddresses, &error)) {
+                CFHostSetClient(target->host, NULL, NULL);
+                _CFTypeUnscheduleFromMultipleRunLoops(target->host, prober->_schedules);
+                target->error = error;
+                if (!target->error.error) {
+                    target->error.domain = kCFStreamErrorDomainNetDB;
+                    target->error.error = EAI_FAIL;
+                }
+            }
+        }
+
+        CFArrayAppendValue(prober->_targets, target);
+
+        // Have the timer look at the new target straight away.
+        CFRunLoopTimerSetNextFireDate(prober->_timer, CFAbsoluteTimeGetCurrent());
+
+        result = TRUE;
+    }
+
+    __CFSpinUnlock(&prober->_lock);
+
+    if (!result)
+        _ProberTargetDestroy(target);
+
+    return result;
+}
+
+
+/* extern */ void
+_CFNetDiagnosticProberScheduleWithRunLoop(_CFNetDiagnosticProberRef proberRef, CFRunLoopRef runLoop, CFStringRef runLoopMode) {
+
+    _CFNetDiagnosticProber* prober = (_CFNetDiagnosticProber*)proberRef;
+    CFIndex i, count;
+
+    __CFSpinLock(&prober->_lock);
+
+    if (prober->_timer && _SchedulesAddRunLoopAndMode(prober->_schedules, runLoop, runLoopMode)) {
+
+        CFRunLoopAddTimer(runLoop, prober->_timer, runLoopMode);
+
+        for (i = 0; i < kProberFamilyCount; i++) {
+            if (prober->_sockets[i])
+                _CFTypeScheduleOnRunLoop(prober->_sockets[i], runLoop, runLoopMode);
+        }
+
+        for (i = 0, count = CFArrayGetCount(prober->_targets); i < count; i++) {
+            _ProberTarget* target = (_ProberTarget*)CFArrayGetValueAtIndex(prober->_targets, i);
+            if (target->host)
+                CFHostScheduleWithRunLoop(target->host, runLoop, runLoopMode);
+        }
+    }
+
+    __CFSpinUnlock(&prober->_lock);
+}
+
+
+/* extern */ void
+_CFNetDiagnosticProberUnscheduleFromRunLoop(_CFNetDiagnosticProberRef proberRef, CFRunLoopRef runLoop, CFStringRef runLoopMode) {
+
+    _CFNetDiagnosticProber* prober = (_CFNetDiagnosticProber*)proberRef;
+    CFIndex i, count;
+
+    __CFSpinLock(&prober->_lock);
+
+    if (prober->_timer && _SchedulesRemoveRunLoopAndMode(prober->_schedules, runLoop, runLoopMode)) {
+
+        CFRunLoopRemoveTimer(runLoop, prober->_timer, runLoopMode);
+
+        for (i = 0; i < kProberFamilyCount; i++) {
+            if (prober->_sockets[i])
+                _CFTypeUnscheduleFromRunLoop(prober->_sockets[i], runLoop, runLoopMode);
+        }
+
+        for (i = 0, count = CFArrayGetCount(prober->_targets); i < count; i++) {
+            _ProberTarget* target = (_ProberTarget*)CFArrayGetValueAtIndex(prober->_targets, i);
+            if (target->host)
+                CFHostUnscheduleFromRunLoop(target->host, runLoop, runLoopMode);
+        }
+    }
+
+    __CFSpinUnlock(&prober->_lock);
+}
+
+
+/* extern */ void
+_CFNetDiagnosticProberInvalidate(_CFNetDiagnosticProberRef proberRef) {
+
+    _CFNetDiagnosticProber* prober = (_CFNetDiagnosticProber*)proberRef;
+
+    __CFSpinLock(&prober->_lock);
+    _ProberInvalidate_NoLock(prober);
+    __CFSpinUnlock(&prober->_lock);
+}
@@ -33,6 +33,7 @@
 #pragma mark Includes
 #endif
 #include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFNetServicesPriv.h>
 #include "CFNetworkInternal.h"			// for __CFSpinLock and __CFSpinUnlock
 #include "CFNetworkSchedule.h"
 
@@ -92,9 +93,27 @@ typedef struct {
 	CFMutableArrayRef					_schedules;		// List of loops and modes
 	CFNetServiceBrowserClientCallBack	_callback;
 	CFNetServiceClientContext			_client;
+
+	_CFNetServiceBrowserBatchCallBack	_batchCallback;	// Gets _adds and _removes whole, if set
+
+	Boolean								_shared;		// Searches go over the shared connection
+	_CFNetServiceSharedOperationRef		_operation;		// The search on the shared connection
+
+	CFSpinLock_t						_inboxLock;		// Guards _inbox and _inboxTrigger for the connection thread
+	CFMutableArrayRef					_inbox;			// _BrowserEvent's from the shared connection
+	CFRunLoopSourceRef					_inboxTrigger;	// Posted for each event while searching
 } __CFNetServiceBrowser;
 
 
+// A reply from the shared connection, kept until the browser's run loop
+typedef struct {
+	DNSServiceRef						_ref;
+	DNSServiceFlags						_flags;
+	DNSServiceErrorType					_error;
+	CFTypeRef							_item;			// The domain or service, if any
+} _BrowserEvent;
+
+
 #if 0
 #pragma mark -
 #pragma mark Static Function Declarations
@@ -115,6 +134,24 @@ static void _BrowseReply(DNSServiceRef sdRef, DNSServiceFlags flags, uint32_t in
 	
 static void _SocketCallBack(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void *data, void *info);
 
+static UInt32 _BrowserDomainFlags(DNSServiceFlags flags);
+static void _BrowserApplyService(__CFNetServiceBrowser* browser, CFNetServiceRef service, Boolean add);
+static void _BrowserDeliverChanges(__CFNetServiceBrowser* browser, CFNetServiceBrowserClientCallBack cb, CFStreamError* error, void* info);
+static void _BrowserDeallocateBrowse(__CFNetServiceBrowser* browser);
+
+static DNSServiceErrorType _BrowserStartShared(__CFNetServiceBrowser* browser, DNSServiceFlags flags, const char* type, const char* domain);
+static void _BrowserStopShared(__CFNetServiceBrowser* browser);
+static void _BrowserPostEvent(__CFNetServiceBrowser* browser, DNSServiceRef sdRef, DNSServiceFlags flags, DNSServiceErrorType errorCode, CFTypeRef item);
+static void _BrowserReleaseEvents(CFMutableArrayRef events);
+static void _BrowserFlush(void* info);
+
+static void _SharedDomainEnumReply(DNSServiceRef sdRef, DNSServiceFlags flags, uint32_t interfaceIndex,
+								   DNSServiceErrorType errorCode, const char* replyDomain, void* context);
+static void _SharedBrowseReply(DNSServiceRef sdRef, DNSServiceFlags flags, uint32_t interfaceIndex,
+							   DNSServiceErrorType errorCode, const char* serviceName, const char* regtype,
+							   const char* replyDomain, void* context);
+static void _SharedBrowseError(DNSServiceRef sdRef, DNSServiceErrorType errorCode, void* context);
+
 
 #if 0
 #pragma mark -
@@ -175,7 +212,13 @@ _NetServiceBrowserDestroy(__CFNetServiceBrowser* browser) {
 	if (browser->_browse) {
 		
 		// Release the underlying service discovery reference
-		DNSServiceRefDeallocate(browser->_browse);
+		_BrowserDeallocateBrowse(browser);
+	}
+	
+	// Release any replies never seen
+	if (browser->_inbox) {
+		_BrowserReleaseEvents(browser->_inbox);
+		CFRelease(browser->_inbox);
 	}
 	
 	// Release the found list
@@ -347,23 +390,13 @@ _DomainEnumReply(DNSServiceRef sdRef, DNSServiceFlags flags, uint32_t interfaceI
 	// If there is a callback, inform the client of the finish.
 	if (cb && domain) {
 		
-		// Time to translate the service discovery flags into CFNetServices
-		// flags.  This is known to be a domain, so start there.
-		UInt32 f = kCFNetServiceFlagIsDomain;
+		// Time to translate the service discovery flags into CFNetServices flags.
+		UInt32 f = _BrowserDomainFlags(flags);
 		
 		// If more is coming, set that bit.
 		if (flags & kDNSServiceFlagsMoreComing)
 			f |= kCFNetServiceFlagMoreComing;
 			
-		// SD notifies that it's adding.  CFNetServices needs to translate to
-		// ones that are going away.
-		if (!(flags & kDNSServiceFlagsAdd))
-			f |= kCFNetServiceFlagRemove;
-			
-		// Set the bit if this is a registration domain
-		if (flags & kDNSServiceFlagsDefault)
-			f |= kCFNetServiceFlagIsDefault;
-			
 		// Inform the client.
 		cb((CFNetServiceBrowserRef)browser, f, domain, &error, info);
 	}
@@ -444,47 +477,7 @@ _BrowseReply(DNSServiceRef sdRef, DNSServiceFlags flags, uint32_t interfaceIndex
 			if (name) CFRelease(name);
 			
 			if (service) {
-				
-				UInt32 count = (UInt32)CFDictionaryGetValue(browser->_found, service);
-				
-				if (flags & kDNSServiceFlagsAdd) {
-					
-					count++;
-					
-					if (count != 1)
-						CFDictionaryReplaceValue(browser->_found, service, (const void*)count);
-					
-					else {
-						CFIndex i = CFArrayGetFirstIndexOfValue(browser->_removes,
-																CFRangeMake(0, CFArrayGetCount(browser->_removes)),
-																service);
-						
-						CFDictionaryAddValue(browser->_found, service, (const void*)count);
-						CFArrayAppendValue(browser->_adds, service);
-						
-						if (i != kCFNotFound)
-							CFArrayRemoveValueAtIndex(browser->_removes, i);
-					}
-				}
-				
-				else {
-					
-					count--;
-					if (count > 0)
-						CFDictionaryReplaceValue(browser->_found, service, (const void*)count);
-					else {
-						CFIndex i = CFArrayGetFirstIndexOfValue(browser->_adds,
-																CFRangeMake(0, CFArrayGetCount(browser->_adds)),
-																service);
-
-						CFDictionaryRemoveValue(browser->_found, service);
-						CFArrayAppendValue(browser->_removes, service);
-						
-						if (i != kCFNotFound)
-							CFArrayRemoveValueAtIndex(browser->_adds, i);
-					}
-				}
-				
+				_BrowserApplyService(browser, service, (flags & kDNSServiceFlagsAdd) ? TRUE : FALSE);
 				CFRelease(service);
 			}
 		}
@@ -508,62 +501,8 @@ _BrowseReply(DNSServiceRef sdRef, DNSServiceFlags flags, uint32_t interfaceIndex
 
 	else if (cb && ((flags & kDNSServiceFlagsMoreComing) == 0)) {
 		
-		CFIndex i, adds = CFArrayGetCount(browser->_adds);
-		CFIndex removes = CFArrayGetCount(browser->_removes);
-		CFIndex total = adds + removes;
-		
-		for (i = 0; i < adds; i++) {
-			
-			const void* saved = browser->_trigger;
-			service = (CFNetServiceRef)CFArrayGetValueAtIndex(browser->_adds, i);
-			
-			// Unlock the browser so the callback can be made safely.
-			__CFSpinUnlock(&browser->_lock);
-			
-			cb((CFNetServiceBrowserRef)browser,
-			   (i == (total - 1)) ? 0 : kCFNetServiceFlagMoreComing, 
-			   service,
-			   &error,
-			   info);
-			
-			// Lock the browser
-			__CFSpinLock(&browser->_lock);
-			
-			if (saved != browser->_trigger) {
-				cb = NULL;
-				break;
-			}
-		}
-		
-		if (cb) {
-			for (i = 0; i < removes; i++) {
-				
-				const void* saved = browser->_trigger;
-				service = (CFNetServiceRef)CFArrayGetValueAtIndex(browser->_removes, i);
-				
-				// Unlock the browser so the callback can be made safely.
-				__CFSpinUnlock(&browser->_lock);
-				
-				cb((CFNetServiceBrowserRef)browser,
-				   kCFNetServiceFlagRemove | ((i == (removes - 1)) ? 0 : kCFNetServiceFlagMoreComing), 
-				   service,
-				   &error,
-				   info);
-				
-				// Lock the browser
-				__CFSpinLock(&browser->_lock);
-				
-				if (saved != browser->_trigger)
-					break;
-			}
-		}
-		
-		// Dump the lists of items, so can start new again.
-		CFArrayRemoveAllValues(browser->_adds);
-		CFArrayRemoveAllValues(browser->_removes);
-		
-		// Unlock the browser so the callback can be made safely.
-		__CFSpinUnlock(&browser->_lock);
+		// Hand over everything gathered in the burst.  This unlocks the browser.
+		_BrowserDeliverChanges(browser, cb, &error, info);
 	}
 	else
 		__CFSpinUnlock(&browser->_lock);
@@ -610,6 +549,522 @@ _SocketCallBack(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, con
 }
 
 
+/* static */ UInt32
+_BrowserDomainFlags(DNSServiceFlags flags) {
+	
+	// This is known to be a domain, so start there.
+	UInt32 f = kCFNetServiceFlagIsDomain;
+	
+	// SD notifies that it's adding.  CFNetServices needs to translate to
+	// ones that are going away.
+	if (!(flags & kDNSServiceFlagsAdd))
+		f |= kCFNetServiceFlagRemove;
+		
+	// Set the bit if this is a registration domain
+	if (flags & kDNSServiceFlagsDefault)
+		f |= kCFNetServiceFlagIsDefault;
+	
+	return f;
+}
+
+
+/* static */ void
+_BrowserApplyService(__CFNetServiceBrowser* browser, CFNetServiceRef service, Boolean add) {
+	
+	// The same service is reported once per interface, so only the first add
+	// and the last remove are passed on.
+	UInt32 count = (UInt32)CFDictionaryGetValue(browser->_found, service);
+	
+	if (add) {
+		
+		count++;
+		
+		if (count != 1)
+			CFDictionaryReplaceValue(browser->_found, service, (const void*)count);
+		
+		else {
+			CFIndex i = CFArrayGetFirstIndexOfValue(browser->_removes,
+													CFRangeMake(0, CFArrayGetCount(browser->_removes)),
+													service);
+			
+			CFDictionaryAddValue(browser->_found, service, (const void*)count);
+			
+			// A service which went and came back in the same burst never went.
+			if (i != kCFNotFound)
+				CFArrayRemoveValueAtIndex(browser->_removes, i);
+			else
+				CFArrayAppendValue(browser->_adds, service);
+		}
+	}
+	
+	else if (count) {
+		
+		count--;
+		if (count > 0)
+			CFDictionaryReplaceValue(browser->_found, service, (const void*)count);
+		else {
+			CFIndex i = CFArrayGetFirstIndexOfValue(browser->_adds,
+													CFRangeMake(0, CFArrayGetCount(browser->_adds)),
+													service);
+
+			CFDictionaryRemoveValue(browser->_found, service);
+			
+			// A service which came and went in the same burst never came.
+			if (i != kCFNotFound)
+				CFArrayRemoveValueAtIndex(browser->_adds, i);
+			else
+				CFArrayAppendValue(browser->_removes, service);
+		}
+	}
+}
+
+
+/* static */ void
+_BrowserDeliverChanges(__CFNetServiceBrowser* browser, CFNetServiceBrowserClientCallBack cb, CFStreamError* error, void* info) {
+	
+	// Called with the browser locked; returns with it unlocked.
+	
+	CFIndex i, adds = CFArrayGetCount(browser->_adds);
+	CFIndex removes = CFArrayGetCount(browser->_removes);
+	CFIndex total = adds + removes;
+	CFNetServiceRef service;
+	
+	// A batch client gets the whole burst in one call.
+	if (browser->_batchCallback) {
+		
+		_CFNetServiceBrowserBatchCallBack batch = browser->_batchCallback;
+		CFAllocatorRef alloc = CFGetAllocator(browser);
+		CFArrayRef added = CFArrayCreateCopy(alloc, browser->_adds);
+		CFArrayRef removed = CFArrayCreateCopy(alloc, browser->_removes);
+		
+		// Dump the lists of items, so can start new again.
+		CFArrayRemoveAllValues(browser->_adds);
+		CFArrayRemoveAllValues(browser->_removes);
+		
+		// Unlock the browser so the callback can be made safely.
+		__CFSpinUnlock(&browser->_lock);
+		
+		if (total && added && removed)
+			batch((CFNetServiceBrowserRef)browser, added, removed, info);
+		
+		if (added) CFRelease(added);
+		if (removed) CFRelease(removed);
+		
+		return;
+	}
+	
+	for (i = 0; i < adds; i++) {
+		
+		const void* saved = browser->_trigger;
+		service = (CFNetServiceRef)CFArrayGetValueAtIndex(browser->_adds, i);
+		
+		// Unlock the browser so the callback can be made safely.
+		__CFSpinUnlock(&browser->_lock);
+		
+		cb((CFNetServiceBrowserRef)browser,
+		   (i == (total - 1)) ? 0 : kCFNetServiceFlagMoreComing, 
+		   service,
+		   error,
+		   info);
+		
+		// Lock the browser
+		__CFSpinLock(&browser->_lock);
+		
+		if (saved != browser->_trigger) {
+			cb = NULL;
+			break;
+		}
+	}
+	
+	if (cb) {
+		for (i = 0; i < removes; i++) {
+			
+			const void* saved = browser->_trigger;
+			service = (CFNetServiceRef)CFArrayGetValueAtIndex(browser->_removes, i);
+			
+			// Unlock the browser so the callback can be made safely.
+			__CFSpinUnlock(&browser->_lock);
+			
+			cb((CFNetServiceBrowserRef)browser,
+			   kCFNetServiceFlagRemove | ((i == (removes - 1)) ? 0 : kCFNetServiceFlagMoreComing), 
+			   service,
+			   error,
+			   info);
+			
+			// Lock the browser
+			__CFSpinLock(&browser->_lock);
+			
+			if (saved != browser->_trigger)
+				break;
+		}
+	}
+	
+	// Dump the lists of items, so can start new again.
+	CFArrayRemoveAllValues(browser->_adds);
+	CFArrayRemoveAllValues(browser->_removes);
+	
+	// Unlock the browser so the callback can be made safely.
+	__CFSpinUnlock(&browser->_lock);
+}
+
+
+/* static */ void
+_BrowserDeallocateBrowse(__CFNetServiceBrowser* browser) {
+	
+	// A search on the shared connection is handed back to it, otherwise the
+	// reference is the browser's own.
+	if (browser->_operation)
+		_BrowserStopShared(browser);
+	else
+		DNSServiceRefDeallocate(browser->_browse);
+	
+	browser->_browse = NULL;
+}
+
+
+/* static */ DNSServiceErrorType
+_BrowserStartShared(__CFNetServiceBrowser* browser, DNSServiceFlags flags, const char* type, const char* domain) {
+	
+	// Called with the browser locked.  The browser's trigger becomes a run loop
+	// source, posted by the replies and performed as _BrowserFlush.
+	
+	DNSServiceErrorType err = kDNSServiceErr_NoError;
+	DNSServiceRef primary;
+	CFRunLoopSourceRef trigger = _CFNetServiceSharedConnectionCreateTrigger(CFGetAllocator(browser),
+																			(CFTypeRef)browser,
+																			_BrowserFlush);
+	
+	if (!trigger)
+		return kDNSServiceErr_NoMemory;
+	
+	// Lock the connection so no replies come before the browser is ready.
+	primary = _CFNetServiceSharedConnectionLock(&err);
+	
+	if (primary) {
+		
+		// The operation is made on a copy of the primary reference.
+		browser->_browse = primary;
+		
+#if defined(__MACH__)
+		if (browser->_domainSearch)
+			err = DNSServiceEnumerateDomains(&browser->_browse,
+											 kDNSServiceFlagsShareConnection | flags,
+											 0,
+											 _SharedDomainEnumReply,
+											 browser);
+		else
+			err = DNSServiceBrowse(&browser->_browse,
+								   kDNSServiceFlagsShareConnection | flags,
+								   0,
+								   type,
+								   domain,
+								   _SharedBrowseReply,
+								   browser);
+#elif defined(__linux__)
+#warning "Linux portability issue!"
+		err = kDNSServiceErr_Unsupported;
+#else
+#error "Platform portability issue!"
+#endif /* defined(__MACH__) */
+		
+		if (!err) {
+			
+			browser->_operation = _CFNetServiceSharedConnectionAddOperation(browser->_browse, trigger, _SharedBrowseError, browser);
+			
+			if (!browser->_operation) {
+				DNSServiceRefDeallocate(browser->_browse);
+				err = kDNSServiceErr_NoMemory;
+			}
+		}
+		
+		if (err)
+			browser->_browse = NULL;
+		
+		else {
+			
+			// Let the replies through to the inbox.
+			__CFSpinLock(&browser->_inboxLock);
+			browser->_inboxTrigger = (CFRunLoopSourceRef)CFRetain(trigger);
+			__CFSpinUnlock(&browser->_inboxLock);
+			
+			browser->_trigger = CFRetain(trigger);
+		}
+		
+		_CFNetServiceSharedConnectionUnlock();
+	}
+	
+	CFRelease(trigger);
+	
+	return err;
+}
+
+
+/* static */ void
+_BrowserStopShared(__CFNetServiceBrowser* browser) {
+	
+	// Called with the browser locked.  The trigger itself is left to the caller.
+	
+	CFRunLoopSourceRef trigger;
+	
+	// Stop replies getting through, and drop the ones not yet seen.
+	__CFSpinLock(&browser->_inboxLock);
+	
+	trigger = browser->_inboxTrigger;
+	browser->_inboxTrigger = NULL;
+	
+	_BrowserReleaseEvents(browser->_inbox);
+	
+	__CFSpinUnlock(&browser->_inboxLock);
+	
+	if (trigger)
+		CFRelease(trigger);
+	
+	// The connection deallocates the search on its own thread.
+	_CFNetServiceSharedConnectionRemoveOperation(browser->_operation);
+	browser->_operation = NULL;
+	browser->_browse = NULL;
+}
+
+
+/* static */ void
+_BrowserPostEvent(__CFNetServiceBrowser* browser, DNSServiceRef sdRef, DNSServiceFlags flags, DNSServiceErrorType errorCode, CFTypeRef item) {
+	
+	// Called on the connection thread, so only the inbox may be touched.
+	
+	_BrowserEvent* event = CFAllocatorAllocate(kCFAllocatorDefault, sizeof(event[0]), 0);
+	
+	if (event) {
+		event->_ref = sdRef;
+		event->_flags = flags;
+		event->_error = errorCode;
+		event->_item = item ? CFRetain(item) : NULL;
+	}
+	
+	__CFSpinLock(&browser->_inboxLock);
+	
+	// Keep it only if the browser is still listening.
+	if (event && browser->_inboxTrigger) {
+		CFArrayAppendValue(browser->_inbox, event);
+		event = NULL;
+	}
+	
+	// Even without a trigger, the connection must see the end of the burst.
+	_CFNetServiceSharedConnectionPost(browser->_inboxTrigger, flags);
+	
+	__CFSpinUnlock(&browser->_inboxLock);
+	
+	if (event) {
+		if (event->_item)
+			CFRelease(event->_item);
+		CFAllocatorDeallocate(kCFAllocatorDefault, event);
+	}
+}
+
+
+/* static */ void
+_BrowserReleaseEvents(CFMutableArrayRef events) {
+	
+	CFIndex i, count = CFArrayGetCount(events);
+	
+	for (i = 0; i < count; i++) {
+		
+		_BrowserEvent* event = (_BrowserEvent*)CFArrayGetValueAtIndex(events, i);
+		
+		if (event->_item)
+			CFRelease(event->_item);
+		
+		CFAllocatorDeallocate(kCFAllocatorDefault, event);
+	}
+	
+	CFArrayRemoveAllValues(events);
+}
+
+
+/* static */ void
+_BrowserFlush(void* context) {
+	
+	__CFNetServiceBrowser* browser = context;
+	CFNetServiceBrowserClientCallBack cb = NULL;
+	CFStreamError error = {0, 0};
+	void* info = NULL;
+	DNSServiceRef browse;
+	CFMutableArrayRef events = CFArrayCreateMutable(kCFAllocatorDefault, 0, NULL);
+	CFIndex i, count;
+	
+	if (!events)
+		return;
+	
+	// Retain here to guarantee safety really after the trigger release,
+	// but definitely before the callback.
+	CFRetain(browser);
+	
+	// Take everything the connection has given so far.
+	__CFSpinLock(&browser->_inboxLock);
+	{
+		CFMutableArrayRef inbox = browser->_inbox;
+		browser->_inbox = events;
+		events = inbox;
+	}
+	__CFSpinUnlock(&browser->_inboxLock);
+	
+	// Lock the browser
+	__CFSpinLock(&browser->_lock);
+	
+	// Replies to an earlier search are of no interest.
+	browse = browser->_browse;
+	
+	for (i = 0, count = CFArrayGetCount(events); browser->_operation && (i < count); i++) {
+		
+		_BrowserEvent* event = (_BrowserEvent*)CFArrayGetValueAtIndex(events, i);
+		
+		if (event->_ref != browse)
+			continue;
+		
+		// If there is an error, fold the browse.
+		if (event->_error) {
+			
+			// Save the error
+			browser->_error.error = _DNSServiceErrorToCFNetServiceError(event->_error);
+			browser->_error.domain = kCFStreamErrorDomainNetServices;
+			
+			// Remove the browse from run loops and modes
+			_CFTypeUnscheduleFromMultipleRunLoops(browser->_trigger, browser->_schedules);
+			
+			// Go ahead and invalidate the trigger
+			_CFTypeInvalidate(browser->_trigger);
+			
+			// Release the browse now.
+			CFRelease(browser->_trigger);
+			browser->_trigger = NULL;
+			
+			// Hand the search back to the connection
+			_BrowserStopShared(browser);
+			
+			// Dump all the lists of items.
+			CFDictionaryRemoveAllValues(browser->_found);
+			CFArrayRemoveAllValues(browser->_adds);
+			CFArrayRemoveAllValues(browser->_removes);
+		}
+		
+		else if (event->_item && !browser->_domainSearch)
+			_BrowserApplyService(browser, (CFNetServiceRef)(event->_item), (event->_flags & kDNSServiceFlagsAdd) ? TRUE : FALSE);
+	}
+	
+	cb = browser->_callback;
+	
+	// Save the error and client information for the callback
+	memmove(&error, &(browser->_error), sizeof(error));
+	info = browser->_client.info;
+	
+	// If there is a callback, inform the client of the error.
+	if (cb && error.error) {
+		
+		// Unlock the browser so the callback can be made safely.
+		__CFSpinUnlock(&browser->_lock);
+		
+		cb((CFNetServiceBrowserRef)browser, 0, NULL, &error, info);
+	}
+	
+	// Domains are few, so they are passed on as they came.
+	else if (cb && browser->_domainSearch) {
+		
+		CFIndex last = kCFNotFound;
+		
+		// Unlock the browser so the callback can be made safely.
+		__CFSpinUnlock(&browser->_lock);
+		
+		for (i = 0; i < count; i++) {
+			if (((_BrowserEvent*)CFArrayGetValueAtIndex(events, i))->_ref == browse)
+				last = i;
+		}
+		
+		for (i = 0; i <= last; i++) {
+			
+			_BrowserEvent* event = (_BrowserEvent*)CFArrayGetValueAtIndex(events, i);
+			
+			if ((event->_ref == browse) && event->_item) {
+				cb((CFNetServiceBrowserRef)browser,
+				   _BrowserDomainFlags(event->_flags) | ((i == last) ? 0 : kCFNetServiceFlagMoreComing),
+				   event->_item,
+				   &error,
+				   info);
+			}
+		}
+	}
+	
+	else if (cb)
+		_BrowserDeliverChanges(browser, cb, &error, info);
+	
+	else
+		__CFSpinUnlock(&browser->_lock);
+	
+	_BrowserReleaseEvents(events);
+	CFRelease(events);
+	
+	// Go ahead and release now that the callback is done.
+	CFRelease(browser);
+}
+
+
+/* static */ void
+_SharedDomainEnumReply(DNSServiceRef sdRef, DNSServiceFlags flags, uint32_t interfaceIndex,
+					   DNSServiceErrorType errorCode, const char* replyDomain, void* context)
+{
+	__CFNetServiceBrowser* browser = context;
+	CFStringRef domain = NULL;
+	
+	// If got a domain from service discovery, create the CFString for the domain.
+	if (!errorCode && replyDomain)
+		domain = CFStringCreateWithCString(CFGetAllocator(browser), replyDomain, kCFStringEncodingUTF8);
+	
+	_BrowserPostEvent(browser, sdRef, flags, errorCode, domain);
+	
+	if (domain)
+		CFRelease(domain);
+}
+
+
+/* static */ void
+_SharedBrowseReply(DNSServiceRef sdRef, DNSServiceFlags flags, uint32_t interfaceIndex,
+				   DNSServiceErrorType errorCode, const char* serviceName, const char* regtype,
+				   const char* replyDomain, void* context)
+{
+	__CFNetServiceBrowser* browser = context;
+	CFNetServiceRef service = NULL;
+	
+	// If got service info from service discovery, create the CFNetServiceRef.
+	if (!errorCode && serviceName && regtype && replyDomain) {
+		
+		// Create CFString's for each of the service components
+		CFAllocatorRef alloc = CFGetAllocator(browser);
+		CFStringRef domain = CFStringCreateWithCString(alloc, replyDomain, kCFStringEncodingUTF8);
+		CFStringRef type = CFStringCreateWithCString(alloc, regtype, kCFStringEncodingUTF8);
+		CFStringRef name = CFStringCreateWithCString(alloc, serviceName, kCFStringEncodingUTF8);
+		
+		// Can only make the service if all the strings were created.
+		if (domain && type && name)
+			service = _CFNetServiceCreateCommon(alloc, domain, type, name, 0);
+		
+		if (domain) CFRelease(domain);
+		if (type) CFRelease(type);
+		if (name) CFRelease(name);
+	}
+	
+	_BrowserPostEvent(browser, sdRef, flags, errorCode, service);
+	
+	if (service)
+		CFRelease(service);
+}
+
+
+/* static */ void
+_SharedBrowseError(DNSServiceRef sdRef, DNSServiceErrorType errorCode, void* context) {
+	
+	// The connection failed, so report it as if it were a reply.
+	_BrowserPostEvent((__CFNetServiceBrowser*)context, sdRef, 0, errorCode, NULL);
+}
+
+
 #if 0
 #pragma mark -
 #pragma mark Extern Function Definitions (API)
@@ -675,8 +1130,11 @@ CFNetServiceBrowserCreate(CFAllocatorRef alloc, CFNetServiceBrowserClientCallBac
 			// Create list of items to be removed
 			result->_removes = CFArrayCreateMutable(alloc, 0, &kCFTypeArrayCallBacks);
 			
+			// Create the list of replies from the shared connection
+			result->_inbox = CFArrayCreateMutable(kCFAllocatorDefault, 0, NULL);
+			
 			// If any failed, need to release and return null
-			if (!result->_schedules) {
+			if (!result->_schedules || !result->_inbox) {
 				CFRelease((CFTypeRef)result);
 				result = NULL;
 			}
@@ -717,8 +1175,7 @@ CFNetServiceBrowserInvalidate(CFNetServiceBrowserRef b) {
 	if (browser->_browse) {
 		
 		// Release the underlying service discovery reference
-		DNSServiceRefDeallocate(browser->_browse);
-		browser->_browse = NULL;
+		_BrowserDeallocateBrowse(browser);
 		
 		// Dump all the lists of items.
 		CFDictionaryRemoveAllValues(browser->_found);
@@ -770,7 +1227,7 @@ CFNetServiceBrowserSearchForDomains(CFNetServiceBrowserRef b, Boolean registrati
 		if (browser->_trigger) {
 		
 			// If it's a mdns search, don't allow another.
-			if (CFGetTypeID(browser->_trigger) == CFSocketGetTypeID()) {
+			if (browser->_browse) {
 				browser->_error.error = kCFNetServicesErrorInProgress;
 				browser->_error.domain = kCFStreamErrorDomainNetServices;
 				break;
@@ -793,20 +1250,30 @@ CFNetServiceBrowserSearchForDomains(CFNetServiceBrowserRef b, Boolean registrati
 		
 		browser->_domainSearch = TRUE;
 		
-		// Create the domain search at the service discovery level
+		// Make the search over the shared connection if asked.
+		if (browser->_shared) {
+			browser->_error.error = _BrowserStartShared(browser,
+														registrationDomains ? kDNSServiceFlagsRegistrationDomains : kDNSServiceFlagsBrowseDomains,
+														NULL,
+														NULL);
+		}
+		
+		else {
+			// Create the domain search at the service discovery level
 #if defined(__MACH__)
-		browser->_error.error = DNSServiceEnumerateDomains(&browser->_browse,
-														   registrationDomains ? kDNSServiceFlagsRegistrationDomains : kDNSServiceFlagsBrowseDomains,
-														   0, 
-														   _DomainEnumReply,
-														   browser);
+			browser->_error.error = DNSServiceEnumerateDomains(&browser->_browse,
+															   registrationDomains ? kDNSServiceFlagsRegistrationDomains : kDNSServiceFlagsBrowseDomains,
+															   0, 
+															   _DomainEnumReply,
+															   browser);
 #elif defined(__linux__)
 #warning "Linux portability issue!"
-		browser->_error.error = ENOSYS;
-		browser->_error.domain = kCFStreamErrorDomainPOSIX;
+			browser->_error.error = ENOSYS;
+			browser->_error.domain = kCFStreamErrorDomainPOSIX;
 #else
 #error "Platform portability issue!"
 #endif /* defined(__MACH__) */
+		}
 		
 		// Fail if it did.
 		if (browser->_error.error) {
@@ -815,36 +1282,39 @@ CFNetServiceBrowserSearchForDomains(CFNetServiceBrowserRef b, Boolean registrati
 			break;
 		}
 		
-		// Create the trigger for the browse
-		browser->_trigger = CFSocketCreateWithNative(CFGetAllocator(browser),
-													 DNSServiceRefSockFD(browser->_browse),
-													 kCFSocketReadCallBack,
-													 _SocketCallBack,
-													 &ctxt);
-		
-		// Make sure the CFSocket wrapper succeeded
-		if (!browser->_trigger) {
-			
-			// Try to use errno for the error
-			browser->_error.error = errno;
+		// Create the trigger for the browse, unless the shared connection made it.
+		if (!browser->_operation) {
 			
-			// If it has no error in it, assume no memory
-			if (!browser->_error.error)
-				browser->_error.error = ENOMEM;
+			browser->_trigger = CFSocketCreateWithNative(CFGetAllocator(browser),
+														 DNSServiceRefSockFD(browser->_browse),
+														 kCFSocketReadCallBack,
+														 _SocketCallBack,
+														 &ctxt);
 			
-			// Correct domain and bail.
-			browser->_error.domain = kCFStreamErrorDomainPOSIX;
-			
-			DNSServiceRefDeallocate(browser->_browse);
-			browser->_browse = NULL;
+			// Make sure the CFSocket wrapper succeeded
+			if (!browser->_trigger) {
+				
+				// Try to use errno for the error
+				browser->_error.error = errno;
+				
+				// If it has no error in it, assume no memory
+				if (!browser->_error.error)
+					browser->_error.error = ENOMEM;
+				
+				// Correct domain and bail.
+				browser->_error.domain = kCFStreamErrorDomainPOSIX;
+				
+				DNSServiceRefDeallocate(browser->_browse);
+				browser->_browse = NULL;
+				
+				break;
+			}
 			
-			break;
+			// Tell CFSocket not to close the native socket on invalidation.
+			CFSocketSetSocketFlags((CFSocketRef)browser->_trigger,
+								   CFSocketGetSocketFlags((CFSocketRef)browser->_trigger) & ~kCFSocketCloseOnInvalidate);
 		}
 		
-		// Tell CFSocket not to close the native socket on invalidation.
-		CFSocketSetSocketFlags((CFSocketRef)browser->_trigger,
-							   CFSocketGetSocketFlags((CFSocketRef)browser->_trigger) & ~kCFSocketCloseOnInvalidate);
-		
 		// Async mode is complete at this point
 		if (CFArrayGetCount(browser->_schedules)) {
 			
@@ -921,7 +1391,7 @@ CFNetServiceBrowserSearchForServices(CFNetServiceBrowserRef b, CFStringRef domai
 		if (browser->_trigger) {
 		
 			// If it's a mdns search, don't allow another.
-			if (CFGetTypeID(browser->_trigger) == CFSocketGetTypeID()) {
+			if (browser->_browse) {
 				browser->_error.error = kCFNetServicesErrorInProgress;
 				browser->_error.domain = kCFStreamErrorDomainNetServices;
 				break;
@@ -964,22 +1434,28 @@ CFNetServiceBrowserSearchForServices(CFNetServiceBrowserRef b, CFStringRef domai
 		
 		browser->_domainSearch = FALSE;
 		
-		// Create the service search at the service discovery level
+		// Make the search over the shared connection if asked.
+		if (browser->_shared)
+			browser->_error.error = _BrowserStartShared(browser, 0, properties[0], properties[1]);
+		
+		else {
+			// Create the service search at the service discovery level
 #if defined(__MACH__)
-		browser->_error.error = DNSServiceBrowse(&browser->_browse,
-												 0,
-												 0,
-												 properties[0],
-												 properties[1],
-												 _BrowseReply,
-												 browser);
+			browser->_error.error = DNSServiceBrowse(&browser->_browse,
+													 0,
+													 0,
+													 properties[0],
+													 properties[1],
+													 _BrowseReply,
+													 browser);
 #elif defined(__linux__)
 #warning "Linux portability issue!"
-		browser->_error.error = ENOSYS;
-		browser->_error.domain = kCFStreamErrorDomainPOSIX;
+			browser->_error.error = ENOSYS;
+			browser->_error.domain = kCFStreamErrorDomainPOSIX;
 #else
 #error "Platform portability issue!"
 #endif /* defined(__MACH__) */
+		}
 
 		
 		// Fail if it did.
@@ -989,36 +1465,39 @@ CFNetServiceBrowserSearchForServices(CFNetServiceBrowserRef b, CFStringRef domai
 			break;
 		}
 		
-		// Create the trigger for the browse
-		browser->_trigger = CFSocketCreateWithNative(CFGetAllocator(browser),
-													 DNSServiceRefSockFD(browser->_browse),
-													 kCFSocketReadCallBack,
-													 _SocketCallBack,
-													 &ctxt);
-		
-		// Make sure the CFSocket wrapper succeeded
-		if (!browser->_trigger) {
+		// Create the trigger for the browse, unless the shared connection made it.
+		if (!browser->_operation) {
 			
-			// Try to use errno for the error
-			browser->_error.error = errno;
-			
-			// If it has no error in it, assume no memory
-			if (!browser->_error.error)
-				browser->_error.error = ENOMEM;
-			
-			// Correct domain and bail.
-			browser->_error.domain = kCFStreamErrorDomainPOSIX;
+			browser->_trigger = CFSocketCreateWithNative(CFGetAllocator(browser),
+														 DNSServiceRefSockFD(browser->_browse),
+														 kCFSocketReadCallBack,
+														 _SocketCallBack,
+														 &ctxt);
 			
-			DNSServiceRefDeallocate(browser->_browse);
-			browser->_browse = NULL;
+			// Make sure the CFSocket wrapper succeeded
+			if (!browser->_trigger) {
+				
+				// Try to use errno for the error
+				browser->_error.error = errno;
+				
+				// If it has no error in it, assume no memory
+				if (!browser->_error.error)
+					browser->_error.error = ENOMEM;
+				
+				// Correct domain and bail.
+				browser->_error.domain = kCFStreamErrorDomainPOSIX;
+				
+				DNSServiceRefDeallocate(browser->_browse);
+				browser->_browse = NULL;
+				
+				break;
+			}
 			
-			break;
+			// Tell CFSocket not to close the native socket on invalidation.
+			CFSocketSetSocketFlags((CFSocketRef)browser->_trigger,
+								   CFSocketGetSocketFlags((CFSocketRef)browser->_trigger) & ~kCFSocketCloseOnInvalidate);
 		}
 		
-		// Tell CFSocket not to close the native socket on invalidation.
-		CFSocketSetSocketFlags((CFSocketRef)browser->_trigger,
-							   CFSocketGetSocketFlags((CFSocketRef)browser->_trigger) & ~kCFSocketCloseOnInvalidate);
-		
 		// Async mode is complete at this point
 		if (CFArrayGetCount(browser->_schedules)) {
 			
@@ -1101,8 +1580,7 @@ CFNetServiceBrowserStopSearch(CFNetServiceBrowserRef b, CFStreamError* error) {
 		if (browser->_browse) {
 			
 			// Release the underlying service discovery reference
-			DNSServiceRefDeallocate(browser->_browse);
-			browser->_browse = NULL;
+			_BrowserDeallocateBrowse(browser);
 			
 			// Dump all the lists of items.
 			CFDictionaryRemoveAllValues(browser->_found);
@@ -1201,3 +1679,71 @@ CFNetServiceBrowserUnscheduleFromRunLoop(CFNetServiceBrowserRef b, CFRunLoopRef
 	__CFSpinUnlock(&(browser->_lock));
 }
 
+
+#if 0
+#pragma mark -
+#pragma mark Extern Function Definitions (SPI)
+#endif
+
+/* extern */ void
+_CFNetServiceBrowserSetUsesSharedConnection(CFNetServiceBrowserRef b, Boolean shared) {
+	
+	__CFNetServiceBrowser* browser = (__CFNetServiceBrowser*)b;
+	
+	// Lock down the browser before work
+	__CFSpinLock(&(browser->_lock));
+	
+	// Noted for the next search; a running one keeps its connection.
+	browser->_shared = shared;
+	
+	// Unlock the browser
+	__CFSpinUnlock(&(browser->_lock));
+}
+
+
+/* extern */ void
+_CFNetServiceBrowserSetBatchCallBack(CFNetServiceBrowserRef b, _CFNetServiceBrowserBatchCallBack callback) {
+	
+	__CFNetServiceBrowser* browser = (__CFNetServiceBrowser*)b;
+	
+	// Lock down the browser before work
+	__CFSpinLock(&(browser->_lock));
+	
+	browser->_batchCallback = callback;
+	
+	// Unlock the browser
+	__CFSpinUnlock(&(browser->_lock));
+}
+
+
+/* extern */ CFArrayRef
+_CFNetServiceBrowserCopyServices(CFNetServiceBrowserRef b) {
+	
+	__CFNetServiceBrowser* browser = (__CFNetServiceBrowser*)b;
+	CFAllocatorRef alloc = CFGetAllocator(browser);
+	CFArrayRef result = NULL;
+	const void** services;
+	CFIndex count;
+	
+	// Lock down the browser before work
+	__CFSpinLock(&(browser->_lock));
+	
+	// The found table has each service once, with a count of its interfaces.
+	count = CFDictionaryGetCount(browser->_found);
+	services = count ? CFAllocatorAllocate(alloc, count * sizeof(services[0]), 0) : NULL;
+	
+	if (services) {
+		CFDictionaryGetKeysAndValues(browser->_found, services, NULL);
+		result = CFArrayCreate(alloc, services, count, &kCFTypeArrayCallBacks);
+		CFAllocatorDeallocate(alloc, services);
+	}
+	
+	else if (!count)
+		result = CFArrayCreate(alloc, NULL, 0, &kCFTypeArrayCallBacks);
+	
+	// Unlock the browser
+	__CFSpinUnlock(&(browser->_lock));
+	
+	return result;
+}
+
@@ -0,0 +1,567 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+/*
+ *  CFNetServiceConnection.c
+ *  CFNetwork
+ *
+ */
+
+#if 0
+#pragma mark Description
+#endif
+
+/*
+	The shared connection is one connection to the DNS-SD daemon over which
+	browsers and monitors can make their operations, passing
+	kDNSServiceFlagsShareConnection, instead of each opening its own connection
+	and watching its own socket.
+
+	A dedicated thread polls the connection's socket, along with a wake up pipe
+	written whenever the connection is made or an operation is removed, and calls
+	DNSServiceProcessResult.  So replies are called on that thread, with the
+	connection locked.  They must not take the locks of their clients; instead a
+	client queues what it is told and posts its trigger, a run loop source
+	scheduled wherever the client is.  Posted triggers are signaled, and their
+	run loops woken, only once a reply comes without kDNSServiceFlagsMoreComing,
+	so a client hears once per burst of replies however many there were.
+
+	Removing an operation never waits on the connection, since the thread may be
+	blocked in a reply on the same client.  Removals are queued and done by the
+	thread, which also closes the connection once the last operation is gone.
+	If the connection fails, every operation is told through its error callback
+	and the connection is made again by the next operation.
+*/
+
+
+#if 0
+#pragma mark -
+#pragma mark Includes
+#endif
+#include <CFNetwork/CFNetwork.h>
+#include "CFNetworkInternal.h"			// for __CFSpinLock and __CFSpinUnlock
+
+#include <dns_sd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#warning "Linux portability issue!"
+#define DNSServiceRefDeallocate(service) do { (void)service; } while (0)
+#define DNSServiceRefSockFD(service)     ((int)(-1))
+#else
+#error "Platform portability issue!"
+#endif /* defined(__MACH__) */
+
+
+#if 0
+#pragma mark -
+#pragma mark Type Declarations
+#endif
+
+struct __CFNetServiceSharedOperation {
+	DNSServiceRef						_ref;
+	CFRunLoopSourceRef					_trigger;
+	_CFNetServiceSharedErrorCallBack	_callback;
+	void*								_info;
+	Boolean								_dead;			// The connection failed, taking _ref with it
+};
+
+typedef struct {
+	CFSpinLock_t						_lock;			// Guards _runLoops
+	CFTypeRef							_owner;
+	void								(*_perform)(void*);
+	CFMutableArrayRef					_runLoops;		// Where the trigger is scheduled, for waking
+} _SharedTriggerInfo;
+
+typedef struct {
+	_CFMutex							_mutex;			// Serializes all use of _primary and its operations
+	CFSpinLock_t						_lock;			// Guards _removals, which are queued without _mutex
+
+	DNSServiceRef						_primary;
+	CFMutableArrayRef					_operations;	// _CFNetServiceSharedOperationRef, not retained
+	CFMutableArrayRef					_removals;		// Operations removed but not yet deallocated
+
+	CFMutableSetRef						_posted;		// Triggers to signal at the end of the burst
+	Boolean								_moreComing;
+
+	int									_wakeup[2];		// Read and write ends of the wake up pipe
+	_CFThread							_thread;
+	Boolean								_valid;
+} _CFNetServiceSharedConnection;
+
+
+#if 0
+#pragma mark -
+#pragma mark Static Function Declarations
+#endif
+
+static void _SharedConnectionInitialize(void);
+static void* _SharedConnectionMain(void* context);
+static void _SharedConnectionWakeUp(_CFNetServiceSharedConnection* shared);
+static void _SharedConnectionRemoveOperations(_CFNetServiceSharedConnection* shared);
+static void _SharedConnectionFail(_CFNetServiceSharedConnection* shared, DNSServiceErrorType error);
+static void _SharedConnectionSignal(_CFNetServiceSharedConnection* shared);
+
+static void _SharedTriggerRelease(const void* info);
+static void _SharedTriggerSchedule(void* info, CFRunLoopRef rl, CFStringRef mode);
+static void _SharedTriggerUnschedule(void* info, CFRunLoopRef rl, CFStringRef mode);
+static void _SharedTriggerPerform(void* info);
+
+
+#if 0
+#pragma mark -
+#pragma mark Globals
+#endif
+
+static _CFOnceLock _kCFNetServiceSharedConnectionInitialize = _CFOnceInitializer;
+static _CFNetServiceSharedConnection _SharedConnection;
+
+
+#if 0
+#pragma mark -
+#pragma mark Static Function Definitions
+#endif
+
+/* static */ void
+_SharedConnectionInitialize(void) {
+
+	_CFNetServiceSharedConnection* shared = &_SharedConnection;
+	int i;
+
+	_CFMutexInit(&shared->_mutex, FALSE);
+
+	shared->_wakeup[0] = shared->_wakeup[1] = -1;
+
+	shared->_operations = CFArrayCreateMutable(kCFAllocatorDefault, 0, NULL);
+	shared->_removals = CFArrayCreateMutable(kCFAllocatorDefault, 0, NULL);
+	shared->_posted = CFSetCreateMutable(kCFAllocatorDefault, 0, &kCFTypeSetCallBacks);
+
+	if (!shared->_operations || !shared->_removals || !shared->_posted)
+		return;
+
+	if (pipe(shared->_wakeup))
+		return;
+
+	for (i = 0; i < 2; i++) {
+		fcntl(shared->_wakeup[i], F_SETFL, fcntl(shared->_wakeup[i], F_GETFL) | O_NONBLOCK);
+		fcntl(shared->_wakeup[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	if (_CFThreadSpawn(&shared->_thread, _SharedConnectionMain, shared)) {
+		close(shared->_wakeup[0]);
+		close(shared->_wakeup[1]);
+		return;
+	}
+
+	shared->_valid = TRUE;
+}
+
+
+/* static */ void*
+_SharedConnectionMain(void* context) {
+
+	_CFNetServiceSharedConnection* shared = (_CFNetServiceSharedConnection*)context;
+
+	while (TRUE) {
+
+		struct pollfd fds[2];
+		nfds_t nfds = 1;
+
+		fds[0].fd = shared->_wakeup[0];
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+
+		// Only this thread closes the connection, so the socket stays good through the poll.
+		_CFMutexLock(&shared->_mutex);
+
+		if (shared->_primary) {
+			fds[nfds].fd = DNSServiceRefSockFD(shared->_primary);
+			fds[nfds].events = POLLIN;
+			fds[nfds].revents = 0;
+			nfds++;
+		}
+
+		_CFMutexUnlock(&shared->_mutex);
+
+		if ((poll(fds, nfds, -1) < 0) && (errno != EINTR))
+			continue;
+
+		// Drain the wake up pipe.  It only got the thread here.
+		if (fds[0].revents & POLLIN) {
+
+			char buffer[64];
+
+			while (read(shared->_wakeup[0], buffer, sizeof(buffer)) > 0)
+				continue;
+		}
+
+		_CFMutexLock(&shared->_mutex);
+
+		if ((nfds > 1) && fds[1].revents && shared->_primary) {
+
+			DNSServiceErrorType err;
+
+#if defined(__MACH__)
+			err = DNSServiceProcessResult(shared->_primary);
+#elif defined(__linux__)
+#warning "Linux portability issue!"
+			err = kDNSServiceErr_Unsupported;
+#else
+#error "Platform portability issue!"
+#endif /* defined(__MACH__) */
+
+			if (err)
+				_SharedConnectionFail(shared, err);
+		}
+
+		_SharedConnectionRemoveOperations(shared);
+
+		if (!shared->_moreComing)
+			_SharedConnectionSignal(shared);
+
+		_CFMutexUnlock(&shared->_mutex);
+	}
+
+	return NULL;
+}
+
+
+/* static */ void
+_SharedConnectionWakeUp(_CFNetServiceSharedConnection* shared) {
+
+	const char wake = 0;
+
+	// A full pipe will wake the thread just as well.
+	(void)write(shared->_wakeup[1], &wake, sizeof(wake));
+}
+
+
+/* static */ void
+_SharedConnectionRemoveOperations(_CFNetServiceSharedConnection* shared) {
+
+	CFIndex i, count;
+	CFArrayRef removals;
+
+	__CFSpinLock(&shared->_lock);
+	removals = CFArrayCreateCopy(kCFAllocatorDefault, shared->_removals);
+	if (removals)
+		CFArrayRemoveAllValues(shared->_removals);
+	__CFSpinUnlock(&shared->_lock);
+
+	if (!removals)
+		return;
+
+	for (i = 0, count = CFArrayGetCount(removals); i < count; i++) {
+
+		_CFNetServiceSharedOperationRef op = (_CFNetServiceSharedOperationRef)CFArrayGetValueAtIndex(removals, i);
+		CFIndex index = CFArrayGetFirstIndexOfValue(shared->_operations,
+													CFRangeMake(0, CFArrayGetCount(shared->_operations)),
+													op);
+
+		if (index != kCFNotFound)
+			CFArrayRemoveValueAtIndex(shared->_operations, index);
+
+		if (!op->_dead)
+			DNSServiceRefDeallocate(op->_ref);
+
+		CFRelease(op->_trigger);
+		CFAllocatorDeallocate(kCFAllocatorDefault, op);
+	}
+
+	CFRelease(removals);
+
+	// Don't hold on to the daemon with nothing to do.
+	if (shared->_primary && !CFArrayGetCount(shared->_operations)) {
+		DNSServiceRefDeallocate(shared->_primary);
+		shared->_primary = NULL;
+		shared->_moreComing = FALSE;
+	}
+}
+
+
+/* static */ void
+_SharedConnectionFail(_CFNetServiceSharedConnection* shared, DNSServiceErrorType error) {
+
+	CFIndex i, count;
+
+	for (i = 0, count = CFArrayGetCount(shared->_operations); i < count; i++) {
+
+		_CFNetServiceSharedOperationRef op = (_CFNetServiceSharedOperationRef)CFArrayGetValueAtIndex(shared->_operations, i);
+
+		if (!op->_dead) {
+			op->_dead = TRUE;
+			op->_callback(op->_ref, error, op->_info);
+		}
+	}
+
+	// Deallocating the primary deallocates every operation on it.
+	DNSServiceRefDeallocate(shared->_primary);
+	shared->_primary = NULL;
+	shared->_moreComing = FALSE;
+}
+
+
+/* static */ void
+_SharedConnectionSignal(_CFNetServiceSharedConnection* shared) {
+
+	CFIndex i, count = CFSetGetCount(shared->_posted);
+	const void** triggers;
+
+	if (!count)
+		return;
+
+	triggers = CFAllocatorAllocate(kCFAllocatorDefault, count * sizeof(triggers[0]), 0);
+	if (!triggers)
+		return;
+
+	CFSetGetValues(shared->_posted, triggers);
+
+	for (i = 0; i < count; i++) {
+
+		CFRunLoopSourceRef trigger = (CFRunLoopSourceRef)triggers[i];
+		CFRunLoopSourceContext ctxt;
+		_SharedTriggerInfo* info;
+		CFArrayRef runLoops;
+
+		CFRunLoopSourceSignal(trigger);
+
+		ctxt.version = 0;
+		CFRunLoopSourceGetContext(trigger, &ctxt);
+		info = (_SharedTriggerInfo*)ctxt.info;
+
+		__CFSpinLock(&info->_lock);
+		runLoops = CFArrayCreateCopy(kCFAllocatorDefault, info->_runLoops);
+		__CFSpinUnlock(&info->_lock);
+
+		if (runLoops) {
+
+			CFIndex j, loops = CFArrayGetCount(runLoops);
+
+			for (j = 0; j < loops; j++)
+				CFRunLoopWakeUp((CFRunLoopRef)CFArrayGetValueAtIndex(runLoops, j));
+
+			CFRelease(runLoops);
+		}
+	}
+
+	CFAllocatorDeallocate(kCFAllocatorDefault, triggers);
+
+	CFSetRemoveAllValues(shared->_posted);
+}
+
+
+/* static */ void
+_SharedTriggerRelease(const void* info) {
+
+	_SharedTriggerInfo* trigger = (_SharedTriggerInfo*)info;
+
+	CFRelease(trigger->_runLoops);
+	CFRelease(trigger->_owner);
+
+	CFAllocatorDeallocate(kCFAllocatorDefault, trigger);
+}
+
+
+/* static */ void
+_SharedTriggerSchedule(void* info, CFRunLoopRef rl, CFStringRef mode) {
+
+	_SharedTriggerInfo* trigger = (_SharedTriggerInfo*)info;
+
+	(void)mode;		// unused
+
+	__CFSpinLock(&trigger->_lock);
+	CFArrayAppendValue(trigger->_runLoops, rl);
+	__CFSpinUnlock(&trigger->_lock);
+}
+
+
+/* static */ void
+_SharedTriggerUnschedule(void* info, CFRunLoopRef rl, CFStringRef mode) {
+
+	_SharedTriggerInfo* trigger = (_SharedTriggerInfo*)info;
+	CFIndex index;
+
+	(void)mode;		// unused
+
+	__CFSpinLock(&trigger->_lock);
+
+	index = CFArrayGetFirstIndexOfValue(trigger->_runLoops,
+										CFRangeMake(0, CFArrayGetCount(trigger->_runLoops)),
+										rl);
+	if (index != kCFNotFound)
+		CFArrayRemoveValueAtIndex(trigger->_runLoops, index);
+
+	__CFSpinUnlock(&trigger->_lock);
+}
+
+
+/* static */ void
+_SharedTriggerPerform(void* info) {
+
+	_SharedTriggerInfo* trigger = (_SharedTriggerInfo*)info;
+
+	trigger->_perform((void*)trigger->_owner);
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark Extern Function Definitions (Internal)
+#endif
+
+/* extern */ DNSServiceRef
+_CFNetServiceSharedConnectionLock(DNSServiceErrorType* error) {
+
+	_CFNetServiceSharedConnection* shared = &_SharedConnection;
+
+	_CFDoOnce(&_kCFNetServiceSharedConnectionInitialize, _SharedConnectionInitialize);
+
+	if (!shared->_valid) {
+		*error = kDNSServiceErr_NoMemory;
+		return NULL;
+	}
+
+	_CFMutexLock(&shared->_mutex);
+
+	if (!shared->_primary) {
+
+#if defined(__MACH__)
+		*error = DNSServiceCreateConnection(&shared->_primary);
+#elif defined(__linux__)
+#warning "Linux portability issue!"
+		*error = kDNSServiceErr_Unsupported;
+#else
+#error "Platform portability issue!"
+#endif /* defined(__MACH__) */
+
+		if (*error) {
+			shared->_primary = NULL;
+			_CFMutexUnlock(&shared->_mutex);
+			return NULL;
+		}
+
+		// Get the new socket into the thread's poll.
+		_SharedConnectionWakeUp(shared);
+	}
+
+	return shared->_primary;
+}
+
+
+/* extern */ void
+_CFNetServiceSharedConnectionUnlock(void) {
+
+	_CFMutexUnlock(&_SharedConnection._mutex);
+}
+
+
+/* extern */ _CFNetServiceSharedOperationRef
+_CFNetServiceSharedConnectionAddOperation(DNSServiceRef operation, CFRunLoopSourceRef trigger,
+										  _CFNetServiceSharedErrorCallBack callback, void* info)
+{
+	_CFNetServiceSharedOperationRef result = CFAllocatorAllocate(kCFAllocatorDefault, sizeof(result[0]), 0);
+
+	if (result) {
+
+		result->_ref = operation;
+		result->_trigger = (CFRunLoopSourceRef)CFRetain(trigger);
+		result->_callback = callback;
+		result->_info = info;
+		result->_dead = FALSE;
+
+		CFArrayAppendValue(_SharedConnection._operations, result);
+	}
+
+	return result;
+}
+
+
+/* extern */ void
+_CFNetServiceSharedConnectionRemoveOperation(_CFNetServiceSharedOperationRef operation) {
+
+	_CFNetServiceSharedConnection* shared = &_SharedConnection;
+
+	__CFSpinLock(&shared->_lock);
+	CFArrayAppendValue(shared->_removals, operation);
+	__CFSpinUnlock(&shared->_lock);
+
+	_SharedConnectionWakeUp(shared);
+}
+
+
+/* extern */ CFRunLoopSourceRef
+_CFNetServiceSharedConnectionCreateTrigger(CFAllocatorRef alloc, CFTypeRef owner, void (*perform)(void*)) {
+
+	CFRunLoopSourceRef result = NULL;
+	_SharedTriggerInfo* info = CFAllocatorAllocate(kCFAllocatorDefault, sizeof(info[0]), 0);
+
+	if (info) {
+
+		CFRunLoopSourceContext ctxt = {
+			0,									// version
+			info,								// info
+			NULL,								// retain
+			_SharedTriggerRelease,				// release
+			NULL,								// copyDescription
+			NULL,								// equal
+			NULL,								// hash
+			_SharedTriggerSchedule,				// schedule
+			_SharedTriggerUnschedule,			// cancel
+			_SharedTriggerPerform				// perform
+		};
+
+		memset(info, 0, sizeof(info[0]));
+
+		info->_owner = CFRetain(owner);
+		info->_perform = perform;
+		info->_runLoops = CFArrayCreateMutable(alloc, 0, &kCFTypeArrayCallBacks);
+
+		if (info->_runLoops)
+			result = CFRunLoopSourceCreate(alloc, 0, &ctxt);
+
+		// The source didn't take the info, so clean it up.
+		if (!result) {
+			if (info->_runLoops)
+				CFRelease(info->_runLoops);
+			CFRelease(info->_owner);
+			CFAllocatorDeallocate(kCFAllocatorDefault, info);
+		}
+	}
+
+	return result;
+}
+
+
+/* extern */ void
+_CFNetServiceSharedConnectionPost(CFRunLoopSourceRef trigger, DNSServiceFlags flags) {
+
+	_CFNetServiceSharedConnection* shared = &_SharedConnection;
+
+	shared->_moreComing = (flags & kDNSServiceFlagsMoreComing) ? TRUE : FALSE;
+
+	if (trigger)
+		CFSetAddValue(shared->_posted, trigger);
+}
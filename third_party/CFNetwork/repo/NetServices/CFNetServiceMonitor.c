@@ -33,6 +33,7 @@
 #pragma mark Includes
 #endif
 #include <CFNetwork/CFNetwork.h>
+#include <CFNetwork/CFNetServicesPriv.h>
 #include "CFNetworkInternal.h"			// for __CFSpinLock and __CFSpinUnlock
 #include "CFNetworkSchedule.h"
 
@@ -93,9 +94,25 @@ typedef struct {
 	CFMutableArrayRef					_schedules;		// List of loops and modes
 	CFNetServiceMonitorClientCallBack	_callback;
 	CFNetServiceClientContext			_client;
+
+	Boolean								_shared;		// Monitors go over the shared connection
+	_CFNetServiceSharedOperationRef		_operation;		// The query on the shared connection
+
+	CFSpinLock_t						_inboxLock;		// Guards _inbox and _inboxTrigger for the connection thread
+	CFMutableArrayRef					_inbox;			// _MonitorEvent's from the shared connection
+	CFRunLoopSourceRef					_inboxTrigger;	// Posted for each event while monitoring
 } __CFNetServiceMonitor;
 
 
+// A reply from the shared connection, kept until the monitor's run loop
+typedef struct {
+	DNSServiceRef						_ref;
+	DNSServiceFlags						_flags;
+	DNSServiceErrorType					_error;
+	CFDataRef							_data;			// The record data, if any
+} _MonitorEvent;
+
+
 #if 0
 #pragma mark -
 #pragma mark Static Function Declarations
@@ -114,6 +131,19 @@ static void _QueryRecordReply(DNSServiceRef sdRef, DNSServiceFlags flags, uint32
 	
 static void _SocketCallBack(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void *data, void *info);
 
+static void _MonitorDeallocateMonitor(__CFNetServiceMonitor* monitor);
+
+static DNSServiceErrorType _MonitorStartShared(__CFNetServiceMonitor* monitor, const char* fullname, UInt16 rrtype, UInt16 rrclass);
+static void _MonitorStopShared(__CFNetServiceMonitor* monitor);
+static void _MonitorPostEvent(__CFNetServiceMonitor* monitor, DNSServiceRef sdRef, DNSServiceFlags flags, DNSServiceErrorType errorCode, CFDataRef data);
+static void _MonitorReleaseEvents(CFMutableArrayRef events);
+static void _MonitorFlush(void* info);
+
+static void _SharedQueryRecordReply(DNSServiceRef sdRef, DNSServiceFlags flags, uint32_t interfaceIndex,
+									DNSServiceErrorType errorCode, const char* fullname, uint16_t rrtype,
+									uint16_t rrclass, uint16_t rdlen, const void* rdata, uint32_t ttl, void* context);
+static void _SharedQueryRecordError(DNSServiceRef sdRef, DNSServiceErrorType errorCode, void* context);
+
 
 #if 0
 #pragma mark -
@@ -174,7 +204,13 @@ _MonitorDestroy(__CFNetServiceMonitor* monitor) {
 	if (monitor->_monitor) {
 		
 		// Release the underlying service discovery reference
-		DNSServiceRefDeallocate(monitor->_monitor);
+		_MonitorDeallocateMonitor(monitor);
+	}
+
+	// Release any replies never seen
+	if (monitor->_inbox) {
+		_MonitorReleaseEvents(monitor->_inbox);
+		CFRelease(monitor->_inbox);
 	}
 
 	/* Release the service if there is one */
@@ -395,6 +431,307 @@ _SocketCallBack(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, con
 }
 
 
+/* static */ void
+_MonitorDeallocateMonitor(__CFNetServiceMonitor* monitor) {
+	
+	// A query on the shared connection is handed back to it, otherwise the
+	// reference is the monitor's own.
+	if (monitor->_operation)
+		_MonitorStopShared(monitor);
+	else
+		DNSServiceRefDeallocate(monitor->_monitor);
+	
+	monitor->_monitor = NULL;
+}
+
+
+/* static */ DNSServiceErrorType
+_MonitorStartShared(__CFNetServiceMonitor* monitor, const char* fullname, UInt16 rrtype, UInt16 rrclass) {
+	
+	// Called with the monitor locked.  The monitor's trigger becomes a run loop
+	// source, posted by the replies and performed as _MonitorFlush.
+	
+	DNSServiceErrorType err = kDNSServiceErr_NoError;
+	DNSServiceRef primary;
+	CFRunLoopSourceRef trigger = _CFNetServiceSharedConnectionCreateTrigger(CFGetAllocator(monitor),
+																			(CFTypeRef)monitor,
+																			_MonitorFlush);
+	
+	if (!trigger)
+		return kDNSServiceErr_NoMemory;
+	
+	// Lock the connection so no replies come before the monitor is ready.
+	primary = _CFNetServiceSharedConnectionLock(&err);
+	
+	if (primary) {
+		
+		// The operation is made on a copy of the primary reference.
+		monitor->_monitor = primary;
+		
+#if defined(__MACH__)
+		err = DNSServiceQueryRecord(&monitor->_monitor,
+									kDNSServiceFlagsShareConnection | kDNSServiceFlagsLongLivedQuery,
+									0,
+									fullname,
+									rrtype,
+									rrclass,
+									_SharedQueryRecordReply,
+									monitor);
+#elif defined(__linux__)
+#warning "Linux portability issue!"
+		(void)fullname;		// unused
+		(void)rrtype;		// unused
+		(void)rrclass;		// unused
+		err = kDNSServiceErr_Unsupported;
+#else
+#error "Platform portability issue!"
+#endif /* defined(__MACH__) */
+		
+		if (!err) {
+			
+			monitor->_operation = _CFNetServiceSharedConnectionAddOperation(monitor->_monitor, trigger, _SharedQueryRecordError, monitor);
+			
+			if (!monitor->_operation) {
+				DNSServiceRefDeallocate(monitor->_monitor);
+				err = kDNSServiceErr_NoMemory;
+			}
+		}
+		
+		if (err)
+			monitor->_monitor = NULL;
+		
+		else {
+			
+			// Let the replies through to the inbox.
+			__CFSpinLock(&monitor->_inboxLock);
+			monitor->_inboxTrigger = (CFRunLoopSourceRef)CFRetain(trigger);
+			__CFSpinUnlock(&monitor->_inboxLock);
+			
+			monitor->_trigger = CFRetain(trigger);
+		}
+		
+		_CFNetServiceSharedConnectionUnlock();
+	}
+	
+	CFRelease(trigger);
+	
+	return err;
+}
+
+
+/* static */ void
+_MonitorStopShared(__CFNetServiceMonitor* monitor) {
+	
+	// Called with the monitor locked.  The trigger itself is left to the caller.
+	
+	CFRunLoopSourceRef trigger;
+	
+	// Stop replies getting through, and drop the ones not yet seen.
+	__CFSpinLock(&monitor->_inboxLock);
+	
+	trigger = monitor->_inboxTrigger;
+	monitor->_inboxTrigger = NULL;
+	
+	_MonitorReleaseEvents(monitor->_inbox);
+	
+	__CFSpinUnlock(&monitor->_inboxLock);
+	
+	if (trigger)
+		CFRelease(trigger);
+	
+	// The connection deallocates the query on its own thread.
+	_CFNetServiceSharedConnectionRemoveOperation(monitor->_operation);
+	monitor->_operation = NULL;
+	monitor->_monitor = NULL;
+}
+
+
+/* static */ void
+_MonitorPostEvent(__CFNetServiceMonitor* monitor, DNSServiceRef sdRef, DNSServiceFlags flags, DNSServiceErrorType errorCode, CFDataRef data) {
+	
+	// Called on the connection thread, so only the inbox may be touched.
+	
+	_MonitorEvent* event = CFAllocatorAllocate(kCFAllocatorDefault, sizeof(event[0]), 0);
+	
+	if (event) {
+		event->_ref = sdRef;
+		event->_flags = flags;
+		event->_error = errorCode;
+		event->_data = data ? (CFDataRef)CFRetain(data) : NULL;
+	}
+	
+	__CFSpinLock(&monitor->_inboxLock);
+	
+	// Keep it only if the monitor is still listening.
+	if (event && monitor->_inboxTrigger) {
+		CFArrayAppendValue(monitor->_inbox, event);
+		event = NULL;
+	}
+	
+	// Even without a trigger, the connection must see the end of the burst.
+	_CFNetServiceSharedConnectionPost(monitor->_inboxTrigger, flags);
+	
+	__CFSpinUnlock(&monitor->_inboxLock);
+	
+	if (event) {
+		if (event->_data)
+			CFRelease(event->_data);
+		CFAllocatorDeallocate(kCFAllocatorDefault, event);
+	}
+}
+
+
+/* static */ void
+_MonitorReleaseEvents(CFMutableArrayRef events) {
+	
+	CFIndex i, count = CFArrayGetCount(events);
+	
+	for (i = 0; i < count; i++) {
+		
+		_MonitorEvent* event = (_MonitorEvent*)CFArrayGetValueAtIndex(events, i);
+		
+		if (event->_data)
+			CFRelease(event->_data);
+		
+		CFAllocatorDeallocate(kCFAllocatorDefault, event);
+	}
+	
+	CFArrayRemoveAllValues(events);
+}
+
+
+/* static */ void
+_MonitorFlush(void* context) {
+	
+	__CFNetServiceMonitor* monitor = context;
+	CFNetServiceMonitorClientCallBack cb = NULL;
+	CFStreamError error = {0, 0};
+	void* info = NULL;
+	CFDataRef data = NULL;
+	CFNetServiceRef service = NULL;
+	CFNetServiceMonitorType type = 0;
+	DNSServiceRef query;
+	CFMutableArrayRef events = CFArrayCreateMutable(kCFAllocatorDefault, 0, NULL);
+	CFIndex i, count;
+	
+	if (!events)
+		return;
+	
+	// Retain here to guarantee safety really after the trigger release,
+	// but definitely before the callback.
+	CFRetain(monitor);
+	
+	// Take everything the connection has given so far.
+	__CFSpinLock(&monitor->_inboxLock);
+	{
+		CFMutableArrayRef inbox = monitor->_inbox;
+		monitor->_inbox = events;
+		events = inbox;
+	}
+	__CFSpinUnlock(&monitor->_inboxLock);
+	
+	// Lock the monitor
+	__CFSpinLock(&monitor->_lock);
+	
+	// Replies to an earlier query are of no interest.
+	query = monitor->_monitor;
+	
+	for (i = 0, count = CFArrayGetCount(events); monitor->_operation && (i < count); i++) {
+		
+		_MonitorEvent* event = (_MonitorEvent*)CFArrayGetValueAtIndex(events, i);
+		
+		if (event->_ref != query)
+			continue;
+		
+		// If there is an error, fold the monitor.
+		if (event->_error) {
+			
+			// Save the error
+			monitor->_error.error = _DNSServiceErrorToCFNetServiceError(event->_error);
+			monitor->_error.domain = kCFStreamErrorDomainNetServices;
+			
+			// Remove the monitor from run loops and modes
+			_CFTypeUnscheduleFromMultipleRunLoops(monitor->_trigger, monitor->_schedules);
+			
+			// Go ahead and invalidate the trigger
+			_CFTypeInvalidate(monitor->_trigger);
+			
+			// Release the monitor now.
+			CFRelease(monitor->_trigger);
+			monitor->_trigger = NULL;
+			
+			// Hand the query back to the connection
+			_MonitorStopShared(monitor);
+		}
+		
+		// Only the latest record of the burst is worth passing on.
+		else if (event->_data && (event->_flags & kDNSServiceFlagsAdd))
+			data = event->_data;
+	}
+	
+	if (monitor->_service) {
+		
+		service = (CFNetServiceRef)CFRetain(monitor->_service);
+		type = monitor->_type;
+		
+		/* Update the service with the info */
+		if (data)
+			_CFNetServiceSetInfoNoPublish(service, type, data);
+	}
+	
+	cb = monitor->_callback;
+	
+	// Save the error and client information for the callback
+	memmove(&error, &(monitor->_error), sizeof(error));
+	info = monitor->_client.info;
+	
+	// Unlock the monitor so the callback can be made safely.
+	__CFSpinUnlock(&monitor->_lock);
+	
+	// If there is a callback, inform the client of the record or the error.
+	if (cb && (data || error.error))
+		cb((CFNetServiceMonitorRef)monitor, service, type, data, &error, info);
+	
+	// No longer need this after the callback
+	if (service)
+		CFRelease(service);
+	
+	// The data is held by the events until now.
+	_MonitorReleaseEvents(events);
+	CFRelease(events);
+	
+	// Go ahead and release now that the callback is done.
+	CFRelease(monitor);
+}
+
+
+/* static */ void
+_SharedQueryRecordReply(DNSServiceRef sdRef, DNSServiceFlags flags, uint32_t interfaceIndex,
+						DNSServiceErrorType errorCode, const char* fullname, uint16_t rrtype,
+						uint16_t rrclass, uint16_t rdlen, const void* rdata, uint32_t ttl, void* context)
+{
+	__CFNetServiceMonitor* monitor = context;
+	CFDataRef data = NULL;
+	
+	// Only the record data is of interest; it's applied on the monitor's run loop.
+	if (!errorCode && rdata)
+		data = CFDataCreate(CFGetAllocator(monitor), rdata, rdlen);
+	
+	_MonitorPostEvent(monitor, sdRef, flags, errorCode, data);
+	
+	if (data)
+		CFRelease(data);
+}
+
+
+/* static */ void
+_SharedQueryRecordError(DNSServiceRef sdRef, DNSServiceErrorType errorCode, void* context) {
+	
+	// The connection failed, so report it as if it were a reply.
+	_MonitorPostEvent((__CFNetServiceMonitor*)context, sdRef, 0, errorCode, NULL);
+}
+
+
 #if 0
 #pragma mark -
 #pragma mark Extern Function Definitions (API)
@@ -449,8 +786,11 @@ CFNetServiceMonitorCreate(CFAllocatorRef alloc, CFNetServiceRef theService, CFNe
 			// Create the list of loops and modes
 			result->_schedules = CFArrayCreateMutable(alloc, 0, &kCFTypeArrayCallBacks);
 			
+			// Create the inbox for replies from the shared connection
+			result->_inbox = CFArrayCreateMutable(kCFAllocatorDefault, 0, NULL);
+			
 			/* Need to save the service if successful */
-			if (result->_schedules)
+			if (result->_schedules && result->_inbox)
 				result->_service = (CFNetServiceRef)CFRetain(theService);
 				
 			// If any failed, need to release and return null
@@ -495,8 +835,7 @@ CFNetServiceMonitorInvalidate(CFNetServiceMonitorRef theMonitor) {
 	if (monitor->_monitor) {
 		
 		// Release the underlying service discovery reference
-		DNSServiceRefDeallocate(monitor->_monitor);
-		monitor->_monitor = NULL;
+		_MonitorDeallocateMonitor(monitor);
 	}
 	
 	/* No longer need the service, so release it. */
@@ -559,7 +898,7 @@ CFNetServiceMonitorStart(CFNetServiceMonitorRef theMonitor, CFNetServiceMonitorT
 		if (monitor->_trigger) {
 		
 			// If it's a mdns monitor, don't allow another.
-			if (CFGetTypeID(monitor->_trigger) == CFSocketGetTypeID()) {
+			if (monitor->_monitor) {
 				monitor->_error.error = kCFNetServicesErrorInProgress;
 				monitor->_error.domain = kCFStreamErrorDomainNetServices;
 				break;
@@ -613,23 +952,29 @@ CFNetServiceMonitorStart(CFNetServiceMonitorRef theMonitor, CFNetServiceMonitorT
 
 		monitor->_type = recordType;
 		
-		// Create the domain monitor at the service discovery level
+		// Make the query over the shared connection if asked.
+		if (monitor->_shared)
+			monitor->_error.error = _MonitorStartShared(monitor, properties[3], rrtype, rrclass);
+		
+		else {
+			// Create the domain monitor at the service discovery level
 #if defined(__MACH__)
-		monitor->_error.error = DNSServiceQueryRecord(&monitor->_monitor,
-													  kDNSServiceFlagsLongLivedQuery,
-													  0,
-													  properties[3],
-													  rrtype,
-													  rrclass,
-													  _QueryRecordReply,
-													  monitor);
+			monitor->_error.error = DNSServiceQueryRecord(&monitor->_monitor,
+														  kDNSServiceFlagsLongLivedQuery,
+														  0,
+														  properties[3],
+														  rrtype,
+														  rrclass,
+														  _QueryRecordReply,
+														  monitor);
 #elif defined(__linux__)
 #warning "Linux portability issue!"
-		monitor->_error.error = ENOSYS;
-		monitor->_error.domain = kCFStreamErrorDomainPOSIX;
+			monitor->_error.error = ENOSYS;
+			monitor->_error.domain = kCFStreamErrorDomainPOSIX;
 #else
 #error "Platform portability issue!"
 #endif /* defined(__MACH__) */
+		}
 		
 		// Fail if it did.
 		if (monitor->_error.error) {
@@ -638,36 +983,39 @@ CFNetServiceMonitorStart(CFNetServiceMonitorRef theMonitor, CFNetServiceMonitorT
 			break;
 		}
 		
-		// Create the trigger for the monitor
-		monitor->_trigger = CFSocketCreateWithNative(CFGetAllocator(monitor),
-													 DNSServiceRefSockFD(monitor->_monitor),
-													 kCFSocketReadCallBack,
-													 _SocketCallBack,
-													 &ctxt);
-		
-		// Make sure the CFSocket wrapper succeeded
-		if (!monitor->_trigger) {
+		// Create the trigger for the monitor, unless the shared connection made it.
+		if (!monitor->_operation) {
 			
-			// Try to use errno for the error
-			monitor->_error.error = errno;
+			monitor->_trigger = CFSocketCreateWithNative(CFGetAllocator(monitor),
+														 DNSServiceRefSockFD(monitor->_monitor),
+														 kCFSocketReadCallBack,
+														 _SocketCallBack,
+														 &ctxt);
 			
-			// If it has no error in it, assume no memory
-			if (!monitor->_error.error)
-				monitor->_error.error = ENOMEM;
-			
-			// Correct domain and bail.
-			monitor->_error.domain = kCFStreamErrorDomainPOSIX;
-			
-			DNSServiceRefDeallocate(monitor->_monitor);
-			monitor->_monitor = NULL;
+			// Make sure the CFSocket wrapper succeeded
+			if (!monitor->_trigger) {
+				
+				// Try to use errno for the error
+				monitor->_error.error = errno;
+				
+				// If it has no error in it, assume no memory
+				if (!monitor->_error.error)
+					monitor->_error.error = ENOMEM;
+				
+				// Correct domain and bail.
+				monitor->_error.domain = kCFStreamErrorDomainPOSIX;
+				
+				DNSServiceRefDeallocate(monitor->_monitor);
+				monitor->_monitor = NULL;
+				
+				break;
+			}
 			
-			break;
+			// Tell CFSocket not to close the native socket on invalidation.
+			CFSocketSetSocketFlags((CFSocketRef)monitor->_trigger,
+								   CFSocketGetSocketFlags((CFSocketRef)monitor->_trigger) & ~kCFSocketCloseOnInvalidate);
 		}
 		
-		// Tell CFSocket not to close the native socket on invalidation.
-		CFSocketSetSocketFlags((CFSocketRef)monitor->_trigger,
-							   CFSocketGetSocketFlags((CFSocketRef)monitor->_trigger) & ~kCFSocketCloseOnInvalidate);
-		
 		// Async mode is complete at this point
 		if (CFArrayGetCount(monitor->_schedules)) {
 			
@@ -750,8 +1098,7 @@ CFNetServiceMonitorStop(CFNetServiceMonitorRef theMonitor, CFStreamError* error)
 		if (monitor->_monitor) {
 			
 			// Release the underlying service discovery reference
-			DNSServiceRefDeallocate(monitor->_monitor);
-			monitor->_monitor = NULL;
+			_MonitorDeallocateMonitor(monitor);
 		}
 		
 		// Copy the error into place
@@ -845,3 +1192,24 @@ CFNetServiceMonitorUnscheduleFromRunLoop(CFNetServiceMonitorRef theMonitor, CFRu
 	__CFSpinUnlock(&(monitor->_lock));
 }
 
+
+#if 0
+#pragma mark -
+#pragma mark Extern Function Definitions (SPI)
+#endif
+
+/* extern */ void
+_CFNetServiceMonitorSetUsesSharedConnection(CFNetServiceMonitorRef theMonitor, Boolean shared) {
+	
+	__CFNetServiceMonitor* monitor = (__CFNetServiceMonitor*)theMonitor;
+	
+	// Lock down the monitor before work
+	__CFSpinLock(&(monitor->_lock));
+	
+	// Noted for the next start; a running monitor keeps its connection.
+	monitor->_shared = shared;
+	
+	// Unlock the monitor
+	__CFSpinUnlock(&(monitor->_lock));
+}
+
@@ -33,6 +33,7 @@
 
 #include <CFNetwork/CFNetworkPriv.h>
 #include "CFNetworkInternal.h"
+#include "CFNetworkSchedule.h"
 #include <CoreFoundation/CFStreamPriv.h>
 
 #ifndef __WIN32__
@@ -82,6 +83,7 @@
 #define _kProxySupportJSExtension			CFSTR("js")
 #define _kProxySupportExpiresHeader			CFSTR("Expires")
 #define _kProxySupportNowHeader                 CFSTR("Date")
+#define _kProxySupportResultKeyFormat		CFSTR("%@://%@")
 #else
 CONST_STRING_DECL_LOCAL(_kProxySupportCFNetworkBundleID, "com.apple.CFNetwork")
 CONST_STRING_DECL_LOCAL(_kProxySupportLocalhost, "localhost")
@@ -116,6 +118,7 @@ CONST_STRING_DECL_LOCAL(_kProxySupportPacSupportFileName, "PACSupport")
 CONST_STRING_DECL_LOCAL(_kProxySupportJSExtension, "js")
 CONST_STRING_DECL_LOCAL(_kProxySupportExpiresHeader, "Expires")
 CONST_STRING_DECL_LOCAL(_kProxySupportNowHeader, "Date")
+CONST_STRING_DECL_LOCAL(_kProxySupportResultKeyFormat, "%@://%@")
 #endif	/* __CONSTANT_CFSTRINGS__ */
 
 #if defined(__MACH__)
@@ -169,13 +172,14 @@ static const char *_CFDLLPath(void) {
 #endif	/* __WIN32__ */
 
 #if defined(__MACH__)
+typedef struct _PACRuntime _PACRuntime;
+
 static CFStringRef _JSFindProxyForURL(CFURLRef pac, CFURLRef url, CFStringRef host);
 static CFStringRef _JSFindProxyForURLAsync(CFURLRef pac, CFURLRef url, CFStringRef host, Boolean *mustBlock);
 #endif
 
 #define PAC_STREAM_LOAD_TIMEOUT		30.0
 
-static CFReadStreamRef BuildStreamForPACURL(CFAllocatorRef alloc, CFURLRef pacURL, CFURLRef targetURL, CFStringRef targetScheme, CFStringRef targetHost, _CFProxyStreamCallBack callback, void *clientInfo);
 static CFStringRef _loadJSSupportFile(void);
 static CFStringRef _loadPACFile(CFAllocatorRef alloc, CFURLRef pac, CFAbsoluteTime *expires, CFStreamError *err);
 #if defined(__MACH__)
@@ -186,7 +190,10 @@ static CFStringRef _callPACFunction(CFAllocatorRef alloc, JSRunRef runtime, CFUR
 static CFArrayRef _resolveDNSName(CFStringRef name);
 static CFReadStreamRef _streamForPACFile(CFAllocatorRef alloc, CFURLRef pac, Boolean *isFile);
 CFStringRef _stringFromLoadedPACStream(CFAllocatorRef alloc, CFMutableDataRef contents, CFReadStreamRef stream, CFAbsoluteTime *expires);
-static void _JSSetEnvironmentForPAC(CFAllocatorRef alloc, CFURLRef url, CFAbsoluteTime expires, CFStringRef pacString);
+#if defined(__MACH__)
+static _PACRuntime *_JSSetEnvironmentForPAC(CFAllocatorRef alloc, CFURLRef url, CFAbsoluteTime expires, CFStringRef pacString);
+static CFReadStreamRef _PACJobCreateStream(CFAllocatorRef alloc, CFURLRef pacURL, CFURLRef targetURL, CFStringRef targetScheme, CFStringRef targetHost, _CFProxyStreamCallBack callback, void *clientInfo);
+#endif /* defined(__MACH__) */
 
 /*
  ** Determine whether a given "enabled" entry ("HTTPEnable", "HTTPSEnable", ...) means 
@@ -675,7 +682,7 @@ _CFNetworkFindProxyForURLAsync(CFStringRef scheme, CFURLRef url, CFStringRef hos
                         }
 
                         if (mustLoad) {
-                            *proxyStream = BuildStreamForPACURL(alloc, pac, url, scheme, host, callback, clientInfo);
+                            *proxyStream = _PACJobCreateStream(alloc, pac, url, scheme, host, callback, clientInfo);
                             CFRelease(result);
                             result = NULL; // NULL means async load in progress
                         } else {
@@ -1922,86 +1929,280 @@ _JSPrimaryIpv4AddressesFunction(void) {
 
 #endif  /* __WIN32__ */
 
-static CFURLRef _JSPacFileLocation = NULL;
-static CFAbsoluteTime _JSPacFileExpiration = 0;
 #if defined(__MACH__)
-static JSRunRef _JSRuntime = NULL;
+
+#define PAC_RUNTIME_CACHE_LIMIT		4		// Compiled PAC runtimes kept, one per PAC URL
+#define PAC_RESULT_CACHE_TTL		300.0	// Seconds a FindProxyForURL result is reused for a scheme and host
+#define PAC_RESULT_CACHE_LIMIT		256		// Results memoized per compiled PAC runtime
+
+struct _PACRuntime {
+    CFURLRef				pacURL;			// Location from which the PAC file was loaded
+    CFAbsoluteTime			expires;		// Expiration of the PAC file, as reported by _loadPACFile
+    JSRunRef				runtime;		// Support and PAC code, compiled once
+    CFMutableDictionaryRef	results;		// Memoized results (_PACResult) by "scheme://host"
+};
+
+typedef struct {
+    CFStringRef				proxies;		// Result of FindProxyForURL
+    CFAbsoluteTime			expires;		// Time after which FindProxyForURL must be evaluated again
+} _PACResult;
+
+/* Compiled runtimes, most recently used first.  The list and the results memoized
+   for each runtime are guarded by the _JSLock.  Runtimes are only compiled, evaluated
+   and freed while holding the _JSEvaluationLock, which is never taken under the _JSLock. */
+static CFMutableArrayRef _JSRuntimes = NULL;
+static _CFMutex _JSEvaluationLock;
+static _CFOnceLock _JSInitializeOnce = _CFOnceInitializer;
 #endif
 
+static CFSpinLock_t _JSLock = CFSpinLockInit;
+
 #if defined(__MACH__)
-/* Must be called while holding the _JSLock.  It is the caller's responsibility to verify that expires is a valid 
+static void
+_JSInitialize(void) {
+    _CFMutexInit(&_JSEvaluationLock, FALSE);
+    _JSRuntimes = CFArrayCreateMutable(kCFAllocatorDefault, 0, NULL);
+}
+
+
+static void
+_PACResultRelease(CFAllocatorRef alloc, const void *value) {
+    _PACResult *result = (_PACResult *)value;
+    CFRelease(result->proxies);
+    CFAllocatorDeallocate(alloc, result);
+}
+
+
+static void
+_JSFreeRuntime(_PACRuntime *entry) {
+    _freeJSRuntime(entry->runtime);
+    CFRelease(entry->pacURL);
+    CFRelease(entry->results);
+    CFAllocatorDeallocate(kCFAllocatorDefault, entry);
+}
+
+
+/* Must be called while holding the _JSLock.  Expired runtimes are not returned,
+   but are left for _JSSetEnvironmentForPAC to replace. */
+static _PACRuntime *
+_JSFindRuntime(CFURLRef pac) {
+    CFIndex i, count = CFArrayGetCount(_JSRuntimes);
+
+    for (i = 0; i < count; i++) {
+        _PACRuntime *entry = (_PACRuntime *)CFArrayGetValueAtIndex(_JSRuntimes, i);
+
+        if (!CFEqual(pac, entry->pacURL))
+            continue;
+
+        if (!entry->expires || (CFAbsoluteTimeGetCurrent() > entry->expires))
+            return NULL;
+
+        // Keep the most recently used runtimes at the front.
+        if (i) {
+            CFArrayRemoveValueAtIndex(_JSRuntimes, i);
+            CFArrayInsertValueAtIndex(_JSRuntimes, 0, entry);
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+
+/* Must be called while holding the _JSEvaluationLock.  It is the caller's responsibility to verify that expires is a valid 
    value; bad values can cause problems.  In general, the caller should make sure to successfully go through
    _stringFromLoadedPACStream to produce the expiry value. */ 
-static void _JSSetEnvironmentForPAC(CFAllocatorRef alloc, CFURLRef url, CFAbsoluteTime expires, CFStringRef pacString) {
+static _PACRuntime *
+_JSSetEnvironmentForPAC(CFAllocatorRef alloc, CFURLRef url, CFAbsoluteTime expires, CFStringRef pacString) {
 
-    if (_JSRuntime) {
-        _freeJSRuntime(_JSRuntime);
-        _JSRuntime = NULL;
+    CFDictionaryValueCallBacks resultCallBacks = {0, NULL, _PACResultRelease, NULL, NULL};
+    _PACRuntime *stale[PAC_RUNTIME_CACHE_LIMIT + 1];
+    CFIndex i, count, staleCount = 0;
+    _PACRuntime *entry = NULL;
+    JSRunRef runtime = NULL;
+
+    CFStringRef js_support = _loadJSSupportFile();
+    if (js_support)
+        runtime = _createJSRuntime(alloc, js_support, pacString);
+
+    if (runtime) {
+        entry = CFAllocatorAllocate(kCFAllocatorDefault, sizeof(entry[0]), 0);
+        entry->pacURL = CFRetain(url);
+        entry->expires = expires;
+        entry->runtime = runtime;
+        entry->results = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &resultCallBacks);
     }
 
-    _JSPacFileExpiration = 0;
+    __CFSpinLock(&_JSLock);
 
-    if (_JSPacFileLocation) {
-        CFRelease(_JSPacFileLocation);
-        _JSPacFileLocation = NULL;
+    // Drop the runtime previously compiled for this PAC file, even if the new one failed.
+    count = CFArrayGetCount(_JSRuntimes);
+    for (i = 0; i < count; i++) {
+        if (CFEqual(url, ((_PACRuntime *)CFArrayGetValueAtIndex(_JSRuntimes, i))->pacURL)) {
+            stale[staleCount++] = (_PACRuntime *)CFArrayGetValueAtIndex(_JSRuntimes, i);
+            CFArrayRemoveValueAtIndex(_JSRuntimes, i);
+            break;
+        }
     }
-    
-    CFStringRef js_support = _loadJSSupportFile();
-    if (js_support) {
-        _JSRuntime = _createJSRuntime(alloc, js_support, pacString);
-        if (_JSRuntime) {
-            _JSPacFileExpiration = expires;
-            _JSPacFileLocation = CFRetain(url);
+
+    // Make room for the new one by dropping the least recently used.
+    if (entry) {
+        while ((count = CFArrayGetCount(_JSRuntimes)) >= PAC_RUNTIME_CACHE_LIMIT) {
+            stale[staleCount++] = (_PACRuntime *)CFArrayGetValueAtIndex(_JSRuntimes, count - 1);
+            CFArrayRemoveValueAtIndex(_JSRuntimes, count - 1);
         }
+        CFArrayInsertValueAtIndex(_JSRuntimes, 0, entry);
     }
+
+    __CFSpinUnlock(&_JSLock);
+
+    // Nothing else can be evaluating these, since that also requires the _JSEvaluationLock.
+    for (i = 0; i < staleCount; i++)
+        _JSFreeRuntime(stale[i]);
+
+    return entry;
+}
+
+
+static CFStringRef
+_JSCreateResultKey(CFAllocatorRef alloc, CFURLRef url, CFStringRef host) {
+    CFStringRef scheme = url ? CFURLCopyScheme(url) : NULL;
+    CFMutableStringRef key = CFStringCreateMutable(alloc, 0);
+
+    if (key) {
+        CFStringAppendFormat(key, NULL, _kProxySupportResultKeyFormat, scheme ? scheme : CFSTR(""), host);
+        CFStringLowercase(key, NULL);
+    }
+
+    if (scheme) CFRelease(scheme);
+    return key;
+}
+
+
+static CFStringRef
+_JSCopyCachedResult(CFURLRef pac, CFStringRef key) {
+    CFStringRef result = NULL;
+    _PACRuntime *entry;
+
+    __CFSpinLock(&_JSLock);
+
+    entry = _JSFindRuntime(pac);
+    if (entry) {
+        _PACResult *cached = (_PACResult *)CFDictionaryGetValue(entry->results, key);
+        if (cached && (CFAbsoluteTimeGetCurrent() <= cached->expires))
+            result = CFRetain(cached->proxies);
+    }
+
+    __CFSpinUnlock(&_JSLock);
+    return result;
+}
+
+
+/* Must be called while holding the _JSEvaluationLock, so the runtime can't be freed. */
+static void
+_JSCacheResult(_PACRuntime *entry, CFStringRef key, CFStringRef proxies) {
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    _PACResult *cached = CFAllocatorAllocate(kCFAllocatorDefault, sizeof(cached[0]), 0);
+
+    if (!cached)
+        return;
+
+    // Never keep a result past the expiration of the PAC file which produced it.
+    cached->proxies = CFRetain(proxies);
+    cached->expires = now + PAC_RESULT_CACHE_TTL;
+    if (cached->expires > entry->expires)
+        cached->expires = entry->expires;
+
+    __CFSpinLock(&_JSLock);
+
+    // When full, throw out the expired results.  If that's not enough, start over.
+    if (CFDictionaryGetCount(entry->results) >= PAC_RESULT_CACHE_LIMIT) {
+        CFIndex i, count = CFDictionaryGetCount(entry->results);
+        const void **keys = CFAllocatorAllocate(kCFAllocatorDefault, 2 * count * sizeof(keys[0]), 0);
+        const void **values = keys ? keys + count : NULL;
+
+        if (keys) {
+            CFDictionaryGetKeysAndValues(entry->results, keys, values);
+            for (i = 0; i < count; i++) {
+                if (now > ((_PACResult *)values[i])->expires)
+                    CFDictionaryRemoveValue(entry->results, keys[i]);
+            }
+            CFAllocatorDeallocate(kCFAllocatorDefault, keys);
+        }
+
+        if (CFDictionaryGetCount(entry->results) >= PAC_RESULT_CACHE_LIMIT)
+            CFDictionaryRemoveAllValues(entry->results);
+    }
+
+    CFDictionarySetValue(entry->results, key, cached);
+
+    __CFSpinUnlock(&_JSLock);
 }
-#endif /* defined(__MACH__) */
 
-static CFSpinLock_t _JSLock = CFSpinLockInit;
 
-#if defined(__MACH__)
 /* static */ CFStringRef
 _JSFindProxyForURL(CFURLRef pac, CFURLRef url, CFStringRef host) {
     CFAllocatorRef alloc = CFGetAllocator(pac);
     CFStringRef result = NULL;
     CFStreamError err = {0, 0};
+    _PACRuntime *entry;
+    CFStringRef key;
 
     if (!host) {
         return CFRetain(_kProxySupportDIRECT);
     }
-    
-    __CFSpinLock(&_JSLock);
 
-    if (!_JSRuntime ||
-        !_JSPacFileExpiration || (CFAbsoluteTimeGetCurrent() > _JSPacFileExpiration) ||
-        !_JSPacFileLocation || !CFEqual(pac, _JSPacFileLocation)) {
+    _CFDoOnce(&_JSInitializeOnce, _JSInitialize);
 
-        CFAbsoluteTime expires;
-        CFStringRef js_pac = _loadPACFile(alloc, pac, &expires, &err);
-        if (js_pac) {
-            _JSSetEnvironmentForPAC(alloc, pac, expires, js_pac);
-            CFRelease(js_pac);
+    // A result memoized for the scheme and host spares evaluating the PAC file at all.
+    key = _JSCreateResultKey(alloc, url, host);
+    if (key) {
+        result = _JSCopyCachedResult(pac, key);
+        if (result) {
+            CFRelease(key);
+            return result;
         }
     }
 
-    if (_JSRuntime) {
-        result = _callPACFunction(alloc, _JSRuntime, url, host);
-#if 0
-        // debug code to enable leak checking - see more info in _freeJSRuntime
-        _freeJSRuntime(_JSRuntime);
-        _JSRuntime = NULL;
-#endif
-    }
-    else if ((err.domain == kCFStreamErrorDomainNetDB) ||					// Host name lookup failure
-             (err.domain == kCFStreamErrorDomainSystemConfiguration) ||		// Connection lost or not reachable
-             (err.domain == kCFStreamErrorDomainSSL) ||						// SSL errors (bad cert)
-             (err.domain == _kCFStreamErrorDomainNativeSockets) ||				// Socket errors
-             (err.domain == kCFStreamErrorDomainCustom))					// Timedout error for loader
-    {
-        result = CFRetain(_kProxySupportDIRECT);
+    _CFMutexLock(&_JSEvaluationLock);
+
+    // Another thread may have evaluated the same scheme and host while waiting.
+    if (key)
+        result = _JSCopyCachedResult(pac, key);
+
+    if (!result) {
+
+        __CFSpinLock(&_JSLock);
+        entry = _JSFindRuntime(pac);
+        __CFSpinUnlock(&_JSLock);
+
+        // Only load and compile the PAC file once per expiration.
+        if (!entry) {
+            CFAbsoluteTime expires;
+            CFStringRef js_pac = _loadPACFile(alloc, pac, &expires, &err);
+            if (js_pac) {
+                entry = _JSSetEnvironmentForPAC(alloc, pac, expires, js_pac);
+                CFRelease(js_pac);
+            }
+        }
+
+        if (entry) {
+            result = _callPACFunction(alloc, entry->runtime, url, host);
+            if (result && key)
+                _JSCacheResult(entry, key, result);
+        }
+        else if ((err.domain == kCFStreamErrorDomainNetDB) ||					// Host name lookup failure
+                 (err.domain == kCFStreamErrorDomainSystemConfiguration) ||		// Connection lost or not reachable
+                 (err.domain == kCFStreamErrorDomainSSL) ||						// SSL errors (bad cert)
+                 (err.domain == _kCFStreamErrorDomainNativeSockets) ||				// Socket errors
+                 (err.domain == kCFStreamErrorDomainCustom))					// Timedout error for loader
+        {
+            result = CFRetain(_kProxySupportDIRECT);
+        }
     }
 
-    __CFSpinUnlock(&_JSLock);
+    _CFMutexUnlock(&_JSEvaluationLock);
+
+    if (key) CFRelease(key);
     return result;
 }
 
@@ -2009,22 +2210,23 @@ static CFStringRef
 _JSFindProxyForURLAsync(CFURLRef pac, CFURLRef url, CFStringRef host, Boolean *mustBlock) {
     CFStringRef result = NULL;
     CFAllocatorRef alloc = CFGetAllocator(pac);
+    CFStringRef key;
     
     if (!host) {
         return CFRetain(_kProxySupportDIRECT);
     }
     
-     __CFSpinLock(&_JSLock);
+    _CFDoOnce(&_JSInitializeOnce, _JSInitialize);
 
-    if (!_JSRuntime || !_JSPacFileExpiration || 
-        (CFAbsoluteTimeGetCurrent() > _JSPacFileExpiration) ||
-        !_JSPacFileLocation || !CFEqual(pac, _JSPacFileLocation)) {
-        *mustBlock = TRUE;
-    } else {
-        result = _callPACFunction(alloc, _JSRuntime, url, host);
-        *mustBlock = FALSE;
+    key = _JSCreateResultKey(alloc, url, host);
+    if (key) {
+        result = _JSCopyCachedResult(pac, key);
+        CFRelease(key);
     }
-    __CFSpinUnlock(&_JSLock);
+
+    // Anything not memoized is loaded and evaluated on the PAC worker, off of
+    // the caller's run loop.
+    *mustBlock = (result == NULL);
 
     return result;
 }
@@ -2160,48 +2362,218 @@ _JSPrimaryIpv4AddressesFunction(void* context, JSObjectRef ctxt, CFArrayRef args
 #endif
 
 
-#define BUF_SIZE 4096
-static void releasePACStreamContext(void *info);
+#if defined(__MACH__)
 
+/*
+** PAC files are loaded, compiled and evaluated on a single worker thread, so an
+** asynchronous lookup never blocks the caller's run loop.  Each lookup is a job,
+** handed to the caller as a proxy stream which ends once the job is evaluated.
+*/
 typedef struct {
-    CFURLRef pacURL;
-    CFURLRef targetURL;
-    CFStringRef targetScheme;
-    CFStringRef targetHost;
-    
-    CFMutableDataRef data;
-    void *clientInfo;
-    _CFProxyStreamCallBack cb;
-} _PACStreamContext;
+    CFSpinLock_t			lock;			// Guards the fields through result
+    UInt32					refs;			// Held by the proxy stream and, while queued, by the worker
+    CFReadStreamRef			stream;			// Proxy stream handed to the caller (not retained)
+    CFRunLoopSourceRef		source;			// Signalled on the proxy stream's run loops once evaluated
+    CFMutableArrayRef		schedules;		// Run loops and modes on which the proxy stream is scheduled
+    Boolean					complete;		// FindProxyForURL has been evaluated
+    CFStringRef				result;			// Result of FindProxyForURL
+
+    CFAllocatorRef			alloc;
+    CFURLRef				pacURL;
+    CFURLRef				targetURL;
+    CFStringRef				targetScheme;
+    CFStringRef				targetHost;
+    _CFProxyStreamCallBack	cb;
+    void*					clientInfo;
+} _PACJob;
+
+static _CFOnceLock _PACWorkerOnce = _CFOnceInitializer;
+static CFSpinLock_t _PACWorkerLock = CFSpinLockInit;		// Guards the run loop and the queue
+static CFRunLoopRef _PACWorkerRunLoop = NULL;				// Worker's run loop, once it's running
+static CFRunLoopSourceRef _PACWorkerSource = NULL;		// Signalled as jobs are queued
+static CFMutableArrayRef _PACWorkerJobs = NULL;			// Jobs awaiting evaluation
+
+static void _PACWorkerStart(void);
+static void *_PACWorkerMain(void *info);
+static void _PACWorkerPerform(void *info);
+static void _PACWorkerQueue(_PACJob *job);
+static void _PACJobRelease(_PACJob *job);
+static void _PACJobEvaluate(_PACJob *job);
+static void _PACJobPerform(_PACJob *job);
+static void _PACJobStreamCallBack(CFReadStreamRef stream, CFStreamEventType type, _PACJob *job);
+static Boolean _PACJobStreamOpen(CFReadStreamRef stream, CFStreamError *error, Boolean *openComplete, _PACJob *job);
+static CFIndex _PACJobStreamRead(CFReadStreamRef stream, UInt8 *buffer, CFIndex bufferLength, CFStreamError *error, Boolean *atEOF, _PACJob *job);
+static Boolean _PACJobStreamCanRead(CFReadStreamRef stream, _PACJob *job);
+static void _PACJobStreamSchedule(CFReadStreamRef stream, CFRunLoopRef runLoop, CFStringRef runLoopMode, _PACJob *job);
+static void _PACJobStreamUnschedule(CFReadStreamRef stream, CFRunLoopRef runLoop, CFStringRef runLoopMode, _PACJob *job);
+static void _PACJobStreamFinalize(CFReadStreamRef stream, _PACJob *job);
+
 
-static void releasePACStreamContext(void *info) {
-    _PACStreamContext *ctxt = (_PACStreamContext *)info;
-    CFAllocatorRef alloc = CFGetAllocator(ctxt->data);
-    CFRelease(ctxt->pacURL);
-    CFRelease(ctxt->targetURL);
-    CFRelease(ctxt->targetScheme);
-    CFRelease(ctxt->targetHost);
-    CFRelease(ctxt->data);
-    CFAllocatorDeallocate(alloc, ctxt);
+static void
+_PACWorkerStart(void) {
+    CFRunLoopSourceContext ctxt = {0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, _PACWorkerPerform};
+    _CFThread thread;
+
+    _PACWorkerJobs = CFArrayCreateMutable(kCFAllocatorDefault, 0, NULL);
+    _PACWorkerSource = _PACWorkerJobs ? CFRunLoopSourceCreate(kCFAllocatorDefault, 0, &ctxt) : NULL;
+
+    // The worker lives for the life of the process.  Without it, jobs are
+    // evaluated as they're queued.
+    if (_PACWorkerSource && (_CFThreadSpawn(&thread, _PACWorkerMain, NULL) == 0)) {
+        _CFThreadDetach(thread);
+    } else if (_PACWorkerSource) {
+        CFRelease(_PACWorkerSource);
+        _PACWorkerSource = NULL;
+    }
 }
 
-static void readBytesFromProxyStream(CFReadStreamRef proxyStream, _PACStreamContext *ctxt) {
-    UInt8 buf[BUF_SIZE];
-    CFIndex bytesRead = CFReadStreamRead(proxyStream, buf, BUF_SIZE);
-    if (bytesRead > 0) {
-        CFDataAppendBytes(ctxt->data, buf, bytesRead);
+
+static void *
+_PACWorkerMain(void *info) {
+    CFRunLoopRef runLoop = CFRunLoopGetCurrent();
+
+    CFRunLoopAddSource(runLoop, _PACWorkerSource, kCFRunLoopDefaultMode);
+
+    // Publish the run loop, so queued jobs can wake it up.  Jobs queued before
+    // this leave the source signalled, so they're picked up straight away.
+    __CFSpinLock(&_PACWorkerLock);
+    _PACWorkerRunLoop = (CFRunLoopRef)CFRetain(runLoop);
+    __CFSpinUnlock(&_PACWorkerLock);
+
+    CFRunLoopRun();
+
+    return NULL;
+}
+
+
+static void
+_PACWorkerPerform(void *info) {
+    while (TRUE) {
+        _PACJob *job = NULL;
+
+        __CFSpinLock(&_PACWorkerLock);
+        if (CFArrayGetCount(_PACWorkerJobs)) {
+            job = (_PACJob *)CFArrayGetValueAtIndex(_PACWorkerJobs, 0);
+            CFArrayRemoveValueAtIndex(_PACWorkerJobs, 0);
+        }
+        __CFSpinUnlock(&_PACWorkerLock);
+
+        if (!job)
+            break;
+
+        _PACJobEvaluate(job);
+        _PACJobRelease(job);
     }
 }
 
-static void proxyStreamCallback(CFReadStreamRef proxyStream, CFStreamEventType type, void *clientCallBackInfo) {
-    _PACStreamContext *ctxt = (_PACStreamContext *)clientCallBackInfo;
+
+static void
+_PACWorkerQueue(_PACJob *job) {
+    CFRunLoopRef runLoop;
+
+    _CFDoOnce(&_PACWorkerOnce, _PACWorkerStart);
+
+    if (!_PACWorkerSource) {
+        _PACJobEvaluate(job);
+        return;
+    }
+
+    // The worker holds the job until it's been evaluated.
+    __CFSpinLock(&job->lock);
+    job->refs++;
+    __CFSpinUnlock(&job->lock);
+
+    __CFSpinLock(&_PACWorkerLock);
+    CFArrayAppendValue(_PACWorkerJobs, job);
+    runLoop = _PACWorkerRunLoop;
+    __CFSpinUnlock(&_PACWorkerLock);
+
+    CFRunLoopSourceSignal(_PACWorkerSource);
+    if (runLoop)
+        CFRunLoopWakeUp(runLoop);
+}
+
+
+static void
+_PACJobRelease(_PACJob *job) {
+    CFAllocatorRef alloc = job->alloc;
+    Boolean last;
+
+    __CFSpinLock(&job->lock);
+    last = (--job->refs == 0);
+    __CFSpinUnlock(&job->lock);
+
+    if (!last)
+        return;
+
+    if (job->source) {
+        CFRunLoopSourceInvalidate(job->source);
+        CFRelease(job->source);
+    }
+    if (job->schedules) CFRelease(job->schedules);
+    if (job->result) CFRelease(job->result);
+    CFRelease(job->pacURL);
+    CFRelease(job->targetURL);
+    CFRelease(job->targetScheme);
+    CFRelease(job->targetHost);
+    CFAllocatorDeallocate(alloc, job);
+    if (alloc) CFRelease(alloc);
+}
+
+
+static void
+_PACJobEvaluate(_PACJob *job) {
+    CFStringRef result = NULL;
+    CFArrayRef schedules = NULL;
+    Boolean abandoned;
+    CFIndex i;
+
+    __CFSpinLock(&job->lock);
+    abandoned = (job->stream == NULL);
+    __CFSpinUnlock(&job->lock);
+
+    // Nobody is waiting on the answer once the proxy stream is gone.
+    if (!abandoned)
+        result = _JSFindProxyForURL(job->pacURL, job->targetURL, job->targetHost);
+
+    __CFSpinLock(&job->lock);
+    job->result = result;
+    job->complete = TRUE;
+    if (job->stream) {
+        CFRunLoopSourceSignal(job->source);
+        schedules = CFArrayCreateCopy(kCFAllocatorDefault, job->schedules);
+    }
+    __CFSpinUnlock(&job->lock);
+
+    // Wake the caller's run loops so the proxy stream can end.
+    if (schedules) {
+        for (i = 0; i + 1 < CFArrayGetCount(schedules); i += 2)
+            CFRunLoopWakeUp((CFRunLoopRef)CFArrayGetValueAtIndex(schedules, i));
+        CFRelease(schedules);
+    }
+}
+
+
+static void
+_PACJobPerform(_PACJob *job) {
+    CFReadStreamRef stream;
+
+    __CFSpinLock(&job->lock);
+    stream = job->complete ? job->stream : NULL;
+    __CFSpinUnlock(&job->lock);
+
+    // Runs on the caller's run loop, where it's safe to end the proxy stream.
+    if (stream)
+        CFReadStreamSignalEvent(stream, kCFStreamEventEndEncountered, NULL);
+}
+
+
+static void
+_PACJobStreamCallBack(CFReadStreamRef stream, CFStreamEventType type, _PACJob *job) {
     switch (type) {
-    case kCFStreamEventHasBytesAvailable: 
-        readBytesFromProxyStream(proxyStream, ctxt);
-        break;
     case kCFStreamEventEndEncountered:
     case kCFStreamEventErrorOccurred:
-        ctxt->cb(proxyStream, ctxt->clientInfo);
+        job->cb(stream, job->clientInfo);
         break;
     default:
         ;
@@ -2209,38 +2581,180 @@ static void proxyStreamCallback(CFReadStreamRef proxyStream, CFStreamEventType t
 }
 
 
-static CFReadStreamRef BuildStreamForPACURL(CFAllocatorRef alloc, CFURLRef pacURL, CFURLRef targetURL, CFStringRef targetScheme, CFStringRef targetHost, _CFProxyStreamCallBack callback, void *clientInfo) {
-    Boolean isFile;
-    CFReadStreamRef stream = _streamForPACFile(alloc, pacURL, &isFile);
-    if (stream) {
-        _PACStreamContext *pacContext = CFAllocatorAllocate(alloc, sizeof(_PACStreamContext), 0);
-        CFRetain(pacURL);
-        pacContext->pacURL = pacURL;
-        CFRetain(targetURL);
-        pacContext->targetURL = targetURL;
-        CFRetain(targetScheme);
-        pacContext->targetScheme = targetScheme;
-        CFRetain(targetHost);
-        pacContext->targetHost = targetHost;
-        
-        pacContext->data = CFDataCreateMutable(alloc, 0);
-        pacContext->clientInfo = clientInfo;
-        pacContext->cb = callback;
-
-        CFStreamClientContext streamContext;
-        streamContext.version = 0;
-        streamContext.info = pacContext;
-        streamContext.retain = NULL;
-        streamContext.release = releasePACStreamContext;
-        streamContext.copyDescription = NULL;
-        
-        CFReadStreamSetClient(stream, kCFStreamEventHasBytesAvailable | kCFStreamEventErrorOccurred | kCFStreamEventEndEncountered, proxyStreamCallback, &streamContext);
-        CFReadStreamOpen(stream);
+static Boolean
+_PACJobStreamOpen(CFReadStreamRef stream, CFStreamError *error, Boolean *openComplete, _PACJob *job) {
+    _PACWorkerQueue(job);
+    *openComplete = TRUE;
+    return TRUE;
+}
+
+
+static CFIndex
+_PACJobStreamRead(CFReadStreamRef stream, UInt8 *buffer, CFIndex bufferLength, CFStreamError *error, Boolean *atEOF, _PACJob *job) {
+    // The proxy stream carries no bytes; it just ends once the job is evaluated.
+    __CFSpinLock(&job->lock);
+    *atEOF = job->complete;
+    __CFSpinUnlock(&job->lock);
+    return 0;
+}
+
+
+static Boolean
+_PACJobStreamCanRead(CFReadStreamRef stream, _PACJob *job) {
+    Boolean result;
+
+    __CFSpinLock(&job->lock);
+    result = job->complete;
+    __CFSpinUnlock(&job->lock);
+    return result;
+}
+
+
+static void
+_PACJobStreamSchedule(CFReadStreamRef stream, CFRunLoopRef runLoop, CFStringRef runLoopMode, _PACJob *job) {
+    Boolean added;
+
+    __CFSpinLock(&job->lock);
+    added = _SchedulesAddRunLoopAndMode(job->schedules, runLoop, runLoopMode);
+    __CFSpinUnlock(&job->lock);
+
+    if (added)
+        CFRunLoopAddSource(runLoop, job->source, runLoopMode);
+}
+
+
+static void
+_PACJobStreamUnschedule(CFReadStreamRef stream, CFRunLoopRef runLoop, CFStringRef runLoopMode, _PACJob *job) {
+    Boolean removed;
+
+    __CFSpinLock(&job->lock);
+    removed = _SchedulesRemoveRunLoopAndMode(job->schedules, runLoop, runLoopMode);
+    __CFSpinUnlock(&job->lock);
+
+    if (removed)
+        CFRunLoopRemoveSource(runLoop, job->source, runLoopMode);
+}
+
+
+static void
+_PACJobStreamFinalize(CFReadStreamRef stream, _PACJob *job) {
+    __CFSpinLock(&job->lock);
+    job->stream = NULL;
+    __CFSpinUnlock(&job->lock);
+
+    CFRunLoopSourceInvalidate(job->source);
+    _PACJobRelease(job);
+}
+
+
+static CFReadStreamRef
+_PACJobCreateStream(CFAllocatorRef alloc, CFURLRef pacURL, CFURLRef targetURL, CFStringRef targetScheme, CFStringRef targetHost, _CFProxyStreamCallBack callback, void *clientInfo) {
+    CFRunLoopSourceContext sourceContext = {0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, (void (*)(void *))_PACJobPerform};
+    CFStreamClientContext streamContext = {0, NULL, NULL, NULL, NULL};
+    CFReadStreamCallBacks callBacks;
+    CFReadStreamRef stream = NULL;
+    _PACJob *job = CFAllocatorAllocate(alloc, sizeof(job[0]), 0);
+
+    if (!job)
+        return NULL;
+
+    memset(job, 0, sizeof(job[0]));
+    CF_SPINLOCK_INIT_FOR_STRUCTS(job->lock);
+
+    job->refs = 1;
+    job->alloc = alloc ? CFRetain(alloc) : NULL;
+    job->pacURL = CFRetain(pacURL);
+    job->targetURL = CFRetain(targetURL);
+    job->targetScheme = CFRetain(targetScheme);
+    job->targetHost = CFRetain(targetHost);
+    job->cb = callback;
+    job->clientInfo = clientInfo;
+
+    sourceContext.info = job;
+    job->source = CFRunLoopSourceCreate(alloc, 0, &sourceContext);
+    job->schedules = CFArrayCreateMutable(alloc, 0, &kCFTypeArrayCallBacks);
+
+    if (job->source && job->schedules) {
+        memset(&callBacks, 0, sizeof(callBacks));
+
+        callBacks.version = 1;
+        callBacks.finalize = (void (*)(CFReadStreamRef, void*))_PACJobStreamFinalize;
+        callBacks.open = (Boolean (*)(CFReadStreamRef, CFStreamError*, Boolean*, void*))_PACJobStreamOpen;
+        callBacks.read = (CFIndex (*)(CFReadStreamRef, UInt8*, CFIndex, CFStreamError*, Boolean*, void*))_PACJobStreamRead;
+        callBacks.canRead = (Boolean (*)(CFReadStreamRef, void*))_PACJobStreamCanRead;
+        callBacks.schedule = (void (*)(CFReadStreamRef, CFRunLoopRef, CFStringRef, void*))_PACJobStreamSchedule;
+        callBacks.unschedule = (void (*)(CFReadStreamRef, CFRunLoopRef, CFStringRef, void*))_PACJobStreamUnschedule;
+
+        stream = CFReadStreamCreate(alloc, &callBacks, job);
+    }
+
+    if (!stream) {
+        _PACJobRelease(job);
+        return NULL;
     }
+
+    // The stream now holds the job's reference.
+    job->stream = stream;
+
+    streamContext.info = job;
+    CFReadStreamSetClient(stream, kCFStreamEventErrorOccurred | kCFStreamEventEndEncountered, (CFReadStreamClientCallBack)_PACJobStreamCallBack, &streamContext);
+    CFReadStreamOpen(stream);
+
     return stream;
 }
+#endif /* defined(__MACH__) */
+
+#if defined(__MACH__)
+CFMutableArrayRef _CFNetworkCopyProxyFromProxyStream(CFReadStreamRef proxyStream, Boolean *isComplete) {
+    _PACJob *job = (_PACJob *)CFReadStreamGetInfoPointer(proxyStream);
+    CFStringRef pacResult = NULL;
+    Boolean complete;
+
+    __CFSpinLock(&job->lock);
+    complete = job->complete;
+    if (job->result)
+        pacResult = CFRetain(job->result);
+    __CFSpinUnlock(&job->lock);
+
+    if (complete) {
+        CFMutableArrayRef result = CFArrayCreateMutable(job->alloc, 0, &kCFTypeArrayCallBacks);
+        *isComplete = TRUE;
+        _appendProxiesFromPACResponse(job->alloc, result, pacResult, job->targetScheme);
+        if (pacResult) CFRelease(pacResult);
+        CFReadStreamClose(proxyStream);
+        return result;
+    } else if (CFReadStreamGetStatus(proxyStream) == kCFStreamStatusError) {
+        CFMutableArrayRef result = CFArrayCreateMutable(CFGetAllocator(proxyStream), 0, &kCFTypeArrayCallBacks);
+        CFArrayAppendValue(result, kCFNull);
+        *isComplete = TRUE;
+        return result;
+    } else {
+        *isComplete = FALSE;
+        return NULL;
+    }
+}
+#elif defined(__WIN32__)
+#define BUF_SIZE 4096
+
+typedef struct {
+    CFURLRef pacURL;
+    CFURLRef targetURL;
+    CFStringRef targetScheme;
+    CFStringRef targetHost;
+    
+    CFMutableDataRef data;
+    void *clientInfo;
+    _CFProxyStreamCallBack cb;
+} _PACStreamContext;
+
+static void readBytesFromProxyStream(CFReadStreamRef proxyStream, _PACStreamContext *ctxt) {
+    UInt8 buf[BUF_SIZE];
+    CFIndex bytesRead = CFReadStreamRead(proxyStream, buf, BUF_SIZE);
+    if (bytesRead > 0) {
+        CFDataAppendBytes(ctxt->data, buf, bytesRead);
+    }
+}
 
-#if defined(__MACH__) || defined(__WIN32__)
 CFMutableArrayRef _CFNetworkCopyProxyFromProxyStream(CFReadStreamRef proxyStream, Boolean *isComplete) {
     CFStreamStatus status = CFReadStreamGetStatus(proxyStream);
     if (status == kCFStreamStatusOpen && CFReadStreamHasBytesAvailable(proxyStream)) {
@@ -27,6 +27,7 @@
 
 #include "CFNetworkInternal.h"
 #include "CFNetConnection.h"
+#include "CFNetworkSchedule.h"
 #include <CFNetwork/CFNetworkPriv.h> 
 #include <sys/types.h>
 
@@ -59,8 +60,30 @@ struct __CFNetConnectionCacheKey {
     CFDictionaryRef properties;
 };
 
+/*
+** The cache is a pool of connections per key.  Each key maps to the
+** array of connections open to that host, no more than maxPerHost of
+** them, and no more than maxTotal across all hosts.  Connections whose
+** queues have drained are checked back in to the idle list, least
+** recently used first, where they wait to be reused until they are
+** evicted to make room for another host or reaped by the idle timer.
+** When the pool is full and nothing is idle, a new host's connection
+** takes the place of the busy one with the shortest queue, which is
+** retired: it takes no new requests and closes once its responses
+** have arrived.  The reaper runs on one of the library's I/O run loops,
+** so it does not depend on whichever thread first checked a
+** connection in.
+*/
 struct __CFNetConnectionCache {
-    CFMutableDictionaryRef dictionary;
+    CFMutableDictionaryRef dictionary;      // key -> CFMutableArray of connections
+    CFMutableDictionaryRef keys;            // connection -> key, for eviction
+    CFMutableArrayRef idle;                 // checked-in connections, least recently used first
+    CFIndex maxPerHost;                     // <= 0 for no limit
+    CFIndex maxTotal;                       // <= 0 for no limit
+    CFTimeInterval idleTimeout;             // <= 0 to close connections as soon as they are checked in
+    CFRunLoopTimerRef reaper;
+    CFRunLoopRef reaperRunLoop;             // I/O run loop the reaper is scheduled on, if any
+    _CFNetConnectionCacheStatistics stats;
     CFSpinLock_t connectionCacheLock;
 };
 
@@ -156,6 +179,11 @@ void getValuesFromKey(const _CFNetConnectionCacheKey theKey, CFStringRef *host,
     *properties = key->properties;
 }
 
+// Far enough out that the reaper will not fire until something is checked in
+#define kConnectionCacheReaperDistantFuture (1.0e10)
+
+static void connectionCacheReaperCallBack(CFRunLoopTimerRef timer, void *info);
+
 // strange behavior in PB: this is declared in header so remove when not needed
 CFNetConnectionCacheRef createConnectionCache(void);
 
@@ -164,14 +192,22 @@ CFNetConnectionCacheRef createConnectionCache(void)
     CFNetConnectionCacheRef conn_cache = malloc(sizeof(struct __CFNetConnectionCache));
  
     if (conn_cache) {
-        CFMutableDictionaryRef dictionary;
         CFDictionaryKeyCallBacks connectionCacheCallBacks = {0, connCacheKeyRetain, connCacheKeyRelease, connCacheKeyCopyDesc, connCacheKeyEqual, connCacheKeyHash};
+        CFDictionaryValueCallBacks connectionKeyCallBacks = {0, connCacheKeyRetain, connCacheKeyRelease, connCacheKeyCopyDesc, connCacheKeyEqual};
         
-        dictionary = CFDictionaryCreateMutable(NULL, 0, &connectionCacheCallBacks, &kCFTypeDictionaryValueCallBacks);
-        if (dictionary) {
-            conn_cache->dictionary = dictionary;
+        memset(conn_cache, 0, sizeof(conn_cache[0]));
+        conn_cache->dictionary = CFDictionaryCreateMutable(NULL, 0, &connectionCacheCallBacks, &kCFTypeDictionaryValueCallBacks);
+        conn_cache->keys = CFDictionaryCreateMutable(NULL, 0, NULL, &connectionKeyCallBacks);
+        conn_cache->idle = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+        if (conn_cache->dictionary && conn_cache->keys && conn_cache->idle) {
+            // Until the owner says otherwise, behave as the cache always has: one
+            // connection per host, dropped as soon as it is checked in.
+            conn_cache->maxPerHost = 1;
 			CF_SPINLOCK_INIT_FOR_STRUCTS(conn_cache->connectionCacheLock);
         } else {
+            if (conn_cache->dictionary) CFRelease(conn_cache->dictionary);
+            if (conn_cache->keys) CFRelease(conn_cache->keys);
+            if (conn_cache->idle) CFRelease(conn_cache->idle);
             free(conn_cache);
             conn_cache = NULL;
         }
@@ -183,6 +219,15 @@ CFNetConnectionCacheRef createConnectionCache(void)
 void releaseConnectionCache(CFNetConnectionCacheRef cache)
 {
     if (cache) {
+        if (cache->reaper) {
+            CFRunLoopTimerInvalidate(cache->reaper);
+            CFRelease(cache->reaper);
+        }
+        if (cache->reaperRunLoop) {
+            _CFNetworkIORunLoopRelinquish(cache->reaperRunLoop);
+        }
+        CFRelease(cache->idle);
+        CFRelease(cache->keys);
         CFRelease(cache->dictionary);
         free(cache);
     }
@@ -199,6 +244,205 @@ void unlockConnectionCache(CFNetConnectionCacheRef cache)
     __CFSpinUnlock(&cache->connectionCacheLock);
 }
 
+void setConnectionCacheLimits(CFNetConnectionCacheRef cache, CFIndex maxPerHost, CFIndex maxTotal, CFTimeInterval idleTimeout)
+{
+    lockConnectionCache(cache);
+    cache->maxPerHost = maxPerHost;
+    cache->maxTotal = maxTotal;
+    cache->idleTimeout = idleTimeout;
+    unlockConnectionCache(cache);
+}
+
+void getConnectionCacheStatistics(CFNetConnectionCacheRef cache, _CFNetConnectionCacheStatistics *stats)
+{
+    lockConnectionCache(cache);
+    *stats = cache->stats;
+    unlockConnectionCache(cache);
+}
+
+// Whether a connection the pool is holding can take another request.  A
+// connection whose server has hung up is caught here if its response stream
+// noticed; otherwise the request will be reattempted on a new connection.
+// The cache must not be locked, since asking a stream its status may take
+// the stream's own locks.
+static Boolean connectionIsReusable(_CFNetConnectionRef conn) {
+    CFReadStreamRef responseStream;
+    CFStreamStatus status;
+    
+    if (!_CFNetConnectionWillEnqueueRequests(conn)) {
+        return FALSE;
+    }
+    responseStream = _CFNetConnectionGetResponseStream(conn);
+    if (!responseStream) {
+        return TRUE;
+    }
+    status = CFReadStreamGetStatus(responseStream);
+    return (status != kCFStreamStatusAtEnd && status != kCFStreamStatusClosed && status != kCFStreamStatusError);
+}
+
+// Drops conn from the pool.  The cache must be locked, and the caller must
+// hold its own reference to conn, since the pool's may be the last.
+static void connectionCacheRemove(CFNetConnectionCacheRef cache, _CFNetConnectionRef conn) {
+    _CFNetConnectionCacheKey key = (_CFNetConnectionCacheKey)CFDictionaryGetValue(cache->keys, conn);
+    CFMutableArrayRef conns;
+    CFIndex index;
+    
+    if (!key) {
+        return;
+    }
+    conns = (CFMutableArrayRef)CFDictionaryGetValue(cache->dictionary, key);
+    if (conns) {
+        index = CFArrayGetFirstIndexOfValue(conns, CFRangeMake(0, CFArrayGetCount(conns)), conn);
+        if (index != kCFNotFound) {
+            CFArrayRemoveValueAtIndex(conns, index);
+        }
+        if (CFArrayGetCount(conns) == 0) {
+            CFDictionaryRemoveValue(cache->dictionary, key);
+        }
+    }
+    index = CFArrayGetFirstIndexOfValue(cache->idle, CFRangeMake(0, CFArrayGetCount(cache->idle)), conn);
+    if (index != kCFNotFound) {
+        CFArrayRemoveValueAtIndex(cache->idle, index);
+    }
+    // Last, since key belongs to this entry
+    CFDictionaryRemoveValue(cache->keys, conn);
+}
+
+// Moves an idle connection from the pool to closed, for the caller to shut
+// down once the cache is unlocked.  The cache must be locked.
+static void connectionCacheEvict(CFNetConnectionCacheRef cache, CFIndex idleIndex, CFMutableArrayRef closed) {
+    _CFNetConnectionRef conn = (_CFNetConnectionRef)CFArrayGetValueAtIndex(cache->idle, idleIndex);
+    
+    CFArrayAppendValue(closed, conn);
+    connectionCacheRemove(cache, conn);
+    cache->stats.evictions++;
+}
+
+// Picks the connection with the shortest queue to retire when the pool is
+// full and nothing is idle.  The cache must be locked.
+static _CFNetConnectionRef connectionCacheFindRetiree(CFNetConnectionCacheRef cache) {
+    CFIndex index, count = CFDictionaryGetCount(cache->keys);
+    _CFNetConnectionRef result = NULL;
+    int depth, shallowest = 0;
+    const void **conns;
+    
+    if (!count) {
+        return NULL;
+    }
+    conns = malloc(count * sizeof(conns[0]));
+    if (!conns) {
+        return NULL;
+    }
+    CFDictionaryGetKeysAndValues(cache->keys, conns, NULL);
+    for (index = 0; index < count; index++) {
+        _CFNetConnectionRef candidate = (_CFNetConnectionRef)conns[index];
+        depth = _CFNetConnectionGetQueueDepth(candidate);
+        if (!result || depth < shallowest) {
+            result = candidate;
+            shallowest = depth;
+        }
+    }
+    free(conns);
+    return result;
+}
+
+// Evicts every idle connection whose timeout has passed, and returns the time
+// at which the next one will expire.  The cache must be locked.
+static CFAbsoluteTime connectionCacheReap(CFNetConnectionCacheRef cache, CFAbsoluteTime now, CFMutableArrayRef closed) {
+    CFAbsoluteTime next = now + kConnectionCacheReaperDistantFuture;
+    CFIndex index = CFArrayGetCount(cache->idle);
+    
+    while (index-- > 0) {
+        _CFNetConnectionRef conn = (_CFNetConnectionRef)CFArrayGetValueAtIndex(cache->idle, index);
+        CFAbsoluteTime expiration = _CFNetConnectionGetLastAccessTime(conn) + cache->idleTimeout;
+        
+        if (expiration <= now) {
+            connectionCacheEvict(cache, index, closed);
+        } else if (expiration < next) {
+            next = expiration;
+        }
+    }
+    return next;
+}
+
+// Evicts every idle connection that can no longer be reused.  The idle list is
+// copied under the lock and the streams are asked their status without it, so
+// the cache must not be locked.
+static void connectionCachePrune(CFNetConnectionCacheRef cache, CFMutableArrayRef closed) {
+    CFArrayRef idle;
+    CFIndex index, count;
+    
+    lockConnectionCache(cache);
+    idle = CFArrayCreateCopy(NULL, cache->idle);
+    unlockConnectionCache(cache);
+    
+    if (!idle) {
+        return;
+    }
+    count = CFArrayGetCount(idle);
+    for (index = 0; index < count; index++) {
+        _CFNetConnectionRef conn = (_CFNetConnectionRef)CFArrayGetValueAtIndex(idle, index);
+        
+        if (!connectionIsReusable(conn)) {
+            CFIndex idleIndex;
+            
+            // It may have been taken or evicted meanwhile
+            lockConnectionCache(cache);
+            idleIndex = CFArrayGetFirstIndexOfValue(cache->idle, CFRangeMake(0, CFArrayGetCount(cache->idle)), conn);
+            if (idleIndex != kCFNotFound) {
+                connectionCacheEvict(cache, idleIndex, closed);
+            }
+            unlockConnectionCache(cache);
+        }
+    }
+    CFRelease(idle);
+}
+
+// Shuts down the connections a reap or eviction took out of the pool.  The
+// cache must not be locked; releasing the last reference closes the streams.
+static void connectionCacheClose(CFMutableArrayRef closed) {
+    CFIndex index, count = CFArrayGetCount(closed);
+    
+    for (index = 0; index < count; index++) {
+        _CFNetConnectionSetAllowsNewRequests((_CFNetConnectionRef)CFArrayGetValueAtIndex(closed, index), FALSE);
+    }
+    CFRelease(closed);
+}
+
+static void connectionCacheReaperCallBack(CFRunLoopTimerRef timer, void *info) {
+    CFNetConnectionCacheRef cache = (CFNetConnectionCacheRef)info;
+    CFMutableArrayRef closed = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    CFAbsoluteTime next;
+    
+    connectionCachePrune(cache, closed);
+    
+    lockConnectionCache(cache);
+    next = connectionCacheReap(cache, CFAbsoluteTimeGetCurrent(), closed);
+    CFRunLoopTimerSetNextFireDate(timer, next);
+    unlockConnectionCache(cache);
+    
+    connectionCacheClose(closed);
+}
+
+// Arms the reaper for the idle connection checked in most recently.  The timer
+// is scheduled on one of the library's I/O run loops, which always run; only
+// if none can be started does it fall back on the run loop of the thread
+// checking the connection in.  Idle connections are also reaped whenever a
+// connection is found or checked in.  The cache must be locked.
+static void connectionCacheScheduleReaper(CFNetConnectionCacheRef cache, CFAbsoluteTime fireDate) {
+    if (!cache->reaper) {
+        CFRunLoopTimerContext ctxt = {0, cache, NULL, NULL, NULL};
+        
+        cache->reaper = CFRunLoopTimerCreate(NULL, fireDate, kConnectionCacheReaperDistantFuture, 0, 0, connectionCacheReaperCallBack, &ctxt);
+        if (cache->reaper) {
+            cache->reaperRunLoop = _CFNetworkIORunLoopAcquire();
+            CFRunLoopAddTimer(cache->reaperRunLoop ? cache->reaperRunLoop : CFRunLoopGetCurrent(), cache->reaper, kCFRunLoopCommonModes);
+        }
+    } else if (fireDate < CFRunLoopTimerGetNextFireDate(cache->reaper)) {
+        CFRunLoopTimerSetNextFireDate(cache->reaper, fireDate);
+    }
+}
+
 _CFNetConnectionRef findOrCreateNetConnection(CFNetConnectionCacheRef connectionCache, CFAllocatorRef allocator, const _CFNetConnectionCallBacks *callbacks, const void *info, _CFNetConnectionCacheKey key, Boolean persistent, CFDictionaryRef connectionProperties)
 {
     _CFNetConnectionRef conn = NULL;
@@ -212,27 +456,107 @@ _CFNetConnectionRef findOrCreateNetConnection(CFNetConnectionCacheRef connection
             created = TRUE;
         }
     } else {
+        CFMutableArrayRef closed = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+        CFMutableArrayRef conns;
+        CFIndex index;
+        
+        connectionCachePrune(connectionCache, closed);
+        
         lockConnectionCache(connectionCache);
         
-        conn = (_CFNetConnectionRef)CFDictionaryGetValue(connectionCache->dictionary, key);
-        if (conn) {
-            if (!_CFNetConnectionWillEnqueueRequests(conn)) {
-                conn = NULL;
-                CFDictionaryRemoveValue(connectionCache->dictionary, key);
-            } else {
-                created = FALSE;
+        connectionCacheReap(connectionCache, CFAbsoluteTimeGetCurrent(), closed);
+        
+        // Prune connections to this host that have stopped taking requests
+        conns = (CFMutableArrayRef)CFDictionaryGetValue(connectionCache->dictionary, key);
+        count = conns ? CFArrayGetCount(conns) : 0;
+        for (index = count - 1; index >= 0; index--) {
+            _CFNetConnectionRef candidate = (_CFNetConnectionRef)CFArrayGetValueAtIndex(conns, index);
+            if (!_CFNetConnectionWillEnqueueRequests(candidate)) {
+                CFArrayAppendValue(closed, candidate);
+                connectionCacheRemove(connectionCache, candidate);
+            }
+        }
+        conns = (CFMutableArrayRef)CFDictionaryGetValue(connectionCache->dictionary, key);
+        count = conns ? CFArrayGetCount(conns) : 0;
+        
+        // Most recently used idle connection to this host
+        for (index = CFArrayGetCount(connectionCache->idle) - 1; index >= 0 && !conn; index--) {
+            _CFNetConnectionRef candidate = (_CFNetConnectionRef)CFArrayGetValueAtIndex(connectionCache->idle, index);
+            if (count && CFArrayContainsValue(conns, CFRangeMake(0, count), candidate)) {
+                conn = candidate;
                 CFRetain(conn);
+                CFArrayRemoveValueAtIndex(connectionCache->idle, index);
             }
-        } 
-        if (!conn) {
-            conn = _CFNetConnectionCreate(allocator, info, callbacks, TRUE);
-            if (conn) {
-                created = TRUE;
-                _CFNetConnectionSetAllowsNewRequests(conn, TRUE);
-                CFDictionarySetValue(connectionCache->dictionary, key, conn);
+        }
+        
+        // Failing that, one that drained without being checked in
+        for (index = 0; index < count && !conn; index++) {
+            _CFNetConnectionRef candidate = (_CFNetConnectionRef)CFArrayGetValueAtIndex(conns, index);
+            if (_CFNetConnectionIsEmpty(candidate)) {
+                conn = candidate;
+                CFRetain(conn);
+            }
+        }
+        
+        if (conn) {
+            connectionCache->stats.hits++;
+        } else if (connectionCache->maxPerHost <= 0 || count < connectionCache->maxPerHost) {
+            
+            // Make room under the global limit, oldest idle connection first.
+            // Failing that, a host with no connection at all retires another
+            // host's; one that has connections waits on them below instead.
+            if (connectionCache->maxTotal > 0) {
+                while (CFDictionaryGetCount(connectionCache->keys) >= connectionCache->maxTotal) {
+                    if (CFArrayGetCount(connectionCache->idle)) {
+                        connectionCacheEvict(connectionCache, 0, closed);
+                    } else {
+                        _CFNetConnectionRef retiree = count ? NULL : connectionCacheFindRetiree(connectionCache);
+                        if (!retiree) {
+                            break;
+                        }
+                        CFArrayAppendValue(closed, retiree);
+                        connectionCacheRemove(connectionCache, retiree);
+                        connectionCache->stats.evictions++;
+                    }
+                }
+            }
+            
+            if (connectionCache->maxTotal <= 0 || CFDictionaryGetCount(connectionCache->keys) < connectionCache->maxTotal) {
+                conn = _CFNetConnectionCreate(allocator, info, callbacks, TRUE);
+                if (conn) {
+                    created = TRUE;
+                    _CFNetConnectionSetAllowsNewRequests(conn, TRUE);
+                    if (!conns) {
+                        conns = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+                        CFDictionarySetValue(connectionCache->dictionary, key, conns);
+                        CFRelease(conns);
+                    }
+                    CFArrayAppendValue(conns, conn);
+                    CFDictionarySetValue(connectionCache->keys, conn, key);
+                    connectionCache->stats.misses++;
+                }
+            }
+        }
+        
+        if (!conn && count) {
+            // The pool is full; wait in line on the connection to this host with
+            // the shortest queue.  Requests are served in the order they queue.
+            int depth, shallowest = 0;
+            for (index = 0; index < count; index++) {
+                _CFNetConnectionRef candidate = (_CFNetConnectionRef)CFArrayGetValueAtIndex(conns, index);
+                depth = _CFNetConnectionGetQueueDepth(candidate);
+                if (!conn || depth < shallowest) {
+                    conn = candidate;
+                    shallowest = depth;
+                }
             }
+            CFRetain(conn);
+            connectionCache->stats.waits++;
         }
+        
         unlockConnectionCache(connectionCache);
+        
+        connectionCacheClose(closed);
     }
     if (created && (count = CFDictionaryGetCount(connectionProperties)) > 0) {
         CFStringRef *keys = CFAllocatorAllocate(allocator, sizeof(CFStringRef)*count*2, 0);
@@ -249,19 +573,43 @@ _CFNetConnectionRef findOrCreateNetConnection(CFNetConnectionCacheRef connection
     return conn;
 }
 
-void removeFromConnectionCache(CFNetConnectionCacheRef cache, _CFNetConnectionRef conn, _CFNetConnectionCacheKey key) {
-    _CFNetConnectionRef cachedConn;
+void checkInToConnectionCache(CFNetConnectionCacheRef cache, _CFNetConnectionRef conn, _CFNetConnectionCacheKey key) {
+    CFMutableArrayRef closed = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    
+    (void)key;	/* The pool remembers the key each connection was created for */
+    
     lockConnectionCache(cache);
-    cachedConn = (_CFNetConnectionRef)CFDictionaryGetValue(cache->dictionary, key);
-    if (cachedConn && cachedConn == conn) {
-        CFDictionaryRemoveValue(cache->dictionary, key);
+    if (CFDictionaryContainsKey(cache->keys, conn) &&
+        !CFArrayContainsValue(cache->idle, CFRangeMake(0, CFArrayGetCount(cache->idle)), conn))
+    {
+        if (cache->idleTimeout <= 0) {
+            CFArrayAppendValue(closed, conn);
+            connectionCacheRemove(cache, conn);
+        } else {
+            CFArrayAppendValue(cache->idle, conn);
+            connectionCacheScheduleReaper(cache, connectionCacheReap(cache, now, closed));
+        }
     }
     unlockConnectionCache(cache);
+    
+    connectionCachePrune(cache, closed);
+    connectionCacheClose(closed);
+}
+
+void removeFromConnectionCache(CFNetConnectionCacheRef cache, _CFNetConnectionRef conn, _CFNetConnectionCacheKey key) {
+    (void)key;	/* The pool remembers the key each connection was created for */
+    
+    lockConnectionCache(cache);
+    connectionCacheRemove(cache, conn);
+    unlockConnectionCache(cache);
 }
 
 // for mark & sweep algorithms around callouts, where we're worried about the client removing itself (and possibly others) from the queue while we're walking it.  See sendStateChanged for an example.
 #define MARKED_REQUEST (0)
 #define IS_ZOMBIE_REQUEST (1)
+// Set at enqueue time for requests that must not share the wire with others (e.g. non-idempotent HTTP methods)
+#define UNPIPELINABLE_REQUEST (2)
 
 typedef struct _CFNetRequest {
     struct _CFNetRequest *next;
@@ -295,6 +643,7 @@ typedef struct {
     _CFMutex lock;
     
 	UInt32	count;
+    CFIndex maxPipelineDepth; // Most requests awaiting responses while pipelining; 0 for no limit
 	
     _CFNetRequest *head;
     _CFNetRequest *tail;
@@ -305,6 +654,7 @@ typedef struct {
     CFReadStreamRef responseStream;
 
     CFAbsoluteTime emptyTime; // The time at which this connection's queue was completely emptied
+    UInt32 transmitted; // Requests which have started transmitting on this connection
 //    int numRequests;
     
     const _CFNetConnectionCallBacks *cb;
@@ -580,6 +930,8 @@ _CFNetConnectionCreate(CFAllocatorRef alloc, const void *info, const _CFNetConne
     connection->emptyTime = CFAbsoluteTimeGetCurrent();
 	
 	connection->count = 0;
+    connection->maxPipelineDepth = 0;
+    connection->transmitted = 0;
 	
     connection->head = NULL;
     connection->tail = NULL;
@@ -618,6 +970,28 @@ _CFNetConnectionCreate(CFAllocatorRef alloc, const void *info, const _CFNetConne
     return (_CFNetConnectionRef)connection;
 }
 
+/* Call from within a lock to decide whether req, the current request, may start transmitting now.
+Nothing stands in the way of a request whose predecessors have all been answered.  Otherwise the
+connection must be pipelining, the pipeline must be below its depth limit, and neither req nor any
+request still awaiting its response may be one that refuses to share the wire. */
+static Boolean canTransmitRequest(__CFNetConnection *conn, _CFNetRequest *req) {
+    _CFNetRequest *outstanding;
+    CFIndex depth = 0;
+
+    for (outstanding = conn->currentResponse; outstanding && outstanding != req; outstanding = outstanding->next) {
+        if (__CFBitIsSet(outstanding->flags, UNPIPELINABLE_REQUEST)) {
+            return FALSE;
+        }
+        depth++;
+    }
+    if (depth == 0) {
+        return TRUE;
+    }
+    return (__CFBitIsSet(conn->flags, SHOULD_PIPELINE) &&
+            !__CFBitIsSet(req->flags, UNPIPELINABLE_REQUEST) &&
+            (conn->maxPipelineDepth <= 0 || depth < conn->maxPipelineDepth));
+}
+
 extern
 Boolean _CFNetConnectionEnqueue(_CFNetConnectionRef arg, void *req) {
 
@@ -638,6 +1012,9 @@ Boolean _CFNetConnectionEnqueue(_CFNetConnectionRef arg, void *req) {
         newReq->request = req;
         newReq->next = NULL;
         newReq->flags = 0;
+        if (conn->cb->version >= 1 && conn->cb->requestIsPipelinable && !conn->cb->requestIsPipelinable(req, (_CFNetConnectionRef)conn, conn->info)) {
+            __CFBitSet(newReq->flags, UNPIPELINABLE_REQUEST);
+        }
         addToList(&(conn->head), &(conn->tail), newReq);
         if (!conn->currentRequest) {
             conn->currentRequest = newReq;
@@ -649,7 +1026,9 @@ Boolean _CFNetConnectionEnqueue(_CFNetConnectionRef arg, void *req) {
 
         if (conn->currentRequest == conn->currentResponse || __CFBitIsSet(conn->flags, SHOULD_PIPELINE)) {
             if (conn->currentRequest == newReq) {
-                scheduleNewRequest(conn, conn->currentRequest, NULL, FALSE);
+                if (canTransmitRequest(conn, newReq)) {
+                    scheduleNewRequest(conn, conn->currentRequest, NULL, FALSE);
+                }
             } else if (conn->cb->runLoopAndModesArrayForRequest && conn->requestStream && nextRealRequest(conn->currentRequest) == newReq) {
                 rescheduleStream(conn->requestStream, NULL, conn->cb->runLoopAndModesArrayForRequest(newReq->request, (_CFNetConnectionRef)conn, conn->info));
                 if (__CFBitIsSet(conn->flags, TRANSMITTING_CURRENT_REQUEST)) {
@@ -823,6 +1202,7 @@ static void scheduleNewRequest(__CFNetConnection* conn, _CFNetRequest *newReques
     }
     if (newRequest) {
         __CFBitSet(conn->flags, TRANSMITTING_CURRENT_REQUEST);
+        conn->transmitted++;
         conn->cb->requestStateChanged(newRequest->request, kTransmittingRequest, NULL, (_CFNetConnectionRef)conn, conn->info);
     }
 }
@@ -870,6 +1250,7 @@ static void schedulePipelinedTransition(__CFNetConnection *conn, _CFNetRequest *
     }
     if (new) {
         __CFBitSet(conn->flags, TRANSMITTING_CURRENT_REQUEST);
+        conn->transmitted++;
         conn->cb->requestStateChanged(new->request, kTransmittingRequest, NULL, (_CFNetConnectionRef)conn, conn->info);
     }
 }
@@ -1072,6 +1453,19 @@ void* _CFNetConnectionGetCurrentRequest(_CFNetConnectionRef arg) {
     return result;
 }
 
+UInt32 _CFNetConnectionGetTransmittedCount(_CFNetConnectionRef arg) {
+    __CFNetConnection* conn = (__CFNetConnection*)arg;
+    UInt32 result;
+
+	_CFNetConnectionLock(conn);
+	
+	result = conn->transmitted;
+	
+	_CFNetConnectionUnlock(conn);
+	
+	return result;
+}
+
 int _CFNetConnectionGetQueueDepth(_CFNetConnectionRef arg) {
     __CFNetConnection* conn = (__CFNetConnection*)arg;
     int result;
@@ -1219,7 +1613,7 @@ void _CFNetConnectionSetShouldPipeline(_CFNetConnectionRef arg, Boolean shouldPi
 #endif
     if (shouldPipeline && !__CFBitIsSet(conn->flags, SHOULD_PIPELINE)) {
         __CFBitSet(conn->flags, SHOULD_PIPELINE);
-        if (conn->currentRequest && !__CFBitIsSet(conn->flags, TRANSMITTING_CURRENT_REQUEST)) {
+        if (conn->currentRequest && !__CFBitIsSet(conn->flags, TRANSMITTING_CURRENT_REQUEST) && canTransmitRequest(conn, conn->currentRequest)) {
             scheduleNewRequest(conn, conn->currentRequest, conn->currentResponse, FALSE);
         }
     }
@@ -1229,6 +1623,15 @@ void _CFNetConnectionSetShouldPipeline(_CFNetConnectionRef arg, Boolean shouldPi
 	_CFNetConnectionUnlock(conn);
 }
 
+void _CFNetConnectionSetMaxPipelineDepth(_CFNetConnectionRef arg, CFIndex maxDepth) {
+
+    __CFNetConnection* conn = (__CFNetConnection*)arg;
+
+	_CFNetConnectionLock(conn);
+    conn->maxPipelineDepth = maxDepth;
+	_CFNetConnectionUnlock(conn);
+}
+
 // Currently not used, so hand dead-stripping for now.
 //Boolean _CFNetConnectionIsPipelining(_CFNetConnectionRef arg) {
 //    __CFNetConnection* conn = (__CFNetConnection*)arg;
@@ -1294,6 +1697,13 @@ void _CFNetConnectionResponseIsComplete(_CFNetConnectionRef arg, void *req) {
             if (!didNonPipelinedTransition) {
                 scheduleNewResponse(conn, newResponse, oldResponse);
             }
+            if (conn->currentRequest && __CFBitIsSet(conn->flags, SHOULD_PIPELINE) &&
+                !__CFBitIsSet(conn->flags, TRANSMITTING_CURRENT_REQUEST) && !__CFBitIsSet(conn->flags, CONNECTION_LOST) &&
+                canTransmitRequest(conn, conn->currentRequest))
+            {
+                // A response came off the pipeline, making room for the request held back behind it
+                scheduleNewRequest(conn, conn->currentRequest, NULL, FALSE);
+            }
         }
     }
 	_CFNetConnectionUnlock(conn);
@@ -1317,7 +1727,7 @@ void _CFNetConnectionRequestIsComplete(_CFNetConnectionRef arg, void *req) {
         Boolean formerRequestIsNewResponse = (conn->currentResponse->request == req && !currResponseComplete);
         if (!__CFBitIsSet(conn->flags, CONNECTION_LOST)) {
             conn->currentRequest = conn->currentRequest->next;
-            if (conn->currentRequest && __CFBitIsSet(conn->flags, SHOULD_PIPELINE)) {
+            if (conn->currentRequest && __CFBitIsSet(conn->flags, SHOULD_PIPELINE) && canTransmitRequest(conn, conn->currentRequest)) {
                 scheduleNewRequest(conn, conn->currentRequest, formerRequest, formerRequestIsNewResponse);
             } else {
                 scheduleNewRequest(conn, NULL, formerRequest, formerRequestIsNewResponse);
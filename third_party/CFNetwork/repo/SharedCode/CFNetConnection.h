@@ -110,6 +110,7 @@ typedef CALLBACK_API_C( void , _CFNetConnectionReceiveResponse )(void *request,
 typedef CALLBACK_API_C( void , _CFNetConnectionResponseStreamCallBack )(void *request, CFReadStreamRef stream, CFStreamEventType eventType, _CFNetConnectionRef conn, const void *info);
 typedef CALLBACK_API_C( void , _CFNetConnectionRequestStreamCallBack )(void *request, CFWriteStreamRef stream, CFStreamEventType eventType, _CFNetConnectionRef conn, const void *info);
 typedef CALLBACK_API_C( CFArrayRef , _CFNetConnectionRunLoopArrayCallBack )(void *request, _CFNetConnectionRef conn, const void *info);
+typedef CALLBACK_API_C( Boolean , _CFNetConnectionRequestIsPipelinable )(void *request, _CFNetConnectionRef conn, const void *info);
 struct _CFNetConnectionCallBacks {
   CFIndex             version;
   _CFNetConnectionCreateCallBack  create;
@@ -121,6 +122,7 @@ struct _CFNetConnectionCallBacks {
   _CFNetConnectionResponseStreamCallBack  responseStreamCallBack;
   _CFNetConnectionRequestStreamCallBack  requestStreamCallBack;
   _CFNetConnectionRunLoopArrayCallBack  runLoopAndModesArrayForRequest;
+  _CFNetConnectionRequestIsPipelinable  requestIsPipelinable;     /* version 1 and later; NULL if every request may be pipelined */
 };
 typedef struct _CFNetConnectionCallBacks _CFNetConnectionCallBacks;
 /* Net connection*/
@@ -284,12 +286,36 @@ _CFNetConnectionSetShouldPipeline(
   _CFNetConnectionRef   conn,
   Boolean               shouldPipeline)                       AVAILABLE_MAC_OS_X_VERSION_10_3_AND_LATER;
 
+
+/* Set how many requests may be on the wire awaiting their responses while pipelining; 0, the default, for no limit*/
+/*
+ *  _CFNetConnectionSetMaxPipelineDepth()
+ *  
+ */
+extern void 
+_CFNetConnectionSetMaxPipelineDepth(
+  _CFNetConnectionRef   conn,
+  CFIndex               maxDepth)                             AVAILABLE_MAC_OS_X_VERSION_10_4_AND_LATER;
+
 extern CFAbsoluteTime 
 _CFNetConnectionGetLastAccessTime(_CFNetConnectionRef arg);
 
 extern int
 _CFNetConnectionGetQueueDepth(_CFNetConnectionRef conn);
 
+/*
+ *  _CFNetConnectionGetTransmittedCount()
+ *
+ *  Discussion:
+ *    Returns the number of requests which have started transmitting
+ *    on the connection, including the current one.  A request which
+ *    sees a count greater than one when it starts transmitting is
+ *    reusing an already open connection.
+ *
+ */
+extern UInt32
+_CFNetConnectionGetTransmittedCount(_CFNetConnectionRef conn);
+
 /*
  *  _CFNetConnectionSetAllowsNewRequests()
  *  
@@ -362,6 +388,13 @@ _CFNetConnectionIsEmpty(_CFNetConnectionRef conn)             AVAILABLE_MAC_OS_X
 typedef struct __CFNetConnectionCache *		CFNetConnectionCacheRef;
 typedef struct __CFNetConnectionCacheKey*	_CFNetConnectionCacheKey;
 
+typedef struct {
+    CFIndex hits;           // Requests handed a pooled connection that had gone idle
+    CFIndex misses;         // Requests that opened a new connection
+    CFIndex evictions;      // Idle connections closed to make room or after the idle timeout
+    CFIndex waits;          // Requests queued behind others because the host was at its limit
+} _CFNetConnectionCacheStatistics;
+
 
 //
 // Net connection cache
@@ -376,6 +409,12 @@ extern
 _CFNetConnectionRef findOrCreateNetConnection(CFNetConnectionCacheRef connectionCache, CFAllocatorRef allocator, const _CFNetConnectionCallBacks *callbacks, const void *info, _CFNetConnectionCacheKey key, Boolean persistent, CFDictionaryRef connectionProperties);	// This routine ties the two objects (connection cache & connection)
 extern
 void removeFromConnectionCache(CFNetConnectionCacheRef cache, _CFNetConnectionRef conn, _CFNetConnectionCacheKey key);
+extern
+void checkInToConnectionCache(CFNetConnectionCacheRef cache, _CFNetConnectionRef conn, _CFNetConnectionCacheKey key);	// conn's queue has drained; keep it for reuse until it idles out
+extern
+void setConnectionCacheLimits(CFNetConnectionCacheRef cache, CFIndex maxPerHost, CFIndex maxTotal, CFTimeInterval idleTimeout);	// A limit <= 0 means none; an idleTimeout <= 0 keeps no idle connections
+extern
+void getConnectionCacheStatistics(CFNetConnectionCacheRef cache, _CFNetConnectionCacheStatistics *stats);
 
 // These two callbacks are shared across protocols
 const void *connCacheKeyRetain(CFAllocatorRef allocator, const void *value);
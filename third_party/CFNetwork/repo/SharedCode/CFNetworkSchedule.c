@@ -30,7 +30,12 @@
  */
 
 #include "CFNetworkSchedule.h"
+#include "CFNetworkThreadSupport.h"
 #include <CFNetwork/CFNetwork.h>
+#include <CoreFoundation/CFStreamPriv.h>
+
+#include <errno.h>
+#include <string.h>
 
 #if defined(__MACH__)
 #include <SystemConfiguration/SystemConfiguration.h>
@@ -575,3 +580,1046 @@ _SchedulesFind(CFArrayRef schedules, CFRunLoopRef runLoop, CFStringRef runLoopMo
 	return kCFNotFound;
 }
 
+
+
+#pragma mark -
+#pragma mark Perform Queues
+
+typedef struct __CFNetworkPerformItem {
+	struct __CFNetworkPerformItem*	_next;
+	void							(*_perform)(void* info);
+	void							(*_release)(void* info);
+	void*							_info;
+} _CFNetworkPerformItem;
+
+struct __CFNetworkPerformQueue {
+	CFAllocatorRef					_alloc;
+	_CFNetworkPerformItem* volatile	_head;			/* Newest first; pushed without a lock */
+	CFRunLoopSourceRef				_source;
+	_CFMutex						_lock;			/* Protects _schedules */
+	CFMutableArrayRef				_schedules;
+};
+
+static _CFNetworkPerformItem* _PerformQueueTakeAll(_CFNetworkPerformQueueRef queue);
+static void _PerformQueuePerform(void* info);
+
+
+/* static */ _CFNetworkPerformItem*
+_PerformQueueTakeAll(_CFNetworkPerformQueueRef queue) {
+	
+	_CFNetworkPerformItem* items;
+	_CFNetworkPerformItem* ordered = NULL;
+	
+	/* Detach the whole list at once; producers carry on with an empty one. */
+	do {
+		items = queue->_head;
+	} while (items && !_CFAtomicCompareAndSwapPtr(items, NULL, (void* volatile*)&queue->_head));
+	
+	/* It was pushed newest first, so turn it around. */
+	while (items) {
+		_CFNetworkPerformItem* next = items->_next;
+		items->_next = ordered;
+		ordered = items;
+		items = next;
+	}
+	
+	return ordered;
+}
+
+
+/* static */ void
+_PerformQueuePerform(void* info) {
+	_CFNetworkPerformQueueDrain((_CFNetworkPerformQueueRef)info);
+}
+
+
+/* extern */ _CFNetworkPerformQueueRef
+_CFNetworkPerformQueueCreate(CFAllocatorRef alloc) {
+	
+	CFRunLoopSourceContext ctxt = {0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, _PerformQueuePerform};
+	_CFNetworkPerformQueueRef queue = (_CFNetworkPerformQueueRef)CFAllocatorAllocate(alloc, sizeof(queue[0]), 0);
+	
+	if (!queue)
+		return NULL;
+	
+	memset(queue, 0, sizeof(queue[0]));
+	queue->_alloc = alloc ? CFRetain(alloc) : NULL;
+	
+	ctxt.info = queue;
+	queue->_source = CFRunLoopSourceCreate(alloc, 0, &ctxt);
+	queue->_schedules = CFArrayCreateMutable(alloc, 0, &kCFTypeArrayCallBacks);
+	
+	if (!queue->_source || !queue->_schedules) {
+		if (queue->_source) CFRelease(queue->_source);
+		if (queue->_schedules) CFRelease(queue->_schedules);
+		if (queue->_alloc) CFRelease(queue->_alloc);
+		CFAllocatorDeallocate(alloc, queue);
+		return NULL;
+	}
+	
+	_CFMutexInit(&queue->_lock, FALSE);
+	
+	return queue;
+}
+
+
+/* extern */ void
+_CFNetworkPerformQueueDestroy(_CFNetworkPerformQueueRef queue) {
+	
+	CFAllocatorRef alloc = queue->_alloc;
+	_CFNetworkPerformItem* items;
+	
+	CFRunLoopSourceInvalidate(queue->_source);
+	CFRelease(queue->_source);
+	CFRelease(queue->_schedules);
+	_CFMutexDestroy(&queue->_lock);
+	
+	/* Whatever is still pending is dropped, not performed. */
+	items = _PerformQueueTakeAll(queue);
+	while (items) {
+		_CFNetworkPerformItem* next = items->_next;
+		if (items->_release)
+			items->_release(items->_info);
+		CFAllocatorDeallocate(alloc, items);
+		items = next;
+	}
+	
+	CFAllocatorDeallocate(alloc, queue);
+	if (alloc) CFRelease(alloc);
+}
+
+
+/* extern */ void
+_CFNetworkPerformQueueScheduleWithRunLoop(_CFNetworkPerformQueueRef queue, CFRunLoopRef runLoop, CFStringRef runLoopMode) {
+	
+	Boolean pending;
+	
+	_CFMutexLock(&queue->_lock);
+	if (_SchedulesAddRunLoopAndMode(queue->_schedules, runLoop, runLoopMode))
+		CFRunLoopAddSource(runLoop, queue->_source, runLoopMode);
+	pending = (queue->_head != NULL);
+	_CFMutexUnlock(&queue->_lock);
+	
+	/* Anything enqueued while there was nowhere to run it gets its wakeup now. */
+	if (pending) {
+		CFRunLoopSourceSignal(queue->_source);
+		CFRunLoopWakeUp(runLoop);
+	}
+}
+
+
+/* extern */ void
+_CFNetworkPerformQueueUnscheduleFromRunLoop(_CFNetworkPerformQueueRef queue, CFRunLoopRef runLoop, CFStringRef runLoopMode) {
+	
+	_CFMutexLock(&queue->_lock);
+	if (_SchedulesRemoveRunLoopAndMode(queue->_schedules, runLoop, runLoopMode))
+		CFRunLoopRemoveSource(runLoop, queue->_source, runLoopMode);
+	_CFMutexUnlock(&queue->_lock);
+}
+
+
+/* extern */ Boolean
+_CFNetworkPerformQueueEnqueue(_CFNetworkPerformQueueRef queue, void (*perform)(void* info), void* info, void (*release)(void* info)) {
+	
+	_CFNetworkPerformItem* item = (_CFNetworkPerformItem*)CFAllocatorAllocate(queue->_alloc, sizeof(item[0]), 0);
+	_CFNetworkPerformItem* head;
+	
+	if (!item)
+		return FALSE;
+	
+	item->_perform = perform;
+	item->_release = release;
+	item->_info = info;
+	
+	do {
+		head = queue->_head;
+		item->_next = head;
+	} while (!_CFAtomicCompareAndSwapPtr(head, item, (void* volatile*)&queue->_head));
+	
+	/* Only the first of a batch wakes the consumer; the rest ride along with it. */
+	if (!head) {
+		
+		CFIndex i, count;
+		
+		CFRunLoopSourceSignal(queue->_source);
+		
+		_CFMutexLock(&queue->_lock);
+		count = CFArrayGetCount(queue->_schedules);
+		for (i = 0; i < count; i += 2)
+			CFRunLoopWakeUp((CFRunLoopRef)CFArrayGetValueAtIndex(queue->_schedules, i));
+		_CFMutexUnlock(&queue->_lock);
+	}
+	
+	return TRUE;
+}
+
+
+/* extern */ void
+_CFNetworkPerformQueueDrain(_CFNetworkPerformQueueRef queue) {
+	
+	CFAllocatorRef alloc = queue->_alloc;
+	_CFNetworkPerformItem* items = _PerformQueueTakeAll(queue);
+	
+	while (items) {
+		
+		_CFNetworkPerformItem* next = items->_next;
+		
+		items->_perform(items->_info);
+		if (items->_release)
+			items->_release(items->_info);
+		
+		CFAllocatorDeallocate(alloc, items);
+		items = next;
+	}
+}
+
+
+#pragma mark -
+#pragma mark I/O Run Loops
+
+#define kCFNetworkIORunLoopMaxCount			16
+#define kCFNetworkIORunLoopDefaultLimit		4
+
+typedef struct {
+	CFRunLoopRef				_runLoop;		/* NULL until the thread is running */
+	_CFNetworkPerformQueueRef	_queue;			/* Work handed to the thread */
+	CFIndex						_load;			/* Objects scheduled on the run loop */
+} _CFNetworkIORunLoop;
+
+static _CFOnceLock _kCFNetworkIOOnce = _CFOnceInitializer;
+static _CFMutex _kCFNetworkIOLock;
+static _CFCondition _kCFNetworkIOStarted;
+static _CFNetworkIORunLoop _kCFNetworkIORunLoops[kCFNetworkIORunLoopMaxCount];
+static CFIndex _kCFNetworkIORunLoopCount = 0;
+static CFIndex _kCFNetworkIORunLoopLimit = 0;
+
+static void _IORunLoopsInitialize(void);
+static void* _IORunLoopMain(void* info);
+static _CFNetworkIORunLoop* _IORunLoopFind(CFRunLoopRef runLoop);
+
+
+/* static */ void
+_IORunLoopsInitialize(void) {
+	
+	CFIndex processors = 1;
+	
+#if defined(__WIN32__)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	processors = info.dwNumberOfProcessors;
+#else
+	processors = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	
+	_CFMutexInit(&_kCFNetworkIOLock, FALSE);
+	_CFConditionInit(&_kCFNetworkIOStarted);
+	
+	if (!_kCFNetworkIORunLoopLimit)
+		_kCFNetworkIORunLoopLimit = (processors < 1) ? 1 : (processors > kCFNetworkIORunLoopDefaultLimit) ? kCFNetworkIORunLoopDefaultLimit : processors;
+}
+
+
+/* static */ void*
+_IORunLoopMain(void* info) {
+	
+	_CFNetworkIORunLoop* io = (_CFNetworkIORunLoop*)info;
+	CFRunLoopRef runLoop = CFRunLoopGetCurrent();
+	
+	/* The queue's source keeps the run loop from ever running out of things to wait on. */
+	_CFNetworkPerformQueueScheduleWithRunLoop(io->_queue, runLoop, kCFRunLoopDefaultMode);
+	
+	_CFMutexLock(&_kCFNetworkIOLock);
+	io->_runLoop = (CFRunLoopRef)CFRetain(runLoop);
+	_CFConditionBroadcast(&_kCFNetworkIOStarted);
+	_CFMutexUnlock(&_kCFNetworkIOLock);
+	
+	while (TRUE)
+		CFRunLoopRun();
+	
+	return NULL;
+}
+
+
+/* static */ _CFNetworkIORunLoop*
+_IORunLoopFind(CFRunLoopRef runLoop) {
+	
+	CFIndex i;
+	
+	for (i = 0; i < _kCFNetworkIORunLoopCount; i++) {
+		if (_kCFNetworkIORunLoops[i]._runLoop == runLoop)
+			return &_kCFNetworkIORunLoops[i];
+	}
+	
+	return NULL;
+}
+
+
+/* extern */ CFRunLoopRef
+_CFNetworkIORunLoopAcquire(void) {
+	
+	_CFNetworkIORunLoop* best = NULL;
+	CFRunLoopRef result = NULL;
+	CFIndex i;
+	
+	_CFDoOnce(&_kCFNetworkIOOnce, _IORunLoopsInitialize);
+	
+	_CFMutexLock(&_kCFNetworkIOLock);
+	
+	for (i = 0; i < _kCFNetworkIORunLoopCount; i++) {
+		if (!best || (_kCFNetworkIORunLoops[i]._load < best->_load))
+			best = &_kCFNetworkIORunLoops[i];
+	}
+	
+	/* Start another thread rather than share a busy one, up to the limit. */
+	if ((!best || best->_load) && (_kCFNetworkIORunLoopCount < _kCFNetworkIORunLoopLimit)) {
+		
+		_CFNetworkIORunLoop* io = &_kCFNetworkIORunLoops[_kCFNetworkIORunLoopCount];
+		_CFThread thread;
+		
+		io->_runLoop = NULL;
+		io->_load = 0;
+		io->_queue = _CFNetworkPerformQueueCreate(kCFAllocatorDefault);
+		
+		if (io->_queue && (_CFThreadSpawn(&thread, _IORunLoopMain, io) == 0)) {
+			
+			_CFThreadDetach(thread);
+			
+			while (!io->_runLoop)
+				_CFConditionWait(&_kCFNetworkIOStarted, &_kCFNetworkIOLock);
+			
+			_kCFNetworkIORunLoopCount++;
+			best = io;
+		}
+		
+		else if (io->_queue) {
+			_CFNetworkPerformQueueDestroy(io->_queue);
+			io->_queue = NULL;
+		}
+	}
+	
+	if (best) {
+		best->_load++;
+		result = best->_runLoop;
+	}
+	
+	_CFMutexUnlock(&_kCFNetworkIOLock);
+	
+	return result;
+}
+
+
+/* extern */ void
+_CFNetworkIORunLoopRelinquish(CFRunLoopRef runLoop) {
+	
+	_CFNetworkIORunLoop* io;
+	
+	_CFDoOnce(&_kCFNetworkIOOnce, _IORunLoopsInitialize);
+	
+	_CFMutexLock(&_kCFNetworkIOLock);
+	io = _IORunLoopFind(runLoop);
+	if (io && io->_load)
+		io->_load--;
+	_CFMutexUnlock(&_kCFNetworkIOLock);
+}
+
+
+/* extern */ void
+_CFNetworkSetIORunLoopLimit(CFIndex limit) {
+	
+	_CFDoOnce(&_kCFNetworkIOOnce, _IORunLoopsInitialize);
+	
+	_CFMutexLock(&_kCFNetworkIOLock);
+	_kCFNetworkIORunLoopLimit = (limit < 1) ? 1 : (limit > kCFNetworkIORunLoopMaxCount) ? kCFNetworkIORunLoopMaxCount : limit;
+	_CFMutexUnlock(&_kCFNetworkIOLock);
+}
+
+
+/* extern */ Boolean
+_CFNetworkIORunLoopPerform(CFRunLoopRef runLoop, void (*perform)(void* info), void* info, void (*release)(void* info)) {
+	
+	_CFNetworkIORunLoop* io;
+	_CFNetworkPerformQueueRef queue = NULL;
+	
+	_CFDoOnce(&_kCFNetworkIOOnce, _IORunLoopsInitialize);
+	
+	/* Pool threads never go away, so their queues can be used once found. */
+	_CFMutexLock(&_kCFNetworkIOLock);
+	io = _IORunLoopFind(runLoop);
+	if (io)
+		queue = io->_queue;
+	_CFMutexUnlock(&_kCFNetworkIOLock);
+	
+	if (queue && _CFNetworkPerformQueueEnqueue(queue, perform, info, release))
+		return TRUE;
+	
+	if (release)
+		release(info);
+	
+	return FALSE;
+}
+
+
+/* extern */ CFRunLoopRef
+_CFTypeScheduleOnIORunLoop(CFTypeRef obj) {
+	
+	CFRunLoopRef runLoop = _CFNetworkIORunLoopAcquire();
+	
+	if (runLoop)
+		_CFTypeScheduleOnRunLoop(obj, runLoop, kCFRunLoopDefaultMode);
+	
+	return runLoop;
+}
+
+
+/* extern */ void
+_CFTypeUnscheduleFromIORunLoop(CFTypeRef obj, CFRunLoopRef runLoop) {
+	
+	_CFTypeUnscheduleFromRunLoop(obj, runLoop, kCFRunLoopDefaultMode);
+	_CFNetworkIORunLoopRelinquish(runLoop);
+}
+
+
+#pragma mark -
+#pragma mark I/O Run Loop Streams
+
+#define kCFNetworkHandoffBufferLimit		(64 * 1024)
+#define kCFNetworkHandoffReadSize			(16 * 1024)
+
+/*
+ *  The client side of a handoff stream is its read, can-read and property calls and the delivery of events,
+ *  all on the client's thread.  The pool side is the inner stream's callback and the open, resume, copy and
+ *  close work handed to the pool thread.  The two meet under _lock.
+ */
+typedef struct {
+	CFAllocatorRef				_alloc;
+	CFIndex						_refs;			/* Under _lock */
+	_CFMutex					_lock;
+	_CFCondition				_changed;		/* Broadcast whenever the state below changes */
+	
+	CFReadStreamRef				_stream;		/* The client's stream; not retained, NULL once finalized */
+	CFReadStreamRef				_inner;
+	CFRunLoopRef				_ioRunLoop;		/* NULL until opened */
+	_CFNetworkPerformQueueRef	_queue;			/* Delivers events on the client's run loops */
+	
+	CFMutableDataRef			_buffer;		/* Read ahead from _inner, not yet read by the client */
+	CFOptionFlags				_pending;		/* Events not yet delivered */
+	CFStreamError				_error;
+	Boolean						_delivering;	/* A delivery is enqueued */
+	Boolean						_opened;
+	Boolean						_innerAtEnd;	/* _inner has ended, though it may not have been read out */
+	Boolean						_atEnd;			/* Everything from _inner is in _buffer */
+	Boolean						_stalled;		/* _buffer filled up with _inner still to read */
+	Boolean						_closed;
+} _CFReadStreamHandoff;
+
+typedef struct {
+	_CFReadStreamHandoff*		_handoff;
+	CFStringRef					_name;
+	CFTypeRef					_value;
+	Boolean						_done;
+} _CFReadStreamHandoffCopy;
+
+static void* _HandoffRetain(void* info);
+static void _HandoffRelease(void* info);
+static void _HandoffDeliver(void* info);
+static void _HandoffPost(_CFReadStreamHandoff* handoff, CFStreamEventType event);
+static void _HandoffFill(_CFReadStreamHandoff* handoff);
+static void _HandoffInnerCallBack(CFReadStreamRef stream, CFStreamEventType type, void* info);
+static void _HandoffOpenOnIORunLoop(void* info);
+static void _HandoffResumeOnIORunLoop(void* info);
+static void _HandoffCopyOnIORunLoop(void* info);
+static void _HandoffCloseOnIORunLoop(void* info);
+
+static void* _HandoffCreate(CFReadStreamRef stream, void* info);
+static void _HandoffFinalize(CFReadStreamRef stream, void* info);
+static Boolean _HandoffOpen(CFReadStreamRef stream, CFStreamError* error, Boolean* openComplete, void* info);
+static Boolean _HandoffOpenCompleted(CFReadStreamRef stream, CFStreamError* error, void* info);
+static CFIndex _HandoffRead(CFReadStreamRef stream, UInt8* buffer, CFIndex bufferLength, CFStreamError* error, Boolean* atEOF, void* info);
+static Boolean _HandoffCanRead(CFReadStreamRef stream, void* info);
+static void _HandoffClose(CFReadStreamRef stream, void* info);
+static CFTypeRef _HandoffCopyProperty(CFReadStreamRef stream, CFStringRef propertyName, void* info);
+static Boolean _HandoffSetProperty(CFReadStreamRef stream, CFStringRef propertyName, CFTypeRef propertyValue, void* info);
+static void _HandoffSchedule(CFReadStreamRef stream, CFRunLoopRef runLoop, CFStringRef runLoopMode, void* info);
+static void _HandoffUnschedule(CFReadStreamRef stream, CFRunLoopRef runLoop, CFStringRef runLoopMode, void* info);
+
+
+/* static */ void*
+_HandoffRetain(void* info) {
+	
+	_CFReadStreamHandoff* handoff = (_CFReadStreamHandoff*)info;
+	
+	_CFMutexLock(&handoff->_lock);
+	handoff->_refs++;
+	_CFMutexUnlock(&handoff->_lock);
+	
+	return info;
+}
+
+
+/* static */ void
+_HandoffRelease(void* info) {
+	
+	_CFReadStreamHandoff* handoff = (_CFReadStreamHandoff*)info;
+	CFAllocatorRef alloc = handoff->_alloc;
+	CFIndex refs;
+	
+	_CFMutexLock(&handoff->_lock);
+	refs = --handoff->_refs;
+	_CFMutexUnlock(&handoff->_lock);
+	
+	if (refs)
+		return;
+	
+	if (handoff->_queue) _CFNetworkPerformQueueDestroy(handoff->_queue);
+	CFRelease(handoff->_inner);
+	CFRelease(handoff->_buffer);
+	_CFConditionDestroy(&handoff->_changed);
+	_CFMutexDestroy(&handoff->_lock);
+	
+	CFAllocatorDeallocate(alloc, handoff);
+	if (alloc) CFRelease(alloc);
+}
+
+
+/* static */ void
+_HandoffDeliver(void* info) {
+	
+	static const CFStreamEventType kOrder[] = {
+		kCFStreamEventOpenCompleted, kCFStreamEventHasBytesAvailable, kCFStreamEventErrorOccurred, kCFStreamEventEndEncountered
+	};
+	
+	_CFReadStreamHandoff* handoff = (_CFReadStreamHandoff*)info;
+	CFOptionFlags events;
+	CFStreamError error;
+	CFIndex i;
+	
+	_CFMutexLock(&handoff->_lock);
+	events = handoff->_pending;
+	error = handoff->_error;
+	handoff->_pending = 0;
+	handoff->_delivering = FALSE;
+	_CFMutexUnlock(&handoff->_lock);
+	
+	/* An error ends the stream; there's no end to report after it. */
+	if (events & kCFStreamEventErrorOccurred)
+		events &= ~kCFStreamEventEndEncountered;
+	
+	for (i = 0; i < (CFIndex)(sizeof(kOrder) / sizeof(kOrder[0])); i++) {
+		
+		CFReadStreamRef stream;
+		
+		if (!(events & kOrder[i]))
+			continue;
+		
+		/* The client may have let go of the stream in the last event. */
+		_CFMutexLock(&handoff->_lock);
+		stream = handoff->_stream;
+		_CFMutexUnlock(&handoff->_lock);
+		
+		if (!stream)
+			break;
+		
+		CFReadStreamSignalEvent(stream, kOrder[i], (kOrder[i] == kCFStreamEventErrorOccurred) ? &error : NULL);
+	}
+}
+
+
+/* static */ void
+_HandoffPost(_CFReadStreamHandoff* handoff, CFStreamEventType event) {
+	
+	/* Called with _lock held.  Events are gathered until the client's run loop gets to them. */
+	handoff->_pending |= event;
+	
+	if (!handoff->_delivering && handoff->_stream) {
+		
+		handoff->_delivering = TRUE;
+		handoff->_refs++;
+		
+		/* Out of memory, the events wait for the next post to try again. */
+		if (!_CFNetworkPerformQueueEnqueue(handoff->_queue, _HandoffDeliver, handoff, _HandoffRelease)) {
+			handoff->_delivering = FALSE;
+			handoff->_refs--;
+		}
+	}
+}
+
+
+/* static */ void
+_HandoffFill(_CFReadStreamHandoff* handoff) {
+	
+	/*
+	 *  Called with _lock held, on the pool thread.  The lock is let go around each read of _inner, which may
+	 *  call back into _HandoffInnerCallBack; only this thread touches _inner, so what's needed of the state is
+	 *  taken before and the bytes are added to _buffer once the lock is held again.
+	 */
+	UInt8 chunk[kCFNetworkHandoffReadSize];
+	Boolean added = FALSE;
+	
+	while (!handoff->_closed && (CFDataGetLength(handoff->_buffer) < kCFNetworkHandoffBufferLimit)) {
+		
+		CFIndex room = kCFNetworkHandoffBufferLimit - CFDataGetLength(handoff->_buffer);
+		Boolean readable = handoff->_innerAtEnd;
+		CFStreamError error = {0, 0};
+		CFIndex bytesRead = 0;
+		
+		if (room > (CFIndex)sizeof(chunk))
+			room = sizeof(chunk);
+		
+		_CFMutexUnlock(&handoff->_lock);
+		
+		if (readable || CFReadStreamHasBytesAvailable(handoff->_inner)) {
+			readable = TRUE;
+			bytesRead = CFReadStreamRead(handoff->_inner, chunk, room);
+			if (bytesRead < 0)
+				error = CFReadStreamGetError(handoff->_inner);
+		}
+		
+		_CFMutexLock(&handoff->_lock);
+		
+		if (!readable)
+			break;
+		
+		/* Bytes read after the client closed are dropped. */
+		if (bytesRead > 0) {
+			if (!handoff->_closed) {
+				CFDataAppendBytes(handoff->_buffer, chunk, bytesRead);
+				added = TRUE;
+			}
+		}
+		
+		else {
+			if (bytesRead < 0) {
+				handoff->_error = error;
+				_HandoffPost(handoff, kCFStreamEventErrorOccurred);
+			}
+			else if (handoff->_innerAtEnd && !handoff->_atEnd) {
+				handoff->_atEnd = TRUE;
+				_HandoffPost(handoff, kCFStreamEventEndEncountered);
+			}
+			break;
+		}
+	}
+	
+	handoff->_stalled = (CFDataGetLength(handoff->_buffer) >= kCFNetworkHandoffBufferLimit);
+	
+	if (added)
+		_HandoffPost(handoff, kCFStreamEventHasBytesAvailable);
+	
+	_CFConditionBroadcast(&handoff->_changed);
+}
+
+
+/* static */ void
+_HandoffInnerCallBack(CFReadStreamRef stream, CFStreamEventType type, void* info) {
+	
+	_CFReadStreamHandoff* handoff = (_CFReadStreamHandoff*)info;
+	
+	(void)stream;	/* unused */
+	
+	_CFMutexLock(&handoff->_lock);
+	
+	switch (type) {
+		
+		case kCFStreamEventOpenCompleted:
+			handoff->_opened = TRUE;
+			_HandoffPost(handoff, kCFStreamEventOpenCompleted);
+			break;
+		
+		case kCFStreamEventHasBytesAvailable:
+			_HandoffFill(handoff);
+			break;
+		
+		case kCFStreamEventEndEncountered:
+			/* Read out whatever is left first; the end is reported once it's all buffered. */
+			handoff->_innerAtEnd = TRUE;
+			_HandoffFill(handoff);
+			break;
+		
+		case kCFStreamEventErrorOccurred:
+			handoff->_error = CFReadStreamGetError(handoff->_inner);
+			_HandoffPost(handoff, kCFStreamEventErrorOccurred);
+			break;
+		
+		default:
+			break;
+	}
+	
+	_CFConditionBroadcast(&handoff->_changed);
+	_CFMutexUnlock(&handoff->_lock);
+}
+
+
+/* static */ void
+_HandoffOpenOnIORunLoop(void* info) {
+	
+	_CFReadStreamHandoff* handoff = (_CFReadStreamHandoff*)info;
+	Boolean closed;
+	
+	_CFMutexLock(&handoff->_lock);
+	closed = handoff->_closed;
+	_CFMutexUnlock(&handoff->_lock);
+	
+	if (closed)
+		return;
+	
+	CFReadStreamScheduleWithRunLoop(handoff->_inner, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+	
+	if (!CFReadStreamOpen(handoff->_inner)) {
+		_CFMutexLock(&handoff->_lock);
+		handoff->_error = CFReadStreamGetError(handoff->_inner);
+		_HandoffPost(handoff, kCFStreamEventErrorOccurred);
+		_CFConditionBroadcast(&handoff->_changed);
+		_CFMutexUnlock(&handoff->_lock);
+	}
+}
+
+
+/* static */ void
+_HandoffResumeOnIORunLoop(void* info) {
+	
+	_CFReadStreamHandoff* handoff = (_CFReadStreamHandoff*)info;
+	
+	_CFMutexLock(&handoff->_lock);
+	if (!handoff->_closed && !handoff->_atEnd && (handoff->_error.error == 0))
+		_HandoffFill(handoff);
+	_CFMutexUnlock(&handoff->_lock);
+}
+
+
+/* static */ void
+_HandoffCopyOnIORunLoop(void* info) {
+	
+	_CFReadStreamHandoffCopy* copy = (_CFReadStreamHandoffCopy*)info;
+	_CFReadStreamHandoff* handoff = copy->_handoff;
+	CFTypeRef value = CFReadStreamCopyProperty(handoff->_inner, copy->_name);
+	
+	_CFMutexLock(&handoff->_lock);
+	copy->_value = value;
+	copy->_done = TRUE;
+	_CFConditionBroadcast(&handoff->_changed);
+	_CFMutexUnlock(&handoff->_lock);
+}
+
+
+/* static */ void
+_HandoffCloseOnIORunLoop(void* info) {
+	
+	_CFReadStreamHandoff* handoff = (_CFReadStreamHandoff*)info;
+	CFRunLoopRef runLoop = CFRunLoopGetCurrent();
+	
+	CFReadStreamSetClient(handoff->_inner, kCFStreamEventNone, NULL, NULL);
+	CFReadStreamUnscheduleFromRunLoop(handoff->_inner, runLoop, kCFRunLoopDefaultMode);
+	CFReadStreamClose(handoff->_inner);
+	
+	_CFNetworkIORunLoopRelinquish(runLoop);
+}
+
+
+/* static */ void*
+_HandoffCreate(CFReadStreamRef stream, void* info) {
+	
+	CFAllocatorRef alloc = CFGetAllocator(stream);
+	_CFReadStreamHandoff* handoff = (_CFReadStreamHandoff*)CFAllocatorAllocate(alloc, sizeof(handoff[0]), 0);
+	
+	if (!handoff)
+		return NULL;
+	
+	memset(handoff, 0, sizeof(handoff[0]));
+	
+	handoff->_queue = _CFNetworkPerformQueueCreate(alloc);
+	handoff->_buffer = CFDataCreateMutable(alloc, 0);
+	
+	if (!handoff->_queue || !handoff->_buffer) {
+		if (handoff->_queue) _CFNetworkPerformQueueDestroy(handoff->_queue);
+		if (handoff->_buffer) CFRelease(handoff->_buffer);
+		CFAllocatorDeallocate(alloc, handoff);
+		return NULL;
+	}
+	
+	handoff->_alloc = alloc ? CFRetain(alloc) : NULL;
+	handoff->_refs = 1;
+	handoff->_stream = stream;
+	handoff->_inner = (CFReadStreamRef)CFRetain((CFReadStreamRef)info);
+	
+	_CFMutexInit(&handoff->_lock, FALSE);
+	_CFConditionInit(&handoff->_changed);
+	
+	return handoff;
+}
+
+
+/* static */ void
+_HandoffClose(CFReadStreamRef stream, void* info) {
+	
+	_CFReadStreamHandoff* handoff = (_CFReadStreamHandoff*)info;
+	CFRunLoopRef runLoop;
+	
+	(void)stream;	/* unused */
+	
+	_CFMutexLock(&handoff->_lock);
+	runLoop = handoff->_closed ? NULL : handoff->_ioRunLoop;
+	handoff->_closed = TRUE;
+	_CFConditionBroadcast(&handoff->_changed);
+	if (runLoop)
+		handoff->_refs++;
+	_CFMutexUnlock(&handoff->_lock);
+	
+	/* The inner stream is closed on its own thread, after anything already handed over there. */
+	if (runLoop)
+		_CFNetworkIORunLoopPerform(runLoop, _HandoffCloseOnIORunLoop, handoff, _HandoffRelease);
+}
+
+
+/* static */ void
+_HandoffFinalize(CFReadStreamRef stream, void* info) {
+	
+	_CFReadStreamHandoff* handoff = (_CFReadStreamHandoff*)info;
+	_CFNetworkPerformQueueRef queue;
+	
+	_HandoffClose(stream, info);
+	
+	/* Nothing more is enqueued once _stream is gone, so the queue can go too. */
+	_CFMutexLock(&handoff->_lock);
+	handoff->_stream = NULL;
+	queue = handoff->_queue;
+	handoff->_queue = NULL;
+	_CFMutexUnlock(&handoff->_lock);
+	
+	_CFNetworkPerformQueueDestroy(queue);
+	
+	_HandoffRelease(handoff);
+}
+
+
+/* static */ Boolean
+_HandoffOpen(CFReadStreamRef stream, CFStreamError* error, Boolean* openComplete, void* info) {
+	
+	_CFReadStreamHandoff* handoff = (_CFReadStreamHandoff*)info;
+	CFStreamClientContext ctxt = {0, handoff, _HandoffRetain, _HandoffRelease, NULL};
+	CFRunLoopRef runLoop = _CFNetworkIORunLoopAcquire();
+	
+	(void)stream;	/* unused */
+	
+	if (!runLoop) {
+		error->domain = kCFStreamErrorDomainPOSIX;
+		error->error = EAGAIN;
+		*openComplete = TRUE;
+		return FALSE;
+	}
+	
+	CFReadStreamSetClient(handoff->_inner,
+						  kCFStreamEventOpenCompleted | kCFStreamEventHasBytesAvailable | kCFStreamEventEndEncountered | kCFStreamEventErrorOccurred,
+						  _HandoffInnerCallBack,
+						  &ctxt);
+	
+	_CFMutexLock(&handoff->_lock);
+	handoff->_ioRunLoop = runLoop;
+	handoff->_refs++;
+	_CFMutexUnlock(&handoff->_lock);
+	
+	if (!_CFNetworkIORunLoopPerform(runLoop, _HandoffOpenOnIORunLoop, handoff, _HandoffRelease)) {
+		
+		_CFMutexLock(&handoff->_lock);
+		handoff->_ioRunLoop = NULL;
+		_CFMutexUnlock(&handoff->_lock);
+		
+		CFReadStreamSetClient(handoff->_inner, kCFStreamEventNone, NULL, NULL);
+		_CFNetworkIORunLoopRelinquish(runLoop);
+		
+		error->domain = kCFStreamErrorDomainPOSIX;
+		error->error = ENOMEM;
+		*openComplete = TRUE;
+		return FALSE;
+	}
+	
+	*openComplete = FALSE;
+	
+	return TRUE;
+}
+
+
+/* static */ Boolean
+_HandoffOpenCompleted(CFReadStreamRef stream, CFStreamError* error, void* info) {
+	
+	_CFReadStreamHandoff* handoff = (_CFReadStreamHandoff*)info;
+	Boolean result;
+	
+	(void)stream;	/* unused */
+	
+	_CFMutexLock(&handoff->_lock);
+	if (handoff->_error.error) {
+		*error = handoff->_error;
+		result = TRUE;
+	}
+	else
+		result = handoff->_opened;
+	_CFMutexUnlock(&handoff->_lock);
+	
+	return result;
+}
+
+
+/* static */ CFIndex
+_HandoffRead(CFReadStreamRef stream, UInt8* buffer, CFIndex bufferLength, CFStreamError* error, Boolean* atEOF, void* info) {
+	
+	_CFReadStreamHandoff* handoff = (_CFReadStreamHandoff*)info;
+	CFIndex length;
+	CFIndex result = 0;
+	Boolean resume = FALSE;
+	
+	(void)stream;	/* unused */
+	
+	*atEOF = FALSE;
+	
+	_CFMutexLock(&handoff->_lock);
+	
+	/* A blocking read waits here for the pool thread. */
+	while (!CFDataGetLength(handoff->_buffer) && !handoff->_atEnd && !handoff->_error.error && !handoff->_closed)
+		_CFConditionWait(&handoff->_changed, &handoff->_lock);
+	
+	length = CFDataGetLength(handoff->_buffer);
+	
+	if (length) {
+		
+		result = (bufferLength < length) ? bufferLength : length;
+		memmove(buffer, CFDataGetBytePtr(handoff->_buffer), result);
+		CFDataDeleteBytes(handoff->_buffer, CFRangeMake(0, result));
+		length -= result;
+		
+		/* Room has been made; the pool thread can read ahead again. */
+		if (handoff->_stalled) {
+			handoff->_stalled = FALSE;
+			handoff->_refs++;
+			resume = TRUE;
+		}
+		
+		if (length)
+			_HandoffPost(handoff, kCFStreamEventHasBytesAvailable);
+		else if (handoff->_atEnd)
+			*atEOF = TRUE;
+	}
+	
+	else if (handoff->_error.error) {
+		*error = handoff->_error;
+		result = -1;
+	}
+	
+	else
+		*atEOF = TRUE;
+	
+	_CFMutexUnlock(&handoff->_lock);
+	
+	/* If the resume can't be handed over, the next read tries again. */
+	if (resume && !_CFNetworkIORunLoopPerform(handoff->_ioRunLoop, _HandoffResumeOnIORunLoop, handoff, _HandoffRelease)) {
+		_CFMutexLock(&handoff->_lock);
+		handoff->_stalled = TRUE;
+		_CFMutexUnlock(&handoff->_lock);
+	}
+	
+	return result;
+}
+
+
+/* static */ Boolean
+_HandoffCanRead(CFReadStreamRef stream, void* info) {
+	
+	_CFReadStreamHandoff* handoff = (_CFReadStreamHandoff*)info;
+	Boolean result;
+	
+	(void)stream;	/* unused */
+	
+	_CFMutexLock(&handoff->_lock);
+	result = (CFDataGetLength(handoff->_buffer) || handoff->_atEnd || handoff->_error.error);
+	_CFMutexUnlock(&handoff->_lock);
+	
+	return result;
+}
+
+
+/* static */ CFTypeRef
+_HandoffCopyProperty(CFReadStreamRef stream, CFStringRef propertyName, void* info) {
+	
+	_CFReadStreamHandoff* handoff = (_CFReadStreamHandoff*)info;
+	_CFReadStreamHandoffCopy copy = {handoff, propertyName, NULL, FALSE};
+	CFRunLoopRef runLoop;
+	
+	(void)stream;	/* unused */
+	
+	_CFMutexLock(&handoff->_lock);
+	runLoop = handoff->_closed ? NULL : handoff->_ioRunLoop;
+	_CFMutexUnlock(&handoff->_lock);
+	
+	/* Not yet opened, or closed, nothing else is touching the inner stream. */
+	if (!runLoop || (runLoop == CFRunLoopGetCurrent()))
+		return CFReadStreamCopyProperty(handoff->_inner, propertyName);
+	
+	if (!_CFNetworkIORunLoopPerform(runLoop, _HandoffCopyOnIORunLoop, &copy, NULL))
+		return NULL;
+	
+	_CFMutexLock(&handoff->_lock);
+	while (!copy._done)
+		_CFConditionWait(&handoff->_changed, &handoff->_lock);
+	_CFMutexUnlock(&handoff->_lock);
+	
+	return copy._value;
+}
+
+
+/* static */ Boolean
+_HandoffSetProperty(CFReadStreamRef stream, CFStringRef propertyName, CFTypeRef propertyValue, void* info) {
+	
+	_CFReadStreamHandoff* handoff = (_CFReadStreamHandoff*)info;
+	
+	/* Once open, the inner stream belongs to the pool thread. */
+	if (CFReadStreamGetStatus(stream) > kCFStreamStatusNotOpen)
+		return FALSE;
+	
+	return CFReadStreamSetProperty(handoff->_inner, propertyName, propertyValue);
+}
+
+
+/* static */ void
+_HandoffSchedule(CFReadStreamRef stream, CFRunLoopRef runLoop, CFStringRef runLoopMode, void* info) {
+	
+	(void)stream;	/* unused */
+	
+	_CFNetworkPerformQueueScheduleWithRunLoop(((_CFReadStreamHandoff*)info)->_queue, runLoop, runLoopMode);
+}
+
+
+/* static */ void
+_HandoffUnschedule(CFReadStreamRef stream, CFRunLoopRef runLoop, CFStringRef runLoopMode, void* info) {
+	
+	(void)stream;	/* unused */
+	
+	_CFNetworkPerformQueueUnscheduleFromRunLoop(((_CFReadStreamHandoff*)info)->_queue, runLoop, runLoopMode);
+}
+
+
+static const CFReadStreamCallBacks _kCFReadStreamHandoffCallBacks = {
+	1,
+	_HandoffCreate,
+	_HandoffFinalize,
+	NULL,
+	_HandoffOpen,
+	_HandoffOpenCompleted,
+	_HandoffRead,
+	NULL,
+	_HandoffCanRead,
+	_HandoffClose,
+	_HandoffCopyProperty,
+	_HandoffSetProperty,
+	NULL,
+	_HandoffSchedule,
+	_HandoffUnschedule
+};
+
+
+/* extern */ CFReadStreamRef
+_CFReadStreamCreateWithIORunLoop(CFAllocatorRef alloc, CFReadStreamRef stream) {
+	
+	if (!stream || (CFReadStreamGetStatus(stream) != kCFStreamStatusNotOpen))
+		return NULL;
+	
+	return CFReadStreamCreate(alloc, &_kCFReadStreamHandoffCallBacks, (void*)stream);
+}
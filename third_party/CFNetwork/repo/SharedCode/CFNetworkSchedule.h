@@ -68,6 +68,66 @@ Boolean _SchedulesRemoveRunLoopAndMode(CFMutableArrayRef schedules, CFRunLoopRef
  */
 CFIndex _SchedulesFind(CFArrayRef schedules, CFRunLoopRef runLoop, CFStringRef runLoopMode);
 
+/*
+ *  A perform queue runs functions handed to it from any thread on the run loops it is scheduled on, in the
+ *  order they were enqueued.  Items are pushed without a lock, and only the enqueue which finds the queue
+ *  empty signals and wakes the run loops, taking the queue's schedule lock to do so; a burst of work thus
+ *  costs one lock and one wakeup, and is run in one pass.  release, if given,
+ *  is called with info once perform has been, or when the queue is destroyed with it pending.
+ *  Nothing may be enqueued once destruction has begun.
+ */
+typedef struct __CFNetworkPerformQueue* _CFNetworkPerformQueueRef;
+
+_CFNetworkPerformQueueRef _CFNetworkPerformQueueCreate(CFAllocatorRef alloc);
+void _CFNetworkPerformQueueDestroy(_CFNetworkPerformQueueRef queue);
+
+void _CFNetworkPerformQueueScheduleWithRunLoop(_CFNetworkPerformQueueRef queue, CFRunLoopRef runLoop, CFStringRef runLoopMode);
+void _CFNetworkPerformQueueUnscheduleFromRunLoop(_CFNetworkPerformQueueRef queue, CFRunLoopRef runLoop, CFStringRef runLoopMode);
+
+/*
+ *  Returns FALSE, with nothing enqueued and release not called, if there's no memory for the item.
+ */
+Boolean _CFNetworkPerformQueueEnqueue(_CFNetworkPerformQueueRef queue, void (*perform)(void* info), void* info, void (*release)(void* info));
+
+/*
+ *  Runs everything enqueued so far on the calling thread.
+ */
+void _CFNetworkPerformQueueDrain(_CFNetworkPerformQueueRef queue);
+
+/*
+ *  A pool of background threads, each running a run loop in kCFRunLoopDefaultMode, for network objects to be
+ *  scheduled on instead of the application's own run loops.  Acquire returns the least loaded run loop,
+ *  starting another thread while there are fewer than the limit and all are busy, and counts one more object
+ *  on it; relinquish counts one fewer.  NULL is returned if no thread could be started.  The limit defaults
+ *  to the number of processors, up to four, and applies to threads started after it is set.
+ */
+CFRunLoopRef _CFNetworkIORunLoopAcquire(void);
+void _CFNetworkIORunLoopRelinquish(CFRunLoopRef runLoop);
+
+void _CFNetworkSetIORunLoopLimit(CFIndex limit);
+
+/*
+ *  Runs perform on the thread of the given pool run loop.  Returns FALSE, having called release, if it could
+ *  not be handed over.
+ */
+Boolean _CFNetworkIORunLoopPerform(CFRunLoopRef runLoop, void (*perform)(void* info), void* info, void (*release)(void* info));
+
+/*
+ *  Schedules the object on a pool run loop, returning that run loop or NULL if there is none.  The object's
+ *  callbacks then come on the pool thread; unschedule with the run loop returned.
+ */
+CFRunLoopRef _CFTypeScheduleOnIORunLoop(CFTypeRef obj);
+void _CFTypeUnscheduleFromIORunLoop(CFTypeRef obj, CFRunLoopRef runLoop);
+
+/*
+ *  Returns a stream which reads the given one on a pool thread and hands its bytes and events over to the
+ *  run loops it is itself scheduled on.  Socket I/O, SSL and HTTP parsing for the given stream are all done
+ *  on the pool thread, so they go on while the client's run loop is busy; up to 64K is read ahead.  The
+ *  given stream must not have been opened, and properties may be set only before the returned stream is
+ *  opened.  Copying a property waits for the pool thread.
+ */
+CFReadStreamRef _CFReadStreamCreateWithIORunLoop(CFAllocatorRef alloc, CFReadStreamRef stream);
+
 #ifdef __cplusplus
 }
 #endif
@@ -161,6 +161,14 @@ CF_INLINE int _CFThreadSpawn(_CFThread *thread, void *(*func)(void *), void *arg
     return pthread_create(thread, NULL, func, arg);
 }
 
+CF_INLINE int _CFThreadJoin(_CFThread thread) {
+    return pthread_join(thread, NULL);
+}
+
+CF_INLINE int _CFThreadDetach(_CFThread thread) {
+    return pthread_detach(thread);
+}
+
 #else   // __WIN32__
 
 typedef CRITICAL_SECTION _CFMutex;
@@ -206,8 +214,87 @@ typedef HANDLE _CFThread;
 
 extern int _CFThreadSpawn(_CFThread *thread, void *(*func)(void *), void *arg);
 
+CF_INLINE int _CFThreadJoin(_CFThread thread) {
+    return (WaitForSingleObject(thread, INFINITE) == WAIT_OBJECT_0) ? 0 : -1;
+}
+
+CF_INLINE int _CFThreadDetach(_CFThread thread) {
+    // The spawned thread closes its own handle as it exits.
+    return 0;
+}
+
+#endif  // __WIN32__
+
+/*
+ * Insulation layer over condition variables
+ */
+
+#if !defined(__WIN32__)
+
+typedef pthread_cond_t _CFCondition;
+
+CF_INLINE void _CFConditionInit(_CFCondition *cond) {
+    pthread_cond_init(cond, NULL);
+}
+
+CF_INLINE void _CFConditionWait(_CFCondition *cond, _CFMutex *lock) {
+    pthread_cond_wait(cond, lock);
+}
+
+CF_INLINE void _CFConditionBroadcast(_CFCondition *cond) {
+    pthread_cond_broadcast(cond);
+}
+
+CF_INLINE void _CFConditionDestroy(_CFCondition *cond) {
+    pthread_cond_destroy(cond);
+}
+
+#else   // __WIN32__
+
+typedef CONDITION_VARIABLE _CFCondition;
+
+CF_INLINE void _CFConditionInit(_CFCondition *cond) {
+    InitializeConditionVariable(cond);
+}
+
+CF_INLINE void _CFConditionWait(_CFCondition *cond, _CFMutex *lock) {
+    SleepConditionVariableCS(cond, lock, INFINITE);
+}
+
+CF_INLINE void _CFConditionBroadcast(_CFCondition *cond) {
+    WakeAllConditionVariable(cond);
+}
+
+CF_INLINE void _CFConditionDestroy(_CFCondition *cond) {
+    // Condition variables hold no resources on Win32
+}
+
 #endif  // __WIN32__
 
+/*
+ * Atomic compare and swap of a pointer, with a full barrier, for lists which take no lock
+ */
+
+#if defined(__MACH__)
+
+CF_INLINE Boolean _CFAtomicCompareAndSwapPtr(void *oldValue, void *newValue, void * volatile *where) {
+    return OSAtomicCompareAndSwapPtrBarrier(oldValue, newValue, where);
+}
+
+#elif defined(__WIN32__)
+
+CF_INLINE Boolean _CFAtomicCompareAndSwapPtr(void *oldValue, void *newValue, void * volatile *where) {
+    return InterlockedCompareExchangePointer((PVOID volatile *)where, newValue, oldValue) == oldValue;
+}
+
+#else
+
+CF_INLINE Boolean _CFAtomicCompareAndSwapPtr(void *oldValue, void *newValue, void * volatile *where) {
+    return __sync_bool_compare_and_swap(where, oldValue, newValue);
+}
+
+#endif
+
 
 #if defined(__cplusplus)
 }
@@ -47,6 +47,13 @@
 #include <netdb.h>
 #include <sys/ioctl.h>
 #include <sys/fcntl.h>
+#include <sys/uio.h>
+#if defined(__linux__)
+#include <poll.h>
+#include <linux/errqueue.h>
+#include <sys/sendfile.h>
+#endif /* defined(__linux__) */
+#include <unistd.h>
 
 #include <CoreFoundation/CFStreamPriv.h>
 #include <CFNetwork/CFSocketStreamPriv.h>
@@ -90,8 +97,35 @@
 
 #define kSocketEvents ((CFOptionFlags)(kCFSocketReadCallBack | kCFSocketConnectCallBack | kCFSocketWriteCallBack))
 #define kReadWriteTimeoutInterval ((CFTimeInterval)75.0)
-#define kRecvBufferSize		((CFIndex)(32768L));
+#define kConnectionAttemptDelay ((CFTimeInterval)0.25)		/* RFC 8305 recommended default */
+#define kRecvBufferSize		((CFIndex)(32768L))
+#define kRecvBufferMinimumSize	((CFIndex)(4096L))
 #define kSecurityBufferSize	((CFIndex)(32768L));
+#define kWriteVectorMaximumCount	(16)
+#define kZeroCopyMinimumSize	((CFIndex)(16384L))		/* Below this, copying beats pinning pages and reaping completions */
+#define kZeroCopyReaperInterval	(250)				/* Milliseconds between retries of sends whose completions have stalled */
+#define kZeroCopyDrainTimeout	(1000)				/* Milliseconds to wait at close for completions the reaper couldn't take */
+#if defined(__MACH__)
+#define kSSLSessionCacheDefaultCapacity	((CFIndex)256)
+#define kSSLSessionCacheDefaultLifetime	((CFTimeInterval)600.0)	/* SecureTransport's own session cache timeout */
+#endif /* defined(__MACH__) */
+
+#if !defined(CFSOCKETSTREAM_USE_ZEROCOPY)
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define CFSOCKETSTREAM_USE_ZEROCOPY	1
+#else
+#define CFSOCKETSTREAM_USE_ZEROCOPY	0
+#endif
+#endif /* !defined(CFSOCKETSTREAM_USE_ZEROCOPY) */
+
+#if !defined(CFSOCKETSTREAM_USE_SENDFILE)
+#if defined(__linux__)
+#define CFSOCKETSTREAM_USE_SENDFILE	1
+#else
+#define CFSOCKETSTREAM_USE_SENDFILE	0
+#endif
+#endif /* !defined(CFSOCKETSTREAM_USE_SENDFILE) */
+#define kWriteFileBufferSize	((CFIndex)(32768L))		/* Copy size when a file can't go straight to the socket */
 
 #ifndef __MACH__
 const int kCFStreamErrorDomainSOCKS = 5;	/* On Mach this lives in CF for historical reasons, even though it is declared in CFNetwork */
@@ -140,6 +174,21 @@ CONST_STRING_DECL(_kCFStreamPropertySSLAllowAnonymousCiphers, "_kCFStreamPropert
 
 /* Properties made available as SPI */
 CONST_STRING_DECL(kCFStreamPropertyUseAddressCache, "kCFStreamPropertyUseAddressCache")
+CONST_STRING_DECL(kCFStreamPropertySocketHappyEyeballs, "kCFStreamPropertySocketHappyEyeballs")
+CONST_STRING_DECL(kCFStreamPropertySocketConnectionAttemptDelay, "kCFStreamPropertySocketConnectionAttemptDelay")
+CONST_STRING_DECL(kCFStreamPropertySocketConnectedAddress, "kCFStreamPropertySocketConnectedAddress")
+CONST_STRING_DECL(_kCFStreamPropertySocketMetrics, "_kCFStreamPropertySocketMetrics")
+CONST_STRING_DECL(_kCFStreamPropertySSLNegotiatedProtocol, "_kCFStreamPropertySSLNegotiatedProtocol")
+CONST_STRING_DECL(_kCFStreamSSLApplicationProtocols, "_kCFStreamSSLApplicationProtocols")
+#if defined(__MACH__)
+CONST_STRING_DECL(_kCFStreamPropertySSLSessionResumed, "_kCFStreamPropertySSLSessionResumed")
+CONST_STRING_DECL(_kCFStreamPropertySSLSessionCacheStatistics, "_kCFStreamPropertySSLSessionCacheStatistics")
+CONST_STRING_DECL(_kCFStreamSSLSessionCacheHits, "_kCFStreamSSLSessionCacheHits")
+CONST_STRING_DECL(_kCFStreamSSLSessionCacheMisses, "_kCFStreamSSLSessionCacheMisses")
+CONST_STRING_DECL(_kCFStreamSSLSessionCacheEvictions, "_kCFStreamSSLSessionCacheEvictions")
+CONST_STRING_DECL(_kCFStreamSSLSessionCacheExpirations, "_kCFStreamSSLSessionCacheExpirations")
+CONST_STRING_DECL(_kCFStreamSSLSessionCacheCount, "_kCFStreamSSLSessionCacheCount")
+#endif /* defined(__MACH__) */
 CONST_STRING_DECL(_kCFStreamSocketIChatWantsSubNet, "_kCFStreamSocketIChatWantsSubNet")
 CONST_STRING_DECL(_kCFStreamSocketCreatedCallBack, "_kCFStreamSocketCreatedCallBack")
 CONST_STRING_DECL(kCFStreamPropertyProxyExceptionsList, "ExceptionsList")
@@ -159,11 +208,12 @@ CONST_STRING_DECL(kCFStreamPropertyPreviousCONNECTResponse, "kCFStreamPropertyPr
 #define _kCFStreamProxySettingSOCKSEnable			CFSTR("SOCKSEnable")
 #define _kCFStreamPropertySocketRemotePort			CFSTR("_kCFStreamPropertySocketRemotePort")
 #define _kCFStreamPropertySocketAddressAttempt		CFSTR("_kCFStreamPropertySocketAddressAttempt")
+#define _kCFStreamPropertySocketAddressOrder		CFSTR("_kCFStreamPropertySocketAddressOrder")
+#define _kCFStreamPropertySocketConnectAttempts		CFSTR("_kCFStreamPropertySocketConnectAttempts")
+#define _kCFStreamPropertySocketConnectAttemptTimer	CFSTR("_kCFStreamPropertySocketConnectAttemptTimer")
 #define _kCFStreamPropertySocketFamilyTypeProtocol	CFSTR("_kCFStreamPropertySocketFamilyTypeProtocol")
 #define _kCFStreamPropertyHostForOpen				CFSTR("_kCFStreamPropertyHostForOpen")
 #define _kCFStreamPropertyNetworkReachability		CFSTR("_kCFStreamPropertyNetworkReachability")
-#define _kCFStreamPropertyRecvBuffer				CFSTR("_kCFStreamPropertyRecvBuffer")
-#define _kCFStreamPropertyRecvBufferCount			CFSTR("_kCFStreamPropertyRecvBufferCount")
 #define _kCFStreamPropertyRecvBufferSize			CFSTR("_kCFStreamPropertyRecvBufferSize")
 #define _kCFStreamPropertySecurityRecvBuffer		CFSTR("_kCFStreamPropertySecurityRecvBuffer")
 #define _kCFStreamPropertySecurityRecvBufferSize	CFSTR("_kCFStreamPropertySecurityRecvBufferSize")
@@ -176,15 +226,17 @@ CONST_STRING_DECL(kCFStreamPropertyPreviousCONNECTResponse, "kCFStreamPropertyPr
 #define _kCFStreamPropertyWriteTimeout				CFSTR("_kCFStreamPropertyWriteTimeout")
 #define _kCFStreamPropertyReadCancel				CFSTR("_kCFStreamPropertyReadCancel")
 #define _kCFStreamPropertyWriteCancel				CFSTR("_kCFStreamPropertyWriteCancel")
+#define _kCFStreamPropertySocketWriteStream		CFSTR("_kCFStreamPropertySocketWriteStream")
 #else
 CONST_STRING_DECL_LOCAL(_kCFStreamProxySettingSOCKSEnable, "SOCKSEnable")
 CONST_STRING_DECL_LOCAL(_kCFStreamPropertySocketRemotePort, "_kCFStreamPropertySocketRemotePort")
 CONST_STRING_DECL_LOCAL(_kCFStreamPropertySocketAddressAttempt, "_kCFStreamPropertySocketAddressAttempt")
+CONST_STRING_DECL_LOCAL(_kCFStreamPropertySocketAddressOrder, "_kCFStreamPropertySocketAddressOrder")
+CONST_STRING_DECL_LOCAL(_kCFStreamPropertySocketConnectAttempts, "_kCFStreamPropertySocketConnectAttempts")
+CONST_STRING_DECL_LOCAL(_kCFStreamPropertySocketConnectAttemptTimer, "_kCFStreamPropertySocketConnectAttemptTimer")
 CONST_STRING_DECL_LOCAL(_kCFStreamPropertySocketFamilyTypeProtocol, "_kCFStreamPropertySocketFamilyTypeProtocol")
 CONST_STRING_DECL_LOCAL(_kCFStreamPropertyHostForOpen, "_kCFStreamPropertyHostForOpen")
 CONST_STRING_DECL_LOCAL(_kCFStreamPropertyNetworkReachability, "_kCFStreamPropertyNetworkReachability")
-CONST_STRING_DECL_LOCAL(_kCFStreamPropertyRecvBuffer, "_kCFStreamPropertyRecvBuffer")
-CONST_STRING_DECL_LOCAL(_kCFStreamPropertyRecvBufferCount, "_kCFStreamPropertyRecvBufferCount")
 CONST_STRING_DECL_LOCAL(_kCFStreamPropertyRecvBufferSize, "_kCFStreamPropertyRecvBufferSize")
 CONST_STRING_DECL_LOCAL(_kCFStreamPropertySecurityRecvBuffer, "_kCFStreamPropertySecurityRecvBuffer")
 CONST_STRING_DECL_LOCAL(_kCFStreamPropertySecurityRecvBufferSize, "_kCFStreamPropertySecurityRecvBufferSize")
@@ -195,6 +247,7 @@ CONST_STRING_DECL_LOCAL(_kCFStreamPropertySOCKSSendBuffer, "_kCFStreamPropertySO
 CONST_STRING_DECL_LOCAL(_kCFStreamPropertySOCKSRecvBuffer, "_kCFStreamPropertySOCKSRecvBuffer")
 CONST_STRING_DECL_LOCAL(_kCFStreamPropertyReadCancel, "_kCFStreamPropertyReadCancel")
 CONST_STRING_DECL_LOCAL(_kCFStreamPropertyWriteCancel, "_kCFStreamPropertyWriteCancel")
+CONST_STRING_DECL_LOCAL(_kCFStreamPropertySocketWriteStream, "_kCFStreamPropertySocketWriteStream")
 CONST_STRING_DECL_LOCAL(_kCFStreamPropertyReadTimeout, "_kCFStreamPropertyReadTimeout")
 CONST_STRING_DECL_LOCAL(_kCFStreamPropertyWriteTimeout, "_kCFStreamPropertyWriteTimeout")
 #endif	/* __CONSTANT_CFSTRINGS__ */
@@ -321,6 +374,8 @@ enum {
 	kFlagBitHasHandshakes,		/* Performance check for handshakes. */
 	kFlagBitIsBuffered,			/* Performance check for using buffered reads. */
 	kFlagBitRecvdRead,			/* On buffered streams, indicates that a read event has been received but buffer was full. */
+	kFlagBitZeroCopyTried,		/* SO_ZEROCOPY has been requested on the socket. */
+	kFlagBitZeroCopyEnabled,	/* The socket accepted SO_ZEROCOPY, so large vectored writes may use MSG_ZEROCOPY. */
 	
 	kFlagBitReadHasCancel,		/* Performance check for detecting run loop source for canceling synchronous read. */
 	kFlagBitWriteHasCancel,		/* Performance check for detecting run loop source for canceling synchronous write. */
@@ -345,6 +400,79 @@ enum {
 #if 0
 #pragma mark -
 #pragma mark Type Declarations
+#pragma mark *Receive Buffer
+#endif
+
+typedef struct {
+	
+	UInt8*						_bytes;				/* Ring storage; allocated on the first buffered read */
+	CFIndex						_capacity;			/* Current size of _bytes */
+	CFIndex						_limit;				/* Largest _capacity may grow (_kCFStreamPropertyRecvBufferSize) */
+	CFIndex						_head;				/* Offset of the oldest unread byte */
+	CFIndex						_count;				/* Number of unread bytes */
+	CFIndex						_peak;				/* Largest _count since the last resize */
+	
+} _CFSocketStreamBuffer;
+
+#if 0
+#pragma mark *Zero-Copy Sends
+#endif
+
+typedef struct {
+	
+	CFMutableArrayRef			_pending;			/* Buffers of each MSG_ZEROCOPY send in order; kCFNull once completed */
+	UInt32						_first;				/* Kernel sequence number of the send at _pending[0] */
+	
+} _CFSocketStreamZeroCopy;
+
+typedef struct _ZeroCopyReaperEntry {
+	
+	struct _ZeroCopyReaperEntry*	_next;
+	int								_socket;		/* Duplicate of the closed stream's socket, for its error queue */
+	CFMutableArrayRef				_pending;		/* As _CFSocketStreamZeroCopy */
+	UInt32							_first;			/* As _CFSocketStreamZeroCopy */
+	Boolean							_stalled;		/* Nothing completed last time, so only retry on the interval */
+	
+} _ZeroCopyReaperEntry;
+
+#if 0
+#pragma mark *File Sends
+#endif
+
+typedef struct {
+	
+	int							_fd;				/* Open file from which to send */
+	off_t						_offset;			/* Offset in the file of the first byte to send */
+	CFIndex						_length;			/* Most bytes to send */
+	
+} _SocketStreamFileRange;
+
+#if 0
+#pragma mark *SSL Sessions
+#endif
+
+#if defined(__MACH__)
+typedef struct _SSLSessionCacheEntry {
+	
+	struct _SSLSessionCacheEntry*	_prev;			/* More recently used entry */
+	struct _SSLSessionCacheEntry*	_next;			/* Less recently used entry */
+	CFStringRef						_key;			/* <host>:<port>/<SNI name> of the far end */
+	UInt32							_generation;	/* Tells successive sessions for the key apart */
+	CFAbsoluteTime					_expires;		/* When the session lapses; zero until one is established */
+	
+} _SSLSessionCacheEntry;
+#endif /* defined(__MACH__) */
+
+typedef struct {
+	
+	CFStringRef					_key;				/* Session cache key; NULL if the peer ID is the address */
+	UInt32						_generation;		/* Generation of the key in the peer ID */
+	Boolean						_resumed;			/* The handshake resumed a cached session */
+	CFStringRef					_protocol;			/* Application protocol the server chose by ALPN, if any */
+	
+} _CFSocketStreamSSLSession;
+
+#if 0
 #pragma mark *CFStream Context
 #endif
 
@@ -368,6 +496,14 @@ typedef struct {
 		
 	CFMutableDictionaryRef		_properties;		/* Host and port and reachability should be here too. */
 	
+	_CFSocketStreamBuffer		_recvBuffer;		/* Bytes read ahead for buffered reads (e.g. SSL) */
+	
+	_CFSocketStreamZeroCopy		_zeroCopy;			/* Sends the kernel may still be reading from */
+	
+	_CFSocketStreamMetrics		_metrics;			/* Phase timestamps and byte counts */
+	
+	_CFSocketStreamSSLSession	_session;			/* Session cache entry used by the SSL handshake */
+	
 } _CFSocketStreamContext;
 
 #if 0
@@ -406,6 +542,7 @@ static void _SocketCallBack(CFSocketRef s, CFSocketCallBackType type, CFDataRef
 static void _HostCallBack(CFHostRef theHost, CFHostInfoType typeInfo, const CFStreamError* error, _CFSocketStreamContext* info);
 static void _NetServiceCallBack(CFNetServiceRef theService, CFStreamError* error, _CFSocketStreamContext* info);
 static void _SocksHostCallBack(CFHostRef theHost, CFHostInfoType typeInfo, const CFStreamError* error, _CFSocketStreamContext* info);
+static void _ConnectAttemptTimerCallBack(CFRunLoopTimerRef timer, _CFSocketStreamContext* info);
 #if defined(__MACH__)
 static void _ReachabilityCallBack(SCNetworkReachabilityRef target, const SCNetworkConnectionFlags flags, _CFSocketStreamContext* ctxt);
 static void _NetworkConnectionCallBack(SCNetworkConnectionRef conn, SCNetworkConnectionStatus status, _CFSocketStreamContext* ctxt);
@@ -422,10 +559,13 @@ static void _SocketStreamUnschedule_NoLock(CFTypeRef stream, CFRunLoopRef runLoo
 
 static CFNumberRef _CFNumberCopyPortForOpen(CFDictionaryRef properties);
 static CFDataRef _CFDataCopyAddressByInjectingPort(CFDataRef address, CFNumberRef port);
+static CFArrayRef _CFArrayCreateInterleavedAddresses(CFAllocatorRef alloc, CFArrayRef addresses);
 static Boolean _ScheduleAndStartLookup(CFTypeRef lookup, CFArrayRef* schedules, CFStreamError* error, const void* cb, void* info);
 
 static CFIndex _CFSocketRecv(CFSocketRef s, UInt8* buffer, CFIndex length, CFStreamError* error);
 static CFIndex _CFSocketSend(CFSocketRef s, const UInt8* buffer, CFIndex length, CFStreamError* error);
+static CFIndex _CFSocketSendVector(CFSocketRef s, const struct iovec* vector, int count, int flags, CFStreamError* error);
+static CFIndex _CFSocketSendFile(CFSocketRef s, int fd, off_t offset, CFIndex length, CFStreamError* error);
 static Boolean _CFSocketCan(CFSocketRef s, int mode);
 
 static _CFSocketStreamContext* _SocketStreamCreateContext(CFAllocatorRef alloc);
@@ -435,6 +575,12 @@ static Boolean _SocketStreamStartLookupForOpen_NoLock(_CFSocketStreamContext* ct
 static Boolean _SocketStreamCreateSocket_NoLock(_CFSocketStreamContext* ctxt, CFDataRef address);
 static Boolean _SocketStreamConnect_NoLock(_CFSocketStreamContext* ctxt, CFDataRef address);
 static Boolean _SocketStreamAttemptNextConnection_NoLock(_CFSocketStreamContext* ctxt);
+static Boolean _SocketStreamRaceNextConnection_NoLock(_CFSocketStreamContext* ctxt, CFArrayRef list, SInt32* attempt, CFNumberRef port);
+static Boolean _SocketStreamResolveConnectRace_NoLock(_CFSocketStreamContext* ctxt, CFSocketRef s, const void* error);
+static void _SocketStreamCancelConnectRace_NoLock(_CFSocketStreamContext* ctxt);
+static void _SocketStreamStartConnectAttemptTimer_NoLock(_CFSocketStreamContext* ctxt);
+static void _SocketStreamCancelConnectAttemptTimer_NoLock(_CFSocketStreamContext* ctxt);
+static void _SocketStreamDisposeSocket_NoLock(_CFSocketStreamContext* ctxt, CFSocketRef s);
 
 static Boolean _SocketStreamCan(_CFSocketStreamContext* ctxt, CFTypeRef stream, int test, CFStringRef mode, CFStreamError* error);
 
@@ -449,9 +595,23 @@ static void _SocketStreamRemoveHandshake_NoLock(_CFSocketStreamContext* ctxt, _C
 
 static void _SocketStreamAttemptAutoVPN_NoLock(_CFSocketStreamContext* ctxt, CFStringRef name);
 
+static Boolean _SocketStreamBufferReserve_NoLock(_CFSocketStreamContext* ctxt, UInt8** space, CFIndex* length);
+static Boolean _SocketStreamBufferResize(CFAllocatorRef alloc, _CFSocketStreamBuffer* buffer, CFIndex capacity);
 static CFIndex _SocketStreamBufferedRead_NoLock(_CFSocketStreamContext* ctxt, UInt8* buffer, CFIndex length);
 static void _SocketStreamBufferedSocketRead_NoLock(_CFSocketStreamContext* ctxt);
 
+static CFIndex _SocketStreamWriteVector(CFWriteStreamRef stream, const struct iovec* vector, int count, CFArrayRef owners, const _SocketStreamFileRange* file, CFStreamError* error, _CFSocketStreamContext* ctxt);
+static CFIndex _SocketStreamSendVector_NoLock(_CFSocketStreamContext* ctxt, const struct iovec* vector, int count, CFArrayRef owners);
+static void _SocketStreamZeroCopyReap_NoLock(_CFSocketStreamContext* ctxt);
+static void _SocketStreamZeroCopyFinish_NoLock(_CFSocketStreamContext* ctxt);
+#if CFSOCKETSTREAM_USE_ZEROCOPY
+static Boolean _ZeroCopyReapSocket(int s, CFMutableArrayRef pending, UInt32* first);
+static Boolean _ZeroCopyReaperAdopt(int s, Boolean shutdownWrite, CFMutableArrayRef pending, UInt32 first);
+static void _ZeroCopyDrainSocket(int s, Boolean shutdownWrite, CFMutableArrayRef pending, UInt32* first);
+static void _ZeroCopyReaperInitialize(void);
+static void* _ZeroCopyReaperMain(void* info);
+#endif /* CFSOCKETSTREAM_USE_ZEROCOPY */
+
 static void _SocketStreamPerformCancel(void* info);
 
 CF_INLINE SInt32 _LastError(CFStreamError* error) {
@@ -530,8 +690,20 @@ static Boolean _SocketStreamSecuritySetAuthenticatesServerCertificates_NoLock(_C
 #if defined(__MACH__)
 static CFStringRef _SecurityGetProtocol(SSLContextRef security);
 static SSLSessionState _SocketStreamSecurityGetSessionState_NoLock(_CFSocketStreamContext* ctxt);
+static CFStringRef _SocketStreamSecurityCopySessionKey_NoLock(_CFSocketStreamContext* ctxt, SSLContextRef ssl);
+#endif
+
+#if 0
+#pragma mark *SSL Session Cache
 #endif
 
+#if defined(__MACH__)
+static void _SSLSessionCacheRemove(_SSLSessionCacheEntry* entry);
+static UInt32 _SSLSessionCacheCheckOut(CFStringRef key);
+static void _SSLSessionCacheCheckIn(CFStringRef key, UInt32 generation, Boolean resumed);
+static CFDictionaryRef _SSLSessionCacheCopyStatistics(CFAllocatorRef alloc);
+#endif /* defined(__MACH__) */
+
 #if 0
 #pragma mark -
 #pragma mark Extern Function Declarations
@@ -928,11 +1100,8 @@ _SocketStreamRead(CFReadStreamRef stream, UInt8* buffer, CFIndex bufferLength,
 			/* Right now only SSL is using the buffered reads. */
 			if (__CFBitIsSet(ctxt->_flags, kFlagBitIsBuffered)) {
 				
-				/* Attempt to get the count of buffered bytes. */
-				CFDataRef c = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
-										
 				/* Are there bytes or has SSL closed the connection? */
-				if (__CFBitIsSet(ctxt->_flags, kFlagBitClosed) || (c && *((CFIndex*)CFDataGetBytePtr(c)))) {
+				if (__CFBitIsSet(ctxt->_flags, kFlagBitClosed) || ctxt->_recvBuffer._count) {
 					__CFBitSet(ctxt->_flags, kFlagBitCanRead);
 					__CFBitClear(ctxt->_flags, kFlagBitPollRead);
 					event = kCFStreamEventHasBytesAvailable;
@@ -999,6 +1168,10 @@ _SocketStreamRead(CFReadStreamRef stream, UInt8* buffer, CFIndex bufferLength,
 		CFSocketDisableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
 	}
 	
+	/* Account for the bytes handed back. */
+	if (result > 0)
+		ctxt->_metrics.bytesRead += result;
+	
 	/* Unlock */
 	__CFSpinUnlock(&ctxt->_lock);
 	
@@ -1021,11 +1194,8 @@ _SocketStreamCanRead(CFReadStreamRef stream, _CFSocketStreamContext* ctxt) {
 	/* Right now only SSL is using the buffered reads. */
 	if (!__CFBitIsSet(ctxt->_flags, kFlagBitHasHandshakes) && __CFBitIsSet(ctxt->_flags, kFlagBitIsBuffered)) {
 		
-		/* Similar to the end of _SocketStreamRead. */
-		CFDataRef c = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
-		
-		/* Need to check for buffered bytes or EOF. */
-		if (__CFBitIsSet(ctxt->_flags, kFlagBitClosed) || (c && *((CFIndex*)CFDataGetBytePtr(c)))) {
+		/* Similar to the end of _SocketStreamRead.  Need to check for buffered bytes or EOF. */
+		if (__CFBitIsSet(ctxt->_flags, kFlagBitClosed) || ctxt->_recvBuffer._count) {
 			
 			result = TRUE;
 						
@@ -1071,6 +1241,20 @@ _SocketStreamCanRead(CFReadStreamRef stream, _CFSocketStreamContext* ctxt) {
 /* static */ CFIndex
 _SocketStreamWrite(CFWriteStreamRef stream, const UInt8* buffer, CFIndex bufferLength,
 				   CFStreamError* error, _CFSocketStreamContext* ctxt)
+{
+	struct iovec vector;
+	
+	vector.iov_base = (void*)buffer;
+	vector.iov_len = bufferLength;
+	
+	/* The client may reuse the buffer as soon as this returns, so there are no owners to hold for zero-copy. */
+	return _SocketStreamWriteVector(stream, &vector, 1, NULL, NULL, error, ctxt);
+}
+
+
+/* static */ CFIndex
+_SocketStreamWriteVector(CFWriteStreamRef stream, const struct iovec* vector, int count, CFArrayRef owners,
+						 const _SocketStreamFileRange* file, CFStreamError* error, _CFSocketStreamContext* ctxt)
 {
 	CFIndex result = 0;
 	CFStreamEventType event = kCFStreamEventNone;
@@ -1162,12 +1346,17 @@ _SocketStreamWrite(CFWriteStreamRef stream, const UInt8* buffer, CFIndex bufferL
 		/* If there's no error, try to write now. */
 		if (!ctxt->_error.error) {
 		
+			/* A file range goes in place of the vector, straight from the file to the socket. */
+			if (file)
+				result = _CFSocketSendFile(ctxt->_socket, file->_fd, file->_offset, file->_length, &ctxt->_error);
+			else
 #if defined(__MACH__)
+			/* SecureTransport takes one buffer at a time; a short write is allowed. */
 			if (__CFBitIsSet(ctxt->_flags, kFlagBitUseSSL))
-				result = _SocketStreamSecuritySend_NoLock(ctxt, buffer, bufferLength);
+				result = _SocketStreamSecuritySend_NoLock(ctxt, (const UInt8*)vector[0].iov_base, vector[0].iov_len);
 			else
 #endif /* defined(__MACH__)  */
-				result = _CFSocketSend(ctxt->_socket, buffer, bufferLength, &ctxt->_error);
+				result = _SocketStreamSendVector_NoLock(ctxt, vector, count, owners);
 		}
 		
 		/* Did a write, so the event is no longer good. */
@@ -1185,10 +1374,8 @@ _SocketStreamWrite(CFWriteStreamRef stream, const UInt8* buffer, CFIndex bufferL
 	/* If there was an error, make sure to propagate and signal. */
 	if (ctxt->_error.error) {
 	
-		CFDataRef c = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
-		
 		/* 3863115 Only signal the read error if it's not buffered and no bytes waiting. */
-		if (!c || !*((CFIndex*)CFDataGetBytePtr(c))) {
+		if (!ctxt->_recvBuffer._count) {
 			
 			/* Copy the error for return */
 			memmove(error, &ctxt->_error, sizeof(error[0]));
@@ -1238,6 +1425,10 @@ _SocketStreamWrite(CFWriteStreamRef stream, const UInt8* buffer, CFIndex bufferL
 		}
 	}
 	
+	/* Account for the bytes taken. */
+	if (result > 0)
+		ctxt->_metrics.bytesWritten += result;
+	
 	/* Unlock */
 	__CFSpinUnlock(&ctxt->_lock);
 	
@@ -1328,6 +1519,13 @@ _SocketStreamClose(CFTypeRef stream, _CFSocketStreamContext* ctxt) {
 		/* Unscheduled and invalidated, so let them go. */
 		CFArrayRemoveAllValues(ctxt->_schedulables);
 		
+		/* Any connect race still running was invalidated with the schedulables. */
+		CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySocketConnectAttempts);
+		CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySocketConnectAttemptTimer);
+		
+		/* Give the kernel a chance to finish with any zero-copy sends before the socket goes. */
+		_SocketStreamZeroCopyFinish_NoLock(ctxt);
+		
 		/* Take care of the socket if there is one. */
 		if (ctxt->_socket) {
 			
@@ -1400,6 +1598,37 @@ _SocketStreamCopyProperty(CFTypeRef stream, CFStringRef propertyName, _CFSocketS
 			result = CFDataCreate(CFGetAllocator(stream), (const void*)(&s), sizeof(s));
 		}
 		
+		/* Hand back a snapshot of the phase timings and byte counts. */
+		else if (CFEqual(_kCFStreamPropertySocketMetrics, propertyName)) {
+			result = CFDataCreate(CFGetAllocator(stream), (const UInt8*)(&ctxt->_metrics), sizeof(ctxt->_metrics));
+		}
+		
+#if defined(__MACH__)
+		/* Only known once the SSL handshake is done. */
+		else if (CFEqual(_kCFStreamPropertySSLSessionResumed, propertyName)) {
+			if (__CFBitIsSet(ctxt->_flags, kFlagBitUseSSL))
+				result = CFRetain(ctxt->_session._resumed ? kCFBooleanTrue : kCFBooleanFalse);
+		}
+#endif /* defined(__MACH__) */
+		
+		/* Also only known once the SSL handshake is done, and only if the server took part in ALPN. */
+		else if (CFEqual(_kCFStreamPropertySSLNegotiatedProtocol, propertyName)) {
+			if (ctxt->_session._protocol)
+				result = CFRetain(ctxt->_session._protocol);
+		}
+		
+#if defined(__MACH__)
+		/* The session cache is process-wide, so any stream can report it. */
+		else if (CFEqual(_kCFStreamPropertySSLSessionCacheStatistics, propertyName)) {
+			result = _SSLSessionCacheCopyStatistics(CFGetAllocator(stream));
+		}
+#endif /* defined(__MACH__) */
+		
+		/* Lets _CFWriteStreamWriteDataVector tell this stream apart from filters forwarding to it. */
+		else if (CFEqual(_kCFStreamPropertySocketWriteStream, propertyName) && (stream == ctxt->_clientWriteStream)) {
+			result = CFRetain(stream);
+		}
+		
 		/* Support for legacy ordering.  Response was available right away. */
 		else if (CFEqual(kCFStreamPropertyCONNECTResponse, propertyName)) {
 
@@ -1501,7 +1730,9 @@ _SocketStreamSetProperty(CFTypeRef stream, CFStringRef propertyName, CFTypeRef p
 	__CFSpinLock(&ctxt->_lock);
 	
 	if (CFEqual(propertyName, kCFStreamPropertyUseAddressCache) ||
-		CFEqual(propertyName, _kCFStreamSocketIChatWantsSubNet))
+		CFEqual(propertyName, _kCFStreamSocketIChatWantsSubNet) ||
+		CFEqual(propertyName, kCFStreamPropertySocketHappyEyeballs) ||
+		CFEqual(propertyName, kCFStreamPropertySocketConnectionAttemptDelay))
 	{
 		
 		if (propertyValue)
@@ -1677,10 +1908,12 @@ _SocketStreamSetProperty(CFTypeRef stream, CFStringRef propertyName, CFTypeRef p
 		if (!propertyValue) {
 			CFDictionaryRemoveValue(ctxt->_properties, propertyName);
 			__CFBitClear(ctxt->_flags, kFlagBitIsBuffered);
+			ctxt->_recvBuffer._limit = 0;
 		}
 		else if (CFNumberGetByteSize(propertyValue) == sizeof(CFIndex)) {
 			CFDictionarySetValue(ctxt->_properties, propertyName, propertyValue);
 			__CFBitSet(ctxt->_flags, kFlagBitIsBuffered);
+			CFNumberGetValue(propertyValue, kCFNumberCFIndexType, &ctxt->_recvBuffer._limit);
 		}
 			
 		result = TRUE;
@@ -1689,14 +1922,11 @@ _SocketStreamSetProperty(CFTypeRef stream, CFStringRef propertyName, CFTypeRef p
 	/* 3800596 Need to signal errors if setting property caused one. */
 	if (ctxt->_error.error) {
 
-		/* Attempt to get the count of buffered bytes. */
-		CFDataRef c = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
-		
 		/*
 		** 3863115 If there is a client stream and it's been opened, signal
 		** the error, but only if there is no bytes sitting in the buffer.
 		*/
-		if ((!c || !*((CFIndex*)CFDataGetBytePtr(c))) &&
+		if (!ctxt->_recvBuffer._count &&
 			(ctxt->_clientReadStream && __CFBitIsSet(ctxt->_flags, kFlagBitReadStreamOpened)))
 		{
 			_CFReadStreamSignalEventDelayed(ctxt->_clientReadStream, kCFStreamEventErrorOccurred, &ctxt->_error);
@@ -1757,27 +1987,47 @@ _SocketCallBack(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, con
 	CFWriteStreamRef wStream = NULL;
 	CFStreamEventType event = kCFStreamEventNone;
 	CFStreamError error = {0, 0};
+	Boolean reaped = FALSE;
 	
 	__CFSpinLock(&ctxt->_lock);
 
+	/* Zero-copy completions leave the socket looking readable, so take them off first. */
+	if (ctxt->_zeroCopy._pending && (s == ctxt->_socket)) {
+		_SocketStreamZeroCopyReap_NoLock(ctxt);
+		reaped = TRUE;
+	}
+	
 	if (!ctxt->_error.error) {
 
 		switch (type) {
 			
 			case kCFSocketConnectCallBack:
 				
+				/* Racing connects are settled before the stream sees the winner. */
+				if ((s != ctxt->_socket) && !_SocketStreamResolveConnectRace_NoLock(ctxt, s, data))
+					break;
+				
 				if (!data) {
 
+					CFDataRef peer;
 #if defined(__MACH__)
 					/* See if the client has turned off the error detection. */
 					CFBooleanRef reach = (CFBooleanRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertyAutoErrorOnSystemChange);
 #endif /* defined(__MACH__) */
 				
+					/* Remember the address which was actually connected. */
+					if ((peer = CFSocketCopyPeerAddress(s))) {
+						CFDictionarySetValue(ctxt->_properties, kCFStreamPropertySocketConnectedAddress, peer);
+						CFRelease(peer);
+					}
+					
 					/* Mark as open. */
 					__CFBitClear(ctxt->_flags, kFlagBitOpenStarted);
 					__CFBitSet(ctxt->_flags, kFlagBitOpenComplete);
 					__CFBitClear(ctxt->_flags, kFlagBitPollOpen);
 					
+					ctxt->_metrics.connectEnd = _CFNetworkGetMonotonicTime();
+					
 					/* Get the streams and event to signal. */
 					event = kCFStreamEventOpenCompleted;
 					
@@ -1824,6 +2074,18 @@ _SocketCallBack(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, con
 			
 			case kCFSocketReadCallBack:
 				
+				/* If only completions were waiting, there's nothing to read; end of stream still is. */
+				if (reaped) {
+					
+					UInt8 peek;
+					
+					if ((recv(CFSocketGetNative(s), &peek, sizeof(peek), MSG_PEEK | MSG_DONTWAIT) < 0) &&
+						((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+					{
+						break;
+					}
+				}
+				
 				/* If handshakes in place, pump those along. */
 				if (__CFBitIsSet(ctxt->_flags, kFlagBitHasHandshakes)) {
 					CFArrayRef handshakes = (CFArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyHandshakes);
@@ -1936,10 +2198,8 @@ _SocketCallBack(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, con
 		/* 3863115 Only signal the read error if it's not buffered and no bytes waiting. */
 		if (rStream && (event == kCFStreamEventErrorOccurred)) {
 			
-			CFDataRef c = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
-			
 			/* If there are bytes waiting, turn the event into a read event. */
-			if (c && *((CFIndex*)CFDataGetBytePtr(c))) {
+			if (ctxt->_recvBuffer._count) {
 				event = kCFStreamEventHasBytesAvailable;
 				memset(&error, 0, sizeof(error));
 			}
@@ -1999,6 +2259,8 @@ _HostCallBack(CFHostRef theHost, CFHostInfoType typeInfo, const CFStreamError* e
 	/* Handle the error */
 	if (error->error)
 		memmove(&(ctxt->_error), error, sizeof(error[0]));
+	
+	ctxt->_metrics.lookupEnd = _CFNetworkGetMonotonicTime();
 					
 	/* Remove the host from the schedulables since it's done. */
 	_SchedulablesRemove(ctxt->_schedulables, theHost);
@@ -2132,6 +2394,8 @@ _NetServiceCallBack(CFNetServiceRef theService, CFStreamError* error, _CFSocketS
 	if (error->error)
 		memmove(&(ctxt->_error), error, sizeof(error[0]));
 	
+	ctxt->_metrics.lookupEnd = _CFNetworkGetMonotonicTime();
+	
 	/* Remove the host from the schedulables since it's done. */
 	_SchedulablesRemove(ctxt->_schedulables, theService);
 	
@@ -2251,12 +2515,36 @@ _SocksHostCallBack(CFHostRef theHost, CFHostInfoType typeInfo, const CFStreamErr
 	}
 }
 
+
+/* static */ void
+_ConnectAttemptTimerCallBack(CFRunLoopTimerRef timer, _CFSocketStreamContext* ctxt) {
+	
+	/* Lock down the context. */
+	__CFSpinLock(&ctxt->_lock);
+	
+	/* Only the armed timer counts; a cancelled one may have already been in flight. */
+	if (timer == (CFRunLoopTimerRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketConnectAttemptTimer)) {
+		
+		/* One-shot, so get rid of it. */
+		_SocketStreamCancelConnectAttemptTimer_NoLock(ctxt);
+		
+		/*
+		** Nobody has won yet, so give the next address a try alongside
+		** the ones in flight.  Since there are attempts in flight, this
+		** can't fail the open.
+		*/
+		if (!ctxt->_error.error && !__CFBitIsSet(ctxt->_flags, kFlagBitOpenComplete))
+			_SocketStreamAttemptNextConnection_NoLock(ctxt);
+	}
+	
+	/* Unlock now. */
+	__CFSpinUnlock(&ctxt->_lock);
+}
+
 #if defined(__MACH__)
 /* static */ void
 _ReachabilityCallBack(SCNetworkReachabilityRef target, const SCNetworkConnectionFlags flags, _CFSocketStreamContext* ctxt) {
 
-	CFDataRef c;
-	
 	/*
     ** 3483384 If the reachability callback fires, there was a change in
     ** routing for this pair and it should get an error.
@@ -2268,14 +2556,11 @@ _ReachabilityCallBack(SCNetworkReachabilityRef target, const SCNetworkConnection
     ctxt->_error.error = ENOTCONN;
     ctxt->_error.domain = _kCFStreamErrorDomainNativeSockets;
 
-	/* Attempt to get the count of buffered bytes. */
-	c = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
-
 	/*
 	** 3863115 If there is a client stream and it's been opened, signal the error, but
 	** only if there are no bytes sitting in the buffer.
 	*/
-	if ((!c || !*((CFIndex*)CFDataGetBytePtr(c))) &&
+	if (!ctxt->_recvBuffer._count &&
 		(ctxt->_clientReadStream && __CFBitIsSet(ctxt->_flags, kFlagBitReadStreamOpened)))
 	{
 		_CFReadStreamSignalEventDelayed(ctxt->_clientReadStream, kCFStreamEventErrorOccurred, &ctxt->_error);
@@ -2454,6 +2739,9 @@ _SocketStreamDestroyContext_NoLock(CFAllocatorRef alloc, _CFSocketStreamContext*
 		CFRelease(ctxt->_schedulables);
 	}
 	
+	/* Release whatever zero-copy sends are still outstanding. */
+	_SocketStreamZeroCopyFinish_NoLock(ctxt);
+	
 	/* Get rid of the socket */
 	if (ctxt->_socket) {
 		
@@ -2471,6 +2759,16 @@ _SocketStreamDestroyContext_NoLock(CFAllocatorRef alloc, _CFSocketStreamContext*
 	if (ctxt->_properties)
 		CFRelease(ctxt->_properties);
 	
+	/* Toss the receive buffer */
+	if (ctxt->_recvBuffer._bytes)
+		CFAllocatorDeallocate(alloc, ctxt->_recvBuffer._bytes);
+	
+	if (ctxt->_session._key)
+		CFRelease(ctxt->_session._key);
+	
+	if (ctxt->_session._protocol)
+		CFRelease(ctxt->_session._protocol);
+	
 	/* Toss the context */
 	CFAllocatorDeallocate(alloc, ctxt);
 }
@@ -2775,6 +3073,57 @@ _CFDataCopyAddressByInjectingPort(CFDataRef address, CFNumberRef port) {
 	return address;
 }
 
+
+/* static */ CFArrayRef
+_CFArrayCreateInterleavedAddresses(CFAllocatorRef alloc, CFArrayRef addresses) {
+	
+	CFIndex i, p = 0, s = 0;
+	CFIndex count = CFArrayGetCount(addresses);
+	CFMutableArrayRef result = CFArrayCreateMutable(alloc, count, &kCFTypeArrayCallBacks);
+	CFMutableArrayRef preferred = CFArrayCreateMutable(alloc, count, &kCFTypeArrayCallBacks);
+	CFMutableArrayRef secondary = CFArrayCreateMutable(alloc, count, &kCFTypeArrayCallBacks);
+	
+	if (result && preferred && secondary && count) {
+		
+		/*
+		** The resolver has already sorted by preference, so the family of
+		** the first address is the preferred family (RFC 8305, section 4).
+		*/
+		sa_family_t family = ((struct sockaddr*)CFDataGetBytePtr((CFDataRef)CFArrayGetValueAtIndex(addresses, 0)))->sa_family;
+		
+		/* Split the list by family, keeping the relative order of each. */
+		for (i = 0; i < count; i++) {
+			
+			CFDataRef address = (CFDataRef)CFArrayGetValueAtIndex(addresses, i);
+			
+			if (((struct sockaddr*)CFDataGetBytePtr(address))->sa_family == family)
+				CFArrayAppendValue(preferred, address);
+			else
+				CFArrayAppendValue(secondary, address);
+		}
+		
+		/* Alternate between the families, starting with the preferred one. */
+		while ((p < CFArrayGetCount(preferred)) || (s < CFArrayGetCount(secondary))) {
+			
+			if (p < CFArrayGetCount(preferred))
+				CFArrayAppendValue(result, CFArrayGetValueAtIndex(preferred, p++));
+			
+			if (s < CFArrayGetCount(secondary))
+				CFArrayAppendValue(result, CFArrayGetValueAtIndex(secondary, s++));
+		}
+	}
+	
+	else if (result && count) {
+		CFRelease(result);
+		result = NULL;
+	}
+	
+	if (preferred) CFRelease(preferred);
+	if (secondary) CFRelease(secondary);
+	
+	return result;
+}
+
 /**
  *  @brief
  *    Schedule and start a socket stream lookup operation.
@@ -2936,6 +3285,80 @@ _CFSocketSend(CFSocketRef s, const UInt8* buffer, CFIndex length, CFStreamError*
 }
 
 
+/* static */ CFIndex
+_CFSocketSendVector(CFSocketRef s, const struct iovec* vector, int count, int flags, CFStreamError* error) {
+	
+	CFIndex result = -1;
+	
+	/* Zero out the error (no error). */
+	memset(error, 0, sizeof(error[0]));
+	
+	/* If the socket is invalid, return an EINVAL error. */
+	if (!s || !CFSocketIsValid(s)) {
+		error->error = EINVAL;
+		error->domain = kCFStreamErrorDomainPOSIX;
+	}
+	
+	else {
+		/* Plain gathers use writev so that non-socket handles behave as they do with write. */
+		if (!flags)
+			result = writev(CFSocketGetNative(s), vector, count);
+		
+		else {
+			struct msghdr msg;
+			
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = (struct iovec*)vector;
+			msg.msg_iovlen = count;
+			
+			result = sendmsg(CFSocketGetNative(s), &msg, flags);
+		}
+		
+		/* If the send returned an error, get the error and make sure to return -1. */
+		if (result < 0) {
+			_LastError(error);
+			result = -1;
+		}
+	}
+	
+    return result;
+}
+
+
+/* static */ CFIndex
+_CFSocketSendFile(CFSocketRef s, int fd, off_t offset, CFIndex length, CFStreamError* error) {
+	
+	CFIndex result = -1;
+	
+	/* Zero out the error (no error). */
+	memset(error, 0, sizeof(error[0]));
+	
+	/* If the socket is invalid, return an EINVAL error. */
+	if (!s || !CFSocketIsValid(s)) {
+		error->error = EINVAL;
+		error->domain = kCFStreamErrorDomainPOSIX;
+	}
+	
+	else {
+#if CFSOCKETSTREAM_USE_SENDFILE
+		/* The kernel moves the file's pages to the socket without a trip through user space. */
+		result = sendfile(CFSocketGetNative(s), fd, &offset, length);
+		
+		/* If the send returned an error, get the error and make sure to return -1. */
+		if (result < 0) {
+			_LastError(error);
+			result = -1;
+		}
+#else
+		error->error = ENOTSUP;
+		error->domain = kCFStreamErrorDomainPOSIX;
+#endif /* CFSOCKETSTREAM_USE_SENDFILE */
+	}
+	
+    return result;
+}
+
+
 /* static */ Boolean
 _CFSocketCan(CFSocketRef s, int mode) {
     
@@ -3093,12 +3516,17 @@ _SocketStreamStartLookupForOpen_NoLock(_CFSocketStreamContext* ctxt) {
 		lookup_type = CFGetTypeID(lookup);
 		
 		/* Given the lookup, try to kick it off */
+		ctxt->_metrics.lookupStart = _CFNetworkGetMonotonicTime();
 		result = _ScheduleAndStartLookup(lookup,
 										 loops,
 										 &ctxt->_error,
 										 ((lookup_type == host_type) ? (const void*)_HostCallBack : (const void*)_NetServiceCallBack),
 										 ctxt);
 		
+		/* Nothing was started, so the lookup (e.g. cached addresses) is already over. */
+		if (!result)
+			ctxt->_metrics.lookupEnd = _CFNetworkGetMonotonicTime();
+		
 		/* Add it to the list of schedulables for future scheduling calls. */
 		if (result)
 			_SchedulablesAdd(ctxt->_schedulables, lookup);
@@ -3269,6 +3697,10 @@ _SocketStreamConnect_NoLock(_CFSocketStreamContext* ctxt, CFDataRef address) {
 	/* Now schedule the socket on all loops and modes */
 	for (i = 0; i < (sizeof(loops) / sizeof(loops[0])); i++)
 		_CFTypeScheduleOnMultipleRunLoops(ctxt->_socket, loops[i]);
+	
+	/* Only the first attempt starts the connect phase; later attempts are part of it. */
+	if (!ctxt->_metrics.connectStart)
+		ctxt->_metrics.connectStart = _CFNetworkGetMonotonicTime();
 		
 	/* Start the connect */
 	if ((result = (CFSocketConnectToAddress(ctxt->_socket, address, -1.0) == kCFSocketSuccess))) {
@@ -3360,6 +3792,21 @@ _SocketStreamAttemptNextConnection_NoLock(_CFSocketStreamContext* ctxt) {
 			else
 				list = CFNetServiceGetAddressing((CFNetServiceRef)lookup);
 			
+			/* With Happy Eyeballs, race the addresses rather than walking them one by one. */
+			if (list && !ctxt->_socket &&
+				(CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketHappyEyeballs) == kCFBooleanTrue))
+			{
+				Boolean racing = _SocketStreamRaceNextConnection_NoLock(ctxt, list, attempt, port);
+				
+				/* Not needed anymore. */
+				if (port) CFRelease(port);
+				
+				if (racing)
+					return TRUE;				/* NOTE the early return here. */
+				
+				break;
+			}
+			
 			/* If there were no addresses, return an error. */
 			if (!list || (*attempt >= (count = CFArrayGetCount(list)))) {
 			
@@ -3535,35 +3982,280 @@ _SocketStreamAttemptNextConnection_NoLock(_CFSocketStreamContext* ctxt) {
 
 
 /* static */ Boolean
-_SocketStreamCan(_CFSocketStreamContext* ctxt, CFTypeRef stream, int test, CFStringRef mode, CFStreamError* error) {
-	
-	Boolean result = TRUE;
-	Boolean isRead;
-	
-	/* No error to  start. */
-	memset(error, 0, sizeof(error[0]));
+_SocketStreamRaceNextConnection_NoLock(_CFSocketStreamContext* ctxt, CFArrayRef list, SInt32* attempt, CFNumberRef port) {
 	
-	/* Lock down the context */
-	__CFSpinLock(&ctxt->_lock);
-	
-	isRead = CFReadStreamGetTypeID() == CFGetTypeID(stream);
+	CFIndex count;
+	CFAllocatorRef alloc = CFGetAllocator(ctxt->_properties);
+	CFMutableArrayRef racers = (CFMutableArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketConnectAttempts);
+	CFArrayRef order = (CFArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketAddressOrder);
 	
-	result = __CFBitIsSet(ctxt->_flags, test);
+	/* First time through, create the list of sockets in flight. */
+	if (!racers) {
+		
+		racers = CFArrayCreateMutable(alloc, 0, &kCFTypeArrayCallBacks);
+		
+		/* If it fails, set out of memory and bail. */
+		if (!racers) {
+			ctxt->_error.error = ENOMEM;
+			ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+			return FALSE;
+		}
+		
+		CFDictionaryAddValue(ctxt->_properties, _kCFStreamPropertySocketConnectAttempts, racers);
+		CFRelease(racers);
+	}
 	
-	/* If not already been signalled, need to find out. */
-	if (!ctxt->_error.error && !result) {
+	/* Attempts go out alternating address families, so reorder the list once. */
+	if (!order) {
 		
-		CFMutableArrayRef loops = isRead ? ctxt->_readloops : ctxt->_writeloops;
+		order = _CFArrayCreateInterleavedAddresses(alloc, list);
 		
-		if (!__CFBitIsSet(ctxt->_flags, test + kFlagBitPollOpen) &&
-			((CFArrayGetCount(ctxt->_sharedloops) + CFArrayGetCount(loops)) > 2))
-		{
-			__CFBitSet(ctxt->_flags, test + kFlagBitPollOpen);
+		/* If it fails, set out of memory and bail. */
+		if (!order) {
+			ctxt->_error.error = ENOMEM;
+			ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+			return FALSE;
 		}
 		
-		else {
-
-			CFTypeRef loopAndMode[2] = {CFRunLoopGetCurrent(), mode};
+		CFDictionaryAddValue(ctxt->_properties, _kCFStreamPropertySocketAddressOrder, order);
+		CFRelease(order);
+	}
+	
+	count = CFArrayGetCount(order);
+	
+	/* Go through the list until an attempt gets started. */
+	while (*attempt < count) {
+		
+		/* Create the address for connecting. */
+		CFDataRef address = _CFDataCopyAddressByInjectingPort((CFDataRef)CFArrayGetValueAtIndex(order, *attempt), port);
+		
+		/* The next attempt will be the next address in the list. */
+		*attempt = *attempt + 1;
+		
+		if (!address)
+			continue;
+		
+		/* Try to create and start connecting to the address */
+		if (_SocketStreamCreateSocket_NoLock(ctxt, address))
+			_SocketStreamConnect_NoLock(ctxt, address);
+		
+		/* No longer need the address */
+		CFRelease(address);
+		
+		if (!ctxt->_error.error) {
+			
+			/* The socket isn't the stream's until it wins, so move it into the race. */
+			CFArrayAppendValue(racers, ctxt->_socket);
+			CFRelease(ctxt->_socket);
+			ctxt->_socket = NULL;
+			
+			/* Give this attempt a head start before the next one goes out. */
+			if (*attempt < count)
+				_SocketStreamStartConnectAttemptTimer_NoLock(ctxt);
+			
+			return TRUE;
+		}
+	}
+	
+	/* Nothing left to start, but that's fine as long as something is still in flight. */
+	if (CFArrayGetCount(racers)) {
+		memset(&ctxt->_error, 0, sizeof(ctxt->_error));
+		return TRUE;
+	}
+	
+	if (!ctxt->_error.error) {
+		ctxt->_error.error = EAI_NODATA;
+		ctxt->_error.domain = kCFStreamErrorDomainNetDB;
+	}
+	
+	return FALSE;
+}
+
+
+/* static */ Boolean
+_SocketStreamResolveConnectRace_NoLock(_CFSocketStreamContext* ctxt, CFSocketRef s, const void* error) {
+	
+	CFMutableArrayRef racers = (CFMutableArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketConnectAttempts);
+	CFIndex i = racers ? CFArrayGetFirstIndexOfValue(racers, CFRangeMake(0, CFArrayGetCount(racers)), s) : kCFNotFound;
+	
+	/* A socket which already lost the race; nothing to do. */
+	if (i == kCFNotFound)
+		return FALSE;
+	
+	/* Whatever the outcome, this attempt is out of the race. */
+	CFRetain(s);
+	CFArrayRemoveValueAtIndex(racers, i);
+	
+	/* Connected, so it's the winner.  Everyone else goes away. */
+	if (!error) {
+		
+		_SocketStreamCancelConnectRace_NoLock(ctxt);
+		
+		/* The stream takes over the retain. */
+		ctxt->_socket = s;
+		
+		return TRUE;
+	}
+	
+	/* Get rid of the failed attempt. */
+	_SocketStreamDisposeSocket_NoLock(ctxt, s);
+	CFRelease(s);
+	
+	/* Hold the error in case this turns out to have been the last attempt. */
+	ctxt->_error.error = *((SInt32 *)error);
+	ctxt->_error.domain = _kCFStreamErrorDomainNativeSockets;
+	
+	/* A failure lets the next attempt go right away instead of waiting on the timer. */
+	_SocketStreamCancelConnectAttemptTimer_NoLock(ctxt);
+	
+	if (_SocketStreamAttemptNextConnection_NoLock(ctxt)) {
+		
+		/* Start fresh with no error again. */
+		memset(&ctxt->_error, 0, sizeof(ctxt->_error));
+	}
+	
+	return FALSE;
+}
+
+
+/* static */ void
+_SocketStreamCancelConnectRace_NoLock(_CFSocketStreamContext* ctxt) {
+	
+	CFArrayRef racers = (CFArrayRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketConnectAttempts);
+	
+	/* No more attempts are going out. */
+	_SocketStreamCancelConnectAttemptTimer_NoLock(ctxt);
+	
+	/* Tear down the attempts still in flight. */
+	if (racers) {
+		
+		CFIndex i, count = CFArrayGetCount(racers);
+		
+		for (i = 0; i < count; i++)
+			_SocketStreamDisposeSocket_NoLock(ctxt, (CFSocketRef)CFArrayGetValueAtIndex(racers, i));
+		
+		CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySocketConnectAttempts);
+	}
+	
+	CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySocketAddressOrder);
+}
+
+
+/* static */ void
+_SocketStreamStartConnectAttemptTimer_NoLock(_CFSocketStreamContext* ctxt) {
+	
+	int i;
+	CFRunLoopTimerRef timer;
+	CFTimeInterval delay = kConnectionAttemptDelay;
+	CFRunLoopTimerContext c = {0, ctxt, NULL, NULL, NULL};
+	CFArrayRef loops[3] = {ctxt->_readloops, ctxt->_writeloops, ctxt->_sharedloops};
+	CFNumberRef value = (CFNumberRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketConnectionAttemptDelay);
+	
+	/* Allow the client to override the delay between attempts. */
+	if (value && (!CFNumberGetValue(value, kCFNumberDoubleType, &delay) || (delay < 0.0)))
+		delay = kConnectionAttemptDelay;
+	
+	/* Only one timer at a time. */
+	_SocketStreamCancelConnectAttemptTimer_NoLock(ctxt);
+	
+	timer = CFRunLoopTimerCreate(CFGetAllocator(ctxt->_properties),
+								 CFAbsoluteTimeGetCurrent() + delay,
+								 0.0,
+								 0,
+								 0,
+								 (CFRunLoopTimerCallBack)_ConnectAttemptTimerCallBack,
+								 &c);
+	
+	/* Without a timer, the next attempt waits for the current ones to fail. */
+	if (!timer)
+		return;
+	
+	CFDictionaryAddValue(ctxt->_properties, _kCFStreamPropertySocketConnectAttemptTimer, timer);
+	
+	/* Schedule the timer on all loops and modes */
+	for (i = 0; i < (sizeof(loops) / sizeof(loops[0])); i++)
+		_CFTypeScheduleOnMultipleRunLoops(timer, loops[i]);
+	
+	/* Make sure the timer follows any future schedules too. */
+	_SchedulablesAdd(ctxt->_schedulables, timer);
+	
+	CFRelease(timer);
+}
+
+
+/* static */ void
+_SocketStreamCancelConnectAttemptTimer_NoLock(_CFSocketStreamContext* ctxt) {
+	
+	int i;
+	CFArrayRef loops[3] = {ctxt->_readloops, ctxt->_writeloops, ctxt->_sharedloops};
+	CFRunLoopTimerRef timer = (CFRunLoopTimerRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketConnectAttemptTimer);
+	
+	if (timer) {
+		
+		/* Remove the timer from the schedulables. */
+		_SchedulablesRemove(ctxt->_schedulables, timer);
+		
+		/* Unschedule the timer from all loops and modes */
+		for (i = 0; i < (sizeof(loops) / sizeof(loops[0])); i++)
+			_CFTypeUnscheduleFromMultipleRunLoops(timer, loops[i]);
+		
+		/* Invalidate the timer; never to fire again. */
+		_CFTypeInvalidate(timer);
+		
+		/* Removing it from the properties releases it. */
+		CFDictionaryRemoveValue(ctxt->_properties, _kCFStreamPropertySocketConnectAttemptTimer);
+	}
+}
+
+
+/* static */ void
+_SocketStreamDisposeSocket_NoLock(_CFSocketStreamContext* ctxt, CFSocketRef s) {
+	
+	int i;
+	CFArrayRef loops[3] = {ctxt->_readloops, ctxt->_writeloops, ctxt->_sharedloops};
+	
+	/* Remove the socket from the schedulables. */
+	_SchedulablesRemove(ctxt->_schedulables, s);
+	
+	/* Unschedule the socket from all loops and modes */
+	for (i = 0; i < (sizeof(loops) / sizeof(loops[0])); i++)
+		_CFTypeUnscheduleFromMultipleRunLoops(s, loops[i]);
+	
+	/* Invalidate the socket; never to be used again. */
+	_CFTypeInvalidate(s);
+}
+
+
+/* static */ Boolean
+_SocketStreamCan(_CFSocketStreamContext* ctxt, CFTypeRef stream, int test, CFStringRef mode, CFStreamError* error) {
+	
+	Boolean result = TRUE;
+	Boolean isRead;
+	
+	/* No error to  start. */
+	memset(error, 0, sizeof(error[0]));
+	
+	/* Lock down the context */
+	__CFSpinLock(&ctxt->_lock);
+	
+	isRead = CFReadStreamGetTypeID() == CFGetTypeID(stream);
+	
+	result = __CFBitIsSet(ctxt->_flags, test);
+	
+	/* If not already been signalled, need to find out. */
+	if (!ctxt->_error.error && !result) {
+		
+		CFMutableArrayRef loops = isRead ? ctxt->_readloops : ctxt->_writeloops;
+		
+		if (!__CFBitIsSet(ctxt->_flags, test + kFlagBitPollOpen) &&
+			((CFArrayGetCount(ctxt->_sharedloops) + CFArrayGetCount(loops)) > 2))
+		{
+			__CFBitSet(ctxt->_flags, test + kFlagBitPollOpen);
+		}
+		
+		else {
+
+			CFTypeRef loopAndMode[2] = {CFRunLoopGetCurrent(), mode};
 
 			/* Add the current loop and the private mode to the list */
 			_SchedulesAddRunLoopAndMode(loops, (CFRunLoopRef)loopAndMode[0], (CFStringRef)loopAndMode[1]);
@@ -3625,9 +4317,6 @@ _SocketStreamCan(_CFSocketStreamContext* ctxt, CFTypeRef stream, int test, CFStr
 	/* If there was an error, make sure to signal it. */
 	if (ctxt->_error.error) {
 		
-		/* Attempt to get the count of buffered bytes. */
-		CFDataRef c = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
-		
 		/* Copy the error. */
 		memmove(error, &ctxt->_error, sizeof(error[0]));
 		
@@ -3645,7 +4334,7 @@ _SocketStreamCan(_CFSocketStreamContext* ctxt, CFTypeRef stream, int test, CFStr
 		** 3863115 If there is a client stream and it's been opened, signal the
 		** error, but only if there are no bytes in the buffer.
 		*/
-		if ((!c || !*((CFIndex*)CFDataGetBytePtr(c))) &&
+		if (!ctxt->_recvBuffer._count &&
 			(ctxt->_clientReadStream && __CFBitIsSet(ctxt->_flags, kFlagBitReadStreamOpened)))
 		{
 			_CFReadStreamSignalEventDelayed(ctxt->_clientReadStream, kCFStreamEventErrorOccurred, error);
@@ -3741,41 +4430,122 @@ _SocketStreamRemoveReachability_NoLock(_CFSocketStreamContext* ctxt) {
 }
 
 
+/* static */ Boolean
+_SocketStreamBufferResize(CFAllocatorRef alloc, _CFSocketStreamBuffer* buffer, CFIndex capacity) {
+	
+	UInt8* bytes = (UInt8*)CFAllocatorAllocate(alloc, capacity, 0);
+	
+	if (!bytes)
+		return FALSE;
+	
+	/* Carry the unread bytes over, unwrapping them to the front of the new storage. */
+	if (buffer->_count) {
+		
+		CFIndex first = buffer->_capacity - buffer->_head;
+		
+		if (first > buffer->_count)
+			first = buffer->_count;
+		
+		memmove(bytes, buffer->_bytes + buffer->_head, first);
+		memmove(bytes + first, buffer->_bytes, buffer->_count - first);
+	}
+	
+	if (buffer->_bytes)
+		CFAllocatorDeallocate(alloc, buffer->_bytes);
+	
+	buffer->_bytes = bytes;
+	buffer->_capacity = capacity;
+	buffer->_head = 0;
+	buffer->_peak = buffer->_count;
+	
+	return TRUE;
+}
+
+
+/* static */ Boolean
+_SocketStreamBufferReserve_NoLock(_CFSocketStreamContext* ctxt, UInt8** space, CFIndex* length) {
+	
+	_CFSocketStreamBuffer* buffer = &ctxt->_recvBuffer;
+	CFIndex limit = (buffer->_limit > 0) ? buffer->_limit : kRecvBufferSize;
+	CFIndex capacity = buffer->_capacity;
+	CFIndex tail;
+	
+	/*
+	** Start small and double whenever the buffer gets more than three
+	** quarters full, up to the configured size.  Once it drains, drop
+	** back down if it never got to a quarter full at the current size.
+	*/
+	if (!buffer->_bytes)
+		capacity = (limit < kRecvBufferMinimumSize) ? limit : kRecvBufferMinimumSize;
+	
+	else if ((capacity < limit) && ((capacity - buffer->_count) < (capacity / 4)))
+		capacity = ((capacity * 2) < limit) ? (capacity * 2) : limit;
+	
+	else if (!buffer->_count && (capacity > kRecvBufferMinimumSize) && (buffer->_peak < (capacity / 4)))
+		capacity = capacity / 2;
+	
+	if ((capacity != buffer->_capacity) &&
+		!_SocketStreamBufferResize(CFGetAllocator(ctxt->_properties), buffer, capacity) &&
+		!buffer->_bytes)
+	{
+		ctxt->_error.error = ENOMEM;
+		ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+		
+		return FALSE;
+	}
+	
+	/* With nothing buffered, rewind so the whole buffer is one contiguous run. */
+	if (!buffer->_count)
+		buffer->_head = 0;
+	
+	/* Hand back the contiguous free run following the unread bytes. */
+	tail = buffer->_head + buffer->_count;
+	
+	if (tail < buffer->_capacity) {
+		*space = buffer->_bytes + tail;
+		*length = buffer->_capacity - tail;
+	}
+	else {
+		*space = buffer->_bytes + (tail - buffer->_capacity);
+		*length = buffer->_capacity - buffer->_count;
+	}
+	
+	return TRUE;
+}
+
+
 /* static */ CFIndex
 _SocketStreamBufferedRead_NoLock(_CFSocketStreamContext* ctxt, UInt8* buffer, CFIndex length) {
 	
 	CFIndex result = 0;
+	_CFSocketStreamBuffer* b = &ctxt->_recvBuffer;
 	
-	/* Different bits required for "buffered reading." */
-	CFNumberRef s = (CFNumberRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferSize);
-	CFMutableDataRef b = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBuffer);
-	CFMutableDataRef c = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
-	
-	/* All have to be availbe to read. */
-	if (b && c && s) {
+	/* Only read if there are bytes waiting. */
+	if (b->_count) {
 		
-		CFIndex* i = (CFIndex*)CFDataGetMutableBytePtr(c);
-		UInt8* ptr = (UInt8*)CFDataGetMutableBytePtr(b);
-		CFIndex max;
-		
-		CFNumberGetValue(s, kCFNumberCFIndexType, &max);
+		CFIndex first = b->_capacity - b->_head;
 		
 		/* Either read all the bytes or just what the client asked. */
-		result = (*i < length) ? *i : length;
-		*i = *i - result;
+		result = (b->_count < length) ? b->_count : length;
+		
+		/* The bytes may wrap around the end of the ring. */
+		if (first > result)
+			first = result;
 		
 		/* Copy the bytes into the client buffer */
-		memmove(buffer, ptr, result);
+		memmove(buffer, b->_bytes + b->_head, first);
+		memmove(buffer + first, b->_bytes, result - first);
 		
-		/* Move down the bytes in the local buffer. */
-		memmove(ptr, ptr + result, *i);
+		/* Move past the bytes just consumed. */
+		b->_head += result;
+		if (b->_head >= b->_capacity)
+			b->_head -= b->_capacity;
 		
-		/* Zero the bytes at the end of the local buffer */
-		memset(ptr + *i, 0, max - *i);
+		b->_count -= result;
 
 #if defined(__MACH__)		
 		/* If the local buffer is empty, pump SSL along. */
-		if (__CFBitIsSet(ctxt->_flags, kFlagBitUseSSL) && (*i == 0)) {
+		if (__CFBitIsSet(ctxt->_flags, kFlagBitUseSSL) && (b->_count == 0)) {
 			_SocketStreamSecurityBufferedRead_NoLock(ctxt);
 		}
 #endif
@@ -3801,87 +4571,437 @@ _SocketStreamBufferedRead_NoLock(_CFSocketStreamContext* ctxt, UInt8* buffer, CF
 /* static */ void
 _SocketStreamBufferedSocketRead_NoLock(_CFSocketStreamContext* ctxt) {
 	
-	CFIndex* i;
-	CFIndex s = kRecvBufferSize;
+	UInt8* ptr;
+	CFIndex room;
+	_CFSocketStreamBuffer* b = &ctxt->_recvBuffer;
 	
-	/* Get the bits required in order to work with the buffer. */
-	CFNumberRef size = (CFNumberRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferSize);
-	CFMutableDataRef buffer = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBuffer);
-	CFMutableDataRef count = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
+	/* Make room for the read, growing the buffer if needed. */
+	if (!_SocketStreamBufferReserve_NoLock(ctxt, &ptr, &room))
+		return;									/* NOTE the early return. */
 	
-	/* No buffer assumes all are missing. */
-	if (!buffer) {
+	/* Only read if there is room in the buffer. */
+	if (room) {
 		
-		CFAllocatorRef alloc = CFGetAllocator(ctxt->_properties);
+		CFIndex bytesRead = _CFSocketRecv(ctxt->_socket, ptr, room, &ctxt->_error);
+
+		__CFBitClear(ctxt->_flags, kFlagBitRecvdRead);
+
+		/* If did read bytes, increase the count. */
+		if (bytesRead > 0) {
+			b->_count += bytesRead;
+			if (b->_count > b->_peak)
+				b->_peak = b->_count;
+			CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
+			__CFBitSet(ctxt->_flags, kFlagBitCanRead);
+			__CFBitClear(ctxt->_flags, kFlagBitPollRead);
+		}
 		
-		/* If no size, assume a default.  Can be overridden by properties. */
-		if (!size)
-			size = CFNumberCreate(alloc, kCFNumberCFIndexType, &s);
-		else
-			CFNumberGetValue(size, kCFNumberCFIndexType, &s);
+		else if (bytesRead == 0) {
+			__CFBitSet(ctxt->_flags, kFlagBitClosed);
+			__CFBitSet(ctxt->_flags, kFlagBitCanRead);
+			__CFBitClear(ctxt->_flags, kFlagBitPollRead);
+		}
+	}
+	else
+		__CFBitSet(ctxt->_flags, kFlagBitRecvdRead);
+}
 
-		/* Create the backing for the buffer and the counter. */
-		if (size) {
-			buffer = CFDataCreateMutable(alloc, s);
-			count = CFDataCreateMutable(alloc, sizeof(CFIndex));
+
+/* static */ CFIndex
+_SocketStreamSendVector_NoLock(_CFSocketStreamContext* ctxt, const struct iovec* vector, int count, CFArrayRef owners) {
+	
+#if CFSOCKETSTREAM_USE_ZEROCOPY
+	/*
+	** Owners are only given for writes of at least kZeroCopyMinimumSize whose bytes
+	** live in CFData's.  Those are the only buffers that can be left with the kernel
+	** after returning, since they can be retained until the completion arrives.
+	** Only sockets the stream closes itself qualify: a send still outstanding at
+	** close keeps the connection open until it completes (see the reaper below).
+	*/
+	if (owners && ctxt->_socket && CFSocketIsValid(ctxt->_socket) &&
+		(CFSocketGetSocketFlags(ctxt->_socket) & kCFSocketCloseOnInvalidate))
+	{
+		
+		/* Pick up completions for earlier sends before queuing another. */
+		_SocketStreamZeroCopyReap_NoLock(ctxt);
+		
+		/* Opt the socket in on first use; older kernels and some socket families refuse. */
+		if (!__CFBitIsSet(ctxt->_flags, kFlagBitZeroCopyTried)) {
+			
+			int yes = 1;
+			
+			__CFBitSet(ctxt->_flags, kFlagBitZeroCopyTried);
+			
+			if (!setsockopt(CFSocketGetNative(ctxt->_socket), SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(yes)))
+				__CFBitSet(ctxt->_flags, kFlagBitZeroCopyEnabled);
 		}
 		
-		/* If anything failed, set out of memory and bail. */
-		if (!buffer || !count || !size) {
+		if (__CFBitIsSet(ctxt->_flags, kFlagBitZeroCopyEnabled)) {
 			
-			if (buffer) CFRelease(buffer);
-			if (count) CFRelease(count);
-			if (size) CFRelease(size);
+			CFIndex result = _CFSocketSendVector(ctxt->_socket, vector, count, MSG_ZEROCOPY, &ctxt->_error);
 			
-			ctxt->_error.error = ENOMEM;
-			ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
+			/* The kernel reads the pages until it posts a completion, so hold the owners until then. */
+			if (result > 0) {
+				
+				if (!ctxt->_zeroCopy._pending)
+					ctxt->_zeroCopy._pending = CFArrayCreateMutable(CFGetAllocator(ctxt->_properties), 0, &kCFTypeArrayCallBacks);
+				
+				if (ctxt->_zeroCopy._pending)
+					CFArrayAppendValue(ctxt->_zeroCopy._pending, owners);
+				
+				return result;
+			}
+			
+			/* ENOBUFS means the socket is over its pinned page budget, so copy this one instead. */
+			if ((result == 0) || (ctxt->_error.error != ENOBUFS) || (ctxt->_error.domain != _kCFStreamErrorDomainNativeSockets))
+				return result;
+		}
+	}
+#endif /* CFSOCKETSTREAM_USE_ZEROCOPY */
+	
+	return _CFSocketSendVector(ctxt->_socket, vector, count, 0, &ctxt->_error);
+}
+
+
+/* static */ void
+_SocketStreamZeroCopyReap_NoLock(_CFSocketStreamContext* ctxt) {
+	
+#if CFSOCKETSTREAM_USE_ZEROCOPY
+	CFMutableArrayRef pending = ctxt->_zeroCopy._pending;
+	
+	if (!pending || !CFArrayGetCount(pending) || !ctxt->_socket || !CFSocketIsValid(ctxt->_socket))
+		return;									/* NOTE the early return. */
+	
+	_ZeroCopyReapSocket(CFSocketGetNative(ctxt->_socket), pending, &ctxt->_zeroCopy._first);
+#endif /* CFSOCKETSTREAM_USE_ZEROCOPY */
+}
+
+
+/* static */ void
+_SocketStreamZeroCopyFinish_NoLock(_CFSocketStreamContext* ctxt) {
+	
+	if (!ctxt->_zeroCopy._pending)
+		return;									/* NOTE the early return. */
+	
+#if CFSOCKETSTREAM_USE_ZEROCOPY
+	/*
+	** The kernel posts completions as the peer acknowledges the data, which for
+	** request/response traffic has normally happened long before close.  Those
+	** still outstanding can be neither released, since the kernel may still be
+	** reading their pages, nor waited for under the lock.  Hand them to the reaper
+	** along with the socket.  If that can't be done, wait a bounded time for them
+	** here instead.  Any still outstanding after that can never be learned of, so
+	** they are deliberately never released.
+	*/
+	_SocketStreamZeroCopyReap_NoLock(ctxt);
+	
+	if (CFArrayGetCount(ctxt->_zeroCopy._pending)) {
+		
+		if (ctxt->_socket && CFSocketIsValid(ctxt->_socket)) {
 			
-			return;								/* NOTE the eary return. */
+			int s = CFSocketGetNative(ctxt->_socket);
+			Boolean shutdownWrite = (CFSocketGetSocketFlags(ctxt->_socket) & kCFSocketCloseOnInvalidate) != 0;
+			
+			if (!_ZeroCopyReaperAdopt(s, shutdownWrite, ctxt->_zeroCopy._pending, ctxt->_zeroCopy._first))
+				_ZeroCopyDrainSocket(s, shutdownWrite, ctxt->_zeroCopy._pending, &ctxt->_zeroCopy._first);
 		}
 		
-		/* Save the buffer information. */
-		CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferSize, size);
-		CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertyRecvBuffer, buffer);
-		CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount, count);
+		if (CFArrayGetCount(ctxt->_zeroCopy._pending))
+			CFRetain(ctxt->_zeroCopy._pending);
+	}
+#endif /* CFSOCKETSTREAM_USE_ZEROCOPY */
+	
+	CFRelease(ctxt->_zeroCopy._pending);
+	ctxt->_zeroCopy._pending = NULL;
+	ctxt->_zeroCopy._first = 0;
+}
+
+
+#if CFSOCKETSTREAM_USE_ZEROCOPY
+
+/*
+** Sends still outstanding when their stream closes are left with a single reaper
+** thread.  It holds a duplicate of each socket, so that the error queue outlives
+** the stream's own descriptor, and lets go of each send's buffers once the kernel
+** posts its completion.  Completions arrive at the latest when the connection is
+** torn down and the kernel frees the data, so nothing is released early.
+*/
+static _CFOnceLock _ZeroCopyReaperOnce = _CFOnceInitializer;
+static _CFMutex _ZeroCopyReaperLock;
+static _ZeroCopyReaperEntry* _ZeroCopyReaperEntries = NULL;	/* Newly adopted; the reaper thread takes them over */
+static int _ZeroCopyReaperWakeup[2] = {-1, -1};
+static Boolean _ZeroCopyReaperValid = FALSE;
+
+
+/* static */ Boolean
+_ZeroCopyReapSocket(int s, CFMutableArrayRef pending, UInt32* first) {
+	
+	Boolean result = FALSE;
+	
+	/* Completions are queued on the socket's error queue; drain it. */
+	while (1) {
+		
+		union {
+			struct cmsghdr	align;
+			UInt8			bytes[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+		} control;
+		struct msghdr msg;
+		struct cmsghdr* cmsg;
 		
-		CFRelease(size);
-		CFRelease(buffer);
-		CFRelease(count);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = &control;
+		msg.msg_controllen = sizeof(control);
 		
-		/* Start with a zero byte count. */
-		*((CFIndex*)CFDataGetMutableBytePtr(count)) = 0;
+		if (recvmsg(s, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+		
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			
+			struct sock_extended_err* err;
+			CFIndex i, count = CFArrayGetCount(pending);
+			
+			if (!(((cmsg->cmsg_level == IPPROTO_IP) && (cmsg->cmsg_type == IP_RECVERR)) ||
+				  ((cmsg->cmsg_level == IPPROTO_IPV6) && (cmsg->cmsg_type == IPV6_RECVERR))))
+			{
+				continue;
+			}
+			
+			err = (struct sock_extended_err*)CMSG_DATA(cmsg);
+			if ((err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) || err->ee_errno)
+				continue;
+			
+			/*
+			** Each completion covers the inclusive range of sends [ee_info, ee_data].
+			** They usually arrive in order but need not (e.g. on retransmit), so mark
+			** the completed entries and only let go of a leading run of them below.
+			*/
+			for (i = 0; i < count; i++) {
+				
+				UInt32 seq = *first + (UInt32)i;
+				
+				if (((SInt32)(seq - err->ee_info) >= 0) && ((SInt32)(err->ee_data - seq) >= 0))
+					CFArraySetValueAtIndex(pending, i, kCFNull);
+			}
+		}
 	}
 	
-	/* Get the count and size of the buffer, respectively. */
-	i = (CFIndex*)CFDataGetMutableBytePtr(count);
-	CFNumberGetValue(size, kCFNumberCFIndexType, &s);
+	while (CFArrayGetCount(pending) && (CFArrayGetValueAtIndex(pending, 0) == kCFNull)) {
+		CFArrayRemoveValueAtIndex(pending, 0);
+		(*first)++;
+		result = TRUE;
+	}
 	
-	/* Only read if there is room in the buffer. */
-	if (*i < s) {
+	return result;
+}
+
+
+/* static */ Boolean
+_ZeroCopyReaperAdopt(int s, Boolean shutdownWrite, CFMutableArrayRef pending, UInt32 first) {
+	
+	_ZeroCopyReaperEntry* entry;
+	
+	_CFDoOnce(&_ZeroCopyReaperOnce, _ZeroCopyReaperInitialize);
+	
+	if (!_ZeroCopyReaperValid)
+		return FALSE;							/* NOTE the early return. */
+	
+	entry = (_ZeroCopyReaperEntry*)CFAllocatorAllocate(kCFAllocatorDefault, sizeof(entry[0]), 0);
+	if (!entry)
+		return FALSE;							/* NOTE the early return. */
+	
+	entry->_socket = fcntl(s, F_DUPFD_CLOEXEC, 0);
+	if (entry->_socket == -1) {
+		CFAllocatorDeallocate(kCFAllocatorDefault, entry);
+		return FALSE;							/* NOTE the early return. */
+	}
+	
+	/* The stream closing its descriptor no longer ends the connection, so finish sending as close would have. */
+	if (shutdownWrite)
+		shutdown(entry->_socket, SHUT_WR);
+	
+	entry->_pending = (CFMutableArrayRef)CFRetain(pending);
+	entry->_first = first;
+	entry->_stalled = FALSE;
+	
+	_CFMutexLock(&_ZeroCopyReaperLock);
+	entry->_next = _ZeroCopyReaperEntries;
+	_ZeroCopyReaperEntries = entry;
+	_CFMutexUnlock(&_ZeroCopyReaperLock);
+	
+	/* A full pipe already means a wake up is on its way. */
+	if ((write(_ZeroCopyReaperWakeup[1], "", 1) < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+		
+		_ZeroCopyReaperEntry** link;
+		Boolean withdrawn = FALSE;
 		
-		UInt8* ptr = (UInt8*)CFDataGetMutableBytePtr(buffer);		
-		CFIndex bytesRead = _CFSocketRecv(ctxt->_socket, ptr + *i, s - *i, &ctxt->_error);
+		/* Take the entry back, unless the reaper has already picked it up on its own. */
+		_CFMutexLock(&_ZeroCopyReaperLock);
+		for (link = &_ZeroCopyReaperEntries; *link; link = &(*link)->_next) {
+			if (*link == entry) {
+				*link = entry->_next;
+				withdrawn = TRUE;
+				break;
+			}
+		}
+		_CFMutexUnlock(&_ZeroCopyReaperLock);
+		
+		if (withdrawn) {
+			close(entry->_socket);
+			CFRelease(entry->_pending);
+			CFAllocatorDeallocate(kCFAllocatorDefault, entry);
+			return FALSE;						/* NOTE the early return. */
+		}
+	}
+	
+	return TRUE;
+}
 
-		__CFBitClear(ctxt->_flags, kFlagBitRecvdRead);
 
-		/* If did read bytes, increase the count. */
-		if (bytesRead > 0) {
-			*i = *i + bytesRead;
-			CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
-			__CFBitSet(ctxt->_flags, kFlagBitCanRead);
-			__CFBitClear(ctxt->_flags, kFlagBitPollRead);
+/* static */ void
+_ZeroCopyDrainSocket(int s, Boolean shutdownWrite, CFMutableArrayRef pending, UInt32* first) {
+	
+	int waited = 0;
+	
+	/* Closing would have finished sending; do so now so that the peer acknowledges everything. */
+	if (shutdownWrite)
+		shutdown(s, SHUT_WR);
+	
+	while (1) {
+		
+		_ZeroCopyReapSocket(s, pending, first);
+		
+		if (!CFArrayGetCount(pending) || (waited >= kZeroCopyDrainTimeout))
+			break;
+		
+		/* A socket which has hung up stays ready, so don't poll on it. */
+		usleep(kZeroCopyReaperInterval * 1000 / 10);
+		waited += kZeroCopyReaperInterval / 10;
+	}
+}
+
+
+/* static */ void
+_ZeroCopyReaperInitialize(void) {
+	
+	int i;
+	_CFThread thread;
+	
+	_CFMutexInit(&_ZeroCopyReaperLock, FALSE);
+	
+	if (pipe(_ZeroCopyReaperWakeup))
+		return;									/* NOTE the early return. */
+	
+	for (i = 0; i < 2; i++) {
+		fcntl(_ZeroCopyReaperWakeup[i], F_SETFL, fcntl(_ZeroCopyReaperWakeup[i], F_GETFL) | O_NONBLOCK);
+		fcntl(_ZeroCopyReaperWakeup[i], F_SETFD, FD_CLOEXEC);
+	}
+	
+	if (_CFThreadSpawn(&thread, _ZeroCopyReaperMain, NULL) == 0)
+		_ZeroCopyReaperValid = TRUE;
+	
+	else {
+		close(_ZeroCopyReaperWakeup[0]);
+		close(_ZeroCopyReaperWakeup[1]);
+	}
+}
+
+
+/* static */ void*
+_ZeroCopyReaperMain(void* info) {
+	
+	_ZeroCopyReaperEntry* entries = NULL;
+	struct pollfd* fds = NULL;
+	CFIndex capacity = 0;
+	
+	while (1) {
+		
+		_ZeroCopyReaperEntry* entry;
+		_ZeroCopyReaperEntry** link;
+		_ZeroCopyReaperEntry* finished = NULL;
+		CFIndex count = 0;
+		UInt8 drain[64];
+		
+		/* Take over whatever has been adopted since last time. */
+		_CFMutexLock(&_ZeroCopyReaperLock);
+		for (link = &_ZeroCopyReaperEntries; *link; link = &(*link)->_next)
+			;
+		*link = entries;
+		entries = _ZeroCopyReaperEntries;
+		_ZeroCopyReaperEntries = NULL;
+		_CFMutexUnlock(&_ZeroCopyReaperLock);
+		
+		for (entry = entries; entry; entry = entry->_next)
+			count++;
+		
+		if (capacity < (count + 1)) {
+			
+			struct pollfd* grown = (struct pollfd*)CFAllocatorReallocate(kCFAllocatorDefault, fds, (count + 1) * sizeof(fds[0]), 0);
+			
+			if (grown) {
+				fds = grown;
+				capacity = count + 1;
+			}
+		}
+		
+		count = 0;
+		if (fds) {
+			
+			fds[count].fd = _ZeroCopyReaperWakeup[0];
+			fds[count].events = POLLIN;
+			count++;
+			
+			/*
+			** POLLERR is always reported, so no events need to be requested.  A socket
+			** which has hung up stays ready, so once one stops making progress it's only
+			** retried on the interval rather than spun on.
+			*/
+			for (entry = entries; entry && (count < capacity); entry = entry->_next) {
+				if (!entry->_stalled) {
+					fds[count].fd = entry->_socket;
+					fds[count].events = 0;
+					count++;
+				}
+			}
+		}
+		
+		if (count)
+			poll(fds, count, kZeroCopyReaperInterval);
+		else
+			usleep(kZeroCopyReaperInterval * 1000);
+		
+		while (read(_ZeroCopyReaperWakeup[0], drain, sizeof(drain)) > 0)
+			;
+		
+		/* Completions are cheap to look for, so check every socket rather than just the ready ones. */
+		for (link = &entries; (entry = *link); ) {
+			
+			Boolean progress = _ZeroCopyReapSocket(entry->_socket, entry->_pending, &entry->_first);
+			
+			if (CFArrayGetCount(entry->_pending)) {
+				entry->_stalled = !progress;
+				link = &entry->_next;
+			}
+			
+			else {
+				*link = entry->_next;
+				entry->_next = finished;
+				finished = entry;
+			}
 		}
 		
-		else if (bytesRead == 0) {
-			__CFBitSet(ctxt->_flags, kFlagBitClosed);
-			__CFBitSet(ctxt->_flags, kFlagBitCanRead);
-			__CFBitClear(ctxt->_flags, kFlagBitPollRead);
+		while ((entry = finished)) {
+			finished = entry->_next;
+			close(entry->_socket);
+			CFRelease(entry->_pending);
+			CFAllocatorDeallocate(kCFAllocatorDefault, entry);
 		}
 	}
-	else
-		__CFBitSet(ctxt->_flags, kFlagBitRecvdRead);
+	
+	return NULL;
 }
 
+#endif /* CFSOCKETSTREAM_USE_ZEROCOPY */
+
 
 /* static */ CFComparisonResult
 _OrderHandshakes(_CFSocketStreamPerformHandshakeCallBack fn1, _CFSocketStreamPerformHandshakeCallBack fn2, void* context) {
@@ -4031,8 +5151,7 @@ _SocketStreamRemoveHandshake_NoLock(_CFSocketStreamContext* ctxt, _CFSocketStrea
 			CFStreamError error = ctxt->_error;
 			
 			/* Similar to the end of _SocketStreamRead. */
-			CFDataRef c = (CFDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
-			Boolean buffered = (c && *((CFIndex*)CFDataGetBytePtr(c)));
+			Boolean buffered = (ctxt->_recvBuffer._count != 0);
 			
 			if (buffered)
 				memset(&error, 0, sizeof(error));
@@ -5989,86 +7108,45 @@ _SocketStreamSecurityBufferedRead_NoLock(_CFSocketStreamContext* ctxt) {
 	** into the unencrypted buffer.
 	*/
 	
-	CFIndex* i;
-	CFIndex s = kRecvBufferSize;
+	UInt8* ptr;
+	CFIndex room;
 	OSStatus status = noErr;
+	_CFSocketStreamBuffer* b = &ctxt->_recvBuffer;
 	
 	SSLContextRef ssl = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties,
 																						   kCFStreamPropertySocketSSLContext)));
 	
-	/* Get the bits required in order to work with the buffer. */
-	CFNumberRef size = (CFNumberRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferSize);
-	CFMutableDataRef buffer = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBuffer);
-	CFMutableDataRef count = (CFMutableDataRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount);
-	
-	/* No buffer assumes all are missing. */
-	if (!buffer) {
-		
-		CFAllocatorRef alloc = CFGetAllocator(ctxt->_properties);
-		
-		/* If no size, assume a default.  Can be overridden by properties. */
-		if (!size)
-			size = CFNumberCreate(alloc, kCFNumberCFIndexType, &s);
-		else
-			CFNumberGetValue(size, kCFNumberCFIndexType, &s);
-
-		/* Create the backing for the buffer and the counter. */
-		if (size) {
-			buffer = CFDataCreateMutable(alloc, s);
-			count = CFDataCreateMutable(alloc, sizeof(CFIndex));
-		}
-		
-		/* If anything failed, set out of memory and bail. */
-		if (!buffer || !count || !size) {
-			
-			if (buffer) CFRelease(buffer);
-			if (count) CFRelease(count);
-			if (size) CFRelease(size);
-			
-			ctxt->_error.error = ENOMEM;
-			ctxt->_error.domain = kCFStreamErrorDomainPOSIX;
-			
-			return;								/* NOTE the eary return. */
-		}
-		
-		/* Save the buffer information. */
-		CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferSize, size);
-		CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertyRecvBuffer, buffer);
-		CFDictionarySetValue(ctxt->_properties, _kCFStreamPropertyRecvBufferCount, count);
-		
-		CFRelease(size);
-		CFRelease(buffer);
-		CFRelease(count);
-		
-		/* Start with a zero byte count. */
-		*((CFIndex*)CFDataGetMutableBytePtr(count)) = 0;
-	}
-	
-	/* Get the count and size of the buffer, respectively. */
-	i = (CFIndex*)CFDataGetMutableBytePtr(count);
-	CFNumberGetValue(size, kCFNumberCFIndexType, &s);
+	/* Make room for the read, growing the buffer if needed. */
+	if (!_SocketStreamBufferReserve_NoLock(ctxt, &ptr, &room))
+		return;									/* NOTE the early return. */
 	
 	/* Only read if there is room in the buffer. */
-	if (*i < s) {
+	if (room) {
 		
-		CFIndex start = *i;
-		UInt8* ptr = (UInt8*)CFDataGetMutableBytePtr(buffer);
+		CFIndex start = b->_count;
 		
 		/* Keep reading out of the encrypted buffer until an error or full. */
-		while (!status && (*i < s)) {
+		while (!status && room) {
 			
 			CFIndex bytesRead = 0;
 			
 			/* Read out of the encrypted and into the unencrypted. */
-			status = SSLRead(ssl, ptr + *i, s - *i, (size_t*)(&bytesRead));
+			status = SSLRead(ssl, ptr, room, (size_t*)(&bytesRead));
 		
 			/* If did read bytes, increase the count. */
-			if (bytesRead > 0)
-				*i = *i + bytesRead;
+			if (bytesRead > 0) {
+				b->_count += bytesRead;
+				if (b->_count > b->_peak)
+					b->_peak = b->_count;
+			}
+			
+			/* The free space may wrap, so go get the next run of it. */
+			if (!status && !_SocketStreamBufferReserve_NoLock(ctxt, &ptr, &room))
+				break;
 		}
 		
 		/* If didn't read bytes and the buffer is empty but SSL hasn't closed, need read events again. */
-		if ((*i == start) && (*i == 0) && !__CFBitIsSet(ctxt->_flags, kFlagBitClosed))
+		if ((b->_count == start) && (b->_count == 0) && !__CFBitIsSet(ctxt->_flags, kFlagBitClosed))
 			CFSocketEnableCallBacks(ctxt->_socket, kCFSocketReadCallBack);
 	}
 	
@@ -6087,7 +7165,7 @@ _SocketStreamSecurityBufferedRead_NoLock(_CFSocketStreamContext* ctxt) {
 		case errSSLWouldBlock:
 			
 			/* If there are bytes in the buffer to be read, set the bit. */
-			if (*i) {
+			if (b->_count) {
 				__CFBitSet(ctxt->_flags, kFlagBitCanRead);
 				__CFBitClear(ctxt->_flags, kFlagBitPollRead);
 			}
@@ -6113,64 +7191,57 @@ _PerformSecurityHandshake_NoLock(_CFSocketStreamContext* ctxt) {
 	SSLContextRef ssl = *((SSLContextRef*)CFDataGetBytePtr((CFDataRef)CFDictionaryGetValue(ctxt->_properties,
 																						   kCFStreamPropertySocketSSLContext)));
 	
+	/* The handshake is re-entered on each socket event; only the first marks the start. */
+	if (!ctxt->_metrics.secureStart)
+		ctxt->_metrics.secureStart = _CFNetworkGetMonotonicTime();
+	
 	/* Make sure the peer id has been set for ST performance. */
 	result = SSLGetPeerID(ssl, &peerid, &peeridlen);
 	if (!result && !peerid) {
 		
 		Boolean set = FALSE;
 		
-		/* Check to see if going through a proxy.  A different ID is used in that case. */
-		CFTypeRef value = (CFTypeRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertyCONNECTProxy);
-		if (!value)
-			value = (CFTypeRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySOCKSProxy);
+		/*
+		** Use the session cache's ID for the far end's host, port and SNI name, so
+		** that a session it established before may be resumed.
+		*/
+		CFStringRef key = _SocketStreamSecurityCopySessionKey_NoLock(ctxt, ssl);
 		
-		/* Use the name and port of the far end host. */
-		if (value) {
-			CFStringRef host = NULL;
-			CFNumberRef port = NULL;
-			CFStreamError error;
+		if (key) {
 			
-			/* Re-use some code to get the host and port of the far end. */
-			_CreateNameAndPortForCONNECTProxy(ctxt->_properties, &host, &port, &error);
+			UInt32 generation = _SSLSessionCacheCheckOut(key);
+			CFAllocatorRef alloc = CFGetAllocator(ctxt->_properties);
+			CFStringRef peer = CFStringCreateWithFormat(alloc, NULL, CFSTR("%@#%lu"), key, (unsigned long)generation);
 			
-			/* Only do it if got the host and port, otherwise it'll fall through to the address. */
-			if (host && port) {
+			if (peer) {
 				
-				SInt32 p;
-				CFStringRef peer;
-				CFAllocatorRef alloc = CFGetAllocator(ctxt->_properties);
+				UInt8 static_buffer[1024];
+				UInt8* buffer = &static_buffer[0];
+				CFIndex buffer_size = sizeof(static_buffer);
 				
-				/* Get the real port value. */
-				CFNumberGetValue(port, kCFNumberSInt32Type, &p);
+				/* Get the raw bytes to use as the ID. */
+				buffer = _CFStringGetOrCreateCString(alloc, peer, static_buffer, &buffer_size, kCFStringEncodingUTF8);
 				
-				/* Produce the ID as <host>:<port>. */
-				peer = CFStringCreateWithFormat(alloc, NULL, _kCFStreamCONNECTURLFormat, host, p & 0x0000FFFF);
+				CFRelease(peer);
 				
-				if (peer) {
-					
-					UInt8 static_buffer[1024];
-					UInt8* buffer = &static_buffer[0];
-					CFIndex buffer_size = sizeof(static_buffer);
+				/* Set the peer ID and remember the entry for when the handshake is done. */
+				if (!SSLSetPeerID(ssl, buffer, buffer_size)) {
 					
-					/* Get the raw bytes to use as the ID. */
-					buffer = _CFStringGetOrCreateCString(alloc, peer, static_buffer, &buffer_size, kCFStringEncodingUTF8);
+					if (ctxt->_session._key)
+						CFRelease(ctxt->_session._key);
 					
-					CFRelease(peer);
+					ctxt->_session._key = CFRetain(key);
+					ctxt->_session._generation = generation;
 					
-					/* Set the peer ID. */
-					SSLSetPeerID(ssl, buffer, buffer_size);
-					
-					/* Did it. */
 					set = TRUE;
-					
-					/* Clean up the allocation if made. */
-					if (buffer != &static_buffer[0])
-						CFAllocatorDeallocate(alloc, buffer);
 				}
+				
+				/* Clean up the allocation if made. */
+				if (buffer != &static_buffer[0])
+					CFAllocatorDeallocate(alloc, buffer);
 			}
 			
-			if (host) CFRelease(host);
-			if (port) CFRelease(port);
+			CFRelease(key);
 		}
 		
 		if (!set) {
@@ -6208,6 +7279,33 @@ _PerformSecurityHandshake_NoLock(_CFSocketStreamContext* ctxt) {
 		}
 		else {
 			CFBooleanRef check;
+			Boolean resumed = FALSE;
+			UInt8 sessionID[32];
+			size_t sessionIDLength = sizeof(sessionID);
+			
+			/* Count the handshake against the session cache; a full one starts the session's lifetime. */
+			if (SSLGetResumableSessionInfo(ssl, &resumed, sessionID, &sessionIDLength))
+				resumed = FALSE;
+			
+			ctxt->_session._resumed = resumed;
+			
+#if defined(MAC_OS_X_VERSION_10_13)
+			/* Remember the application protocol the server chose, if it chose one. */
+			{
+				CFArrayRef protocols = NULL;
+				
+				if (!SSLCopyALPNProtocols(ssl, &protocols) && protocols) {
+					
+					if (CFArrayGetCount(protocols))
+						ctxt->_session._protocol = CFRetain(CFArrayGetValueAtIndex(protocols, 0));
+					
+					CFRelease(protocols);
+				}
+			}
+#endif /* defined(MAC_OS_X_VERSION_10_13) */
+			
+			if (ctxt->_session._key)
+				_SSLSessionCacheCheckIn(ctxt->_session._key, ctxt->_session._generation, resumed);
 			
 			check = (CFBooleanRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySSLAllowAnonymousCiphers);
 			if ( !check || (CFBooleanGetValue(check) == FALSE) ) {
@@ -6231,6 +7329,8 @@ _PerformSecurityHandshake_NoLock(_CFSocketStreamContext* ctxt) {
 			}
 		}
 		
+		ctxt->_metrics.secureEnd = _CFNetworkGetMonotonicTime();
+		
 		/* Either way, it's done.  Mark the SSL bit for performance checks. */
 		__CFBitSet(ctxt->_flags, kFlagBitUseSSL);
 		__CFBitSet(ctxt->_flags, kFlagBitIsBuffered);
@@ -6396,6 +7496,16 @@ _SocketStreamSecuritySetInfo_NoLock(_CFSocketStreamContext* ctxt, CFDictionaryRe
         if (SSLNewContext((value && CFEqual(value, kCFBooleanTrue)), &security))
             break;
 		
+#if defined(MAC_OS_X_VERSION_10_13)
+		/* Let sessions be resumed from tickets as well as by ID; both follow the peer ID. */
+		SSLSetSessionTicketsEnabled(security, TRUE);
+		
+		/* Offer the application protocols, most preferred first, by ALPN. */
+		value = CFDictionaryGetValue(settings, _kCFStreamSSLApplicationProtocols);
+		if (value && SSLSetALPNProtocols(security, (CFArrayRef)value))
+			break;
+#endif /* defined(MAC_OS_X_VERSION_10_13) */
+		
 		/* Figure out the correct security level to set and set it. */
         value = CFDictionaryGetValue(settings, kCFStreamSSLLevel);
         if ((!value || CFEqual(value, kCFStreamSocketSecurityLevelNegotiatedSSL)) && SSLSetProtocolVersion(security, kTLSProtocol1))
@@ -6666,6 +7776,264 @@ _SocketStreamSecurityGetSessionState_NoLock(_CFSocketStreamContext* ctxt) {
 	SSLSessionState state;
 	return !SSLGetSessionState(ssl, &state) ? state : kSSLAborted;
 }
+
+
+/* static */ CFStringRef
+_SocketStreamSecurityCopySessionKey_NoLock(_CFSocketStreamContext* ctxt, SSLContextRef ssl) {
+	
+	CFStringRef result = NULL;
+	CFStringRef host = NULL;
+	CFNumberRef port = NULL;
+	CFAllocatorRef alloc = CFGetAllocator(ctxt->_properties);
+	
+	/* Through a proxy, the far end is the CONNECT target rather than the proxy. */
+	if (CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertyCONNECTProxy) ||
+		CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySOCKSProxy))
+	{
+		CFStreamError error;
+		_CreateNameAndPortForCONNECTProxy(ctxt->_properties, &host, &port, &error);
+	}
+	
+	else {
+		
+		CFHostRef lookup = (CFHostRef)CFDictionaryGetValue(ctxt->_properties, kCFStreamPropertySocketRemoteHost);
+		CFArrayRef names = lookup ? CFHostGetNames(lookup, NULL) : NULL;
+		
+		if (names && CFArrayGetCount(names))
+			host = CFRetain(CFArrayGetValueAtIndex(names, 0));
+		
+		port = (CFNumberRef)CFDictionaryGetValue(ctxt->_properties, _kCFStreamPropertySocketRemotePort);
+		if (port)
+			CFRetain(port);
+	}
+	
+	if (host && port) {
+		
+		SInt32 p;
+		char name[1024];
+		size_t length = 0;
+		CFMutableStringRef lower = CFStringCreateMutableCopy(alloc, 0, host);
+		
+		CFNumberGetValue(port, kCFNumberSInt32Type, &p);
+		
+		/* The SNI name, if any, was set on the context from the SSL settings. */
+		if (SSLGetPeerDomainNameLength(ssl, &length) || (length >= sizeof(name)) || SSLGetPeerDomainName(ssl, name, &length))
+			length = 0;
+		
+		name[length] = '\0';
+		
+		/* Host names are case-insensitive. */
+		if (lower) {
+			CFStringLowercase(lower, NULL);
+			result = CFStringCreateWithFormat(alloc, NULL, CFSTR("%@:%d/%s"), lower, (int)(p & 0x0000FFFF), name);
+			CFRelease(lower);
+		}
+	}
+	
+	if (host) CFRelease(host);
+	if (port) CFRelease(port);
+	
+	return result;
+}
+#endif /* defined(__MACH__) */
+
+
+#if 0
+#pragma mark *SSL Session Cache
+#endif
+
+#if defined(__MACH__)
+/*
+** SecureTransport resumes a session, whether by ID or by ticket, only for a
+** connection given the same peer ID as the one which established it.  Peer
+** IDs are handed out from here, keyed by the far end's host, port and SNI
+** name, so that connections to a host share its session whichever of its
+** addresses they reach.  Each peer ID carries a generation, and a new one is
+** handed out once the session lapses or its entry is evicted, so that a
+** stale session is never resumed.
+*/
+static CFSpinLock_t _SSLSessionCacheLock = CFSpinLockInit;
+static CFMutableDictionaryRef _SSLSessionCache = NULL;		/* Key to _SSLSessionCacheEntry* */
+static _SSLSessionCacheEntry* _SSLSessionCacheHead = NULL;	/* Most recently used */
+static _SSLSessionCacheEntry* _SSLSessionCacheTail = NULL;	/* Least recently used */
+static CFIndex _SSLSessionCacheCapacity = kSSLSessionCacheDefaultCapacity;
+static CFTimeInterval _SSLSessionCacheLifetime = kSSLSessionCacheDefaultLifetime;
+static UInt32 _SSLSessionCacheGeneration = 0;
+static CFIndex _SSLSessionCacheHits = 0;
+static CFIndex _SSLSessionCacheMisses = 0;
+static CFIndex _SSLSessionCacheEvictions = 0;
+static CFIndex _SSLSessionCacheExpirations = 0;
+
+
+/* static */ void
+_SSLSessionCacheRemove(_SSLSessionCacheEntry* entry) {
+	
+	/* NOTE that this is called with _SSLSessionCacheLock held. */
+	
+	if (entry->_prev)
+		entry->_prev->_next = entry->_next;
+	else
+		_SSLSessionCacheHead = entry->_next;
+	
+	if (entry->_next)
+		entry->_next->_prev = entry->_prev;
+	else
+		_SSLSessionCacheTail = entry->_prev;
+	
+	CFDictionaryRemoveValue(_SSLSessionCache, entry->_key);
+	CFRelease(entry->_key);
+	CFAllocatorDeallocate(kCFAllocatorDefault, entry);
+}
+
+
+/* static */ UInt32
+_SSLSessionCacheCheckOut(CFStringRef key) {
+	
+	UInt32 result;
+	_SSLSessionCacheEntry* entry = NULL;
+	
+	__CFSpinLock(&_SSLSessionCacheLock);
+	
+	/* With caching off, every handshake gets a peer ID of its own. */
+	if (_SSLSessionCacheCapacity <= 0) {
+		result = ++_SSLSessionCacheGeneration;
+		__CFSpinUnlock(&_SSLSessionCacheLock);
+		return result;
+	}
+	
+	if (!_SSLSessionCache)
+		_SSLSessionCache = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+	
+	if (_SSLSessionCache)
+		entry = (_SSLSessionCacheEntry*)CFDictionaryGetValue(_SSLSessionCache, key);
+	
+	if (entry) {
+		
+		/* A lapsed session must not be resumed, so move the key on to a new one. */
+		if (entry->_expires && (entry->_expires <= CFAbsoluteTimeGetCurrent())) {
+			entry->_generation = ++_SSLSessionCacheGeneration;
+			entry->_expires = 0;
+			_SSLSessionCacheExpirations++;
+		}
+		
+		/* Move it to the front as the most recently used. */
+		if (entry->_prev) {
+			
+			entry->_prev->_next = entry->_next;
+			
+			if (entry->_next)
+				entry->_next->_prev = entry->_prev;
+			else
+				_SSLSessionCacheTail = entry->_prev;
+			
+			entry->_prev = NULL;
+			entry->_next = _SSLSessionCacheHead;
+			_SSLSessionCacheHead->_prev = entry;
+			_SSLSessionCacheHead = entry;
+		}
+	}
+	
+	else if (_SSLSessionCache) {
+		
+		entry = (_SSLSessionCacheEntry*)CFAllocatorAllocate(kCFAllocatorDefault, sizeof(entry[0]), 0);
+		
+		if (entry) {
+			
+			entry->_key = CFStringCreateCopy(kCFAllocatorDefault, key);
+			entry->_generation = ++_SSLSessionCacheGeneration;
+			entry->_expires = 0;
+			
+			entry->_prev = NULL;
+			entry->_next = _SSLSessionCacheHead;
+			
+			if (_SSLSessionCacheHead)
+				_SSLSessionCacheHead->_prev = entry;
+			else
+				_SSLSessionCacheTail = entry;
+			
+			_SSLSessionCacheHead = entry;
+			
+			CFDictionarySetValue(_SSLSessionCache, entry->_key, entry);
+			
+			/* Make room by dropping the least recently used. */
+			while (CFDictionaryGetCount(_SSLSessionCache) > _SSLSessionCacheCapacity) {
+				_SSLSessionCacheRemove(_SSLSessionCacheTail);
+				_SSLSessionCacheEvictions++;
+			}
+		}
+	}
+	
+	result = entry ? entry->_generation : ++_SSLSessionCacheGeneration;
+	
+	__CFSpinUnlock(&_SSLSessionCacheLock);
+	
+	return result;
+}
+
+
+/* static */ void
+_SSLSessionCacheCheckIn(CFStringRef key, UInt32 generation, Boolean resumed) {
+	
+	__CFSpinLock(&_SSLSessionCacheLock);
+	
+	if (resumed)
+		_SSLSessionCacheHits++;
+	
+	else {
+		
+		_SSLSessionCacheEntry* entry = _SSLSessionCache ? (_SSLSessionCacheEntry*)CFDictionaryGetValue(_SSLSessionCache, key) : NULL;
+		
+		_SSLSessionCacheMisses++;
+		
+		/*
+		** A full handshake established a new session, which lasts from now.  The
+		** entry may since have moved on to a new generation, in which case this
+		** session belongs to no one.
+		*/
+		if (entry && (entry->_generation == generation))
+			entry->_expires = CFAbsoluteTimeGetCurrent() + _SSLSessionCacheLifetime;
+	}
+	
+	__CFSpinUnlock(&_SSLSessionCacheLock);
+}
+
+
+/* static */ CFDictionaryRef
+_SSLSessionCacheCopyStatistics(CFAllocatorRef alloc) {
+	
+	CFStringRef keys[] = {
+		_kCFStreamSSLSessionCacheHits,
+		_kCFStreamSSLSessionCacheMisses,
+		_kCFStreamSSLSessionCacheEvictions,
+		_kCFStreamSSLSessionCacheExpirations,
+		_kCFStreamSSLSessionCacheCount
+	};
+	CFIndex counts[sizeof(keys) / sizeof(keys[0])];
+	CFNumberRef values[sizeof(keys) / sizeof(keys[0])];
+	CFDictionaryRef result = NULL;
+	int i;
+	
+	__CFSpinLock(&_SSLSessionCacheLock);
+	
+	counts[0] = _SSLSessionCacheHits;
+	counts[1] = _SSLSessionCacheMisses;
+	counts[2] = _SSLSessionCacheEvictions;
+	counts[3] = _SSLSessionCacheExpirations;
+	counts[4] = _SSLSessionCache ? CFDictionaryGetCount(_SSLSessionCache) : 0;
+	
+	__CFSpinUnlock(&_SSLSessionCacheLock);
+	
+	for (i = 0; i < (sizeof(keys) / sizeof(keys[0])); i++)
+		values[i] = CFNumberCreate(alloc, kCFNumberCFIndexType, &counts[i]);
+	
+	result = CFDictionaryCreate(alloc, (const void**)keys, (const void**)values, sizeof(keys) / sizeof(keys[0]),
+								&kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	
+	for (i = 0; i < (sizeof(values) / sizeof(values[0])); i++)
+		if (values[i]) CFRelease(values[i]);
+	
+	return result;
+}
 #endif /* defined(__MACH__) */
 
 
@@ -7022,3 +8390,172 @@ _CFSocketStreamCreatePair(CFAllocatorRef alloc, CFStringRef host, UInt32 port, C
 	}
 }
 
+
+
+/* extern */ CFIndex
+_CFWriteStreamWriteDataVector(CFWriteStreamRef stream, const CFDataRef* buffers, CFIndex count, CFIndex offset)
+{
+	CFIndex i, total = 0, result;
+	CFStreamStatus status;
+	CFStreamError error;
+	CFArrayRef owners = NULL;
+	struct iovec vector[kWriteVectorMaximumCount];
+	int used = 0;
+	
+	/* Filters forward property requests, so only a socket stream answers with itself. */
+	CFWriteStreamRef socket = (CFWriteStreamRef)CFWriteStreamCopyProperty(stream, _kCFStreamPropertySocketWriteStream);
+	
+	if (socket)
+		CFRelease(socket);
+	
+	/* Not a socket stream, so write the first unsent piece the ordinary way. */
+	if (socket != stream) {
+		
+		for (i = 0; i < count; i++) {
+			
+			CFIndex length = CFDataGetLength(buffers[i]);
+			
+			if (offset < length)
+				return CFWriteStreamWrite(stream, CFDataGetBytePtr(buffers[i]) + offset, length - offset);
+			
+			offset -= length;
+		}
+		
+		return 0;
+	}
+	
+	/* Going around CFWriteStreamWrite, so hold to its rules on stream state. */
+	status = CFWriteStreamGetStatus(stream);
+	if (status != kCFStreamStatusOpen)
+		return (status == kCFStreamStatusAtEnd) ? 0 : -1;
+	
+	/* Gather the unsent remainder, skipping what was already written. */
+	for (i = 0; (i < count) && (used < kWriteVectorMaximumCount); i++) {
+		
+		CFIndex length = CFDataGetLength(buffers[i]);
+		
+		if (offset >= length) {
+			offset -= length;
+			continue;
+		}
+		
+		vector[used].iov_base = (void*)(CFDataGetBytePtr(buffers[i]) + offset);
+		vector[used].iov_len = length - offset;
+		total += length - offset;
+		offset = 0;
+		used++;
+	}
+	
+	if (!used)
+		return 0;
+	
+#if CFSOCKETSTREAM_USE_ZEROCOPY
+	/* Large writes may be sent zero-copy, with the CFData's held until the kernel is done. */
+	if (total >= kZeroCopyMinimumSize)
+		owners = CFArrayCreate(CFGetAllocator(stream), (const void**)buffers, count, &kCFTypeArrayCallBacks);
+#endif /* CFSOCKETSTREAM_USE_ZEROCOPY */
+	
+	result = _SocketStreamWriteVector(stream, vector, used, owners, NULL,
+									  &error, (_CFSocketStreamContext*)CFWriteStreamGetInfoPointer(stream));
+	
+	if (owners)
+		CFRelease(owners);
+	
+	/* Report the outcome the way CFWriteStreamWrite would have. */
+	if (error.error)
+		CFWriteStreamSignalEvent(stream, kCFStreamEventErrorOccurred, &error);
+	else if (!result)
+		CFWriteStreamSignalEvent(stream, kCFStreamEventEndEncountered, NULL);
+	
+	return result;
+}
+
+
+/* extern */ CFIndex
+_CFWriteStreamWriteFile(CFWriteStreamRef stream, int fd, off_t offset, CFIndex length)
+{
+	CFIndex result;
+	UInt8 buffer[kWriteFileBufferSize];
+	
+	/* Filters forward property requests, so only a socket stream answers with itself. */
+	CFWriteStreamRef socket = (CFWriteStreamRef)CFWriteStreamCopyProperty(stream, _kCFStreamPropertySocketWriteStream);
+	
+	if (socket)
+		CFRelease(socket);
+	
+#if CFSOCKETSTREAM_USE_SENDFILE
+	/* Bytes headed for SSL have to pass through user space, so only plain sockets get sendfile. */
+	if ((socket == stream) && (length > 0)) {
+		
+		_CFSocketStreamContext* ctxt = (_CFSocketStreamContext*)CFWriteStreamGetInfoPointer(stream);
+		
+		if (!__CFBitIsSet(ctxt->_flags, kFlagBitUseSSL)) {
+			
+			CFStreamStatus status;
+			CFStreamError error;
+			_SocketStreamFileRange file = {fd, offset, length};
+			
+			/* Going around CFWriteStreamWrite, so hold to its rules on stream state. */
+			status = CFWriteStreamGetStatus(stream);
+			if (status != kCFStreamStatusOpen)
+				return (status == kCFStreamStatusAtEnd) ? 0 : -1;
+			
+			result = _SocketStreamWriteVector(stream, NULL, 0, NULL, &file, &error, ctxt);
+			
+			/* Report the outcome the way CFWriteStreamWrite would have. */
+			if (error.error)
+				CFWriteStreamSignalEvent(stream, kCFStreamEventErrorOccurred, &error);
+			else if (!result)
+				CFWriteStreamSignalEvent(stream, kCFStreamEventEndEncountered, NULL);
+			
+			return result;
+		}
+	}
+#endif /* CFSOCKETSTREAM_USE_SENDFILE */
+	
+	/* Otherwise copy a buffer's worth out of the file and write it the ordinary way. */
+	if (length > kWriteFileBufferSize)
+		length = kWriteFileBufferSize;
+	
+	do {
+		result = pread(fd, buffer, length, offset);
+	} while ((result < 0) && (errno == EINTR));
+	
+	if (result <= 0)
+		return result;
+	
+	return CFWriteStreamWrite(stream, buffer, result);
+}
+
+
+#if defined(__MACH__)
+/* extern */ void
+_CFSocketStreamSetSSLSessionCacheLimits(CFIndex capacity, CFTimeInterval lifetime) {
+	
+	__CFSpinLock(&_SSLSessionCacheLock);
+	
+	_SSLSessionCacheCapacity = (capacity > 0) ? capacity : 0;
+	_SSLSessionCacheLifetime = (lifetime > 0) ? lifetime : kSSLSessionCacheDefaultLifetime;
+	
+	/* Shrink right away if need be. */
+	while (_SSLSessionCacheTail && (CFDictionaryGetCount(_SSLSessionCache) > _SSLSessionCacheCapacity)) {
+		_SSLSessionCacheRemove(_SSLSessionCacheTail);
+		_SSLSessionCacheEvictions++;
+	}
+	
+	__CFSpinUnlock(&_SSLSessionCacheLock);
+}
+
+
+/* extern */ void
+_CFSocketStreamFlushSSLSessionCache(void) {
+	
+	__CFSpinLock(&_SSLSessionCacheLock);
+	
+	/* Forgetting the keys is enough; the next handshake to each gets a new generation. */
+	while (_SSLSessionCacheTail)
+		_SSLSessionCacheRemove(_SSLSessionCacheTail);
+	
+	__CFSpinUnlock(&_SSLSessionCacheLock);
+}
+#endif /* defined(__MACH__) */